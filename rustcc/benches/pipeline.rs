@@ -0,0 +1,177 @@
+// pipeline.rs
+// Benchmarks of each phase of the compiler on synthetic workloads
+//
+//   cargo bench                        every benchmark
+//   cargo bench -- lex                 benchmarks whose name contains "lex"
+//   cargo bench -- --emit 100 4 20     print the workload with 100 functions,
+//                                      nesting depth 4 and 20 macros
+//
+// Every benchmark runs at several sizes so the results show how each phase
+// scales; a phase that is linear in its input should take ten times as long
+// on the next size up. Each line of output is
+//
+//   <phase>/<dimension>=<size>  <time per iteration>  (<iterations>)
+
+mod workload;
+
+use rustcc::analyzer::annotate;
+use rustcc::codegen::x86_64::X86_64Generator;
+use rustcc::parser::ast::Program;
+use rustcc::parser::lexer::Lexer;
+use rustcc::parser::Parser;
+use rustcc::preprocessor::{output_string, NativePreprocessor, Preprocessor};
+use rustcc::transforms::obfuscation::{ControlFlowObfuscator, DeadCodeInserter, StringEncryptor, VariableObfuscator};
+use rustcc::transforms::{PassManager, Transform};
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+use workload::Workload;
+
+/// How long each benchmark is run for, after a warm-up of a tenth of that
+const TARGET: Duration = Duration::from_millis(500);
+
+/// Function counts the code-size benchmarks run at
+const FUNCTIONS: [usize; 3] = [10, 100, 1000];
+
+struct Bench {
+    filter: Option<String>,
+}
+
+impl Bench {
+    /// Times `routine` on a fresh input from `setup` each iteration; only
+    /// `routine` is timed
+    fn run<I, O>(&self, name: &str, mut setup: impl FnMut() -> I, mut routine: impl FnMut(I) -> O) {
+        if self.filter.as_ref().is_some_and(|filter| !name.contains(filter.as_str())) {
+            return;
+        }
+        let mut measure = |budget: Duration| {
+            let (mut iterations, mut elapsed) = (0u32, Duration::ZERO);
+            while elapsed < budget || iterations == 0 {
+                let input = setup();
+                let start = Instant::now();
+                let output = black_box(routine(black_box(input)));
+                elapsed += start.elapsed();
+                // Dropping the output isn't part of the routine
+                drop(output);
+                iterations += 1;
+            }
+            (iterations, elapsed)
+        };
+        measure(TARGET / 10);
+        let (iterations, elapsed) = measure(TARGET);
+        println!("{:<40} {:>12}  ({} iterations)", name, format_time(elapsed / iterations), iterations);
+    }
+}
+
+fn format_time(time: Duration) -> String {
+    let nanos = time.as_nanos();
+    match nanos {
+        0..=9_999 => format!("{} ns", nanos),
+        10_000..=9_999_999 => format!("{:.1} µs", nanos as f64 / 1e3),
+        _ => format!("{:.2} ms", nanos as f64 / 1e6),
+    }
+}
+
+fn preprocess(source: &str, include_dir: Option<&str>) -> String {
+    let mut preprocessor = NativePreprocessor::new();
+    if let Some(dir) = include_dir {
+        preprocessor.add_include_dir(dir);
+    }
+    let mut out = Vec::new();
+    preprocessor.preprocess_string_into(source, "bench.c", &mut out).unwrap();
+    output_string(out).unwrap()
+}
+
+fn parse(source: &str) -> Program {
+    Parser::new(Lexer::new(source).scan_tokens()).parse().unwrap()
+}
+
+fn main() {
+    let args: Vec<String> = std::env::args().skip(1).collect();
+    if let Some(index) = args.iter().position(|arg| arg == "--emit") {
+        let size = |n: usize| args.get(index + n).and_then(|arg| arg.parse().ok());
+        let (Some(functions), Some(depth), Some(macros)) = (size(1), size(2), size(3)) else {
+            eprintln!("Usage: --emit <functions> <depth> <macros>");
+            std::process::exit(1);
+        };
+        print!("{}", Workload::new(functions, depth, macros).source());
+        return;
+    }
+    // Cargo passes --bench; anything else is a filter
+    let bench = Bench {
+        filter: args.into_iter().find(|arg| !arg.starts_with("--")),
+    };
+
+    for functions in FUNCTIONS {
+        let source = preprocess(&Workload::new(functions, 3, 10).source(), None);
+        bench.run(&format!("lex/functions={}", functions), || (), |_| Lexer::new(&source).scan_tokens());
+    }
+
+    for macros in [10, 100, 1000] {
+        let source = Workload::new(100, 3, macros).source();
+        bench.run(&format!("preprocess_macros/macros={}", macros), || (), |_| preprocess(&source, None));
+    }
+    for functions in FUNCTIONS {
+        let dir = tempfile::tempdir().unwrap();
+        let source = Workload::new(functions, 3, 10).with_headers(dir.path());
+        let include_dir = dir.path().to_string_lossy().to_string();
+        bench.run(
+            &format!("preprocess_includes/headers={}", functions + 1),
+            || (),
+            |_| preprocess(&source, Some(&include_dir)),
+        );
+    }
+
+    for functions in FUNCTIONS {
+        let source = preprocess(&Workload::new(functions, 3, 10).source(), None);
+        bench.run(
+            &format!("parse/functions={}", functions),
+            || Lexer::new(&source).scan_tokens(),
+            |tokens| Parser::new(tokens).parse().unwrap(),
+        );
+    }
+    for depth in [2, 8, 32] {
+        let source = preprocess(&Workload::new(100, depth, 10).source(), None);
+        bench.run(
+            &format!("parse/depth={}", depth),
+            || Lexer::new(&source).scan_tokens(),
+            |tokens| Parser::new(tokens).parse().unwrap(),
+        );
+    }
+
+    let (control_flow, dead_code) = (ControlFlowObfuscator::default(), DeadCodeInserter::default());
+    let transforms: [&dyn Transform; 4] = [&VariableObfuscator, &StringEncryptor, &control_flow, &dead_code];
+    for transform in transforms {
+        let name = transform.name().to_lowercase().replace(' ', "_");
+        for functions in FUNCTIONS {
+            let program = parse(&preprocess(&Workload::new(functions, 3, 10).source(), None));
+            bench.run(
+                &format!("{}/functions={}", name, functions),
+                || program.clone(),
+                |mut program| {
+                    PassManager::new(vec![transform]).with_threads(1).run(&mut program).unwrap();
+                    program
+                },
+            );
+        }
+    }
+    // All four together, as -obf2 runs them
+    for functions in FUNCTIONS {
+        let program = parse(&preprocess(&Workload::new(functions, 3, 10).source(), None));
+        bench.run(
+            &format!("obfuscate/functions={}", functions),
+            || program.clone(),
+            |mut program| {
+                PassManager::new(transforms.to_vec()).run(&mut program).unwrap();
+                program
+            },
+        );
+    }
+
+    for functions in FUNCTIONS {
+        let mut program = parse(&preprocess(&Workload::new(functions, 3, 10).source(), None));
+        let (analysis, _) = annotate(&mut program);
+        bench.run(&format!("codegen/functions={}", functions), || (), |_| {
+            X86_64Generator::new().generate(&program, &analysis)
+        });
+    }
+}
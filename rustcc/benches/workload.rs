@@ -0,0 +1,101 @@
+// workload.rs
+// Synthetic C sources for the benchmarks
+//
+// A workload is `functions` functions whose bodies nest `depth` levels of
+// if/while blocks, using `macros` function-like macros. Each dimension scales
+// one part of the pipeline: functions the amount of code, depth the nesting
+// the parser and the obfuscators walk, macros the preprocessor's expansion.
+// The same parameters always give the same source.
+
+use std::fmt::Write;
+use std::fs;
+use std::path::Path;
+
+#[derive(Debug, Clone, Copy)]
+pub struct Workload {
+    pub functions: usize,
+    pub depth: usize,
+    pub macros: usize,
+}
+
+impl Workload {
+    pub fn new(functions: usize, depth: usize, macros: usize) -> Self {
+        Workload { functions, depth, macros }
+    }
+
+    /// The macro definitions of the workload
+    pub fn macros(&self) -> String {
+        let mut out = String::new();
+        for m in 0..self.macros {
+            writeln!(out, "#define SCALE_{}(x) ((x) * {} + {})", m, m % 7 + 2, m).unwrap();
+        }
+        if self.macros == 0 {
+            out.push_str("#define SCALE_0(x) (x)\n");
+        }
+        out
+    }
+
+    /// The functions of the workload, using the macros of `macros()`
+    pub fn functions(&self) -> String {
+        let mut out = String::new();
+        for f in 0..self.functions {
+            self.function(&mut out, f);
+        }
+        self.main(&mut out);
+        out
+    }
+
+    /// The whole translation unit: macros followed by functions
+    pub fn source(&self) -> String {
+        self.macros() + "\n" + &self.functions()
+    }
+
+    /// Writes the macros, and each function, to a header of its own in
+    /// `dir`, returning a source that includes them all
+    pub fn with_headers(&self, dir: &Path) -> String {
+        fs::write(dir.join("macros.h"), self.macros()).unwrap();
+        let mut source = String::from("#include \"macros.h\"\n");
+        for f in 0..self.functions {
+            let mut header = String::new();
+            self.function(&mut header, f);
+            fs::write(dir.join(format!("f{}.h", f)), header).unwrap();
+            writeln!(source, "#include \"f{}.h\"", f).unwrap();
+        }
+        self.main(&mut source);
+        source
+    }
+
+    fn function(&self, out: &mut String, f: usize) {
+        writeln!(out, "int f{}(int a, int b) {{", f).unwrap();
+        writeln!(out, "    int x = SCALE_{}(a) - b;", f % self.macros.max(1)).unwrap();
+        self.block(out, f, 0);
+        out.push_str("    return x;\n}\n\n");
+    }
+
+    fn main(&self, out: &mut String) {
+        out.push_str("int main() {\n    int total = 0;\n");
+        for f in 0..self.functions {
+            writeln!(out, "    total = total + f{}({}, {});", f, f % 13, f % 5).unwrap();
+        }
+        out.push_str("    return total;\n}\n");
+    }
+
+    fn block(&self, out: &mut String, f: usize, level: usize) {
+        if level == self.depth {
+            return;
+        }
+        let indent = "    ".repeat(level + 1);
+        if level % 2 == 0 {
+            writeln!(out, "{}if (x > {}) {{", indent, level + f % 3).unwrap();
+            writeln!(out, "{}    x = x - SCALE_{}(b);", indent, (f + level) % self.macros.max(1)).unwrap();
+        } else {
+            // Loops count on a variable of their own so the program ends
+            writeln!(out, "{}int i{} = 0;", indent, level).unwrap();
+            writeln!(out, "{}while (i{} < 3) {{", indent, level).unwrap();
+            writeln!(out, "{}    i{} = i{} + 1;", indent, level, level).unwrap();
+            writeln!(out, "{}    x = x + {};", indent, level + 1).unwrap();
+        }
+        self.block(out, f, level + 1);
+        writeln!(out, "{}}}", indent).unwrap();
+    }
+}
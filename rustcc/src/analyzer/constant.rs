@@ -0,0 +1,231 @@
+// constant.rs
+// Evaluation of integer constant expressions
+//
+// Enum values, _Alignas arguments, array sizes, case labels and the
+// initializers of globals are all integer constant expressions, and every
+// phase evaluates them the same way. The parser evaluates enum values and
+// alignments as it reads them, knowing only what was declared before;
+// annotation folds the rest into literals once names and types are
+// resolved, so frame layout and code generation only see plain numbers.
+//
+// Arithmetic is done in 64 bits and wraps. Casts truncate to the width of
+// the target type and extend by its signedness, so `(char)300` is 44.
+
+use super::symbols::{Binding, Symbols};
+use super::types::{is_unsigned, strip_qualifiers, TypeTable};
+use crate::parser::ast::{AstArena, BinaryOp, ExprId, Expression, OperatorType, Statement, Type, UnaryOp};
+use crate::parser::symbol::Symbol;
+
+/// What the names and types in an expression mean where it's evaluated
+pub trait Context {
+    /// The value of `name`, used as `expr`, if it's an enum constant
+    fn enum_constant(&self, expr: ExprId, name: Symbol) -> Option<i64>;
+
+    /// Size of `typ` in bytes, if it's complete
+    fn size_of_type(&self, typ: &Type) -> Option<usize>;
+
+    /// Alignment of `typ` in bytes, if it's complete
+    fn align_of_type(&self, typ: &Type) -> Option<usize>;
+
+    /// Size in bytes of the value of `expr`, if its type is known
+    fn size_of_value(&self, _expr: ExprId) -> Option<usize> {
+        None
+    }
+}
+
+/// File scope: the program's enum constants and types
+impl Context for TypeTable {
+    fn enum_constant(&self, _expr: ExprId, name: Symbol) -> Option<i64> {
+        self.constant(name).map(i64::from)
+    }
+
+    fn size_of_type(&self, typ: &Type) -> Option<usize> {
+        Some(self.size_of(typ)).filter(|&size| size > 0)
+    }
+
+    fn align_of_type(&self, typ: &Type) -> Option<usize> {
+        self.size_of_type(typ).map(|_| self.align_of(typ))
+    }
+}
+
+/// A function body whose names have been resolved
+pub struct Resolved<'a> {
+    pub symbols: &'a Symbols,
+    pub types: &'a TypeTable,
+}
+
+impl Context for Resolved<'_> {
+    fn enum_constant(&self, expr: ExprId, _name: Symbol) -> Option<i64> {
+        match self.symbols.binding(expr)? {
+            Binding::Constant(value) => Some(value.into()),
+            _ => None,
+        }
+    }
+
+    fn size_of_type(&self, typ: &Type) -> Option<usize> {
+        self.types.size_of_type(typ)
+    }
+
+    fn align_of_type(&self, typ: &Type) -> Option<usize> {
+        self.types.align_of_type(typ)
+    }
+
+    fn size_of_value(&self, expr: ExprId) -> Option<usize> {
+        self.symbols.size_of(expr)
+    }
+}
+
+/// The value of `expr` if it's an integer constant expression
+pub fn evaluate(arena: &AstArena, expr: ExprId, context: &impl Context) -> Option<i64> {
+    let value = |expr| evaluate(arena, expr, context);
+    Some(match &arena[expr] {
+        Expression::IntegerLiteral(value) => i64::from(*value),
+        Expression::CharLiteral(value) => i64::from(*value as u8),
+        Expression::Variable(name) => context.enum_constant(expr, *name)?,
+        Expression::UnaryOperation { operator: OperatorType::Unary(operator), operand } => {
+            let operand = value(*operand)?;
+            match operator {
+                UnaryOp::Negate => operand.wrapping_neg(),
+                UnaryOp::LogicalNot => i64::from(operand == 0),
+                UnaryOp::BitwiseNot => !operand,
+                _ => return None,
+            }
+        }
+        // Only the side that decides the result has to be constant
+        Expression::BinaryOperation { left, operator: BinaryOp::LogicalAnd, right } => {
+            i64::from(value(*left)? != 0 && value(*right)? != 0)
+        }
+        Expression::BinaryOperation { left, operator: BinaryOp::LogicalOr, right } => {
+            i64::from(value(*left)? != 0 || value(*right)? != 0)
+        }
+        Expression::BinaryOperation { left, operator, right } => binary(value(*left)?, *operator, value(*right)?)?,
+        Expression::TernaryIf { condition, then_expr, else_expr } => {
+            if value(*condition)? != 0 {
+                value(*then_expr)?
+            } else {
+                value(*else_expr)?
+            }
+        }
+        Expression::Cast { target_type, expr: operand } => convert(value(*operand)?, target_type)?,
+        Expression::SizeOf(operand) => size_of_operand(arena, *operand, context)? as i64,
+        Expression::SizeOfType(typ) => context.size_of_type(typ)? as i64,
+        Expression::AlignOf(typ) => context.align_of_type(typ)? as i64,
+        _ => return None,
+    })
+}
+
+/// Replaces the array sizes, case labels and `sizeof` and `_Alignof`
+/// operations in `arena` that have a constant value with literals
+pub fn fold(arena: &mut AstArena, context: &impl Context) {
+    let mut roots = Vec::new();
+    for stmt in arena.stmts() {
+        match stmt {
+            Statement::ArrayDeclaration { size: Some(size), .. } => roots.push(*size),
+            Statement::Switch { cases, .. } => roots.extend(cases.iter().filter_map(|case| case.value)),
+            _ => {}
+        }
+    }
+    roots.extend(arena.expr_ids().filter(|&id| {
+        matches!(arena[id], Expression::SizeOf(_) | Expression::SizeOfType(_) | Expression::AlignOf(_))
+    }));
+
+    // Evaluate everything before rewriting anything, so each value comes
+    // from the tree as written
+    let folded: Vec<_> = roots
+        .into_iter()
+        .filter(|&id| !matches!(arena[id], Expression::IntegerLiteral(_)))
+        .filter_map(|id| Some((id, i32::try_from(evaluate(arena, id, context)?).ok()?)))
+        .collect();
+    for (id, value) in folded {
+        arena[id] = Expression::IntegerLiteral(value);
+    }
+}
+
+fn binary(left: i64, operator: BinaryOp, right: i64) -> Option<i64> {
+    // Shifting by a negative amount or by the width or more is undefined
+    let shift = || u32::try_from(right).ok().filter(|&shift| shift < 64);
+    Some(match operator {
+        BinaryOp::Add => left.wrapping_add(right),
+        BinaryOp::Subtract => left.wrapping_sub(right),
+        BinaryOp::Multiply => left.wrapping_mul(right),
+        BinaryOp::Divide if right != 0 => left.wrapping_div(right),
+        BinaryOp::Modulo if right != 0 => left.wrapping_rem(right),
+        BinaryOp::Equal => i64::from(left == right),
+        BinaryOp::NotEqual => i64::from(left != right),
+        BinaryOp::LessThan => i64::from(left < right),
+        BinaryOp::LessThanOrEqual => i64::from(left <= right),
+        BinaryOp::GreaterThan => i64::from(left > right),
+        BinaryOp::GreaterThanOrEqual => i64::from(left >= right),
+        BinaryOp::BitwiseAnd => left & right,
+        BinaryOp::BitwiseOr => left | right,
+        BinaryOp::BitwiseXor => left ^ right,
+        BinaryOp::LeftShift => left << shift()?,
+        BinaryOp::RightShift => left >> shift()?,
+        _ => return None,
+    })
+}
+
+// `value` converted to the integer type `typ`
+fn convert(value: i64, typ: &Type) -> Option<i64> {
+    let bits = match strip_qualifiers(typ) {
+        Type::Bool => return Some(i64::from(value != 0)),
+        Type::Char | Type::UnsignedChar => 8,
+        Type::Short | Type::UnsignedShort => 16,
+        Type::Int | Type::UnsignedInt => 32,
+        Type::Long | Type::UnsignedLong | Type::LongLong | Type::UnsignedLongLong | Type::Pointer(_) => 64,
+        _ => return None,
+    };
+    let shift = 64 - bits;
+    Some(if is_unsigned(typ) {
+        ((value as u64) << shift >> shift) as i64
+    } else {
+        value << shift >> shift
+    })
+}
+
+// `sizeof` only needs its operand's type, not its value
+fn size_of_operand(arena: &AstArena, operand: ExprId, context: &impl Context) -> Option<usize> {
+    match &arena[operand] {
+        Expression::Cast { target_type, .. } => context.size_of_type(target_type),
+        Expression::StringLiteral(text) => Some(text.len() + 1),
+        _ => context.size_of_value(operand),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+
+    #[test]
+    fn test_constant_expressions_fold() {
+        let source = "enum { WIDTH = 2 * 3, HEIGHT = WIDTH << 1, NEGATIVE = -1 };\n\
+                      struct point { char tag; int x; };\n\
+                      int main() {\n\
+                          int a[WIDTH * HEIGHT - sizeof(struct point)];\n\
+                          return (char)300 + _Alignof(struct point) + (NEGATIVE ? 1 : 2) + 7 / 0;\n\
+                      }";
+        let mut program = Parser::new(Lexer::new(source).scan_tokens()).parse().unwrap();
+        let (analysis, errors) = crate::analyzer::annotate(&mut program);
+        assert!(errors.is_empty());
+        assert_eq!(program.enum_constants.iter().map(|&(_, value)| value).collect::<Vec<_>>(), [6, 12, -1]);
+
+        let main = &program.functions[0];
+        let Statement::ArrayDeclaration { size: Some(size), .. } = main.arena[main.body[0]] else {
+            panic!("expected an array declaration");
+        };
+        assert!(matches!(main.arena[size], Expression::IntegerLiteral(64)));
+
+        // The division by zero keeps the whole sum from being constant
+        let Statement::Return(sum) = main.arena[main.body[1]] else {
+            panic!("expected a return");
+        };
+        let Expression::BinaryOperation { left, right, .. } = main.arena[sum] else {
+            panic!("expected an addition");
+        };
+        let context = Resolved { symbols: &analysis.functions[0], types: &analysis.types };
+        assert_eq!(evaluate(&main.arena, left, &context), Some(44 + 4 + 1));
+        assert_eq!(evaluate(&main.arena, right, &context), None);
+    }
+}
@@ -1,18 +1,35 @@
-use crate::parser::ast::{Expression, Function, Program, Statement};
-use std::collections::HashMap;
-
-pub struct SemanticAnalyzer {
-    variables: HashMap<String, bool>, // tracks if variables are defined
+pub mod constant;
+pub mod symbols;
+pub mod types;
+
+use constant::Resolved;
+use crate::parser::ast::{AstArena, Expression, Program, Statement, Type};
+use std::sync::Arc;
+use symbols::{Globals, Symbols};
+use types::TypeTable;
+
+pub struct SemanticAnalyzer;
+
+/// What semantic analysis found out about a program. It's kept beside the
+/// AST rather than in it, so the parser's types don't depend on the
+/// analyzer's.
+#[derive(Debug, Clone, Default)]
+pub struct Analysis {
+    /// Sizes and layouts of the program's types
+    pub types: TypeTable,
+    /// What each function body's names refer to and the types of its
+    /// expressions, by the function's position in the program
+    pub functions: Vec<Arc<Symbols>>,
 }
 
 impl SemanticAnalyzer {
     pub fn new() -> Self {
-        SemanticAnalyzer {
-            variables: HashMap::new(),
-        }
+        SemanticAnalyzer
     }
 
-    pub fn analyze(&mut self, program: &Program) -> Result<(), String> {
+    /// Checks the program and annotates it for code generation, failing on
+    /// the first problem found
+    pub fn analyze(&mut self, program: &mut Program) -> Result<Analysis, String> {
         // Check if main function exists
         let main_exists = program.functions.iter().any(|f| f.name == "main");
 
@@ -20,225 +37,154 @@ impl SemanticAnalyzer {
             return Err("Program must have a main function".to_string());
         }
 
-        // Analyze each function
-        for function in &program.functions {
-            self.analyze_function(function)?;
+        let (analysis, errors) = annotate(program);
+        if let Some(error) = errors.into_iter().next() {
+            return Err(error);
         }
 
-        Ok(())
-    }
+        for function in &program.functions {
+            // For external function declarations (without a body), no need to check for return statement
+            if function.body.is_empty() {
+                continue;
+            }
 
-    fn analyze_function(&mut self, function: &Function) -> Result<(), String> {
-        self.variables.clear(); // Clear variables for new function scope
+            // Check that function has a return statement if it's not void
+            let is_void = matches!(function.return_type, Type::Void);
+            let has_return = function
+                .body
+                .iter()
+                .any(|&stmt| matches!(function.arena[stmt], Statement::Return(_)));
 
-        // Register function parameters in the variables scope
-        for param in &function.parameters {
-            self.variables.insert(param.name.clone(), true);
+            if !has_return && !is_void {
+                return Err(format!(
+                    "Function '{}' must have a return statement",
+                    function.name
+                ));
+            }
         }
 
-        // For external function declarations (without a body), no need to check for return statement
-        // External functions are those without a body (empty body)
-        if function.body.is_empty() {
-            return Ok(());
-        }
+        Ok(analysis)
+    }
+}
 
-        // Analyze each statement in the function body
-        for statement in &function.body {
-            self.analyze_statement(statement)?;
+impl Default for SemanticAnalyzer {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Resolves typedef names in place, lays out the program's types and
+/// resolves the names in every function body, returning the results for
+/// code generation. Array sizes, case labels, `sizeof` and `_Alignof` are
+/// folded to literals where they're constant. Also returns the problems
+/// found; whatever they concern is left unannotated.
+///
+/// Transforms that add or rewrite nodes should run this again, so that
+/// code generation sees annotations for the tree it's given.
+pub fn annotate(program: &mut Program) -> (Analysis, Vec<String>) {
+    let types = TypeTable::new(program);
+    let mut errors = Vec::new();
+    let mut resolve = |typ: &mut Type| {
+        *typ = types.resolve(typ);
+        if let Some(name) = typedef_name(typ) {
+            errors.push(format!("Unknown type name '{}'", name));
         }
+    };
 
-        // Check that function has a return statement if it's not void
-        let is_void = matches!(function.return_type, crate::parser::ast::Type::Void);
-        let has_return = function
-            .body
-            .iter()
-            .any(|stmt| matches!(stmt, Statement::Return(_)));
-
-        if !has_return && !is_void {
-            return Err(format!(
-                "Function '{}' must have a return statement",
-                function.name
-            ));
+    resolve_types_in(&mut program.arena, &mut resolve);
+    for function in &mut program.functions {
+        resolve(&mut function.return_type);
+        for param in &mut function.parameters {
+            resolve(&mut param.data_type);
         }
+        resolve_types_in(&mut function.arena, &mut resolve);
+    }
 
-        Ok(())
+    let globals = Globals::new(program, &types);
+    constant::fold(&mut program.arena, &types);
+    let mut functions = Vec::with_capacity(program.functions.len());
+    for function in &mut program.functions {
+        let (symbols, function_errors) = symbols::resolve(function, &globals, &types);
+        constant::fold(&mut function.arena, &Resolved { symbols: &symbols, types: &types });
+        functions.push(Arc::new(symbols));
+        errors.extend(function_errors);
     }
+    (Analysis { types, functions }, errors)
+}
 
-    fn analyze_statement(&mut self, statement: &Statement) -> Result<(), String> {
-        match statement {
-            Statement::Return(expr) => self.analyze_expression(expr),
-            Statement::VariableDeclaration {
-                name,
-                initializer,
-                data_type: _,
-                is_global: _,
-                alignment: _,
-            } => {
-                // Check if variable is already defined
-                if self.variables.contains_key(name) {
-                    return Err(format!("Variable '{}' is already defined", name));
-                }
-
-                // Analyze the initializer expression
-                self.analyze_expression(initializer)?;
-
-                // Mark variable as defined
-                self.variables.insert(name.clone(), true);
-                Ok(())
-            }
-            Statement::ArrayDeclaration {
-                name,
-                initializer,
-                size,
-                data_type: _,
-                is_global: _,
-                alignment: _,
-            } => {
-                // Check if variable is already defined
-                if self.variables.contains_key(name) {
-                    return Err(format!("Array '{}' is already defined", name));
-                }
-
-                // Analyze the initializer expression
-                self.analyze_expression(initializer)?;
-
-                // Analyze the size expression if provided
-                if let Some(size_expr) = size {
-                    self.analyze_expression(size_expr)?;
-                }
-
-                // Mark array as defined
-                self.variables.insert(name.clone(), true);
-                Ok(())
-            }
-            Statement::ExpressionStatement(expr) => self.analyze_expression(expr),
-            Statement::Block(statements) => {
-                for stmt in statements {
-                    self.analyze_statement(stmt)?;
-                }
-                Ok(())
-            }
-            Statement::If {
-                condition,
-                then_block,
-                else_block,
-            } => {
-                self.analyze_expression(condition)?;
-                self.analyze_statement(then_block)?;
-                if let Some(else_stmt) = else_block {
-                    self.analyze_statement(else_stmt)?;
-                }
-                Ok(())
-            }
-            Statement::While { condition, body } => {
-                self.analyze_expression(condition)?;
-                self.analyze_statement(body)
-            }
-            Statement::For {
-                initializer,
-                condition,
-                increment,
-                body,
-            } => {
-                if let Some(init) = initializer {
-                    self.analyze_statement(init)?;
-                }
-                if let Some(cond) = condition {
-                    self.analyze_expression(cond)?;
-                }
-                if let Some(inc) = increment {
-                    self.analyze_expression(inc)?;
-                }
-                self.analyze_statement(body)
-            }
-            Statement::DoWhile { body, condition } => {
-                self.analyze_statement(body)?;
-                self.analyze_expression(condition)
-            }
-            Statement::Break | Statement::Continue => Ok(()),
-            Statement::Switch { expression, cases } => {
-                self.analyze_expression(expression)?;
-                for case in cases {
-                    if let Some(value) = &case.value {
-                        self.analyze_expression(value)?;
-                    }
-                    for stmt in &case.statements {
-                        self.analyze_statement(stmt)?;
-                    }
-                }
-                Ok(())
-            }
-            // Add a catch-all for unhandled statement types (C11 features)
-            _ => {
-                // For now, we'll just continue without analyzing these statements
-                // They will be handled properly in a future implementation
-                Ok(())
-            }
+// Applies `resolve` to every type written in the arena's nodes
+fn resolve_types_in(arena: &mut AstArena, resolve: &mut impl FnMut(&mut Type)) {
+    for stmt in arena.stmts_mut() {
+        if let Statement::VariableDeclaration { data_type: Some(typ), .. }
+        | Statement::ArrayDeclaration { data_type: Some(typ), .. } = stmt
+        {
+            resolve(typ);
         }
     }
-
-    fn analyze_expression(&self, expr: &Expression) -> Result<(), String> {
+    for expr in arena.exprs_mut() {
         match expr {
-            Expression::IntegerLiteral(_) => Ok(()),
-            Expression::StringLiteral(_) => Ok(()),
-            Expression::CharLiteral(_) => Ok(()),
-            Expression::BinaryOperation { left, right, .. } => {
-                self.analyze_expression(left)?;
-                self.analyze_expression(right)
-            }
-            Expression::UnaryOperation { operand, .. } => self.analyze_expression(operand),
-            Expression::Variable(name) => {
-                if !self.variables.contains_key(name) {
-                    Err(format!("Variable '{}' is used before being defined", name))
-                } else {
-                    Ok(())
-                }
-            }
-            Expression::FunctionCall { arguments, .. } => {
-                for arg in arguments {
-                    self.analyze_expression(arg)?;
-                }
-                Ok(())
-            }
-            Expression::Assignment { target, value } => {
-                self.analyze_expression(target)?;
-                self.analyze_expression(value)
-            }
-            Expression::TernaryIf {
-                condition,
-                then_expr,
-                else_expr,
-            } => {
-                self.analyze_expression(condition)?;
-                self.analyze_expression(then_expr)?;
-                self.analyze_expression(else_expr)
-            }
-            Expression::Cast { expr, .. } => self.analyze_expression(expr),
-            Expression::SizeOf(expr) => self.analyze_expression(expr),
-            Expression::ArrayAccess { array, index } => {
-                self.analyze_expression(array)?;
-                self.analyze_expression(index)
-            }
-            Expression::ArrayLiteral(elements) => {
-                for element in elements {
-                    self.analyze_expression(element)?;
-                }
-                Ok(())
-            }
-            Expression::StructFieldAccess { object, .. } => self.analyze_expression(object),
-            Expression::PointerFieldAccess { pointer, .. } => self.analyze_expression(pointer),
-            // Add a catch-all for unhandled expression types (C11 features)
-            _ => {
-                // For now, we'll just return a placeholder result
-                // These will be handled properly in a future implementation
-                Ok(())
-            }
+            Expression::Cast { target_type: typ, .. }
+            | Expression::SizeOfType(typ)
+            | Expression::AlignOf(typ)
+            | Expression::CompoundLiteral { type_name: typ, .. } => resolve(typ),
+            _ => {}
         }
     }
 }
 
-impl Default for SemanticAnalyzer {
-    fn default() -> Self {
-        Self::new()
+// A typedef name left in `typ` after resolution, which nothing declared
+fn typedef_name(typ: &Type) -> Option<&str> {
+    match typ {
+        Type::TypeDef(name) => Some(name),
+        Type::Pointer(inner)
+        | Type::Array(inner, _)
+        | Type::Const(inner)
+        | Type::Volatile(inner)
+        | Type::Restrict(inner)
+        | Type::Atomic(inner) => typedef_name(inner),
+        _ => None,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+    use symbols::{Access, Binding};
+
+    #[test]
+    fn test_typedefs_enums_and_globals_resolve() {
+        let source = "typedef char byte;\n\
+                      enum color { RED, GREEN = 4, BLUE };\n\
+                      int total = 0;\n\
+                      int main() { byte b = BLUE; total = b; return total; }";
+        let mut program = Parser::new(Lexer::new(source).scan_tokens()).parse().unwrap();
+        let analysis = SemanticAnalyzer::new().analyze(&mut program).unwrap();
+
+        let (main, symbols) = (&program.functions[0], &analysis.functions[0]);
+        let Statement::VariableDeclaration { data_type, initializer, .. } = &main.arena[main.body[0]] else {
+            panic!("expected a declaration");
+        };
+        assert_eq!(data_type.as_ref(), Some(&Type::Char));
+        assert_eq!(symbols.binding(*initializer), Some(Binding::Constant(5)));
+
+        let uses: Vec<_> = main
+            .arena
+            .expr_ids()
+            .filter(|&id| matches!(main.arena[id], Expression::Variable(_)))
+            .map(|id| (symbols.binding(id), symbols.access(id)))
+            .collect();
+        let int = Access::Scalar { width: 4, signed: true };
+        let byte = Access::Scalar { width: 1, signed: true };
+        assert_eq!(
+            uses,
+            [
+                (Some(Binding::Constant(5)), int),
+                (Some(Binding::Global), int),
+                (Some(Binding::Local(main.body[0])), byte),
+                (Some(Binding::Global), int),
+            ]
+        );
     }
 }
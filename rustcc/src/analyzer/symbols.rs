@@ -0,0 +1,583 @@
+// symbols.rs
+// Name resolution and expression types for function bodies
+//
+// Every name in a body is resolved once, in a single walk, to the
+// declaration it refers to. The results are kept per expression, along
+// with the expression's type and how its value moves through a register,
+// so code generation reads them directly instead of looking names up again.
+//
+// All scopes share one stack of bindings. A binding remembers the one of
+// the same name it shadows, and leaving a scope pops its bindings and
+// restores those, so a lookup is a single map access whatever the depth.
+
+use super::constant::{self, Context};
+use super::types::{is_unsigned, strip_qualifiers, TypeTable};
+use crate::parser::ast::{
+    AstArena, ExprId, Expression, Function, OperatorType, Program, Statement, StmtId, Type, UnaryOp,
+};
+use crate::parser::symbol::Symbol;
+use std::collections::HashMap;
+
+/// What a name refers to
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum Binding {
+    /// The function's parameter at this position
+    Param(usize),
+    /// The local declared by this statement
+    Local(StmtId),
+    /// A global variable or function
+    Global,
+    /// An enum constant
+    Constant(i32),
+}
+
+/// How the value of an expression moves between memory and a 64-bit
+/// register
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Access {
+    /// A scalar of 1, 2, 4 or 8 bytes, sign- or zero-extended when loaded
+    Scalar { width: u8, signed: bool },
+    /// An array, struct or function, which stands for its address
+    Address,
+}
+
+impl Access {
+    // Where nothing is known about a value it's a signed quadword
+    const UNKNOWN: Access = Access::Scalar { width: 8, signed: true };
+
+    fn of(typ: &Type, types: &TypeTable) -> Access {
+        match strip_qualifiers(typ) {
+            Type::Array(..) | Type::Struct(_) | Type::Union(_) | Type::Function { .. } => Access::Address,
+            typ => {
+                let width = match types.size_of(typ) {
+                    size @ (1 | 2 | 4) => size as u8,
+                    _ => 8,
+                };
+                Access::Scalar { width, signed: !is_unsigned(typ) }
+            }
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+struct Annotation {
+    binding: Option<Binding>,
+    data_type: Option<Type>,
+    access: Access,
+    size: usize,
+    // Offset of the field a field access reads
+    field_offset: Option<usize>,
+}
+
+impl Default for Annotation {
+    fn default() -> Self {
+        Annotation { binding: None, data_type: None, access: Access::UNKNOWN, size: 0, field_offset: None }
+    }
+}
+
+/// The results of resolving one function body, by expression. Nodes
+/// allocated after resolution have no annotations.
+#[derive(Debug, Clone, Default)]
+pub struct Symbols {
+    annotations: Vec<Annotation>,
+}
+
+impl Symbols {
+    /// The declaration a variable refers to
+    pub fn binding(&self, expr: ExprId) -> Option<Binding> {
+        self.annotations.get(expr.index())?.binding
+    }
+
+    /// The type of `expr`, with typedefs resolved
+    #[allow(dead_code)]
+    pub fn type_of(&self, expr: ExprId) -> Option<&Type> {
+        self.annotations.get(expr.index())?.data_type.as_ref()
+    }
+
+    /// How the value of `expr` is loaded and stored
+    pub fn access(&self, expr: ExprId) -> Access {
+        self.annotations.get(expr.index()).map_or(Access::UNKNOWN, |annotation| annotation.access)
+    }
+
+    /// Size in bytes of the value of `expr`, if its type is known
+    pub fn size_of(&self, expr: ExprId) -> Option<usize> {
+        self.annotations.get(expr.index()).map(|annotation| annotation.size).filter(|&size| size > 0)
+    }
+
+    /// Offset of the field read by a struct or pointer field access
+    pub fn field_offset(&self, expr: ExprId) -> Option<usize> {
+        self.annotations.get(expr.index())?.field_offset
+    }
+}
+
+/// The names any function can see: globals, functions and enum constants
+pub struct Globals {
+    names: HashMap<Symbol, (Binding, Type)>,
+}
+
+impl Globals {
+    pub fn new(program: &Program, types: &TypeTable) -> Self {
+        let mut names = HashMap::new();
+        for function in &program.functions {
+            let typ = Type::Function {
+                return_type: Box::new(types.resolve(&function.return_type)),
+                parameters: Vec::new(),
+                is_variadic: function.is_variadic,
+            };
+            names.insert(function.name, (Binding::Global, typ));
+        }
+        for &global in &program.globals {
+            if let Some((name, typ)) = declared(&program.arena, global, types, types) {
+                names.insert(name, (Binding::Global, typ));
+            }
+        }
+        for &(name, value) in &program.enum_constants {
+            names.insert(name, (Binding::Constant(value), Type::Int));
+        }
+        Globals { names }
+    }
+}
+
+/// Resolves the names in `function`'s body and works out the type of every
+/// expression. Problems are returned rather than stopping the walk, and
+/// whatever couldn't be resolved is left unannotated.
+pub fn resolve(function: &Function, globals: &Globals, types: &TypeTable) -> (Symbols, Vec<String>) {
+    let mut resolver = Resolver {
+        arena: &function.arena,
+        globals,
+        types,
+        scopes: Scopes::default(),
+        annotations: vec![Annotation::default(); function.arena.expr_count()],
+        errors: Vec::new(),
+    };
+
+    // Parameters share a scope with the outermost statements of the body
+    resolver.scopes.enter();
+    for (index, param) in function.parameters.iter().enumerate() {
+        resolver.declare(param.name, Binding::Param(index), types.resolve(&param.data_type));
+    }
+    for &stmt in &function.body {
+        resolver.statement(stmt);
+    }
+
+    let Resolver { annotations, errors, .. } = resolver;
+    (Symbols { annotations }, errors)
+}
+
+// A declaration's name and type, arrays taking their length from the size
+// or the initializer
+fn declared(arena: &AstArena, stmt: StmtId, types: &TypeTable, context: &impl Context) -> Option<(Symbol, Type)> {
+    match &arena[stmt] {
+        Statement::VariableDeclaration { name, data_type, .. } => {
+            Some((*name, types.resolve(data_type.as_ref().unwrap_or(&Type::Int))))
+        }
+        Statement::ArrayDeclaration { name, data_type, size, initializer, .. } => {
+            let element = types.resolve(data_type.as_ref().unwrap_or(&Type::Int));
+            let length = match (size, &arena[*initializer]) {
+                (Some(size), _) => constant::evaluate(arena, *size, context).and_then(|length| usize::try_from(length).ok()),
+                (None, Expression::ArrayLiteral(elements)) => Some(elements.len()),
+                _ => None,
+            };
+            Some((*name, Type::Array(Box::new(element), length)))
+        }
+        _ => None,
+    }
+}
+
+#[derive(Debug)]
+struct Entry<T> {
+    name: Symbol,
+    value: T,
+    // The binding of the same name this one hides, as an index into `bindings`
+    shadows: Option<usize>,
+}
+
+/// Bindings of every open scope on one stack
+#[derive(Debug)]
+struct Scopes<T> {
+    bindings: Vec<Entry<T>>,
+    // The innermost binding of each name in scope
+    innermost: HashMap<Symbol, usize>,
+    // Where each open scope's bindings start
+    starts: Vec<usize>,
+}
+
+impl<T> Default for Scopes<T> {
+    fn default() -> Self {
+        Scopes { bindings: Vec::new(), innermost: HashMap::new(), starts: Vec::new() }
+    }
+}
+
+impl<T> Scopes<T> {
+    fn enter(&mut self) {
+        self.starts.push(self.bindings.len());
+    }
+
+    fn leave(&mut self) {
+        let start = self.starts.pop().expect("leaving a scope that was never entered");
+        while self.bindings.len() > start {
+            let entry = self.bindings.pop().expect("scope bindings are on the stack");
+            match entry.shadows {
+                Some(index) => self.innermost.insert(entry.name, index),
+                None => self.innermost.remove(&entry.name),
+            };
+        }
+    }
+
+    /// Binds `name` in the innermost scope, unless it's already bound there
+    fn declare(&mut self, name: Symbol, value: T) -> bool {
+        let start = self.starts.last().copied().unwrap_or(0);
+        let shadows = self.innermost.get(&name).copied();
+        if shadows.is_some_and(|index| index >= start) {
+            return false;
+        }
+        self.innermost.insert(name, self.bindings.len());
+        self.bindings.push(Entry { name, value, shadows });
+        true
+    }
+
+    fn lookup(&self, name: Symbol) -> Option<&T> {
+        self.innermost.get(&name).map(|&index| &self.bindings[index].value)
+    }
+}
+
+struct Resolver<'a> {
+    arena: &'a AstArena,
+    globals: &'a Globals,
+    types: &'a TypeTable,
+    scopes: Scopes<(Binding, Type)>,
+    annotations: Vec<Annotation>,
+    errors: Vec<String>,
+}
+
+// Array sizes are evaluated as they're declared, from what's been
+// resolved so far
+impl Context for Resolver<'_> {
+    fn enum_constant(&self, expr: ExprId, _name: Symbol) -> Option<i64> {
+        match self.annotations[expr.index()].binding? {
+            Binding::Constant(value) => Some(value.into()),
+            _ => None,
+        }
+    }
+
+    fn size_of_type(&self, typ: &Type) -> Option<usize> {
+        self.types.size_of_type(typ)
+    }
+
+    fn align_of_type(&self, typ: &Type) -> Option<usize> {
+        self.types.align_of_type(typ)
+    }
+
+    fn size_of_value(&self, expr: ExprId) -> Option<usize> {
+        Some(self.annotations[expr.index()].size).filter(|&size| size > 0)
+    }
+}
+
+impl Resolver<'_> {
+    fn declare(&mut self, name: Symbol, binding: Binding, typ: Type) {
+        if !self.scopes.declare(name, (binding, typ)) {
+            let kind = match binding {
+                Binding::Local(stmt) if matches!(self.arena[stmt], Statement::ArrayDeclaration { .. }) => "Array",
+                _ => "Variable",
+            };
+            self.errors.push(format!("{} '{}' is already defined", kind, name));
+        }
+    }
+
+    fn statement(&mut self, stmt: StmtId) {
+        let arena = self.arena;
+        match &arena[stmt] {
+            Statement::VariableDeclaration { initializer, .. } => {
+                // The initializer can't see the variable it initializes
+                self.expression(*initializer);
+                if let Some((name, typ)) = declared(arena, stmt, self.types, self) {
+                    self.declare(name, Binding::Local(stmt), typ);
+                }
+            }
+            Statement::ArrayDeclaration { size, initializer, .. } => {
+                if let Some(size) = size {
+                    self.expression(*size);
+                }
+                self.expression(*initializer);
+                if let Some((name, typ)) = declared(arena, stmt, self.types, self) {
+                    self.declare(name, Binding::Local(stmt), typ);
+                }
+            }
+            Statement::Return(expr) | Statement::ExpressionStatement(expr) => {
+                self.expression(*expr);
+            }
+            Statement::StaticAssert { condition, .. } => {
+                self.expression(*condition);
+            }
+            Statement::Block(stmts) | Statement::AtomicBlock(stmts) => self.scope(|resolver| {
+                for &stmt in stmts {
+                    resolver.statement(stmt);
+                }
+            }),
+            Statement::If { condition, then_block, else_block } => {
+                self.expression(*condition);
+                self.scope(|resolver| resolver.statement(*then_block));
+                if let Some(else_block) = else_block {
+                    self.scope(|resolver| resolver.statement(*else_block));
+                }
+            }
+            Statement::While { condition, body } => {
+                self.expression(*condition);
+                self.scope(|resolver| resolver.statement(*body));
+            }
+            Statement::DoWhile { body, condition } => {
+                self.scope(|resolver| resolver.statement(*body));
+                self.expression(*condition);
+            }
+            Statement::For { initializer, condition, increment, body } => {
+                // The initializer's declarations are visible in the loop only
+                self.scope(|resolver| {
+                    if let Some(init) = initializer {
+                        resolver.statement(*init);
+                    }
+                    for &expr in condition.iter().chain(increment) {
+                        resolver.expression(expr);
+                    }
+                    resolver.scope(|resolver| resolver.statement(*body));
+                });
+            }
+            Statement::Switch { expression, cases } => {
+                self.expression(*expression);
+                // All cases share the switch body's scope
+                self.scope(|resolver| {
+                    for case in cases {
+                        if let Some(value) = case.value {
+                            resolver.expression(value);
+                        }
+                        for &stmt in &case.statements {
+                            resolver.statement(stmt);
+                        }
+                    }
+                });
+            }
+            Statement::Label(_, stmt)
+            | Statement::ThreadLocal { declaration: stmt }
+            | Statement::NoReturn { declaration: stmt } => self.statement(*stmt),
+            Statement::Break | Statement::Continue | Statement::Goto(_) => {}
+        }
+    }
+
+    fn scope(&mut self, f: impl FnOnce(&mut Self)) {
+        self.scopes.enter();
+        f(self);
+        self.scopes.leave();
+    }
+
+    // Resolves `expr` and its subexpressions, returning its type if known
+    fn expression(&mut self, expr: ExprId) -> Option<Type> {
+        let arena = self.arena;
+        let mut binding = None;
+        let mut field_offset = None;
+        let typ = match &arena[expr] {
+            Expression::IntegerLiteral(_) | Expression::CharLiteral(_) => Some(Type::Int),
+            Expression::StringLiteral(_) => Some(Type::Pointer(Box::new(Type::Char))),
+            Expression::FloatLiteral(_) => Some(Type::Double),
+            Expression::Variable(name) => {
+                let found = self.scopes.lookup(*name).or_else(|| self.globals.names.get(name)).cloned();
+                match found {
+                    Some((found, typ)) => {
+                        binding = Some(found);
+                        Some(typ)
+                    }
+                    None => {
+                        self.errors.push(format!("Variable '{}' is used before being defined", name));
+                        None
+                    }
+                }
+            }
+            Expression::BinaryOperation { left, operator, right } => {
+                let (left, right) = (self.expression(*left), self.expression(*right));
+                use crate::parser::ast::BinaryOp::*;
+                match operator {
+                    Equal | NotEqual | LessThan | LessThanOrEqual | GreaterThan | GreaterThanOrEqual
+                    | LogicalAnd | LogicalOr | LogicalNot => Some(Type::Int),
+                    // Shifts take the type of the value shifted
+                    LeftShift | RightShift => left.map(|left| self.promote(left)),
+                    _ => match (left, right) {
+                        (Some(left), _) if is_address(&left) => Some(decay(left)),
+                        (_, Some(right)) if is_address(&right) => Some(decay(right)),
+                        (Some(left), Some(right)) => Some(self.arithmetic(left, right)),
+                        _ => None,
+                    },
+                }
+            }
+            Expression::UnaryOperation { operator, operand } => {
+                let operand = self.expression(*operand);
+                match operator {
+                    OperatorType::Unary(UnaryOp::Dereference) => operand.and_then(pointee),
+                    OperatorType::Unary(UnaryOp::AddressOf) => operand.map(|typ| Type::Pointer(Box::new(typ))),
+                    OperatorType::Unary(UnaryOp::LogicalNot) => Some(Type::Int),
+                    OperatorType::Unary(UnaryOp::Negate | UnaryOp::BitwiseNot) => {
+                        operand.map(|typ| self.promote(typ))
+                    }
+                    // Increments and decrements keep their operand's type
+                    _ => operand,
+                }
+            }
+            Expression::Assignment { target, value } => {
+                let target = self.expression(*target);
+                self.expression(*value);
+                target
+            }
+            Expression::FunctionCall { name, arguments } => {
+                for &argument in arguments {
+                    self.expression(argument);
+                }
+                // Undeclared functions return int, as in C89
+                match self.globals.names.get(name) {
+                    Some((_, Type::Function { return_type, .. })) => Some((**return_type).clone()),
+                    _ => Some(Type::Int),
+                }
+            }
+            Expression::TernaryIf { condition, then_expr, else_expr } => {
+                self.expression(*condition);
+                let then_type = self.expression(*then_expr);
+                let else_type = self.expression(*else_expr);
+                then_type.or(else_type)
+            }
+            Expression::Cast { target_type, expr: operand } => {
+                self.expression(*operand);
+                Some(self.types.resolve(target_type))
+            }
+            Expression::SizeOf(operand) => {
+                self.expression(*operand);
+                Some(Type::UnsignedLong)
+            }
+            Expression::SizeOfType(_) | Expression::AlignOf(_) => Some(Type::UnsignedLong),
+            Expression::ArrayAccess { array, index } => {
+                let array = self.expression(*array);
+                self.expression(*index);
+                array.and_then(pointee)
+            }
+            Expression::StructFieldAccess { object, field } => {
+                let object = self.expression(*object);
+                let found = object.and_then(|object| self.types.field(&object, field));
+                found.map(|(offset, typ)| {
+                    field_offset = Some(offset);
+                    typ
+                })
+            }
+            Expression::PointerFieldAccess { pointer, field } => {
+                let pointer = self.expression(*pointer);
+                let found = pointer.and_then(pointee).and_then(|object| self.types.field(&object, field));
+                found.map(|(offset, typ)| {
+                    field_offset = Some(offset);
+                    typ
+                })
+            }
+            Expression::CompoundLiteral { type_name, initializers } => {
+                for &initializer in initializers {
+                    self.expression(initializer);
+                }
+                Some(self.types.resolve(type_name))
+            }
+            Expression::AtomicExpr { operands, .. } => {
+                let mut operands = operands.iter();
+                let object = operands.next().and_then(|&object| self.expression(object));
+                for &operand in operands {
+                    self.expression(operand);
+                }
+                object
+            }
+            node => {
+                node.for_each_child(|child| {
+                    self.expression(child);
+                });
+                None
+            }
+        };
+
+        if let Some(annotation) = self.annotations.get_mut(expr.index()) {
+            if let Some(typ) = &typ {
+                annotation.access = Access::of(typ, self.types);
+                annotation.size = self.types.size_of(typ);
+            }
+            annotation.binding = binding;
+            annotation.data_type = typ.clone();
+            annotation.field_offset = field_offset;
+        }
+        typ
+    }
+
+    // Integer promotion: anything narrower than int computes as int
+    fn promote(&self, typ: Type) -> Type {
+        if self.types.size_of(&typ) < 4 && !is_address(&typ) {
+            Type::Int
+        } else {
+            typ
+        }
+    }
+
+    // The type of arithmetic on two values: the wider, or the unsigned one
+    // of two the same width
+    fn arithmetic(&self, left: Type, right: Type) -> Type {
+        let (left, right) = (self.promote(left), self.promote(right));
+        let (left_size, right_size) = (self.types.size_of(&left), self.types.size_of(&right));
+        if right_size > left_size || (right_size == left_size && is_unsigned(&right)) {
+            right
+        } else {
+            left
+        }
+    }
+}
+
+// Arrays, and pointers after pointer arithmetic
+fn is_address(typ: &Type) -> bool {
+    matches!(strip_qualifiers(typ), Type::Pointer(_) | Type::Array(..))
+}
+
+// Arrays used as values are pointers to their first element
+fn decay(typ: Type) -> Type {
+    match typ {
+        Type::Array(element, _) => Type::Pointer(element),
+        Type::Const(inner) | Type::Volatile(inner) | Type::Restrict(inner) | Type::Atomic(inner) => decay(*inner),
+        typ => typ,
+    }
+}
+
+// The type a pointer or array refers to
+fn pointee(typ: Type) -> Option<Type> {
+    match decay(typ) {
+        Type::Pointer(inner) => Some(*inner),
+        _ => None,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+
+    #[test]
+    fn test_inner_scopes_shadow_and_restore() {
+        let source = "int x = 1;\n\
+                      int f(char x) { { int x = 2; x = 3; } return x + sizeof(x); }";
+        let program = Parser::new(Lexer::new(source).scan_tokens()).parse().unwrap();
+        let types = TypeTable::new(&program);
+        let function = &program.functions[0];
+        let (symbols, errors) = resolve(function, &Globals::new(&program, &types), &types);
+        assert!(errors.is_empty(), "{:?}", errors);
+
+        let arena = &function.arena;
+        let uses: Vec<_> = arena
+            .expr_ids()
+            .filter(|&id| matches!(arena[id], Expression::Variable(_)))
+            .map(|id| (symbols.binding(id), symbols.access(id)))
+            .collect();
+        let Statement::Block(inner) = &arena[function.body[0]] else {
+            panic!("expected a block");
+        };
+        let int = Access::Scalar { width: 4, signed: true };
+        let char = Access::Scalar { width: 1, signed: true };
+        assert_eq!(
+            uses,
+            [(Some(Binding::Local(inner[0])), int), (Some(Binding::Param(0)), char), (Some(Binding::Param(0)), char)]
+        );
+    }
+}
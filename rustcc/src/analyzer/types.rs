@@ -0,0 +1,167 @@
+// types.rs
+// Sizes, alignments and struct layouts of the program's types
+//
+// Typedef names are resolved and struct fields are laid out once for the
+// whole program, so that every later phase agrees on how wide a value is
+// and where each field lives.
+
+use crate::parser::ast::{Program, Struct, Type};
+use crate::parser::symbol::Symbol;
+use std::collections::HashMap;
+
+/// The fields of a struct at their offsets, with the size and alignment
+/// of the whole
+#[derive(Debug, Clone, Default)]
+pub struct Layout {
+    pub fields: Vec<(String, Type, usize)>, // (name, type, offset)
+    pub size: usize,
+    pub alignment: usize,
+}
+
+/// Typedefs, struct layouts and enum constants, keyed by name
+#[derive(Debug, Clone, Default)]
+pub struct TypeTable {
+    typedefs: HashMap<String, Type>,
+    structs: HashMap<String, Layout>,
+    constants: HashMap<Symbol, i32>,
+}
+
+impl TypeTable {
+    pub fn new(program: &Program) -> Self {
+        Self::declared(&program.typedefs, &program.structs, &program.enum_constants)
+    }
+
+    /// The table for the given declarations, in the order they appear
+    pub fn declared(typedefs: &[(Symbol, Type)], structs: &[Struct], constants: &[(Symbol, i32)]) -> Self {
+        let mut table = TypeTable { constants: constants.iter().copied().collect(), ..Default::default() };
+
+        // A typedef can only name types declared before it, so resolving in
+        // order leaves every entry free of typedef names
+        for (name, typ) in typedefs {
+            let typ = table.resolve(typ);
+            table.typedefs.insert(name.to_string(), typ);
+        }
+
+        for definition in structs {
+            // A forward declaration doesn't replace the definition
+            if definition.fields.is_empty() && table.structs.contains_key(&definition.name) {
+                continue;
+            }
+            let layout = table.layout(definition);
+            table.structs.insert(definition.name.clone(), layout);
+        }
+        table
+    }
+
+    fn layout(&self, definition: &Struct) -> Layout {
+        let mut layout = Layout { fields: Vec::new(), size: 0, alignment: 1 };
+        for field in &definition.fields {
+            let typ = self.resolve(&field.data_type);
+            let alignment = self.align_of(&typ);
+            let offset = layout.size.next_multiple_of(alignment);
+            layout.size = offset + self.size_of(&typ);
+            layout.alignment = layout.alignment.max(alignment);
+            layout.fields.push((field.name.clone(), typ, offset));
+        }
+        // Arrays of the struct keep every element aligned
+        layout.size = layout.size.next_multiple_of(layout.alignment);
+        layout
+    }
+
+    /// `typ` with every typedef name replaced by the type it stands for.
+    /// Unknown names are left in place.
+    pub fn resolve(&self, typ: &Type) -> Type {
+        let resolve = |inner: &Type| Box::new(self.resolve(inner));
+        match typ {
+            Type::TypeDef(name) => self.typedefs.get(name).cloned().unwrap_or_else(|| typ.clone()),
+            Type::Pointer(inner) => Type::Pointer(resolve(inner)),
+            Type::Array(inner, length) => Type::Array(resolve(inner), *length),
+            Type::Const(inner) => Type::Const(resolve(inner)),
+            Type::Volatile(inner) => Type::Volatile(resolve(inner)),
+            Type::Restrict(inner) => Type::Restrict(resolve(inner)),
+            Type::Atomic(inner) => Type::Atomic(resolve(inner)),
+            Type::Function { return_type, parameters, is_variadic } => Type::Function {
+                return_type: resolve(return_type),
+                parameters: parameters.iter().map(|(name, typ)| (name.clone(), self.resolve(typ))).collect(),
+                is_variadic: *is_variadic,
+            },
+            _ => typ.clone(),
+        }
+    }
+
+    /// Size of `typ` in bytes
+    pub fn size_of(&self, typ: &Type) -> usize {
+        match typ {
+            Type::Array(element, Some(length)) => self.size_of(element) * length,
+            Type::Array(element, None) => self.size_of(element), // VLA
+            Type::Struct(name) => self.structs.get(name).map_or(0, |layout| layout.size),
+            // A union is as large as its largest field
+            Type::Union(name) => self.structs.get(name).map_or(0, |layout| {
+                let size = layout.fields.iter().map(|(_, typ, _)| self.size_of(typ)).max().unwrap_or(0);
+                size.next_multiple_of(layout.alignment)
+            }),
+            Type::Const(inner) | Type::Volatile(inner) | Type::Restrict(inner) | Type::Atomic(inner) => {
+                self.size_of(inner)
+            }
+            Type::TypeDef(name) => self.typedefs.get(name).map_or(8, |typ| self.size_of(typ)),
+            Type::Complex => 16,
+            Type::Imaginary | Type::Generic { .. } => 8,
+            _ => typ.size(),
+        }
+    }
+
+    /// Alignment of `typ` in bytes
+    pub fn align_of(&self, typ: &Type) -> usize {
+        match typ {
+            Type::Void => 1,
+            Type::Array(element, _) => self.align_of(element),
+            Type::Struct(name) | Type::Union(name) => self.structs.get(name).map_or(8, |layout| layout.alignment),
+            Type::Const(inner) | Type::Volatile(inner) | Type::Restrict(inner) | Type::Atomic(inner) => {
+                self.align_of(inner)
+            }
+            Type::TypeDef(name) => self.typedefs.get(name).map_or(8, |typ| self.align_of(typ)),
+            Type::Complex | Type::Imaginary | Type::Generic { .. } | Type::Function { .. } => 8,
+            _ => typ.size().max(1),
+        }
+    }
+
+    /// The value of the enum constant `name`
+    pub fn constant(&self, name: Symbol) -> Option<i32> {
+        self.constants.get(&name).copied()
+    }
+
+    /// Offset and type of the field `name` of a struct or union type
+    pub fn field(&self, typ: &Type, name: &str) -> Option<(usize, Type)> {
+        let (layout, is_union) = match strip_qualifiers(typ) {
+            Type::Struct(struct_name) => (self.structs.get(struct_name)?, false),
+            Type::Union(union_name) => (self.structs.get(union_name)?, true),
+            _ => return None,
+        };
+        let (_, typ, offset) = layout.fields.iter().find(|(field, _, _)| field == name)?;
+        Some((if is_union { 0 } else { *offset }, typ.clone()))
+    }
+}
+
+/// `typ` without its const, volatile, restrict and _Atomic qualifiers
+pub fn strip_qualifiers(typ: &Type) -> &Type {
+    match typ {
+        Type::Const(inner) | Type::Volatile(inner) | Type::Restrict(inner) | Type::Atomic(inner) => {
+            strip_qualifiers(inner)
+        }
+        _ => typ,
+    }
+}
+
+/// Whether values of an integer or pointer type are zero-extended
+pub fn is_unsigned(typ: &Type) -> bool {
+    matches!(
+        strip_qualifiers(typ),
+        Type::Bool
+            | Type::UnsignedChar
+            | Type::UnsignedShort
+            | Type::UnsignedInt
+            | Type::UnsignedLong
+            | Type::UnsignedLongLong
+            | Type::Pointer(_)
+    )
+}
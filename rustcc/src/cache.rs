@@ -0,0 +1,93 @@
+// cache.rs
+// On-disk cache of compiled output for incremental rebuilds
+//
+// Entries are content-addressed: the key is a SHA-256 of everything the
+// output depends on, plus the compiler build itself, so an entry never goes
+// stale. It is only unused once its inputs change. Two levels are cached:
+// the assembly of a whole translation unit, keyed by its preprocessed source
+// and the options, and the code of each function, keyed by the function
+// itself. After an edit, the unit misses but only the changed functions are
+// generated again.
+//
+// The cache is best effort: entries are written to a temporary file and
+// renamed into place, so concurrent compilations never see half an entry,
+// and failing to read or write one just means compiling normally.
+
+use sha2::{Digest, Sha256};
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::UNIX_EPOCH;
+
+#[derive(Debug)]
+pub struct BuildCache {
+    dir: PathBuf,
+    // Identifies the running compiler, so a rebuilt compiler's output isn't
+    // mixed with the old one's
+    build: String,
+}
+
+impl BuildCache {
+    /// Opens the cache in `dir`, creating the directory if needed
+    pub fn open<P: AsRef<Path>>(dir: P) -> Result<Self, String> {
+        let dir = dir.as_ref().to_path_buf();
+        fs::create_dir_all(&dir).map_err(|e| format!("Failed to create cache directory {}: {}", dir.display(), e))?;
+        let executable = std::env::current_exe().and_then(fs::metadata).ok();
+        let build = format!(
+            "{} {:?} {:?}",
+            env!("CARGO_PKG_VERSION"),
+            executable.as_ref().map(|metadata| metadata.len()),
+            executable
+                .and_then(|metadata| metadata.modified().ok())
+                .and_then(|modified| modified.duration_since(UNIX_EPOCH).ok()),
+        );
+        Ok(BuildCache { dir, build })
+    }
+
+    /// The key of an entry depending on `parts`
+    pub fn key(&self, parts: &[&str]) -> String {
+        let mut hasher = Sha256::new();
+        hasher.update(self.build.as_bytes());
+        for part in parts {
+            // Lengths keep ["ab", "c"] and ["a", "bc"] apart
+            hasher.update((part.len() as u64).to_le_bytes());
+            hasher.update(part.as_bytes());
+        }
+        hasher.finalize().iter().map(|byte| format!("{:02x}", byte)).collect()
+    }
+
+    pub fn get(&self, key: &str) -> Option<Vec<u8>> {
+        fs::read(self.dir.join(key)).ok()
+    }
+
+    pub fn put(&self, key: &str, contents: &[u8]) {
+        static NEXT: AtomicUsize = AtomicUsize::new(0);
+        let temp = self.dir.join(format!(
+            "{}.{}.{}.tmp",
+            key,
+            std::process::id(),
+            NEXT.fetch_add(1, Ordering::Relaxed)
+        ));
+        if fs::write(&temp, contents).is_err() || fs::rename(&temp, self.dir.join(key)).is_err() {
+            let _ = fs::remove_file(&temp);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tempfile::TempDir;
+
+    #[test]
+    fn test_entries_are_found_by_their_inputs() {
+        let dir = TempDir::new().unwrap();
+        let cache = BuildCache::open(dir.path().join("cache")).unwrap();
+        let key = cache.key(&["ab", "c"]);
+        assert_ne!(key, cache.key(&["a", "bc"]));
+        assert_eq!(cache.get(&key), None);
+
+        cache.put(&key, b"output");
+        assert_eq!(BuildCache::open(dir.path().join("cache")).unwrap().get(&key), Some(b"output".to_vec()));
+    }
+}
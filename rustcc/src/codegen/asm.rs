@@ -0,0 +1,198 @@
+// asm.rs
+// Assembly listings of the x86-64 backend
+//
+// The generator builds each function as a list of lines whose instructions
+// hold the encoder's operands. The same list is printed as AT&T text for
+// `--emit=asm` and handed to the in-process assembler for `--emit=obj`, so
+// an object file never goes through text. Text is only read back for code
+// taken from the build cache.
+
+use super::object::encoder::{Address, Operand, Register};
+use std::borrow::Cow;
+use std::fmt::{self, Write as _};
+
+// Views of each register by size, as the encoder numbers them
+const REGISTERS: [[&str; 4]; 16] = [
+    ["%al", "%ax", "%eax", "%rax"],
+    ["%cl", "%cx", "%ecx", "%rcx"],
+    ["%dl", "%dx", "%edx", "%rdx"],
+    ["%bl", "%bx", "%ebx", "%rbx"],
+    ["%spl", "%sp", "%esp", "%rsp"],
+    ["%bpl", "%bp", "%ebp", "%rbp"],
+    ["%sil", "%si", "%esi", "%rsi"],
+    ["%dil", "%di", "%edi", "%rdi"],
+    ["%r8b", "%r8w", "%r8d", "%r8"],
+    ["%r9b", "%r9w", "%r9d", "%r9"],
+    ["%r10b", "%r10w", "%r10d", "%r10"],
+    ["%r11b", "%r11w", "%r11d", "%r11"],
+    ["%r12b", "%r12w", "%r12d", "%r12"],
+    ["%r13b", "%r13w", "%r13d", "%r13"],
+    ["%r14b", "%r14w", "%r14d", "%r14"],
+    ["%r15b", "%r15w", "%r15d", "%r15"],
+];
+
+const RBP: Register = Register { number: 5, size: 8 };
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Line {
+    Inst(Inst),
+    /// A label, without its colon
+    Label(String),
+    /// Directives, comments and blank lines, as they're written
+    Other(String),
+}
+
+impl Line {
+    /// Reads a line of assembly as the generator writes it. Lines that
+    /// aren't labels or instructions are kept as they are.
+    pub fn parse(line: &str) -> Result<Line, String> {
+        let text = line.trim();
+        if let Some(name) = text.strip_suffix(':') {
+            if !name.is_empty() && !name.contains(char::is_whitespace) {
+                return Ok(Line::Label(name.trim_end().to_string()));
+            }
+        }
+        if text.is_empty() || text.starts_with(['.', '#']) {
+            return Ok(Line::Other(line.to_string()));
+        }
+        let (mut mnemonic, mut operands) = text.split_once(char::is_whitespace).unwrap_or((text, ""));
+        // A lock prefix is written before the instruction it applies to
+        let locked;
+        if mnemonic == "lock" {
+            let (name, rest) = operands.trim().split_once(char::is_whitespace).unwrap_or((operands.trim(), ""));
+            locked = format!("lock {}", name);
+            (mnemonic, operands) = (&locked, rest);
+        }
+        let operands = split_operands(operands).map(Operand::parse).collect::<Result<Vec<_>, _>>()?;
+        Ok(Line::Inst(Inst { mnemonic: mnemonic.to_string().into(), operands }))
+    }
+}
+
+impl fmt::Display for Line {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Line::Inst(inst) => write!(f, "{}", inst),
+            Line::Label(name) => write!(f, "{}:", name),
+            Line::Other(line) => f.write_str(line),
+        }
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Inst {
+    pub mnemonic: Cow<'static, str>,
+    pub operands: Vec<Operand>,
+}
+
+impl Inst {
+    pub fn new<const N: usize>(mnemonic: impl Into<Cow<'static, str>>, operands: [Operand; N]) -> Self {
+        Inst { mnemonic: mnemonic.into(), operands: operands.into() }
+    }
+}
+
+impl fmt::Display for Inst {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "    {}", self.mnemonic)?;
+        for (n, operand) in self.operands.iter().enumerate() {
+            f.write_str(if n == 0 { " " } else { ", " })?;
+            write!(f, "{}", operand)?;
+        }
+        Ok(())
+    }
+}
+
+impl Register {
+    /// The register called `name`, such as `%eax`
+    pub fn named(name: &str) -> Register {
+        name.strip_prefix('%').and_then(Register::parse).unwrap_or_else(|| panic!("unknown register {}", name))
+    }
+
+    pub fn name(self) -> &'static str {
+        REGISTERS[self.number as usize][self.size.trailing_zeros() as usize]
+    }
+}
+
+impl fmt::Display for Register {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.write_str(self.name())
+    }
+}
+
+impl fmt::Display for Address {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Address::Base { base, index, displacement } => {
+                if *displacement != 0 {
+                    write!(f, "{}", displacement)?;
+                }
+                write!(f, "({}", base)?;
+                if let Some((index, scale)) = index {
+                    write!(f, ",{}", index)?;
+                    if *scale != 1 {
+                        write!(f, ",{}", scale)?;
+                    }
+                }
+                f.write_char(')')
+            }
+            Address::Rip { symbol, addend: 0 } => write!(f, "{}(%rip)", symbol),
+            Address::Rip { symbol, addend } => write!(f, "{}{:+}(%rip)", symbol, addend),
+        }
+    }
+}
+
+impl fmt::Display for Operand {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            Operand::Register(register) => write!(f, "{}", register),
+            Operand::Immediate(value) => write!(f, "${}", value),
+            Operand::Memory(address) => write!(f, "{}", address),
+            Operand::Symbol(symbol) => f.write_str(symbol),
+        }
+    }
+}
+
+/// The register called `name`
+pub fn reg(name: &str) -> Operand {
+    Operand::Register(Register::named(name))
+}
+
+pub fn imm(value: impl TryInto<i64>) -> Operand {
+    Operand::Immediate(value.try_into().unwrap_or_else(|_| panic!("immediate out of range")))
+}
+
+/// The memory `displacement` bytes from the address in the 64-bit
+/// register `base`
+pub fn mem(displacement: i32, base: &str) -> Operand {
+    Operand::Memory(Address::Base { base: Register::named(base), index: None, displacement })
+}
+
+/// A stack slot at `offset` from %rbp
+pub fn frame(offset: i32) -> Operand {
+    Operand::Memory(Address::Base { base: RBP, index: None, displacement: offset })
+}
+
+/// The global or label `symbol`, addressed relative to %rip
+pub fn rip(symbol: impl Into<String>) -> Operand {
+    Operand::Memory(Address::Rip { symbol: symbol.into(), addend: 0 })
+}
+
+/// A jump or call target
+pub fn label(name: impl Into<String>) -> Operand {
+    Operand::Symbol(name.into())
+}
+
+// Splits operands on the commas outside parentheses
+pub fn split_operands(operands: &str) -> impl Iterator<Item = &str> {
+    let mut depth = 0;
+    operands
+        .split(move |c| {
+            match c {
+                '(' => depth += 1,
+                ')' => depth -= 1,
+                _ => {}
+            }
+            c == ',' && depth == 0
+        })
+        .map(str::trim)
+        .filter(|operand| !operand.is_empty())
+}
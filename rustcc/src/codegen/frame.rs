@@ -0,0 +1,290 @@
+// frame.rs
+// Stack frame layout for the x86-64 backend
+
+use super::regalloc::{Local, RegisterAssignment};
+use crate::analyzer::types::is_unsigned;
+use crate::parser::ast::{AstArena, Expression, Function, Statement, StmtId, Type};
+use std::collections::HashMap;
+
+/// Fallback element count for arrays whose length isn't a constant
+const UNKNOWN_ARRAY_LENGTH: usize = 8;
+
+/// %rbp is only guaranteed to be 16-byte aligned, so stricter `_Alignas`
+/// requests can't be honoured without realigning the stack
+const MAX_FRAME_ALIGNMENT: usize = 16;
+
+/// Where a variable lives
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Home {
+    /// A stack slot at this offset from %rbp
+    Frame(i32),
+    /// A callee-saved register, holding the value extended to 64 bits
+    Register(&'static str),
+}
+
+/// Storage assigned to a parameter or local
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Slot {
+    pub home: Home,
+    /// Bytes moved by a load or store of the slot (1, 2, 4 or 8)
+    pub width: usize,
+    /// Whether loads sign-extend (true) or zero-extend (false) into %rax
+    pub signed: bool,
+}
+
+/// Slot assignment for one function.
+///
+/// The layout is computed in a single pass over the body before any code is
+/// emitted. Every slot is sized and aligned from the declared type, and
+/// sibling scopes (the two arms of an `if`, consecutive blocks, loop bodies)
+/// start from the same depth so they share the same stack space.
+#[derive(Debug, Clone, Default)]
+pub struct FrameLayout {
+    params: Vec<Slot>,
+    locals: HashMap<StmtId, Slot>,
+    saved_registers: Vec<(&'static str, i32)>,
+    size: usize,
+}
+
+impl FrameLayout {
+    /// Lays out `function`. Locals that `registers` placed in registers get
+    /// no stack space, but each callee-saved register they use gets a save
+    /// slot. `type_info` returns the size and alignment of a type, so struct
+    /// layouts known to the generator are respected.
+    pub fn compute<F>(
+        function: &Function,
+        register_params: usize,
+        registers: &RegisterAssignment,
+        type_info: F,
+    ) -> Self
+    where
+        F: Fn(&Type) -> (usize, usize),
+    {
+        let mut builder = FrameBuilder {
+            arena: &function.arena,
+            registers,
+            type_info,
+            depth: 0,
+            max_depth: 0,
+            locals: HashMap::new(),
+        };
+
+        let saved_registers = registers
+            .used()
+            .into_iter()
+            .map(|reg| (reg, builder.alloc(8, 8)))
+            .collect();
+
+        // Register parameters are spilled to the frame on entry unless the
+        // allocator gave them a register of their own
+        let params = function
+            .parameters
+            .iter()
+            .take(register_params)
+            .enumerate()
+            .map(|(index, param)| builder.alloc_scalar(Local::Param(index), &param.data_type, None))
+            .collect();
+
+        for &stmt in &function.body {
+            builder.visit(stmt);
+        }
+
+        FrameLayout {
+            params,
+            locals: builder.locals,
+            saved_registers,
+            size: align_up(builder.max_depth, 16),
+        }
+    }
+
+    /// Slot of the `index`th register parameter
+    pub fn param(&self, index: usize) -> Option<Slot> {
+        self.params.get(index).copied()
+    }
+
+    /// Slot of the variable declared by `decl`
+    pub fn local(&self, decl: StmtId) -> Option<Slot> {
+        self.locals.get(&decl).copied()
+    }
+
+    /// Callee-saved registers to preserve, with their save slot offsets
+    pub fn saved_registers(&self) -> &[(&'static str, i32)] {
+        &self.saved_registers
+    }
+
+    /// Total frame size, rounded up to the 16 bytes the ABI requires
+    pub fn size(&self) -> usize {
+        self.size
+    }
+}
+
+struct FrameBuilder<'a, F> {
+    arena: &'a AstArena,
+    registers: &'a RegisterAssignment,
+    type_info: F,
+    // Bytes below %rbp in use at the current point of the walk
+    depth: usize,
+    max_depth: usize,
+    locals: HashMap<StmtId, Slot>,
+}
+
+impl<F> FrameBuilder<'_, F>
+where
+    F: Fn(&Type) -> (usize, usize),
+{
+    fn visit(&mut self, stmt: StmtId) {
+        let arena = self.arena;
+        match &arena[stmt] {
+            Statement::VariableDeclaration { data_type, alignment, .. } => {
+                let slot = self.alloc_scalar(
+                    Local::Decl(stmt),
+                    data_type.as_ref().unwrap_or(&Type::Int),
+                    *alignment,
+                );
+                self.locals.insert(stmt, slot);
+            }
+            Statement::ArrayDeclaration {
+                data_type,
+                size,
+                initializer,
+                alignment,
+                ..
+            } => {
+                let element = data_type.as_ref().unwrap_or(&Type::Int);
+                let length = match size.map(|size| &arena[size]) {
+                    Some(Expression::IntegerLiteral(n)) if *n > 0 => *n as usize,
+                    // `int a[] = {...}` takes its length from the initializer
+                    None => match &arena[*initializer] {
+                        Expression::ArrayLiteral(elements) if !elements.is_empty() => elements.len(),
+                        _ => UNKNOWN_ARRAY_LENGTH,
+                    },
+                    _ => UNKNOWN_ARRAY_LENGTH,
+                };
+                let (element_size, element_alignment) = (self.type_info)(element);
+                let offset = self.alloc(
+                    element_size.max(1) * length,
+                    element_alignment.max(alignment.unwrap_or(1)),
+                );
+                self.locals.insert(stmt, Slot { home: Home::Frame(offset), width: 8, signed: true });
+            }
+            Statement::Block(stmts) | Statement::AtomicBlock(stmts) => {
+                self.scope(|builder| {
+                    for &stmt in stmts {
+                        builder.visit(stmt);
+                    }
+                });
+            }
+            Statement::If { then_block, else_block, .. } => {
+                self.scope(|builder| builder.visit(*then_block));
+                if let Some(else_block) = else_block {
+                    self.scope(|builder| builder.visit(*else_block));
+                }
+            }
+            Statement::While { body, .. } | Statement::DoWhile { body, .. } => {
+                self.scope(|builder| builder.visit(*body));
+            }
+            Statement::For { initializer, body, .. } => {
+                // The initializer's declarations are visible in the body
+                self.scope(|builder| {
+                    if let Some(init) = initializer {
+                        builder.visit(*init);
+                    }
+                    builder.scope(|builder| builder.visit(*body));
+                });
+            }
+            Statement::Switch { cases, .. } => {
+                // All cases share the switch body's scope
+                self.scope(|builder| {
+                    for case in cases {
+                        for &stmt in &case.statements {
+                            builder.visit(stmt);
+                        }
+                    }
+                });
+            }
+            Statement::Label(_, stmt) => self.visit(*stmt),
+            _ => {} // Other statement types don't allocate stack space
+        }
+    }
+
+    /// Runs `f` in a nested scope whose slots are released afterwards
+    fn scope(&mut self, f: impl FnOnce(&mut Self)) {
+        let depth = self.depth;
+        f(self);
+        self.depth = depth;
+    }
+
+    fn alloc_scalar(&mut self, local: Local, typ: &Type, alignment: Option<usize>) -> Slot {
+        let (size, natural_alignment) = (self.type_info)(typ);
+        let width = match size {
+            1 | 2 | 4 => size,
+            _ => 8, // Values move through %rax, so aggregates get at least a quadword
+        };
+        let home = match self.registers.register(local) {
+            Some(reg) => Home::Register(reg),
+            None => Home::Frame(self.alloc(size.max(width), natural_alignment.max(alignment.unwrap_or(1)))),
+        };
+        Slot {
+            home,
+            width,
+            signed: !is_unsigned(typ),
+        }
+    }
+
+    /// Reserves `size` bytes below the current depth and returns their offset
+    fn alloc(&mut self, size: usize, alignment: usize) -> i32 {
+        let alignment = alignment.clamp(1, MAX_FRAME_ALIGNMENT);
+        self.depth = align_up(self.depth + size, alignment);
+        self.max_depth = self.max_depth.max(self.depth);
+        -(self.depth as i32)
+    }
+}
+
+fn align_up(value: usize, alignment: usize) -> usize {
+    value.div_ceil(alignment) * alignment
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+
+    fn layout(source: &str) -> (Function, FrameLayout) {
+        let tokens = Lexer::new(source).scan_tokens();
+        let mut program = Parser::new(tokens).parse().unwrap();
+        let function = program.functions.remove(0);
+        let frame = FrameLayout::compute(&function, 6, &RegisterAssignment::default(), |typ| match typ {
+            Type::Char => (1, 1),
+            Type::Int => (4, 4),
+            _ => (8, 8),
+        });
+        (function, frame)
+    }
+
+    #[test]
+    fn test_slots_follow_type_size_and_alignment() {
+        let (function, frame) = layout("int f(char c) { char d = c; int x = 1; return x; }");
+        assert_eq!(frame.param(0).unwrap().home, Home::Frame(-1));
+        assert_eq!(frame.local(function.body[0]).unwrap(), Slot { home: Home::Frame(-2), width: 1, signed: true });
+        assert_eq!(frame.local(function.body[1]).unwrap(), Slot { home: Home::Frame(-8), width: 4, signed: true });
+        assert_eq!(frame.size(), 16);
+    }
+
+    #[test]
+    fn test_sibling_scopes_share_slots() {
+        let (function, frame) =
+            layout("int f() { int a = 0; if (a) { int b = 1; } else { int c = 2; } return a; }");
+        let Statement::If { then_block, else_block, .. } = &function.arena[function.body[1]] else {
+            panic!("expected if statement");
+        };
+        let first_decl = |block: StmtId| match &function.arena[block] {
+            Statement::Block(stmts) => stmts[0],
+            _ => panic!("expected block"),
+        };
+        let b = frame.local(first_decl(*then_block)).unwrap();
+        let c = frame.local(first_decl(else_block.unwrap())).unwrap();
+        assert_eq!(b.home, Home::Frame(-8));
+        assert_eq!(b.home, c.home);
+    }
+}
@@ -1,29 +1,143 @@
+// llvm.rs
+// LLVM backend
+//
+// Values follow the x86-64 generator's model: every expression is a 64-bit
+// integer, pointers included, and variables are stored at the width of
+// their declared type, extended by its signedness when loaded. Arrays and
+// structs are used by address. Functions the optimizer lowered to SSA are
+// compiled from their IR, the rest from the AST. The module then goes
+// through LLVM's new pass manager at the level matching `-O`, and
+// `compile` emits it as IR, assembly or an object file through the host's
+// `TargetMachine`.
+
+#[cfg(feature = "llvm-backend")]
+use super::OutputFormat;
+#[cfg(feature = "llvm-backend")]
+use crate::analyzer::constant;
+#[cfg(feature = "llvm-backend")]
+use crate::analyzer::types::TypeTable;
+#[cfg(feature = "llvm-backend")]
+use crate::analyzer::Analysis;
+#[cfg(feature = "llvm-backend")]
+use crate::compiler::OptimizationLevel;
+#[cfg(feature = "llvm-backend")]
+use crate::parser::ast::{
+    AstArena, AtomicOp, BinaryOp, ExprId, Expression, Function, OperatorType, Program, Statement, StmtId, Struct,
+    StructField, Type, UnaryOp,
+};
+#[cfg(feature = "llvm-backend")]
+use crate::optimizer::ir;
+#[cfg(feature = "llvm-backend")]
+use crate::parser::symbol::Symbol;
 #[cfg(feature = "llvm-backend")]
-use crate::parser::ast::{BinaryOp, Expression, Function, Program, Statement, Type};
+use inkwell::basic_block::BasicBlock;
 #[cfg(feature = "llvm-backend")]
 use inkwell::builder::Builder;
 #[cfg(feature = "llvm-backend")]
 use inkwell::context::Context;
 #[cfg(feature = "llvm-backend")]
-use inkwell::module::Module;
+use inkwell::module::{Linkage, Module};
 #[cfg(feature = "llvm-backend")]
-use inkwell::types::{BasicMetadataTypeEnum, BasicTypeEnum};
+use inkwell::passes::PassBuilderOptions;
 #[cfg(feature = "llvm-backend")]
-use inkwell::values::{BasicValueEnum, FunctionValue, PointerValue};
+use inkwell::targets::{CodeModel, FileType, InitializationConfig, RelocMode, Target, TargetMachine};
 #[cfg(feature = "llvm-backend")]
-use inkwell::AddressSpace;
+use inkwell::types::{BasicMetadataTypeEnum, BasicType, BasicTypeEnum, StructType};
+#[cfg(feature = "llvm-backend")]
+use inkwell::values::{BasicMetadataValueEnum, BasicValue, BasicValueEnum, FunctionValue, IntValue, PhiValue, PointerValue};
+#[cfg(feature = "llvm-backend")]
+use inkwell::{AddressSpace, AtomicOrdering, AtomicRMWBinOp, IntPredicate};
 #[cfg(feature = "llvm-backend")]
 use std::collections::HashMap;
 #[cfg(feature = "llvm-backend")]
+use std::io::Write;
+#[cfg(feature = "llvm-backend")]
 use std::path::Path;
 
+/// Compiles `program`, as `analysis` found it, in an LLVM context of its
+/// own, runs the pass pipeline for `opt_level` and writes the module to
+/// `out` as `format`. Functions present in `ir` are compiled from their
+/// optimized IR.
+#[cfg(feature = "llvm-backend")]
+pub fn compile(
+    program: &Program,
+    analysis: &Analysis,
+    ir: Option<&ir::Module>,
+    opt_level: OptimizationLevel,
+    format: OutputFormat,
+    out: &mut dyn Write,
+) -> Result<(), String> {
+    let machine = native_target_machine(opt_level)?;
+    let context = Context::create();
+    let mut generator = LLVMCodeGenerator::new(&context, "rustcc");
+    generator.module.set_triple(&machine.get_triple());
+    generator.module.set_data_layout(&machine.get_target_data().get_data_layout());
+
+    match ir {
+        Some(ir) => generator.generate_optimized(program, analysis, ir)?,
+        None => generator.generate(program, analysis)?,
+    }
+    generator.run_passes(&machine, opt_level)?;
+
+    let written = match format {
+        OutputFormat::LlvmIr => out.write_all(generator.get_llvm_ir().as_bytes()),
+        OutputFormat::Assembly | OutputFormat::Object => {
+            let file_type = if format == OutputFormat::Object { FileType::Object } else { FileType::Assembly };
+            let buffer = machine
+                .write_to_memory_buffer(&generator.module, file_type)
+                .map_err(|e| format!("LLVM failed to emit code: {}", e))?;
+            out.write_all(buffer.as_slice())
+        }
+    };
+    written.map_err(|e| format!("Failed to write output file: {}", e))
+}
+
+/// A target machine for the host, generating code at `opt_level`
+#[cfg(feature = "llvm-backend")]
+fn native_target_machine(opt_level: OptimizationLevel) -> Result<TargetMachine, String> {
+    Target::initialize_native(&InitializationConfig::default())
+        .map_err(|e| format!("Failed to initialize the native target: {}", e))?;
+    let triple = TargetMachine::get_default_triple();
+    let target = Target::from_triple(&triple)
+        .map_err(|e| format!("Unsupported target {}: {}", triple.as_str().to_string_lossy(), e))?;
+    let level = match opt_level {
+        OptimizationLevel::None => inkwell::OptimizationLevel::None,
+        OptimizationLevel::Basic => inkwell::OptimizationLevel::Less,
+        OptimizationLevel::Full => inkwell::OptimizationLevel::Default,
+    };
+    target
+        .create_target_machine(
+            &triple,
+            &TargetMachine::get_host_cpu_name().to_string(),
+            &TargetMachine::get_host_cpu_features().to_string(),
+            level,
+            RelocMode::PIC,
+            CodeModel::Default,
+        )
+        .ok_or_else(|| format!("Failed to create a target machine for {}", triple.as_str().to_string_lossy()))
+}
+
+/// Where a variable or other lvalue lives, and the type stored there
+#[cfg(feature = "llvm-backend")]
+#[derive(Debug, Clone)]
+struct Place<'ctx> {
+    pointer: PointerValue<'ctx>,
+    data_type: Type,
+}
+
 #[cfg(feature = "llvm-backend")]
 #[allow(dead_code)]
 pub struct LLVMCodeGenerator<'ctx> {
     context: &'ctx Context,
     module: Module<'ctx>,
     builder: Builder<'ctx>,
-    variables: HashMap<String, PointerValue<'ctx>>,
+    variables: HashMap<Symbol, Place<'ctx>>,
+    globals: HashMap<Symbol, Type>,
+    structs: HashMap<String, (StructType<'ctx>, Vec<StructField>)>,
+    types: TypeTable,
+    // (continue target, break target) of each enclosing loop or switch;
+    // a switch has no continue target of its own
+    loops: Vec<(Option<BasicBlock<'ctx>>, BasicBlock<'ctx>)>,
 }
 
 #[cfg(feature = "llvm-backend")]
@@ -35,21 +149,60 @@ impl<'ctx> LLVMCodeGenerator<'ctx> {
             module: context.create_module(module_name),
             builder: context.create_builder(),
             variables: HashMap::new(),
+            globals: HashMap::new(),
+            structs: HashMap::new(),
+            types: TypeTable::default(),
+            loops: Vec::new(),
         }
     }
 
-    pub fn generate(&mut self, program: &Program) -> Result<(), String> {
-        // Generate code for each function
-        for function in &program.functions {
-            self.compile_function(function)?;
+    pub fn generate(&mut self, program: &Program, analysis: &Analysis) -> Result<(), String> {
+        self.generate_program(program, analysis, None)
+    }
+
+    /// Like `generate`, but compiles the functions present in `ir` from
+    /// their optimized IR
+    pub fn generate_optimized(&mut self, program: &Program, analysis: &Analysis, ir: &ir::Module) -> Result<(), String> {
+        self.generate_program(program, analysis, Some(ir))
+    }
+
+    fn generate_program(&mut self, program: &Program, analysis: &Analysis, ir: Option<&ir::Module>) -> Result<(), String> {
+        self.types = analysis.types.clone();
+        self.register_structs(&program.structs)?;
+        for &global in &program.globals {
+            self.compile_global(&program.arena, global)?;
         }
 
-        // Verify the module
-        if self.module.verify().is_err() {
-            return Err("Failed to verify LLVM module".to_string());
+        // Declare everything first so calls can refer to functions defined
+        // later in the file
+        for function in &program.functions {
+            self.declare_function(function)?;
+        }
+        for function in &program.functions {
+            if function.is_external || function.body.is_empty() {
+                continue;
+            }
+            match ir.and_then(|ir| ir.function(function.name)) {
+                Some(optimized) => self.compile_ir_function(function, optimized)?,
+                None => self.compile_function(function)?,
+            }
         }
 
-        Ok(())
+        self.module
+            .verify()
+            .map_err(|e| format!("Failed to verify LLVM module: {}", e))
+    }
+
+    /// Runs LLVM's new pass manager with the default pipeline for `opt_level`
+    pub fn run_passes(&self, machine: &TargetMachine, opt_level: OptimizationLevel) -> Result<(), String> {
+        let passes = match opt_level {
+            OptimizationLevel::None => "default<O0>",
+            OptimizationLevel::Basic => "default<O1>",
+            OptimizationLevel::Full => "default<O2>",
+        };
+        self.module
+            .run_passes(passes, machine, PassBuilderOptions::create())
+            .map_err(|e| format!("LLVM pass pipeline failed: {}", e))
     }
 
     pub fn get_llvm_ir(&self) -> String {
@@ -66,63 +219,134 @@ impl<'ctx> LLVMCodeGenerator<'ctx> {
         Ok(())
     }
 
-    fn compile_function(&mut self, function: &Function) -> Result<FunctionValue<'ctx>, String> {
-        // Create function return type
-        let return_type = self.convert_type(&function.return_type)?;
-
-        // Create function parameter types - convert to BasicMetadataTypeEnum
-        let param_types: Vec<BasicMetadataTypeEnum<'ctx>> = function
-            .parameters
-            .iter()
-            .map(|param| self.convert_type(&param.data_type))
-            .collect::<Result<Vec<_>, _>>()?
-            .into_iter()
-            .map(|ty| ty.into()) // Convert BasicTypeEnum to BasicMetadataTypeEnum
-            .collect();
+    // Declares every struct before defining any, so fields can point to
+    // structs defined later
+    fn register_structs(&mut self, structs: &[Struct]) -> Result<(), String> {
+        for struct_def in structs {
+            let struct_type = self.context.opaque_struct_type(&struct_def.name);
+            self.structs.insert(struct_def.name.clone(), (struct_type, struct_def.fields.clone()));
+        }
+        for struct_def in structs {
+            let fields = struct_def
+                .fields
+                .iter()
+                .map(|field| self.convert_type(&field.data_type))
+                .collect::<Result<Vec<_>, _>>()?;
+            self.structs[&struct_def.name].0.set_body(&fields, false);
+        }
+        Ok(())
+    }
 
-        // Create LLVM function type
-        let fn_type = match return_type {
-            BasicTypeEnum::IntType(int_type) => int_type.fn_type(&param_types, false),
-            // Add other types as needed
-            _ => return Err("Unsupported return type".to_string()),
+    fn compile_global(&mut self, arena: &AstArena, global: StmtId) -> Result<(), String> {
+        let (name, data_type, initializer, alignment) = match &arena[global] {
+            Statement::VariableDeclaration { name, data_type, initializer, alignment, .. } => {
+                (*name, data_type.clone().unwrap_or(Type::Int), *initializer, *alignment)
+            }
+            Statement::ArrayDeclaration { name, data_type, size, initializer, alignment, .. } => {
+                let element = data_type.clone().unwrap_or(Type::Int);
+                let length = match size {
+                    Some(size) => constant::evaluate(arena, *size, &self.types),
+                    None => match &arena[*initializer] {
+                        Expression::ArrayLiteral(elements) => Some(elements.len() as i64),
+                        _ => None,
+                    },
+                };
+                let length = length
+                    .and_then(|length| usize::try_from(length).ok())
+                    .ok_or_else(|| format!("Global array {} needs a constant size", name))?;
+                (*name, Type::Array(Box::new(element), Some(length)), *initializer, *alignment)
+            }
+            _ => return Ok(()),
         };
 
-        // Create the function
-        let function_value = self.module.add_function(&function.name, fn_type, None);
+        let ty = self.convert_type(&data_type)?;
+        let value = match self.constant_initializer(arena, initializer, ty) {
+            Some(value) => value,
+            None => ty.const_zero(),
+        };
+        let variable = self.module.add_global(ty, Some(AddressSpace::default()), name.as_str());
+        variable.set_initializer(&value);
+        if let Some(alignment) = alignment {
+            variable.set_alignment(alignment as u32);
+        }
+        // The compiler's own globals, such as encrypted strings, stay local
+        // to the file as the x86-64 backend keeps them
+        if name.as_str().starts_with("L.") {
+            variable.set_linkage(Linkage::Private);
+        }
+        self.globals.insert(name, data_type);
+        Ok(())
+    }
 
-        // Create a basic block for the function
-        let basic_block = self.context.append_basic_block(function_value, "entry");
-        self.builder.position_at_end(basic_block);
+    /// The constant `expr` as a value of `ty`, if it is one
+    fn constant_initializer(&self, arena: &AstArena, expr: ExprId, ty: BasicTypeEnum<'ctx>) -> Option<BasicValueEnum<'ctx>> {
+        match (ty, &arena[expr]) {
+            (BasicTypeEnum::IntType(int_type), _) => {
+                Some(int_type.const_int(constant::evaluate(arena, expr, &self.types)? as u64, true).into())
+            }
+            (BasicTypeEnum::PointerType(_), Expression::StringLiteral(string)) => {
+                let bytes = self.context.const_string(string.as_bytes(), true);
+                let storage = self.module.add_global(bytes.get_type(), None, ".str");
+                storage.set_initializer(&bytes);
+                storage.set_constant(true);
+                Some(storage.as_pointer_value().into())
+            }
+            (BasicTypeEnum::ArrayType(array_type), Expression::ArrayLiteral(elements)) => {
+                let BasicTypeEnum::IntType(element_type) = array_type.get_element_type() else {
+                    return None;
+                };
+                let mut values = Vec::with_capacity(array_type.len() as usize);
+                for &element in elements.iter().take(array_type.len() as usize) {
+                    values.push(element_type.const_int(constant::evaluate(arena, element, &self.types)? as u64, true));
+                }
+                values.resize(array_type.len() as usize, element_type.const_zero());
+                Some(element_type.const_array(&values).into())
+            }
+            _ => None,
+        }
+    }
 
-        // Clear variables from previous compilation
+    fn compile_function(&mut self, function: &Function) -> Result<(), String> {
+        let function_value = self.declare_function(function)?;
+        let entry = self.context.append_basic_block(function_value, "entry");
+        self.builder.position_at_end(entry);
         self.variables.clear();
+        self.loops.clear();
 
-        // Allocate space for parameters
+        // Parameters live in stack slots like other locals, which LLVM
+        // promotes to registers
         for (i, param) in function.parameters.iter().enumerate() {
-            let param_value = function_value
+            let value = function_value
                 .get_nth_param(i as u32)
                 .ok_or_else(|| format!("Failed to get parameter {}", i))?;
-
-            let alloca = self.create_entry_block_alloca(&param.name, param_value.get_type())?;
+            // Array parameters are pointers
+            let data_type = match Self::unqualified(&param.data_type) {
+                Type::Array(element, _) => Type::Pointer(element.clone()),
+                data_type => data_type.clone(),
+            };
+            let pointer = self.create_entry_block_alloca(param.name.as_str(), value.get_type())?;
             self.builder
-                .build_store(alloca, param_value)
+                .build_store(pointer, value)
                 .map_err(|e| format!("Failed to store parameter {}: {}", param.name, e))?;
-            self.variables.insert(param.name.clone(), alloca);
+            self.variables.insert(param.name, Place { pointer, data_type });
         }
 
-        // Compile the function body
-        for statement in &function.body {
-            self.compile_statement(statement, function_value)?;
+        for &statement in &function.body {
+            self.compile_statement(&function.arena, statement)?;
         }
 
-        // Verify the function
+        // Falling off the end returns 0, as with the x86-64 generator
+        self.build_return(function_value, None)?;
+
         if function_value.verify(true) {
-            Ok(function_value)
+            Ok(())
         } else {
             Err(format!("Failed to verify function {}", function.name))
         }
     }
 
+    // Allocas all go at the start of the entry block, where LLVM's mem2reg
+    // looks for them
     fn create_entry_block_alloca(
         &self,
         name: &str,
@@ -130,135 +354,1077 @@ impl<'ctx> LLVMCodeGenerator<'ctx> {
     ) -> Result<PointerValue<'ctx>, String> {
         let builder = self.context.create_builder();
         let entry = self
-            .builder
-            .get_insert_block()
+            .current_function()
+            .get_first_basic_block()
             .ok_or_else(|| "No current block to insert into".to_string())?;
 
-        // Replace position_at_start with position_at
-        // If entry has no instructions yet, use position_at_end instead
-        let first_instruction = entry.get_first_instruction();
-        if let Some(instr) = first_instruction {
-            builder.position_before(&instr);
-        } else {
-            builder.position_at_end(entry);
+        match entry.get_first_instruction() {
+            Some(instr) => builder.position_before(&instr),
+            None => builder.position_at_end(entry),
         }
 
-        // Add proper error handling with expect
-        let alloca = builder
+        builder
             .build_alloca(ty, name)
-            .map_err(|e| format!("Failed to allocate memory: {}", e))?;
+            .map_err(|e| format!("Failed to allocate memory: {}", e))
+    }
+
+    fn current_function(&self) -> FunctionValue<'ctx> {
+        self.builder
+            .get_insert_block()
+            .and_then(|block| block.get_parent())
+            .expect("builder is positioned in a function")
+    }
+
+    // Code after a return, break or continue can't be reached. It goes into
+    // a block of its own, so every block keeps a single terminator at its
+    // end.
+    fn continue_in_new_block(&self) {
+        let block = self.context.append_basic_block(self.current_function(), "dead");
+        self.builder.position_at_end(block);
+    }
 
-        Ok(alloca)
+    fn branch(&self, target: BasicBlock<'ctx>) -> Result<(), String> {
+        self.builder
+            .build_unconditional_branch(target)
+            .map_err(|e| format!("Failed to build branch: {}", e))?;
+        Ok(())
     }
 
-    fn compile_statement(
+    fn conditional_branch(
         &mut self,
-        statement: &Statement,
-        _function: FunctionValue<'ctx>,
+        arena: &AstArena,
+        condition: ExprId,
+        then_block: BasicBlock<'ctx>,
+        else_block: BasicBlock<'ctx>,
     ) -> Result<(), String> {
-        match statement {
+        let condition = self.compile_condition(arena, condition)?;
+        self.builder
+            .build_conditional_branch(condition, then_block, else_block)
+            .map_err(|e| format!("Failed to build branch: {}", e))?;
+        Ok(())
+    }
+
+    fn compile_statement(&mut self, arena: &AstArena, statement: StmtId) -> Result<(), String> {
+        let function = self.current_function();
+        match &arena[statement] {
             Statement::Return(expr) => {
-                let return_value = self.compile_expression(expr)?;
+                let value = self.compile_expression(arena, *expr)?;
+                self.build_return(function, Some(value))?;
+                self.continue_in_new_block();
+            }
+            Statement::VariableDeclaration { name, data_type, initializer, .. } => {
+                let data_type = data_type.clone().unwrap_or(Type::Int);
+                let ty = self.convert_type(&data_type)?;
+                let pointer = self.create_entry_block_alloca(name.as_str(), ty)?;
+                let place = Place { pointer, data_type };
+                self.initialize(arena, &place, *initializer)?;
+                self.variables.insert(*name, place);
+            }
+            Statement::ArrayDeclaration { name, data_type, size, initializer, .. } => {
+                let element = data_type.clone().unwrap_or(Type::Int);
+                let length = match size {
+                    Some(size) => constant::evaluate(arena, *size, &self.types),
+                    None => match &arena[*initializer] {
+                        Expression::ArrayLiteral(elements) => Some(elements.len() as i64),
+                        _ => None,
+                    },
+                };
+                let place = match (length.and_then(|length| usize::try_from(length).ok()), size) {
+                    (Some(length), _) => {
+                        let data_type = Type::Array(Box::new(element), Some(length));
+                        let ty = self.convert_type(&data_type)?;
+                        Place { pointer: self.create_entry_block_alloca(name.as_str(), ty)?, data_type }
+                    }
+                    // A variable length array is allocated where it's declared
+                    (None, Some(size)) => {
+                        let length = self.compile_expression(arena, *size)?;
+                        let ty = self.convert_type(&element)?;
+                        let pointer = self
+                            .builder
+                            .build_array_alloca(ty, length, name.as_str())
+                            .map_err(|e| format!("Failed to allocate memory: {}", e))?;
+                        Place { pointer, data_type: Type::Array(Box::new(element), None) }
+                    }
+                    (None, None) => return Err(format!("Array {} has no size", name)),
+                };
+                self.initialize(arena, &place, *initializer)?;
+                self.variables.insert(*name, place);
+            }
+            Statement::ExpressionStatement(expr) => {
+                self.compile_expression(arena, *expr)?;
+            }
+            Statement::Block(statements) | Statement::AtomicBlock(statements) => {
+                // Declarations go out of scope at the end of the block
+                let outer = self.variables.clone();
+                for &statement in statements {
+                    self.compile_statement(arena, statement)?;
+                }
+                self.variables = outer;
+            }
+            Statement::If { condition, then_block, else_block } => {
+                let then_bb = self.context.append_basic_block(function, "then");
+                let else_bb = else_block.map(|_| self.context.append_basic_block(function, "else"));
+                let end_bb = self.context.append_basic_block(function, "if_end");
+
+                self.conditional_branch(arena, *condition, then_bb, else_bb.unwrap_or(end_bb))?;
+                self.builder.position_at_end(then_bb);
+                self.compile_statement(arena, *then_block)?;
+                self.branch(end_bb)?;
+                if let (Some(else_bb), Some(else_block)) = (else_bb, else_block) {
+                    self.builder.position_at_end(else_bb);
+                    self.compile_statement(arena, *else_block)?;
+                    self.branch(end_bb)?;
+                }
+                self.builder.position_at_end(end_bb);
+            }
+            Statement::While { condition, body } => {
+                let condition_bb = self.context.append_basic_block(function, "while_cond");
+                let body_bb = self.context.append_basic_block(function, "while_body");
+                let end_bb = self.context.append_basic_block(function, "while_end");
+
+                self.branch(condition_bb)?;
+                self.builder.position_at_end(condition_bb);
+                self.conditional_branch(arena, *condition, body_bb, end_bb)?;
+                self.builder.position_at_end(body_bb);
+                self.compile_loop_body(arena, *body, condition_bb, end_bb)?;
+                self.branch(condition_bb)?;
+                self.builder.position_at_end(end_bb);
+            }
+            Statement::DoWhile { body, condition } => {
+                let body_bb = self.context.append_basic_block(function, "do_body");
+                let condition_bb = self.context.append_basic_block(function, "do_cond");
+                let end_bb = self.context.append_basic_block(function, "do_end");
+
+                self.branch(body_bb)?;
+                self.builder.position_at_end(body_bb);
+                self.compile_loop_body(arena, *body, condition_bb, end_bb)?;
+                self.branch(condition_bb)?;
+                self.builder.position_at_end(condition_bb);
+                self.conditional_branch(arena, *condition, body_bb, end_bb)?;
+                self.builder.position_at_end(end_bb);
+            }
+            Statement::For { initializer, condition, increment, body } => {
+                // The initializer's declarations are local to the loop
+                let outer = self.variables.clone();
+                if let Some(initializer) = initializer {
+                    self.compile_statement(arena, *initializer)?;
+                }
+
+                let condition_bb = self.context.append_basic_block(function, "for_cond");
+                let body_bb = self.context.append_basic_block(function, "for_body");
+                let increment_bb = self.context.append_basic_block(function, "for_inc");
+                let end_bb = self.context.append_basic_block(function, "for_end");
+
+                self.branch(condition_bb)?;
+                self.builder.position_at_end(condition_bb);
+                match condition {
+                    Some(condition) => self.conditional_branch(arena, *condition, body_bb, end_bb)?,
+                    // No condition means loop forever (until break)
+                    None => self.branch(body_bb)?,
+                }
+                self.builder.position_at_end(body_bb);
+                self.compile_loop_body(arena, *body, increment_bb, end_bb)?;
+                self.branch(increment_bb)?;
+                self.builder.position_at_end(increment_bb);
+                if let Some(increment) = increment {
+                    self.compile_expression(arena, *increment)?;
+                }
+                self.branch(condition_bb)?;
+                self.builder.position_at_end(end_bb);
+                self.variables = outer;
+            }
+            Statement::Break => {
+                let (_, target) = *self.loops.last().ok_or_else(|| "break outside of a loop or switch".to_string())?;
+                self.branch(target)?;
+                self.continue_in_new_block();
+            }
+            Statement::Continue => {
+                let target = self
+                    .loops
+                    .last()
+                    .and_then(|&(target, _)| target)
+                    .ok_or_else(|| "continue outside of a loop".to_string())?;
+                self.branch(target)?;
+                self.continue_in_new_block();
+            }
+            Statement::Switch { expression, cases } => {
+                let value = self.compile_expression(arena, *expression)?;
+                let end_bb = self.context.append_basic_block(function, "switch_end");
+                let case_bbs: Vec<BasicBlock<'ctx>> =
+                    cases.iter().map(|_| self.context.append_basic_block(function, "case")).collect();
+
+                let i64_type = self.context.i64_type();
+                let mut default_bb = end_bb;
+                let mut table = Vec::with_capacity(cases.len());
+                for (case, &case_bb) in cases.iter().zip(&case_bbs) {
+                    match case.value {
+                        Some(label) => {
+                            let label = constant::evaluate(arena, label, &self.types)
+                                .ok_or_else(|| "case label is not an integer constant".to_string())?;
+                            table.push((i64_type.const_int(label as u64, true), case_bb));
+                        }
+                        None => default_bb = case_bb,
+                    }
+                }
                 self.builder
-                    .build_return(Some(&return_value))
-                    .map_err(|e| format!("Failed to build return: {}", e))?;
-            }
-            Statement::VariableDeclaration {
-                name,
-                data_type: _,
-                initializer,
-            } => {
-                let init_val = self.compile_expression(initializer)?;
-                let alloca = self.create_entry_block_alloca(name, init_val.get_type())?;
+                    .build_switch(value, default_bb, &table)
+                    .map_err(|e| format!("Failed to build switch: {}", e))?;
+
+                // continue still refers to the enclosing loop
+                let continue_target = self.loops.last().and_then(|&(target, _)| target);
+                self.loops.push((continue_target, end_bb));
+                for (i, case) in cases.iter().enumerate() {
+                    self.builder.position_at_end(case_bbs[i]);
+                    for &statement in &case.statements {
+                        self.compile_statement(arena, statement)?;
+                    }
+                    // Cases fall through into the next
+                    self.branch(case_bbs.get(i + 1).copied().unwrap_or(end_bb))?;
+                }
+                self.loops.pop();
+                self.builder.position_at_end(end_bb);
+            }
+            Statement::ThreadLocal { declaration } | Statement::NoReturn { declaration } => {
+                self.compile_statement(arena, *declaration)?;
+            }
+            // Checked during semantic analysis
+            Statement::StaticAssert { .. } => {}
+            Statement::Goto(_) | Statement::Label(..) => {
+                return Err("goto is not supported by the LLVM backend".to_string());
+            }
+        }
+
+        Ok(())
+    }
+
+    fn compile_loop_body(
+        &mut self,
+        arena: &AstArena,
+        body: StmtId,
+        continue_target: BasicBlock<'ctx>,
+        break_target: BasicBlock<'ctx>,
+    ) -> Result<(), String> {
+        self.loops.push((Some(continue_target), break_target));
+        let result = self.compile_statement(arena, body);
+        self.loops.pop();
+        result
+    }
+
+    /// Stores the initial value of a declared variable
+    fn initialize(&mut self, arena: &AstArena, place: &Place<'ctx>, initializer: ExprId) -> Result<(), String> {
+        match Self::unqualified(&place.data_type) {
+            Type::Array(element, _) => {
+                let Expression::ArrayLiteral(elements) = &arena[initializer] else {
+                    return Ok(());
+                };
+                let element_type = self.convert_type(element)?;
+                for (i, &value) in elements.iter().enumerate() {
+                    let index = self.context.i64_type().const_int(i as u64, false);
+                    // SAFETY: the index is within the declared array
+                    let pointer = unsafe { self.builder.build_in_bounds_gep(element_type, place.pointer, &[index], "init") }
+                        .map_err(|e| format!("Failed to build element address: {}", e))?;
+                    let value = self.compile_expression(arena, value)?;
+                    self.store(&Place { pointer, data_type: (**element).clone() }, value)?;
+                }
+            }
+            Type::Struct(name) => {
+                let Expression::ArrayLiteral(values) = &arena[initializer] else {
+                    return Ok(());
+                };
+                let fields = self.structs.get(name).map(|(_, fields)| fields.clone()).unwrap_or_default();
+                for (field, &value) in fields.iter().zip(values) {
+                    let field = self.field(place.pointer, &place.data_type, &field.name)?;
+                    let value = self.compile_expression(arena, value)?;
+                    self.store(&field, value)?;
+                }
+            }
+            _ => {
+                let value = self.compile_expression(arena, initializer)?;
+                self.store(place, value)?;
+            }
+        }
+        Ok(())
+    }
+
+    /// `expr` as an i1, true when it's non-zero
+    fn compile_condition(&mut self, arena: &AstArena, expr: ExprId) -> Result<IntValue<'ctx>, String> {
+        let value = self.compile_expression(arena, expr)?;
+        self.builder
+            .build_int_compare(IntPredicate::NE, value, self.context.i64_type().const_zero(), "cond")
+            .map_err(|e| format!("Failed to build comparison: {}", e))
+    }
+
+    fn compile_expression(&mut self, arena: &AstArena, expr: ExprId) -> Result<IntValue<'ctx>, String> {
+        let i64_type = self.context.i64_type();
+        let error = |what: &str| move |e| format!("Failed to build {}: {}", what, e);
+
+        Ok(match &arena[expr] {
+            Expression::IntegerLiteral(value) => i64_type.const_int(*value as i64 as u64, true),
+            Expression::CharLiteral(value) => i64_type.const_int(*value as u8 as u64, false),
+            Expression::StringLiteral(value) => {
+                let string = self.builder.build_global_string_ptr(value, "str").map_err(error("string"))?;
                 self.builder
-                    .build_store(alloca, init_val)
-                    .map_err(|e| format!("Failed to store variable {}: {}", name, e))?;
-                self.variables.insert(name.clone(), alloca);
+                    .build_ptr_to_int(string.as_pointer_value(), i64_type, "str")
+                    .map_err(error("conversion"))?
+            }
+            Expression::FloatLiteral(_) => {
+                return Err("Floating-point values are not supported by the LLVM backend".to_string());
+            }
+            Expression::Variable(_)
+            | Expression::ArrayAccess { .. }
+            | Expression::StructFieldAccess { .. }
+            | Expression::PointerFieldAccess { .. }
+            | Expression::UnaryOperation { operator: OperatorType::Unary(UnaryOp::Dereference), .. } => {
+                let place = self.place(arena, expr)?;
+                self.load(&place)?
+            }
+            Expression::BinaryOperation { left, operator, right } => match operator {
+                BinaryOp::LogicalAnd | BinaryOp::LogicalOr => {
+                    self.compile_logical(arena, *left, *operator == BinaryOp::LogicalAnd, *right)?
+                }
+                _ => {
+                    let op = Self::binary_op(*operator)?;
+                    let left_value = self.compile_expression(arena, *left)?;
+                    let mut right_value = self.compile_expression(arena, *right)?;
+                    // Pointer arithmetic counts in elements
+                    if matches!(op, ir::BinOp::Add | ir::BinOp::Sub) {
+                        if let Some(element) = self.pointee(arena, *left) {
+                            if self.pointee(arena, *right).is_none() {
+                                let size = self.size_of(&element)?;
+                                right_value = self.builder.build_int_mul(right_value, size, "scaled").map_err(error("multiplication"))?;
+                            }
+                        }
+                    }
+                    self.compile_ir_binary(op, left_value, right_value)?
+                }
+            },
+            Expression::UnaryOperation { operator, operand } => match operator {
+                OperatorType::Unary(UnaryOp::AddressOf) => {
+                    let place = self.place(arena, *operand)?;
+                    self.builder.build_ptr_to_int(place.pointer, i64_type, "addr").map_err(error("conversion"))?
+                }
+                OperatorType::Unary(
+                    op @ (UnaryOp::PreIncrement | UnaryOp::PreDecrement | UnaryOp::PostIncrement | UnaryOp::PostDecrement),
+                ) => {
+                    let place = self.place(arena, *operand)?;
+                    let old = self.load(&place)?;
+                    // Pointers step by their element size
+                    let step = match Self::element_type(&place.data_type) {
+                        Some(element) => self.size_of(element)?,
+                        None => i64_type.const_int(1, false),
+                    };
+                    let new = if matches!(op, UnaryOp::PreIncrement | UnaryOp::PostIncrement) {
+                        self.builder.build_int_add(old, step, "inc")
+                    } else {
+                        self.builder.build_int_sub(old, step, "dec")
+                    }
+                    .map_err(error("increment"))?;
+                    let new = self.store(&place, new)?;
+                    if matches!(op, UnaryOp::PreIncrement | UnaryOp::PreDecrement) { new } else { old }
+                }
+                OperatorType::Unary(op) => {
+                    let operand = self.compile_expression(arena, *operand)?;
+                    match op {
+                        UnaryOp::Negate => self.builder.build_int_neg(operand, "neg").map_err(error("negation"))?,
+                        UnaryOp::BitwiseNot => self.builder.build_not(operand, "not").map_err(error("complement"))?,
+                        UnaryOp::LogicalNot => {
+                            let zero = self
+                                .builder
+                                .build_int_compare(IntPredicate::EQ, operand, i64_type.const_zero(), "lnot")
+                                .map_err(error("comparison"))?;
+                            self.builder.build_int_z_extend(zero, i64_type, "lnot").map_err(error("extension"))?
+                        }
+                        _ => unreachable!("handled above"),
+                    }
+                }
+                OperatorType::Binary(op) => {
+                    return Err(format!("Binary operator {:?} used as a unary operator", op));
+                }
+            },
+            Expression::Assignment { target, value } => {
+                let value = self.compile_expression(arena, *value)?;
+                let place = self.place(arena, *target)?;
+                self.store(&place, value)?
+            }
+            Expression::FunctionCall { name, arguments } => {
+                let arguments = arguments
+                    .iter()
+                    .map(|&argument| self.compile_expression(arena, argument))
+                    .collect::<Result<Vec<_>, _>>()?;
+                self.call(*name, &arguments)?
+            }
+            Expression::TernaryIf { condition, then_expr, else_expr } => {
+                let function = self.current_function();
+                let then_bb = self.context.append_basic_block(function, "cond_then");
+                let else_bb = self.context.append_basic_block(function, "cond_else");
+                let end_bb = self.context.append_basic_block(function, "cond_end");
+
+                self.conditional_branch(arena, *condition, then_bb, else_bb)?;
+                let mut incoming = Vec::with_capacity(2);
+                for (block, expr) in [(then_bb, *then_expr), (else_bb, *else_expr)] {
+                    self.builder.position_at_end(block);
+                    let value = self.compile_expression(arena, expr)?;
+                    incoming.push((value, self.builder.get_insert_block().expect("builder is positioned")));
+                    self.branch(end_bb)?;
+                }
+                self.builder.position_at_end(end_bb);
+                let phi = self.builder.build_phi(i64_type, "cond").map_err(error("phi"))?;
+                for (value, block) in &incoming {
+                    phi.add_incoming(&[(value as &dyn BasicValue<'ctx>, *block)]);
+                }
+                phi.as_basic_value().into_int_value()
+            }
+            Expression::Cast { target_type, expr } => {
+                let value = self.compile_expression(arena, *expr)?;
+                self.cast(value, target_type)?
             }
-            // Implement other statement types
-            _ => return Err("Statement type not yet implemented for LLVM".to_string()),
+            Expression::SizeOf(operand) => {
+                let data_type = self
+                    .expr_type(arena, *operand)
+                    .ok_or_else(|| "Can't determine the type of the sizeof operand".to_string())?;
+                self.size_of(&data_type)?
+            }
+            Expression::SizeOfType(data_type) => self.size_of(data_type)?,
+            Expression::AtomicExpr { operation, operands } => self.compile_atomic(arena, *operation, operands)?,
+            other => return Err(format!("Expression not supported by the LLVM backend: {:?}", other)),
+        })
+    }
+
+    // A sequentially consistent operation on the 64-bit object `operands[0]`
+    fn compile_atomic(&mut self, arena: &AstArena, operation: AtomicOp, operands: &[ExprId]) -> Result<IntValue<'ctx>, String> {
+        let arity = match operation {
+            AtomicOp::Load => 1,
+            AtomicOp::CompareExchange => 3,
+            _ => 2,
+        };
+        if operands.len() != arity {
+            return Err(format!("Atomic {:?} takes {} operands", operation, arity));
+        }
+        let values = operands[1..]
+            .iter()
+            .map(|&operand| self.compile_expression(arena, operand))
+            .collect::<Result<Vec<_>, _>>()?;
+        let pointer = self.place(arena, operands[0])?.pointer;
+        let ordering = AtomicOrdering::SequentiallyConsistent;
+        let error = |what: &str| move |e| format!("Failed to build atomic {}: {}", what, e);
+        let order = |instruction: inkwell::values::InstructionValue<'ctx>| {
+            instruction
+                .set_alignment(8)
+                .and_then(|()| instruction.set_atomic_ordering(ordering))
+                .map_err(|e| format!("Failed to build atomic access: {}", e))
+        };
+
+        let op = match operation {
+            AtomicOp::Load => {
+                let value = self.builder.build_load(self.context.i64_type(), pointer, "atomic").map_err(error("load"))?;
+                order(value.as_instruction_value().expect("a load is an instruction"))?;
+                return Ok(value.into_int_value());
+            }
+            AtomicOp::Store => {
+                order(self.builder.build_store(pointer, values[0]).map_err(error("store"))?)?;
+                return Ok(values[0]);
+            }
+            AtomicOp::CompareExchange => {
+                let result = self
+                    .builder
+                    .build_cmpxchg(pointer, values[0], values[1], ordering, ordering)
+                    .map_err(error("compare-exchange"))?;
+                let old = self.builder.build_extract_value(result, 0, "old").map_err(error("compare-exchange"))?;
+                return Ok(old.into_int_value());
+            }
+            AtomicOp::Exchange => AtomicRMWBinOp::Xchg,
+            AtomicOp::FetchAdd => AtomicRMWBinOp::Add,
+            AtomicOp::FetchSub => AtomicRMWBinOp::Sub,
+            AtomicOp::FetchAnd => AtomicRMWBinOp::And,
+            AtomicOp::FetchOr => AtomicRMWBinOp::Or,
+            AtomicOp::FetchXor => AtomicRMWBinOp::Xor,
+        };
+        self.builder
+            .build_atomicrmw(op, pointer, values[0], ordering)
+            .map_err(error("read-modify-write"))
+    }
+
+    // Short-circuit && and ||, giving 0 or 1
+    fn compile_logical(&mut self, arena: &AstArena, left: ExprId, is_and: bool, right: ExprId) -> Result<IntValue<'ctx>, String> {
+        let function = self.current_function();
+        let right_bb = self.context.append_basic_block(function, "logical_rhs");
+        let end_bb = self.context.append_basic_block(function, "logical_end");
+
+        let left = self.compile_condition(arena, left)?;
+        let left_bb = self.builder.get_insert_block().expect("builder is positioned");
+        let (then_bb, else_bb) = if is_and { (right_bb, end_bb) } else { (end_bb, right_bb) };
+        self.builder
+            .build_conditional_branch(left, then_bb, else_bb)
+            .map_err(|e| format!("Failed to build branch: {}", e))?;
+
+        self.builder.position_at_end(right_bb);
+        let right = self.compile_condition(arena, right)?;
+        let right_end_bb = self.builder.get_insert_block().expect("builder is positioned");
+        self.branch(end_bb)?;
+
+        self.builder.position_at_end(end_bb);
+        let bool_type = self.context.bool_type();
+        let phi = self
+            .builder
+            .build_phi(bool_type, "logical")
+            .map_err(|e| format!("Failed to build phi: {}", e))?;
+        let short_circuit = bool_type.const_int(u64::from(!is_and), false);
+        phi.add_incoming(&[
+            (&short_circuit as &dyn BasicValue<'ctx>, left_bb),
+            (&right as &dyn BasicValue<'ctx>, right_end_bb),
+        ]);
+        self.builder
+            .build_int_z_extend(phi.as_basic_value().into_int_value(), self.context.i64_type(), "logical")
+            .map_err(|e| format!("Failed to build extension: {}", e))
+    }
+
+    /// The IR operator computing `op`, which the two backends share
+    fn binary_op(op: BinaryOp) -> Result<ir::BinOp, String> {
+        Ok(match op {
+            BinaryOp::Add => ir::BinOp::Add,
+            BinaryOp::Subtract => ir::BinOp::Sub,
+            BinaryOp::Multiply => ir::BinOp::Mul,
+            BinaryOp::Divide => ir::BinOp::Div,
+            BinaryOp::Modulo => ir::BinOp::Mod,
+            BinaryOp::BitwiseAnd => ir::BinOp::And,
+            BinaryOp::BitwiseOr => ir::BinOp::Or,
+            BinaryOp::BitwiseXor => ir::BinOp::Xor,
+            BinaryOp::LeftShift => ir::BinOp::Shl,
+            BinaryOp::RightShift => ir::BinOp::Shr,
+            BinaryOp::Equal => ir::BinOp::Eq,
+            BinaryOp::NotEqual => ir::BinOp::Ne,
+            BinaryOp::LessThan => ir::BinOp::Lt,
+            BinaryOp::LessThanOrEqual => ir::BinOp::Le,
+            BinaryOp::GreaterThan => ir::BinOp::Gt,
+            BinaryOp::GreaterThanOrEqual => ir::BinOp::Ge,
+            op => return Err(format!("Binary operator {:?} is not supported by the LLVM backend", op)),
+        })
+    }
+
+    /// Where the lvalue `expr` is stored
+    fn place(&mut self, arena: &AstArena, expr: ExprId) -> Result<Place<'ctx>, String> {
+        match &arena[expr] {
+            Expression::Variable(name) => Ok(self.variable(*name)),
+            Expression::ArrayAccess { array, index } => {
+                // Elements of unknown type are 8 bytes, as in the x86-64
+                // generator
+                let element = self.pointee(arena, *array).unwrap_or(Type::Long);
+                let base = self.compile_pointer(arena, *array)?;
+                let index = self.compile_expression(arena, *index)?;
+                let element_type = self.convert_type(&element)?;
+                // SAFETY: C leaves indexing outside the array undefined
+                let pointer = unsafe { self.builder.build_in_bounds_gep(element_type, base, &[index], "element") }
+                    .map_err(|e| format!("Failed to build element address: {}", e))?;
+                Ok(Place { pointer, data_type: element })
+            }
+            Expression::UnaryOperation { operator: OperatorType::Unary(UnaryOp::Dereference), operand } => {
+                let data_type = self.pointee(arena, *operand).unwrap_or(Type::Long);
+                let pointer = self.compile_pointer(arena, *operand)?;
+                Ok(Place { pointer, data_type })
+            }
+            Expression::StructFieldAccess { object, field } => {
+                let object = self.place(arena, *object)?;
+                self.field(object.pointer, &object.data_type, field)
+            }
+            Expression::PointerFieldAccess { pointer, field } => {
+                let data_type = self
+                    .pointee(arena, *pointer)
+                    .ok_or_else(|| format!("Field {} of a value that isn't a struct pointer", field))?;
+                let pointer = self.compile_pointer(arena, *pointer)?;
+                self.field(pointer, &data_type, field)
+            }
+            _ => Err("Expression is not assignable".to_string()),
+        }
+    }
+
+    /// A local, a declared global, or else an implicitly declared global
+    fn variable(&mut self, name: Symbol) -> Place<'ctx> {
+        if let Some(place) = self.variables.get(&name) {
+            return place.clone();
         }
+        let data_type = self.globals.get(&name).cloned().unwrap_or(Type::Long);
+        Place { pointer: self.global(name), data_type }
+    }
 
+    fn field(&self, pointer: PointerValue<'ctx>, data_type: &Type, field: &str) -> Result<Place<'ctx>, String> {
+        let Type::Struct(name) = Self::unqualified(data_type) else {
+            return Err(format!("Field {} of a value that isn't a struct", field));
+        };
+        let (struct_type, fields) = self.structs.get(name).ok_or_else(|| format!("Unknown struct {}", name))?;
+        let index = fields
+            .iter()
+            .position(|candidate| candidate.name == field)
+            .ok_or_else(|| format!("Struct {} has no field {}", name, field))?;
+        let pointer = self
+            .builder
+            .build_struct_gep(*struct_type, pointer, index as u32, field)
+            .map_err(|e| format!("Failed to build field address: {}", e))?;
+        Ok(Place { pointer, data_type: fields[index].data_type.clone() })
+    }
+
+    fn compile_pointer(&mut self, arena: &AstArena, expr: ExprId) -> Result<PointerValue<'ctx>, String> {
+        let address = self.compile_expression(arena, expr)?;
+        self.builder
+            .build_int_to_ptr(address, self.context.ptr_type(AddressSpace::default()), "ptr")
+            .map_err(|e| format!("Failed to build conversion: {}", e))
+    }
+
+    fn load(&mut self, place: &Place<'ctx>) -> Result<IntValue<'ctx>, String> {
+        // Arrays and structs are used by address
+        if matches!(Self::unqualified(&place.data_type), Type::Array(..) | Type::Struct(_)) {
+            return self
+                .builder
+                .build_ptr_to_int(place.pointer, self.context.i64_type(), "addr")
+                .map_err(|e| format!("Failed to build conversion: {}", e));
+        }
+        let ty = self.convert_type(&place.data_type)?;
+        let value = self
+            .builder
+            .build_load(ty, place.pointer, "load")
+            .map_err(|e| format!("Failed to build load: {}", e))?;
+        self.to_i64(value, Self::is_signed(&place.data_type))
+    }
+
+    /// Stores `value` converted to the place's type, returning the value
+    /// as stored, which is the value of an assignment
+    fn store(&mut self, place: &Place<'ctx>, value: IntValue<'ctx>) -> Result<IntValue<'ctx>, String> {
+        if matches!(Self::unqualified(&place.data_type), Type::Array(..) | Type::Struct(_)) {
+            return Err("Assigning whole arrays or structs is not supported by the LLVM backend".to_string());
+        }
+        let value = self.cast(value, &place.data_type)?;
+        let ty = self.convert_type(&place.data_type)?;
+        let stored = self.from_i64(value, ty)?;
+        self.builder
+            .build_store(place.pointer, stored)
+            .map_err(|e| format!("Failed to build store: {}", e))?;
+        Ok(value)
+    }
+
+    /// Converts `value` to `data_type` and back to 64 bits, as a cast does
+    fn cast(&self, value: IntValue<'ctx>, data_type: &Type) -> Result<IntValue<'ctx>, String> {
+        let i64_type = self.context.i64_type();
+        let error = |e| format!("Failed to build conversion: {}", e);
+        match Self::unqualified(data_type) {
+            Type::Bool => {
+                let flag = self
+                    .builder
+                    .build_int_compare(IntPredicate::NE, value, i64_type.const_zero(), "bool")
+                    .map_err(error)?;
+                self.builder.build_int_z_extend(flag, i64_type, "bool").map_err(error)
+            }
+            Type::Void | Type::Pointer(_) | Type::Array(..) | Type::Struct(_) => Ok(value),
+            data_type => {
+                let BasicTypeEnum::IntType(narrow_type) = self.convert_type(data_type)? else {
+                    return Err(format!("Cast to {:?} is not supported by the LLVM backend", data_type));
+                };
+                let narrow = self.builder.build_int_truncate_or_bit_cast(value, narrow_type, "narrow").map_err(error)?;
+                self.to_i64(narrow.into(), Self::is_signed(data_type))
+            }
+        }
+    }
+
+    /// `value` as a 64-bit integer
+    fn to_i64(&self, value: BasicValueEnum<'ctx>, signed: bool) -> Result<IntValue<'ctx>, String> {
+        let i64_type = self.context.i64_type();
+        let error = |e| format!("Failed to build conversion: {}", e);
+        match value {
+            BasicValueEnum::IntValue(value) if signed => {
+                self.builder.build_int_s_extend_or_bit_cast(value, i64_type, "sext").map_err(error)
+            }
+            BasicValueEnum::IntValue(value) => self.builder.build_int_z_extend_or_bit_cast(value, i64_type, "zext").map_err(error),
+            BasicValueEnum::PointerValue(value) => self.builder.build_ptr_to_int(value, i64_type, "addr").map_err(error),
+            _ => Err("Only integer and pointer values are supported by the LLVM backend".to_string()),
+        }
+    }
+
+    /// A 64-bit integer as a value of `ty`
+    fn from_i64(&self, value: IntValue<'ctx>, ty: BasicTypeEnum<'ctx>) -> Result<BasicValueEnum<'ctx>, String> {
+        let error = |e| format!("Failed to build conversion: {}", e);
+        Ok(match ty {
+            BasicTypeEnum::IntType(int_type) => {
+                self.builder.build_int_truncate_or_bit_cast(value, int_type, "narrow").map_err(error)?.into()
+            }
+            BasicTypeEnum::PointerType(pointer_type) => {
+                self.builder.build_int_to_ptr(value, pointer_type, "ptr").map_err(error)?.into()
+            }
+            _ => return Err("Only integer and pointer values are supported by the LLVM backend".to_string()),
+        })
+    }
+
+    /// Calls `name` with 64-bit arguments, converting them to the types of
+    /// its parameters and its result back to 64 bits
+    fn call(&mut self, name: Symbol, args: &[IntValue<'ctx>]) -> Result<IntValue<'ctx>, String> {
+        let i64_type = self.context.i64_type();
+        let callee = match self.module.get_function(name.as_str()) {
+            Some(callee) => callee,
+            // Undeclared functions follow C's implicit declaration
+            None => self.module.add_function(name.as_str(), i64_type.fn_type(&[], true), None),
+        };
+        let param_types = callee.get_type().get_param_types();
+        let mut call_args: Vec<BasicMetadataValueEnum<'ctx>> = Vec::with_capacity(args.len());
+        for (index, &arg) in args.iter().enumerate() {
+            // Variadic arguments are passed as 64-bit integers
+            let arg = match param_types.get(index) {
+                Some(&param_type) => self.from_i64(arg, param_type)?,
+                None => arg.into(),
+            };
+            call_args.push(arg.into());
+        }
+        let call = self
+            .builder
+            .build_call(callee, &call_args, "call")
+            .map_err(|e| format!("Failed to build call: {}", e))?;
+        match call.try_as_basic_value().left() {
+            Some(result) => self.to_i64(result, true),
+            None => Ok(i64_type.const_zero()),
+        }
+    }
+
+    /// Returns `value`, or 0, converted to the function's return type
+    fn build_return(&self, function_value: FunctionValue<'ctx>, value: Option<IntValue<'ctx>>) -> Result<(), String> {
+        let returned = match function_value.get_type().get_return_type() {
+            None => self.builder.build_return(None),
+            Some(return_type) => {
+                let value = value.unwrap_or_else(|| self.context.i64_type().const_zero());
+                let value = self.from_i64(value, return_type)?;
+                self.builder.build_return(Some(&value))
+            }
+        };
+        returned.map_err(|e| format!("Failed to build return: {}", e))?;
         Ok(())
     }
 
-    fn compile_expression(&mut self, expr: &Expression) -> Result<BasicValueEnum<'ctx>, String> {
-        match expr {
-            Expression::IntegerLiteral(value) => {
-                let int_type = self.context.i32_type();
-                Ok(int_type.const_int(*value as u64, true).into())
+    /// The type `expr` has in the source, where it matters for addressing:
+    /// variables, elements, fields and casts
+    fn expr_type(&self, arena: &AstArena, expr: ExprId) -> Option<Type> {
+        match &arena[expr] {
+            Expression::Variable(name) => self
+                .variables
+                .get(name)
+                .map(|place| place.data_type.clone())
+                .or_else(|| self.globals.get(name).cloned()),
+            Expression::StringLiteral(_) => Some(Type::Pointer(Box::new(Type::Char))),
+            Expression::ArrayAccess { array: pointer, .. }
+            | Expression::UnaryOperation { operator: OperatorType::Unary(UnaryOp::Dereference), operand: pointer } => {
+                self.pointee(arena, *pointer)
+            }
+            Expression::UnaryOperation { operator: OperatorType::Unary(UnaryOp::AddressOf), operand } => {
+                self.expr_type(arena, *operand).map(|data_type| Type::Pointer(Box::new(data_type)))
+            }
+            Expression::StructFieldAccess { object, field } => self.field_type(&self.expr_type(arena, *object)?, field),
+            Expression::PointerFieldAccess { pointer, field } => self.field_type(&self.pointee(arena, *pointer)?, field),
+            Expression::BinaryOperation { left, operator: BinaryOp::Add | BinaryOp::Subtract, .. } => {
+                self.pointee(arena, *left).map(|element| Type::Pointer(Box::new(element)))
+            }
+            Expression::Assignment { target, .. } => self.expr_type(arena, *target),
+            Expression::Cast { target_type, .. } => Some(target_type.clone()),
+            _ => None,
+        }
+    }
+
+    /// The element type of a pointer or array expression
+    fn pointee(&self, arena: &AstArena, expr: ExprId) -> Option<Type> {
+        Self::element_type(&self.expr_type(arena, expr)?).cloned()
+    }
+
+    fn field_type(&self, data_type: &Type, field: &str) -> Option<Type> {
+        let Type::Struct(name) = Self::unqualified(data_type) else {
+            return None;
+        };
+        let (_, fields) = self.structs.get(name)?;
+        fields.iter().find(|candidate| candidate.name == field).map(|field| field.data_type.clone())
+    }
+
+    fn element_type(data_type: &Type) -> Option<&Type> {
+        match Self::unqualified(data_type) {
+            Type::Pointer(element) | Type::Array(element, _) => Some(&**element),
+            _ => None,
+        }
+    }
+
+    fn unqualified(mut data_type: &Type) -> &Type {
+        while let Type::Const(inner) | Type::Volatile(inner) | Type::Restrict(inner) | Type::Atomic(inner) = data_type {
+            data_type = &**inner;
+        }
+        data_type
+    }
+
+    fn is_signed(data_type: &Type) -> bool {
+        !matches!(
+            Self::unqualified(data_type),
+            Type::UnsignedChar
+                | Type::UnsignedShort
+                | Type::UnsignedInt
+                | Type::UnsignedLong
+                | Type::UnsignedLongLong
+                | Type::Bool
+        )
+    }
+
+    fn size_of(&self, data_type: &Type) -> Result<IntValue<'ctx>, String> {
+        self.convert_type(data_type)?
+            .size_of()
+            .ok_or_else(|| format!("Type {:?} has no size", data_type))
+    }
+
+    fn declare_function(&mut self, function: &Function) -> Result<FunctionValue<'ctx>, String> {
+        if let Some(declared) = self.module.get_function(function.name.as_str()) {
+            return Ok(declared);
+        }
+        let param_types: Vec<BasicMetadataTypeEnum<'ctx>> = function
+            .parameters
+            .iter()
+            .map(|param| self.convert_type(&param.data_type).map(|ty| ty.into()))
+            .collect::<Result<_, _>>()?;
+        let fn_type = match Self::unqualified(&function.return_type) {
+            Type::Void => self.context.void_type().fn_type(&param_types, function.is_variadic),
+            return_type => self.convert_type(return_type)?.fn_type(&param_types, function.is_variadic),
+        };
+        Ok(self.module.add_function(function.name.as_str(), fn_type, None))
+    }
+
+    /// Compiles `function` from its optimized IR. IR values are all i64;
+    /// parameters, arguments and return values are converted at the
+    /// function's boundary to the types its signature declares.
+    fn compile_ir_function(&mut self, function: &Function, optimized: &ir::Function) -> Result<(), String> {
+        let function_value = self.declare_function(function)?;
+        let i64_type = self.context.i64_type();
+        self.variables.clear();
+
+        let blocks: Vec<BasicBlock<'ctx>> = optimized
+            .block_ids()
+            .map(|id| self.context.append_basic_block(function_value, &format!("b{}", id.index())))
+            .collect();
+        let mut values: HashMap<ir::Value, IntValue<'ctx>> = HashMap::new();
+        let mut phis: Vec<(PhiValue<'ctx>, ir::Value)> = Vec::new();
+
+        // Blocks come in reverse postorder, so every operand other than a
+        // phi's is compiled before its use
+        for id in optimized.block_ids() {
+            self.builder.position_at_end(blocks[id.index()]);
+            for &value in &optimized[id].insts {
+                let result = match &optimized[value] {
+                    ir::Inst::Phi(_) => {
+                        let phi = self
+                            .builder
+                            .build_phi(i64_type, "phi")
+                            .map_err(|e| format!("Failed to build phi: {}", e))?;
+                        phis.push((phi, value));
+                        phi.as_basic_value().into_int_value()
+                    }
+                    inst => self.compile_ir_inst(function_value, inst, &values)?,
+                };
+                values.insert(value, result);
             }
-            Expression::Variable(name) => {
-                if let Some(ptr) = self.variables.get(name) {
-                    // Updated to use the correct build_load signature
-                    // Use the IntType directly without converting to BasicTypeEnum
-                    let int_type = self.context.i32_type();
-                    let load_value = self
+
+            match &optimized[id].terminator {
+                ir::Terminator::Jump(target) => self.branch(blocks[target.index()])?,
+                ir::Terminator::Branch { condition, then_block, else_block } => {
+                    let condition = self
                         .builder
-                        .build_load::<inkwell::types::IntType>(
-                            int_type,
-                            *ptr,
-                            &format!("{}_val", name),
-                        )
-                        .map_err(|e| format!("Failed to load variable {}: {}", name, e))?;
-
-                    Ok(load_value)
+                        .build_int_compare(IntPredicate::NE, values[condition], i64_type.const_zero(), "cond")
+                        .map_err(|e| format!("Failed to build comparison: {}", e))?;
+                    self.builder
+                        .build_conditional_branch(condition, blocks[then_block.index()], blocks[else_block.index()])
+                        .map_err(|e| format!("Failed to build branch: {}", e))?;
+                }
+                ir::Terminator::Return(value) => {
+                    self.build_return(function_value, value.as_ref().map(|value| values[value]))?;
+                }
+            }
+        }
+
+        for (phi, value) in phis {
+            let ir::Inst::Phi(entries) = &optimized[value] else {
+                unreachable!("phi list only holds phis");
+            };
+            for &(pred, operand) in entries {
+                phi.add_incoming(&[(&values[&operand] as &dyn BasicValue<'ctx>, blocks[pred.index()])]);
+            }
+        }
+
+        if function_value.verify(true) {
+            Ok(())
+        } else {
+            Err(format!("Failed to verify function {}", function.name))
+        }
+    }
+
+    fn compile_ir_inst(
+        &mut self,
+        function_value: FunctionValue<'ctx>,
+        inst: &ir::Inst,
+        values: &HashMap<ir::Value, IntValue<'ctx>>,
+    ) -> Result<IntValue<'ctx>, String> {
+        let i64_type = self.context.i64_type();
+        let ptr_type = self.context.ptr_type(AddressSpace::default());
+        let error = |what: &str| move |e| format!("Failed to build {}: {}", what, e);
+
+        Ok(match inst {
+            ir::Inst::Const(c) => i64_type.const_int(*c as u64, true),
+            ir::Inst::Param(index) => {
+                let param = function_value
+                    .get_nth_param(*index as u32)
+                    .ok_or_else(|| format!("Failed to get parameter {}", index))?;
+                self.to_i64(param, true)?
+            }
+            ir::Inst::Extend { value, width, signed } => {
+                let narrow_type = self.context.custom_width_int_type(*width as u32 * 8);
+                let narrow = self
+                    .builder
+                    .build_int_truncate_or_bit_cast(values[value], narrow_type, "narrow")
+                    .map_err(error("truncation"))?;
+                if *signed {
+                    self.builder.build_int_s_extend_or_bit_cast(narrow, i64_type, "sext")
                 } else {
-                    Err(format!("Variable {} not found", name))
+                    self.builder.build_int_z_extend_or_bit_cast(narrow, i64_type, "zext")
                 }
+                .map_err(error("extension"))?
             }
-            Expression::BinaryOperation {
-                left,
-                operator,
-                right,
-            } => {
-                let lhs = self.compile_expression(left)?;
-                let rhs = self.compile_expression(right)?;
-
-                // Ensure proper type conversions between BasicValueEnum and IntValue
-                if let (BasicValueEnum::IntValue(lhs_val), BasicValueEnum::IntValue(rhs_val)) =
-                    (lhs, rhs)
-                {
-                    let result = match operator {
-                        BinaryOp::Add => self
+            ir::Inst::Binary { op, left, right } => self.compile_ir_binary(*op, values[left], values[right])?,
+            ir::Inst::Unary { op, operand } => {
+                let operand = values[operand];
+                match op {
+                    ir::UnOp::Neg => self.builder.build_int_neg(operand, "neg").map_err(error("negation"))?,
+                    ir::UnOp::Not => self.builder.build_not(operand, "not").map_err(error("complement"))?,
+                    ir::UnOp::LogicalNot => {
+                        let zero = self
                             .builder
-                            .build_int_add(lhs_val, rhs_val, "addtmp")
-                            .map_err(|e| format!("Failed to build addition: {}", e))?,
-                        BinaryOp::Subtract => self
-                            .builder
-                            .build_int_sub(lhs_val, rhs_val, "subtmp")
-                            .map_err(|e| format!("Failed to build subtraction: {}", e))?,
-                        BinaryOp::Multiply => self
-                            .builder
-                            .build_int_mul(lhs_val, rhs_val, "multmp")
-                            .map_err(|e| format!("Failed to build multiplication: {}", e))?,
-                        BinaryOp::Divide => self
-                            .builder
-                            .build_int_signed_div(lhs_val, rhs_val, "divtmp")
-                            .map_err(|e| format!("Failed to build division: {}", e))?,
-                        // Implement other operators as needed
-                        _ => return Err("Binary operator not yet implemented for LLVM".to_string()),
-                    };
-                    Ok(result.into())
+                            .build_int_compare(IntPredicate::EQ, operand, i64_type.const_zero(), "lnot")
+                            .map_err(error("comparison"))?;
+                        self.builder.build_int_z_extend(zero, i64_type, "lnot").map_err(error("extension"))?
+                    }
+                }
+            }
+            ir::Inst::Call { callee, args } => {
+                let args: Vec<IntValue<'ctx>> = args.iter().map(|arg| values[arg]).collect();
+                self.call(*callee, &args)?
+            }
+            ir::Inst::String(string) => {
+                let global = self.builder.build_global_string_ptr(string, "str").map_err(error("string"))?;
+                self.builder
+                    .build_ptr_to_int(global.as_pointer_value(), i64_type, "str")
+                    .map_err(error("conversion"))?
+            }
+            // Globals are loaded and stored at the width of their declared
+            // type, which is the width the IR gives
+            ir::Inst::LoadGlobal { name, .. } => {
+                let place = self.variable(*name);
+                self.load(&place)?
+            }
+            ir::Inst::StoreGlobal { name, value, .. } => {
+                let place = self.variable(*name);
+                self.store(&place, values[value])?
+            }
+            ir::Inst::Load { address, width, signed } => {
+                let pointer = self
+                    .builder
+                    .build_int_to_ptr(values[address], ptr_type, "addr")
+                    .map_err(error("conversion"))?;
+                let narrow_type = self.context.custom_width_int_type(*width as u32 * 8);
+                let narrow = self.builder.build_load(narrow_type, pointer, "load").map_err(error("load"))?.into_int_value();
+                if *signed {
+                    self.builder.build_int_s_extend_or_bit_cast(narrow, i64_type, "sext")
                 } else {
-                    Err("Type mismatch in binary operation".to_string())
+                    self.builder.build_int_z_extend_or_bit_cast(narrow, i64_type, "zext")
                 }
+                .map_err(error("extension"))?
+            }
+            ir::Inst::Store { address, value, width } => {
+                let pointer = self
+                    .builder
+                    .build_int_to_ptr(values[address], ptr_type, "addr")
+                    .map_err(error("conversion"))?;
+                let narrow_type = self.context.custom_width_int_type(*width as u32 * 8);
+                let narrow = self
+                    .builder
+                    .build_int_truncate_or_bit_cast(values[value], narrow_type, "narrow")
+                    .map_err(error("truncation"))?;
+                self.builder.build_store(pointer, narrow).map_err(error("store"))?;
+                values[value]
             }
-            // Implement other expression types
-            _ => Err("Expression type not yet implemented for LLVM".to_string()),
+            ir::Inst::Phi(_) => unreachable!("phis are built by compile_ir_function"),
+        })
+    }
+
+    fn compile_ir_binary(&self, op: ir::BinOp, left: IntValue<'ctx>, right: IntValue<'ctx>) -> Result<IntValue<'ctx>, String> {
+        let builder = &self.builder;
+        let i64_type = self.context.i64_type();
+        let error = |e| format!("Failed to build binary operation: {}", e);
+        let predicate = match op {
+            ir::BinOp::Eq => Some(IntPredicate::EQ),
+            ir::BinOp::Ne => Some(IntPredicate::NE),
+            ir::BinOp::Lt => Some(IntPredicate::SLT),
+            ir::BinOp::Le => Some(IntPredicate::SLE),
+            ir::BinOp::Gt => Some(IntPredicate::SGT),
+            ir::BinOp::Ge => Some(IntPredicate::SGE),
+            _ => None,
+        };
+        if let Some(predicate) = predicate {
+            let flag = builder.build_int_compare(predicate, left, right, "cmp").map_err(error)?;
+            return builder.build_int_z_extend(flag, i64_type, "cmp").map_err(error);
+        }
+
+        Ok(match op {
+            ir::BinOp::Add => builder.build_int_add(left, right, "add"),
+            ir::BinOp::Sub => builder.build_int_sub(left, right, "sub"),
+            ir::BinOp::Mul => builder.build_int_mul(left, right, "mul"),
+            ir::BinOp::Div => builder.build_int_signed_div(left, right, "div"),
+            ir::BinOp::Mod => builder.build_int_signed_rem(left, right, "rem"),
+            ir::BinOp::And => builder.build_and(left, right, "and"),
+            ir::BinOp::Or => builder.build_or(left, right, "or"),
+            ir::BinOp::Xor => builder.build_xor(left, right, "xor"),
+            // Shifts work on the low 32 bits, as `ir::BinOp::eval` specifies
+            ir::BinOp::Shl | ir::BinOp::Shr => {
+                let i32_type = self.context.i32_type();
+                let value = builder.build_int_truncate(left, i32_type, "shval").map_err(error)?;
+                let count = builder.build_int_truncate(right, i32_type, "shcnt").map_err(error)?;
+                let count = builder.build_and(count, i32_type.const_int(31, false), "shcnt").map_err(error)?;
+                let shifted = if op == ir::BinOp::Shl {
+                    builder.build_left_shift(value, count, "shl")
+                } else {
+                    builder.build_right_shift(value, count, true, "sar")
+                }
+                .map_err(error)?;
+                builder.build_int_z_extend(shifted, i64_type, "shift")
+            }
+            _ => unreachable!("comparisons are handled above"),
+        }
+        .map_err(error)?)
+    }
+
+    /// The global variable `name`, declared as 64 bits wide if this module
+    /// hasn't seen it yet
+    fn global(&mut self, name: Symbol) -> PointerValue<'ctx> {
+        match self.module.get_global(name.as_str()) {
+            Some(global) => global.as_pointer_value(),
+            None => self
+                .module
+                .add_global(self.context.i64_type(), Some(AddressSpace::default()), name.as_str())
+                .as_pointer_value(),
         }
     }
 
+
+
     fn convert_type(&self, ty: &Type) -> Result<BasicTypeEnum<'ctx>, String> {
-        match ty {
-            Type::Int => Ok(self.context.i32_type().into()),
-            Type::Char => Ok(self.context.i8_type().into()),
-            Type::Pointer(_) => {
-                // Use context.ptr_type directly instead of pointee_type.ptr_type
-                Ok(self.context.ptr_type(AddressSpace::default()).into())
+        Ok(match ty {
+            Type::Char | Type::UnsignedChar | Type::Bool => self.context.i8_type().into(),
+            Type::Short | Type::UnsignedShort => self.context.i16_type().into(),
+            Type::Int | Type::UnsignedInt => self.context.i32_type().into(),
+            Type::Long | Type::UnsignedLong | Type::LongLong | Type::UnsignedLongLong => self.context.i64_type().into(),
+            // Array parameters of unknown length are pointers
+            Type::Pointer(_) | Type::Array(_, None) => self.context.ptr_type(AddressSpace::default()).into(),
+            Type::Array(element, Some(length)) => self.convert_type(element)?.array_type(*length as u32).into(),
+            Type::Struct(name) => self
+                .structs
+                .get(name)
+                .map(|(struct_type, _)| struct_type.as_basic_type_enum())
+                .ok_or_else(|| format!("Unknown struct {}", name))?,
+            Type::Const(inner) | Type::Volatile(inner) | Type::Restrict(inner) | Type::Atomic(inner) => {
+                self.convert_type(inner)?
             }
-            // Add other type conversions as needed
-            _ => Err("Type not yet implemented for LLVM".to_string()),
-        }
+            _ => return Err(format!("Type {:?} is not supported by the LLVM backend", ty)),
+        })
     }
 }
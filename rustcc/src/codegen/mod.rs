@@ -1,11 +1,26 @@
 #[cfg(feature = "llvm-backend")]
 pub mod llvm;
+mod asm;
+mod frame;
+pub mod object;
+mod regalloc;
 pub mod x86_64;
 
+use crate::analyzer::Analysis;
+use crate::cache::BuildCache;
+use crate::compiler::OptimizationLevel;
+use crate::optimizer::ir::Module;
 use crate::parser::ast::Program;
+use std::io::Write;
+use std::sync::Arc;
 
 pub struct CodeGenerator {
     backend: Backend,
+    format: OutputFormat,
+    opt_level: OptimizationLevel,
+    ir: Option<Module>,
+    threads: Option<usize>,
+    cache: Option<Arc<BuildCache>>,
 }
 
 #[allow(dead_code)]
@@ -17,35 +32,141 @@ pub enum Backend {
     LLVMUnavailable,
 }
 
+impl Backend {
+    /// The LLVM backend, or the variant reporting it wasn't built in
+    pub fn llvm() -> Self {
+        #[cfg(feature = "llvm-backend")]
+        return Backend::LLVM;
+        #[cfg(not(feature = "llvm-backend"))]
+        return Backend::LLVMUnavailable;
+    }
+}
+
+/// What the backend writes to the output file
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum OutputFormat {
+    Assembly,
+    LlvmIr,
+    Object,
+}
+
+impl OutputFormat {
+    /// The format named by `--emit=<name>`
+    pub fn from_name(name: &str) -> Option<Self> {
+        match name {
+            "asm" => Some(OutputFormat::Assembly),
+            "llvm" => Some(OutputFormat::LlvmIr),
+            "obj" => Some(OutputFormat::Object),
+            _ => None,
+        }
+    }
+
+    /// The usual extension of files in this format
+    pub fn extension(self) -> &'static str {
+        match self {
+            OutputFormat::Assembly => "s",
+            OutputFormat::LlvmIr => "ll",
+            OutputFormat::Object => "o",
+        }
+    }
+}
+
 impl CodeGenerator {
     pub fn new() -> Self {
         CodeGenerator {
             backend: Backend::X86_64, // Default to x86_64 for backward compatibility
+            format: OutputFormat::Assembly,
+            opt_level: OptimizationLevel::None,
+            ir: None,
+            threads: None,
+            cache: None,
         }
     }
 
-    #[allow(dead_code)]
     pub fn with_backend(backend: Backend) -> Self {
-        CodeGenerator { backend }
+        CodeGenerator {
+            backend,
+            format: OutputFormat::Assembly,
+            opt_level: OptimizationLevel::None,
+            ir: None,
+            threads: None,
+            cache: None,
+        }
+    }
+
+    /// Set the optimization level used by the backend
+    pub fn with_optimization(mut self, level: OptimizationLevel) -> Self {
+        self.opt_level = level;
+        self
+    }
+
+    /// Compile the functions of `module` from their optimized IR instead of
+    /// the AST
+    pub fn with_ir(mut self, module: Module) -> Self {
+        self.ir = Some(module);
+        self
+    }
+
+    /// Set what the backend writes; the x86-64 backend can't write LLVM IR
+    pub fn with_format(mut self, format: OutputFormat) -> Self {
+        self.format = format;
+        self
+    }
+
+    /// Set the number of threads the backend may use
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        self.threads = Some(threads);
+        self
+    }
+
+    /// Reuse the code of unchanged functions from `cache`
+    pub fn with_cache(mut self, cache: Arc<BuildCache>) -> Self {
+        self.cache = Some(cache);
+        self
+    }
+
+    #[allow(dead_code)]
+    pub fn generate(&mut self, program: &Program, analysis: &Analysis) -> String {
+        let mut out = Vec::new();
+        match self.generate_into(program, analysis, &mut out) {
+            Ok(()) => String::from_utf8(out).expect("assembly is UTF-8"),
+            Err(e) => unreachable!("writing to memory failed: {}", e),
+        }
     }
 
-    pub fn generate(&mut self, program: &Program) -> String {
-        match self.backend {
+    /// Write the generated code for `program`, as `analysis` found it, to
+    /// `out` as it is produced
+    pub fn generate_into(&mut self, program: &Program, analysis: &Analysis, out: &mut dyn Write) -> Result<(), String> {
+        let result = match self.backend {
+            Backend::X86_64 if self.format == OutputFormat::LlvmIr => {
+                return Err("The x86_64 backend can't emit LLVM IR; use --backend=llvm".to_string());
+            }
             Backend::X86_64 => {
-                let mut generator = x86_64::X86_64Generator::new();
-                generator.generate(program)
+                let mut generator = x86_64::X86_64Generator::new().with_optimization(self.opt_level);
+                if let Some(threads) = self.threads {
+                    generator = generator.with_threads(threads);
+                }
+                if let Some(cache) = &self.cache {
+                    generator = generator.with_cache(Arc::clone(cache));
+                }
+                if self.format == OutputFormat::Object {
+                    // Assembled in process rather than by an external assembler
+                    let bytes = generator.generate_object(program, analysis, self.ir.as_ref(), object::ObjectFormat::host())?;
+                    out.write_all(&bytes)
+                } else {
+                    generator.generate_into(program, analysis, self.ir.as_ref(), out)
+                }
             }
             #[cfg(feature = "llvm-backend")]
-            Backend::LLVM => {
-                // LLVM requires context, which we can't easily create here
-                // So we'll just return a message for now
-                "LLVM IR generation is available through the LLVMCodeGenerator directly.".to_string()
-            }
+            Backend::LLVM => return llvm::compile(program, analysis, self.ir.as_ref(), self.opt_level, self.format, out),
             #[cfg(not(feature = "llvm-backend"))]
             Backend::LLVMUnavailable => {
-                "LLVM backend is not available. Compile with the 'llvm-backend' feature to enable it.".to_string()
+                return Err(
+                    "LLVM backend is not available. Compile with the 'llvm-backend' feature to enable it.".to_string(),
+                );
             }
-        }
+        };
+        result.map_err(|e| format!("Failed to write output file: {}", e))
     }
 }
 
@@ -0,0 +1,415 @@
+// object.rs
+// Relocatable object files from the x86-64 generator's assembly
+//
+// The generator's listing is assembled in process, so `--emit=obj` needs
+// no external assembler. Each line is encoded as the generator produces it
+// (see `encoder`), into one of three sections: code, initialized data and
+// string literals. Jumps to labels in the same section are resolved once
+// every label is known; calls, references to global symbols and to other
+// sections are left to the linker as relocations. The sections are then
+// written out as an ELF object for Linux or a Mach-O object for macOS,
+// whose section names the assembly uses.
+//
+// Symbols in the assembly carry Mach-O's leading underscore, which the ELF
+// writer drops. Labels starting with `L` or `.L` are the assembler's own
+// and don't appear in the symbol table.
+
+mod elf;
+pub(super) mod encoder;
+mod macho;
+
+use super::asm::Line;
+use encoder::{Fixup, FixupKind, Operand};
+use std::collections::HashMap;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ObjectFormat {
+    Elf,
+    MachO,
+}
+
+impl ObjectFormat {
+    /// The format the host's linker takes
+    pub fn host() -> Self {
+        if cfg!(target_os = "macos") {
+            ObjectFormat::MachO
+        } else {
+            ObjectFormat::Elf
+        }
+    }
+}
+
+const TEXT: usize = 0;
+const DATA: usize = 1;
+const STRINGS: usize = 2;
+
+/// Alignment of each section, in bytes
+const SECTION_ALIGNMENT: [u64; 3] = [16, 8, 1];
+
+#[derive(Debug, Clone)]
+struct Symbol {
+    name: String,
+    /// Section and offset of the definition, if it's in this object
+    definition: Option<(usize, u64)>,
+    global: bool,
+}
+
+impl Symbol {
+    // Local labels of the assembler: `.L` on ELF, `L` on Mach-O
+    fn is_temporary(&self) -> bool {
+        self.name.starts_with('L') || self.name.starts_with(".L")
+    }
+
+    /// Whether references to the symbol can go through its section, rather
+    /// than the symbol itself
+    fn is_local(&self) -> bool {
+        self.definition.is_some() && !self.global
+    }
+}
+
+#[derive(Debug, Clone)]
+struct Relocation {
+    section: usize,
+    offset: u64,
+    symbol: usize,
+    kind: FixupKind,
+    /// The constant added to the symbol's address, as in `sym+8(%rip)`
+    addend: i64,
+}
+
+#[derive(Debug, Default)]
+struct Object {
+    sections: [Vec<u8>; 3],
+    symbols: Vec<Symbol>,
+    relocations: Vec<Relocation>,
+    symbol_indices: HashMap<String, usize>,
+}
+
+/// Encodes a listing into an object file line by line, as the generator
+/// produces it
+#[derive(Debug, Default)]
+pub struct Assembler {
+    object: Object,
+    section: usize,
+    fixups: Vec<(usize, Fixup)>,
+    lines: usize,
+}
+
+impl Assembler {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn line(&mut self, line: &Line) -> Result<(), String> {
+        self.lines += 1;
+        let number = self.lines;
+        let at_line = |message: String| format!("Assembly line {}: {}", number, message);
+        let object = &mut self.object;
+        match line {
+            Line::Label(label) => {
+                let symbol = object.symbol(label);
+                if object.symbols[symbol].definition.is_some() {
+                    return Err(at_line(format!("{} is defined twice", label)));
+                }
+                object.symbols[symbol].definition = Some((self.section, object.sections[self.section].len() as u64));
+            }
+            Line::Inst(inst) => {
+                let code = &mut object.sections[self.section];
+                if let Some(fixup) = encoder::encode(&inst.mnemonic, &inst.operands, code).map_err(at_line)? {
+                    self.fixups.push((self.section, fixup));
+                }
+            }
+            Line::Other(text) => {
+                let text = text.trim();
+                if text.starts_with('.') {
+                    object.directive(text, &mut self.section).map_err(at_line)?;
+                } else if !text.is_empty() && !text.starts_with('#') {
+                    return Err(at_line(format!("Unsupported line {}", text)));
+                }
+            }
+        }
+        Ok(())
+    }
+
+    /// The object file of the lines so far
+    pub fn finish(self, format: ObjectFormat) -> Result<Vec<u8>, String> {
+        let object = self.resolve()?;
+        Ok(match format {
+            ObjectFormat::Elf => elf::write(&object),
+            ObjectFormat::MachO => macho::write(&object),
+        })
+    }
+
+    fn resolve(self) -> Result<Object, String> {
+        let mut object = self.object;
+        for (section, fixup) in self.fixups {
+            let symbol = object.symbol(&fixup.symbol);
+            let field = fixup.offset..fixup.offset + 4;
+            let addend = i32::from_le_bytes(object.sections[section][field.clone()].try_into().expect("4-byte field"));
+            match object.symbols[symbol].definition {
+                // Within a section the distance is known now
+                Some((target_section, target)) if target_section == section && !object.symbols[symbol].global => {
+                    let trailing = match fixup.kind {
+                        FixupKind::Branch => 0,
+                        FixupKind::PcRelative { trailing } => u64::from(trailing),
+                    };
+                    let end = fixup.offset as u64 + 4 + trailing;
+                    let displacement = i32::try_from(target as i64 + i64::from(addend) - end as i64)
+                        .map_err(|_| format!("{} is out of range", fixup.symbol))?;
+                    object.sections[section][field].copy_from_slice(&displacement.to_le_bytes());
+                }
+                None if object.symbols[symbol].is_temporary() => {
+                    return Err(format!("Undefined label {}", fixup.symbol));
+                }
+                _ => object.relocations.push(Relocation {
+                    section,
+                    offset: fixup.offset as u64,
+                    symbol,
+                    kind: fixup.kind,
+                    addend: i64::from(addend),
+                }),
+            }
+        }
+        Ok(object)
+    }
+}
+
+impl Object {
+    /// The index of the symbol `name`, added undefined if it's new
+    fn symbol(&mut self, name: &str) -> usize {
+        if let Some(&index) = self.symbol_indices.get(name) {
+            return index;
+        }
+        self.symbols.push(Symbol {
+            name: name.to_string(),
+            definition: None,
+            global: false,
+        });
+        self.symbol_indices.insert(name.to_string(), self.symbols.len() - 1);
+        self.symbols.len() - 1
+    }
+
+    fn directive(&mut self, line: &str, section: &mut usize) -> Result<(), String> {
+        let (name, arguments) = line.split_once(char::is_whitespace).unwrap_or((line, ""));
+        let arguments = arguments.trim();
+        let bytes = &mut self.sections[*section];
+        let mut values = |size: usize| -> Result<(), String> {
+            for value in arguments.split(',') {
+                let value = Operand::parse(&format!("${}", value.trim()))?;
+                let Operand::Immediate(value) = value else {
+                    unreachable!("a $ operand is an immediate");
+                };
+                bytes.extend_from_slice(&value.to_le_bytes()[..size]);
+            }
+            Ok(())
+        };
+        match name {
+            ".section" => {
+                // Mach-O segment and section, or an ELF section
+                let mut parts = arguments.split(',').map(str::trim);
+                *section = match (parts.next().unwrap_or_default(), parts.next()) {
+                    ("__TEXT", Some("__text")) | (".text", _) => TEXT,
+                    ("__DATA", Some("__data")) | (".data", _) => DATA,
+                    ("__TEXT", Some("__cstring")) | (".rodata", _) => STRINGS,
+                    _ => return Err(format!("Unsupported section {}", arguments)),
+                }
+            }
+            ".text" => *section = TEXT,
+            ".data" => *section = DATA,
+            ".globl" | ".global" => {
+                let symbol = self.symbol(arguments);
+                self.symbols[symbol].global = true;
+            }
+            ".byte" => values(1)?,
+            ".short" | ".word" => values(2)?,
+            ".long" | ".int" => values(4)?,
+            ".quad" => values(8)?,
+            ".zero" | ".space" => {
+                let count: usize = arguments.parse().map_err(|_| format!("Invalid size in {}", line))?;
+                bytes.resize(bytes.len() + count, 0);
+            }
+            ".asciz" | ".string" | ".ascii" => {
+                bytes.extend(unescape(arguments).ok_or_else(|| format!("Invalid string in {}", line))?);
+                if name != ".ascii" {
+                    bytes.push(0);
+                }
+            }
+            ".p2align" | ".align" => {
+                let power: u32 = arguments.parse().map_err(|_| format!("Invalid alignment in {}", line))?;
+                // Code is padded with nops
+                let fill = if *section == TEXT { 0x90 } else { 0 };
+                let alignment = 1usize.checked_shl(power).filter(|&alignment| alignment <= 4096);
+                let alignment = alignment.ok_or_else(|| format!("Invalid alignment in {}", line))?;
+                bytes.resize(bytes.len().next_multiple_of(alignment), fill);
+            }
+            _ => return Err(format!("Unsupported directive {}", name)),
+        }
+        Ok(())
+    }
+}
+
+/// The bytes of a quoted string, undoing the generator's escapes
+fn unescape(quoted: &str) -> Option<Vec<u8>> {
+    let text = quoted.strip_prefix('"')?.strip_suffix('"')?;
+    let mut bytes = Vec::with_capacity(text.len());
+    let mut chars = text.chars().peekable();
+    while let Some(c) = chars.next() {
+        if c != '\\' {
+            let mut buffer = [0; 4];
+            bytes.extend_from_slice(c.encode_utf8(&mut buffer).as_bytes());
+            continue;
+        }
+        match chars.next()? {
+            'n' => bytes.push(b'\n'),
+            't' => bytes.push(b'\t'),
+            'r' => bytes.push(b'\r'),
+            digit @ '0'..='7' => {
+                // Up to three octal digits
+                let mut value = digit.to_digit(8)?;
+                for _ in 0..2 {
+                    match chars.peek().and_then(|c| c.to_digit(8)) {
+                        Some(digit) => {
+                            value = value * 8 + digit;
+                            chars.next();
+                        }
+                        None => break,
+                    }
+                }
+                bytes.push(value as u8);
+            }
+            c => bytes.push(u8::try_from(c).ok()?),
+        }
+    }
+    Some(bytes)
+}
+
+/// Little-endian fields of object files
+trait Put {
+    fn put_u8(&mut self, value: u8);
+    fn put_u16(&mut self, value: u16);
+    fn put_u32(&mut self, value: u32);
+    fn put_u64(&mut self, value: u64);
+    /// A name padded with zeros to `width` bytes
+    fn put_name(&mut self, name: &str, width: usize);
+    /// Pads with zeros to a multiple of `alignment`
+    fn align(&mut self, alignment: u64);
+}
+
+impl Put for Vec<u8> {
+    fn put_u8(&mut self, value: u8) {
+        self.push(value);
+    }
+
+    fn put_u16(&mut self, value: u16) {
+        self.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn put_u32(&mut self, value: u32) {
+        self.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn put_u64(&mut self, value: u64) {
+        self.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn put_name(&mut self, name: &str, width: usize) {
+        self.extend_from_slice(name.as_bytes());
+        self.resize(self.len() + width - name.len(), 0);
+    }
+
+    fn align(&mut self, alignment: u64) {
+        self.resize((self.len() as u64).next_multiple_of(alignment) as usize, 0);
+    }
+}
+
+/// A string table of NUL-terminated names, starting with the empty name
+struct StringTable {
+    bytes: Vec<u8>,
+}
+
+impl StringTable {
+    fn new() -> Self {
+        StringTable { bytes: vec![0] }
+    }
+
+    /// Adds `name`, returning its offset in the table
+    fn add(&mut self, name: &str) -> u32 {
+        let offset = self.bytes.len() as u32;
+        self.bytes.extend_from_slice(name.as_bytes());
+        self.bytes.push(0);
+        offset
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn assemble(assembly: &str) -> Result<Object, String> {
+        let mut assembler = Assembler::new();
+        for line in assembly.lines() {
+            assembler.line(&Line::parse(line)?)?;
+        }
+        assembler.resolve()
+    }
+
+    fn text(assembly: &str) -> Vec<u8> {
+        let object = assemble(assembly).unwrap();
+        object.sections[TEXT].clone()
+    }
+
+    #[test]
+    fn test_instructions_encode_as_gnu_as_does() {
+        let cases: [(&str, &[u8]); 17] = [
+            ("push %rbp", &[0x55]),
+            ("mov %rsp, %rbp", &[0x48, 0x89, 0xe5]),
+            ("mov $0, %rax", &[0x48, 0xc7, 0xc0, 0, 0, 0, 0]),
+            ("movslq -4(%rbp), %rax", &[0x48, 0x63, 0x45, 0xfc]),
+            ("movl %r8d, -20(%rbp)", &[0x44, 0x89, 0x45, 0xec]),
+            ("movq %rbx, -8(%rbp)", &[0x48, 0x89, 0x5d, 0xf8]),
+            ("movzbq %sil, %rdi", &[0x48, 0x0f, 0xb6, 0xfe]),
+            ("movb %al, -13(%rbp)", &[0x88, 0x45, 0xf3]),
+            ("imul $3, %r8", &[0x4d, 0x6b, 0xc0, 0x03]),
+            ("sub $1000, %rsp", &[0x48, 0x81, 0xec, 0xe8, 0x03, 0, 0]),
+            ("addl $1, -72(%rbp)", &[0x83, 0x45, 0xb8, 0x01]),
+            ("sar %cl, %eax", &[0xd3, 0xf8]),
+            ("setge %al", &[0x0f, 0x9d, 0xc0]),
+            ("mov (%rax), %r12", &[0x4c, 0x8b, 0x20]),
+            ("xchg %rax, (%rcx)", &[0x48, 0x87, 0x01]),
+            ("lock cmpxchg %rdx, (%rcx)", &[0xf0, 0x48, 0x0f, 0xb1, 0x11]),
+            ("lock xadd %rax, (%rcx)", &[0xf0, 0x48, 0x0f, 0xc1, 0x01]),
+        ];
+        for (instruction, expected) in cases {
+            assert_eq!(text(instruction), expected, "{}", instruction);
+        }
+    }
+
+    #[test]
+    fn test_local_jumps_resolve_and_calls_relocate() {
+        let object = assemble(
+            ".section __TEXT,__text,regular,pure_instructions\n\
+             .globl _main\n\
+             _main: \n\
+             .Lloop:\n    call _f\n    jmp .Lloop\n    leaq L.str.0(%rip), %rax\n    ret\n\
+             .section __TEXT,__cstring,cstring_literals\n\
+             L.str.0:\n    .asciz \"a\\\"b\\n\"\n",
+        )
+        .unwrap();
+        // jmp back over itself and the call
+        assert_eq!(object.sections[TEXT][5..10], [0xe9, 0xf6, 0xff, 0xff, 0xff]);
+        assert_eq!(object.sections[STRINGS], b"a\"b\n\0");
+
+        let targets: Vec<&str> = object
+            .relocations
+            .iter()
+            .map(|relocation| object.symbols[relocation.symbol].name.as_str())
+            .collect();
+        assert_eq!(targets, ["_f", "L.str.0"]);
+
+        let elf = elf::write(&object);
+        assert_eq!(elf[..4], *b"\x7fELF");
+        let macho = macho::write(&object);
+        assert_eq!(macho[..4], 0xfeedfacf_u32.to_le_bytes());
+        assert!(assemble("jmp .Lmissing").unwrap_err().contains(".Lmissing"));
+    }
+}
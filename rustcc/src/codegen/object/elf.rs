@@ -0,0 +1,257 @@
+// elf.rs
+// ELF64 relocatable objects for x86-64 Linux
+//
+// The sections are .text, .data and .rodata, each followed by its .rela
+// section if it has relocations, then the symbol and string tables and an
+// empty .note.GNU-stack so the linker doesn't make the stack executable.
+// References to local labels go through their section's symbol, with the
+// label's offset in the addend.
+
+use super::{Object, Put, StringTable, SECTION_ALIGNMENT, TEXT};
+use crate::codegen::object::encoder::FixupKind;
+
+const SHT_PROGBITS: u32 = 1;
+const SHT_SYMTAB: u32 = 2;
+const SHT_STRTAB: u32 = 3;
+const SHT_RELA: u32 = 4;
+
+const SHF_WRITE: u64 = 0x1;
+const SHF_ALLOC: u64 = 0x2;
+const SHF_EXECINSTR: u64 = 0x4;
+const SHF_INFO_LINK: u64 = 0x40;
+
+const STB_LOCAL: u8 = 0;
+const STB_GLOBAL: u8 = 1;
+const STT_NOTYPE: u8 = 0;
+const STT_OBJECT: u8 = 1;
+const STT_FUNC: u8 = 2;
+const STT_SECTION: u8 = 3;
+
+const R_X86_64_PC32: u32 = 2;
+const R_X86_64_PLT32: u32 = 4;
+
+const SYMBOL_SIZE: u64 = 24;
+const RELA_SIZE: u64 = 24;
+
+struct SectionHeader {
+    name: u32,
+    kind: u32,
+    flags: u64,
+    contents: Vec<u8>,
+    link: u32,
+    info: u32,
+    alignment: u64,
+    entry_size: u64,
+}
+
+pub fn write(object: &Object) -> Vec<u8> {
+    let mut names = StringTable::new();
+    let mut sections = vec![SectionHeader {
+        name: 0,
+        kind: 0,
+        flags: 0,
+        contents: Vec::new(),
+        link: 0,
+        info: 0,
+        alignment: 0,
+        entry_size: 0,
+    }];
+    // RELA relocations carry their addends, so the fields are left zero
+    let mut contents = object.sections.clone();
+    for relocation in &object.relocations {
+        let offset = relocation.offset as usize;
+        contents[relocation.section][offset..offset + 4].fill(0);
+    }
+    let flags = [SHF_ALLOC | SHF_EXECINSTR, SHF_ALLOC | SHF_WRITE, SHF_ALLOC];
+    for (index, name) in [".text", ".data", ".rodata"].into_iter().enumerate() {
+        sections.push(SectionHeader {
+            name: names.add(name),
+            kind: SHT_PROGBITS,
+            flags: flags[index],
+            contents: std::mem::take(&mut contents[index]),
+            link: 0,
+            info: 0,
+            alignment: SECTION_ALIGNMENT[index],
+            entry_size: 0,
+        });
+    }
+
+    // Locals come first: the null symbol, a symbol for each section and
+    // the named local labels
+    let mut strings = StringTable::new();
+    let mut symbols = vec![0u8; SYMBOL_SIZE as usize];
+    let mut indices = vec![0u32; object.symbols.len()];
+    for section in 0..object.sections.len() {
+        put_symbol(&mut symbols, 0, STB_LOCAL << 4 | STT_SECTION, section as u16 + 1, 0);
+    }
+    let mut count = 1 + object.sections.len() as u32;
+    let mut first_global = count;
+    for global in [false, true] {
+        if global {
+            first_global = count;
+        }
+        for (index, symbol) in object.symbols.iter().enumerate() {
+            // Undefined symbols are global; temporary labels are left out
+            let is_global = symbol.global || symbol.definition.is_none();
+            if is_global != global || (!global && symbol.is_temporary()) {
+                continue;
+            }
+            let name = strings.add(symbol.name.strip_prefix('_').unwrap_or(&symbol.name));
+            let bind = if global { STB_GLOBAL } else { STB_LOCAL };
+            let (kind, section, value) = match symbol.definition {
+                Some((section, offset)) => (
+                    if section == TEXT { STT_FUNC } else { STT_OBJECT },
+                    section as u16 + 1,
+                    offset,
+                ),
+                None => (STT_NOTYPE, 0, 0),
+            };
+            put_symbol(&mut symbols, name, bind << 4 | kind, section, value);
+            indices[index] = count;
+            count += 1;
+        }
+    }
+
+    let symtab_index = (sections.len() + relocated_sections(object)) as u32;
+    for section in 0..object.sections.len() {
+        let mut entries = Vec::new();
+        for relocation in object.relocations.iter().filter(|relocation| relocation.section == section) {
+            let trailing = match relocation.kind {
+                FixupKind::Branch => 0,
+                FixupKind::PcRelative { trailing } => i64::from(trailing),
+            };
+            // The field is 4 bytes from the end of the instruction, less
+            // any immediate after it
+            let mut addend = relocation.addend - 4 - trailing;
+            let target = &object.symbols[relocation.symbol];
+            let symbol = match target.definition {
+                Some((target_section, offset)) if target.is_local() => {
+                    addend += offset as i64;
+                    target_section as u32 + 1
+                }
+                _ => indices[relocation.symbol],
+            };
+            let kind = match relocation.kind {
+                FixupKind::Branch => R_X86_64_PLT32,
+                FixupKind::PcRelative { .. } => R_X86_64_PC32,
+            };
+            entries.put_u64(relocation.offset);
+            entries.put_u64(u64::from(symbol) << 32 | u64::from(kind));
+            entries.put_u64(addend as u64);
+        }
+        if !entries.is_empty() {
+            let name = names.add(&format!(".rela{}", [".text", ".data", ".rodata"][section]));
+            sections.push(SectionHeader {
+                name,
+                kind: SHT_RELA,
+                flags: SHF_INFO_LINK,
+                contents: entries,
+                link: symtab_index,
+                info: section as u32 + 1,
+                alignment: 8,
+                entry_size: RELA_SIZE,
+            });
+        }
+    }
+
+    sections.push(SectionHeader {
+        name: names.add(".symtab"),
+        kind: SHT_SYMTAB,
+        flags: 0,
+        contents: symbols,
+        link: symtab_index + 1,
+        info: first_global,
+        alignment: 8,
+        entry_size: SYMBOL_SIZE,
+    });
+    sections.push(SectionHeader {
+        name: names.add(".strtab"),
+        kind: SHT_STRTAB,
+        flags: 0,
+        contents: strings.bytes,
+        link: 0,
+        info: 0,
+        alignment: 1,
+        entry_size: 0,
+    });
+    let note = names.add(".note.GNU-stack");
+    let shstrtab = names.add(".shstrtab");
+    sections.push(SectionHeader {
+        name: shstrtab,
+        kind: SHT_STRTAB,
+        flags: 0,
+        contents: names.bytes.clone(),
+        link: 0,
+        info: 0,
+        alignment: 1,
+        entry_size: 0,
+    });
+    sections.push(SectionHeader {
+        name: note,
+        kind: SHT_PROGBITS,
+        flags: 0,
+        contents: Vec::new(),
+        link: 0,
+        info: 0,
+        alignment: 1,
+        entry_size: 0,
+    });
+
+    // The header, each section's contents, then the section headers
+    let mut out = Vec::new();
+    out.extend_from_slice(b"\x7fELF");
+    out.extend_from_slice(&[2, 1, 1]); // 64-bit, little-endian, version 1
+    out.resize(16, 0);
+    out.put_u16(1); // ET_REL
+    out.put_u16(62); // EM_X86_64
+    out.put_u32(1);
+    out.put_u64(0); // entry
+    out.put_u64(0); // program headers
+    let section_headers_offset = out.len();
+    out.put_u64(0);
+    out.put_u32(0); // flags
+    out.put_u16(64); // header size
+    out.put_u16(0);
+    out.put_u16(0);
+    out.put_u16(64); // section header size
+    out.put_u16(sections.len() as u16);
+    out.put_u16(sections.len() as u16 - 2); // .shstrtab
+
+    let mut offsets = Vec::with_capacity(sections.len());
+    for section in &sections {
+        out.align(section.alignment.max(1));
+        offsets.push(out.len() as u64);
+        out.extend_from_slice(&section.contents);
+    }
+    out.align(8);
+    let headers = out.len() as u64;
+    out[section_headers_offset..section_headers_offset + 8].copy_from_slice(&headers.to_le_bytes());
+    for (section, offset) in sections.iter().zip(offsets) {
+        out.put_u32(section.name);
+        out.put_u32(section.kind);
+        out.put_u64(section.flags);
+        out.put_u64(0); // address
+        out.put_u64(if section.kind == 0 { 0 } else { offset });
+        out.put_u64(section.contents.len() as u64);
+        out.put_u32(section.link);
+        out.put_u32(section.info);
+        out.put_u64(section.alignment);
+        out.put_u64(section.entry_size);
+    }
+    out
+}
+
+fn put_symbol(symbols: &mut Vec<u8>, name: u32, info: u8, section: u16, value: u64) {
+    symbols.put_u32(name);
+    symbols.put_u8(info);
+    symbols.put_u8(0); // default visibility
+    symbols.put_u16(section);
+    symbols.put_u64(value);
+    symbols.put_u64(0); // size
+}
+
+fn relocated_sections(object: &Object) -> usize {
+    (0..object.sections.len())
+        .filter(|&section| object.relocations.iter().any(|relocation| relocation.section == section))
+        .count()
+}
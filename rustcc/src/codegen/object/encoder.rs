@@ -0,0 +1,631 @@
+// encoder.rs
+// x86-64 instruction encoding
+//
+// Machine code for the AT&T syntax instructions the x86-64 generator emits:
+// moves and extensions, integer arithmetic, shifts, comparisons, setcc,
+// push/pop, calls and jumps. Operands are registers, immediates, base +
+// index * scale + displacement addresses and RIP-relative symbols. Jumps
+// and calls always take a 32-bit displacement, so an instruction's size is
+// known as soon as it's encoded.
+
+/// A 32-bit field the assembler fills in once symbols are laid out
+#[derive(Debug, Clone, PartialEq)]
+pub struct Fixup {
+    /// Offset of the field in the section
+    pub offset: usize,
+    pub symbol: String,
+    pub kind: FixupKind,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FixupKind {
+    /// The target of a call or jump
+    Branch,
+    /// A RIP-relative address, followed by `trailing` bytes of immediate
+    /// before the end of the instruction
+    PcRelative { trailing: u8 },
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Register {
+    pub number: u8,
+    /// Width in bytes
+    pub size: u8,
+}
+
+impl Register {
+    pub fn parse(name: &str) -> Option<Self> {
+        const NAMES: [[&str; 4]; 16] = [
+            ["al", "ax", "eax", "rax"],
+            ["cl", "cx", "ecx", "rcx"],
+            ["dl", "dx", "edx", "rdx"],
+            ["bl", "bx", "ebx", "rbx"],
+            ["spl", "sp", "esp", "rsp"],
+            ["bpl", "bp", "ebp", "rbp"],
+            ["sil", "si", "esi", "rsi"],
+            ["dil", "di", "edi", "rdi"],
+            ["r8b", "r8w", "r8d", "r8"],
+            ["r9b", "r9w", "r9d", "r9"],
+            ["r10b", "r10w", "r10d", "r10"],
+            ["r11b", "r11w", "r11d", "r11"],
+            ["r12b", "r12w", "r12d", "r12"],
+            ["r13b", "r13w", "r13d", "r13"],
+            ["r14b", "r14w", "r14d", "r14"],
+            ["r15b", "r15w", "r15d", "r15"],
+        ];
+        NAMES.iter().enumerate().find_map(|(number, names)| {
+            let width = names.iter().position(|&candidate| candidate == name)?;
+            Some(Register { number: number as u8, size: 1 << width })
+        })
+    }
+
+    // spl, bpl, sil and dil are only reachable with a REX prefix; without
+    // one the same numbers mean ah, ch, dh and bh
+    fn needs_rex(self) -> bool {
+        self.size == 1 && (4..8).contains(&self.number)
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Address {
+    /// `displacement(base, index, scale)`
+    Base {
+        base: Register,
+        index: Option<(Register, u8)>,
+        displacement: i32,
+    },
+    /// `symbol+addend(%rip)`
+    Rip { symbol: String, addend: i32 },
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Operand {
+    Register(Register),
+    Immediate(i64),
+    Memory(Address),
+    /// A label, as the target of a jump or call
+    Symbol(String),
+}
+
+impl Operand {
+    pub fn parse(text: &str) -> Result<Self, String> {
+        let text = text.trim();
+        if let Some(name) = text.strip_prefix('%') {
+            return Register::parse(name)
+                .map(Operand::Register)
+                .ok_or_else(|| format!("Unknown register %{}", name));
+        }
+        if let Some(value) = text.strip_prefix('$') {
+            return parse_number(value)
+                .map(Operand::Immediate)
+                .ok_or_else(|| format!("Invalid immediate {}", text));
+        }
+        let Some((displacement, rest)) = text.split_once('(') else {
+            return Ok(Operand::Symbol(text.to_string()));
+        };
+        let inner = rest
+            .strip_suffix(')')
+            .ok_or_else(|| format!("Invalid memory operand {}", text))?;
+        let mut parts = inner.split(',').map(str::trim);
+        let base = parts.next().unwrap_or_default();
+
+        if base == "%rip" {
+            // symbol, symbol+n or symbol-n
+            let (symbol, addend) = match displacement.rfind(['+', '-']).filter(|&at| at > 0) {
+                Some(at) => (&displacement[..at], parse_number(&displacement[at..])),
+                None => (displacement, Some(0)),
+            };
+            let addend = addend
+                .and_then(|addend| i32::try_from(addend).ok())
+                .ok_or_else(|| format!("Invalid memory operand {}", text))?;
+            return Ok(Operand::Memory(Address::Rip { symbol: symbol.trim().to_string(), addend }));
+        }
+
+        let register = |name: &str| {
+            name.strip_prefix('%')
+                .and_then(Register::parse)
+                .filter(|register| register.size == 8)
+                .ok_or_else(|| format!("Invalid address register {} in {}", name, text))
+        };
+        let base = register(base)?;
+        let index = match parts.next() {
+            Some(index) => {
+                let scale = match parts.next() {
+                    Some(scale) => scale.parse().ok().filter(|scale| matches!(scale, 1 | 2 | 4 | 8)),
+                    None => Some(1),
+                };
+                let scale = scale.ok_or_else(|| format!("Invalid scale in {}", text))?;
+                let index = register(index)?;
+                if index.number == 4 {
+                    return Err(format!("%rsp can't be an index register in {}", text));
+                }
+                Some((index, scale))
+            }
+            None => None,
+        };
+        let displacement = match displacement.trim() {
+            "" => 0,
+            value => parse_number(value)
+                .and_then(|value| i32::try_from(value).ok())
+                .ok_or_else(|| format!("Invalid displacement in {}", text))?,
+        };
+        Ok(Operand::Memory(Address::Base { base, index, displacement }))
+    }
+
+    fn register(&self) -> Option<Register> {
+        match self {
+            Operand::Register(register) => Some(*register),
+            _ => None,
+        }
+    }
+}
+
+fn parse_number(text: &str) -> Option<i64> {
+    let text = text.trim();
+    let (negative, digits) = match text.strip_prefix('-') {
+        Some(digits) => (true, digits),
+        None => (false, text.strip_prefix('+').unwrap_or(text)),
+    };
+    let value = match digits.strip_prefix("0x").or_else(|| digits.strip_prefix("0X")) {
+        Some(hex) => u64::from_str_radix(hex, 16).ok()? as i64,
+        None => digits.parse::<u64>().ok()? as i64,
+    };
+    Some(if negative { value.wrapping_neg() } else { value })
+}
+
+fn fits_i8(value: i64) -> bool {
+    i8::try_from(value).is_ok()
+}
+
+fn fits_i32(value: i64) -> bool {
+    i32::try_from(value).is_ok()
+}
+
+/// Condition code numbers of jcc, setcc and cmovcc
+fn condition(name: &str) -> Option<u8> {
+    Some(match name {
+        "o" => 0x0,
+        "no" => 0x1,
+        "b" | "c" | "nae" => 0x2,
+        "ae" | "nb" | "nc" => 0x3,
+        "e" | "z" => 0x4,
+        "ne" | "nz" => 0x5,
+        "be" | "na" => 0x6,
+        "a" | "nbe" => 0x7,
+        "s" => 0x8,
+        "ns" => 0x9,
+        "p" | "pe" => 0xa,
+        "np" | "po" => 0xb,
+        "l" | "nge" => 0xc,
+        "ge" | "nl" => 0xd,
+        "le" | "ng" => 0xe,
+        "g" | "nle" => 0xf,
+        _ => return None,
+    })
+}
+
+/// The operand of an instruction's ModRM byte
+#[derive(Clone, Copy)]
+enum Rm<'a> {
+    Register(Register),
+    Memory(&'a Address),
+}
+
+impl<'a> Rm<'a> {
+    fn of(operand: &'a Operand) -> Option<Self> {
+        match operand {
+            Operand::Register(register) => Some(Rm::Register(*register)),
+            Operand::Memory(address) => Some(Rm::Memory(address)),
+            _ => None,
+        }
+    }
+}
+
+/// Appends the encoding of one instruction to `code`, returning the field
+/// left for the assembler to fill in, if any
+pub fn encode(mnemonic: &str, operands: &[Operand], code: &mut Vec<u8>) -> Result<Option<Fixup>, String> {
+    if let Some(mnemonic) = mnemonic.strip_prefix("lock ") {
+        code.push(0xf0);
+        return encode(mnemonic, operands, code);
+    }
+    let mut encoder = Encoder {
+        code,
+        fixup: None,
+        rex: operands.iter().any(|operand| operand.register().is_some_and(Register::needs_rex)),
+    };
+    encoder.instruction(mnemonic, operands)?;
+    Ok(encoder.fixup)
+}
+
+struct Encoder<'a> {
+    code: &'a mut Vec<u8>,
+    fixup: Option<Fixup>,
+    // Whether a REX prefix is needed for a byte register
+    rex: bool,
+}
+
+impl Encoder<'_> {
+    fn instruction(&mut self, mnemonic: &str, operands: &[Operand]) -> Result<(), String> {
+        let invalid = || format!("Invalid operands for {}", mnemonic);
+
+        // Instructions without a size suffix
+        match (mnemonic, operands) {
+            ("ret" | "retq", []) => return self.bytes(&[0xc3]),
+            ("cqo" | "cqto", []) => return self.bytes(&[0x48, 0x99]),
+            ("cdq" | "cltd", []) => return self.bytes(&[0x99]),
+            ("cltq" | "cdqe", []) => return self.bytes(&[0x48, 0x98]),
+            ("leave" | "leaveq", []) => return self.bytes(&[0xc9]),
+            ("nop", []) => return self.bytes(&[0x90]),
+            ("call" | "callq", [Operand::Symbol(target)]) => return self.branch(&[0xe8], target),
+            ("jmp" | "jmpq", [Operand::Symbol(target)]) => return self.branch(&[0xe9], target),
+            _ => {}
+        }
+        if let Some(code) = mnemonic.strip_prefix('j').and_then(condition) {
+            let [Operand::Symbol(target)] = operands else {
+                return Err(invalid());
+            };
+            return self.branch(&[0x0f, 0x80 + code], target);
+        }
+        if let Some(code) = mnemonic.strip_prefix("set").and_then(condition) {
+            let [operand] = operands else {
+                return Err(invalid());
+            };
+            let rm = Rm::of(operand).filter(|_| operand.register().is_none_or(|register| register.size == 1));
+            return self.modrm(1, &[0x0f, 0x90 + code], 0, rm.ok_or_else(invalid)?, None);
+        }
+        if let Some(code) = mnemonic.strip_prefix("cmov").and_then(|rest| {
+            condition(rest).or_else(|| condition(rest.strip_suffix(['w', 'l', 'q'])?))
+        }) {
+            let [source, Operand::Register(destination)] = operands else {
+                return Err(invalid());
+            };
+            return self.modrm(destination.size, &[0x0f, 0x40 + code], destination.number, Rm::of(source).ok_or_else(invalid)?, None);
+        }
+        if let Some((from, to, signed)) = extension(mnemonic, operands) {
+            return self.extend(mnemonic, from, to, signed, operands);
+        }
+
+        // The rest take an optional size suffix
+        const SIZED: [&str; 31] = [
+            "mov", "movabs", "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp", "test", "imul", "not", "neg", "mul",
+            "div", "idiv", "inc", "dec", "shl", "sal", "shr", "sar", "rol", "ror", "push", "pop", "lea", "xchg",
+            "cmpxchg", "xadd",
+        ];
+        let (name, suffix) = if SIZED.contains(&mnemonic) {
+            (mnemonic, None)
+        } else {
+            let (name, suffix) = mnemonic.split_at(mnemonic.len().saturating_sub(1));
+            let size = match suffix {
+                "b" => 1,
+                "w" => 2,
+                "l" => 4,
+                "q" => 8,
+                _ => 0,
+            };
+            if size == 0 || !SIZED.contains(&name) {
+                return Err(format!("Unsupported instruction {}", mnemonic));
+            }
+            (name, Some(size))
+        };
+        // Registers give the size when there's no suffix
+        let size = suffix.or_else(|| operands.iter().rev().find_map(Operand::register).map(|register| register.size));
+
+        if matches!(name, "push" | "pop") {
+            return self.push_pop(name == "push", operands).ok_or_else(invalid)?;
+        }
+        let size = size.ok_or_else(|| format!("Operand size of {} is ambiguous", mnemonic))?;
+        if operands.iter().filter_map(Operand::register).any(|register| register.size != size)
+            && !matches!(name, "shl" | "sal" | "shr" | "sar" | "rol" | "ror")
+        {
+            return Err(format!("Operand size mismatch in {}", mnemonic));
+        }
+        let byte = |opcode: u8| if size == 1 { opcode } else { opcode + 1 };
+
+        match (name, operands) {
+            ("mov", [Operand::Register(source), destination]) => {
+                self.modrm(size, &[byte(0x88)], source.number, Rm::of(destination).ok_or_else(invalid)?, None)
+            }
+            ("mov", [Operand::Memory(source), Operand::Register(destination)]) => {
+                self.modrm(size, &[byte(0x8a)], destination.number, Rm::Memory(source), None)
+            }
+            ("mov", [Operand::Immediate(value), Operand::Register(destination)]) if size < 8 || !fits_i32(*value) => {
+                self.mov_immediate(size, *destination, *value)
+            }
+            ("mov", [Operand::Immediate(value), destination]) => {
+                let rm = Rm::of(destination).ok_or_else(invalid)?;
+                self.modrm(size, &[byte(0xc6)], 0, rm, Some(self.immediate(size, *value, mnemonic)?))
+            }
+            ("movabs", [Operand::Immediate(value), Operand::Register(destination)]) if size == 8 => {
+                self.mov_immediate(size, *destination, *value)
+            }
+            ("add" | "or" | "adc" | "sbb" | "and" | "sub" | "xor" | "cmp", _) => {
+                let extension = match name {
+                    "add" => 0,
+                    "or" => 1,
+                    "adc" => 2,
+                    "sbb" => 3,
+                    "and" => 4,
+                    "sub" => 5,
+                    "xor" => 6,
+                    _ => 7,
+                };
+                match operands {
+                    [Operand::Register(source), destination] => {
+                        let rm = Rm::of(destination).ok_or_else(invalid)?;
+                        self.modrm(size, &[byte(extension << 3)], source.number, rm, None)
+                    }
+                    [Operand::Memory(source), Operand::Register(destination)] => {
+                        self.modrm(size, &[byte(extension << 3 | 2)], destination.number, Rm::Memory(source), None)
+                    }
+                    [Operand::Immediate(value), destination] => {
+                        let rm = Rm::of(destination).ok_or_else(invalid)?;
+                        if size > 1 && fits_i8(*value) {
+                            self.modrm(size, &[0x83], extension, rm, Some((*value, 1)))
+                        } else {
+                            self.modrm(size, &[byte(0x80)], extension, rm, Some(self.immediate(size, *value, mnemonic)?))
+                        }
+                    }
+                    _ => Err(invalid()),
+                }
+            }
+            ("test", [Operand::Register(source), destination]) => {
+                self.modrm(size, &[byte(0x84)], source.number, Rm::of(destination).ok_or_else(invalid)?, None)
+            }
+            ("test", [Operand::Immediate(value), destination]) => {
+                let rm = Rm::of(destination).ok_or_else(invalid)?;
+                self.modrm(size, &[byte(0xf6)], 0, rm, Some(self.immediate(size, *value, mnemonic)?))
+            }
+            ("imul", [source, Operand::Register(destination)]) if !matches!(source, Operand::Immediate(_)) => {
+                self.modrm(size, &[0x0f, 0xaf], destination.number, Rm::of(source).ok_or_else(invalid)?, None)
+            }
+            ("imul", [Operand::Immediate(value), Operand::Register(destination)]) => {
+                self.imul_immediate(size, *value, Rm::Register(*destination), *destination, mnemonic)
+            }
+            ("imul", [Operand::Immediate(value), source, Operand::Register(destination)]) => {
+                self.imul_immediate(size, *value, Rm::of(source).ok_or_else(invalid)?, *destination, mnemonic)
+            }
+            ("not" | "neg" | "mul" | "imul" | "div" | "idiv", [operand]) => {
+                let extension = match name {
+                    "not" => 2,
+                    "neg" => 3,
+                    "mul" => 4,
+                    "imul" => 5,
+                    "div" => 6,
+                    _ => 7,
+                };
+                self.modrm(size, &[byte(0xf6)], extension, Rm::of(operand).ok_or_else(invalid)?, None)
+            }
+            ("inc" | "dec", [operand]) => {
+                let extension = if name == "inc" { 0 } else { 1 };
+                self.modrm(size, &[byte(0xfe)], extension, Rm::of(operand).ok_or_else(invalid)?, None)
+            }
+            ("shl" | "sal" | "shr" | "sar" | "rol" | "ror", _) => {
+                let extension = match name {
+                    "rol" => 0,
+                    "ror" => 1,
+                    "shl" | "sal" => 4,
+                    "shr" => 5,
+                    _ => 7,
+                };
+                match operands {
+                    // Shifts by one have their own opcode
+                    [Operand::Immediate(1), destination] | [destination] => {
+                        self.modrm(size, &[byte(0xd0)], extension, Rm::of(destination).ok_or_else(invalid)?, None)
+                    }
+                    [Operand::Immediate(count), destination] => {
+                        let rm = Rm::of(destination).ok_or_else(invalid)?;
+                        let count = u8::try_from(*count).map_err(|_| format!("Invalid shift count in {}", mnemonic))?;
+                        self.modrm(size, &[byte(0xc0)], extension, rm, Some((i64::from(count), 1)))
+                    }
+                    [Operand::Register(Register { number: 1, size: 1 }), destination] => {
+                        self.modrm(size, &[byte(0xd2)], extension, Rm::of(destination).ok_or_else(invalid)?, None)
+                    }
+                    _ => Err(invalid()),
+                }
+            }
+            ("xchg", [Operand::Register(source), destination]) => {
+                self.modrm(size, &[byte(0x86)], source.number, Rm::of(destination).ok_or_else(invalid)?, None)
+            }
+            ("cmpxchg", [Operand::Register(source), destination]) => {
+                self.modrm(size, &[0x0f, byte(0xb0)], source.number, Rm::of(destination).ok_or_else(invalid)?, None)
+            }
+            ("xadd", [Operand::Register(source), destination]) => {
+                self.modrm(size, &[0x0f, byte(0xc0)], source.number, Rm::of(destination).ok_or_else(invalid)?, None)
+            }
+            ("lea", [Operand::Memory(source), Operand::Register(destination)]) if size > 1 => {
+                self.modrm(size, &[0x8d], destination.number, Rm::Memory(source), None)
+            }
+            _ => Err(invalid()),
+        }
+    }
+
+    fn bytes(&mut self, bytes: &[u8]) -> Result<(), String> {
+        self.code.extend_from_slice(bytes);
+        Ok(())
+    }
+
+    fn branch(&mut self, opcode: &[u8], target: &str) -> Result<(), String> {
+        self.code.extend_from_slice(opcode);
+        self.fixup = Some(Fixup {
+            offset: self.code.len(),
+            symbol: target.to_string(),
+            kind: FixupKind::Branch,
+        });
+        self.bytes(&[0; 4])
+    }
+
+    // The immediate of an instruction on `size` bytes: as wide as the
+    // operand, up to 4 bytes. A 4-byte immediate of a 64-bit instruction is
+    // sign extended, so it can't hold values that only fit unsigned.
+    fn immediate(&self, size: u8, value: i64, mnemonic: &str) -> Result<(i64, u8), String> {
+        let bits = u32::from(size.min(4)) * 8;
+        let limit = if size == 8 { 1i64 << (bits - 1) } else { 1i64 << bits };
+        let fits = value >= -(1i64 << (bits - 1)) && value < limit;
+        if fits {
+            Ok((value, size.min(4)))
+        } else {
+            Err(format!("Immediate {} is out of range for {}", value, mnemonic))
+        }
+    }
+
+    fn imul_immediate(&mut self, size: u8, value: i64, source: Rm, destination: Register, mnemonic: &str) -> Result<(), String> {
+        if fits_i8(value) {
+            self.modrm(size, &[0x6b], destination.number, source, Some((value, 1)))
+        } else {
+            let immediate = self.immediate(size, value, mnemonic)?;
+            self.modrm(size, &[0x69], destination.number, source, Some(immediate))
+        }
+    }
+
+    // mov $imm, %reg with the register in the opcode; a 64-bit register
+    // takes a full 64-bit immediate (movabs)
+    fn mov_immediate(&mut self, size: u8, destination: Register, value: i64) -> Result<(), String> {
+        let immediate = match size {
+            8 => (value, 8),
+            size => self.immediate(size, value, "mov")?,
+        };
+        self.prefixes(size, 0, None, destination.number);
+        let opcode = if size == 1 { 0xb0 } else { 0xb8 };
+        self.code.push(opcode + (destination.number & 7));
+        self.write_immediate(immediate);
+        Ok(())
+    }
+
+    fn push_pop(&mut self, push: bool, operands: &[Operand]) -> Option<Result<(), String>> {
+        Some(match operands {
+            [Operand::Register(register)] if register.size == 8 => {
+                if register.number >= 8 {
+                    self.code.push(0x41);
+                }
+                self.code.push(if push { 0x50 } else { 0x58 } + (register.number & 7));
+                Ok(())
+            }
+            [Operand::Immediate(value)] if push && fits_i8(*value) => self.bytes(&[0x6a, *value as u8]),
+            [Operand::Immediate(value)] if push && fits_i32(*value) => {
+                self.code.push(0x68);
+                self.write_immediate((*value, 4));
+                Ok(())
+            }
+            // 64 bits is the default size, so there's no REX.W
+            [Operand::Memory(address)] if push => self.modrm(4, &[0xff], 6, Rm::Memory(address), None),
+            [Operand::Memory(address)] => self.modrm(4, &[0x8f], 0, Rm::Memory(address), None),
+            _ => return None,
+        })
+    }
+
+    fn extend(&mut self, mnemonic: &str, from: u8, to: u8, signed: bool, operands: &[Operand]) -> Result<(), String> {
+        let [source, Operand::Register(destination)] = operands else {
+            return Err(format!("Invalid operands for {}", mnemonic));
+        };
+        if destination.size != to || source.register().is_some_and(|register| register.size != from) {
+            return Err(format!("Operand size mismatch in {}", mnemonic));
+        }
+        let rm = Rm::of(source).ok_or_else(|| format!("Invalid operands for {}", mnemonic))?;
+        let opcode: &[u8] = match (from, signed) {
+            (4, _) => &[0x63],
+            (1, false) => &[0x0f, 0xb6],
+            (2, false) => &[0x0f, 0xb7],
+            (1, true) => &[0x0f, 0xbe],
+            _ => &[0x0f, 0xbf],
+        };
+        self.modrm(to, opcode, destination.number, rm, None)
+    }
+
+    // Operand-size and REX prefixes: `reg` is the ModRM reg field (a
+    // register or opcode extension), `index` the SIB index and `base` the
+    // register in ModRM rm, SIB base or the opcode
+    fn prefixes(&mut self, size: u8, reg: u8, index: Option<u8>, base: u8) {
+        if size == 2 {
+            self.code.push(0x66);
+        }
+        let rex = u8::from(size == 8) << 3 | (reg >> 3 & 1) << 2 | (index.unwrap_or(0) >> 3 & 1) << 1 | (base >> 3 & 1);
+        if rex != 0 || self.rex {
+            self.code.push(0x40 | rex);
+        }
+    }
+
+    // An instruction with a ModRM byte, followed by an immediate of the
+    // given size if there is one
+    fn modrm(&mut self, size: u8, opcode: &[u8], reg: u8, rm: Rm, immediate: Option<(i64, u8)>) -> Result<(), String> {
+        let trailing = immediate.map_or(0, |(_, size)| size);
+        match rm {
+            Rm::Register(register) => {
+                self.prefixes(size, reg, None, register.number);
+                self.code.extend_from_slice(opcode);
+                self.code.push(0xc0 | (reg & 7) << 3 | (register.number & 7));
+            }
+            Rm::Memory(Address::Rip { symbol, addend }) => {
+                self.prefixes(size, reg, None, 0);
+                self.code.extend_from_slice(opcode);
+                self.code.push((reg & 7) << 3 | 0b101);
+                self.fixup = Some(Fixup {
+                    offset: self.code.len(),
+                    symbol: symbol.clone(),
+                    kind: FixupKind::PcRelative { trailing },
+                });
+                self.code.extend_from_slice(&addend.to_le_bytes());
+            }
+            Rm::Memory(Address::Base { base, index, displacement }) => {
+                self.prefixes(size, reg, index.map(|(index, _)| index.number), base.number);
+                self.code.extend_from_slice(opcode);
+                // rbp and r13 as a base always take a displacement, since
+                // that encoding without one means no base
+                let mode = match *displacement {
+                    0 if base.number & 7 != 5 => 0b00,
+                    displacement if fits_i8(i64::from(displacement)) => 0b01,
+                    _ => 0b10,
+                };
+                // rsp and r12 as a base need a SIB byte
+                match index {
+                    None if base.number & 7 != 4 => self.code.push(mode << 6 | (reg & 7) << 3 | (base.number & 7)),
+                    _ => {
+                        let (index, scale) = index.map_or((4, 1u8), |(index, scale)| (index.number & 7, scale));
+                        self.code.push(mode << 6 | (reg & 7) << 3 | 0b100);
+                        self.code.push((scale.trailing_zeros() as u8) << 6 | index << 3 | (base.number & 7));
+                    }
+                }
+                match mode {
+                    0b01 => self.code.push(*displacement as u8),
+                    0b10 => self.code.extend_from_slice(&displacement.to_le_bytes()),
+                    _ => {}
+                }
+            }
+        }
+        if let Some(immediate) = immediate {
+            self.write_immediate(immediate);
+        }
+        Ok(())
+    }
+
+    fn write_immediate(&mut self, (value, size): (i64, u8)) {
+        self.code.extend_from_slice(&value.to_le_bytes()[..usize::from(size)]);
+    }
+}
+
+// The (source size, destination size, signedness) of a sign or zero
+// extending move: movzbq, movslq and the like, or movzx/movsx with the
+// sizes taken from the operands
+fn extension(mnemonic: &str, operands: &[Operand]) -> Option<(u8, u8, bool)> {
+    let size = |letter| match letter {
+        b'b' => Some(1),
+        b'w' => Some(2),
+        b'l' => Some(4),
+        b'q' => Some(8),
+        _ => None,
+    };
+    let (signed, sizes) = match mnemonic {
+        "movslq" | "movsxd" => return Some((4, 8, true)),
+        "movzx" | "movsx" => {
+            let from = operands.first()?.register()?.size;
+            let to = operands.get(1)?.register()?.size;
+            return (from < to && from <= 2).then_some((from, to, mnemonic == "movsx"));
+        }
+        _ => (mnemonic.strip_prefix("movs").map(|sizes| (true, sizes)))
+            .or_else(|| mnemonic.strip_prefix("movz").map(|sizes| (false, sizes)))?,
+    };
+    let [from, to] = sizes.as_bytes() else {
+        return None;
+    };
+    let (from, to) = (size(*from)?, size(*to)?);
+    (from < to && from <= 2).then_some((from, to, signed))
+}
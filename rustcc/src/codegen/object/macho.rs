@@ -0,0 +1,209 @@
+// macho.rs
+// Mach-O relocatable objects for x86-64 macOS
+//
+// One unnamed segment holds __TEXT,__text, __DATA,__data and
+// __TEXT,__cstring, laid out one after the other from address 0 as the
+// linker expects of an object file. References to symbols in the symbol
+// table are external relocations carrying their addend in the field;
+// references to the assembler's local labels are section relocations whose
+// field holds the displacement as laid out here, which the linker adjusts.
+
+use super::{Object, Put, StringTable, DATA, SECTION_ALIGNMENT, STRINGS, TEXT};
+use crate::codegen::object::encoder::FixupKind;
+
+const MH_MAGIC_64: u32 = 0xfeedfacf;
+const CPU_TYPE_X86_64: u32 = 0x0100_0007;
+const CPU_SUBTYPE_X86_64_ALL: u32 = 3;
+const MH_OBJECT: u32 = 1;
+
+const LC_SYMTAB: u32 = 0x2;
+const LC_DYSYMTAB: u32 = 0xb;
+const LC_SEGMENT_64: u32 = 0x19;
+const LC_BUILD_VERSION: u32 = 0x32;
+
+const HEADER_SIZE: u32 = 32;
+const SEGMENT_SIZE: u32 = 72;
+const SECTION_SIZE: u32 = 80;
+const SYMTAB_SIZE: u32 = 24;
+const DYSYMTAB_SIZE: u32 = 80;
+const BUILD_VERSION_SIZE: u32 = 24;
+
+const S_CSTRING_LITERALS: u32 = 0x2;
+const S_ATTR_PURE_INSTRUCTIONS: u32 = 0x8000_0000;
+const S_ATTR_SOME_INSTRUCTIONS: u32 = 0x400;
+
+const N_EXT: u8 = 0x1;
+const N_SECT: u8 = 0xe;
+
+const X86_64_RELOC_SIGNED: u32 = 1;
+const X86_64_RELOC_BRANCH: u32 = 2;
+const X86_64_RELOC_SIGNED_1: u32 = 6;
+
+pub fn write(object: &Object) -> Vec<u8> {
+    // Section addresses, each aligned after the one before
+    let mut addresses = [0u64; 3];
+    let mut end = 0u64;
+    for section in [TEXT, DATA, STRINGS] {
+        addresses[section] = end.next_multiple_of(SECTION_ALIGNMENT[section]);
+        end = addresses[section] + object.sections[section].len() as u64;
+    }
+
+    // Locals, then defined globals, then undefined symbols, the last two
+    // sorted by name
+    let mut locals = Vec::new();
+    let mut definitions = Vec::new();
+    let mut undefined = Vec::new();
+    for (index, symbol) in object.symbols.iter().enumerate() {
+        match symbol.definition {
+            Some(_) if symbol.global => definitions.push(index),
+            Some(_) if !symbol.is_temporary() => locals.push(index),
+            Some(_) => {}
+            None => undefined.push(index),
+        }
+    }
+    definitions.sort_by(|&a, &b| object.symbols[a].name.cmp(&object.symbols[b].name));
+    undefined.sort_by(|&a, &b| object.symbols[a].name.cmp(&object.symbols[b].name));
+
+    let mut strings = StringTable::new();
+    let mut symbols = Vec::new();
+    let mut indices = vec![0u32; object.symbols.len()];
+    for (position, &index) in locals.iter().chain(&definitions).chain(&undefined).enumerate() {
+        let symbol = &object.symbols[index];
+        indices[index] = position as u32;
+        symbols.put_u32(strings.add(&symbol.name));
+        let (kind, section, value) = match symbol.definition {
+            Some((section, offset)) => (
+                N_SECT | if symbol.global { N_EXT } else { 0 },
+                section as u8 + 1,
+                addresses[section] + offset,
+            ),
+            None => (N_EXT, 0, 0),
+        };
+        symbols.put_u8(kind);
+        symbols.put_u8(section);
+        symbols.put_u16(0);
+        symbols.put_u64(value);
+    }
+    strings.bytes.resize(strings.bytes.len().next_multiple_of(8), 0);
+
+    let mut contents = object.sections.clone();
+    let mut relocations: [Vec<u8>; 3] = Default::default();
+    for relocation in &object.relocations {
+        let target = &object.symbols[relocation.symbol];
+        let trailing = match relocation.kind {
+            FixupKind::Branch => 0,
+            FixupKind::PcRelative { trailing } => u32::from(trailing),
+        };
+        let kind = match relocation.kind {
+            FixupKind::Branch => X86_64_RELOC_BRANCH,
+            FixupKind::PcRelative { trailing: 0 } => X86_64_RELOC_SIGNED,
+            // SIGNED_1, _2 and _4 for fields followed by an immediate
+            FixupKind::PcRelative { trailing } => X86_64_RELOC_SIGNED_1 + trailing.trailing_zeros(),
+        };
+        let (symbol, external) = match target.definition {
+            Some((section, offset)) if target.is_local() => {
+                let address = addresses[relocation.section] + relocation.offset;
+                let displacement = (addresses[section] + offset) as i64 + relocation.addend
+                    - (address + 4 + u64::from(trailing)) as i64;
+                let field = relocation.offset as usize;
+                contents[relocation.section][field..field + 4].copy_from_slice(&(displacement as i32).to_le_bytes());
+                (section as u32 + 1, 0)
+            }
+            _ => (indices[relocation.symbol], 1),
+        };
+        let entries = &mut relocations[relocation.section];
+        entries.put_u32(relocation.offset as u32);
+        // pc-relative, 4 bytes long
+        entries.put_u32(symbol | 1 << 24 | 2 << 25 | external << 27 | kind << 28);
+    }
+
+    let commands_size =
+        SEGMENT_SIZE + SECTION_SIZE * 3 + BUILD_VERSION_SIZE + SYMTAB_SIZE + DYSYMTAB_SIZE;
+    let contents_offset = u64::from(HEADER_SIZE + commands_size).next_multiple_of(16);
+    let mut relocations_offset = (contents_offset + end).next_multiple_of(8);
+    let relocations_size: usize = relocations.iter().map(Vec::len).sum();
+    let symbols_offset = relocations_offset + relocations_size as u64;
+    let strings_offset = symbols_offset + symbols.len() as u64;
+
+    let mut out = Vec::new();
+    out.put_u32(MH_MAGIC_64);
+    out.put_u32(CPU_TYPE_X86_64);
+    out.put_u32(CPU_SUBTYPE_X86_64_ALL);
+    out.put_u32(MH_OBJECT);
+    out.put_u32(4); // load commands
+    out.put_u32(commands_size);
+    out.put_u32(0); // flags
+    out.put_u32(0);
+
+    out.put_u32(LC_SEGMENT_64);
+    out.put_u32(SEGMENT_SIZE + SECTION_SIZE * 3);
+    out.put_name("", 16);
+    out.put_u64(0); // address
+    out.put_u64(end);
+    out.put_u64(contents_offset);
+    out.put_u64(end);
+    out.put_u32(7); // rwx
+    out.put_u32(7);
+    out.put_u32(3); // sections
+    out.put_u32(0);
+    let headers = [
+        ("__text", "__TEXT", S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS),
+        ("__data", "__DATA", 0),
+        ("__cstring", "__TEXT", S_CSTRING_LITERALS),
+    ];
+    for (section, (name, segment, flags)) in headers.into_iter().enumerate() {
+        let count = relocations[section].len() / 8;
+        out.put_name(name, 16);
+        out.put_name(segment, 16);
+        out.put_u64(addresses[section]);
+        out.put_u64(object.sections[section].len() as u64);
+        out.put_u32((contents_offset + addresses[section]) as u32);
+        out.put_u32(SECTION_ALIGNMENT[section].trailing_zeros());
+        out.put_u32(if count == 0 { 0 } else { relocations_offset as u32 });
+        out.put_u32(count as u32);
+        out.put_u32(flags);
+        out.put_u32(0);
+        out.put_u32(0);
+        out.put_u32(0);
+        relocations_offset += relocations[section].len() as u64;
+    }
+
+    out.put_u32(LC_BUILD_VERSION);
+    out.put_u32(BUILD_VERSION_SIZE);
+    out.put_u32(1); // macOS
+    out.put_u32(0x000b_0000); // 11.0
+    out.put_u32(0); // SDK
+    out.put_u32(0); // tools
+
+    out.put_u32(LC_SYMTAB);
+    out.put_u32(SYMTAB_SIZE);
+    out.put_u32(symbols_offset as u32);
+    out.put_u32((locals.len() + definitions.len() + undefined.len()) as u32);
+    out.put_u32(strings_offset as u32);
+    out.put_u32(strings.bytes.len() as u32);
+
+    out.put_u32(LC_DYSYMTAB);
+    out.put_u32(DYSYMTAB_SIZE);
+    out.put_u32(0);
+    out.put_u32(locals.len() as u32);
+    out.put_u32(locals.len() as u32);
+    out.put_u32(definitions.len() as u32);
+    out.put_u32((locals.len() + definitions.len()) as u32);
+    out.put_u32(undefined.len() as u32);
+    // No table of contents, modules, indirect symbols or dynamic
+    // relocations
+    out.resize(out.len() + 12 * 4, 0);
+
+    out.align(16);
+    for section in [TEXT, DATA, STRINGS] {
+        out.resize((contents_offset + addresses[section]) as usize, 0);
+        out.extend_from_slice(&contents[section]);
+    }
+    out.align(8);
+    for entries in &relocations {
+        out.extend_from_slice(entries);
+    }
+    out.extend_from_slice(&symbols);
+    out.extend_from_slice(&strings.bytes);
+    out
+}
@@ -0,0 +1,431 @@
+// regalloc.rs
+// Register allocation for the x86-64 backend
+//
+// Two independent pieces:
+// - `ExprCosts` computes Sethi-Ullman register needs so the generator can
+//   evaluate the costlier operand first and keep the other in a scratch
+//   register instead of pushing it to the stack (-O1 and up).
+// - `RegisterAssignment` runs a linear scan over the live intervals of a
+//   function's scalar locals and places the hottest ones in callee-saved
+//   registers (-O2).
+
+use crate::analyzer::symbols::{Binding, Symbols};
+use crate::parser::ast::{AstArena, ExprId, Expression, Function, OperatorType, Statement, StmtId, Type, UnaryOp};
+use std::collections::{HashMap, HashSet};
+
+/// Callee-saved registers handed out to locals, in allocation order
+pub const CALLEE_SAVED: [&str; 5] = ["%rbx", "%r12", "%r13", "%r14", "%r15"];
+
+/// Caller-saved registers that hold expression temporaries. They are never
+/// live across a call, so they need no saving.
+pub const SCRATCH: [&str; 2] = ["%r10", "%r11"];
+
+#[derive(Debug, Clone, Copy, Default)]
+struct Cost {
+    need: u32,
+    has_call: bool,
+}
+
+/// Memoised per-expression register needs for one function
+#[derive(Debug, Default)]
+pub struct ExprCosts {
+    costs: Vec<Option<Cost>>,
+}
+
+impl ExprCosts {
+    pub fn new(arena: &AstArena) -> Self {
+        ExprCosts {
+            costs: vec![None; arena.expr_count()],
+        }
+    }
+
+    /// Registers needed to evaluate `expr` without spilling
+    pub fn need(&mut self, arena: &AstArena, expr: ExprId) -> u32 {
+        self.cost(arena, expr).need
+    }
+
+    /// Whether evaluating `expr` may call a function (and so clobber every
+    /// caller-saved register)
+    pub fn has_call(&mut self, arena: &AstArena, expr: ExprId) -> bool {
+        self.cost(arena, expr).has_call
+    }
+
+    fn cost(&mut self, arena: &AstArena, expr: ExprId) -> Cost {
+        if let Some(cost) = self.costs.get(expr.index()).copied().flatten() {
+            return cost;
+        }
+
+        let cost = match &arena[expr] {
+            Expression::BinaryOperation { left, right, .. } => {
+                let (left, right) = (self.cost(arena, *left), self.cost(arena, *right));
+                Cost {
+                    // Classic Sethi-Ullman labelling
+                    need: if left.need == right.need {
+                        left.need + 1
+                    } else {
+                        left.need.max(right.need)
+                    },
+                    has_call: left.has_call || right.has_call,
+                }
+            }
+            Expression::FunctionCall { .. } => Cost {
+                need: SCRATCH.len() as u32 + 1,
+                has_call: true,
+            },
+            node => {
+                let mut cost = Cost { need: 1, has_call: false };
+                let mut children = 0;
+                node.for_each_child(|child| {
+                    let child = self.cost(arena, child);
+                    cost.need = cost.need.max(child.need);
+                    cost.has_call |= child.has_call;
+                    children += 1;
+                });
+                if children > 1 {
+                    cost.need += 1;
+                }
+                cost
+            }
+        };
+
+        // Nodes allocated after the table was built are simply not cached
+        if let Some(slot) = self.costs.get_mut(expr.index()) {
+            *slot = Some(cost);
+        }
+        cost
+    }
+}
+
+/// A parameter (by position) or a local (by its declaration)
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum Local {
+    Param(usize),
+    Decl(StmtId),
+}
+
+/// Locals that live in callee-saved registers for the whole function
+#[derive(Debug, Clone, Default)]
+pub struct RegisterAssignment {
+    registers: HashMap<Local, &'static str>,
+}
+
+impl RegisterAssignment {
+    /// Linear-scan allocation over `function`'s locals. Only register
+    /// parameters and locals of scalar type whose address is never taken
+    /// are candidates. Uses are found through the bindings semantic
+    /// analysis recorded in `symbols`, so shadowing names don't get in the
+    /// way.
+    pub fn compute(function: &Function, symbols: &Symbols, register_params: usize) -> Self {
+        let mut scan = LivenessScan::new(&function.arena, symbols);
+        for (index, param) in function.parameters.iter().enumerate() {
+            let local = (index < register_params).then_some(Local::Param(index));
+            scan.define(Binding::Param(index), local, &param.data_type, 0);
+        }
+        for &stmt in &function.body {
+            scan.visit(stmt);
+        }
+        if scan.has_goto || scan.unresolved {
+            // Jumps we don't model, or uses we can't attribute, could make
+            // any interval wrong
+            return RegisterAssignment::default();
+        }
+
+        let mut intervals = scan.intervals();
+        intervals.sort_by_key(|interval| (interval.start, interval.end));
+
+        let mut free: Vec<&'static str> = CALLEE_SAVED.iter().rev().copied().collect();
+        let mut active: Vec<(Interval, &'static str)> = Vec::new();
+        let mut registers = HashMap::new();
+
+        for interval in intervals {
+            // Expire intervals that ended before this one starts
+            active.retain(|(old, reg)| {
+                let live = old.end >= interval.start;
+                if !live {
+                    free.push(reg);
+                }
+                live
+            });
+
+            if let Some(reg) = free.pop() {
+                registers.insert(interval.local, reg);
+                active.push((interval, reg));
+                continue;
+            }
+
+            // No register left: keep the lighter of the two in memory
+            let (victim, _) = active
+                .iter()
+                .enumerate()
+                .min_by_key(|(_, (old, _))| old.weight)
+                .expect("active set is non-empty when no register is free");
+            if active[victim].0.weight < interval.weight {
+                let (old, reg) = active.swap_remove(victim);
+                registers.remove(&old.local);
+                registers.insert(interval.local, reg);
+                active.push((interval, reg));
+            }
+        }
+
+        RegisterAssignment { registers }
+    }
+
+    /// Register holding `local`, if it was allocated one
+    pub fn register(&self, local: Local) -> Option<&'static str> {
+        self.registers.get(&local).copied()
+    }
+
+    /// Callee-saved registers in use, in a stable order
+    pub fn used(&self) -> Vec<&'static str> {
+        CALLEE_SAVED
+            .iter()
+            .copied()
+            .filter(|reg| self.registers.values().any(|used| used == reg))
+            .collect()
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+struct Interval {
+    local: Local,
+    start: u32,
+    end: u32,
+    weight: u64,
+}
+
+#[derive(Default)]
+struct Candidate {
+    local: Option<Local>,
+    eligible: bool,
+    start: u32,
+    end: u32,
+    weight: u64,
+    uses: Vec<u32>,
+}
+
+/// Numbers statements in execution order and records where each local is
+/// defined and used, and where loops begin and end.
+struct LivenessScan<'a> {
+    arena: &'a AstArena,
+    symbols: &'a Symbols,
+    point: u32,
+    loop_depth: u32,
+    loops: Vec<(u32, u32)>,
+    locals: HashMap<Binding, Candidate>,
+    address_taken: HashSet<Binding>,
+    has_goto: bool,
+    // Set when a variable has no recorded binding
+    unresolved: bool,
+}
+
+impl<'a> LivenessScan<'a> {
+    fn new(arena: &'a AstArena, symbols: &'a Symbols) -> Self {
+        LivenessScan {
+            arena,
+            symbols,
+            point: 0,
+            loop_depth: 0,
+            loops: Vec::new(),
+            locals: HashMap::new(),
+            address_taken: HashSet::new(),
+            has_goto: false,
+            unresolved: false,
+        }
+    }
+
+    fn next_point(&mut self) -> u32 {
+        self.point += 1;
+        self.point
+    }
+
+    fn define(&mut self, binding: Binding, local: Option<Local>, typ: &Type, point: u32) {
+        let candidate = self.locals.entry(binding).or_default();
+        candidate.local = local;
+        candidate.eligible = local.is_some() && is_scalar(typ);
+        candidate.start = point;
+        candidate.end = point;
+        candidate.weight += 1;
+    }
+
+    fn visit(&mut self, stmt: StmtId) {
+        let arena = self.arena;
+        match &arena[stmt] {
+            Statement::VariableDeclaration { data_type, initializer, .. } => {
+                let point = self.next_point();
+                self.uses(*initializer, point);
+                let typ = data_type.as_ref().unwrap_or(&Type::Int);
+                self.define(Binding::Local(stmt), Some(Local::Decl(stmt)), typ, point);
+            }
+            Statement::ArrayDeclaration { size, initializer, .. } => {
+                let point = self.next_point();
+                if let Some(size) = size {
+                    self.uses(*size, point);
+                }
+                self.uses(*initializer, point);
+                self.define(Binding::Local(stmt), None, &Type::Void, point);
+            }
+            Statement::Return(expr) | Statement::ExpressionStatement(expr) => {
+                let point = self.next_point();
+                self.uses(*expr, point);
+            }
+            Statement::Block(stmts) | Statement::AtomicBlock(stmts) => {
+                for &stmt in stmts {
+                    self.visit(stmt);
+                }
+            }
+            Statement::If { condition, then_block, else_block } => {
+                let point = self.next_point();
+                self.uses(*condition, point);
+                self.visit(*then_block);
+                if let Some(else_block) = else_block {
+                    self.visit(*else_block);
+                }
+            }
+            Statement::While { condition, body } => {
+                self.in_loop(|scan| {
+                    let point = scan.next_point();
+                    scan.uses(*condition, point);
+                    scan.visit(*body);
+                });
+            }
+            Statement::For { initializer, condition, increment, body } => {
+                if let Some(init) = initializer {
+                    self.visit(*init);
+                }
+                self.in_loop(|scan| {
+                    let point = scan.next_point();
+                    for expr in condition.iter().chain(increment) {
+                        scan.uses(*expr, point);
+                    }
+                    scan.visit(*body);
+                });
+            }
+            Statement::DoWhile { body, condition } => {
+                self.in_loop(|scan| {
+                    scan.visit(*body);
+                    let point = scan.next_point();
+                    scan.uses(*condition, point);
+                });
+            }
+            Statement::Switch { expression, cases } => {
+                let point = self.next_point();
+                self.uses(*expression, point);
+                for case in cases {
+                    for &stmt in &case.statements {
+                        self.visit(stmt);
+                    }
+                }
+            }
+            Statement::Goto(_) | Statement::Label(..) => self.has_goto = true,
+            _ => {}
+        }
+    }
+
+    fn in_loop(&mut self, f: impl FnOnce(&mut Self)) {
+        let start = self.point + 1;
+        self.loop_depth += 1;
+        f(self);
+        self.loop_depth -= 1;
+        self.loops.push((start, self.point));
+    }
+
+    fn uses(&mut self, expr: ExprId, point: u32) {
+        let arena = self.arena;
+        match &arena[expr] {
+            Expression::Variable(_) => {
+                let weight = 8u64.pow(self.loop_depth.min(4));
+                let Some(binding) = self.symbols.binding(expr) else {
+                    self.unresolved = true;
+                    return;
+                };
+                if let Some(candidate) = self.locals.get_mut(&binding) {
+                    candidate.end = candidate.end.max(point);
+                    candidate.weight += weight;
+                    candidate.uses.push(point);
+                }
+            }
+            Expression::UnaryOperation {
+                operator: OperatorType::Unary(UnaryOp::AddressOf),
+                operand,
+            } => {
+                if let Some(binding) = self.symbols.binding(*operand) {
+                    self.address_taken.insert(binding);
+                }
+                self.uses(*operand, point);
+            }
+            node => node.for_each_child(|child| self.uses(child, point)),
+        }
+    }
+
+    fn intervals(self) -> Vec<Interval> {
+        let loops = self.loops;
+        let address_taken = self.address_taken;
+        self.locals
+            .into_iter()
+            .filter(|(binding, candidate)| candidate.eligible && !address_taken.contains(binding))
+            .map(|(_, candidate)| {
+                let mut end = candidate.end;
+                // A value defined before a loop and used inside it must
+                // survive the back edge, so it stays live to the loop's end
+                for &(loop_start, loop_end) in &loops {
+                    let used_inside = candidate
+                        .uses
+                        .iter()
+                        .any(|&point| (loop_start..=loop_end).contains(&point));
+                    if candidate.start < loop_start && used_inside {
+                        end = end.max(loop_end);
+                    }
+                }
+                Interval {
+                    local: candidate.local.expect("eligible locals have a home"),
+                    start: candidate.start,
+                    end,
+                    weight: candidate.weight,
+                }
+            })
+            .collect()
+    }
+}
+
+/// Integer and pointer types that fit in a general purpose register
+fn is_scalar(typ: &Type) -> bool {
+    match typ {
+        Type::Bool
+        | Type::Char
+        | Type::UnsignedChar
+        | Type::Short
+        | Type::UnsignedShort
+        | Type::Int
+        | Type::UnsignedInt
+        | Type::Long
+        | Type::UnsignedLong
+        | Type::LongLong
+        | Type::UnsignedLongLong
+        | Type::Pointer(_) => true,
+        Type::Const(inner) => is_scalar(inner),
+        _ => false,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+
+    #[test]
+    fn test_scalars_get_registers_unless_address_taken() {
+        let source = "int f(int n) { int i = 0; int x = 1; int y = &x; while (i < n) { i = i + 1; } return i; }";
+        let tokens = Lexer::new(source).scan_tokens();
+        let mut program = Parser::new(tokens).parse().unwrap();
+        let (analysis, _) = crate::analyzer::annotate(&mut program);
+        let function = &program.functions[0];
+        let registers = RegisterAssignment::compute(function, &analysis.functions[0], 6);
+
+        assert!(registers.register(Local::Param(0)).is_some());
+        assert!(registers.register(Local::Decl(function.body[0])).is_some());
+        assert!(registers.register(Local::Decl(function.body[1])).is_none());
+        // n, i and y are live together and need distinct registers
+        assert_eq!(registers.used(), vec!["%rbx", "%r12", "%r13"]);
+    }
+}
@@ -1,176 +1,427 @@
-use crate::parser::ast::{BinaryOp, Expression, Function, Program, Statement, Type, OperatorType, UnaryOp, Struct};
-use std::collections::HashMap;
+use crate::parser::ast::{AstArena, AtomicOp, BinaryOp, ExprId, Expression, Function, Program, Statement, StmtId, Type, OperatorType, UnaryOp};
+use crate::analyzer::constant;
+use crate::analyzer::symbols::{Access, Binding, Symbols};
+use crate::analyzer::Analysis;
+use crate::analyzer::types::TypeTable;
+use crate::compiler::OptimizationLevel;
+use crate::parser::symbol::Symbol;
+use super::frame::{FrameLayout, Home, Slot};
+use super::regalloc::{ExprCosts, RegisterAssignment, SCRATCH};
+use crate::optimizer::ir::{Function as IrFunction, Module};
+use crate::cache::BuildCache;
+use super::asm::{frame, imm, label, mem, reg, rip, Inst, Line};
+use super::object::encoder::{Address, Operand, Register};
+use super::object::{Assembler, ObjectFormat};
+use std::borrow::Cow;
+use std::collections::{HashMap, HashSet};
+use std::fmt::{self, Write as _};
+use std::io::{self, Write};
+use std::sync::Arc;
+use std::thread;
+
+// Appends a directive or comment to the generator's output
+macro_rules! emit {
+    ($generator:expr, $($arg:tt)*) => {
+        $generator.output.push($crate::codegen::asm::Line::Other(format!($($arg)*)))
+    };
+}
+
+mod ir;
+mod peephole;
+
+// System V AMD64 integer argument registers, in order
+const ARG_REGISTERS: [&str; 6] = ["%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"];
+
+// Fewer functions than this per thread aren't worth a thread of their own
+const MIN_FUNCTIONS_PER_THREAD: usize = 16;
+
+// Only string addresses use symbols starting with this
+const STRING_PREFIX: &str = "L.str.";
+
+/// The assembly symbol of the global variable `name`. Globals the compiler
+/// makes up for itself are named like assembler-local labels, starting
+/// with "L." as no C identifier can, and are kept out of the object's
+/// symbol table.
+pub(super) fn global_symbol(name: Symbol) -> String {
+    if is_local(name) {
+        name.to_string()
+    } else {
+        format!("_{}", name)
+    }
+}
+
+fn is_local(name: Symbol) -> bool {
+    name.as_str().starts_with("L.")
+}
+
+/// The code and string literals of one function, generated independently
+/// of the others. Its strings are numbered from 0 and renumbered when the
+/// functions are merged in source order.
+struct FunctionOutput {
+    lines: Vec<Line>,
+    strings: Vec<String>,
+}
+
+impl FunctionOutput {
+    // Encodes the output for the build cache as little-endian lengths
+    // followed by the strings and the code as text
+    fn encode(&self) -> Vec<u8> {
+        let mut bytes = Vec::with_capacity(self.lines.len() * 16 + 64);
+        let mut push = |value: usize| bytes.extend_from_slice(&(value as u64).to_le_bytes());
+        push(self.strings.len());
+        for string in &self.strings {
+            push(string.len());
+        }
+        for string in &self.strings {
+            bytes.extend_from_slice(string.as_bytes());
+        }
+        let mut text = String::new();
+        for line in &self.lines {
+            let _ = writeln!(text, "{}", line);
+        }
+        bytes.extend_from_slice(text.as_bytes());
+        bytes
+    }
+
+    fn decode(bytes: &[u8]) -> Option<Self> {
+        let mut position = 0;
+        let mut next = || {
+            let value = u64::from_le_bytes(bytes.get(position..position + 8)?.try_into().ok()?);
+            position += 8;
+            usize::try_from(value).ok()
+        };
+        let lengths = (0..next()?).map(|_| next()).collect::<Option<Vec<_>>>()?;
+        let mut strings = Vec::with_capacity(lengths.len());
+        for len in lengths {
+            let string = bytes.get(position..position.checked_add(len)?)?;
+            strings.push(String::from_utf8(string.to_vec()).ok()?);
+            position += len;
+        }
+        let text = std::str::from_utf8(bytes.get(position..)?).ok()?;
+        let lines = text.lines().map(|line| Line::parse(line).ok()).collect::<Option<Vec<_>>>()?;
+        // Every string referred to must be in the table
+        let operands = lines.iter().flat_map(|line| match line {
+            Line::Inst(inst) => inst.operands.as_slice(),
+            _ => &[],
+        });
+        if operands.filter_map(string_number).any(|local| local >= strings.len()) {
+            return None;
+        }
+        Some(FunctionOutput { lines, strings })
+    }
+}
+
+// The number of the string literal `operand` addresses, if it's one
+fn string_number(operand: &Operand) -> Option<usize> {
+    match operand {
+        Operand::Memory(Address::Rip { symbol, .. }) => symbol.strip_prefix(STRING_PREFIX)?.parse().ok(),
+        _ => None,
+    }
+}
 
 pub struct X86_64Generator {
-    output: String,
-    variables: HashMap<String, i32>, // Maps variable names to stack offsets
-    current_stack_offset: i32,
+    output: Vec<Line>,
+    symbols: Arc<Symbols>, // What the current function's names refer to
+    frame: FrameLayout,
+    opt_level: OptimizationLevel,
+    costs: ExprCosts,
+    free_scratch: Vec<&'static str>, // Scratch registers not holding a temporary
     strings: Vec<String>,
+    function_name: Symbol, // Keeps label names unique across functions
     label_counter: usize,
     current_loop_end_label: Option<String>,
     current_loop_start_label: Option<String>,
-    structs: HashMap<String, Vec<(String, Type, usize)>>, // struct name -> [(field name, type, offset)]
+    types: TypeTable,
+    threads: usize,
+    cache: Option<Arc<BuildCache>>,
+    // What the code of every function depends on besides the function
+    // itself, for its cache key
+    cache_context: String,
+    // Global arrays, whose name stands for their address
+    global_arrays: HashSet<Symbol>,
 }
 
 impl X86_64Generator {
     pub fn new() -> Self {
         X86_64Generator {
-            output: String::new(),
-            variables: HashMap::new(),
-            current_stack_offset: 0,
+            output: Vec::new(),
+            symbols: Arc::default(),
+            frame: FrameLayout::default(),
+            opt_level: OptimizationLevel::None,
+            costs: ExprCosts::default(),
+            free_scratch: Vec::new(),
             strings: Vec::new(),
+            function_name: Symbol::intern(""),
             label_counter: 0,
             current_loop_end_label: None,
             current_loop_start_label: None,
-            structs: HashMap::new(),
+            types: TypeTable::default(),
+            threads: thread::available_parallelism().map_or(1, |threads| threads.get()),
+            cache: None,
+            cache_context: String::new(),
+            global_arrays: HashSet::new(),
         }
     }
 
-    pub fn generate(&mut self, program: &Program) -> String {
+    /// -O1 evaluates expressions in registers, ordering operands by their
+    /// Sethi-Ullman number; -O2 also keeps hot locals in callee-saved registers
+    pub fn with_optimization(mut self, level: OptimizationLevel) -> Self {
+        self.opt_level = level;
+        self
+    }
+
+    /// Generate functions on up to `threads` threads. The output doesn't
+    /// depend on the thread count.
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        self.threads = threads.max(1);
+        self
+    }
+
+    /// Reuse the code of functions compiled before from `cache`, and add
+    /// the code of new ones to it
+    pub fn with_cache(mut self, cache: Arc<BuildCache>) -> Self {
+        self.cache = Some(cache);
+        self
+    }
+
+    #[allow(dead_code)]
+    pub fn generate(&mut self, program: &Program, analysis: &Analysis) -> String {
+        self.generate_program(program, analysis, None)
+    }
+
+    /// Like `generate`, but compiles the functions present in `module` from
+    /// their optimized IR
+    #[allow(dead_code)]
+    pub fn generate_optimized(&mut self, program: &Program, analysis: &Analysis, module: &Module) -> String {
+        self.generate_program(program, analysis, Some(module))
+    }
+
+    fn generate_program(&mut self, program: &Program, analysis: &Analysis, module: Option<&Module>) -> String {
+        let mut out = Vec::new();
+        self.generate_into(program, analysis, module, &mut out).expect("writing to memory can't fail");
+        String::from_utf8(out).expect("assembly is UTF-8")
+    }
+
+    /// Writes the assembly of `program`, as `analysis` found it, to `out`,
+    /// compiling the functions present in `module` from their optimized IR.
+    /// Each function is written as soon as it's been renumbered into place,
+    /// so the whole file is never held in memory at once as text.
+    pub fn generate_into(
+        &mut self,
+        program: &Program,
+        analysis: &Analysis,
+        module: Option<&Module>,
+        out: &mut dyn Write,
+    ) -> io::Result<()> {
+        let mut text = String::new();
+        self.generate_listing(program, analysis, module, &mut |lines| {
+            text.clear();
+            for line in lines {
+                let _ = writeln!(text, "{}", line);
+            }
+            out.write_all(text.as_bytes())
+        })
+    }
+
+    /// Like `generate_into`, but assembles the code into an object file as
+    /// it's generated
+    pub fn generate_object(
+        &mut self,
+        program: &Program,
+        analysis: &Analysis,
+        module: Option<&Module>,
+        format: ObjectFormat,
+    ) -> Result<Vec<u8>, String> {
+        let mut assembler = Assembler::new();
+        self.generate_listing(program, analysis, module, &mut |lines| {
+            lines.iter().try_for_each(|line| assembler.line(line))
+        })?;
+        assembler.finish(format)
+    }
+
+    // Generates `program`, handing `put` the global data, then each
+    // function in source order, then the string literals
+    fn generate_listing<E>(
+        &mut self,
+        program: &Program,
+        analysis: &Analysis,
+        module: Option<&Module>,
+        put: &mut dyn FnMut(&[Line]) -> Result<(), E>,
+    ) -> Result<(), E> {
         self.output.clear();
-        self.variables.clear();
-        self.current_stack_offset = 0;
         self.strings.clear();
+        self.global_arrays.clear();
         self.label_counter = 0;
 
         // Add necessary assembly directives and headers
         self.emit_line(".section __TEXT,__text,regular,pure_instructions");
         
-        // Register struct types
-        for struct_def in &program.structs {
-            self.register_struct(struct_def);
-        }
-        
+        self.types = analysis.types.clone();
+
         // Process global variables
-        for global in &program.globals {
-            self.process_global(global);
+        for &global in &program.globals {
+            self.process_global(&program.arena, global);
         }
+        // Functions go back in the text section after any global data
+        if self.output.iter().any(|line| matches!(line, Line::Other(line) if line.contains("__DATA"))) {
+            self.emit_line("");
+            self.emit_line(".section __TEXT,__text,regular,pure_instructions");
+        }
+        if self.cache.is_some() {
+            // Each function's own key covers what its names resolved to
+            let mut arrays: Vec<_> = self.global_arrays.iter().map(|name| name.as_str()).collect();
+            arrays.sort_unstable();
+            self.cache_context = format!("{:?} {:?} {:?}", self.opt_level, program.structs, arrays);
+        }
+        put(&self.output)?;
         
-        // Generate code for each function
-        for function in &program.functions {
-            self.generate_function(function);
+        // Generate code for each function, then write it out in source
+        // order
+        let optimized: HashMap<Symbol, &IrFunction> = module
+            .map(|module| module.functions.iter().map(|function| (function.name, function)).collect())
+            .unwrap_or_default();
+        for function in self.generate_functions(&program.functions, &analysis.functions, &optimized) {
+            self.write_function(function, put)?;
         }
         
         // Add string literals at the end
+        self.output.clear();
         if !self.strings.is_empty() {
             self.emit_line("");
             self.emit_line(".section __TEXT,__cstring,cstring_literals");
             
-            // Create a copy of the strings to avoid borrowing issues
-            let strings_copy = self.strings.clone();
-            for (i, string) in strings_copy.iter().enumerate() {
-                self.emit_line(&format!("L.str.{}:", i));
-                // Escape the string before formatting
-                let escaped = Self::escape_string(string);
-                self.emit_line(&format!("    .asciz \"{}\"", escaped));
+            let strings = std::mem::take(&mut self.strings);
+            for (i, string) in strings.iter().enumerate() {
+                self.label(&format!("{}{}", STRING_PREFIX, i));
+                emit!(self, "    .asciz \"{}\"", Escaped(string));
             }
         }
-
-        self.output.clone()
+        put(&self.output)
     }
     
-    fn register_struct(&mut self, struct_def: &Struct) {
-        let mut offset = 0;
-        let mut field_info = Vec::new();
-        
-        for field in &struct_def.fields {
-            let size = self.get_type_size(&field.data_type);
-            let alignment = self.get_type_alignment(&field.data_type);
-            
-            // Apply field alignment
-            offset = (offset + alignment - 1) / alignment * alignment;
-            
-            field_info.push((field.name.clone(), field.data_type.clone(), offset));
-            offset += size;
+    /// Generates every function into its own buffer, splitting the list
+    /// into contiguous chunks across threads when it is long enough
+    fn generate_functions(
+        &self,
+        functions: &[Function],
+        symbols: &[Arc<Symbols>],
+        optimized: &HashMap<Symbol, &IrFunction>,
+    ) -> Vec<FunctionOutput> {
+        let chunk_size = functions.len().div_ceil(self.threads).max(MIN_FUNCTIONS_PER_THREAD);
+        if chunk_size >= functions.len() {
+            let mut worker = self.worker();
+            return functions
+                .iter()
+                .zip(symbols)
+                .map(|(function, symbols)| worker.generate_function_output(function, symbols, optimized))
+                .collect();
         }
-        
-        self.structs.insert(struct_def.name.clone(), field_info);
+
+        thread::scope(|scope| {
+            let handles: Vec<_> = functions
+                .chunks(chunk_size)
+                .zip(symbols.chunks(chunk_size))
+                .map(|(functions, symbols)| {
+                    let mut worker = self.worker();
+                    scope.spawn(move || {
+                        functions
+                            .iter()
+                            .zip(symbols)
+                            .map(|(function, symbols)| worker.generate_function_output(function, symbols, optimized))
+                            .collect::<Vec<_>>()
+                    })
+                })
+                .collect();
+            handles
+                .into_iter()
+                .flat_map(|handle| handle.join().expect("code generation thread panicked"))
+                .collect()
+        })
     }
-    
-    fn get_type_size(&self, typ: &Type) -> usize {
-        match typ {
-            Type::Void => 0,
-            Type::Bool => 1,
-            Type::Char | Type::UnsignedChar => 1,
-            Type::Short | Type::UnsignedShort => 2,
-            Type::Int | Type::UnsignedInt => 4,
-            Type::Long | Type::UnsignedLong => 8,
-            Type::LongLong | Type::UnsignedLongLong => 8,
-            Type::Float => 4,
-            Type::Double => 8,
-            Type::Pointer(_) => 8, // 64-bit pointers
-            Type::Array(elem_type, Some(size)) => elem_type.size() * size,
-            Type::Array(elem_type, None) => elem_type.size(), // VLA
-            Type::Struct(name) => {
-                // Get the struct size from the registry
-                if let Some(fields) = self.structs.get(name) {
-                    if fields.is_empty() {
-                        0
-                    } else {
-                        // Last field offset + last field size
-                        let (_, field_type, offset) = fields.last().unwrap();
-                        offset + self.get_type_size(field_type)
-                    }
-                } else {
-                    // Unknown struct, assume size 0
-                    0
-                }
-            },
-            Type::Union(name) => {
-                // For unions, size is the size of the largest field
-                if let Some(fields) = self.structs.get(name) {
-                    fields
-                        .iter()
-                        .map(|(_, field_type, _)| self.get_type_size(field_type))
-                        .max()
-                        .unwrap_or(0)
-                } else {
-                    // Unknown union, assume size 0
-                    0
-                }
-            },
-            Type::Function { .. } => 8, // Function pointers are 8 bytes
-            Type::Const(inner) => self.get_type_size(inner),
-            Type::Volatile(inner) => self.get_type_size(inner),
-            Type::Restrict(inner) => self.get_type_size(inner),
-            Type::TypeDef(_) => 8, // Assume 8 bytes, should be resolved during semantic analysis
-            Type::Complex => 16,    // _Complex
-            Type::Imaginary => 8,   // _Imaginary
-            Type::Atomic(inner) => self.get_type_size(inner),   // _Atomic type - C11
-            Type::Generic { .. } => 8,   // Generic type
+
+    // A generator sharing this one's settings and type layouts, with empty
+    // output
+    fn worker(&self) -> Self {
+        X86_64Generator {
+            opt_level: self.opt_level,
+            types: self.types.clone(),
+            threads: 1,
+            cache: self.cache.clone(),
+            cache_context: self.cache_context.clone(),
+            global_arrays: self.global_arrays.clone(),
+            ..Self::new()
         }
     }
-    
-    fn get_type_alignment(&self, typ: &Type) -> usize {
-        match typ {
-            Type::Void => 1,
-            Type::Bool => 1,
-            Type::Char | Type::UnsignedChar => 1,
-            Type::Short | Type::UnsignedShort => 2,
-            Type::Int | Type::UnsignedInt => 4,
-            Type::Long | Type::UnsignedLong => 8,
-            Type::LongLong | Type::UnsignedLongLong => 8,
-            Type::Float => 4,
-            Type::Double => 8,
-            Type::Pointer(_) => 8,
-            Type::Array(elem_type, _) => self.get_type_alignment(elem_type),
-            Type::Struct(_) => 8, // Simplified, should use field alignments
-            Type::Union(_) => 8,  // Simplified, should use field alignments
-            Type::Function { .. } => 8,
-            Type::Const(inner) => self.get_type_alignment(inner),
-            Type::Volatile(inner) => self.get_type_alignment(inner),
-            Type::Restrict(inner) => self.get_type_alignment(inner),
-            Type::TypeDef(_) => 8,
-            Type::Complex => 16,    // _Complex
-            Type::Imaginary => 8,   // _Imaginary
-            Type::Atomic(inner) => self.get_type_alignment(inner),   // _Atomic type - C11
-            Type::Generic { .. } => 8,   // Generic type
+
+    // Generates a function, or takes its code from the build cache. The
+    // code doesn't depend on where the function is in the file, so it can
+    // be reused after edits elsewhere.
+    fn generate_function_output(
+        &mut self,
+        function: &Function,
+        symbols: &Arc<Symbols>,
+        optimized: &HashMap<Symbol, &IrFunction>,
+    ) -> FunctionOutput {
+        let optimized = optimized.get(&function.name);
+        let key = self.cache.as_ref().map(|cache| {
+            let source = match optimized {
+                Some(optimized) => format!("{:?}", optimized),
+                None => format!("{:?} {:?}", function, symbols),
+            };
+            cache.key(&["function", &self.cache_context, &source])
+        });
+        if let (Some(cache), Some(key)) = (&self.cache, &key) {
+            if let Some(output) = cache.get(key).and_then(|bytes| FunctionOutput::decode(&bytes)) {
+                return output;
+            }
+        }
+
+        self.output.clear();
+        self.function_name = function.name;
+        self.label_counter = 0;
+        match optimized {
+            Some(optimized) => self.generate_ir_function(optimized),
+            None => self.generate_function(function, symbols),
+        }
+        let mut output = FunctionOutput {
+            lines: std::mem::take(&mut self.output),
+            strings: std::mem::take(&mut self.strings),
+        };
+        if self.opt_level != OptimizationLevel::None {
+            peephole::optimize(&mut output);
+        }
+        if let (Some(cache), Some(key)) = (&self.cache, &key) {
+            cache.put(key, &output.encode());
         }
+        output
     }
-    
-    fn process_global(&mut self, global: &Statement) {
-        match global {
-            Statement::VariableDeclaration { name, data_type, initializer, is_global, alignment: _ } => {
+
+    // Write a function's code, renumbering its strings to follow those of
+    // the functions before it
+    fn write_function<E>(
+        &mut self,
+        mut function: FunctionOutput,
+        put: &mut dyn FnMut(&[Line]) -> Result<(), E>,
+    ) -> Result<(), E> {
+        let base = self.strings.len();
+        for line in &mut function.lines {
+            if let Line::Inst(inst) = line {
+                for operand in &mut inst.operands {
+                    let Some(local) = string_number(operand) else { continue };
+                    if let Operand::Memory(Address::Rip { symbol, .. }) = operand {
+                        *symbol = format!("{}{}", STRING_PREFIX, base + local);
+                    }
+                }
+            }
+        }
+        put(&function.lines)?;
+        self.strings.extend(function.strings);
+        Ok(())
+    }
+
+    fn process_global(&mut self, arena: &AstArena, global: StmtId) {
+        match &arena[global] {
+            Statement::VariableDeclaration { name, data_type, initializer, is_global, alignment } => {
                 if !is_global {
                     return;
                 }
@@ -178,213 +429,169 @@ impl X86_64Generator {
                 // Start the data section if not already
                 self.emit_line("");
                 self.emit_line(".section __DATA,__data");
-                self.emit_line(&format!(".globl _{}", name));
-                self.emit_line(&format!("_{}: ", name));
-                
-                // Generate initial value based on the type
-                if let Some(typ) = data_type {
-                    match typ {
-                        Type::Int => {
-                            if let Expression::IntegerLiteral(value) = initializer {
-                                self.emit_line(&format!("    .long {}", value));
-                            } else {
-                                self.emit_line("    .long 0");
-                            }
-                        }
-                        Type::Char => {
-                            if let Expression::CharLiteral(value) = initializer {
-                                self.emit_line(&format!("    .byte {}", *value as u8));
-                            } else {
-                                self.emit_line("    .byte 0");
-                            }
-                        }
-                        Type::Pointer(_) => {
-                            self.emit_line("    .quad 0");
-                        }
-                        _ => {
-                            // Default to 8 bytes of zeros for other types
-                            self.emit_line("    .quad 0");
-                        }
-                    }
-                } else {
-                    // No type specified, assume int
-                    self.emit_line("    .long 0");
+                if !is_local(*name) {
+                    emit!(self, ".globl _{}", name);
+                }
+                let typ = data_type.clone().unwrap_or(Type::Int);
+                let alignment = self.types.align_of(&typ).max(alignment.unwrap_or(1)).next_power_of_two();
+                if alignment > 1 {
+                    emit!(self, ".p2align {}", alignment.trailing_zeros());
+                }
+                self.label(&global_symbol(*name));
+
+                // Scalars get the value of a constant initializer, at the
+                // width they're loaded with; anything else starts zeroed
+                let value = constant::evaluate(arena, *initializer, &self.types).unwrap_or(0);
+                match self.types.size_of(&typ) {
+                    1 => emit!(self, "    .byte {}", value as u8),
+                    2 => emit!(self, "    .short {}", value as i16),
+                    4 => emit!(self, "    .long {}", value as i32),
+                    8 => emit!(self, "    .quad {}", value),
+                    size => emit!(self, "    .zero {}", size.max(1)),
                 }
             }
+            Statement::ArrayDeclaration { name, data_type, size, initializer, is_global, alignment } => {
+                if !is_global {
+                    return;
+                }
+                let element = data_type.clone().unwrap_or(Type::Int);
+                let element_size = self.types.size_of(&element).clamp(1, 8);
+                let values: Vec<i64> = match &arena[*initializer] {
+                    Expression::ArrayLiteral(elements) => elements
+                        .iter()
+                        .map(|&element| constant::evaluate(arena, element, &self.types).unwrap_or(0))
+                        .collect(),
+                    _ => Vec::new(),
+                };
+                let length = size
+                    .and_then(|size| constant::evaluate(arena, size, &self.types))
+                    .and_then(|length| usize::try_from(length).ok())
+                    .unwrap_or(values.len());
+                let directive = match element_size {
+                    1 => ".byte",
+                    2 => ".short",
+                    4 => ".long",
+                    _ => ".quad",
+                };
+
+                self.emit_line("");
+                self.emit_line(".section __DATA,__data");
+                if !is_local(*name) {
+                    emit!(self, ".globl _{}", name);
+                }
+                let alignment = alignment.unwrap_or(1).max(element_size).next_power_of_two();
+                emit!(self, ".p2align {}", alignment.trailing_zeros());
+                self.label(&global_symbol(*name));
+                for value in values.iter().take(length) {
+                    emit!(self, "    {} {}", directive, value);
+                }
+                if length > values.len() {
+                    emit!(self, "    .zero {}", (length - values.len()) * element_size);
+                }
+                self.global_arrays.insert(*name);
+            }
             _ => {
                 // Only variable declarations can be global
             }
         }
     }
 
-    fn generate_function(&mut self, function: &Function) {
+    fn generate_function(&mut self, function: &Function, symbols: &Arc<Symbols>) {
+        let arena = &function.arena;
+
         // Reset function state
-        self.variables.clear();
-        self.current_stack_offset = 0;
+        self.symbols = Arc::clone(symbols);
         self.current_loop_start_label = None;
         self.current_loop_end_label = None;
+
+        // Choose registers and lay out the frame before emitting anything so
+        // the prologue knows its size
+        let registers = if self.opt_level == OptimizationLevel::Full {
+            RegisterAssignment::compute(function, symbols, ARG_REGISTERS.len())
+        } else {
+            RegisterAssignment::default()
+        };
+        self.frame = FrameLayout::compute(function, ARG_REGISTERS.len(), &registers, |typ| {
+            (self.types.size_of(typ), self.types.align_of(typ))
+        });
+        self.costs = ExprCosts::new(arena);
+        self.free_scratch = SCRATCH.iter().rev().copied().collect();
         
         // Function label
         self.emit_line("");
-        self.emit_line(&format!(".globl _{}", function.name));
-        self.emit_line(&format!("_{}: ", function.name));
+        emit!(self, ".globl _{}", function.name);
+        self.label(&format!("_{}", function.name));
 
         // Function prologue
-        self.emit_line("    push %rbp");
-        self.emit_line("    mov %rsp, %rbp");
+        self.inst("push", [reg("%rbp")]);
+        self.inst("mov", [reg("%rsp"), reg("%rbp")]);
 
-        // First pass: analyze the function to determine stack space needed
-        let mut stack_size = 0;
-        
-        // Account for parameters
-        for (i, _param) in function.parameters.iter().enumerate() {
-            if i < 6 {  // First 6 parameters are in registers
-                stack_size += 8;  // 8 bytes per parameter
-            }
-        }
-        
-        // Account for local variables by analyzing the function body
-        stack_size += self.calculate_stack_size(&function.body);
-        
-        // Align stack to 16 bytes (ABI requirement)
-        if stack_size % 16 != 0 {
-            stack_size = (stack_size / 16 + 1) * 16;
-        }
-        
         // Reserve stack space for parameters and local variables
+        let stack_size = self.frame.size();
         if stack_size > 0 {
-            self.emit_line(&format!("    sub ${}, %rsp", stack_size));
+            self.inst("sub", [imm(stack_size), reg("%rsp")]);
         }
         
-        // Store parameter values in the stack
-        for (i, param) in function.parameters.iter().enumerate() {
-            if i < 6 {  // First 6 parameters are in registers
-                // The first 6 parameters use registers in System V ABI
-                // (rdi, rsi, rdx, rcx, r8, r9)
-                let reg = match i {
-                    0 => "%rdi",
-                    1 => "%rsi",
-                    2 => "%rdx",
-                    3 => "%rcx",
-                    4 => "%r8",
-                    5 => "%r9",
-                    _ => unreachable!(),
-                };
-                
-                // Store the parameter in the stack
-                self.current_stack_offset -= 8;
-                self.variables.insert(param.name.clone(), self.current_stack_offset);
-                self.emit_line(&format!("    mov {}, {}(%rbp)", reg, self.current_stack_offset));
+        // Preserve the callee-saved registers allocated to locals
+        for (name, offset) in self.frame.saved_registers().to_vec() {
+            self.inst("movq", [reg(name), frame(offset)]);
+        }
+        
+        // Store parameter values in their slots
+        // The first 6 parameters use registers in System V ABI
+        for i in 0..function.parameters.len().min(ARG_REGISTERS.len()) {
+            let slot = self.frame.param(i).expect("register parameter without a frame slot");
+            match slot.home {
+                Home::Frame(offset) => {
+                    let name = Self::sized_register(ARG_REGISTERS[i], slot.width);
+                    self.inst(format!("mov{}", Self::suffix(slot.width)), [reg(name), frame(offset)]);
+                }
+                Home::Register(home) => self.emit_extend(ARG_REGISTERS[i], slot.width, slot.signed, home),
             }
         }
 
         // Generate code for function body
-        for statement in &function.body {
-            self.generate_statement(statement);
+        for &statement in &function.body {
+            self.generate_statement(arena, statement);
         }
 
         // Check if the function already has a return statement
         let has_return = function
             .body
             .iter()
-            .any(|stmt| matches!(stmt, Statement::Return(_)));
+            .any(|&stmt| matches!(arena[stmt], Statement::Return(_)));
 
         // Function epilogue (if not already returned)
         if !has_return {
-            self.emit_line("    mov %rbp, %rsp");
-            self.emit_line("    pop %rbp");
-            self.emit_line("    ret");
+            self.emit_epilogue();
         }
     }
 
-    // Calculate the stack size needed for a list of statements
-    fn calculate_stack_size(&self, statements: &[Statement]) -> usize {
-        let mut size = 0;
-        
-        for stmt in statements {
-            match stmt {
-                Statement::VariableDeclaration { .. } => {
-                    // Each variable takes 8 bytes
-                    size += 8;
-                }
-                Statement::ArrayDeclaration { size: Some(expr), .. } => {
-                    // For array declarations with constant size
-                    if let Expression::IntegerLiteral(n) = expr {
-                        size += (*n as usize) * 8;  // 8 bytes per element
-                    } else {
-                        // For non-constant sizes, allocate a reasonable default
-                        size += 64;  // Default to 8 elements
-                    }
-                }
-                Statement::Block(block_stmts) => {
-                    // Recursively calculate size for nested blocks
-                    size += self.calculate_stack_size(block_stmts);
-                }
-                Statement::If { then_block, else_block, .. } => {
-                    // Calculate size for both branches and take the maximum
-                    let then_size = self.calculate_stack_size(&[*then_block.clone()]);
-                    let else_size = if let Some(else_stmt) = else_block {
-                        self.calculate_stack_size(&[*else_stmt.clone()])
-                    } else {
-                        0
-                    };
-                    size += then_size.max(else_size);
-                }
-                Statement::While { body, .. } | Statement::DoWhile { body, .. } => {
-                    size += self.calculate_stack_size(&[*body.clone()]);
-                }
-                Statement::For { body, initializer, .. } => {
-                    // Account for initializer if it's a variable declaration
-                    if let Some(init) = initializer {
-                        size += self.calculate_stack_size(&[*init.clone()]);
-                    }
-                    size += self.calculate_stack_size(&[*body.clone()]);
-                }
-                Statement::Switch { cases, .. } => {
-                    // Calculate size for all cases and take the maximum
-                    let mut max_case_size = 0;
-                    for case in cases {
-                        let case_size = self.calculate_stack_size(&case.statements);
-                        max_case_size = max_case_size.max(case_size);
-                    }
-                    size += max_case_size;
-                }
-                _ => {} // Other statement types don't allocate stack space
-            }
-        }
-        
-        size
-    }
-
-    fn generate_statement(&mut self, statement: &Statement) {
-        match statement {
+    fn generate_statement(&mut self, arena: &AstArena, statement: StmtId) {
+        match &arena[statement] {
             Statement::Return(expr) => {
                 // Evaluate expression and put result in %rax
-                self.generate_expression(expr);
-                self.emit_line("    mov %rbp, %rsp");
-                self.emit_line("    pop %rbp");
-                self.emit_line("    ret");
+                self.generate_expression(arena, *expr);
+                self.emit_epilogue();
             }
-            Statement::VariableDeclaration { name, data_type: _, initializer, is_global: _, alignment: _ } => {
+            Statement::VariableDeclaration { initializer, .. } => {
                 // Evaluate initializer
-                self.generate_expression(initializer);
+                self.generate_expression(arena, *initializer);
 
-                // Store result in stack
-                self.current_stack_offset -= 8;
-                self.variables
-                    .insert(name.clone(), self.current_stack_offset);
-                self.emit_line(&format!(
-                    "    mov %rax, {}(%rbp)",
-                    self.current_stack_offset
-                ));
+                // Store result in the slot chosen by the frame layout
+                let slot = self.frame.local(statement).expect("declaration without a frame slot");
+                self.emit_store(slot);
+            }
+            Statement::ArrayDeclaration { data_type, size, initializer, .. } => {
+                self.generate_array_initializer(arena, statement, data_type.as_ref(), *size, *initializer);
             }
             Statement::ExpressionStatement(expr) => {
-                self.generate_expression(expr);
+                self.generate_expression(arena, *expr);
                 // Result is discarded
             }
             Statement::Block(statements) => {
-                for stmt in statements {
-                    self.generate_statement(stmt);
+                for &stmt in statements {
+                    self.generate_statement(arena, stmt);
                 }
             }
             Statement::If { condition, then_block, else_block } => {
@@ -392,25 +599,25 @@ impl X86_64Generator {
                 let label_end = self.next_label("if_end");
                 
                 // Generate condition code
-                self.generate_expression(condition);
-                self.emit_line("    cmp $0, %rax");
+                self.generate_expression(arena, *condition);
+                self.inst("cmp", [imm(0), reg("%rax")]);
                 
                 if else_block.is_some() {
-                    self.emit_line(&format!("    je {}", label_else));
+                    self.inst("je", [label(&label_else)]);
                 } else {
-                    self.emit_line(&format!("    je {}", label_end));
+                    self.inst("je", [label(&label_end)]);
                 }
                 
                 // Then block
-                self.generate_statement(then_block);
+                self.generate_statement(arena, *then_block);
                 
                 if else_block.is_some() {
-                    self.emit_line(&format!("    jmp {}", label_end));
-                    self.emit_line(&format!("{}:", label_else));
-                    self.generate_statement(else_block.as_ref().unwrap());
+                    self.inst("jmp", [label(&label_end)]);
+                    self.label(&label_else);
+                    self.generate_statement(arena, else_block.unwrap());
                 }
                 
-                self.emit_line(&format!("{}:", label_end));
+                self.label(&label_end);
             }
             Statement::While { condition, body } => {
                 let label_start = self.next_label("while_start");
@@ -424,19 +631,19 @@ impl X86_64Generator {
                 self.current_loop_start_label = Some(label_start.clone());
                 self.current_loop_end_label = Some(label_end.clone());
                 
-                self.emit_line(&format!("{}:", label_start));
+                self.label(&label_start);
                 
                 // Generate condition code
-                self.generate_expression(condition);
-                self.emit_line("    cmp $0, %rax");
-                self.emit_line(&format!("    je {}", label_end));
+                self.generate_expression(arena, *condition);
+                self.inst("cmp", [imm(0), reg("%rax")]);
+                self.inst("je", [label(&label_end)]);
                 
                 // Loop body
-                self.generate_statement(body);
+                self.generate_statement(arena, *body);
                 
                 // Jump back to start
-                self.emit_line(&format!("    jmp {}", label_start));
-                self.emit_line(&format!("{}:", label_end));
+                self.inst("jmp", [label(&label_start)]);
+                self.label(&label_end);
                 
                 // Restore previous loop labels
                 self.current_loop_start_label = prev_start;
@@ -457,78 +664,64 @@ impl X86_64Generator {
                 
                 // Initializer
                 if let Some(init) = initializer {
-                    self.generate_statement(init);
+                    self.generate_statement(arena, *init);
                 }
                 
-                self.emit_line(&format!("    jmp {}", label_check));
-                self.emit_line(&format!("{}:", label_start));
+                self.inst("jmp", [label(&label_check)]);
+                self.label(&label_start);
                 
                 // Loop body
-                self.generate_statement(body);
+                self.generate_statement(arena, *body);
                 
                 // Increment
                 if let Some(inc) = increment {
-                    self.generate_expression(inc);
+                    self.generate_expression(arena, *inc);
                 }
                 
                 // Condition check
-                self.emit_line(&format!("{}:", label_check));
+                self.label(&label_check);
                 if let Some(cond) = condition {
-                    self.generate_expression(cond);
-                    self.emit_line("    cmp $0, %rax");
-                    self.emit_line(&format!("    jne {}", label_start));
+                    self.generate_expression(arena, *cond);
+                    self.inst("cmp", [imm(0), reg("%rax")]);
+                    self.inst("jne", [label(&label_start)]);
                 } else {
                     // No condition means loop forever (until break)
-                    self.emit_line(&format!("    jmp {}", label_start));
+                    self.inst("jmp", [label(&label_start)]);
                 }
                 
-                self.emit_line(&format!("{}:", label_end));
+                self.label(&label_end);
                 
                 // Restore previous loop labels
                 self.current_loop_start_label = prev_start;
                 self.current_loop_end_label = prev_end;
             }
             Statement::Break => {
-                if let Some(label) = &self.current_loop_end_label {
-                    self.emit_line(&format!("    jmp {}", label));
+                if let Some(target) = &self.current_loop_end_label {
+                    self.inst("jmp", [label(target)]);
                 }
             }
             Statement::Continue => {
-                if let Some(label) = &self.current_loop_start_label {
-                    self.emit_line(&format!("    jmp {}", label));
+                if let Some(target) = &self.current_loop_start_label {
+                    self.inst("jmp", [label(target)]);
                 }
             }
             _ => {
                 // Other statement types not yet implemented
-                self.emit_line(&format!("    # Unimplemented statement: {:?}", statement));
+                emit!(self, "    # Unimplemented statement: {:?}", arena[statement]);
             }
         }
     }
 
-    fn generate_expression(&mut self, expr: &Expression) {
-        match expr {
+    fn generate_expression(&mut self, arena: &AstArena, expr: ExprId) {
+        match &arena[expr] {
             Expression::IntegerLiteral(value) => {
-                self.emit_line(&format!("    mov ${}, %rax", value));
-            }
-            Expression::StringLiteral(value) => {
-                // Add string to literals section and store the index
-                let string_index = self.strings.len();
-                self.strings.push(value.clone());
-                
-                // Load the address of the string
-                self.emit_line(&format!("    leaq L.str.{}(%rip), %rax", string_index));
+                self.inst("mov", [imm(*value), reg("%rax")]);
             }
+            Expression::StringLiteral(value) => self.emit_string_address(value, "%rax"),
             Expression::CharLiteral(value) => {
-                self.emit_line(&format!("    mov ${}, %rax", *value as u8));
-            }
-            Expression::Variable(name) => {
-                if let Some(offset) = self.variables.get(name) {
-                    self.emit_line(&format!("    mov {}(%rbp), %rax", offset));
-                } else {
-                    // Could be a global variable
-                    self.emit_line(&format!("    mov _{}(%rip), %rax", name));
-                }
+                self.inst("mov", [imm(*value as u8), reg("%rax")]);
             }
+            Expression::Variable(_) => self.generate_leaf(arena, expr, "%rax"),
             Expression::BinaryOperation {
                 left,
                 operator,
@@ -539,35 +732,49 @@ impl X86_64Generator {
                     BinaryOp::Add | BinaryOp::Subtract | BinaryOp::Multiply | BinaryOp::Divide |
                     BinaryOp::Modulo | BinaryOp::BitwiseAnd | BinaryOp::BitwiseOr | BinaryOp::BitwiseXor |
                     BinaryOp::LeftShift | BinaryOp::RightShift => {
-                        // Generate right operand first and push to stack
-                        self.generate_expression(right);
-                        self.emit_line("    push %rax");
-                        
-                        // Generate left operand into %rax
-                        self.generate_expression(left);
-                        
-                        // Move right operand to %rcx
-                        self.emit_line("    pop %rcx");
+                        // Multiplying and dividing by a suitable constant
+                        // needs no second operand
+                        if self.opt_level != OptimizationLevel::None {
+                            if let Expression::IntegerLiteral(value) = arena[*right] {
+                                let value = i64::from(value);
+                                let selected = match operator {
+                                    BinaryOp::Multiply => Self::multiplies_without_imul(value),
+                                    BinaryOp::Divide | BinaryOp::Modulo => Self::divides_by_shifting(value),
+                                    _ => false,
+                                };
+                                if selected {
+                                    self.generate_expression(arena, *left);
+                                    match operator {
+                                        BinaryOp::Multiply => self.emit_multiply_by_constant("%rax", value),
+                                        _ => self.emit_divide_by_power_of_two(value, *operator == BinaryOp::Modulo),
+                                    }
+                                    return;
+                                }
+                            }
+                        }
+
+                        // Left operand in %rax, right operand in %rcx
+                        self.generate_operands(arena, *left, *right);
                         
                         // Perform operation
                         match operator {
-                            BinaryOp::Add => self.emit_line("    add %rcx, %rax"),
-                            BinaryOp::Subtract => self.emit_line("    sub %rcx, %rax"),
-                            BinaryOp::Multiply => self.emit_line("    imul %rcx, %rax"),
+                            BinaryOp::Add => self.inst("add", [reg("%rcx"), reg("%rax")]),
+                            BinaryOp::Subtract => self.inst("sub", [reg("%rcx"), reg("%rax")]),
+                            BinaryOp::Multiply => self.inst("imul", [reg("%rcx"), reg("%rax")]),
                             BinaryOp::Divide => {
-                                self.emit_line("    cqo"); // Sign-extend RAX into RDX:RAX
-                                self.emit_line("    idiv %rcx");
+                                self.inst("cqo", []); // Sign-extend RAX into RDX:RAX
+                                self.inst("idiv", [reg("%rcx")]);
                             },
                             BinaryOp::Modulo => {
-                                self.emit_line("    cqo"); // Sign-extend RAX into RDX:RAX
-                                self.emit_line("    idiv %rcx");
-                                self.emit_line("    mov %rdx, %rax"); // Remainder is in %rdx
+                                self.inst("cqo", []); // Sign-extend RAX into RDX:RAX
+                                self.inst("idiv", [reg("%rcx")]);
+                                self.inst("mov", [reg("%rdx"), reg("%rax")]); // Remainder is in %rdx
                             },
-                            BinaryOp::BitwiseAnd => self.emit_line("    and %rcx, %rax"),
-                            BinaryOp::BitwiseOr => self.emit_line("    or %rcx, %rax"),
-                            BinaryOp::BitwiseXor => self.emit_line("    xor %rcx, %rax"),
-                            BinaryOp::LeftShift => self.emit_line("    shl %cl, %eax"),
-                            BinaryOp::RightShift => self.emit_line("    sar %cl, %eax"),
+                            BinaryOp::BitwiseAnd => self.inst("and", [reg("%rcx"), reg("%rax")]),
+                            BinaryOp::BitwiseOr => self.inst("or", [reg("%rcx"), reg("%rax")]),
+                            BinaryOp::BitwiseXor => self.inst("xor", [reg("%rcx"), reg("%rax")]),
+                            BinaryOp::LeftShift => self.inst("shl", [reg("%cl"), reg("%eax")]),
+                            BinaryOp::RightShift => self.inst("sar", [reg("%cl"), reg("%eax")]),
                             _ => unreachable!(),
                         }
                     },
@@ -575,32 +782,25 @@ impl X86_64Generator {
                     // Comparison operations
                     BinaryOp::Equal | BinaryOp::NotEqual | BinaryOp::LessThan | 
                     BinaryOp::LessThanOrEqual | BinaryOp::GreaterThan | BinaryOp::GreaterThanOrEqual => {
-                        // Generate right operand first and push to stack
-                        self.generate_expression(right);
-                        self.emit_line("    push %rax");
-                        
-                        // Generate left operand into %rax
-                        self.generate_expression(left);
-                        
-                        // Move right operand to %rcx
-                        self.emit_line("    pop %rcx");
+                        // Left operand in %rax, right operand in %rcx
+                        self.generate_operands(arena, *left, *right);
                         
                         // Compare left and right
-                        self.emit_line("    cmp %rcx, %rax");
+                        self.inst("cmp", [reg("%rcx"), reg("%rax")]);
                         
                         // Set result based on comparison
                         match operator {
-                            BinaryOp::Equal => self.emit_line("    sete %al"),
-                            BinaryOp::NotEqual => self.emit_line("    setne %al"),
-                            BinaryOp::LessThan => self.emit_line("    setl %al"),
-                            BinaryOp::LessThanOrEqual => self.emit_line("    setle %al"),
-                            BinaryOp::GreaterThan => self.emit_line("    setg %al"),
-                            BinaryOp::GreaterThanOrEqual => self.emit_line("    setge %al"),
+                            BinaryOp::Equal => self.inst("sete", [reg("%al")]),
+                            BinaryOp::NotEqual => self.inst("setne", [reg("%al")]),
+                            BinaryOp::LessThan => self.inst("setl", [reg("%al")]),
+                            BinaryOp::LessThanOrEqual => self.inst("setle", [reg("%al")]),
+                            BinaryOp::GreaterThan => self.inst("setg", [reg("%al")]),
+                            BinaryOp::GreaterThanOrEqual => self.inst("setge", [reg("%al")]),
                             _ => unreachable!(),
                         }
                         
                         // Zero-extend result to 64 bits
-                        self.emit_line("    movzx %al, %rax");
+                        self.inst("movzx", [reg("%al"), reg("%rax")]);
                     },
                     
                     // Logical operations with short-circuit behavior
@@ -608,182 +808,146 @@ impl X86_64Generator {
                         let end_label = self.next_label("logical_end");
                         
                         // Generate left operand
-                        self.generate_expression(left);
+                        self.generate_expression(arena, *left);
                         
                         if matches!(operator, BinaryOp::LogicalAnd) {
                             // Short-circuit if left is false
-                            self.emit_line("    cmp $0, %rax");
-                            self.emit_line(&format!("    je {}", end_label));
+                            self.inst("cmp", [imm(0), reg("%rax")]);
+                            self.inst("je", [label(&end_label)]);
                         } else {
                             // Short-circuit if left is true (non-zero)
-                            self.emit_line("    cmp $0, %rax");
-                            self.emit_line(&format!("    jne {}", end_label));
+                            self.inst("cmp", [imm(0), reg("%rax")]);
+                            self.inst("jne", [label(&end_label)]);
                         }
                         
                         // Generate right operand
-                        self.generate_expression(right);
+                        self.generate_expression(arena, *right);
                         
                         // For LogicalAnd, result is already correct
                         // For LogicalOr, we need to ensure it's 1 if non-zero
                         if matches!(operator, BinaryOp::LogicalOr) {
-                            self.emit_line("    cmp $0, %rax");
-                            self.emit_line("    setne %al");
-                            self.emit_line("    movzx %al, %rax");
+                            self.inst("cmp", [imm(0), reg("%rax")]);
+                            self.inst("setne", [reg("%al")]);
+                            self.inst("movzx", [reg("%al"), reg("%rax")]);
                         }
                         
-                        self.emit_line(&format!("{}:", end_label));
+                        self.label(&end_label);
                     },
                     _ => {
                         // Unsupported binary operation
-                        self.emit_line(&format!("    # Unsupported binary op: {:?}", operator));
+                        emit!(self, "    # Unsupported binary op: {:?}", operator);
                         // Default to 0
-                        self.emit_line("    xor %rax, %rax");
+                        self.inst("xor", [reg("%rax"), reg("%rax")]);
                     }
                 }
             }
+            Expression::UnaryOperation { operator: OperatorType::Unary(UnaryOp::AddressOf), operand } => {
+                if !self.generate_address(arena, *operand) {
+                    self.emit_line("    # Operand of & has no address");
+                    self.inst("mov", [imm(0), reg("%rax")]);
+                }
+            }
             Expression::UnaryOperation { operator, operand } => {
                 // Generate operand value first
-                self.generate_expression(operand);
+                self.generate_expression(arena, *operand);
                 
                 match operator {
                     OperatorType::Unary(UnaryOp::Negate) => {
-                        self.emit_line("    neg %rax");
+                        self.inst("neg", [reg("%rax")]);
                     },
                     OperatorType::Unary(UnaryOp::LogicalNot) => {
-                        self.emit_line("    cmp $0, %rax");
-                        self.emit_line("    sete %al");
-                        self.emit_line("    movzx %al, %rax");
+                        self.inst("cmp", [imm(0), reg("%rax")]);
+                        self.inst("sete", [reg("%al")]);
+                        self.inst("movzx", [reg("%al"), reg("%rax")]);
                     },
                     OperatorType::Unary(UnaryOp::BitwiseNot) => {
-                        self.emit_line("    not %rax");
-                    },
-                    OperatorType::Unary(UnaryOp::AddressOf) => {
-                        // This would require tracking where values are stored
-                        // For now, it's a placeholder that depends on operand type
-                        self.emit_line("    # Address-of operator not fully implemented");
+                        self.inst("not", [reg("%rax")]);
                     },
                     OperatorType::Unary(UnaryOp::Dereference) => {
-                        // Dereference a pointer (load from address in %rax)
-                        self.emit_line("    mov (%rax), %rax");
+                        // Load from the address in %rax
+                        self.emit_load_from(self.symbols.access(expr), mem(0, "%rax"), "%rax");
                     },
-                    OperatorType::Unary(UnaryOp::PreIncrement) | OperatorType::Unary(UnaryOp::PostIncrement) => {
+                    OperatorType::Unary(
+                        op @ (UnaryOp::PreIncrement
+                        | UnaryOp::PreDecrement
+                        | UnaryOp::PostIncrement
+                        | UnaryOp::PostDecrement),
+                    ) => {
+                        let post = matches!(op, UnaryOp::PostIncrement | UnaryOp::PostDecrement);
+                        let increment = matches!(op, UnaryOp::PreIncrement | UnaryOp::PostIncrement);
+                        let instruction = if increment { "add" } else { "sub" };
+
                         // For post increment, we need to save the original value
-                        if matches!(operator, OperatorType::Unary(UnaryOp::PostIncrement)) {
-                            self.emit_line("    mov %rax, %rcx"); // Save original value
+                        if post {
+                            self.inst("mov", [reg("%rax"), reg("%rcx")]);
                         }
-                        
-                        // Generate increment operation (depends on variable location)
-                        if let Expression::Variable(name) = operand.as_ref() {
-                            // Get a copy of the offset to avoid borrowing issues
-                            let offset = if let Some(&offset) = self.variables.get(name) {
-                                offset
-                            } else {
-                                0 // Default if not found
-                            };
-                            
-                            if offset != 0 {
-                                self.emit_line(&format!("    add $1, {}(%rbp)", offset));
-                                
-                                if matches!(operator, OperatorType::Unary(UnaryOp::PreIncrement)) {
-                                    self.emit_line(&format!("    mov {}(%rbp), %rax", offset));
+
+                        // Update the variable where it lives
+                        match (self.variable_slot(*operand), &arena[*operand], self.symbols.access(*operand)) {
+                            (Some(slot), ..) => {
+                                match slot.home {
+                                    Home::Frame(offset) => {
+                                        let mnemonic = format!("{}{}", instruction, Self::suffix(slot.width));
+                                        self.inst(mnemonic, [imm(1), frame(offset)])
+                                    }
+                                    // %rax already holds the operand's value
+                                    Home::Register(_) => {
+                                        self.inst(instruction, [imm(1), reg("%rax")]);
+                                        self.emit_store(slot);
+                                    }
+                                }
+                                if !post {
+                                    self.emit_load(slot);
                                 }
                             }
-                        }
-                        
-                        // For post increment, restore the original value
-                        if matches!(operator, OperatorType::Unary(UnaryOp::PostIncrement)) {
-                            self.emit_line("    mov %rcx, %rax");
-                        }
-                    },
-                    OperatorType::Unary(UnaryOp::PreDecrement) | OperatorType::Unary(UnaryOp::PostDecrement) => {
-                        // Similar to increment
-                        if matches!(operator, OperatorType::Unary(UnaryOp::PostDecrement)) {
-                            self.emit_line("    mov %rax, %rcx"); // Save original value
-                        }
-                        
-                        if let Expression::Variable(name) = operand.as_ref() {
-                            // Get a copy of the offset to avoid borrowing issues
-                            let offset = if let Some(&offset) = self.variables.get(name) {
-                                offset
-                            } else {
-                                0 // Default if not found
-                            };
-                            
-                            if offset != 0 {
-                                self.emit_line(&format!("    sub $1, {}(%rbp)", offset));
-                                
-                                if matches!(operator, OperatorType::Unary(UnaryOp::PreDecrement)) {
-                                    self.emit_line(&format!("    mov {}(%rbp), %rax", offset));
+                            (None, Expression::Variable(name), access @ Access::Scalar { width, .. })
+                                if self.symbols.binding(*operand) == Some(Binding::Global) =>
+                            {
+                                let mnemonic = format!("{}{}", instruction, Self::suffix(width as usize));
+                                self.inst(mnemonic, [imm(1), rip(global_symbol(*name))]);
+                                if !post {
+                                    self.emit_global_load(*name, access, "%rax");
                                 }
                             }
+                            _ => emit!(self, "    # Unsupported increment operand"),
                         }
-                        
-                        if matches!(operator, OperatorType::Unary(UnaryOp::PostDecrement)) {
-                            self.emit_line("    mov %rcx, %rax");
+
+                        // For post increment, restore the original value
+                        if post {
+                            self.inst("mov", [reg("%rcx"), reg("%rax")]);
                         }
                     },
                     _ => {
-                        self.emit_line(&format!("    # Unsupported unary op: {:?}", operator));
+                        emit!(self, "    # Unsupported unary op: {:?}", operator);
                     }
                 }
             }
             Expression::Assignment { target, value } => {
                 // Generate the value to assign
-                self.generate_expression(value);
+                self.generate_expression(arena, *value);
                 
-                match target.as_ref() {
-                    Expression::Variable(name) => {
-                        if let Some(offset) = self.variables.get(name) {
-                            // Local variable
-                            self.emit_line(&format!("    mov %rax, {}(%rbp)", offset));
+                let access = self.symbols.access(*target);
+                match (&arena[*target], self.symbols.binding(*target)) {
+                    (Expression::Variable(name), binding) => match (self.variable_slot(*target), binding) {
+                        // Local variable
+                        (Some(slot), _) => self.emit_store(slot),
+                        (None, Some(Binding::Global)) => self.emit_store_to(access, rip(global_symbol(*name))),
+                        _ => emit!(self, "    # Can't assign to {}", name),
+                    },
+                    _ => {
+                        // Keep the value while the target's address is worked out
+                        self.inst("push", [reg("%rax")]);
+                        if self.generate_address(arena, *target) {
+                            self.inst("mov", [reg("%rax"), reg("%rcx")]);
+                            self.inst("pop", [reg("%rax")]);
+                            self.emit_store_to(access, mem(0, "%rcx"));
                         } else {
-                            // Global variable
-                            self.emit_line(&format!("    mov %rax, _{}(%rip)", name));
+                            self.inst("pop", [reg("%rax")]);
+                            self.emit_line("    # Unsupported assignment target");
                         }
                     }
-                    Expression::ArrayAccess { array, index } => {
-                        // Calculate address of the array element
-                        // For optimization, save the value to assign
-                        self.emit_line("    push %rax");
-                        
-                        // Generate array base address
-                        self.generate_expression(array);
-                        self.emit_line("    mov %rax, %rcx");
-                        
-                        // Generate index and scale by element size (assume 8 bytes)
-                        self.generate_expression(index);
-                        self.emit_line("    shl $3, %rax"); // Scale by 8 (element size)
-                        
-                        // Calculate effective address
-                        self.emit_line("    add %rcx, %rax");
-                        
-                        // Restore value to assign and store it
-                        self.emit_line("    mov %rax, %rcx");
-                        self.emit_line("    pop %rax");
-                        self.emit_line("    mov %rax, (%rcx)");
-                    }
-                    Expression::PointerFieldAccess { pointer, field } => {
-                        // Save the value to assign
-                        self.emit_line("    push %rax");
-                        
-                        // Generate pointer address
-                        self.generate_expression(pointer);
-                        
-                        // Find the field offset (simplified)
-                        // In a real implementation, we'd need to access the struct info
-                        self.emit_line(&format!("    # Accessing field {} (offset hardcoded)", field));
-                        self.emit_line("    add $8, %rax"); // Placeholder offset
-                        
-                        // Restore value and store
-                        self.emit_line("    mov %rax, %rcx");
-                        self.emit_line("    pop %rax");
-                        self.emit_line("    mov %rax, (%rcx)");
-                    }
-                    _ => {
-                        self.emit_line("    # Unsupported assignment target");
-                    }
                 }
-                
+
                 // Assignment expression returns the assigned value, which is already in %rax
             }
             Expression::FunctionCall { name, arguments } => {
@@ -791,111 +955,574 @@ impl X86_64Generator {
                 let arg_count = arguments.len();
                 if arg_count > 0 {
                     self.emit_line("    # Save caller-saved registers");
-                    self.emit_line("    push %rcx");
-                    self.emit_line("    push %rdx");
-                    self.emit_line("    push %rsi");
-                    self.emit_line("    push %rdi");
-                    self.emit_line("    push %r8");
-                    self.emit_line("    push %r9");
+                    self.inst("push", [reg("%rcx")]);
+                    self.inst("push", [reg("%rdx")]);
+                    self.inst("push", [reg("%rsi")]);
+                    self.inst("push", [reg("%rdi")]);
+                    self.inst("push", [reg("%r8")]);
+                    self.inst("push", [reg("%r9")]);
                 }
                 
                 // Evaluate arguments in reverse order (for stack args)
                 for (i, arg) in arguments.iter().enumerate().rev() {
-                    self.generate_expression(arg);
+                    self.generate_expression(arena, *arg);
                     
                     // First 6 args go in registers, rest on stack
                     match i {
-                        0 => self.emit_line("    mov %rax, %rdi"),
-                        1 => self.emit_line("    mov %rax, %rsi"),
-                        2 => self.emit_line("    mov %rax, %rdx"),
-                        3 => self.emit_line("    mov %rax, %rcx"),
-                        4 => self.emit_line("    mov %rax, %r8"),
-                        5 => self.emit_line("    mov %rax, %r9"),
-                        _ => self.emit_line("    push %rax"), // Stack arg
+                        0 => self.inst("mov", [reg("%rax"), reg("%rdi")]),
+                        1 => self.inst("mov", [reg("%rax"), reg("%rsi")]),
+                        2 => self.inst("mov", [reg("%rax"), reg("%rdx")]),
+                        3 => self.inst("mov", [reg("%rax"), reg("%rcx")]),
+                        4 => self.inst("mov", [reg("%rax"), reg("%r8")]),
+                        5 => self.inst("mov", [reg("%rax"), reg("%r9")]),
+                        _ => self.inst("push", [reg("%rax")]), // Stack arg
                     }
                 }
                 
                 // Call the function
-                self.emit_line(&format!("    call _{}", name));
+                self.inst("call", [label(format!("_{}", name))]);
                 
                 // Clean up stack arguments
                 if arg_count > 6 {
                     let stack_arg_count = arg_count - 6;
-                    self.emit_line(&format!("    add ${}, %rsp", stack_arg_count * 8));
+                    self.inst("add", [imm(stack_arg_count * 8), reg("%rsp")]);
                 }
                 
                 // Restore caller-saved registers
                 if arg_count > 0 {
                     self.emit_line("    # Restore caller-saved registers");
-                    self.emit_line("    pop %r9");
-                    self.emit_line("    pop %r8");
-                    self.emit_line("    pop %rdi");
-                    self.emit_line("    pop %rsi");
-                    self.emit_line("    pop %rdx");
-                    self.emit_line("    pop %rcx");
+                    self.inst("pop", [reg("%r9")]);
+                    self.inst("pop", [reg("%r8")]);
+                    self.inst("pop", [reg("%rdi")]);
+                    self.inst("pop", [reg("%rsi")]);
+                    self.inst("pop", [reg("%rdx")]);
+                    self.inst("pop", [reg("%rcx")]);
                 }
                 
                 // Result is already in %rax
             }
-            Expression::ArrayAccess { array, index } => {
-                // Generate array base address
-                self.generate_expression(array);
-                self.emit_line("    mov %rax, %rcx");
-                
-                // Generate index and scale by element size (assume 8 bytes)
-                self.generate_expression(index);
-                self.emit_line("    shl $3, %rax"); // Scale by 8 (element size)
-                
-                // Calculate effective address
-                self.emit_line("    add %rcx, %rax");
-                
-                // Load value from calculated address
-                self.emit_line("    mov (%rax), %rax");
+            Expression::ArrayAccess { .. }
+            | Expression::StructFieldAccess { .. }
+            | Expression::PointerFieldAccess { .. } => {
+                // Load the element or field from its address, unless it's an
+                // aggregate, which stands for that address
+                self.generate_address(arena, expr);
+                self.emit_load_from(self.symbols.access(expr), mem(0, "%rax"), "%rax");
             }
             Expression::TernaryIf { condition, then_expr, else_expr } => {
                 let label_else = self.next_label("ternary_else");
                 let label_end = self.next_label("ternary_end");
                 
                 // Generate condition
-                self.generate_expression(condition);
-                self.emit_line("    cmp $0, %rax");
-                self.emit_line(&format!("    je {}", label_else));
+                self.generate_expression(arena, *condition);
+                self.inst("cmp", [imm(0), reg("%rax")]);
+                self.inst("je", [label(&label_else)]);
                 
                 // Generate then expression
-                self.generate_expression(then_expr);
-                self.emit_line(&format!("    jmp {}", label_end));
+                self.generate_expression(arena, *then_expr);
+                self.inst("jmp", [label(&label_end)]);
                 
                 // Generate else expression
-                self.emit_line(&format!("{}:", label_else));
-                self.generate_expression(else_expr);
+                self.label(&label_else);
+                self.generate_expression(arena, *else_expr);
                 
-                self.emit_line(&format!("{}:", label_end));
+                self.label(&label_end);
             }
+            Expression::AtomicExpr { operation, operands } => self.generate_atomic(arena, *operation, operands),
             _ => {
                 // Other expression types not yet implemented
-                self.emit_line(&format!("    # Unimplemented expression: {:?}", expr));
-                self.emit_line("    mov $0, %rax"); // Default to 0
+                emit!(self, "    # Unimplemented expression: {:?}", arena[expr]);
+                self.inst("mov", [imm(0), reg("%rax")]); // Default to 0
+            }
+        }
+    }
+
+    // Evaluate the address of an lvalue into %rax, if it has one
+    fn generate_address(&mut self, arena: &AstArena, expr: ExprId) -> bool {
+        match &arena[expr] {
+            Expression::Variable(name) => match (self.variable_slot(expr), self.symbols.binding(expr)) {
+                (Some(slot), _) => match slot.home {
+                    Home::Frame(offset) => self.inst("lea", [frame(offset), reg("%rax")]),
+                    Home::Register(_) => return false,
+                },
+                (None, Some(Binding::Global)) => self.inst("leaq", [rip(global_symbol(*name)), reg("%rax")]),
+                _ => return false,
+            },
+            Expression::ArrayAccess { array, index } => {
+                self.generate_expression(arena, *array);
+                self.inst("push", [reg("%rax")]);
+                self.generate_expression(arena, *index);
+                // Scale by the element size
+                match self.symbols.size_of(expr).unwrap_or(8) {
+                    1 => {}
+                    size if size.is_power_of_two() => self.inst("shl", [imm(size.trailing_zeros()), reg("%rax")]),
+                    size => self.inst("imul", [imm(size), reg("%rax")]),
+                }
+                self.inst("pop", [reg("%rcx")]);
+                self.inst("add", [reg("%rcx"), reg("%rax")]);
+            }
+            Expression::UnaryOperation { operator: OperatorType::Unary(UnaryOp::Dereference), operand } => {
+                self.generate_expression(arena, *operand);
+            }
+            // A struct's value is its address, and a pointer's is the address
+            // it holds
+            Expression::StructFieldAccess { object: base, field }
+            | Expression::PointerFieldAccess { pointer: base, field } => {
+                self.generate_expression(arena, *base);
+                match self.symbols.field_offset(expr) {
+                    Some(0) => {}
+                    Some(offset) => self.inst("add", [imm(offset), reg("%rax")]),
+                    None => emit!(self, "    # Unknown field {}", field),
+                }
+            }
+            _ => return false,
+        }
+        true
+    }
+
+    // Initialize a local array from its initializer list, zeroing the
+    // elements the list leaves out
+    fn generate_array_initializer(
+        &mut self,
+        arena: &AstArena,
+        statement: StmtId,
+        element: Option<&Type>,
+        size: Option<ExprId>,
+        initializer: ExprId,
+    ) {
+        let Expression::ArrayLiteral(values) = &arena[initializer] else {
+            return;
+        };
+        let Some(Slot { home: Home::Frame(base), .. }) = self.frame.local(statement) else {
+            return;
+        };
+        if values.is_empty() {
+            return;
+        }
+        let element = element.unwrap_or(&Type::Int);
+        let (element_size, signed) = (self.types.size_of(element), !crate::analyzer::types::is_unsigned(element));
+        if !matches!(element_size, 1 | 2 | 4 | 8) {
+            emit!(self, "    # Unsupported initializer for array of {:?}", element);
+            return;
+        }
+        let length = size
+            .and_then(|size| constant::evaluate(arena, size, &self.types))
+            .and_then(|length| usize::try_from(length).ok())
+            .unwrap_or(values.len());
+        let access = Access::Scalar { width: element_size as u8, signed };
+        for index in 0..length {
+            let offset = base + (index * element_size) as i32;
+            match values.get(index) {
+                Some(&value) => {
+                    self.generate_expression(arena, value);
+                    self.emit_store_to(access, frame(offset));
+                }
+                None => self.inst(format!("mov{}", Self::suffix(element_size)), [imm(0), frame(offset)]),
+            }
+        }
+    }
+
+    // An atomic operation on the 64-bit object `operands[0]`. Aligned loads
+    // are already atomic and ordered on x86-64; everything else either
+    // locks the object or uses xchg, which does so implicitly.
+    fn generate_atomic(&mut self, arena: &AstArena, operation: AtomicOp, operands: &[ExprId]) {
+        let arity = match operation {
+            AtomicOp::Load => 1,
+            AtomicOp::CompareExchange => 3,
+            _ => 2,
+        };
+        if operands.len() != arity {
+            emit!(self, "    # Atomic {:?} needs {} operands", operation, arity);
+            self.inst("mov", [imm(0), reg("%rax")]);
+            return;
+        }
+
+        // The values go on the stack, last first, while the address is
+        // worked out into %rcx
+        for &value in operands[1..].iter().rev() {
+            self.generate_expression(arena, value);
+            self.inst("push", [reg("%rax")]);
+        }
+        if !self.generate_address(arena, operands[0]) {
+            self.emit_line("    # Unsupported atomic object");
+            self.inst("mov", [imm(0), reg("%rax")]);
+        }
+        self.inst("mov", [reg("%rax"), reg("%rcx")]);
+
+        match operation {
+            AtomicOp::Load => self.inst("mov", [mem(0, "%rcx"), reg("%rax")]),
+            AtomicOp::Store => {
+                self.inst("pop", [reg("%rax")]);
+                self.inst("mov", [reg("%rax"), reg("%rdx")]);
+                self.inst("xchg", [reg("%rdx"), mem(0, "%rcx")]);
+            }
+            AtomicOp::Exchange => {
+                self.inst("pop", [reg("%rax")]);
+                self.inst("xchg", [reg("%rax"), mem(0, "%rcx")]);
+            }
+            AtomicOp::CompareExchange => {
+                // cmpxchg compares with %rax and leaves the old value there
+                self.inst("pop", [reg("%rax")]);
+                self.inst("pop", [reg("%rdx")]);
+                self.inst("lock cmpxchg", [reg("%rdx"), mem(0, "%rcx")]);
+            }
+            AtomicOp::FetchAdd | AtomicOp::FetchSub => {
+                self.inst("pop", [reg("%rax")]);
+                if operation == AtomicOp::FetchSub {
+                    self.inst("neg", [reg("%rax")]);
+                }
+                self.inst("lock xadd", [reg("%rax"), mem(0, "%rcx")]);
+            }
+            AtomicOp::FetchAnd | AtomicOp::FetchOr | AtomicOp::FetchXor => {
+                // Retry until no other thread changed the object between
+                // the load and the compare-exchange
+                let instruction = match operation {
+                    AtomicOp::FetchAnd => "and",
+                    AtomicOp::FetchOr => "or",
+                    _ => "xor",
+                };
+                let retry = self.next_label("atomic_retry");
+                self.inst("mov", [mem(0, "%rcx"), reg("%rax")]);
+                self.label(&retry);
+                self.inst("mov", [reg("%rax"), reg("%rdx")]);
+                self.inst(instruction, [mem(0, "%rsp"), reg("%rdx")]);
+                self.inst("lock cmpxchg", [reg("%rdx"), mem(0, "%rcx")]);
+                self.inst("jne", [label(&retry)]);
+                self.inst("add", [imm(8), reg("%rsp")]);
+            }
+        }
+    }
+
+    // Evaluate `left` into %rax and `right` into %rcx
+    fn generate_operands(&mut self, arena: &AstArena, left: ExprId, right: ExprId) {
+        if self.opt_level != OptimizationLevel::None {
+            // Leaves load straight into %rcx once the left operand is done
+            if self.is_leaf(arena, right) {
+                self.generate_expression(arena, left);
+                self.generate_leaf(arena, right, "%rcx");
+                return;
+            }
+
+            // Evaluate the operand needing more registers first and hold its
+            // value in a scratch register. Scratch registers don't survive
+            // calls, so the second operand must not contain one.
+            let right_first = self.costs.need(arena, right) > self.costs.need(arena, left);
+            let second = if right_first { left } else { right };
+            if !self.costs.has_call(arena, second) {
+                if let Some(temp) = self.free_scratch.pop() {
+                    if right_first {
+                        self.generate_expression(arena, right);
+                        self.inst("mov", [reg("%rax"), reg(temp)]);
+                        self.generate_expression(arena, left);
+                        self.inst("mov", [reg(temp), reg("%rcx")]);
+                    } else {
+                        self.generate_expression(arena, left);
+                        self.inst("mov", [reg("%rax"), reg(temp)]);
+                        self.generate_expression(arena, right);
+                        self.inst("mov", [reg("%rax"), reg("%rcx")]);
+                        self.inst("mov", [reg(temp), reg("%rax")]);
+                    }
+                    self.free_scratch.push(temp);
+                    return;
+                }
+            }
+        }
+
+        // Out of registers (or not optimizing): spill through the stack
+        // Generate right operand first and push to stack
+        self.generate_expression(arena, right);
+        self.inst("push", [reg("%rax")]);
+        
+        // Generate left operand into %rax
+        self.generate_expression(arena, left);
+        
+        // Move right operand to %rcx
+        self.inst("pop", [reg("%rcx")]);
+    }
+
+    // Whether `expr` can be loaded into a register with a single instruction
+    fn is_leaf(&self, arena: &AstArena, expr: ExprId) -> bool {
+        matches!(
+            arena[expr],
+            Expression::IntegerLiteral(_) | Expression::CharLiteral(_) | Expression::Variable(_)
+        )
+    }
+
+    fn generate_leaf(&mut self, arena: &AstArena, expr: ExprId, dest: &'static str) {
+        match &arena[expr] {
+            Expression::IntegerLiteral(value) => self.inst("mov", [imm(*value), reg(dest)]),
+            Expression::CharLiteral(value) => self.inst("mov", [imm(*value as u8), reg(dest)]),
+            Expression::Variable(name) => {
+                let access = self.symbols.access(expr);
+                match (self.variable_slot(expr), self.symbols.binding(expr)) {
+                    // Arrays in the frame stand for their address
+                    (Some(Slot { home: Home::Frame(offset), .. }), _) if access == Access::Address => {
+                        self.inst("lea", [frame(offset), reg(dest)])
+                    }
+                    (Some(slot), _) => self.emit_load_into(slot, dest),
+                    (None, Some(Binding::Constant(value))) => self.inst("mov", [imm(value), reg(dest)]),
+                    // Anything else is a global
+                    _ => self.emit_global_load(*name, access, dest),
+                }
+            }
+            _ => unreachable!("not a leaf expression"),
+        }
+    }
+
+    // Where the parameter or local `expr` refers to lives
+    fn variable_slot(&self, expr: ExprId) -> Option<Slot> {
+        match self.symbols.binding(expr)? {
+            Binding::Param(index) if index >= ARG_REGISTERS.len() => {
+                // Stack arguments sit above the return address, each in a
+                // quadword of its own
+                let Access::Scalar { width, signed } = self.symbols.access(expr) else {
+                    return None;
+                };
+                let offset = 16 + 8 * (index - ARG_REGISTERS.len()) as i32;
+                Some(Slot { home: Home::Frame(offset), width: width as usize, signed })
             }
+            Binding::Param(index) => self.frame.param(index),
+            Binding::Local(decl) => self.frame.local(decl),
+            Binding::Global | Binding::Constant(_) => None,
+        }
+    }
+
+    // Store %rax (or its low bytes) to a memory operand, at the width of a
+    // value accessed as `access`
+    fn emit_store_to(&mut self, access: Access, memory: Operand) {
+        match access {
+            Access::Scalar { width, .. } => {
+                let width = width as usize;
+                self.inst(format!("mov{}", Self::suffix(width)), [reg(Self::sized_register("%rax", width)), memory]);
+            }
+            Access::Address => self.emit_line("    # Unsupported aggregate assignment"),
+        }
+    }
+
+    // Load a value accessed as `access` from a memory operand into `dest`,
+    // extending it to 64 bits. Aggregates leave `dest` as it is: it already
+    // holds their address.
+    fn emit_load_from(&mut self, access: Access, memory: Operand, dest: &'static str) {
+        if let Access::Scalar { width, signed } = access {
+            let (mnemonic, dest) = Self::load_mnemonic(width as usize, signed, dest);
+            self.inst(mnemonic, [memory, reg(dest)]);
+        }
+    }
+
+    // Store %rax (or its low bytes) into a variable's home
+    fn emit_store(&mut self, slot: Slot) {
+        match slot.home {
+            Home::Frame(offset) => {
+                let name = Self::sized_register("%rax", slot.width);
+                self.inst(format!("mov{}", Self::suffix(slot.width)), [reg(name), frame(offset)]);
+            }
+            // Registers hold the value already truncated and re-extended, so
+            // they behave exactly like a load from memory would
+            Home::Register(home) => self.emit_extend("%rax", slot.width, slot.signed, home),
+        }
+    }
+
+    // Load a variable into %rax, extending it to 64 bits
+    fn emit_load(&mut self, slot: Slot) {
+        self.emit_load_into(slot, "%rax");
+    }
+
+    fn emit_load_into(&mut self, slot: Slot, dest: &'static str) {
+        let offset = match slot.home {
+            Home::Frame(offset) => offset,
+            Home::Register(home) => {
+                self.inst("mov", [reg(home), reg(dest)]);
+                return;
+            }
+        };
+        let (mnemonic, dest) = Self::load_mnemonic(slot.width, slot.signed, dest);
+        self.inst(mnemonic, [frame(offset), reg(dest)]);
+    }
+
+    // The instruction loading `width` bytes from memory into `dest`,
+    // extended to 64 bits, and the register it names
+    fn load_mnemonic(width: usize, signed: bool, dest: &'static str) -> (&'static str, &'static str) {
+        match (width, signed) {
+            (1, true) => ("movsbq", dest),
+            (1, false) => ("movzbq", dest),
+            (2, true) => ("movswq", dest),
+            (2, false) => ("movzwq", dest),
+            (4, true) => ("movslq", dest),
+            // A 32-bit move zero-extends into the full register
+            (4, false) => ("movl", Self::sized_register(dest, 4)),
+            _ => ("movq", dest),
+        }
+    }
+
+    // Copy the low `width` bytes of `src` into `dest`, extended to 64 bits
+    fn emit_extend(&mut self, src: &'static str, width: usize, signed: bool, dest: &'static str) {
+        let narrow = Self::sized_register(src, width);
+        let (mnemonic, src, dest) = match (width, signed) {
+            (1, true) => ("movsbq", narrow, dest),
+            (1, false) => ("movzbq", narrow, dest),
+            (2, true) => ("movswq", narrow, dest),
+            (2, false) => ("movzwq", narrow, dest),
+            (4, true) => ("movslq", narrow, dest),
+            (4, false) => ("movl", narrow, Self::sized_register(dest, 4)),
+            _ => ("mov", src, dest),
+        };
+        self.inst(mnemonic, [reg(src), reg(dest)]);
+    }
+
+    // Whether `emit_multiply_by_constant` can multiply by `factor`
+    fn multiplies_without_imul(factor: i64) -> bool {
+        matches!(factor, 3 | 5 | 9) || (factor > 0 && factor & (factor - 1) == 0)
+    }
+
+    // Multiply `reg` by `factor`: a shift for a power of two, or a lea
+    // adding the register to itself scaled by 2, 4 or 8
+    fn emit_multiply_by_constant(&mut self, name: &str, factor: i64) {
+        match factor {
+            3 | 5 | 9 => {
+                let register = Register::named(name);
+                let index = Some((register, factor as u8 - 1));
+                self.inst("lea", [Operand::Memory(Address::Base { base: register, index, displacement: 0 }), reg(name)])
+            }
+            1 => {}
+            _ => self.inst("shl", [imm(factor.trailing_zeros()), reg(name)]),
+        }
+    }
+
+    // Whether `emit_divide_by_power_of_two` can divide by `divisor`
+    fn divides_by_shifting(divisor: i64) -> bool {
+        divisor > 0 && divisor & (divisor - 1) == 0 && divisor <= 1 << 30
+    }
+
+    // Divide %rax by the power of two `divisor`, leaving the quotient or
+    // the remainder in %rax. Negative dividends are biased by divisor - 1
+    // first, so the quotient rounds toward zero like idiv's. Uses %rdx.
+    fn emit_divide_by_power_of_two(&mut self, divisor: i64, remainder: bool) {
+        let shift = divisor.trailing_zeros();
+        if shift == 0 {
+            if remainder {
+                self.inst("mov", [imm(0), reg("%rax")]);
+            }
+            return;
+        }
+        self.inst("mov", [reg("%rax"), reg("%rdx")]);
+        self.inst("sar", [imm(63), reg("%rdx")]);
+        self.inst("shr", [imm(64 - shift), reg("%rdx")]);
+        self.inst("add", [reg("%rdx"), reg("%rax")]);
+        if remainder {
+            self.inst("and", [imm(divisor - 1), reg("%rax")]);
+            self.inst("sub", [reg("%rdx"), reg("%rax")]);
+        } else {
+            self.inst("sar", [imm(shift), reg("%rax")]);
+        }
+    }
+
+    // Restore the frame layout's callee-saved registers and return
+    fn emit_epilogue(&mut self) {
+        let saved = self.frame.saved_registers().to_vec();
+        self.emit_return(&saved);
+    }
+
+    // Restore `saved_registers` from their slots, tear down the frame and return
+    fn emit_return(&mut self, saved_registers: &[(&'static str, i32)]) {
+        for &(name, offset) in saved_registers {
+            self.inst("movq", [frame(offset), reg(name)]);
+        }
+        self.inst("mov", [reg("%rbp"), reg("%rsp")]);
+        self.inst("pop", [reg("%rbp")]);
+        self.inst("ret", []);
+    }
+
+    // AT&T operand-size suffix for an access of `width` bytes
+    fn suffix(width: usize) -> &'static str {
+        match width {
+            1 => "b",
+            2 => "w",
+            4 => "l",
+            _ => "q",
+        }
+    }
+
+    // The `width`-byte view of a 64-bit general purpose register
+    fn sized_register(reg: &'static str, width: usize) -> &'static str {
+        const VIEWS: [[&str; 4]; 14] = [
+            ["%rax", "%eax", "%ax", "%al"],
+            ["%rbx", "%ebx", "%bx", "%bl"],
+            ["%rcx", "%ecx", "%cx", "%cl"],
+            ["%rdx", "%edx", "%dx", "%dl"],
+            ["%rsi", "%esi", "%si", "%sil"],
+            ["%rdi", "%edi", "%di", "%dil"],
+            ["%r8", "%r8d", "%r8w", "%r8b"],
+            ["%r9", "%r9d", "%r9w", "%r9b"],
+            ["%r10", "%r10d", "%r10w", "%r10b"],
+            ["%r11", "%r11d", "%r11w", "%r11b"],
+            ["%r12", "%r12d", "%r12w", "%r12b"],
+            ["%r13", "%r13d", "%r13w", "%r13b"],
+            ["%r14", "%r14d", "%r14w", "%r14b"],
+            ["%r15", "%r15d", "%r15w", "%r15b"],
+        ];
+        let views = VIEWS
+            .iter()
+            .find(|views| views[0] == reg)
+            .expect("unknown register");
+        match width {
+            1 => views[3],
+            2 => views[2],
+            4 => views[1],
+            _ => views[0],
+        }
+    }
+
+    // Load a global's value, or the address of a global array
+    fn emit_global_load(&mut self, name: Symbol, access: Access, dest: &'static str) {
+        if access == Access::Address || self.global_arrays.contains(&name) {
+            self.inst("leaq", [rip(global_symbol(name)), reg(dest)]);
+        } else {
+            self.emit_load_from(access, rip(global_symbol(name)), dest);
         }
     }
 
+    // Add a string literal to the function's table and load its address
+    fn emit_string_address(&mut self, string: &str, dest: &str) {
+        let index = self.strings.len();
+        self.strings.push(string.to_string());
+        self.inst("leaq", [rip(format!("{}{}", STRING_PREFIX, index)), reg(dest)]);
+    }
+
     fn next_label(&mut self, prefix: &str) -> String {
-        let label = format!(".L{}_{}", prefix, self.label_counter);
+        let label = format!(".L{}_{}_{}", prefix, self.function_name, self.label_counter);
         self.label_counter += 1;
         label
     }
     
-    fn escape_string(s: &str) -> String {
-        s.replace("\\", "\\\\")
-         .replace("\n", "\\n")
-         .replace("\t", "\\t")
-         .replace("\"", "\\\"")
-         .replace("\0", "\\0")
+    fn emit_line(&mut self, line: &str) {
+        self.output.push(Line::Other(line.to_string()));
     }
 
-    fn emit_line(&mut self, line: &str) {
-        self.output.push_str(line);
-        self.output.push('\n');
+    fn inst<const N: usize>(&mut self, mnemonic: impl Into<Cow<'static, str>>, operands: [Operand; N]) {
+        self.output.push(Line::Inst(Inst::new(mnemonic, operands)));
+    }
+
+    fn label(&mut self, name: &str) {
+        self.output.push(Line::Label(name.to_string()));
+    }
+}
+
+/// A string literal escaped for `.asciz` as it's written
+struct Escaped<'a>(&'a str);
+
+impl fmt::Display for Escaped<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        for c in self.0.chars() {
+            match c {
+                '\\' => f.write_str("\\\\")?,
+                '\n' => f.write_str("\\n")?,
+                '\t' => f.write_str("\\t")?,
+                '"' => f.write_str("\\\"")?,
+                '\0' => f.write_str("\\0")?,
+                c => f.write_char(c)?,
+            }
+        }
+        Ok(())
     }
 }
 
@@ -905,3 +1532,91 @@ impl Default for X86_64Generator {
     }
 }
 
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::config::OptimizationConfig;
+    use crate::optimizer::Optimizer;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+    use crate::transforms::obfuscation::StringEncryptor;
+    use crate::transforms::PassManager;
+
+    #[test]
+    fn test_parallel_output_matches_serial() {
+        let source: String = (0..64)
+            .map(|i| format!("int f{i}(int x) {{ puts(\"f{i}\"); if (x > {i}) {{ return x; }} return {i}; }}\n"))
+            .collect();
+        let tokens = Lexer::new(&source).scan_tokens();
+        let mut program = Parser::new(tokens).parse().unwrap();
+        let (analysis, _) = crate::analyzer::annotate(&mut program);
+        let module = Optimizer::new(OptimizationLevel::Basic, OptimizationConfig::default()).run(&program, &analysis);
+
+        for module in [None, Some(&module)] {
+            let generate =
+                |threads| X86_64Generator::new().with_threads(threads).generate_program(&program, &analysis, module);
+            let serial = generate(1);
+            assert_eq!(serial, generate(4));
+            assert!(serial.contains("leaq L.str.63(%rip)"));
+            assert!(serial.contains("L.str.63:\n    .asciz \"\\\"f63\\\"\""));
+        }
+    }
+
+    #[test]
+    fn test_streamed_output_matches_generate() {
+        // The lexer keeps escapes as written, so the strings are set in the AST
+        let source = "
+            int greet() { puts(\"a\"); return 1; }
+            int paths() { puts(\"b\"); puts(\"c\"); return 2; }
+            int lines(int x) { puts(\"d\"); if (x) { return x; } return 3; }
+            int main() { return greet() + paths() + lines(0); }
+        ";
+        let mut program = Parser::new(Lexer::new(source).scan_tokens()).parse().unwrap();
+        let mut strings = ["say \"hi\"", "C:\\dir\\file", "a\tb", "one\ntwo\n"].into_iter();
+        for function in &mut program.functions {
+            for expr in function.arena.exprs_mut() {
+                if let Expression::StringLiteral(value) = expr {
+                    *value = strings.next().unwrap().to_string();
+                }
+            }
+        }
+        assert!(strings.next().is_none());
+        let (analysis, _) = crate::analyzer::annotate(&mut program);
+
+        let mut streamed = Vec::new();
+        X86_64Generator::new().generate_into(&program, &analysis, None, &mut streamed).unwrap();
+        let mut listing = String::new();
+        X86_64Generator::new()
+            .generate_listing(&program, &analysis, None, &mut |lines| {
+                lines.iter().try_for_each(|line| writeln!(listing, "{}", line))
+            })
+            .unwrap();
+
+        assert_eq!(listing.matches(".asciz").count(), 4);
+        assert!(listing.contains(".asciz \"say \\\"hi\\\"\"\n"));
+        assert_eq!(streamed, X86_64Generator::new().generate(&program, &analysis).into_bytes());
+        assert_eq!(streamed, listing.into_bytes());
+    }
+
+    #[test]
+    fn test_escaped_strings() {
+        assert_eq!(Escaped("plain text").to_string(), "plain text");
+        assert_eq!(Escaped("say \"hi\"").to_string(), "say \\\"hi\\\"");
+        assert_eq!(Escaped("C:\\dir").to_string(), "C:\\\\dir");
+        assert_eq!(Escaped("one\ntwo\tthree\0").to_string(), "one\\ntwo\\tthree\\0");
+    }
+
+    #[test]
+    fn test_encrypted_strings_stay_local() {
+        let source = "int main() { puts(\"secret\"); return 0; }";
+        let mut program = Parser::new(Lexer::new(source).scan_tokens()).parse().unwrap();
+        PassManager::new(vec![&StringEncryptor]).with_seed(1).run(&mut program).unwrap();
+        let (analysis, _) = crate::analyzer::annotate(&mut program);
+        let asm = X86_64Generator::new().generate(&program, &analysis);
+
+        assert!(asm.contains("\nL.enc.0:\n"));
+        assert!(asm.contains("leaq L.enc.0(%rip)"));
+        assert!(!asm.contains(".globl L.enc") && !asm.contains("_L.enc"));
+    }
+}
@@ -0,0 +1,758 @@
+// ir.rs
+// x86-64 code generation from the optimizer's SSA form
+//
+// Every value gets a location before any code is emitted: small constants
+// become immediates, a comparison that only feeds its block's branch is
+// left in the flags, and everything else gets a register or a stack slot
+// from a linear scan over live intervals. Values live across a call are
+// restricted to callee-saved registers. Phis become copies on the edges
+// into their block.
+
+use super::{global_symbol, X86_64Generator, ARG_REGISTERS};
+use crate::analyzer::symbols::Access;
+use crate::codegen::regalloc::CALLEE_SAVED;
+use crate::optimizer::ir::{BinOp, BlockId, Function, Inst, Terminator, UnOp, Value};
+use crate::codegen::asm::{frame, imm, label, mem, reg, rip};
+use crate::codegen::object::encoder::Operand;
+use std::collections::HashSet;
+
+/// Caller-saved registers for values not live across a call. %rax, %rcx
+/// and %rdx are never allocated; instructions use them as temporaries.
+const CALLER_SAVED: [&str; 6] = ["%rsi", "%rdi", "%r8", "%r9", "%r10", "%r11"];
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum Location {
+    /// Never used; computed only for its side effects
+    Nowhere,
+    /// A constant that fits in a sign-extended 32-bit immediate
+    Immediate(i64),
+    /// A comparison evaluated by the branch that consumes it
+    Flags,
+    Register(&'static str),
+    /// A stack slot at this offset from %rbp
+    Frame(i32),
+}
+
+impl Location {
+    fn operand(self) -> Operand {
+        match self {
+            Location::Immediate(value) => imm(value),
+            Location::Register(name) => reg(name),
+            Location::Frame(offset) => frame(offset),
+            Location::Nowhere | Location::Flags => unreachable!("location has no operand form"),
+        }
+    }
+}
+
+struct Allocation {
+    locations: Vec<Location>,
+    saved_registers: Vec<(&'static str, i32)>,
+    frame_size: usize,
+}
+
+#[derive(Debug, Clone, Copy)]
+struct Interval {
+    value: Value,
+    start: u32,
+    end: u32,
+    weight: u64,
+    callee_saved_only: bool,
+}
+
+struct IrContext<'a> {
+    function: &'a Function,
+    locations: Vec<Location>,
+    labels: Vec<String>,
+    saved_registers: Vec<(&'static str, i32)>,
+}
+
+impl IrContext<'_> {
+    fn location(&self, value: Value) -> Location {
+        self.locations[value.index()]
+    }
+}
+
+impl X86_64Generator {
+    pub(super) fn generate_ir_function(&mut self, function: &Function) {
+        let allocation = allocate(function);
+        let cx = IrContext {
+            function,
+            labels: function.blocks.iter().map(|_| self.next_label("bb")).collect(),
+            locations: allocation.locations,
+            saved_registers: allocation.saved_registers,
+        };
+
+        self.emit_line("");
+        emit!(self, ".globl _{}", function.name);
+        self.label(&format!("_{}", function.name));
+        self.inst("push", [reg("%rbp")]);
+        self.inst("mov", [reg("%rsp"), reg("%rbp")]);
+        if allocation.frame_size > 0 {
+            self.inst("sub", [imm(allocation.frame_size), reg("%rsp")]);
+        }
+        for &(name, offset) in &cx.saved_registers {
+            self.inst("movq", [reg(name), frame(offset)]);
+        }
+        // Parameters never get caller-saved registers, so these moves can't
+        // overwrite an argument that is still to be read
+        for &value in &function[BlockId::ENTRY].insts {
+            if let Inst::Param(index) = function[value] {
+                self.store_from(ARG_REGISTERS[index], cx.location(value));
+            }
+        }
+
+        for id in function.block_ids() {
+            if id != BlockId::ENTRY {
+                self.label(&cx.labels[id.index()]);
+            }
+            for &value in &function[id].insts {
+                if cx.location(value) != Location::Flags {
+                    self.emit_ir_inst(&cx, value);
+                }
+            }
+            self.emit_ir_terminator(&cx, id);
+        }
+    }
+
+    fn emit_ir_inst(&mut self, cx: &IrContext, value: Value) {
+        let dest = cx.location(value);
+        let target = match dest {
+            Location::Register(reg) => reg,
+            _ => "%rax",
+        };
+        match &cx.function[value] {
+            Inst::Phi(_) | Inst::Param(_) => {}
+            Inst::Const(c) => match dest {
+                Location::Register(_) | Location::Frame(_) if i32::try_from(*c).is_ok() => {
+                    self.inst("movq", [imm(*c), dest.operand()]);
+                }
+                Location::Register(_) | Location::Frame(_) => {
+                    self.inst("movabs", [imm(*c), reg(target)]);
+                    self.store_from(target, dest);
+                }
+                _ => {}
+            },
+            Inst::String(string) => {
+                self.emit_string_address(string, target);
+                self.store_from(target, dest);
+            }
+            Inst::LoadGlobal { name, width, signed } => {
+                let access = Access::Scalar { width: *width, signed: *signed };
+                self.emit_global_load(*name, access, target);
+                self.store_from(target, dest);
+            }
+            Inst::StoreGlobal { name, value, width } => {
+                let src = self.ir_sized_operand(cx, *value, *width, "%rax");
+                self.inst(format!("mov{}", Self::suffix(*width as usize)), [src.operand(), rip(global_symbol(*name))]);
+            }
+            Inst::Load { address, width, signed } => {
+                let address = self.ir_register(cx, *address, "%rax");
+                let access = Access::Scalar { width: *width, signed: *signed };
+                self.emit_load_from(access, mem(0, address), target);
+                self.store_from(target, dest);
+            }
+            Inst::Store { address, value, width } => {
+                let address = self.ir_register(cx, *address, "%rcx");
+                let src = self.ir_sized_operand(cx, *value, *width, "%rax");
+                self.inst(format!("mov{}", Self::suffix(*width as usize)), [src.operand(), mem(0, address)]);
+            }
+            Inst::Extend { value, width, signed } => {
+                let src = self.ir_register(cx, *value, "%rax");
+                self.emit_extend(src, *width as usize, *signed, target);
+                self.store_from(target, dest);
+            }
+            Inst::Unary { op, operand } => {
+                match op {
+                    UnOp::Neg | UnOp::Not => {
+                        self.load_ir_value(cx, *operand, target);
+                        let mnemonic = if *op == UnOp::Neg { "neg" } else { "not" };
+                        self.inst(mnemonic, [reg(target)]);
+                    }
+                    UnOp::LogicalNot => {
+                        let tested = self.ir_register(cx, *operand, "%rax");
+                        self.inst("test", [reg(tested), reg(tested)]);
+                        self.inst("sete", [reg("%al")]);
+                        self.inst("movzbq", [reg("%al"), reg(target)]);
+                    }
+                }
+                self.store_from(target, dest);
+            }
+            Inst::Binary { op, left, right } => self.emit_ir_binary(cx, value, *op, *left, *right),
+            Inst::Call { callee, args } => {
+                let stack_args = args.len().saturating_sub(ARG_REGISTERS.len());
+                // Keep %rsp 16-byte aligned at the call
+                let padding = stack_args % 2;
+                if padding != 0 {
+                    self.inst("sub", [imm(8), reg("%rsp")]);
+                }
+                for &arg in args.iter().skip(ARG_REGISTERS.len()).rev() {
+                    let src = self.ir_operand(cx, arg, "%rax");
+                    self.inst("pushq", [src.operand()]);
+                }
+                // No argument lives in a caller-saved register, so filling
+                // the argument registers can't clobber a later argument
+                for (&arg, reg) in args.iter().zip(ARG_REGISTERS) {
+                    self.load_ir_value(cx, arg, reg);
+                }
+                self.inst("call", [label(format!("_{}", callee))]);
+                if stack_args > 0 {
+                    self.inst("add", [imm((stack_args + padding) * 8), reg("%rsp")]);
+                }
+                self.store_from("%rax", dest);
+            }
+        }
+    }
+
+    fn emit_ir_binary(&mut self, cx: &IrContext, value: Value, op: BinOp, left: Value, right: Value) {
+        let dest = cx.location(value);
+        match op {
+            BinOp::Div | BinOp::Mod
+                if matches!(cx.location(right), Location::Immediate(c) if Self::divides_by_shifting(c)) =>
+            {
+                let Location::Immediate(divisor) = cx.location(right) else { unreachable!() };
+                self.load_ir_value(cx, left, "%rax");
+                self.emit_divide_by_power_of_two(divisor, op == BinOp::Mod);
+                self.store_from("%rax", dest);
+            }
+            BinOp::Div | BinOp::Mod => {
+                self.load_ir_value(cx, left, "%rax");
+                self.load_ir_value(cx, right, "%rcx");
+                self.inst("cqo", []);
+                self.inst("idiv", [reg("%rcx")]);
+                self.store_from(if op == BinOp::Div { "%rax" } else { "%rdx" }, dest);
+            }
+            // Shifts work on the low 32 bits, like the AST backend's
+            BinOp::Shl | BinOp::Shr => {
+                let mnemonic = if op == BinOp::Shl { "shl" } else { "sar" };
+                self.load_ir_value(cx, left, "%rax");
+                match cx.location(right) {
+                    Location::Immediate(count) => self.inst(mnemonic, [imm(count & 31), reg("%eax")]),
+                    _ => {
+                        self.load_ir_value(cx, right, "%rcx");
+                        self.inst(mnemonic, [reg("%cl"), reg("%eax")]);
+                    }
+                }
+                self.store_from("%rax", dest);
+            }
+            _ if op.is_comparison() => {
+                let condition = self.emit_ir_compare(cx, op, left, right);
+                let target = match dest {
+                    Location::Register(reg) => reg,
+                    _ => "%rax",
+                };
+                self.inst(format!("set{}", condition), [reg("%al")]);
+                self.inst("movzbq", [reg("%al"), reg(target)]);
+                self.store_from(target, dest);
+            }
+            _ => {
+                let (mut left, mut right) = (left, right);
+                if op.is_commutative()
+                    && (matches!(cx.location(left), Location::Immediate(_)) || cx.location(right) == dest)
+                {
+                    std::mem::swap(&mut left, &mut right);
+                }
+                let target = match dest {
+                    Location::Register(reg) if cx.location(right) != dest => reg,
+                    _ => "%rax",
+                };
+                self.load_ir_value(cx, left, target);
+                match (op, cx.location(right)) {
+                    (BinOp::Mul, Location::Immediate(c)) if Self::multiplies_without_imul(c) => {
+                        self.emit_multiply_by_constant(target, c);
+                    }
+                    (_, src) => {
+                        let mnemonic = match op {
+                            BinOp::Add => "add",
+                            BinOp::Sub => "sub",
+                            BinOp::Mul => "imul",
+                            BinOp::And => "and",
+                            BinOp::Or => "or",
+                            BinOp::Xor => "xor",
+                            _ => unreachable!(),
+                        };
+                        self.inst(mnemonic, [src.operand(), reg(target)]);
+                    }
+                }
+                self.store_from(target, dest);
+            }
+        }
+    }
+
+    /// Compares `left` with `right` and returns the condition code that
+    /// holds when `left op right`
+    fn emit_ir_compare(&mut self, cx: &IrContext, op: BinOp, left: Value, right: Value) -> &'static str {
+        let left = self.ir_register(cx, left, "%rax");
+        let right = self.ir_operand(cx, right, "%rcx");
+        self.inst("cmp", [right.operand(), reg(left)]);
+        condition_code(op)
+    }
+
+    fn emit_ir_terminator(&mut self, cx: &IrContext, block: BlockId) {
+        let next = BlockId::from_index(block.index() + 1);
+        match cx.function[block].terminator {
+            Terminator::Return(value) => {
+                if let Some(value) = value {
+                    self.load_ir_value(cx, value, "%rax");
+                }
+                self.emit_return(&cx.saved_registers);
+            }
+            Terminator::Jump(target) => self.emit_ir_jump(cx, block, target),
+            Terminator::Branch { condition, then_block, else_block } => {
+                let taken = match cx.location(condition) {
+                    Location::Flags => match cx.function[condition] {
+                        Inst::Binary { op, left, right } => self.emit_ir_compare(cx, op, left, right),
+                        _ => unreachable!("only comparisons live in the flags"),
+                    },
+                    Location::Immediate(c) => {
+                        return self.emit_ir_jump(cx, block, if c != 0 { then_block } else { else_block });
+                    }
+                    location => {
+                        let tested = self.ir_register(cx, condition, "%rax");
+                        debug_assert!(location != Location::Nowhere);
+                        self.inst("test", [reg(tested), reg(tested)]);
+                        "ne"
+                    }
+                };
+
+                let then_copies = has_edge_copies(cx, block, then_block);
+                let else_copies = has_edge_copies(cx, block, else_block);
+                if then_block == next && !then_copies && !else_copies {
+                    self.inst(format!("j{}", invert_condition(taken)), [label(&cx.labels[else_block.index()])]);
+                    return;
+                }
+
+                // The taken edge gets its own block when it needs copies
+                let edge = then_copies.then(|| self.next_label("edge"));
+                let then_label = edge.as_ref().unwrap_or(&cx.labels[then_block.index()]);
+                self.inst(format!("j{}", taken), [label(then_label)]);
+                self.emit_edge_copies(cx, block, else_block);
+                // The edge block sits between this block and the next
+                if edge.is_some() || else_block != next {
+                    self.inst("jmp", [label(&cx.labels[else_block.index()])]);
+                }
+                if let Some(edge) = edge {
+                    self.label(&edge);
+                    self.emit_edge_copies(cx, block, then_block);
+                    if then_block != next {
+                        self.inst("jmp", [label(&cx.labels[then_block.index()])]);
+                    }
+                }
+            }
+        }
+    }
+
+    fn emit_ir_jump(&mut self, cx: &IrContext, block: BlockId, target: BlockId) {
+        self.emit_edge_copies(cx, block, target);
+        if target.index() != block.index() + 1 {
+            self.inst("jmp", [label(&cx.labels[target.index()])]);
+        }
+    }
+
+    /// Gives the phis of `target` their operands for the edge from `block`.
+    /// A phi is live at the end of each of its predecessors, so it never
+    /// shares a location with another value live there and the copies
+    /// can't interfere with each other.
+    fn emit_edge_copies(&mut self, cx: &IrContext, block: BlockId, target: BlockId) {
+        for &value in &cx.function[target].insts {
+            let Inst::Phi(entries) = &cx.function[value] else {
+                break;
+            };
+            let dest = cx.location(value);
+            if dest == Location::Nowhere {
+                continue;
+            }
+            let &(_, src) = entries.iter().find(|(pred, _)| *pred == block).expect("phi has an operand for every edge");
+            match (cx.location(src), dest) {
+                (src, dest) if src == dest => {}
+                (Location::Frame(_), Location::Frame(_)) => {
+                    self.load_ir_value(cx, src, "%rax");
+                    self.store_from("%rax", dest);
+                }
+                (Location::Immediate(_), _) | (_, Location::Frame(_)) => {
+                    self.inst("movq", [cx.location(src).operand(), dest.operand()]);
+                }
+                (src, dest) => self.inst("mov", [src.operand(), dest.operand()]),
+            }
+        }
+    }
+
+    /// Copies `value` into `target`
+    fn load_ir_value(&mut self, cx: &IrContext, value: Value, target: &'static str) {
+        match cx.location(value) {
+            Location::Register(src) if src == target => {}
+            location => self.inst("mov", [location.operand(), reg(target)]),
+        }
+    }
+
+    /// The register holding `value`, loading it into `scratch` if needed
+    fn ir_register(&mut self, cx: &IrContext, value: Value, scratch: &'static str) -> &'static str {
+        match cx.location(value) {
+            Location::Register(reg) => reg,
+            _ => {
+                self.load_ir_value(cx, value, scratch);
+                scratch
+            }
+        }
+    }
+
+    /// An operand naming `value` that can be paired with a memory operand:
+    /// a register or an immediate
+    fn ir_operand(&mut self, cx: &IrContext, value: Value, scratch: &'static str) -> Location {
+        match cx.location(value) {
+            immediate @ Location::Immediate(_) => immediate,
+            _ => Location::Register(self.ir_register(cx, value, scratch)),
+        }
+    }
+
+    /// Like `ir_operand`, naming only the low `width` bytes of a register
+    fn ir_sized_operand(&mut self, cx: &IrContext, value: Value, width: u8, scratch: &'static str) -> Location {
+        match self.ir_operand(cx, value, scratch) {
+            Location::Register(reg) => Location::Register(Self::sized_register(reg, width as usize)),
+            immediate => immediate,
+        }
+    }
+
+    fn store_from(&mut self, source: &'static str, dest: Location) {
+        match dest {
+            Location::Register(dest) if dest == source => {}
+            Location::Register(_) | Location::Frame(_) => self.inst("mov", [reg(source), dest.operand()]),
+            _ => {}
+        }
+    }
+}
+
+fn has_edge_copies(cx: &IrContext, block: BlockId, target: BlockId) -> bool {
+    cx.function[target].insts.iter().any(|&value| match &cx.function[value] {
+        Inst::Phi(entries) => {
+            let dest = cx.location(value);
+            dest != Location::Nowhere
+                && entries
+                    .iter()
+                    .any(|&(pred, src)| pred == block && cx.location(src) != dest)
+        }
+        _ => false,
+    })
+}
+
+fn condition_code(op: BinOp) -> &'static str {
+    match op {
+        BinOp::Eq => "e",
+        BinOp::Ne => "ne",
+        BinOp::Lt => "l",
+        BinOp::Le => "le",
+        BinOp::Gt => "g",
+        BinOp::Ge => "ge",
+        _ => unreachable!("not a comparison"),
+    }
+}
+
+pub(super) fn invert_condition(condition: &str) -> &'static str {
+    match condition {
+        "e" => "ne",
+        "ne" => "e",
+        "l" => "ge",
+        "le" => "g",
+        "g" => "le",
+        "ge" => "l",
+        _ => unreachable!("unknown condition code"),
+    }
+}
+
+/// Chooses a location for every value of `function` and lays out its frame
+fn allocate(function: &Function) -> Allocation {
+    let count = function.insts.len();
+    let mut locations = vec![Location::Nowhere; count];
+    let mut uses = vec![0u32; count];
+    for block in &function.blocks {
+        for &value in &block.insts {
+            function[value].for_each_operand(|operand| uses[operand.index()] += 1);
+        }
+        if let Some(operand) = block.terminator.operand() {
+            uses[operand.index()] += 1;
+        }
+    }
+
+    for block in &function.blocks {
+        for &value in &block.insts {
+            if let Inst::Const(c) = function[value] {
+                if i32::try_from(c).is_ok() {
+                    locations[value.index()] = Location::Immediate(c);
+                }
+            }
+        }
+        // A comparison right before the branch consuming it needs no value
+        if let Terminator::Branch { condition, .. } = block.terminator {
+            let is_comparison = matches!(function[condition], Inst::Binary { op, .. } if op.is_comparison());
+            if is_comparison && block.insts.last() == Some(&condition) && uses[condition.index()] == 1 {
+                locations[condition.index()] = Location::Flags;
+            }
+        }
+    }
+
+    // Number the program points in layout order; a phi is defined where
+    // its block starts
+    let mut position = vec![0u32; count];
+    let mut block_start = Vec::with_capacity(function.blocks.len());
+    let mut block_end = Vec::with_capacity(function.blocks.len());
+    let mut calls = Vec::new();
+    let mut point = 0;
+    for block in &function.blocks {
+        point += 1;
+        block_start.push(point);
+        for &value in &block.insts {
+            match function[value] {
+                Inst::Phi(_) => position[value.index()] = point,
+                Inst::Call { .. } => {
+                    point += 1;
+                    position[value.index()] = point;
+                    calls.push(point);
+                }
+                _ => {
+                    point += 1;
+                    position[value.index()] = point;
+                }
+            }
+        }
+        point += 1;
+        block_end.push(point);
+    }
+
+    // Blocks between a loop header and the block jumping back to it are
+    // inside the loop, given the reverse postorder layout
+    let mut loop_depth = vec![0u32; function.blocks.len()];
+    for id in function.block_ids() {
+        for succ in function[id].terminator.successors() {
+            if succ <= id {
+                for depth in &mut loop_depth[succ.index()..=id.index()] {
+                    *depth += 1;
+                }
+            }
+        }
+    }
+
+    let (live_in, live_out) = liveness(function);
+
+    let mut ranges: Vec<Option<(u32, u32)>> = vec![None; count];
+    let mut weights = vec![0u64; count];
+    for id in function.block_ids() {
+        let b = id.index();
+        let weight = 8u64.pow(loop_depth[b].min(4));
+        for &value in &function[id].insts {
+            extend_range(&mut ranges, value, position[value.index()]);
+            weights[value.index()] += weight;
+            match &function[value] {
+                // The edge copies write a phi at the end of each predecessor
+                Inst::Phi(entries) => {
+                    for &(pred, operand) in entries {
+                        extend_range(&mut ranges, value, block_end[pred.index()]);
+                        weights[operand.index()] += 8u64.pow(loop_depth[pred.index()].min(4));
+                    }
+                }
+                // The prologue copies every parameter out of its register
+                Inst::Param(_) => extend_range(&mut ranges, value, block_start[b]),
+                inst => inst.for_each_operand(|operand| {
+                    extend_range(&mut ranges, operand, position[value.index()]);
+                    weights[operand.index()] += weight;
+                }),
+            }
+        }
+        if let Some(operand) = function[id].terminator.operand() {
+            extend_range(&mut ranges, operand, block_end[b]);
+            weights[operand.index()] += weight;
+        }
+        for &value in &live_in[b] {
+            extend_range(&mut ranges, value, block_start[b]);
+        }
+        for &value in &live_out[b] {
+            extend_range(&mut ranges, value, block_end[b]);
+        }
+    }
+
+    let mut intervals = Vec::new();
+    for block in &function.blocks {
+        for &value in &block.insts {
+            let index = value.index();
+            let Some((start, end)) = ranges[index] else {
+                continue;
+            };
+            if locations[index] != Location::Nowhere || uses[index] == 0 {
+                continue;
+            }
+            // Params arrive in argument registers, which the prologue must
+            // not overwrite while copying them out
+            let is_param = matches!(function[value], Inst::Param(_));
+            let crosses_call = calls.iter().any(|&call| start < call && call <= end);
+            intervals.push(Interval {
+                value,
+                start,
+                end,
+                weight: weights[index],
+                callee_saved_only: is_param || crosses_call,
+            });
+        }
+    }
+    intervals.sort_by_key(|interval| (interval.start, interval.end));
+
+    let mut free_callee: Vec<&'static str> = CALLEE_SAVED.iter().rev().copied().collect();
+    let mut free_caller: Vec<&'static str> = CALLER_SAVED.iter().rev().copied().collect();
+    let mut active: Vec<(Interval, &'static str)> = Vec::new();
+    let mut spilled = Vec::new();
+    let mut used_callee = HashSet::new();
+
+    for interval in intervals {
+        active.retain(|&(old, reg)| {
+            let live = old.end >= interval.start;
+            if !live {
+                if CALLEE_SAVED.contains(&reg) {
+                    free_callee.push(reg);
+                } else {
+                    free_caller.push(reg);
+                }
+            }
+            live
+        });
+
+        let free = if interval.callee_saved_only { None } else { free_caller.pop() };
+        if let Some(reg) = free.or_else(|| free_callee.pop()) {
+            locations[interval.value.index()] = Location::Register(reg);
+            active.push((interval, reg));
+            continue;
+        }
+
+        // No register left: the lighter of this interval and the active ones
+        // whose register it could use goes to memory
+        let victim = active
+            .iter()
+            .enumerate()
+            .filter(|(_, (_, reg))| !interval.callee_saved_only || CALLEE_SAVED.contains(reg))
+            .min_by_key(|(_, (old, _))| old.weight)
+            .map(|(index, _)| index);
+        match victim {
+            Some(index) if active[index].0.weight < interval.weight => {
+                let (old, reg) = active.swap_remove(index);
+                spilled.push(old);
+                locations[interval.value.index()] = Location::Register(reg);
+                active.push((interval, reg));
+            }
+            _ => spilled.push(interval),
+        }
+    }
+    for location in &locations {
+        if let Location::Register(reg) = location {
+            if CALLEE_SAVED.contains(reg) {
+                used_callee.insert(*reg);
+            }
+        }
+    }
+
+    let saved_registers: Vec<(&'static str, i32)> = CALLEE_SAVED
+        .iter()
+        .copied()
+        .filter(|reg| used_callee.contains(reg))
+        .zip((1..).map(|slot: i32| -8 * slot))
+        .collect();
+
+    // Spilled values share stack slots when their intervals don't overlap
+    spilled.sort_by_key(|interval| (interval.start, interval.end));
+    let mut slots = saved_registers.len() as i32;
+    let mut free_slots: Vec<i32> = Vec::new();
+    let mut active_slots: Vec<(u32, i32)> = Vec::new();
+    for interval in spilled {
+        active_slots.retain(|&(end, offset)| {
+            let live = end >= interval.start;
+            if !live {
+                free_slots.push(offset);
+            }
+            live
+        });
+        let offset = free_slots.pop().unwrap_or_else(|| {
+            slots += 1;
+            -8 * slots
+        });
+        locations[interval.value.index()] = Location::Frame(offset);
+        active_slots.push((interval.end, offset));
+    }
+
+    Allocation {
+        locations,
+        saved_registers,
+        frame_size: (slots as usize * 8).div_ceil(16) * 16,
+    }
+}
+
+fn extend_range(ranges: &mut [Option<(u32, u32)>], value: Value, point: u32) {
+    let range = &mut ranges[value.index()];
+    *range = Some(match *range {
+        None => (point, point),
+        Some((start, end)) => (start.min(point), end.max(point)),
+    });
+}
+
+/// Values live on entry to and on exit from every block. A phi operand is
+/// live out of the predecessor it comes from, not into the phi's block.
+fn liveness(function: &Function) -> (Vec<HashSet<Value>>, Vec<HashSet<Value>>) {
+    let count = function.blocks.len();
+    let mut live_in = vec![HashSet::new(); count];
+    let mut live_out = vec![HashSet::new(); count];
+    let mut changed = true;
+    while changed {
+        changed = false;
+        for id in function.block_ids().rev() {
+            let block = &function[id];
+            let mut out = HashSet::new();
+            for succ in block.terminator.successors() {
+                out.extend(live_in[succ.index()].iter().copied());
+                for &value in &function[succ].insts {
+                    let Inst::Phi(entries) = &function[value] else {
+                        break;
+                    };
+                    out.extend(entries.iter().filter(|(pred, _)| *pred == id).map(|&(_, operand)| operand));
+                }
+            }
+
+            let mut live = out.clone();
+            live.extend(block.terminator.operand());
+            for &value in block.insts.iter().rev() {
+                live.remove(&value);
+                if !matches!(function[value], Inst::Phi(_)) {
+                    function[value].for_each_operand(|operand| {
+                        live.insert(operand);
+                    });
+                }
+            }
+
+            if out != live_out[id.index()] || live != live_in[id.index()] {
+                live_out[id.index()] = out;
+                live_in[id.index()] = live;
+                changed = true;
+            }
+        }
+    }
+    (live_in, live_out)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::compiler::OptimizationLevel;
+    use crate::config::OptimizationConfig;
+    use crate::optimizer::Optimizer;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+
+    #[test]
+    fn test_loop_keeps_values_in_registers() {
+        let source = "int f(int n) { int s = 0; while (n > 0) { s = s + n; n = n - 1; } return s; }";
+        let tokens = Lexer::new(source).scan_tokens();
+        let mut program = Parser::new(tokens).parse().unwrap();
+        let (analysis, _) = crate::analyzer::annotate(&mut program);
+        let module = Optimizer::new(OptimizationLevel::Basic, OptimizationConfig::default()).run(&program, &analysis);
+        let asm = X86_64Generator::new().generate_optimized(&program, &analysis, &module);
+
+        // The loop branches on the comparison itself
+        assert!(asm.contains("    jg "));
+        assert!(!asm.contains("set"));
+        // The only stack accesses save and restore the parameter's register
+        assert_eq!(asm.matches("(%rbp)").count(), 2);
+    }
+}
@@ -0,0 +1,1029 @@
+// peephole.rs
+// Peephole optimization of generated x86-64 code
+//
+// Both code generators emit each expression and each IR instruction on its
+// own: operands pass through %rax and %rcx, held values are pushed and
+// popped, comparisons become 0 or 1 before a branch tests them and a value
+// stored to a variable is often loaded straight back. At -O1 and above the
+// code of each function is rewritten over windows of adjacent instructions
+// until nothing more applies: immediates fold into the instructions using
+// them, pushes and pops and copies through a scratch register become moves
+// to the final register, address arithmetic becomes lea, a set-and-test
+// becomes a compare and branch, and a reload of what was just stored reuses
+// the register.
+//
+// A rewrite that drops a register's value or the flags is only made if
+// nothing reads them later, following jumps to their labels. Anything not
+// understood, and anything too far ahead, counts as reading everything.
+
+use super::ir::invert_condition;
+use super::FunctionOutput;
+use crate::codegen::asm::{Inst, Line};
+use crate::codegen::object::encoder::{Address, Operand, Register};
+use crate::optimizer::ir::extend;
+use std::collections::{HashMap, HashSet};
+
+/// Upper bound on the rounds of rewriting; each usually only exposes a
+/// little more work for the next
+const MAX_ROUNDS: usize = 8;
+
+// Instructions followed when deciding whether a value is still needed,
+// beyond which it's assumed to be
+const SCAN_LIMIT: usize = 64;
+
+// A set of registers and the flags: register n is bit n
+const FLAGS: u32 = 1 << 16;
+const RAX: u32 = 1 << 0;
+const RCX: u32 = 1 << 1;
+const RDX: u32 = 1 << 2;
+const RSP: u32 = 1 << 4;
+
+// Read by a call: the argument registers, %al for the vector register
+// count of a variadic call, and the stack
+const CALL_READS: u32 = 0b11_1100_0110 | RAX | RSP;
+// Overwritten by a call without being one of its arguments
+const CALL_CLOBBERS: u32 = 0b1100_0000_0000 | FLAGS;
+// Live at a return: the result, the stack and the callee-saved registers
+const RETURN_READS: u32 = RAX | RDX | 0b1111_0000_0011_1000;
+
+// Mnemonics taking an optional size suffix
+const SIZED: [&str; 22] = [
+    "mov", "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp", "test", "imul", "not", "neg", "mul", "div", "idiv",
+    "inc", "dec", "shl", "sal", "shr", "sar",
+];
+
+/// Rewrites the code of one function. String addresses are rewritten like
+/// any other operand, so they keep pointing at the same literals.
+pub(super) fn optimize(output: &mut FunctionOutput) {
+    let lines = std::mem::take(&mut output.lines);
+    let mut code = Code { lines: lines.into_iter().map(Some).collect(), labels: HashMap::new() };
+    for _ in 0..MAX_ROUNDS {
+        if !code.rewrite() {
+            break;
+        }
+    }
+    output.lines = code.lines.into_iter().flatten().collect();
+}
+
+impl Inst {
+    // The mnemonic without a size suffix
+    fn name(&self) -> &str {
+        let mnemonic = &*self.mnemonic;
+        if SIZED.contains(&mnemonic) || is_extension(mnemonic) {
+            return mnemonic;
+        }
+        match mnemonic.strip_suffix(['b', 'w', 'l', 'q']) {
+            Some(name) if SIZED.contains(&name) || name == "lea" || name == "push" || name == "pop" => name,
+            _ => mnemonic,
+        }
+    }
+
+    // The register written by a move, extension or lea, replacing its old
+    // value entirely
+    fn defined_register(&self) -> Option<Register> {
+        if !matches!(self.name(), "mov" | "lea") && !is_extension(&self.mnemonic) {
+            return None;
+        }
+        match self.operands.as_slice() {
+            [_, Operand::Register(register)] if register.size >= 4 => Some(*register),
+            _ => None,
+        }
+    }
+}
+
+// movzx, movslq, movzbq and the other extending moves
+fn is_extension(mnemonic: &str) -> bool {
+    match mnemonic {
+        "movzx" | "movsx" | "movslq" | "movsxd" => true,
+        _ => {
+            let sizes = mnemonic.strip_prefix("movs").or_else(|| mnemonic.strip_prefix("movz"));
+            sizes.is_some_and(|sizes| sizes.len() == 2 && sizes.chars().all(|c| "bwlq".contains(c)))
+        }
+    }
+}
+
+fn is_condition(code: &str) -> bool {
+    matches!(
+        code,
+        "o" | "no"
+            | "b"
+            | "c"
+            | "nae"
+            | "ae"
+            | "nb"
+            | "nc"
+            | "e"
+            | "z"
+            | "ne"
+            | "nz"
+            | "be"
+            | "na"
+            | "a"
+            | "nbe"
+            | "s"
+            | "ns"
+            | "p"
+            | "pe"
+            | "np"
+            | "po"
+            | "l"
+            | "nge"
+            | "ge"
+            | "nl"
+            | "le"
+            | "ng"
+            | "g"
+            | "nle"
+    )
+}
+
+// The conditions `invert_condition` knows, as jumps and sets spell them
+fn invertible(code: &str) -> Option<&'static str> {
+    Some(match code {
+        "e" | "z" => "e",
+        "ne" | "nz" => "ne",
+        "l" => "l",
+        "le" => "le",
+        "g" => "g",
+        "ge" => "ge",
+        _ => return None,
+    })
+}
+
+fn bit(register: Register) -> u32 {
+    1 << register.number
+}
+
+// Registers an operand reads as a source
+fn uses(operand: &Operand) -> u32 {
+    match operand {
+        Operand::Register(register) => bit(*register),
+        Operand::Memory(address) => address_uses(address),
+        _ => 0,
+    }
+}
+
+fn address_uses(address: &Address) -> u32 {
+    match address {
+        Address::Base { base, index, .. } => bit(*base) | index.map_or(0, |(index, _)| bit(index)),
+        Address::Rip { .. } => 0,
+    }
+}
+
+// `address` moved by `offset` bytes
+fn offset_address(address: &Address, offset: i64) -> Option<Address> {
+    let add = |value: i32| i32::try_from(i64::from(value) + offset).ok();
+    Some(match address {
+        Address::Base { base, index, displacement } => {
+            Address::Base { base: *base, index: *index, displacement: add(*displacement)? }
+        }
+        Address::Rip { symbol, addend } => Address::Rip { symbol: symbol.clone(), addend: add(*addend)? },
+    })
+}
+
+/// What an instruction does to the registers and flags
+#[derive(Debug, Default)]
+struct Effects {
+    reads: u32,
+    // Replaced entirely, without being read
+    writes: u32,
+    // Changed in any way
+    clobbers: u32,
+}
+
+impl Effects {
+    fn read(&mut self, operand: &Operand) {
+        self.reads |= uses(operand);
+    }
+
+    // `operand` is written without being read. A register narrower than
+    // 32 bits keeps its other bytes, so it's read too.
+    fn define(&mut self, operand: &Operand) {
+        match operand {
+            Operand::Register(register) if register.size >= 4 => {
+                self.writes |= bit(*register);
+                self.clobbers |= bit(*register);
+            }
+            Operand::Register(register) => {
+                self.reads |= bit(*register);
+                self.clobbers |= bit(*register);
+            }
+            _ => self.read_address(operand),
+        }
+    }
+
+    // `operand` is read and written
+    fn modify(&mut self, operand: &Operand) {
+        self.read(operand);
+        if let Operand::Register(register) = operand {
+            self.clobbers |= bit(*register);
+        }
+    }
+
+    fn read_address(&mut self, operand: &Operand) {
+        if let Operand::Memory(address) = operand {
+            self.reads |= address_uses(address);
+        }
+    }
+
+    fn set_flags(&mut self) {
+        self.writes |= FLAGS;
+        self.clobbers |= FLAGS;
+    }
+}
+
+// What `inst` reads and writes. None for control flow and anything else
+// not modelled.
+fn effects(inst: &Inst) -> Option<Effects> {
+    let operands = &inst.operands;
+    let mut effects = Effects::default();
+    let name = inst.name();
+    if name.strip_prefix("set").is_some_and(is_condition) {
+        let [operand] = operands.as_slice() else { return None };
+        effects.reads |= FLAGS;
+        effects.define(operand);
+        return Some(effects);
+    }
+    match (name, operands.as_slice()) {
+        ("mov" | "movabs" | "lea", [source, destination]) => {
+            effects.read(source);
+            effects.define(destination);
+        }
+        (_, [source, destination]) if is_extension(name) => {
+            effects.read(source);
+            effects.define(destination);
+        }
+        ("add" | "sub" | "and" | "or" | "xor" | "imul", [source, destination]) => {
+            effects.read(source);
+            effects.modify(destination);
+            effects.set_flags();
+        }
+        ("adc" | "sbb", [source, destination]) => {
+            effects.reads |= FLAGS;
+            effects.read(source);
+            effects.modify(destination);
+            effects.set_flags();
+        }
+        ("cmp" | "test", [left, right]) => {
+            effects.read(left);
+            effects.read(right);
+            effects.set_flags();
+        }
+        ("imul", [Operand::Immediate(_), source, destination]) => {
+            effects.read(source);
+            effects.define(destination);
+            effects.set_flags();
+        }
+        ("imul" | "mul" | "div" | "idiv", [operand]) => {
+            effects.read(operand);
+            effects.reads |= RAX | RDX;
+            effects.writes |= RAX | RDX;
+            effects.clobbers |= RAX | RDX;
+            effects.set_flags();
+        }
+        ("neg", [operand]) => {
+            effects.modify(operand);
+            effects.set_flags();
+        }
+        ("not", [operand]) => effects.modify(operand),
+        // inc and dec leave the carry flag as it was
+        ("inc" | "dec", [operand]) => {
+            effects.reads |= FLAGS;
+            effects.modify(operand);
+            effects.clobbers |= FLAGS;
+        }
+        ("shl" | "sal" | "shr" | "sar", [Operand::Immediate(_), destination]) => {
+            effects.modify(destination);
+            effects.set_flags();
+        }
+        // A shift by zero leaves the flags as they were
+        ("shl" | "sal" | "shr" | "sar", [Operand::Register(count), destination]) if count.number == 1 => {
+            effects.reads |= RCX | FLAGS;
+            effects.modify(destination);
+            effects.clobbers |= FLAGS;
+        }
+        ("cqo" | "cqto" | "cdq" | "cltd", []) => {
+            effects.reads |= RAX;
+            effects.writes |= RDX;
+            effects.clobbers |= RDX;
+        }
+        ("cltq" | "cdqe", []) => {
+            effects.reads |= RAX;
+            effects.clobbers |= RAX;
+        }
+        ("push", [operand]) => {
+            effects.read(operand);
+            effects.reads |= RSP;
+            effects.clobbers |= RSP;
+        }
+        ("pop", [operand]) => {
+            effects.reads |= RSP;
+            effects.clobbers |= RSP;
+            effects.define(operand);
+        }
+        _ => return None,
+    }
+    Some(effects)
+}
+
+enum Flow<'a> {
+    Jump(&'a str),
+    Branch(&'a str, &'a str),
+    Call,
+    Return,
+    Straight,
+    // An indirect jump
+    Unknown,
+}
+
+fn flow(inst: &Inst) -> Flow<'_> {
+    let target = || match inst.operands.first() {
+        Some(Operand::Symbol(target)) => Some(target.as_str()),
+        _ => None,
+    };
+    match &*inst.mnemonic {
+        "jmp" | "jmpq" => target().map_or(Flow::Unknown, Flow::Jump),
+        "call" | "callq" => Flow::Call,
+        "ret" | "retq" => Flow::Return,
+        mnemonic => match mnemonic.strip_prefix('j').filter(|code| is_condition(code)) {
+            Some(code) => target().map_or(Flow::Unknown, |target| Flow::Branch(code, target)),
+            None => Flow::Straight,
+        },
+    }
+}
+
+struct Code {
+    // None once removed by the current round
+    lines: Vec<Option<Line>>,
+    // Line of each label, as of the current round
+    labels: HashMap<String, usize>,
+}
+
+impl Code {
+    // One round of rewriting; returns whether anything changed
+    fn rewrite(&mut self) -> bool {
+        self.labels =
+            self.lines.iter().enumerate().filter_map(|(at, line)| match line {
+                Some(Line::Label(name)) => Some((name.clone(), at)),
+                _ => None,
+            })
+            .collect();
+        let mut changed = false;
+        for at in 0..self.lines.len() {
+            if matches!(self.lines[at], Some(Line::Inst(_))) {
+                changed |= self.remove_self_move(at)
+                    || self.forward_push(at)
+                    || self.forward_definition(at)
+                    || self.remove_copy_back(at)
+                    || self.fold_immediate(at)
+                    || self.store_immediate(at)
+                    || self.fold_into_lea(at)
+                    || self.fold_address(at)
+                    || self.forward_store(at)
+                    || self.swap_operands(at)
+                    || self.fuse_compare_and_branch(at)
+                    || self.remove_jump(at)
+                    || self.remove_dead_definition(at);
+            }
+        }
+        self.lines.retain(Option::is_some);
+        changed
+    }
+
+    fn inst(&self, at: usize) -> &Inst {
+        match &self.lines[at] {
+            Some(Line::Inst(inst)) => inst,
+            _ => unreachable!("not an instruction"),
+        }
+    }
+
+    fn replace(&mut self, at: usize, inst: Inst) {
+        self.lines[at] = Some(Line::Inst(inst));
+    }
+
+    // The instruction right after line `at`, unless a label or directive
+    // comes first
+    fn next(&self, at: usize) -> Option<usize> {
+        let mut next = at + 1;
+        loop {
+            match self.lines.get(next)? {
+                None => next += 1,
+                Some(Line::Inst(_)) => return Some(next),
+                _ => return None,
+            }
+        }
+    }
+
+    // Whether nothing reads `resource`, a register bit or FLAGS, before
+    // overwriting it on every path from each line of `starts`
+    fn is_dead(&self, starts: &[usize], resource: u32) -> bool {
+        let mut paths = starts.to_vec();
+        let mut visited = HashSet::new();
+        let mut steps = 0;
+        while let Some(mut at) = paths.pop() {
+            loop {
+                steps += 1;
+                if steps > SCAN_LIMIT {
+                    return false;
+                }
+                // A line seen before is being followed already
+                if !visited.insert(at) {
+                    break;
+                }
+                let inst = match self.lines.get(at) {
+                    // Falling off the end of the function
+                    None => return false,
+                    Some(Some(Line::Inst(inst))) => inst,
+                    Some(Some(Line::Other(line))) if !line.trim_start().starts_with('#') => return false,
+                    Some(_) => {
+                        at += 1;
+                        continue;
+                    }
+                };
+                match flow(inst) {
+                    Flow::Jump(target) => match self.labels.get(target) {
+                        Some(&target) => at = target,
+                        None => return false,
+                    },
+                    Flow::Branch(_, target) => {
+                        if resource == FLAGS {
+                            return false;
+                        }
+                        match self.labels.get(target) {
+                            Some(&target) => paths.push(target),
+                            None => return false,
+                        }
+                        at += 1;
+                    }
+                    Flow::Call => {
+                        if CALL_READS & resource != 0 {
+                            return false;
+                        }
+                        if CALL_CLOBBERS & resource != 0 {
+                            break;
+                        }
+                        at += 1;
+                    }
+                    Flow::Unknown => return false,
+                    Flow::Return => {
+                        if RETURN_READS & resource != 0 {
+                            return false;
+                        }
+                        break;
+                    }
+                    Flow::Straight => {
+                        let Some(effects) = effects(inst) else {
+                            return false;
+                        };
+                        if effects.reads & resource != 0 {
+                            return false;
+                        }
+                        if effects.writes & resource != 0 {
+                            break;
+                        }
+                        at += 1;
+                    }
+                }
+            }
+        }
+        true
+    }
+
+    // mov %rax, %rax
+    fn remove_self_move(&mut self, at: usize) -> bool {
+        let inst = self.inst(at);
+        let redundant = inst.name() == "mov"
+            && matches!(inst.operands.as_slice(),
+                [Operand::Register(a), Operand::Register(b)] if a == b && a.size == 8);
+        if redundant {
+            self.lines[at] = None;
+        }
+        redundant
+    }
+
+    // push %rax ... pop %rcx, where the code between leaves %rcx and the
+    // stack alone, becomes mov %rax, %rcx before it. Pushing and popping
+    // the same register around code that keeps it needs neither.
+    fn forward_push(&mut self, at: usize) -> bool {
+        let Some(pushed) = self.single_register(at, "push") else {
+            return false;
+        };
+        let (mut reads, mut clobbers) = (0, 0);
+        let mut next = at;
+        for _ in 0..16 {
+            let Some(following) = self.next(next) else {
+                return false;
+            };
+            next = following;
+            if self.inst(next).name() == "pop" {
+                let Some(popped) = self.single_register(next, "pop") else {
+                    return false;
+                };
+                if popped == pushed {
+                    if clobbers & bit(pushed) != 0 {
+                        return false;
+                    }
+                    self.lines[at] = None;
+                } else {
+                    if (reads | clobbers) & bit(popped) != 0 {
+                        return false;
+                    }
+                    self.replace(at, Inst::new("mov", [Operand::Register(pushed), Operand::Register(popped)]));
+                }
+                self.lines[next] = None;
+                return true;
+            }
+            let inst = self.inst(next);
+            let Flow::Straight = flow(inst) else {
+                return false;
+            };
+            let Some(effects) = effects(inst) else {
+                return false;
+            };
+            if (effects.reads | effects.clobbers) & RSP != 0 {
+                return false;
+            }
+            reads |= effects.reads;
+            clobbers |= effects.clobbers;
+        }
+        false
+    }
+
+    // A value made in one register and copied to another is made there
+    fn forward_definition(&mut self, at: usize) -> bool {
+        let Some(defined) = self.inst(at).defined_register().filter(|defined| defined.size == 8) else {
+            return false;
+        };
+        let Some(next) = self.next(at) else {
+            return false;
+        };
+        let target = match self.register_move(next) {
+            Some((source, target)) if source == defined && target != defined && target.number != 4 => target,
+            _ => return false,
+        };
+        if !self.is_dead(&[next + 1], bit(defined)) {
+            return false;
+        }
+        let mut inst = self.inst(at).clone();
+        inst.operands[1] = Operand::Register(target);
+        self.replace(at, inst);
+        self.lines[next] = None;
+        true
+    }
+
+    // mov %rax, %rcx; mov %rcx, %rax
+    fn remove_copy_back(&mut self, at: usize) -> bool {
+        let Some(next) = self.next(at) else {
+            return false;
+        };
+        let redundant = match (self.register_move(at), self.register_move(next)) {
+            (Some((a, b)), Some((c, d))) => a == d && b == c,
+            _ => false,
+        };
+        if redundant {
+            self.lines[next] = None;
+        }
+        redundant
+    }
+
+    // An immediate moved to a register only to be an operand is the operand
+    fn fold_immediate(&mut self, at: usize) -> bool {
+        let Some((register, value)) = self.immediate_move(at) else {
+            return false;
+        };
+        let Some(next) = self.next(at) else {
+            return false;
+        };
+        let inst = self.inst(next);
+        let [Operand::Register(source), destination] = inst.operands.as_slice() else {
+            return false;
+        };
+        if source.number != register.number || uses(destination) & bit(register) != 0 {
+            return false;
+        }
+        let immediate = match (inst.name(), destination) {
+            ("add" | "sub" | "and" | "or" | "xor" | "cmp" | "test", _) | ("imul", Operand::Register(_)) => {
+                extend(value, source.size, true)
+            }
+            // Shifts only use the low bits of the count
+            ("shl" | "sal" | "shr" | "sar", Operand::Register(destination)) if source.size == 1 => {
+                value & if destination.size == 8 { 63 } else { 31 }
+            }
+            _ => return false,
+        };
+        if i32::try_from(immediate).is_err() || !self.is_dead(&[next + 1], bit(register)) {
+            return false;
+        }
+        let mut inst = inst.clone();
+        inst.operands[0] = Operand::Immediate(immediate);
+        self.replace(next, inst);
+        self.lines[at] = None;
+        true
+    }
+
+    // An immediate moved to a register only to be stored or pushed is
+    // stored or pushed itself
+    fn store_immediate(&mut self, at: usize) -> bool {
+        let Some((register, value)) = self.immediate_move(at) else {
+            return false;
+        };
+        let Some(next) = self.next(at) else {
+            return false;
+        };
+        let inst = self.inst(next);
+        let (mnemonic, value, destination) = match (inst.name(), inst.operands.as_slice()) {
+            ("mov", [Operand::Register(source), Operand::Memory(address)])
+                if source.number == register.number && address_uses(address) & bit(register) == 0 =>
+            {
+                let mnemonic = ["movb", "movw", "movl", "movq"][source.size.trailing_zeros() as usize];
+                (mnemonic, extend(value, source.size, true), Some(inst.operands[1].clone()))
+            }
+            ("push", [Operand::Register(source)]) if *source == register && source.size == 8 => {
+                ("push", value, None)
+            }
+            _ => return false,
+        };
+        if i32::try_from(value).is_err() || !self.is_dead(&[next + 1], bit(register)) {
+            return false;
+        }
+        let inst = match destination {
+            Some(destination) => Inst::new(mnemonic, [Operand::Immediate(value), destination]),
+            None => Inst::new(mnemonic, [Operand::Immediate(value)]),
+        };
+        self.replace(next, inst);
+        self.lines[at] = None;
+        true
+    }
+
+    // Adding to an address or a copied register is a lea, when nothing
+    // needs the flags the add sets
+    fn fold_into_lea(&mut self, at: usize) -> bool {
+        let Some(next) = self.next(at) else {
+            return false;
+        };
+        let (first, second) = (self.inst(at), self.inst(next));
+        let (definition, addition) = (&first.operands, &second.operands);
+        let (addend, target) = match (second.name(), addition.as_slice()) {
+            ("add" | "sub", [addend, Operand::Register(target)]) if target.size == 8 => (addend, *target),
+            _ => return false,
+        };
+        let subtract = second.name() == "sub";
+        let address = match (first.name(), definition.as_slice(), addend) {
+            ("lea", [Operand::Memory(address), Operand::Register(defined)], Operand::Immediate(value))
+                if *defined == target =>
+            {
+                offset_address(address, if subtract { value.wrapping_neg() } else { *value })
+            }
+            ("mov", [Operand::Register(source), Operand::Register(defined)], Operand::Immediate(value))
+                if *defined == target && source.size == 8 =>
+            {
+                let address = Address::Base { base: *source, index: None, displacement: 0 };
+                offset_address(&address, if subtract { value.wrapping_neg() } else { *value })
+            }
+            ("mov", [Operand::Register(source), Operand::Register(defined)], Operand::Register(index))
+                if *defined == target
+                    && !subtract
+                    && source.size == 8
+                    && index.size == 8
+                    && index.number != 4
+                    && *index != target =>
+            {
+                Some(Address::Base { base: *source, index: Some((*index, 1)), displacement: 0 })
+            }
+            _ => None,
+        };
+        let Some(address) = address else {
+            return false;
+        };
+        if !self.is_dead(&[next + 1], FLAGS) {
+            return false;
+        }
+        self.replace(at, Inst::new("lea", [Operand::Memory(address), Operand::Register(target)]));
+        self.lines[next] = None;
+        true
+    }
+
+    // An address computed into a register only to be used once is used
+    // directly: lea -8(%rbp), %rax; mov (%rax), %rax is mov -8(%rbp), %rax
+    fn fold_address(&mut self, at: usize) -> bool {
+        let first = self.inst(at);
+        let (address, base) = match (first.name(), first.operands.as_slice()) {
+            ("lea", [Operand::Memory(address), Operand::Register(base)]) if base.size == 8 => {
+                (address.clone(), *base)
+            }
+            _ => return false,
+        };
+        let Some(next) = self.next(at) else {
+            return false;
+        };
+        let inst = self.inst(next);
+        if !matches!(flow(inst), Flow::Straight) || effects(inst).is_none() {
+            return false;
+        }
+        // The register may only otherwise be the destination it's replaced in
+        let overwritten = inst.defined_register().is_some_and(|defined| defined.number == base.number);
+        let mut memory = None;
+        let operands = &inst.operands;
+        for (n, operand) in operands.iter().enumerate() {
+            match operand {
+                Operand::Memory(Address::Base { base: used, index: None, displacement })
+                    if *used == base && memory.is_none() =>
+                {
+                    memory = Some((n, *displacement));
+                }
+                _ if overwritten && n == operands.len() - 1 => {}
+                _ if uses(operand) & bit(base) != 0 => return false,
+                _ => {}
+            }
+        }
+        let Some((n, displacement)) = memory else {
+            return false;
+        };
+        let Some(address) = offset_address(&address, displacement.into()) else {
+            return false;
+        };
+        if !overwritten && !self.is_dead(&[next + 1], bit(base)) {
+            return false;
+        }
+        let mut inst = inst.clone();
+        inst.operands[n] = Operand::Memory(address);
+        self.replace(next, inst);
+        self.lines[at] = None;
+        true
+    }
+
+    // A value stored and loaded straight back is still in its register
+    fn forward_store(&mut self, at: usize) -> bool {
+        let store = self.inst(at);
+        let (source, address) = match (store.name(), store.operands.as_slice()) {
+            ("mov", [Operand::Register(source), Operand::Memory(address)]) => (*source, address.clone()),
+            _ => return false,
+        };
+        let Some(next) = self.next(at) else {
+            return false;
+        };
+        let load = self.inst(next);
+        let target = match load.operands.as_slice() {
+            [Operand::Memory(loaded), Operand::Register(target)] if *loaded == address => *target,
+            _ => return false,
+        };
+        let mnemonic = match (&*load.mnemonic, source.size, target.size) {
+            ("mov" | "movq" | "movl" | "movw" | "movb", from, to) if from == to => "mov",
+            ("movslq" | "movsxd", 4, 8) => "movslq",
+            ("movswq", 2, 8) => "movswq",
+            ("movzwq", 2, 8) => "movzwq",
+            ("movsbq", 1, 8) => "movsbq",
+            ("movzbq", 1, 8) => "movzbq",
+            _ => return false,
+        };
+        self.replace(next, Inst::new(mnemonic, [Operand::Register(source), Operand::Register(target)]));
+        true
+    }
+
+    // mov %rax, %rcx; mov %rdx, %rax; add %rcx, %rax is add %rdx, %rax,
+    // for an operation whose operands can be swapped
+    fn swap_operands(&mut self, at: usize) -> bool {
+        let Some(second) = self.next(at) else {
+            return false;
+        };
+        let Some(third) = self.next(second) else {
+            return false;
+        };
+        let (Some((kept, held)), Some((other, replaced))) = (self.register_move(at), self.register_move(second)) else {
+            return false;
+        };
+        if replaced != kept || other == held || other == kept || held == kept {
+            return false;
+        }
+        let inst = self.inst(third);
+        if !matches!(inst.name(), "add" | "imul" | "and" | "or" | "xor") {
+            return false;
+        }
+        match inst.operands.as_slice() {
+            [Operand::Register(source), Operand::Register(destination)]
+                if *source == held && *destination == kept => {}
+            _ => return false,
+        }
+        if !self.is_dead(&[third + 1], bit(held)) {
+            return false;
+        }
+        let mut inst = inst.clone();
+        inst.operands[0] = Operand::Register(other);
+        self.replace(third, inst);
+        self.lines[at] = None;
+        self.lines[second] = None;
+        true
+    }
+
+    // setl %al; movzx %al, %rax; cmp $0, %rax; je L is jge L, when the
+    // 0 or 1 isn't needed afterwards
+    fn fuse_compare_and_branch(&mut self, at: usize) -> bool {
+        let set = self.inst(at);
+        let Some(condition) = set.mnemonic.strip_prefix("set").and_then(invertible) else {
+            return false;
+        };
+        let flag = match set.operands.as_slice() {
+            [Operand::Register(flag)] if flag.size == 1 => *flag,
+            _ => return false,
+        };
+        let Some(widen) = self.next(at) else {
+            return false;
+        };
+        let inst = self.inst(widen);
+        match (&*inst.mnemonic, inst.operands.as_slice()) {
+            ("movzx" | "movzbq" | "movzbl", [Operand::Register(source), Operand::Register(value)])
+                if *source == flag && value.number == flag.number && value.size >= 4 => {}
+            _ => return false,
+        }
+        let Some(test) = self.next(widen) else {
+            return false;
+        };
+        let inst = self.inst(test);
+        let tested = match (inst.name(), inst.operands.as_slice()) {
+            ("cmp", [Operand::Immediate(0), Operand::Register(tested)]) => *tested,
+            ("test", [Operand::Register(a), Operand::Register(b)]) if a == b => *a,
+            _ => return false,
+        };
+        let Some(branch) = self.next(test) else {
+            return false;
+        };
+        let (if_set, target) = match flow(self.inst(branch)) {
+            Flow::Branch("ne" | "nz", target) => (true, target.to_string()),
+            Flow::Branch("e" | "z", target) => (false, target.to_string()),
+            _ => return false,
+        };
+        let Some(&destination) = self.labels.get(&target) else {
+            return false;
+        };
+        if tested.number != flag.number
+            || !self.is_dead(&[branch], bit(flag))
+            || !self.is_dead(&[branch + 1, destination], FLAGS)
+        {
+            return false;
+        }
+        let condition = if if_set { condition } else { invert_condition(condition) };
+        self.replace(at, Inst::new(format!("j{}", condition), [Operand::Symbol(target)]));
+        for removed in [widen, test, branch] {
+            self.lines[removed] = None;
+        }
+        true
+    }
+
+    // A jump to the next line, or a branch over a jump
+    fn remove_jump(&mut self, at: usize) -> bool {
+        match flow(self.inst(at)) {
+            Flow::Jump(target) => {
+                let redundant = self.falls_into(at, target);
+                if redundant {
+                    self.lines[at] = None;
+                }
+                redundant
+            }
+            Flow::Branch(condition, target) => {
+                let (Some(condition), Some(next)) = (invertible(condition), self.next(at)) else {
+                    return false;
+                };
+                let Flow::Jump(destination) = flow(self.inst(next)) else {
+                    return false;
+                };
+                if !self.falls_into(next, target) {
+                    return false;
+                }
+                let jump = format!("j{}", invert_condition(condition));
+                let inst = Inst::new(jump, [Operand::Symbol(destination.to_string())]);
+                self.replace(at, inst);
+                self.lines[next] = None;
+                true
+            }
+            _ => false,
+        }
+    }
+
+    // A register written and never read
+    fn remove_dead_definition(&mut self, at: usize) -> bool {
+        let Some(defined) = self.inst(at).defined_register() else {
+            return false;
+        };
+        // The frame registers are read by the epilogue in ways not followed
+        let dead = defined.number != 4 && defined.number != 5 && self.is_dead(&[at + 1], bit(defined));
+        if dead {
+            self.lines[at] = None;
+        }
+        dead
+    }
+
+    // Whether only labels, one of them `label`, come between line `at` and
+    // the next instruction
+    fn falls_into(&self, at: usize, label: &str) -> bool {
+        for line in &self.lines[at + 1..] {
+            match line {
+                None => {}
+                Some(Line::Label(name)) if name == label => return true,
+                Some(Line::Label(_)) => {}
+                _ => return false,
+            }
+        }
+        false
+    }
+
+    // The 64-bit register a push or pop at line `at` takes
+    fn single_register(&self, at: usize, name: &str) -> Option<Register> {
+        let inst = self.inst(at);
+        match inst.operands.as_slice() {
+            [Operand::Register(register)] if inst.name() == name && register.size == 8 && register.number != 4 => {
+                Some(*register)
+            }
+            _ => None,
+        }
+    }
+
+    // The registers of a 64-bit mov between registers at line `at`
+    fn register_move(&self, at: usize) -> Option<(Register, Register)> {
+        let inst = self.inst(at);
+        match inst.operands.as_slice() {
+            [Operand::Register(source), Operand::Register(target)]
+                if inst.name() == "mov" && source.size == 8 && target.size == 8 =>
+            {
+                Some((*source, *target))
+            }
+            _ => None,
+        }
+    }
+
+    // The register and value of a mov of an immediate at line `at`
+    fn immediate_move(&self, at: usize) -> Option<(Register, i64)> {
+        let inst = self.inst(at);
+        match inst.operands.as_slice() {
+            [Operand::Immediate(value), Operand::Register(register)] if inst.name() == "mov" && register.size >= 4 => {
+                Some((*register, extend(*value, register.size, false)))
+            }
+            _ => None,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_expression_code_is_tightened() {
+        // `long x = 5; if (x < 3) x = (long)"small"; return x;` as the AST
+        // generator writes it
+        let lines = [
+            "_f:",
+            "    push %rbp",
+            "    mov %rsp, %rbp",
+            "    sub $16, %rsp",
+            "    lea -8(%rbp), %rax",
+            "    push %rax",
+            "    mov $5, %rax",
+            "    pop %rcx",
+            "    mov %rax, (%rcx)",
+            "    mov -8(%rbp), %rax",
+            "    push %rax",
+            "    mov $3, %rax",
+            "    mov %rax, %rcx",
+            "    pop %rax",
+            "    cmp %rcx, %rax",
+            "    setl %al",
+            "    movzx %al, %rax",
+            "    cmp $0, %rax",
+            "    je .Lelse_f_0",
+            "    lea -8(%rbp), %rax",
+            "    push %rax",
+            "    leaq L.str.0(%rip), %rax",
+            "    pop %rcx",
+            "    mov %rax, (%rcx)",
+            ".Lelse_f_0:",
+            "    mov -8(%rbp), %rax",
+            "    mov %rbp, %rsp",
+            "    pop %rbp",
+            "    ret",
+        ]
+        .map(|line| Line::parse(line).unwrap())
+        .into();
+        let mut output = FunctionOutput { lines, strings: vec!["small".to_string()] };
+        optimize(&mut output);
+
+        let expected = [
+            "_f:",
+            "    push %rbp",
+            "    mov %rsp, %rbp",
+            "    sub $16, %rsp",
+            "    movq $5, -8(%rbp)",
+            "    mov -8(%rbp), %rax",
+            "    cmp $3, %rax",
+            "    jge .Lelse_f_0",
+            "    lea -8(%rbp), %rcx",
+            "    leaq L.str.0(%rip), %rax",
+            "    mov %rax, (%rcx)",
+            ".Lelse_f_0:",
+            "    mov -8(%rbp), %rax",
+            "    mov %rbp, %rsp",
+            "    pop %rbp",
+            "    ret",
+        ];
+        assert_eq!(output.lines.iter().map(Line::to_string).collect::<Vec<_>>(), expected);
+    }
+}
@@ -1,17 +1,25 @@
-use crate::analyzer::SemanticAnalyzer;
-use crate::codegen::CodeGenerator;
-use crate::config::Config;
+use crate::analyzer::{self, SemanticAnalyzer};
+use crate::cache::BuildCache;
+use crate::codegen::{Backend, CodeGenerator, OutputFormat};
+use crate::config::{Config, OptimizationConfig};
+use crate::optimizer::Optimizer;
 use crate::parser::lexer::Lexer;
 use crate::parser::Parser;
+use crate::pch::PrecompiledHeader;
 use crate::preprocessor::{NativePreprocessor, Preprocessor};
+use crate::report::{measure, ReportFormat, TimeReport};
 use crate::transforms::obfuscation::{
     ControlFlowObfuscator, DeadCodeInserter, StringEncryptor, VariableObfuscator,
 };
-use crate::transforms::Transform;
+use crate::transforms::{PassManager, Transform};
+use std::fmt::{self, Write as _};
 use std::fs;
+use std::io::{BufWriter, Write};
 use std::path::{Path, PathBuf};
+use std::sync::Arc;
 
 /// Main compiler struct that orchestrates the compilation process
+#[derive(Clone)]
 pub struct Compiler {
     source_file: String,
     output_file: String,
@@ -26,19 +34,38 @@ pub struct Compiler {
     defines: std::collections::HashMap<String, String>,
     /// Whether to only preprocess the source file
     preprocess_only: bool,
+    /// Whether to keep the preprocessed source in `<source>.i`
+    save_temps: bool,
+    /// Threads for code generation, defaulting to one per core
+    threads: Option<usize>,
+    /// Whether to write a precompiled header of the source file instead of
+    /// compiling it
+    emit_pch: bool,
+    /// Precompiled header to start from, shared by the files of a batch
+    pch: Option<Arc<PrecompiledHeader>>,
+    /// Cache of earlier output for incremental rebuilds
+    cache: Option<Arc<BuildCache>>,
+    /// How to print per-phase statistics, if at all
+    time_report: Option<ReportFormat>,
+    /// What code generation writes to the output file
+    output_format: OutputFormat,
+    /// Whether to generate code with LLVM instead of the x86-64 backend
+    llvm_backend: bool,
+    /// Functions that only get obfuscations which cost nothing at run time
+    hot_functions: Vec<String>,
+    /// How much obfuscation may grow a function, as a fraction of its size
+    obfuscation_budget: Option<f32>,
 }
 
 /// Optimization levels for the compiler
-/// 
-/// Note: The optimizer has been removed from the codebase.
-/// This enum is kept for backward compatibility but has no effect.
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 pub enum OptimizationLevel {
     /// No optimizations
     None,
-    /// Basic optimizations like constant folding (deprecated)
+    /// Constant folding, common subexpression and dead code elimination on
+    /// the SSA IR, with values kept in registers
     Basic,
-    /// Full optimizations including dead code elimination and function inlining (deprecated)
+    /// Also inline small leaf functions and hoist loop invariants
     Full,
 }
 
@@ -69,6 +96,29 @@ pub enum LanguageDialect {
     CPlusPlus,
 }
 
+/// What a compilation prints, collected while it runs so that whoever ran
+/// it can print it, or send it to a client of the server
+#[derive(Debug, Default, Clone)]
+pub struct Messages {
+    pub stdout: String,
+    pub stderr: String,
+}
+
+impl Messages {
+    fn progress(&mut self, line: impl fmt::Display) {
+        let _ = writeln!(self.stdout, "{}", line);
+    }
+
+    fn warn(&mut self, line: impl fmt::Display) {
+        let _ = writeln!(self.stderr, "{}", line);
+    }
+
+    pub fn print(&self) {
+        print!("{}", self.stdout);
+        eprint!("{}", self.stderr);
+    }
+}
+
 impl Compiler {
     /// Create a new compiler instance with default settings
     pub fn new(source_file: String, output_file: String) -> Self {
@@ -83,6 +133,25 @@ impl Compiler {
             include_paths: Vec::new(),
             defines: std::collections::HashMap::new(),
             preprocess_only: false,
+            save_temps: false,
+            threads: None,
+            emit_pch: false,
+            pch: None,
+            cache: None,
+            time_report: None,
+            output_format: OutputFormat::Assembly,
+            llvm_backend: false,
+            hot_functions: Vec::new(),
+            obfuscation_budget: None,
+        }
+    }
+
+    /// A compiler with the same settings for another source file
+    pub fn for_file(&self, source_file: &str, output_file: &str) -> Self {
+        Compiler {
+            source_file: source_file.to_string(),
+            output_file: output_file.to_string(),
+            ..self.clone()
         }
     }
 
@@ -147,19 +216,98 @@ impl Compiler {
         self
     }
 
+    /// Set whether to keep the preprocessed source in `<source>.i`
+    pub fn save_temps(mut self, save_temps: bool) -> Self {
+        self.save_temps = save_temps;
+        self
+    }
+
+    /// Set the number of threads used for code generation
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        self.threads = Some(threads);
+        self
+    }
+
+    /// Set whether to write a precompiled header instead of compiling
+    pub fn emit_pch(mut self, emit_pch: bool) -> Self {
+        self.emit_pch = emit_pch;
+        self
+    }
+
+    /// Start from a precompiled header written by `emit_pch`
+    pub fn with_pch<P: AsRef<Path>>(mut self, path: P) -> Result<Self, String> {
+        self.pch = Some(Arc::new(PrecompiledHeader::read(path.as_ref())?));
+        Ok(self)
+    }
+
+    /// Start from a precompiled header that's already been read
+    pub fn with_loaded_pch(mut self, pch: Arc<PrecompiledHeader>) -> Self {
+        self.pch = Some(pch);
+        self
+    }
+
+    /// Keep compiled output in `dir` and reuse it when the same code is
+    /// compiled again
+    pub fn with_cache_dir<P: AsRef<Path>>(mut self, dir: P) -> Result<Self, String> {
+        self.cache = Some(Arc::new(BuildCache::open(dir)?));
+        Ok(self)
+    }
+
+    /// Use a build cache that's already open
+    pub fn with_cache(mut self, cache: Arc<BuildCache>) -> Self {
+        self.cache = Some(cache);
+        self
+    }
+
+    /// Print each phase's time and allocations to stderr
+    pub fn with_time_report(mut self, format: ReportFormat) -> Self {
+        self.time_report = Some(format);
+        self
+    }
+
+    /// Write `format` to the output file; LLVM IR needs the LLVM backend
+    pub fn emit(mut self, format: OutputFormat) -> Self {
+        self.output_format = format;
+        self
+    }
+
+    /// Generate code with LLVM, which runs its own passes at the
+    /// optimization level and can emit LLVM IR and object files
+    pub fn with_llvm_backend(mut self, enabled: bool) -> Self {
+        self.llvm_backend = enabled;
+        self
+    }
+
+    /// Keep obfuscations that slow code down out of these functions, on
+    /// top of those marked `#pragma rustcc hot`
+    pub fn with_hot_functions(mut self, names: Vec<String>) -> Self {
+        self.hot_functions.extend(names);
+        self
+    }
+
+    /// Stop obfuscating a function once it has grown by `budget` times its
+    /// size
+    pub fn with_obfuscation_budget(mut self, budget: f32) -> Self {
+        self.obfuscation_budget = Some(budget);
+        self
+    }
+
     /// Compiles the source file to the output file
     pub fn compile(&self) -> Result<(), String> {
-        if self.verbose {
-            println!("Compiling {} to {}", self.source_file, self.output_file);
-        }
-        
-        // Sanitize and validate file paths
-        let source_path = self.sanitize_path(&self.source_file)?;
-        let output_path = self.sanitize_path(&self.output_file)?;
-        
-        // Create preprocessor
+        self.compile_with(self.preprocessor())
+    }
+
+    /// Creates the preprocessor for this compiler's include paths and
+    /// defines. It doesn't depend on the source file, so one can be set up
+    /// once and cloned for every file of a batch.
+    pub fn preprocessor(&self) -> NativePreprocessor {
         let mut preprocessor = NativePreprocessor::new();
         
+        // Start from the macros of the precompiled header
+        if let Some(pch) = &self.pch {
+            pch.apply_to_preprocessor(&mut preprocessor);
+        }
+        
         // Add include paths
         for path in &self.include_paths {
             preprocessor.add_include_dir(path.to_str().unwrap_or(""));
@@ -186,150 +334,316 @@ impl Compiler {
         for (name, value) in &self.defines {
             preprocessor.add_define(name, value);
         }
-        
-        // Preprocess the source file
+
+        preprocessor
+    }
+
+    /// Compiles the source file to the output file using `preprocessor`,
+    /// as returned by `preprocessor()`
+    pub fn compile_with(&self, preprocessor: NativePreprocessor) -> Result<(), String> {
+        let mut messages = Messages::default();
+        let result = self.compile_reporting(preprocessor, &mut messages);
+        messages.print();
+        result
+    }
+
+    /// Like `compile_with`, but appends its progress, warnings and time
+    /// report to `messages` instead of printing them
+    pub fn compile_reporting(&self, preprocessor: NativePreprocessor, messages: &mut Messages) -> Result<(), String> {
+        let Some(format) = self.time_report else {
+            return self.compile_phases(preprocessor, &mut None, messages);
+        };
+        let mut time_report = Some(TimeReport::new(&self.source_file));
+        let result = self.compile_phases(preprocessor, &mut time_report, messages);
+        if let Some(time_report) = time_report {
+            messages.stderr.push_str(&time_report.format(format));
+        }
+        result
+    }
+
+    /// The phases of `compile_with`, recorded in `report` if there is one
+    fn compile_phases(
+        &self,
+        mut preprocessor: NativePreprocessor,
+        report: &mut Option<TimeReport>,
+        messages: &mut Messages,
+    ) -> Result<(), String> {
         if self.verbose {
-            println!("Preprocessing source file...");
+            messages.progress(format_args!("Compiling {} to {}", self.source_file, self.output_file));
         }
         
-        let preprocessed_content = preprocessor.preprocess_file(source_path.to_str().unwrap_or(""))?;
+        // Sanitize and validate file paths
+        let source_path = self.sanitize_path(&self.source_file)?;
+        let output_path = self.sanitize_path(&self.output_file)?;
         
-        // Create a temporary file for the preprocessed content
-        let preprocessed_path = PathBuf::from(format!("{}.i", self.source_file));
-        fs::write(&preprocessed_path, &preprocessed_content)
-            .map_err(|e| format!("Failed to write preprocessed file: {}", e))?;
+        // Preprocess the source file
+        if self.verbose {
+            messages.progress("Preprocessing source file...");
+        }
         
-        // If preprocess_only is true, just copy the preprocessed file to the output path and return
+        // If preprocess_only is true, the preprocessed source is streamed
+        // to the output file as it is produced
         if self.preprocess_only {
             if self.verbose {
-                println!("Preprocessing only, copying to output file...");
+                messages.progress("Preprocessing only, writing output file...");
             }
             
-            // Copy the preprocessed file to the output path
-            fs::copy(&preprocessed_path, &output_path)
-                .map_err(|e| format!("Failed to copy preprocessed file to output: {}", e))?;
-            return Ok(());
+            let result = measure(report, "preprocess", || {
+                let file = fs::File::create(&output_path)
+                    .map_err(|e| format!("Failed to write preprocessed file: {}", e))?;
+                let mut out = BufWriter::new(file);
+                preprocessor.preprocess_file_into(source_path.to_str().unwrap_or(""), &mut out)?;
+                out.flush().map_err(|e| format!("Failed to write preprocessed file: {}", e))
+            });
+            preprocessor.take_warnings().iter().for_each(|warning| messages.warn(warning));
+            return result;
+        }
+        
+        // Otherwise it is collected in one buffer for the lexer
+        let source = measure(report, "preprocess", || {
+            preprocessor.preprocess_file(source_path.to_str().unwrap_or(""))
+        });
+        // Warnings before an error are reported along with it
+        preprocessor.take_warnings().iter().for_each(|warning| messages.warn(warning));
+        let mut source = source?;
+
+        // Keep the preprocessed source next to the source file if asked to
+        if self.save_temps {
+            fs::write(format!("{}.i", self.source_file), &source)
+                .map_err(|e| format!("Failed to write preprocessed file: {}", e))?;
         }
         
-        // Read the preprocessed file
-        let mut source = fs::read_to_string(&preprocessed_path)
-            .map_err(|e| format!("Failed to read preprocessed file: {}", e))?;
         // Ensure the source ends with a newline
         if !source.ends_with("\n") {
             source.push('\n');
         }
+        if let Some(report) = report {
+            report.preprocessed_bytes = source.len();
+        }
             
         if self.verbose {
-            println!("Preprocessing completed. Processed source:\n{}", source);
+            messages.progress(format_args!("Preprocessing completed: {} bytes", source.len()));
+        }
+
+        let obf_level = if let Some(config) = &self.config {
+            config.get_obfuscation_level()
+        } else {
+            self.obfuscation_level
+        };
+        let (opt_level, opt_config) = if let Some(config) = &self.config {
+            (config.get_optimization_level(), config.optimization.clone())
+        } else {
+            (self.optimization_level, OptimizationConfig::default())
+        };
+        let mut obf_config = self.config.as_ref().map(|config| config.obfuscation.clone()).unwrap_or_default();
+        obf_config.hot_functions.extend(self.hot_functions.iter().cloned());
+        obf_config.max_size_overhead = self.obfuscation_budget.or(obf_config.max_size_overhead);
+
+        // A unit compiled before with the same source and options is taken
+        // from the cache. Obfuscation is random, so its output isn't cached.
+        let cache = self.cache.as_ref().filter(|_| obf_level == ObfuscationLevel::None && !self.emit_pch);
+        let unit_key = cache.map(|cache| {
+            let options = format!(
+                "{:?} {:?} {:?} llvm={}",
+                opt_level, opt_config, self.output_format, self.llvm_backend
+            );
+            let pch = self.pch.as_ref().map(|pch| pch.fingerprint()).unwrap_or_default();
+            cache.key(&["unit", &source, &options, &pch])
+        });
+        if let (Some(cache), Some(key)) = (cache, &unit_key) {
+            if let Some(output) = cache.get(key) {
+                if self.verbose {
+                    messages.progress("Reusing cached output");
+                }
+                if let Some(report) = report {
+                    report.cached = true;
+                    report.output_bytes = output.len();
+                }
+                return Self::write_output(&output_path, &output);
+            }
         }
 
         // Lexical analysis
-        let mut lexer = Lexer::new(source);
-        let tokens = lexer.scan_tokens();
+        let tokens = measure(report, "lex", || Lexer::new(&source).scan_tokens());
+        if let Some(report) = report {
+            report.tokens = tokens.len();
+        }
 
         if self.verbose {
-            println!("Lexical analysis completed: {} tokens", tokens.len());
+            messages.progress(format_args!("Lexical analysis completed: {} tokens", tokens.len()));
         }
 
         // Parsing
-        let mut parser = Parser::new(tokens.clone());
-        let mut ast = match parser.parse() {
+        // Names the header declared with typedef are types in this source too
+        let type_names = self.pch.as_ref().map(|pch| pch.type_names()).unwrap_or_default();
+        let mut parser = Parser::new(tokens).with_type_names(type_names).with_source(source);
+        if let Some(threads) = self.threads {
+            parser = parser.with_threads(threads);
+        }
+        let mut ast = match measure(report, "parse", || parser.parse_recovering()) {
             Ok(ast) => ast,
-            Err(err) => return Err(format!("Parsing error: {}", err)),
+            Err(errors) => {
+                let errors: Vec<_> = errors.iter().map(|err| format!("Parsing error: {}", err)).collect();
+                return Err(errors.join("\n"));
+            }
         };
 
         if self.verbose {
-            println!("Parsing completed");
+            messages.progress("Parsing completed");
+        }
+
+        // A precompiled header is written right after parsing
+        if self.emit_pch {
+            return PrecompiledHeader::new(&source_path, &preprocessor, &ast)?.write(&output_path);
+        }
+        if let Some(pch) = &self.pch {
+            pch.add_declarations(&mut ast);
+        }
+        if let Some(report) = report {
+            report.ast_nodes = ast.node_count();
         }
 
         // Semantic analysis
-        let mut analyzer = SemanticAnalyzer::new();
-        analyzer.analyze(&ast)?;
+        let mut analysis = measure(report, "analyze", || SemanticAnalyzer::new().analyze(&mut ast))?;
 
         if self.verbose {
-            println!("Semantic analysis completed");
+            messages.progress("Semantic analysis completed");
         }
         
-        // Note: Optimizer code has been removed from the codebase.
-        // The optimization_level setting is ignored.
-
         // Apply obfuscations based on the obfuscation level
-        let obf_level = if let Some(config) = &self.config {
-            config.get_obfuscation_level()
-        } else {
-            self.obfuscation_level
-        };
-
+        let control_flow = ControlFlowObfuscator::new(&obf_config.opaque_predicate_complexity);
+        let dead_code = DeadCodeInserter::new(obf_config.dead_code_insertion_ratio);
+        let mut transforms: Vec<&dyn Transform> = Vec::new();
         match obf_level {
             ObfuscationLevel::None => {
                 if self.verbose {
-                    println!("No obfuscations applied");
+                    messages.progress("No obfuscations applied");
                 }
             }
-            ObfuscationLevel::Basic => {
+            ObfuscationLevel::Basic | ObfuscationLevel::Aggressive => {
                 if self.verbose {
-                    println!("Applying basic obfuscations");
+                    let level = if obf_level == ObfuscationLevel::Basic { "basic" } else { "aggressive" };
+                    messages.progress(format_args!("Applying {} obfuscations", level));
                 }
-                // Apply variable renaming
-                let variable_obfuscator = VariableObfuscator;
-                variable_obfuscator.apply(&mut ast)?;
-
-                // Apply string encryption
-                let string_encryptor = StringEncryptor;
-                string_encryptor.apply(&mut ast)?;
-            }
-            ObfuscationLevel::Aggressive => {
-                if self.verbose {
-                    println!("Applying aggressive obfuscations");
+                // Variable renaming and string encryption
+                transforms.push(&VariableObfuscator);
+                if obf_config.string_encryption {
+                    transforms.push(&StringEncryptor);
+                }
+                // Aggressive also adds control flow flattening and dead
+                // code insertion
+                if obf_level == ObfuscationLevel::Aggressive {
+                    if obf_config.control_flow_flattening {
+                        transforms.push(&control_flow);
+                    }
+                    transforms.push(&dead_code);
                 }
-                // Apply variable renaming
-                let variable_obfuscator = VariableObfuscator;
-                variable_obfuscator.apply(&mut ast)?;
-
-                // Apply string encryption
-                let string_encryptor = StringEncryptor;
-                string_encryptor.apply(&mut ast)?;
-
-                // Apply control flow flattening
-                let control_flow_obfuscator = ControlFlowObfuscator;
-                control_flow_obfuscator.apply(&mut ast)?;
-
-                // Apply dead code insertion
-                let _dead_code_ratio = if let Some(config) = &self.config {
-                    config.obfuscation.dead_code_insertion_ratio
-                } else {
-                    0.2 // Default ratio
-                };
-                let dead_code_inserter = DeadCodeInserter;
-                dead_code_inserter.apply(&mut ast)?;
             }
         }
+        // One visit per function runs every transform, in parallel across
+        // functions
+        if !transforms.is_empty() {
+            let mut passes = PassManager::new(transforms)
+                .with_hot_functions(obf_config.hot_functions.iter().map(String::as_str));
+            if let Some(threads) = self.threads {
+                passes = passes.with_threads(threads);
+            }
+            if let Some(budget) = obf_config.max_size_overhead {
+                passes = passes.with_size_budget(budget);
+            }
+            let costs = passes.run(&mut ast)?;
+            if let Some(report) = report {
+                report.phases.extend(costs);
+            }
+            // Code generation reads the annotations of the transformed tree.
+            // The transforms only ever introduce names they also declare.
+            (analysis, _) = analyzer::annotate(&mut ast);
+        }
 
         if self.verbose {
-            println!("Code generation started");
+            messages.progress("Code generation started");
         }
 
-        // Code generation
-        let mut generator = CodeGenerator::new();
-        let output = generator.generate(&ast);
-
-        // Create parent directories if they don't exist
-        if let Some(parent) = Path::new(&output_path).parent() {
-            fs::create_dir_all(parent)
-                .map_err(|e| format!("Failed to create output directory: {}", e))?;
+        // Optimize the functions the IR can represent
+        let backend = if self.llvm_backend { Backend::llvm() } else { Backend::X86_64 };
+        let mut generator = CodeGenerator::with_backend(backend)
+            .with_format(self.output_format)
+            .with_optimization(opt_level);
+        if let Some(threads) = self.threads {
+            generator = generator.with_threads(threads);
+        }
+        if let Some(cache) = cache {
+            generator = generator.with_cache(Arc::clone(cache));
+        }
+        if opt_level != OptimizationLevel::None {
+            let module = measure(report, "optimize", || Optimizer::new(opt_level, opt_config).run(&ast, &analysis));
+            if self.verbose {
+                messages.progress(format_args!(
+                    "Optimized {} of {} functions",
+                    module.functions.len(),
+                    ast.functions.iter().filter(|function| !function.body.is_empty()).count()
+                ));
+            }
+            generator = generator.with_ir(module);
         }
 
-        // Write the output to the file
-        fs::write(&output_path, output)
-            .map_err(|e| format!("Failed to write output file: {}", e))?;
+        // Code generation, streamed to the output file unless it's also
+        // going into the cache
+        if let (Some(cache), Some(key)) = (cache, &unit_key) {
+            let mut output = Vec::new();
+            measure(report, "codegen", || generator.generate_into(&ast, &analysis, &mut output))?;
+            cache.put(key, &output);
+            if let Some(report) = report {
+                report.output_bytes = output.len();
+            }
+            measure(report, "write", || Self::write_output(&output_path, &output))?;
+        } else {
+            measure(report, "codegen", || {
+                Self::stream_output(&output_path, |out| generator.generate_into(&ast, &analysis, out))
+            })?;
+            if let Some(report) = report {
+                report.output_bytes = fs::metadata(&output_path).map_or(0, |metadata| metadata.len() as usize);
+            }
+        }
 
         if self.verbose {
-            println!("Compilation completed successfully");
+            messages.progress("Compilation completed successfully");
         }
 
         Ok(())
     }
 
+    /// Writes the compiled output, creating its directory if needed
+    fn write_output(output_path: &Path, output: &[u8]) -> Result<(), String> {
+        Self::create_output_dir(output_path)?;
+
+        // Write the output to the file
+        fs::write(output_path, output)
+            .map_err(|e| format!("Failed to write output file: {}", e))
+    }
+
+    /// Writes the output to the file as `write` produces it
+    fn stream_output(
+        output_path: &Path,
+        write: impl FnOnce(&mut dyn Write) -> Result<(), String>,
+    ) -> Result<(), String> {
+        Self::create_output_dir(output_path)?;
+        let file = fs::File::create(output_path)
+            .map_err(|e| format!("Failed to write output file: {}", e))?;
+        let mut out = BufWriter::new(file);
+        write(&mut out)?;
+        out.flush().map_err(|e| format!("Failed to write output file: {}", e))
+    }
+
+    /// Creates the output file's directory if it doesn't exist
+    fn create_output_dir(output_path: &Path) -> Result<(), String> {
+        match output_path.parent() {
+            Some(parent) => fs::create_dir_all(parent)
+                .map_err(|e| format!("Failed to create output directory: {}", e)),
+            None => Ok(()),
+        }
+    }
+
     /// Sanitize and validate a file path
     fn sanitize_path(&self, path: &str) -> Result<PathBuf, String> {
         // Convert to PathBuf to handle platform-specific path separators
@@ -411,6 +725,121 @@ mod tests {
         );
     }
 
+    #[test]
+    fn test_preprocessed_source_kept_only_with_save_temps() {
+        let mut source_file = NamedTempFile::new().unwrap();
+        write!(source_file, "int main() {{ return 0; }}").unwrap();
+        let source = source_file.path().to_string_lossy().to_string();
+        let temp = format!("{}.i", source);
+        let output_file = NamedTempFile::new().unwrap();
+        let output = output_file.path().to_string_lossy().to_string();
+
+        Compiler::new(source.clone(), output.clone()).compile().unwrap();
+        assert!(!Path::new(&temp).exists());
+
+        Compiler::new(source, output).save_temps(true).compile().unwrap();
+        assert!(fs::read_to_string(&temp).unwrap().contains("int main()"));
+        fs::remove_file(temp).unwrap();
+    }
+
+    #[test]
+    fn test_cache_reuses_unchanged_functions() {
+        let dir = tempfile::TempDir::new().unwrap();
+        let source = dir.path().join("test.c");
+        let output = dir.path().join("test.s");
+        let cache = dir.path().join("cache");
+        let compile = |code: &str| {
+            fs::write(&source, code).unwrap();
+            let compiler = Compiler::new(source.to_string_lossy().to_string(), output.to_string_lossy().to_string());
+            compiler.clone().compile().unwrap();
+            let uncached = fs::read_to_string(&output).unwrap();
+            compiler.with_cache_dir(&cache).unwrap().compile().unwrap();
+            assert_eq!(fs::read_to_string(&output).unwrap(), uncached);
+            fs::read_dir(&cache).unwrap().count()
+        };
+
+        // The unit and each of its functions
+        let entries = compile("int f() { return 1; }\nint main() { if (f()) { return 2; } return 3; }\n");
+        assert_eq!(entries, 3);
+        assert_eq!(compile("int f() { return 1; }\nint main() { if (f()) { return 2; } return 3; }\n"), 3);
+        // An edit adds the new unit and the changed function only
+        assert_eq!(compile("int f() { return 4; }\nint main() { if (f()) { return 2; } return 3; }\n"), 5);
+    }
+
+    #[test]
+    fn test_messages_are_collected_instead_of_printed() {
+        let dir = tempfile::TempDir::new().unwrap();
+        let source = dir.path().join("test.c");
+        fs::write(&source, "#warning check the limits\nint main() { return 0; }\n").unwrap();
+        let compiler = Compiler::new(
+            source.to_string_lossy().to_string(),
+            dir.path().join("test.s").to_string_lossy().to_string(),
+        )
+        .with_verbose(true);
+
+        let mut messages = Messages::default();
+        compiler.compile_reporting(compiler.preprocessor(), &mut messages).unwrap();
+        assert_eq!(messages.stderr, "Warning: check the limits\n");
+        assert!(messages.stdout.starts_with("Compiling "));
+        assert!(messages.stdout.ends_with("Compilation completed successfully\n"));
+
+        // Warnings before an error are kept with it
+        fs::write(&source, "#warning first\n#error stop\n").unwrap();
+        let mut messages = Messages::default();
+        assert!(compiler.compile_reporting(compiler.preprocessor(), &mut messages).is_err());
+        assert_eq!(messages.stderr, "Warning: first\n");
+    }
+
+    #[test]
+    fn test_time_report_records_each_phase() {
+        let dir = tempfile::TempDir::new().unwrap();
+        let source = dir.path().join("test.c");
+        fs::write(&source, "int main() { int x = 2; return x * 3; }\n").unwrap();
+        let compiler = Compiler::new(
+            source.to_string_lossy().to_string(),
+            dir.path().join("test.s").to_string_lossy().to_string(),
+        )
+        .with_optimization(OptimizationLevel::Basic)
+        .with_obfuscation(ObfuscationLevel::Basic);
+
+        let mut report = Some(TimeReport::new(&compiler.source_file));
+        compiler.compile_phases(compiler.preprocessor(), &mut report, &mut Messages::default()).unwrap();
+        let report = report.unwrap();
+        let phases: Vec<&str> = report.phases.iter().map(|phase| phase.name.as_str()).collect();
+        assert_eq!(
+            phases,
+            ["preprocess", "lex", "parse", "analyze", "Variable Obfuscator", "String Encryptor", "optimize", "codegen"]
+        );
+        assert!(report.tokens > 0 && report.ast_nodes > 0 && report.output_bytes > 0);
+
+        let json: serde_json::Value = serde_json::from_str(&report.format(ReportFormat::Json)).unwrap();
+        assert_eq!(json["phases"].as_array().unwrap().len(), phases.len());
+    }
+
+    #[test]
+    fn test_x86_64_backend_emits_objects_but_not_llvm_ir() {
+        let dir = tempfile::TempDir::new().unwrap();
+        let source = dir.path().join("test.c");
+        let output = dir.path().join("test.ll");
+        fs::write(&source, "int main() { int x = 2; return x * 3; }\n").unwrap();
+        let compiler = Compiler::new(source.to_string_lossy().to_string(), output.to_string_lossy().to_string())
+            .emit(OutputFormat::LlvmIr);
+
+        assert!(compiler.clone().compile().unwrap_err().contains("can't emit LLVM IR"));
+        let object = dir.path().join("test.o");
+        let objects = compiler.for_file(&source.to_string_lossy(), &object.to_string_lossy());
+        objects.emit(OutputFormat::Object).compile().unwrap();
+        let magic = fs::read(&object).unwrap()[..4].to_vec();
+        assert!(magic == b"\x7fELF" || magic == 0xfeedfacf_u32.to_le_bytes(), "{:?}", magic);
+        let result = compiler.with_llvm_backend(true).compile();
+        if cfg!(feature = "llvm-backend") {
+            result.unwrap();
+            assert!(fs::read_to_string(&output).unwrap().contains("define i32 @main()"));
+        } else {
+            assert!(result.unwrap_err().contains("llvm-backend"));
+        }
+    }
+
     #[test]
     fn test_compiler_with_variables() {
         // Test a program with variables and arithmetic
@@ -26,16 +26,13 @@ pub struct Config {
 }
 
 /// Configuration for optimization
-/// 
-/// Note: The optimizer has been removed from the codebase.
-/// This configuration is kept for backward compatibility but has no effect.
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub struct OptimizationConfig {
     /// Optimization level
     #[serde(default = "default_optimization_level")]
     pub level: String,
 
-    /// Threshold for function inlining (number of statements)
+    /// Largest callee inlined at the full level, in IR instructions
     #[serde(default = "default_inline_threshold")]
     pub inline_threshold: usize,
 
@@ -71,9 +68,19 @@ pub struct ObfuscationConfig {
     #[serde(default = "default_dead_code_ratio")]
     pub dead_code_insertion_ratio: f32,
 
-    /// Complexity of opaque predicates
+    /// Complexity of opaque predicates: low, medium or high
     #[serde(default = "default_opaque_predicate_complexity")]
     pub opaque_predicate_complexity: String,
+
+    /// How much a function may grow, as a fraction of its size, before
+    /// obfuscation stops adding to it; unlimited if unset
+    #[serde(default)]
+    pub max_size_overhead: Option<f32>,
+
+    /// Functions on hot paths, say from a profile, which only get
+    /// transforms that cost nothing at run time (as `#pragma rustcc hot`)
+    #[serde(default)]
+    pub hot_functions: Vec<String>,
 }
 
 /// Configuration for output
@@ -172,6 +179,8 @@ impl Default for ObfuscationConfig {
             control_flow_flattening: default_true(),
             dead_code_insertion_ratio: default_dead_code_ratio(),
             opaque_predicate_complexity: default_opaque_predicate_complexity(),
+            max_size_overhead: None,
+            hot_functions: Vec::new(),
         }
     }
 }
@@ -0,0 +1,127 @@
+// driver.rs
+// Batch compilation of several translation units in one process
+//
+// All files of a batch share one compiler configuration and one prepared
+// preprocessor (predefined macros, platform and user include paths), which
+// each job clones instead of setting up again. Jobs are compiled on a fixed
+// set of threads that take the next file from a shared counter, so threads
+// finishing small files move straight on to the remaining ones.
+
+use crate::compiler::{Compiler, Messages};
+use crate::preprocessor::NativePreprocessor;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+
+/// A source file and the file its output is written to
+#[derive(Debug, Clone)]
+pub struct Job {
+    pub source_file: String,
+    pub output_file: String,
+}
+
+/// Compiles every job with the settings of `compiler` on up to `threads`
+/// threads, returning each job's result in the order of `jobs`
+pub fn compile_all(compiler: &Compiler, jobs: &[Job], threads: usize) -> Vec<Result<(), String>> {
+    compile_all_reporting(compiler, &compiler.preprocessor(), jobs, threads)
+        .into_iter()
+        .map(|(result, messages)| {
+            messages.print();
+            result
+        })
+        .collect()
+}
+
+/// Like `compile_all`, but starting each job from a clone of
+/// `preprocessor` and returning what it would have printed along with its
+/// result
+pub fn compile_all_reporting(
+    compiler: &Compiler,
+    preprocessor: &NativePreprocessor,
+    jobs: &[Job],
+    threads: usize,
+) -> Vec<(Result<(), String>, Messages)> {
+    let threads = threads.clamp(1, jobs.len().max(1));
+    // Cores not taken by whole files are left to code generation
+    let cores = thread::available_parallelism().map_or(1, |cores| cores.get());
+    let compiler = compiler.clone().with_threads((cores / threads).max(1));
+    let next = AtomicUsize::new(0);
+
+    let mut results: Vec<(usize, (Result<(), String>, Messages))> = thread::scope(|scope| {
+        let workers: Vec<_> = (0..threads)
+            .map(|_| {
+                scope.spawn(|| {
+                    let mut results = Vec::new();
+                    loop {
+                        let index = next.fetch_add(1, Ordering::Relaxed);
+                        let Some(job) = jobs.get(index) else {
+                            break;
+                        };
+                        let compiler = compiler.for_file(&job.source_file, &job.output_file);
+                        // A crash while compiling one file fails that file only
+                        let mut messages = Messages::default();
+                        let result = panic::catch_unwind(AssertUnwindSafe(|| {
+                            compiler.compile_reporting(preprocessor.clone(), &mut messages)
+                        }))
+                        .unwrap_or_else(|_| Err("Internal compiler error".to_string()));
+                        results.push((index, (result, messages)));
+                    }
+                    results
+                })
+            })
+            .collect();
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().expect("compilation thread panicked"))
+            .collect()
+    });
+    results.sort_by_key(|&(index, _)| index);
+    results.into_iter().map(|(_, result)| result).collect()
+}
+
+/// The outcome of a batch: the error of each file that failed, as printed
+/// for it, and the batch's own error if any file failed
+pub fn batch_errors(jobs: &[Job], results: &[Result<(), String>]) -> (Vec<String>, Result<(), String>) {
+    let errors: Vec<String> = jobs
+        .iter()
+        .zip(results)
+        .filter_map(|(job, result)| result.as_ref().err().map(|e| format!("{}: {}", job.source_file, e)))
+        .collect();
+    let result = if errors.is_empty() {
+        Ok(())
+    } else {
+        Err(format!("{} of {} files failed to compile", errors.len(), results.len()))
+    };
+    (errors, result)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::fs;
+    use tempfile::TempDir;
+
+    #[test]
+    fn test_batch_reports_errors_per_file() {
+        let dir = TempDir::new().unwrap();
+        let sources = ["int main() { return 1; }", "int main() { return }", "int f() { return 3; } int main() { return f(); }"];
+        let jobs: Vec<Job> = sources
+            .iter()
+            .enumerate()
+            .map(|(i, source)| {
+                let source_file = dir.path().join(format!("{}.c", i));
+                fs::write(&source_file, source).unwrap();
+                Job {
+                    source_file: source_file.to_string_lossy().to_string(),
+                    output_file: dir.path().join(format!("{}.s", i)).to_string_lossy().to_string(),
+                }
+            })
+            .collect();
+
+        let compiler = Compiler::new(String::new(), String::new());
+        let results = compile_all(&compiler, &jobs, 2);
+        assert!(results[0].is_ok() && results[2].is_ok());
+        assert!(results[1].as_ref().unwrap_err().starts_with("Parsing error"));
+        assert!(fs::read_to_string(&jobs[2].output_file).unwrap().contains("_f:"));
+    }
+}
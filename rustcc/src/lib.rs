@@ -1,9 +1,16 @@
 pub mod analyzer;
+pub mod cache;
 pub mod codegen;
 pub mod compiler;
 pub mod config;
+pub mod driver;
+pub mod optimizer;
+pub mod options;
 pub mod parser;
+pub mod pch;
 pub mod preprocessor;
+pub mod report;
+pub mod server;
 pub mod transforms;
 
 // Re-export key components
@@ -0,0 +1,88 @@
+// cse.rs
+// Common subexpression elimination
+//
+// Walks the dominator tree keeping a table of the pure computations
+// available at each point. An instruction that repeats one computed in a
+// dominating block is replaced by the earlier value. Loads, calls and
+// phis are never merged.
+
+use super::dom::Dominators;
+use super::ir::{BinOp, BlockId, Function, Inst, UnOp, Value};
+use std::collections::HashMap;
+
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+enum Key {
+    Const(i64),
+    Binary(BinOp, Value, Value),
+    Unary(UnOp, Value),
+    Extend(Value, u8, bool),
+}
+
+enum Step {
+    Enter(BlockId),
+    // Leaving a subtree: forget the computations it made available
+    Exit(Vec<Key>),
+}
+
+pub fn eliminate_common_subexpressions(function: &mut Function) -> bool {
+    let children = Dominators::compute(function).children();
+    let mut available: HashMap<Key, Value> = HashMap::new();
+    let mut replace: HashMap<Value, Value> = HashMap::new();
+
+    let mut stack = vec![Step::Enter(BlockId::ENTRY)];
+    while let Some(step) = stack.pop() {
+        match step {
+            Step::Enter(block) => {
+                let mut added = Vec::new();
+                for &value in &function[block].insts {
+                    let Some(key) = key(function, value, &replace) else {
+                        continue;
+                    };
+                    match available.get(&key) {
+                        Some(&existing) => {
+                            replace.insert(value, existing);
+                        }
+                        None => {
+                            available.insert(key.clone(), value);
+                            added.push(key);
+                        }
+                    }
+                }
+                stack.push(Step::Exit(added));
+                stack.extend(children[block.index()].iter().map(|&child| Step::Enter(child)));
+            }
+            Step::Exit(keys) => {
+                for key in keys {
+                    available.remove(&key);
+                }
+            }
+        }
+    }
+
+    if replace.is_empty() {
+        return false;
+    }
+    for block in &mut function.blocks {
+        block.insts.retain(|value| !replace.contains_key(value));
+    }
+    function.replace_uses(&replace);
+    true
+}
+
+fn key(function: &Function, value: Value, replace: &HashMap<Value, Value>) -> Option<Key> {
+    // Operands may have been merged already
+    let resolve = |value: Value| replace.get(&value).copied().unwrap_or(value);
+    Some(match &function[value] {
+        Inst::Const(c) => Key::Const(*c),
+        Inst::Binary { op, left, right } => {
+            let (mut left, mut right) = (resolve(*left), resolve(*right));
+            if op.is_commutative() && right < left {
+                std::mem::swap(&mut left, &mut right);
+            }
+            Key::Binary(*op, left, right)
+        }
+        Inst::Unary { op, operand } => Key::Unary(*op, resolve(*operand)),
+        Inst::Extend { value, width, signed } => Key::Extend(resolve(*value), *width, *signed),
+        _ => return None,
+    })
+}
@@ -0,0 +1,41 @@
+// dce.rs
+// Dead code elimination
+//
+// Mark and sweep: instructions with side effects and the operands of
+// terminators are live, and so is everything they use. Whatever is left,
+// including cycles of phis that only feed each other, is removed.
+
+use super::ir::{Function, Value};
+
+pub fn eliminate_dead_code(function: &mut Function) -> bool {
+    let mut live = vec![false; function.insts.len()];
+    let mut worklist: Vec<Value> = Vec::new();
+
+    for block in &function.blocks {
+        for &value in &block.insts {
+            if function[value].has_side_effects() {
+                worklist.push(value);
+            }
+        }
+        worklist.extend(block.terminator.operand());
+    }
+
+    while let Some(value) = worklist.pop() {
+        if std::mem::replace(&mut live[value.index()], true) {
+            continue;
+        }
+        function[value].for_each_operand(|operand| {
+            if !live[operand.index()] {
+                worklist.push(operand);
+            }
+        });
+    }
+
+    let mut changed = false;
+    for block in &mut function.blocks {
+        let before = block.insts.len();
+        block.insts.retain(|value| live[value.index()]);
+        changed |= block.insts.len() != before;
+    }
+    changed
+}
@@ -0,0 +1,100 @@
+// dom.rs
+// Dominator tree of a function's control flow graph
+
+use super::ir::{BlockId, Function};
+
+/// Immediate dominators, computed with the iterative algorithm of Cooper,
+/// Harvey and Kennedy over the reverse postorder.
+pub struct Dominators {
+    idom: Vec<Option<BlockId>>,
+    // Position of each reachable block in the reverse postorder
+    order: Vec<Option<usize>>,
+}
+
+impl Dominators {
+    pub fn compute(function: &Function) -> Self {
+        let rpo = function.reverse_postorder();
+        let preds = function.predecessors();
+        let mut order = vec![None; function.blocks.len()];
+        for (position, block) in rpo.iter().enumerate() {
+            order[block.index()] = Some(position);
+        }
+
+        let mut idom = vec![None; function.blocks.len()];
+        idom[BlockId::ENTRY.index()] = Some(BlockId::ENTRY);
+
+        let mut changed = true;
+        while changed {
+            changed = false;
+            for &block in rpo.iter().skip(1) {
+                let mut new_idom = None;
+                for &pred in &preds[block.index()] {
+                    if idom[pred.index()].is_none() {
+                        continue; // Not processed yet, or unreachable
+                    }
+                    new_idom = Some(match new_idom {
+                        None => pred,
+                        Some(current) => intersect(&idom, &order, pred, current),
+                    });
+                }
+                if new_idom.is_some() && idom[block.index()] != new_idom {
+                    idom[block.index()] = new_idom;
+                    changed = true;
+                }
+            }
+        }
+
+        Dominators { idom, order }
+    }
+
+    /// The immediate dominator of `block`; None for the entry and for
+    /// unreachable blocks
+    pub fn idom(&self, block: BlockId) -> Option<BlockId> {
+        match self.idom[block.index()] {
+            Some(idom) if block != BlockId::ENTRY => Some(idom),
+            _ => None,
+        }
+    }
+
+    /// Whether every path from the entry to `block` passes through `dominator`
+    pub fn dominates(&self, dominator: BlockId, block: BlockId) -> bool {
+        if self.order[block.index()].is_none() {
+            return false;
+        }
+        let mut current = block;
+        loop {
+            if current == dominator {
+                return true;
+            }
+            match self.idom(current) {
+                Some(parent) => current = parent,
+                None => return false,
+            }
+        }
+    }
+
+    /// Children of every block in the dominator tree
+    pub fn children(&self) -> Vec<Vec<BlockId>> {
+        let mut children = vec![Vec::new(); self.idom.len()];
+        for index in 0..self.idom.len() {
+            let block = BlockId::from_index(index);
+            if let Some(parent) = self.idom(block) {
+                children[parent.index()].push(block);
+            }
+        }
+        children
+    }
+}
+
+fn intersect(idom: &[Option<BlockId>], order: &[Option<usize>], mut a: BlockId, mut b: BlockId) -> BlockId {
+    let position = |block: BlockId| order[block.index()].expect("block is reachable");
+    while a != b {
+        while position(a) > position(b) {
+            a = idom[a.index()].expect("processed block has a dominator");
+        }
+        while position(b) > position(a) {
+            b = idom[b.index()].expect("processed block has a dominator");
+        }
+    }
+    a
+}
@@ -0,0 +1,128 @@
+// fold.rs
+// Constant folding and propagation
+//
+// In SSA form propagation comes for free: every use of a folded value sees
+// the constant instruction directly. Each sweep folds instructions whose
+// operands are constants, applies algebraic identities, removes phis that
+// only ever see one value, and turns branches on constants into jumps; the
+// pass repeats until a sweep changes nothing.
+
+use super::ir::{self, BinOp, Function, Inst, Terminator, Value};
+use std::collections::HashMap;
+
+enum Folded {
+    Const(i64),
+    Value(Value),
+}
+
+pub fn fold_constants(function: &mut Function) -> bool {
+    let mut changed = false;
+    loop {
+        let mut progress = false;
+        let mut replace = HashMap::new();
+
+        for b in 0..function.blocks.len() {
+            for i in 0..function.blocks[b].insts.len() {
+                let value = function.blocks[b].insts[i];
+                match simplify(function, value) {
+                    Some(Folded::Const(c)) => {
+                        function[value] = Inst::Const(c);
+                        progress = true;
+                    }
+                    Some(Folded::Value(other)) => {
+                        replace.insert(value, other);
+                        progress = true;
+                    }
+                    None => {}
+                }
+            }
+        }
+
+        for block in &mut function.blocks {
+            block.insts.retain(|value| !replace.contains_key(value));
+        }
+        function.replace_uses(&replace);
+        // A phi folded to a constant may now sit among the remaining phis
+        let insts = &function.insts;
+        for block in &mut function.blocks {
+            block.insts.sort_by_key(|&value| !matches!(insts[value.index()], Inst::Phi(_)));
+        }
+
+        for id in function.block_ids().collect::<Vec<_>>() {
+            let Terminator::Branch { condition, then_block, else_block } = function[id].terminator else {
+                continue;
+            };
+            let Some(c) = function.constant(condition) else {
+                continue;
+            };
+            let (taken, dropped) = if c != 0 { (then_block, else_block) } else { (else_block, then_block) };
+            function[id].terminator = Terminator::Jump(taken);
+            if dropped != taken {
+                function.remove_phi_operands(dropped, id);
+            }
+            progress = true;
+        }
+
+        if !progress {
+            return changed;
+        }
+        changed = true;
+    }
+}
+
+fn simplify(function: &Function, value: Value) -> Option<Folded> {
+    match &function[value] {
+        Inst::Binary { op, left, right } => {
+            let (op, left, right) = (*op, *left, *right);
+            let (l, r) = (function.constant(left), function.constant(right));
+            if let (Some(l), Some(r)) = (l, r) {
+                return op.eval(l, r).map(Folded::Const);
+            }
+            match (op, l, r) {
+                (BinOp::Add | BinOp::Sub | BinOp::Or | BinOp::Xor, _, Some(0))
+                | (BinOp::Mul | BinOp::Div, _, Some(1)) => Some(Folded::Value(left)),
+                (BinOp::Add | BinOp::Or | BinOp::Xor, Some(0), _) | (BinOp::Mul, Some(1), _) => {
+                    Some(Folded::Value(right))
+                }
+                (BinOp::Mul | BinOp::And, _, Some(0)) | (BinOp::Mul | BinOp::And, Some(0), _) => {
+                    Some(Folded::Const(0))
+                }
+                _ if left == right => match op {
+                    BinOp::Sub | BinOp::Xor | BinOp::Ne | BinOp::Lt | BinOp::Gt => Some(Folded::Const(0)),
+                    BinOp::Eq | BinOp::Le | BinOp::Ge => Some(Folded::Const(1)),
+                    BinOp::And | BinOp::Or => Some(Folded::Value(left)),
+                    _ => None,
+                },
+                _ => None,
+            }
+        }
+        Inst::Unary { op, operand } => function.constant(*operand).map(|c| Folded::Const(op.eval(c))),
+        Inst::Extend { value: inner, width, signed } => {
+            if let Some(c) = function.constant(*inner) {
+                return Some(Folded::Const(ir::extend(c, *width, *signed)));
+            }
+            match &function[*inner] {
+                // Already in range
+                Inst::Extend { width: inner_width, signed: inner_signed, .. }
+                    if inner_width == width && inner_signed == signed =>
+                {
+                    Some(Folded::Value(*inner))
+                }
+                // 0 and 1 survive any extension
+                Inst::Binary { op, .. } if op.is_comparison() => Some(Folded::Value(*inner)),
+                Inst::Unary { op: ir::UnOp::LogicalNot, .. } => Some(Folded::Value(*inner)),
+                _ => None,
+            }
+        }
+        Inst::Phi(entries) => {
+            let mut operands = entries.iter().map(|&(_, operand)| operand).filter(|&operand| operand != value);
+            let first = operands.next()?;
+            if operands.clone().all(|operand| operand == first) {
+                return Some(Folded::Value(first));
+            }
+            let c = function.constant(first)?;
+            operands.all(|operand| function.constant(operand) == Some(c)).then_some(Folded::Const(c))
+        }
+        _ => None,
+    }
+}
@@ -0,0 +1,135 @@
+// inline.rs
+// Function inlining
+//
+// Calls to small leaf functions (ones that make no calls themselves) are
+// replaced by a copy of the callee's body. Restricting inlining to leaves
+// keeps it from ever recursing, and those are the calls whose overhead
+// matters most relative to the work they do.
+
+use super::ir::{BlockId, Function, Inst, Module, Terminator, Value};
+use crate::parser::symbol::Symbol;
+use std::collections::HashMap;
+
+/// Inlines calls to leaf functions of at most `threshold` instructions
+pub fn inline_leaf_calls(module: &mut Module, threshold: usize) -> bool {
+    let candidates: HashMap<Symbol, Function> = module
+        .functions
+        .iter()
+        .filter(|function| function.inst_count() <= threshold && !makes_calls(function))
+        .map(|function| (function.name, function.clone()))
+        .collect();
+    if candidates.is_empty() {
+        return false;
+    }
+
+    let mut changed = false;
+    for function in &mut module.functions {
+        changed |= inline_calls(function, &candidates);
+    }
+    changed
+}
+
+fn makes_calls(function: &Function) -> bool {
+    function
+        .blocks
+        .iter()
+        .flat_map(|block| &block.insts)
+        .any(|&value| matches!(function[value], Inst::Call { .. }))
+}
+
+fn inline_calls(function: &mut Function, candidates: &HashMap<Symbol, Function>) -> bool {
+    let mut changed = false;
+    // Blocks appended while inlining are scanned too: continuations hold
+    // the rest of the block a call was found in
+    let mut b = 0;
+    while b < function.blocks.len() {
+        let block = BlockId::from_index(b);
+        let found = function[block].insts.iter().enumerate().find_map(|(position, &value)| match &function[value] {
+            Inst::Call { callee, args } => candidates
+                .get(callee)
+                .filter(|callee| callee.params == args.len())
+                .map(|callee| (position, value, callee, args.clone())),
+            _ => None,
+        });
+        match found {
+            Some((position, call, callee, args)) => {
+                inline_call(function, block, position, call, callee, &args);
+                changed = true;
+            }
+            None => b += 1,
+        }
+    }
+    changed
+}
+
+/// Replaces the call at `position` of `block` by the body of `callee`
+fn inline_call(function: &mut Function, block: BlockId, position: usize, call: Value, callee: &Function, args: &[Value]) {
+    // Everything after the call moves to a continuation block
+    let continuation = function.add_block();
+    let rest = function[block].insts.split_off(position + 1);
+    function[block].insts.pop();
+    let terminator = std::mem::replace(&mut function[block].terminator, Terminator::Jump(continuation));
+    for succ in terminator.successors() {
+        function.rename_phi_pred(succ, block, continuation);
+    }
+    function[continuation].insts = rest;
+    function[continuation].terminator = terminator;
+
+    // Copy the callee, first creating every value so operands can refer
+    // to values defined later (phis in loops), then renaming operands
+    let blocks: Vec<BlockId> = callee.blocks.iter().map(|_| function.add_block()).collect();
+    let mut values: HashMap<Value, Value> = HashMap::new();
+    let mut copied = Vec::new();
+    for id in callee.block_ids() {
+        for &value in &callee[id].insts {
+            let copy = match callee[value] {
+                Inst::Param(index) => args[index],
+                ref inst => {
+                    let copy = function.push(blocks[id.index()], inst.clone());
+                    copied.push(copy);
+                    copy
+                }
+            };
+            values.insert(value, copy);
+        }
+    }
+    for &copy in &copied {
+        let inst = &mut function[copy];
+        inst.for_each_operand_mut(|operand| *operand = values[&*operand]);
+        if let Inst::Phi(entries) = inst {
+            for (pred, _) in entries.iter_mut() {
+                *pred = blocks[pred.index()];
+            }
+        }
+    }
+
+    let mut returns = Vec::new();
+    for id in callee.block_ids() {
+        let copy = blocks[id.index()];
+        let mut terminator = callee[id].terminator.clone();
+        terminator.for_each_successor_mut(|succ| *succ = blocks[succ.index()]);
+        if let Some(operand) = terminator.operand_mut() {
+            *operand = values[&*operand];
+        }
+        if let Terminator::Return(value) = terminator {
+            // Falling off the end of a function leaves its result undefined
+            let value = value.unwrap_or_else(|| function.push(copy, Inst::Const(0)));
+            returns.push((copy, value));
+            terminator = Terminator::Jump(continuation);
+        }
+        function[copy].terminator = terminator;
+    }
+    function[block].terminator = Terminator::Jump(blocks[BlockId::ENTRY.index()]);
+
+    let result = match returns.as_slice() {
+        [(_, value)] => *value,
+        // The callee never returns, so the continuation is unreachable
+        [] => function.push(block, Inst::Const(0)),
+        _ => {
+            let phi = function.create(Inst::Phi(returns));
+            function[continuation].insts.insert(0, phi);
+            phi
+        }
+    };
+    function.replace_uses(&HashMap::from([(call, result)]));
+}
@@ -0,0 +1,501 @@
+// ir.rs
+// SSA intermediate representation used by the optimizer
+//
+// A function is a control flow graph of basic blocks. Every instruction
+// defines exactly one value and lives in the function's `insts` table,
+// indexed by that value; blocks list the instructions they execute, in
+// order. All values are 64-bit integers: C values narrower than that are
+// kept sign- or zero-extended, the way the x86-64 backend keeps them in
+// %rax, and `Inst::Extend` models a store to a narrow variable.
+
+use crate::parser::symbol::Symbol;
+use std::collections::HashMap;
+use std::fmt;
+use std::ops::{Index, IndexMut};
+
+/// An SSA value, named after the instruction that defines it
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct Value(u32);
+
+/// Handle to a basic block of a [`Function`]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct BlockId(u32);
+
+impl Value {
+    pub fn index(self) -> usize {
+        self.0 as usize
+    }
+}
+
+impl BlockId {
+    /// The block execution starts in. It never has predecessors.
+    pub const ENTRY: BlockId = BlockId(0);
+
+    pub fn from_index(index: usize) -> Self {
+        BlockId(index as u32)
+    }
+
+    pub fn index(self) -> usize {
+        self.0 as usize
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum BinOp {
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod,
+    And,
+    Or,
+    Xor,
+    Shl,
+    Shr,
+    Eq,
+    Ne,
+    Lt,
+    Le,
+    Gt,
+    Ge,
+}
+
+impl BinOp {
+    pub fn is_commutative(self) -> bool {
+        matches!(
+            self,
+            BinOp::Add | BinOp::Mul | BinOp::And | BinOp::Or | BinOp::Xor | BinOp::Eq | BinOp::Ne
+        )
+    }
+
+    pub fn is_comparison(self) -> bool {
+        matches!(
+            self,
+            BinOp::Eq | BinOp::Ne | BinOp::Lt | BinOp::Le | BinOp::Gt | BinOp::Ge
+        )
+    }
+
+    /// Computes the operation exactly as the generated code does, or
+    /// returns None where the machine instruction would trap. Shifts work on
+    /// the low 32 bits and zero-extend their result, like `shl %cl, %eax`.
+    pub fn eval(self, left: i64, right: i64) -> Option<i64> {
+        Some(match self {
+            BinOp::Add => left.wrapping_add(right),
+            BinOp::Sub => left.wrapping_sub(right),
+            BinOp::Mul => left.wrapping_mul(right),
+            BinOp::Div => left.checked_div(right)?,
+            BinOp::Mod => left.checked_rem(right)?,
+            BinOp::And => left & right,
+            BinOp::Or => left | right,
+            BinOp::Xor => left ^ right,
+            BinOp::Shl => ((left as u32) << (right & 31)) as i64,
+            BinOp::Shr => ((left as i32) >> (right & 31)) as u32 as i64,
+            BinOp::Eq => (left == right) as i64,
+            BinOp::Ne => (left != right) as i64,
+            BinOp::Lt => (left < right) as i64,
+            BinOp::Le => (left <= right) as i64,
+            BinOp::Gt => (left > right) as i64,
+            BinOp::Ge => (left >= right) as i64,
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum UnOp {
+    Neg,
+    /// Bitwise complement
+    Not,
+    LogicalNot,
+}
+
+impl UnOp {
+    pub fn eval(self, operand: i64) -> i64 {
+        match self {
+            UnOp::Neg => operand.wrapping_neg(),
+            UnOp::Not => !operand,
+            UnOp::LogicalNot => (operand == 0) as i64,
+        }
+    }
+}
+
+/// Truncates `value` to `width` bytes and extends it back to 64 bits
+pub fn extend(value: i64, width: u8, signed: bool) -> i64 {
+    match (width, signed) {
+        (1, true) => value as i8 as i64,
+        (1, false) => value as u8 as i64,
+        (2, true) => value as i16 as i64,
+        (2, false) => value as u16 as i64,
+        (4, true) => value as i32 as i64,
+        (4, false) => value as u32 as i64,
+        _ => value,
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Inst {
+    Const(i64),
+    /// The function's `n`th argument
+    Param(usize),
+    /// Truncation to a narrow type followed by extension to 64 bits
+    Extend { value: Value, width: u8, signed: bool },
+    Binary { op: BinOp, left: Value, right: Value },
+    Unary { op: UnOp, operand: Value },
+    /// The operand of the predecessor control arrived from. Phis always
+    /// come first in their block.
+    Phi(Vec<(BlockId, Value)>),
+    Call { callee: Symbol, args: Vec<Value> },
+    /// Address of a string literal
+    String(String),
+    /// The `width` bytes stored at a global variable, extended to 64 bits
+    LoadGlobal { name: Symbol, width: u8, signed: bool },
+    /// Stores the low `width` bytes of `value` to a global variable
+    StoreGlobal { name: Symbol, value: Value, width: u8 },
+    /// The `width` bytes stored at an address, extended to 64 bits
+    Load { address: Value, width: u8, signed: bool },
+    Store { address: Value, value: Value, width: u8 },
+}
+
+impl Inst {
+    /// Calls `f` with each operand, in evaluation order
+    pub fn for_each_operand(&self, mut f: impl FnMut(Value)) {
+        match self {
+            Inst::Const(_) | Inst::Param(_) | Inst::String(_) | Inst::LoadGlobal { .. } => {}
+            Inst::Extend { value, .. } | Inst::StoreGlobal { value, .. } => f(*value),
+            Inst::Unary { operand, .. } | Inst::Load { address: operand, .. } => f(*operand),
+            Inst::Binary { left, right, .. } => {
+                f(*left);
+                f(*right);
+            }
+            Inst::Store { address, value, .. } => {
+                f(*address);
+                f(*value);
+            }
+            Inst::Phi(entries) => entries.iter().for_each(|&(_, value)| f(value)),
+            Inst::Call { args, .. } => args.iter().copied().for_each(f),
+        }
+    }
+
+    pub fn for_each_operand_mut(&mut self, mut f: impl FnMut(&mut Value)) {
+        match self {
+            Inst::Const(_) | Inst::Param(_) | Inst::String(_) | Inst::LoadGlobal { .. } => {}
+            Inst::Extend { value, .. } | Inst::StoreGlobal { value, .. } => f(value),
+            Inst::Unary { operand, .. } | Inst::Load { address: operand, .. } => f(operand),
+            Inst::Binary { left, right, .. } => {
+                f(left);
+                f(right);
+            }
+            Inst::Store { address, value, .. } => {
+                f(address);
+                f(value);
+            }
+            Inst::Phi(entries) => entries.iter_mut().for_each(|(_, value)| f(value)),
+            Inst::Call { args, .. } => args.iter_mut().for_each(f),
+        }
+    }
+
+    /// Whether executing the instruction matters beyond the value it defines
+    pub fn has_side_effects(&self) -> bool {
+        matches!(self, Inst::Call { .. } | Inst::StoreGlobal { .. } | Inst::Store { .. })
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub enum Terminator {
+    Jump(BlockId),
+    Branch {
+        condition: Value,
+        then_block: BlockId,
+        else_block: BlockId,
+    },
+    Return(Option<Value>),
+}
+
+impl Terminator {
+    pub fn successors(&self) -> Vec<BlockId> {
+        match self {
+            Terminator::Jump(target) => vec![*target],
+            Terminator::Branch { then_block, else_block, .. } => vec![*then_block, *else_block],
+            Terminator::Return(_) => Vec::new(),
+        }
+    }
+
+    pub fn for_each_successor_mut(&mut self, mut f: impl FnMut(&mut BlockId)) {
+        match self {
+            Terminator::Jump(target) => f(target),
+            Terminator::Branch { then_block, else_block, .. } => {
+                f(then_block);
+                f(else_block);
+            }
+            Terminator::Return(_) => {}
+        }
+    }
+
+    pub fn operand(&self) -> Option<Value> {
+        match self {
+            Terminator::Branch { condition, .. } => Some(*condition),
+            Terminator::Return(value) => *value,
+            Terminator::Jump(_) => None,
+        }
+    }
+
+    pub fn operand_mut(&mut self) -> Option<&mut Value> {
+        match self {
+            Terminator::Branch { condition, .. } => Some(condition),
+            Terminator::Return(value) => value.as_mut(),
+            Terminator::Jump(_) => None,
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+pub struct Block {
+    pub insts: Vec<Value>,
+    pub terminator: Terminator,
+}
+
+#[derive(Debug, Clone)]
+pub struct Function {
+    pub name: Symbol,
+    pub params: usize,
+    /// Every instruction ever created, indexed by the value it defines.
+    /// Only those listed by a block are part of the program.
+    pub insts: Vec<Inst>,
+    pub blocks: Vec<Block>,
+}
+
+impl Function {
+    /// Creates a function with an empty entry block
+    pub fn new(name: Symbol, params: usize) -> Self {
+        let mut function = Function {
+            name,
+            params,
+            insts: Vec::new(),
+            blocks: Vec::new(),
+        };
+        function.add_block();
+        function
+    }
+
+    pub fn add_block(&mut self) -> BlockId {
+        let id = BlockId(self.blocks.len() as u32);
+        self.blocks.push(Block {
+            insts: Vec::new(),
+            terminator: Terminator::Return(None),
+        });
+        id
+    }
+
+    /// Creates an instruction without placing it in a block
+    pub fn create(&mut self, inst: Inst) -> Value {
+        let value = Value(u32::try_from(self.insts.len()).expect("too many IR instructions"));
+        self.insts.push(inst);
+        value
+    }
+
+    /// Appends an instruction to `block`
+    pub fn push(&mut self, block: BlockId, inst: Inst) -> Value {
+        let value = self.create(inst);
+        self.blocks[block.index()].insts.push(value);
+        value
+    }
+
+    /// The constant `value` is known to hold, if any
+    pub fn constant(&self, value: Value) -> Option<i64> {
+        match self[value] {
+            Inst::Const(c) => Some(c),
+            _ => None,
+        }
+    }
+
+    /// Number of instructions placed in blocks
+    pub fn inst_count(&self) -> usize {
+        self.blocks.iter().map(|block| block.insts.len()).sum()
+    }
+
+    pub fn block_ids(&self) -> impl DoubleEndedIterator<Item = BlockId> {
+        (0..self.blocks.len() as u32).map(BlockId)
+    }
+
+    /// Predecessors of every block. A block appears once per edge.
+    pub fn predecessors(&self) -> Vec<Vec<BlockId>> {
+        let mut preds = vec![Vec::new(); self.blocks.len()];
+        for id in self.block_ids() {
+            for succ in self[id].terminator.successors() {
+                preds[succ.index()].push(id);
+            }
+        }
+        preds
+    }
+
+    /// Blocks reachable from the entry, in reverse postorder
+    pub fn reverse_postorder(&self) -> Vec<BlockId> {
+        let mut visited = vec![false; self.blocks.len()];
+        let mut order = Vec::with_capacity(self.blocks.len());
+        // Explicit stack of (block, next successor to visit)
+        let mut stack = vec![(BlockId::ENTRY, 0)];
+        visited[0] = true;
+        while let Some((block, next)) = stack.last_mut() {
+            let succs = self[*block].terminator.successors();
+            if let Some(&succ) = succs.get(*next) {
+                *next += 1;
+                if !visited[succ.index()] {
+                    visited[succ.index()] = true;
+                    stack.push((succ, 0));
+                }
+            } else {
+                order.push(*block);
+                stack.pop();
+            }
+        }
+        order.reverse();
+        order
+    }
+
+    /// Drops the operand for the edge from `pred` from the phis of `block`,
+    /// after that edge was removed
+    pub fn remove_phi_operands(&mut self, block: BlockId, pred: BlockId) {
+        for &value in &self.blocks[block.index()].insts {
+            if let Inst::Phi(entries) = &mut self.insts[value.index()] {
+                if let Some(position) = entries.iter().position(|&(from, _)| from == pred) {
+                    entries.remove(position);
+                }
+            }
+        }
+    }
+
+    /// Makes the phis of `block` take the operand for the edge from `from`
+    /// from `to` instead, after that edge was moved
+    pub fn rename_phi_pred(&mut self, block: BlockId, from: BlockId, to: BlockId) {
+        for &value in &self.blocks[block.index()].insts {
+            if let Inst::Phi(entries) = &mut self.insts[value.index()] {
+                for (pred, _) in entries.iter_mut() {
+                    if *pred == from {
+                        *pred = to;
+                    }
+                }
+            }
+        }
+    }
+
+    /// Rewrites every use of a key of `map` to its value, following chains
+    pub fn replace_uses(&mut self, map: &HashMap<Value, Value>) {
+        if map.is_empty() {
+            return;
+        }
+        let resolve = |mut value: Value| {
+            while let Some(&next) = map.get(&value) {
+                value = next;
+            }
+            value
+        };
+        for block in &mut self.blocks {
+            for &value in &block.insts {
+                self.insts[value.index()].for_each_operand_mut(|operand| *operand = resolve(*operand));
+            }
+            if let Some(operand) = block.terminator.operand_mut() {
+                *operand = resolve(*operand);
+            }
+        }
+    }
+
+    /// Drops unreachable blocks and renumbers the rest in reverse postorder,
+    /// so that every block comes after its dominators
+    pub fn compact(&mut self) {
+        let order = self.reverse_postorder();
+        let mut renumber = vec![None; self.blocks.len()];
+        for (new, old) in order.iter().enumerate() {
+            renumber[old.index()] = Some(BlockId(new as u32));
+        }
+
+        let mut old_blocks: Vec<Option<Block>> = std::mem::take(&mut self.blocks).into_iter().map(Some).collect();
+        for old in &order {
+            let mut block = old_blocks[old.index()].take().expect("block visited twice");
+            block
+                .terminator
+                .for_each_successor_mut(|succ| *succ = renumber[succ.index()].expect("successor is reachable"));
+            for &value in &block.insts {
+                if let Inst::Phi(entries) = &mut self.insts[value.index()] {
+                    entries.retain_mut(|(pred, _)| match renumber[pred.index()] {
+                        Some(new) => {
+                            *pred = new;
+                            true
+                        }
+                        None => false,
+                    });
+                }
+            }
+            self.blocks.push(block);
+        }
+    }
+}
+
+impl Index<Value> for Function {
+    type Output = Inst;
+
+    fn index(&self, value: Value) -> &Inst {
+        &self.insts[value.index()]
+    }
+}
+
+impl IndexMut<Value> for Function {
+    fn index_mut(&mut self, value: Value) -> &mut Inst {
+        &mut self.insts[value.index()]
+    }
+}
+
+impl Index<BlockId> for Function {
+    type Output = Block;
+
+    fn index(&self, block: BlockId) -> &Block {
+        &self.blocks[block.index()]
+    }
+}
+
+impl IndexMut<BlockId> for Function {
+    fn index_mut(&mut self, block: BlockId) -> &mut Block {
+        &mut self.blocks[block.index()]
+    }
+}
+
+/// The optimized functions of a program. Functions the IR can't represent
+/// are absent and get compiled from the AST instead.
+#[derive(Debug, Clone, Default)]
+pub struct Module {
+    pub functions: Vec<Function>,
+}
+
+impl fmt::Display for Value {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "v{}", self.0)
+    }
+}
+
+impl fmt::Display for BlockId {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(f, "b{}", self.0)
+    }
+}
+
+impl fmt::Display for Function {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        writeln!(f, "function {}({}):", self.name, self.params)?;
+        for id in self.block_ids() {
+            writeln!(f, "{}:", id)?;
+            for &value in &self[id].insts {
+                write!(f, "    {} = ", value)?;
+                match &self[value] {
+                    Inst::Phi(entries) => {
+                        write!(f, "phi")?;
+                        for (pred, operand) in entries {
+                            write!(f, " [{}: {}]", pred, operand)?;
+                        }
+                        writeln!(f)?;
+                    }
+                    inst => writeln!(f, "{:?}", inst)?,
+                }
+            }
+            writeln!(f, "    {:?}", self[id].terminator)?;
+        }
+        Ok(())
+    }
+}
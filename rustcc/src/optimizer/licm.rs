@@ -0,0 +1,168 @@
+// licm.rs
+// Loop invariant code motion
+//
+// Finds natural loops from the back edges of the dominator tree, gives each
+// loop header a preheader (a block that is the header's only predecessor
+// from outside the loop), and moves computations whose operands are all
+// defined outside the loop into it. Loops are handled innermost first, so
+// code hoisted into an inner preheader can keep moving outward.
+
+use super::dom::Dominators;
+use super::ir::{BinOp, BlockId, Function, Inst, Terminator};
+
+pub(super) struct Loop {
+    pub(super) header: BlockId,
+    // Indexed by block
+    pub(super) body: Vec<bool>,
+    size: usize,
+}
+
+pub fn hoist_loop_invariants(function: &mut Function) -> bool {
+    let loops = find_loops(function);
+    if loops.is_empty() {
+        return false;
+    }
+    let inserted = insert_preheaders(function, &loops);
+    let mut loops = if inserted { find_loops(function) } else { loops };
+    loops.sort_by_key(|l| l.size);
+
+    let preds = function.predecessors();
+    let order = function.reverse_postorder();
+    let mut def_block = vec![None; function.insts.len()];
+    for id in function.block_ids() {
+        for &value in &function[id].insts {
+            def_block[value.index()] = Some(id);
+        }
+    }
+
+    let mut changed = inserted;
+    for l in &loops {
+        let preheader = preds[l.header.index()]
+            .iter()
+            .copied()
+            .find(|pred| !l.body[pred.index()])
+            .expect("loop has a preheader");
+        // Definitions dominate their uses and come first in reverse
+        // postorder, so one pass moves whole chains of invariants
+        for &block in order.iter().filter(|block| l.body[block.index()]) {
+            let mut i = 0;
+            while i < function[block].insts.len() {
+                let value = function[block].insts[i];
+                let inst = &function[value];
+                let mut invariant = is_speculatable(function, inst);
+                inst.for_each_operand(|operand| {
+                    invariant &= def_block[operand.index()].is_some_and(|def| !l.body[def.index()]);
+                });
+                if invariant {
+                    function[block].insts.remove(i);
+                    function[preheader].insts.push(value);
+                    def_block[value.index()] = Some(preheader);
+                    changed = true;
+                } else {
+                    i += 1;
+                }
+            }
+        }
+    }
+    changed
+}
+
+/// Whether `inst` can run where it didn't before: it's pure and can't trap
+fn is_speculatable(function: &Function, inst: &Inst) -> bool {
+    match inst {
+        Inst::Const(_) | Inst::String(_) | Inst::Unary { .. } | Inst::Extend { .. } => true,
+        Inst::Binary { op: BinOp::Div | BinOp::Mod, right, .. } => {
+            matches!(function.constant(*right), Some(c) if c != 0 && c != -1)
+        }
+        Inst::Binary { .. } => true,
+        // Loads may see stores made in the loop
+        _ => false,
+    }
+}
+
+/// Natural loops, one per header; back edges to the same header share it
+pub(super) fn find_loops(function: &Function) -> Vec<Loop> {
+    let dominators = Dominators::compute(function);
+    let preds = function.predecessors();
+    let mut loops: Vec<Loop> = Vec::new();
+
+    for block in function.reverse_postorder() {
+        for header in function[block].terminator.successors() {
+            if !dominators.dominates(header, block) {
+                continue;
+            }
+            let index = match loops.iter().position(|l| l.header == header) {
+                Some(index) => index,
+                None => {
+                    let mut body = vec![false; function.blocks.len()];
+                    body[header.index()] = true;
+                    loops.push(Loop { header, body, size: 1 });
+                    loops.len() - 1
+                }
+            };
+            let l = &mut loops[index];
+            let mut worklist = vec![block];
+            while let Some(member) = worklist.pop() {
+                if std::mem::replace(&mut l.body[member.index()], true) {
+                    continue;
+                }
+                l.size += 1;
+                worklist.extend(
+                    preds[member.index()]
+                        .iter()
+                        .copied()
+                        .filter(|&pred| dominators.dominates(header, pred)),
+                );
+            }
+        }
+    }
+    loops
+}
+
+/// Gives every loop header without one a preheader. The header's phis
+/// take a single operand from it, merged there by a new phi when several
+/// edges from outside the loop used to enter the header.
+fn insert_preheaders(function: &mut Function, loops: &[Loop]) -> bool {
+    let preds = function.predecessors();
+    let mut changed = false;
+
+    for l in loops {
+        let header = l.header;
+        let outside: Vec<BlockId> = preds[header.index()]
+            .iter()
+            .copied()
+            .filter(|pred| !l.body[pred.index()])
+            .collect();
+        if let [pred] = outside.as_slice() {
+            if matches!(function[*pred].terminator, Terminator::Jump(_)) {
+                continue;
+            }
+        }
+
+        let preheader = function.add_block();
+        function[preheader].terminator = Terminator::Jump(header);
+        for &pred in &outside {
+            function[pred].terminator.for_each_successor_mut(|succ| {
+                if *succ == header {
+                    *succ = preheader;
+                }
+            });
+        }
+
+        for value in function[header].insts.clone() {
+            let Inst::Phi(entries) = &mut function[value] else {
+                break;
+            };
+            let (entering, mut kept): (Vec<_>, Vec<_>) =
+                std::mem::take(entries).into_iter().partition(|(pred, _)| !l.body[pred.index()]);
+            let incoming = match entering.as_slice() {
+                [(_, operand)] => *operand,
+                _ => function.push(preheader, Inst::Phi(entering)),
+            };
+            kept.push((preheader, incoming));
+            function[value] = Inst::Phi(kept);
+        }
+        changed = true;
+    }
+    changed
+}
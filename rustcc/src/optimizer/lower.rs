@@ -0,0 +1,605 @@
+// lower.rs
+// Translation of function bodies from the AST into SSA form
+//
+// SSA is built while walking the AST, following Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form". Each block
+// records the current value of the locals assigned in it; a read looks the
+// value up through the predecessors and creates a phi where control flow
+// joins. Blocks whose predecessors aren't all known yet (loop headers and
+// exits) stay unsealed, and their phis get operands once they're sealed.
+//
+// Names are looked up in the bindings semantic analysis recorded, and
+// memory is read and written at the width of the type it holds.
+
+use super::ir::{BinOp, BlockId, Function, Inst, Terminator, UnOp, Value};
+use crate::analyzer::symbols::{Access, Binding, Symbols};
+use crate::parser::ast::{self, AstArena, BinaryOp, ExprId, Expression, OperatorType, Statement, StmtId, Type, UnaryOp};
+use std::collections::HashMap;
+
+/// Arguments past the sixth are passed on the stack, which the IR doesn't model
+const MAX_PARAMS: usize = 6;
+
+/// A local variable, one per declaration
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct Var(u32);
+
+/// How values of a scalar type are kept in 64 bits
+#[derive(Debug, Clone, Copy)]
+struct Scalar {
+    width: u8,
+    signed: bool,
+}
+
+/// Lowers `function`, whose names resolved to `symbols`, or explains which
+/// construct the IR can't represent
+pub fn lower_function(function: &ast::Function, symbols: &Symbols) -> Result<Function, String> {
+    if function.parameters.len() > MAX_PARAMS {
+        return Err(format!("more than {} parameters", MAX_PARAMS));
+    }
+
+    let mut lowering = Lowering {
+        arena: &function.arena,
+        symbols,
+        function: Function::new(function.name, function.parameters.len()),
+        current: BlockId::ENTRY,
+        preds: vec![Vec::new()],
+        sealed: vec![true],
+        defs: HashMap::new(),
+        incomplete: HashMap::new(),
+        pending: Vec::new(),
+        vars: Vec::new(),
+        bindings: HashMap::new(),
+        loops: Vec::new(),
+        undefined: None,
+    };
+
+    for (index, param) in function.parameters.iter().enumerate() {
+        let scalar = scalar_type(&param.data_type)?;
+        let var = lowering.declare(Binding::Param(index), scalar);
+        let value = lowering.push(Inst::Param(index));
+        let value = lowering.narrow(value, scalar);
+        lowering.write(var, value);
+    }
+    for &stmt in &function.body {
+        lowering.statement(stmt)?;
+    }
+
+    debug_assert!(lowering.sealed.iter().all(|&sealed| sealed));
+    let mut function = lowering.function;
+    function.compact();
+    Ok(function)
+}
+
+struct Lowering<'a> {
+    arena: &'a AstArena,
+    symbols: &'a Symbols,
+    function: Function,
+    current: BlockId,
+    // Edges added so far, indexed by target block
+    preds: Vec<Vec<BlockId>>,
+    sealed: Vec<bool>,
+    defs: HashMap<(Var, BlockId), Value>,
+    // Phis of unsealed blocks, completed when the block is sealed
+    incomplete: HashMap<BlockId, Vec<(Var, Value)>>,
+    // Phis of sealed blocks still waiting for their operands
+    pending: Vec<(Var, Value, BlockId)>,
+    vars: Vec<Scalar>,
+    // The variable of each parameter and local declared so far
+    bindings: HashMap<Binding, Var>,
+    // (continue target, break target) of the enclosing loops
+    loops: Vec<(BlockId, BlockId)>,
+    undefined: Option<Value>,
+}
+
+impl Lowering<'_> {
+    fn statement(&mut self, stmt: StmtId) -> Result<(), String> {
+        let arena = self.arena;
+        match &arena[stmt] {
+            Statement::Return(expr) => {
+                let value = self.expr(*expr)?;
+                self.terminate(Terminator::Return(Some(value)));
+                self.start_unreachable();
+            }
+            Statement::VariableDeclaration { data_type, initializer, .. } => {
+                let scalar = scalar_type(data_type.as_ref().unwrap_or(&Type::Int))?;
+                let value = self.expr(*initializer)?;
+                let var = self.declare(Binding::Local(stmt), scalar);
+                let value = self.narrow(value, scalar);
+                self.write(var, value);
+            }
+            Statement::ExpressionStatement(expr) => {
+                self.expr(*expr)?;
+            }
+            Statement::Block(stmts) | Statement::AtomicBlock(stmts) => {
+                for &stmt in stmts {
+                    self.statement(stmt)?;
+                }
+            }
+            Statement::If { condition, then_block, else_block } => {
+                let condition = self.expr(*condition)?;
+                let then_entry = self.new_block();
+                let end = self.new_block();
+                let else_entry = if else_block.is_some() { self.new_block() } else { end };
+                self.branch(condition, then_entry, else_entry);
+                self.seal(then_entry);
+
+                self.switch_to(then_entry);
+                self.statement(*then_block)?;
+                self.terminate(Terminator::Jump(end));
+
+                if let Some(else_block) = else_block {
+                    self.seal(else_entry);
+                    self.switch_to(else_entry);
+                    self.statement(*else_block)?;
+                    self.terminate(Terminator::Jump(end));
+                }
+
+                self.seal(end);
+                self.switch_to(end);
+            }
+            Statement::While { condition, body } => {
+                let header = self.new_block();
+                let body_entry = self.new_block();
+                let exit = self.new_block();
+                self.terminate(Terminator::Jump(header));
+
+                self.switch_to(header);
+                let condition = self.expr(*condition)?;
+                self.branch(condition, body_entry, exit);
+                self.seal(body_entry);
+
+                self.switch_to(body_entry);
+                self.in_loop(header, exit, *body)?;
+                self.terminate(Terminator::Jump(header));
+
+                self.seal(header);
+                self.seal(exit);
+                self.switch_to(exit);
+            }
+            Statement::For { initializer, condition, increment, body } => {
+                if let Some(init) = initializer {
+                    self.statement(*init)?;
+                }
+
+                let header = self.new_block();
+                let body_entry = self.new_block();
+                let step = self.new_block();
+                let exit = self.new_block();
+                self.terminate(Terminator::Jump(header));
+
+                self.switch_to(header);
+                match condition {
+                    Some(condition) => {
+                        let condition = self.expr(*condition)?;
+                        self.branch(condition, body_entry, exit);
+                    }
+                    None => self.terminate(Terminator::Jump(body_entry)),
+                }
+                self.seal(body_entry);
+
+                self.switch_to(body_entry);
+                self.in_loop(step, exit, *body)?;
+                self.terminate(Terminator::Jump(step));
+
+                self.seal(step);
+                self.switch_to(step);
+                if let Some(increment) = increment {
+                    self.expr(*increment)?;
+                }
+                self.terminate(Terminator::Jump(header));
+
+                self.seal(header);
+                self.seal(exit);
+                self.switch_to(exit);
+            }
+            Statement::DoWhile { body, condition } => {
+                let body_entry = self.new_block();
+                let check = self.new_block();
+                let exit = self.new_block();
+                self.terminate(Terminator::Jump(body_entry));
+
+                self.switch_to(body_entry);
+                self.in_loop(check, exit, *body)?;
+                self.terminate(Terminator::Jump(check));
+
+                self.seal(check);
+                self.switch_to(check);
+                let condition = self.expr(*condition)?;
+                self.branch(condition, body_entry, exit);
+
+                self.seal(body_entry);
+                self.seal(exit);
+                self.switch_to(exit);
+            }
+            Statement::Break | Statement::Continue => {
+                let &(continue_target, break_target) =
+                    self.loops.last().ok_or("break or continue outside a loop")?;
+                let target = if matches!(arena[stmt], Statement::Break) {
+                    break_target
+                } else {
+                    continue_target
+                };
+                self.terminate(Terminator::Jump(target));
+                self.start_unreachable();
+            }
+            Statement::StaticAssert { .. } => {} // Checked at compile time, no code
+            _ => return Err("unsupported statement".to_string()),
+        }
+        Ok(())
+    }
+
+    fn in_loop(&mut self, continue_target: BlockId, break_target: BlockId, body: StmtId) -> Result<(), String> {
+        self.loops.push((continue_target, break_target));
+        let result = self.statement(body);
+        self.loops.pop();
+        result
+    }
+
+    fn expr(&mut self, expr: ExprId) -> Result<Value, String> {
+        let arena = self.arena;
+        match &arena[expr] {
+            Expression::IntegerLiteral(value) => Ok(self.push(Inst::Const(*value as i64))),
+            Expression::CharLiteral(value) => Ok(self.push(Inst::Const(*value as u8 as i64))),
+            Expression::StringLiteral(value) => Ok(self.push(Inst::String(value.clone()))),
+            Expression::Variable(name) => match self.binding(expr)? {
+                Binding::Constant(value) => Ok(self.push(Inst::Const(value as i64))),
+                // Global arrays stand for their address, which a quadword
+                // load of the name gives
+                Binding::Global => {
+                    let Scalar { width, signed } = self.access(expr).unwrap_or(Scalar { width: 8, signed: false });
+                    Ok(self.push(Inst::LoadGlobal { name: *name, width, signed }))
+                }
+                binding => {
+                    let var = self.lookup(binding)?;
+                    Ok(self.read(var))
+                }
+            },
+            Expression::BinaryOperation { left, operator, right } => match operator {
+                BinaryOp::LogicalAnd | BinaryOp::LogicalOr => {
+                    self.logical(*left, *right, *operator == BinaryOp::LogicalAnd)
+                }
+                operator => {
+                    let op = binary_op(*operator)?;
+                    let left = self.expr(*left)?;
+                    let right = self.expr(*right)?;
+                    Ok(self.push(Inst::Binary { op, left, right }))
+                }
+            },
+            Expression::UnaryOperation { operator, operand } => {
+                let OperatorType::Unary(operator) = operator else {
+                    return Err("unsupported unary operator".to_string());
+                };
+                let op = match operator {
+                    UnaryOp::Negate => UnOp::Neg,
+                    UnaryOp::BitwiseNot => UnOp::Not,
+                    UnaryOp::LogicalNot => UnOp::LogicalNot,
+                    UnaryOp::Dereference => {
+                        let address = self.expr(*operand)?;
+                        return self.load(expr, address);
+                    }
+                    UnaryOp::PreIncrement => return self.increment(*operand, 1, true),
+                    UnaryOp::PreDecrement => return self.increment(*operand, -1, true),
+                    UnaryOp::PostIncrement => return self.increment(*operand, 1, false),
+                    UnaryOp::PostDecrement => return self.increment(*operand, -1, false),
+                    UnaryOp::AddressOf => return Err("address-of is not supported".to_string()),
+                };
+                let operand = self.expr(*operand)?;
+                Ok(self.push(Inst::Unary { op, operand }))
+            }
+            Expression::Assignment { target, value } => match &arena[*target] {
+                Expression::Variable(name) => {
+                    let value = self.expr(*value)?;
+                    match self.binding(*target)? {
+                        Binding::Constant(_) => Err("assignment to an enum constant".to_string()),
+                        Binding::Global => {
+                            let scalar = self.access(*target).ok_or("assignment to a global aggregate")?;
+                            let value = self.narrow(value, scalar);
+                            self.push(Inst::StoreGlobal { name: *name, value, width: scalar.width });
+                            Ok(value)
+                        }
+                        binding => {
+                            let var = self.lookup(binding)?;
+                            let value = self.narrow(value, self.vars[var.0 as usize]);
+                            self.write(var, value);
+                            Ok(value)
+                        }
+                    }
+                }
+                Expression::ArrayAccess { array, index } => {
+                    let value = self.expr(*value)?;
+                    let scalar = self.access(*target).ok_or("assignment to an aggregate element")?;
+                    let address = self.element_address(*target, *array, *index)?;
+                    let value = self.narrow(value, scalar);
+                    self.push(Inst::Store { address, value, width: scalar.width });
+                    Ok(value)
+                }
+                _ => Err("unsupported assignment target".to_string()),
+            },
+            Expression::FunctionCall { name, arguments } => {
+                // Arguments are evaluated last to first, like the AST backend does
+                let mut args = vec![None; arguments.len()];
+                for (index, &argument) in arguments.iter().enumerate().rev() {
+                    args[index] = Some(self.expr(argument)?);
+                }
+                let args = args.into_iter().map(|arg| arg.expect("argument evaluated")).collect();
+                Ok(self.push(Inst::Call { callee: *name, args }))
+            }
+            Expression::ArrayAccess { array, index } => {
+                let address = self.element_address(expr, *array, *index)?;
+                self.load(expr, address)
+            }
+            Expression::TernaryIf { condition, then_expr, else_expr } => {
+                let condition = self.expr(*condition)?;
+                let then_entry = self.new_block();
+                let else_entry = self.new_block();
+                let end = self.new_block();
+                self.branch(condition, then_entry, else_entry);
+                self.seal(then_entry);
+                self.seal(else_entry);
+
+                self.switch_to(then_entry);
+                let then_value = self.expr(*then_expr)?;
+                let then_exit = self.current;
+                self.terminate(Terminator::Jump(end));
+
+                self.switch_to(else_entry);
+                let else_value = self.expr(*else_expr)?;
+                let else_exit = self.current;
+                self.terminate(Terminator::Jump(end));
+
+                self.seal(end);
+                self.switch_to(end);
+                Ok(self.phi(end, vec![(then_exit, then_value), (else_exit, else_value)]))
+            }
+            _ => Err("unsupported expression".to_string()),
+        }
+    }
+
+    /// `&&` and `||`, evaluating `right` only when needed. The result is 0 or 1.
+    fn logical(&mut self, left: ExprId, right: ExprId, is_and: bool) -> Result<Value, String> {
+        let left = self.expr(left)?;
+        let short_circuit = self.push(Inst::Const(if is_and { 0 } else { 1 }));
+        let left_exit = self.current;
+        let rhs = self.new_block();
+        let end = self.new_block();
+        if is_and {
+            self.branch(left, rhs, end);
+        } else {
+            self.branch(left, end, rhs);
+        }
+        self.seal(rhs);
+
+        self.switch_to(rhs);
+        let right = self.expr(right)?;
+        let zero = self.push(Inst::Const(0));
+        let right = self.push(Inst::Binary { op: BinOp::Ne, left: right, right: zero });
+        let right_exit = self.current;
+        self.terminate(Terminator::Jump(end));
+
+        self.seal(end);
+        self.switch_to(end);
+        Ok(self.phi(end, vec![(left_exit, short_circuit), (right_exit, right)]))
+    }
+
+    fn increment(&mut self, operand: ExprId, delta: i64, prefix: bool) -> Result<Value, String> {
+        let var = match (&self.arena[operand], self.symbols.binding(operand)) {
+            (Expression::Variable(_), Some(binding @ (Binding::Param(_) | Binding::Local(_)))) => {
+                self.lookup(binding)?
+            }
+            _ => return Err("increment of something other than a local".to_string()),
+        };
+
+        let old = self.read(var);
+        let delta = self.push(Inst::Const(delta));
+        let new = self.push(Inst::Binary { op: BinOp::Add, left: old, right: delta });
+        let new = self.narrow(new, self.vars[var.0 as usize]);
+        self.write(var, new);
+        Ok(if prefix { new } else { old })
+    }
+
+    /// Address of `array[index]`, the expression `element`. Elements of
+    /// unknown type are taken to be 8 bytes, as in the AST backend.
+    fn element_address(&mut self, element: ExprId, array: ExprId, index: ExprId) -> Result<Value, String> {
+        let base = self.expr(array)?;
+        let index = self.expr(index)?;
+        let size = self.symbols.size_of(element).unwrap_or(8);
+        let size = self.push(Inst::Const(size as i64));
+        let offset = self.push(Inst::Binary { op: BinOp::Mul, left: index, right: size });
+        Ok(self.push(Inst::Binary { op: BinOp::Add, left: base, right: offset }))
+    }
+
+    /// The value of `expr`, stored at `address`. Aggregates stand for their
+    /// address and aren't loaded.
+    fn load(&mut self, expr: ExprId, address: Value) -> Result<Value, String> {
+        Ok(match self.access(expr) {
+            Some(Scalar { width, signed }) => self.push(Inst::Load { address, width, signed }),
+            None => address,
+        })
+    }
+
+    /// How the value of `expr` is kept in 64 bits, unless it's an aggregate
+    fn access(&self, expr: ExprId) -> Option<Scalar> {
+        match self.symbols.access(expr) {
+            Access::Scalar { width, signed } => Some(Scalar { width, signed }),
+            Access::Address => None,
+        }
+    }
+
+    fn binding(&self, expr: ExprId) -> Result<Binding, String> {
+        self.symbols.binding(expr).ok_or_else(|| "unresolved name".to_string())
+    }
+
+    fn narrow(&mut self, value: Value, scalar: Scalar) -> Value {
+        if scalar.width == 8 {
+            return value;
+        }
+        self.push(Inst::Extend {
+            value,
+            width: scalar.width,
+            signed: scalar.signed,
+        })
+    }
+
+    fn push(&mut self, inst: Inst) -> Value {
+        self.function.push(self.current, inst)
+    }
+
+    fn phi(&mut self, block: BlockId, entries: Vec<(BlockId, Value)>) -> Value {
+        let phi = self.function.create(Inst::Phi(entries));
+        self.function[block].insts.insert(0, phi);
+        phi
+    }
+
+    fn new_block(&mut self) -> BlockId {
+        self.preds.push(Vec::new());
+        self.sealed.push(false);
+        self.function.add_block()
+    }
+
+    fn switch_to(&mut self, block: BlockId) {
+        self.current = block;
+    }
+
+    /// Ends the current block. Code that follows must switch to another block.
+    fn terminate(&mut self, terminator: Terminator) {
+        for succ in terminator.successors() {
+            self.preds[succ.index()].push(self.current);
+        }
+        self.function[self.current].terminator = terminator;
+    }
+
+    fn branch(&mut self, condition: Value, then_block: BlockId, else_block: BlockId) {
+        self.terminate(Terminator::Branch { condition, then_block, else_block });
+    }
+
+    /// Continues in a block nothing jumps to, for code after `return`,
+    /// `break` and `continue`
+    fn start_unreachable(&mut self) {
+        let block = self.new_block();
+        self.seal(block);
+        self.switch_to(block);
+    }
+
+    fn declare(&mut self, binding: Binding, scalar: Scalar) -> Var {
+        let var = Var(self.vars.len() as u32);
+        self.vars.push(scalar);
+        self.bindings.insert(binding, var);
+        var
+    }
+
+    // Locals the IR can't hold, arrays among them, are never declared
+    fn lookup(&self, binding: Binding) -> Result<Var, String> {
+        self.bindings.get(&binding).copied().ok_or_else(|| "unsupported local".to_string())
+    }
+
+    fn write(&mut self, var: Var, value: Value) {
+        self.defs.insert((var, self.current), value);
+    }
+
+    fn read(&mut self, var: Var) -> Value {
+        let value = self.read_in(var, self.current);
+        self.fill_pending_phis();
+        value
+    }
+
+    /// Value of `var` at the end of `block`. Walks up chains of single
+    /// predecessors iteratively; phis created at joins are queued on
+    /// `pending` rather than filled recursively, so long functions can't
+    /// exhaust the stack.
+    fn read_in(&mut self, var: Var, block: BlockId) -> Value {
+        let mut visited = Vec::new();
+        let mut block = block;
+        let value = loop {
+            if let Some(&value) = self.defs.get(&(var, block)) {
+                break value;
+            }
+            visited.push(block);
+            if !self.sealed[block.index()] {
+                let phi = self.phi(block, Vec::new());
+                self.incomplete.entry(block).or_default().push((var, phi));
+                break phi;
+            }
+            match self.preds[block.index()].as_slice() {
+                [pred] => block = *pred,
+                [] => break self.undefined(),
+                _ => {
+                    let phi = self.phi(block, Vec::new());
+                    self.pending.push((var, phi, block));
+                    break phi;
+                }
+            }
+        };
+        for block in visited {
+            self.defs.insert((var, block), value);
+        }
+        value
+    }
+
+    fn fill_pending_phis(&mut self) {
+        while let Some((var, phi, block)) = self.pending.pop() {
+            let mut entries = Vec::new();
+            for pred in self.preds[block.index()].clone() {
+                entries.push((pred, self.read_in(var, pred)));
+            }
+            self.function[phi] = Inst::Phi(entries);
+        }
+    }
+
+    fn seal(&mut self, block: BlockId) {
+        self.sealed[block.index()] = true;
+        if let Some(phis) = self.incomplete.remove(&block) {
+            self.pending.extend(phis.into_iter().map(|(var, phi)| (var, phi, block)));
+            self.fill_pending_phis();
+        }
+    }
+
+    /// Value read from a local before any assignment
+    fn undefined(&mut self) -> Value {
+        if let Some(value) = self.undefined {
+            return value;
+        }
+        let value = self.function.create(Inst::Const(0));
+        self.function[BlockId::ENTRY].insts.insert(0, value);
+        self.undefined = Some(value);
+        value
+    }
+}
+
+fn binary_op(operator: BinaryOp) -> Result<BinOp, String> {
+    Ok(match operator {
+        BinaryOp::Add => BinOp::Add,
+        BinaryOp::Subtract => BinOp::Sub,
+        BinaryOp::Multiply => BinOp::Mul,
+        BinaryOp::Divide => BinOp::Div,
+        BinaryOp::Modulo => BinOp::Mod,
+        BinaryOp::BitwiseAnd => BinOp::And,
+        BinaryOp::BitwiseOr => BinOp::Or,
+        BinaryOp::BitwiseXor => BinOp::Xor,
+        BinaryOp::LeftShift => BinOp::Shl,
+        BinaryOp::RightShift => BinOp::Shr,
+        BinaryOp::Equal => BinOp::Eq,
+        BinaryOp::NotEqual => BinOp::Ne,
+        BinaryOp::LessThan => BinOp::Lt,
+        BinaryOp::LessThanOrEqual => BinOp::Le,
+        BinaryOp::GreaterThan => BinOp::Gt,
+        BinaryOp::GreaterThanOrEqual => BinOp::Ge,
+        _ => return Err("unsupported binary operator".to_string()),
+    })
+}
+
+fn scalar_type(typ: &Type) -> Result<Scalar, String> {
+    let (width, signed) = match typ {
+        Type::Bool => (1, false),
+        Type::Char => (1, true),
+        Type::UnsignedChar => (1, false),
+        Type::Short => (2, true),
+        Type::UnsignedShort => (2, false),
+        Type::Int => (4, true),
+        Type::UnsignedInt => (4, false),
+        Type::Long | Type::LongLong => (8, true),
+        Type::UnsignedLong | Type::UnsignedLongLong | Type::Pointer(_) => (8, false),
+        Type::Const(inner) | Type::Atomic(inner) => return scalar_type(inner),
+        _ => return Err(format!("unsupported type {:?}", typ)),
+    };
+    Ok(Scalar { width, signed })
+}
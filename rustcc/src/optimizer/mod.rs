@@ -0,0 +1,175 @@
+// mod.rs
+// Mid-level optimizer
+//
+// Function bodies are lowered from the AST into the SSA form of `ir`,
+// optimized there and handed to the backends. Functions using constructs
+// the IR doesn't model are left out of the module and compiled from the
+// AST as before.
+
+mod cse;
+mod dce;
+mod dom;
+mod fold;
+mod inline;
+pub mod ir;
+mod licm;
+mod lower;
+mod simplify;
+mod strength;
+
+use crate::analyzer::Analysis;
+use crate::compiler::OptimizationLevel;
+use crate::config::OptimizationConfig;
+use crate::parser::ast::Program;
+use ir::{Function, Module};
+
+/// Upper bound on the rounds of the scalar pipeline; each round usually
+/// only exposes a little more work for the next
+const MAX_ROUNDS: usize = 8;
+
+pub struct Optimizer {
+    level: OptimizationLevel,
+    config: OptimizationConfig,
+}
+
+impl Optimizer {
+    pub fn new(level: OptimizationLevel, config: OptimizationConfig) -> Self {
+        Optimizer { level, config }
+    }
+
+    /// Lowers and optimizes every function of `program` the IR can represent
+    pub fn run(&self, program: &Program, analysis: &Analysis) -> Module {
+        let mut module = Module {
+            functions: program
+                .functions
+                .iter()
+                .zip(&analysis.functions)
+                .filter(|(function, _)| !function.is_external && !function.is_variadic && !function.body.is_empty())
+                .filter_map(|(function, symbols)| lower::lower_function(function, symbols).ok())
+                .collect(),
+        };
+        if self.level == OptimizationLevel::None {
+            return module;
+        }
+
+        for function in &mut module.functions {
+            self.simplify(function);
+        }
+        if self.level == OptimizationLevel::Full {
+            if inline::inline_leaf_calls(&mut module, self.config.inline_threshold) {
+                for function in &mut module.functions {
+                    self.simplify(function);
+                }
+            }
+            for function in &mut module.functions {
+                if licm::hoist_loop_invariants(function) {
+                    self.simplify(function);
+                }
+            }
+        }
+        for function in &mut module.functions {
+            if strength::reduce_loop_multiplications(function) {
+                self.simplify(function);
+            }
+        }
+        module
+    }
+
+    /// Runs the scalar passes until they stop finding work
+    fn simplify(&self, function: &mut Function) {
+        for _ in 0..MAX_ROUNDS {
+            let mut changed = simplify::simplify_cfg(function);
+            if self.config.constant_folding {
+                changed |= fold::fold_constants(function);
+            }
+            changed |= cse::eliminate_common_subexpressions(function);
+            if self.config.dead_code_elimination {
+                changed |= dce::eliminate_dead_code(function);
+            }
+            if !changed {
+                break;
+            }
+        }
+        // Leave the blocks in reverse postorder for the backends
+        simplify::simplify_cfg(function);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::ir::{BinOp, Inst, Terminator};
+    use super::*;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+
+    fn optimize(source: &str, level: OptimizationLevel) -> Module {
+        let tokens = Lexer::new(source).scan_tokens();
+        let mut program = Parser::new(tokens).parse().unwrap();
+        let (analysis, _) = crate::analyzer::annotate(&mut program);
+        Optimizer::new(level, OptimizationConfig::default()).run(&program, &analysis)
+    }
+
+    fn returned_constant(function: &Function) -> Option<i64> {
+        match function.blocks.as_slice() {
+            [block] => match block.terminator {
+                Terminator::Return(Some(value)) => function.constant(value),
+                _ => None,
+            },
+            _ => None,
+        }
+    }
+
+    #[test]
+    fn test_constants_fold_through_control_flow() {
+        let source = "int f() { int x = 6; int y = 0; if (x > 5) { y = x * 7; } else { y = 1; } return y; }";
+        let module = optimize(source, OptimizationLevel::Basic);
+        assert_eq!(returned_constant(&module.functions[0]), Some(42));
+    }
+
+    #[test]
+    fn test_leaf_calls_are_inlined() {
+        let source = "int sq(int x) { return x * x; } int main() { return sq(3); }";
+        let module = optimize(source, OptimizationLevel::Full);
+        let main = &module.functions[1];
+        assert_eq!(returned_constant(main), Some(9));
+        assert!(main.blocks[0].insts.iter().all(|&value| !matches!(main[value], Inst::Call { .. })));
+    }
+
+    #[test]
+    fn test_loop_invariants_are_hoisted() {
+        let source = "int f(int n, int k) { int s = 0; int i = 0; while (i < n) { s = s + k * 3; i = i + 1; } return s; }";
+        let module = optimize(source, OptimizationLevel::Full);
+        let function = &module.functions[0];
+        let (header, _) = function
+            .blocks
+            .iter()
+            .enumerate()
+            .find(|(_, block)| matches!(block.terminator, Terminator::Branch { .. }))
+            .unwrap();
+        let mul_block = function
+            .block_ids()
+            .find(|&id| {
+                function[id]
+                    .insts
+                    .iter()
+                    .any(|&value| matches!(function[value], Inst::Binary { op: BinOp::Mul, .. }))
+            })
+            .unwrap();
+        // The multiplication runs once, before the loop header
+        assert!(mul_block.index() < header);
+    }
+
+    #[test]
+    fn test_loop_multiplications_become_additions() {
+        let source = "int f(int n) { int s = 0; int i = 0; while (i < n) { s = s + i * 12; i = i + 1; } return s; }";
+        let module = optimize(source, OptimizationLevel::Basic);
+        let function = &module.functions[0];
+        let insts: Vec<&Inst> =
+            function.blocks.iter().flat_map(|block| &block.insts).map(|&value| &function[value]).collect();
+        assert!(!insts.iter().any(|inst| matches!(inst, Inst::Binary { op: BinOp::Mul, .. })));
+        // i * 12 is counted up by 12 alongside i
+        assert!(insts.iter().any(
+            |inst| matches!(inst, Inst::Binary { op: BinOp::Add, right, .. } if function.constant(*right) == Some(12))
+        ));
+    }
+}
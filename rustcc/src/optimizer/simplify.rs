@@ -0,0 +1,130 @@
+// simplify.rs
+// Control flow graph cleanup
+//
+// Lowering produces many small blocks joined by unconditional jumps, and
+// folding branches leaves more behind. This pass merges a block into its
+// predecessor when that is the only way to reach it, forwards jumps through
+// empty blocks and drops unreachable blocks.
+
+use super::ir::{BlockId, Function, Inst, Terminator};
+use std::collections::HashMap;
+
+pub fn simplify_cfg(function: &mut Function) -> bool {
+    let before = function.blocks.len();
+    function.compact();
+    let mut changed = function.blocks.len() != before;
+
+    // A branch whose arms agree is a jump. The target saw two edges from
+    // this block, so its phis hold two (equal) operands for it.
+    for id in function.block_ids().collect::<Vec<_>>() {
+        if let Terminator::Branch { then_block, else_block, .. } = function[id].terminator {
+            if then_block == else_block {
+                function[id].terminator = Terminator::Jump(then_block);
+                function.remove_phi_operands(then_block, id);
+                changed = true;
+            }
+        }
+    }
+
+    changed |= merge_blocks(function);
+    changed |= forward_empty_blocks(function);
+
+    if changed {
+        function.compact();
+    }
+    changed
+}
+
+/// Appends each block to its predecessor when it is that block's only
+/// successor and has no other predecessor
+fn merge_blocks(function: &mut Function) -> bool {
+    let mut preds = function.predecessors();
+    let mut replace = HashMap::new();
+    let mut changed = false;
+
+    for id in function.block_ids().collect::<Vec<_>>() {
+        while let Terminator::Jump(succ) = function[id].terminator {
+            if succ == id || succ == BlockId::ENTRY || preds[succ.index()].len() != 1 {
+                break;
+            }
+            let insts = &function.insts;
+            let phis_resolved = function[succ].insts.iter().all(|&value| match &insts[value.index()] {
+                Inst::Phi(entries) => entries.len() == 1,
+                _ => true,
+            });
+            if !phis_resolved {
+                break;
+            }
+
+            let moved = std::mem::take(&mut function[succ].insts);
+            for value in moved {
+                match &function[value] {
+                    Inst::Phi(entries) => {
+                        replace.insert(value, entries[0].1);
+                    }
+                    _ => function[id].insts.push(value),
+                }
+            }
+            let terminator = std::mem::replace(&mut function[succ].terminator, Terminator::Return(None));
+            for next in terminator.successors() {
+                function.rename_phi_pred(next, succ, id);
+                for pred in &mut preds[next.index()] {
+                    if *pred == succ {
+                        *pred = id;
+                    }
+                }
+            }
+            function[id].terminator = terminator;
+            preds[succ.index()].clear();
+            changed = true;
+        }
+    }
+
+    function.replace_uses(&replace);
+    changed
+}
+
+/// Sends jumps to an empty block straight to where it jumps to
+fn forward_empty_blocks(function: &mut Function) -> bool {
+    let mut preds = function.predecessors();
+    let mut changed = false;
+
+    for id in function.block_ids().skip(1).collect::<Vec<_>>() {
+        let Terminator::Jump(target) = function[id].terminator else {
+            continue;
+        };
+        if target == id || !function[id].insts.is_empty() || preds[id.index()].is_empty() {
+            continue;
+        }
+
+        let insts = &function.insts;
+        let target_has_phis = function[target]
+            .insts
+            .first()
+            .is_some_and(|&value| matches!(insts[value.index()], Inst::Phi(_)));
+        let id_preds = preds[id.index()].clone();
+        if target_has_phis {
+            // The phi operand for this block can move to its single
+            // predecessor, unless that predecessor already has its own
+            match id_preds.as_slice() {
+                [pred] if !preds[target.index()].contains(pred) => function.rename_phi_pred(target, id, *pred),
+                _ => continue,
+            }
+        }
+
+        for &pred in &id_preds {
+            function[pred].terminator.for_each_successor_mut(|succ| {
+                if *succ == id {
+                    *succ = target;
+                }
+            });
+        }
+        let target_preds = &mut preds[target.index()];
+        target_preds.retain(|&pred| pred != id);
+        target_preds.extend(id_preds);
+        preds[id.index()].clear();
+        changed = true;
+    }
+
+    changed
+}
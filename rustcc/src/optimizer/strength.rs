@@ -0,0 +1,108 @@
+// strength.rs
+// Strength reduction of multiplications in loops
+//
+// A loop counter stepped by a constant, multiplied by a constant in the
+// loop, is multiplied by an add: i * k gets a counter of its own that
+// starts at init * k before the loop and is stepped by step * k wherever i
+// is. Multiplications the backends already turn into shifts or a lea are
+// left alone.
+//
+// An int counter is only stepped without wrapping if the program doesn't
+// overflow it, which C leaves undefined; an unsigned one could wrap, so
+// only signed and 64-bit counters are reduced.
+
+use super::ir::{BinOp, BlockId, Function, Inst, Value};
+use super::licm::find_loops;
+use std::collections::HashMap;
+
+pub fn reduce_loop_multiplications(function: &mut Function) -> bool {
+    let preds = function.predecessors();
+    let mut changed = false;
+    for l in find_loops(function) {
+        // The counters need a block entering the loop to start in
+        let preheader =
+            match preds[l.header.index()].iter().filter(|pred| !l.body[pred.index()]).collect::<Vec<_>>().as_slice() {
+                [&preheader] if function[preheader].terminator.successors() == [l.header] => preheader,
+                _ => continue,
+            };
+
+        for i in function[l.header].insts.clone() {
+            let Inst::Phi(entries) = &function[i] else {
+                break;
+            };
+            let (init, latch, next) = match entries.as_slice() {
+                [(a, init), (latch, next)] | [(latch, next), (a, init)] if *a == preheader && l.body[latch.index()] => {
+                    (*init, *latch, *next)
+                }
+                _ => continue,
+            };
+            let Some(step) = counter_step(function, i, next) else {
+                continue;
+            };
+
+            let mut reduced = Vec::new();
+            for block in function.block_ids().filter(|block| l.body[block.index()]) {
+                for &value in &function[block].insts {
+                    if let Some(factor) = multiplication(function, value, i).filter(|&factor| !is_cheap(factor)) {
+                        reduced.push((value, factor));
+                    }
+                }
+            }
+            let Some(block) = defining_block(function, next, &l.body) else {
+                continue;
+            };
+            for (multiplication, factor) in reduced {
+                let factor_value = function.push(preheader, Inst::Const(factor));
+                let start = function.push(preheader, Inst::Binary { op: BinOp::Mul, left: init, right: factor_value });
+                let stride = function.push(preheader, Inst::Const(step.wrapping_mul(factor)));
+
+                // Stepped right after the counter, so it reaches the back
+                // edge wherever the counter does
+                let product = function.create(Inst::Phi(Vec::new()));
+                let product_next = function.create(Inst::Binary { op: BinOp::Add, left: product, right: stride });
+                function[product] = Inst::Phi(vec![(preheader, start), (latch, product_next)]);
+                function[l.header].insts.insert(0, product);
+                let position = function[block].insts.iter().position(|&value| value == next).expect("step is placed");
+                function[block].insts.insert(position + 1, product_next);
+
+                function.replace_uses(&HashMap::from([(multiplication, product)]));
+                changed = true;
+            }
+        }
+    }
+    changed
+}
+
+/// The constant `next` adds to the counter `i`, if it's a signed or 64-bit
+/// step of it
+fn counter_step(function: &Function, i: Value, next: Value) -> Option<i64> {
+    let add = match function[next] {
+        Inst::Extend { value, width: 4, signed: true } => value,
+        Inst::Binary { .. } => next,
+        _ => return None,
+    };
+    match function[add] {
+        Inst::Binary { op: BinOp::Add, left, right } if left == i => function.constant(right),
+        Inst::Binary { op: BinOp::Add, left, right } if right == i => function.constant(left),
+        Inst::Binary { op: BinOp::Sub, left, right } if left == i => function.constant(right).map(i64::wrapping_neg),
+        _ => None,
+    }
+}
+
+/// The constant `value` multiplies `i` by, if it's such a multiplication
+fn multiplication(function: &Function, value: Value, i: Value) -> Option<i64> {
+    match function[value] {
+        Inst::Binary { op: BinOp::Mul, left, right } if left == i => function.constant(right),
+        Inst::Binary { op: BinOp::Mul, left, right } if right == i => function.constant(left),
+        _ => None,
+    }
+}
+
+/// Whether the backends multiply by `factor` with a shift or a lea
+fn is_cheap(factor: i64) -> bool {
+    matches!(factor, -1..=1 | 3 | 5 | 9) || (factor > 0 && factor.count_ones() == 1)
+}
+
+fn defining_block(function: &Function, value: Value, body: &[bool]) -> Option<BlockId> {
+    function.block_ids().filter(|block| body[block.index()]).find(|&block| function[block].insts.contains(&value))
+}
@@ -0,0 +1,301 @@
+// options.rs
+// Command-line options
+//
+// The options of one invocation, parsed once and turned into a compiler
+// and its jobs. Running locally and running through the compilation
+// server (see server.rs) share this, so both accept exactly the same
+// command lines. The server relies on `resolve` to make a client's
+// relative paths independent of its own working directory.
+
+use crate::codegen::OutputFormat;
+use crate::compiler::{Compiler, ObfuscationLevel, OptimizationLevel};
+use crate::driver::Job;
+use crate::report::ReportFormat;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::thread;
+
+pub const USAGE: &str = "Usage: rustcc <source_file>... [options]\n       rustcc --server <socket> [-j <n>]\n       rustcc --connect <socket> <source_file>... [options]\nOptions:\n  -o <file>: Output file (single source file only)\n  -j <n>: Compile up to n source files in parallel\n  @<file>: Read source file names, one per line, from file\n  -O0, -O1, -O2: Optimization level\n  -obf0, -obf1, -obf2: Obfuscation level\n  -I<dir>: Add directory to include search path\n  -E: Preprocess only\n  --save-temps: Keep the preprocessed source as <source_file>.i\n  --emit-pch: Write a precompiled header of the source file\n  --include-pch <file>: Start from a precompiled header\n  --cache-dir <dir>: Reuse output of unchanged code from earlier builds\n  --time-report[=json]: Print the time and allocations of each phase\n  --backend=<x86_64|llvm>: Code generator (llvm needs the llvm-backend feature)\n  --emit=<asm|llvm|obj>: Output format; llvm needs --backend=llvm\n  --hot=<f,g,...>: Only obfuscate these functions in ways that don't slow them down\n  --obf-budget=<fraction>: Stop obfuscating a function once it grows by this fraction\n  --server <socket>: Serve compilations on a Unix socket, keeping caches warm\n  --connect <socket>: Compile through the server on the socket";
+
+/// The options of one invocation of the compiler
+#[derive(Debug, Clone)]
+pub struct Options {
+    pub source_files: Vec<String>,
+    pub output_file: String,
+    pub opt_level: OptimizationLevel,
+    pub obf_level: ObfuscationLevel,
+    pub include_paths: Vec<PathBuf>,
+    pub preprocess_only: bool,
+    pub save_temps: bool,
+    pub emit_pch: bool,
+    pub include_pch: Option<String>,
+    pub cache_dir: Option<String>,
+    pub time_report: Option<ReportFormat>,
+    pub output_format: OutputFormat,
+    pub llvm_backend: bool,
+    pub hot_functions: Vec<String>,
+    pub obfuscation_budget: Option<f32>,
+    pub threads: usize,
+    // Where default output files go, if not the working directory
+    output_dir: Option<PathBuf>,
+}
+
+impl Options {
+    /// Parses the arguments after the program name
+    pub fn parse(args: &[String]) -> Result<Self, String> {
+        if args.is_empty() {
+            return Err(USAGE.to_string());
+        }
+
+        let mut options = Options {
+            source_files: Vec::new(),
+            output_file: String::new(),
+            opt_level: OptimizationLevel::None,
+            obf_level: ObfuscationLevel::None,
+            include_paths: Vec::new(),
+            preprocess_only: false,
+            save_temps: false,
+            emit_pch: false,
+            include_pch: None,
+            cache_dir: None,
+            time_report: None,
+            output_format: OutputFormat::Assembly,
+            llvm_backend: false,
+            hot_functions: Vec::new(),
+            obfuscation_budget: None,
+            threads: default_threads(),
+            output_dir: None,
+        };
+
+        let mut i = 0;
+        while i < args.len() {
+            let arg = &args[i];
+
+            if arg.starts_with("-") {
+                // Handle options
+                if arg.starts_with("-I") {
+                    // Handle include path
+                    let path = if arg.len() > 2 {
+                        // Path is part of the argument (e.g., -I/usr/include)
+                        arg[2..].to_string()
+                    } else if i + 1 < args.len() {
+                        // Path is the next argument (e.g., -I /usr/include)
+                        i += 1;
+                        args[i].clone()
+                    } else {
+                        return Err("Missing path after -I option".to_string());
+                    };
+
+                    options.include_paths.push(PathBuf::from(path));
+                } else if arg == "-o" {
+                    // Handle output file
+                    if i + 1 < args.len() {
+                        i += 1;
+                        options.output_file = args[i].clone();
+                    } else {
+                        return Err("Missing file after -o option".to_string());
+                    }
+                } else if arg == "--include-pch" {
+                    // Handle the precompiled header to start from
+                    if i + 1 < args.len() {
+                        i += 1;
+                        options.include_pch = Some(args[i].clone());
+                    } else {
+                        return Err("Missing file after --include-pch option".to_string());
+                    }
+                } else if arg == "--cache-dir" {
+                    // Handle the incremental build cache
+                    if i + 1 < args.len() {
+                        i += 1;
+                        options.cache_dir = Some(args[i].clone());
+                    } else {
+                        return Err("Missing directory after --cache-dir option".to_string());
+                    }
+                } else if let Some(name) = arg.strip_prefix("--emit=") {
+                    options.output_format = OutputFormat::from_name(name)
+                        .ok_or_else(|| format!("Unknown output format: {} (expected asm, llvm or obj)", name))?;
+                } else if let Some(name) = arg.strip_prefix("--backend=") {
+                    options.llvm_backend = match name {
+                        "llvm" => true,
+                        "x86_64" => false,
+                        _ => return Err(format!("Unknown backend: {} (expected x86_64 or llvm)", name)),
+                    };
+                } else if let Some(names) = arg.strip_prefix("--hot=") {
+                    options
+                        .hot_functions
+                        .extend(names.split(',').filter(|name| !name.is_empty()).map(str::to_string));
+                } else if let Some(budget) = arg.strip_prefix("--obf-budget=") {
+                    options.obfuscation_budget = match budget.parse::<f32>() {
+                        Ok(budget) if budget >= 0.0 => Some(budget),
+                        _ => return Err(format!("Invalid obfuscation budget: {}", budget)),
+                    };
+                } else if arg.starts_with("-j") {
+                    // Handle the number of parallel jobs (-j4 or -j 4)
+                    let count = if arg.len() > 2 {
+                        arg[2..].to_string()
+                    } else if i + 1 < args.len() {
+                        i += 1;
+                        args[i].clone()
+                    } else {
+                        return Err("Missing count after -j option".to_string());
+                    };
+                    options.threads = parse_job_count(&count)?;
+                } else {
+                    // Handle other options
+                    match arg.as_str() {
+                        "-O0" => options.opt_level = OptimizationLevel::None,
+                        "-O1" => options.opt_level = OptimizationLevel::Basic,
+                        "-O2" => options.opt_level = OptimizationLevel::Full,
+                        "-obf0" => options.obf_level = ObfuscationLevel::None,
+                        "-obf1" => options.obf_level = ObfuscationLevel::Basic,
+                        "-obf2" => options.obf_level = ObfuscationLevel::Aggressive,
+                        "-E" => options.preprocess_only = true,
+                        "--save-temps" => options.save_temps = true,
+                        "--emit-pch" => options.emit_pch = true,
+                        "--time-report" => options.time_report = Some(ReportFormat::Table),
+                        "--time-report=json" => options.time_report = Some(ReportFormat::Json),
+                        _ => return Err(format!("Unknown option: {}", arg)),
+                    }
+                }
+            } else if let Some(list) = arg.strip_prefix('@') {
+                // A file listing source files
+                let contents =
+                    fs::read_to_string(list).map_err(|e| format!("Failed to read file list {}: {}", list, e))?;
+                options
+                    .source_files
+                    .extend(contents.lines().map(str::trim).filter(|line| !line.is_empty()).map(String::from));
+            } else {
+                // This is a source file
+                options.source_files.push(arg.clone());
+            }
+
+            i += 1;
+        }
+
+        // Check if source file was provided
+        if options.source_files.is_empty() {
+            return Err("No source file provided".to_string());
+        }
+        if options.source_files.len() > 1 && !options.output_file.is_empty() {
+            return Err("Cannot use -o with multiple source files".to_string());
+        }
+        Ok(options)
+    }
+
+    /// Makes every relative path absolute against `dir`, as if the
+    /// compiler had been run there
+    pub fn resolve(&mut self, dir: &Path) {
+        let absolute = |path: &str| dir.join(path).to_string_lossy().to_string();
+        for file in &mut self.source_files {
+            *file = absolute(file);
+        }
+        if !self.output_file.is_empty() {
+            self.output_file = absolute(&self.output_file);
+        }
+        for path in &mut self.include_paths {
+            *path = dir.join(&*path);
+        }
+        self.include_pch = self.include_pch.as_deref().map(absolute);
+        self.cache_dir = self.cache_dir.as_deref().map(absolute);
+        self.output_dir = Some(dir.to_path_buf());
+    }
+
+    /// A compiler with these options, apart from the precompiled header and
+    /// the build cache, which the caller loads
+    pub fn compiler(&self) -> Compiler {
+        let mut compiler = Compiler::new(String::new(), String::new())
+            .with_optimization(self.opt_level)
+            .with_obfuscation(self.obf_level);
+
+        // Add include paths
+        for path in &self.include_paths {
+            compiler = compiler.add_include_path(path);
+        }
+
+        // Set preprocess only mode if requested
+        if self.preprocess_only {
+            compiler = compiler.preprocess_only(true);
+        }
+        compiler = compiler.save_temps(self.save_temps).emit_pch(self.emit_pch);
+        if let Some(format) = self.time_report {
+            compiler = compiler.with_time_report(format);
+        }
+        compiler = compiler.emit(self.output_format).with_llvm_backend(self.llvm_backend);
+        compiler = compiler.with_hot_functions(self.hot_functions.clone());
+        if let Some(budget) = self.obfuscation_budget {
+            compiler = compiler.with_obfuscation_budget(budget);
+        }
+        compiler
+    }
+
+    /// A job for each source file, writing to the output file or the
+    /// default one
+    pub fn jobs(&self) -> Vec<Job> {
+        self.source_files
+            .iter()
+            .map(|source_file| Job {
+                source_file: source_file.clone(),
+                output_file: if self.output_file.is_empty() {
+                    let output_file = default_output_file(
+                        source_file,
+                        self.preprocess_only,
+                        self.emit_pch,
+                        self.output_format,
+                    );
+                    match &self.output_dir {
+                        Some(dir) => dir.join(output_file).to_string_lossy().to_string(),
+                        None => output_file,
+                    }
+                } else {
+                    self.output_file.clone()
+                },
+            })
+            .collect()
+    }
+
+    /// What a successful compilation prints
+    pub fn summary(&self) -> String {
+        format!(
+            "Compilation successful!\nOptions: Optimization={:?}, Obfuscation={:?}\n",
+            self.opt_level, self.obf_level
+        )
+    }
+}
+
+/// The number of requests `rustcc --server <socket> [-j <n>]` serves at once,
+/// from the arguments after the socket
+pub fn server_workers(args: &[String]) -> Result<usize, String> {
+    match args {
+        [] => Ok(default_threads()),
+        [arg] if arg.len() > 2 && arg.starts_with("-j") => parse_job_count(&arg[2..]),
+        [flag, count] if flag == "-j" => parse_job_count(count),
+        _ => Err(USAGE.to_string()),
+    }
+}
+
+fn default_threads() -> usize {
+    thread::available_parallelism().map_or(1, |cores| cores.get())
+}
+
+fn parse_job_count(count: &str) -> Result<usize, String> {
+    match count.parse() {
+        Ok(count) if count > 0 => Ok(count),
+        _ => Err(format!("Invalid job count: {}", count)),
+    }
+}
+
+/// The output file for `source_file` when none was given: its name with
+/// the extension of the output format, .i when only preprocessing or .pch
+/// for a precompiled header
+fn default_output_file(source_file: &str, preprocess_only: bool, emit_pch: bool, format: OutputFormat) -> String {
+    let source_path = PathBuf::from(source_file);
+    let file_stem = source_path.file_stem().unwrap_or_default().to_string_lossy();
+
+    if preprocess_only {
+        format!("{}.i", file_stem)
+    } else if emit_pch {
+        format!("{}.pch", file_stem)
+    } else {
+        format!("{}.{}", file_stem, format.extension())
+    }
+}
@@ -1,4 +1,137 @@
-#[derive(Debug, Clone)]
+use crate::parser::symbol::Symbol;
+use std::ops::{Index, IndexMut};
+
+/// Handle to an expression node stored in an [`AstArena`]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct ExprId(u32);
+
+/// Handle to a statement node stored in an [`AstArena`]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct StmtId(u32);
+
+impl ExprId {
+    pub fn index(self) -> usize {
+        self.0 as usize
+    }
+}
+
+impl StmtId {
+    pub fn index(self) -> usize {
+        self.0 as usize
+    }
+}
+
+/// Backing storage for AST nodes.
+///
+/// Nodes refer to their children by `ExprId`/`StmtId` rather than owning
+/// them through `Box`, so a whole function body lives in two contiguous
+/// vectors. Passes walk the tree by copying ids instead of cloning
+/// subtrees, and rewriting a node is a plain assignment through `IndexMut`.
+/// Nodes are never freed individually; a replaced node simply becomes
+/// unreachable until the arena is dropped.
+///
+/// Each function owns an arena and the program has one more for its
+/// globals, rather than one for the whole translation unit. Transforms and
+/// code generation run on several functions at once, each changing only
+/// its own arena without any locking, and a function's ids and nodes stay
+/// the same when other functions are edited, so the build cache can key the
+/// function's code on them. Each arena is still only a few reallocations of
+/// two vectors.
+#[derive(Debug, Clone, Default)]
+pub struct AstArena {
+    exprs: Vec<Expression>,
+    stmts: Vec<Statement>,
+}
+
+impl AstArena {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates an arena with room for the given number of nodes
+    pub fn with_capacity(exprs: usize, stmts: usize) -> Self {
+        AstArena {
+            exprs: Vec::with_capacity(exprs),
+            stmts: Vec::with_capacity(stmts),
+        }
+    }
+
+    /// Stores an expression and returns its handle
+    pub fn alloc_expr(&mut self, expr: Expression) -> ExprId {
+        let id = ExprId(u32::try_from(self.exprs.len()).expect("too many expression nodes"));
+        self.exprs.push(expr);
+        id
+    }
+
+    /// Stores a statement and returns its handle
+    pub fn alloc_stmt(&mut self, stmt: Statement) -> StmtId {
+        let id = StmtId(u32::try_from(self.stmts.len()).expect("too many statement nodes"));
+        self.stmts.push(stmt);
+        id
+    }
+
+    /// Number of expression nodes allocated so far
+    pub fn expr_count(&self) -> usize {
+        self.exprs.len()
+    }
+
+    /// Number of statement nodes allocated so far
+    pub fn stmt_count(&self) -> usize {
+        self.stmts.len()
+    }
+
+    /// Handles of the expressions allocated so far, in allocation order.
+    /// Nodes allocated while iterating are not visited.
+    pub fn expr_ids(&self) -> impl Iterator<Item = ExprId> {
+        (0..self.exprs.len() as u32).map(ExprId)
+    }
+
+    /// Every expression node, reachable or not, for passes that rewrite nodes
+    /// independently of their position in the tree
+    pub fn exprs_mut(&mut self) -> impl Iterator<Item = &mut Expression> {
+        self.exprs.iter_mut()
+    }
+
+    /// Every statement node, reachable or not
+    pub fn stmts(&self) -> impl Iterator<Item = &Statement> {
+        self.stmts.iter()
+    }
+
+    /// Every statement node, reachable or not, for rewriting in place
+    pub fn stmts_mut(&mut self) -> impl Iterator<Item = &mut Statement> {
+        self.stmts.iter_mut()
+    }
+}
+
+impl Index<ExprId> for AstArena {
+    type Output = Expression;
+
+    fn index(&self, id: ExprId) -> &Expression {
+        &self.exprs[id.index()]
+    }
+}
+
+impl IndexMut<ExprId> for AstArena {
+    fn index_mut(&mut self, id: ExprId) -> &mut Expression {
+        &mut self.exprs[id.index()]
+    }
+}
+
+impl Index<StmtId> for AstArena {
+    type Output = Statement;
+
+    fn index(&self, id: StmtId) -> &Statement {
+        &self.stmts[id.index()]
+    }
+}
+
+impl IndexMut<StmtId> for AstArena {
+    fn index_mut(&mut self, id: StmtId) -> &mut Statement {
+        &mut self.stmts[id.index()]
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
 #[allow(dead_code)]
 pub enum BinaryOp {
     Add,
@@ -27,7 +160,7 @@ pub enum BinaryOp {
     PostDecrement, // for expr--
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
 #[allow(dead_code)]
 pub enum UnaryOp {
     // Keep these variants for backward compatibility
@@ -42,7 +175,7 @@ pub enum UnaryOp {
     PostDecrement, // x--
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
 #[allow(dead_code)]
 pub enum OperatorType {
     Binary(BinaryOp),
@@ -57,133 +190,192 @@ pub enum Expression {
     CharLiteral(char),
     FloatLiteral(f64),  // Add support for floating-point literals
     BinaryOperation {
-        left: Box<Expression>,
+        left: ExprId,
         operator: BinaryOp,
-        right: Box<Expression>,
+        right: ExprId,
     },
     UnaryOperation {
         operator: OperatorType,
-        operand: Box<Expression>,
+        operand: ExprId,
     },
-    Variable(String),
+    Variable(Symbol),
     FunctionCall {
-        name: String,
-        arguments: Vec<Expression>,
+        name: Symbol,
+        arguments: Vec<ExprId>,
     },
     Assignment {
-        target: Box<Expression>,
-        value: Box<Expression>,
+        target: ExprId,
+        value: ExprId,
     },
     TernaryIf {
-        condition: Box<Expression>,
-        then_expr: Box<Expression>,
-        else_expr: Box<Expression>,
+        condition: ExprId,
+        then_expr: ExprId,
+        else_expr: ExprId,
     },
     Cast {
         target_type: Type,
-        expr: Box<Expression>,
+        expr: ExprId,
     },
-    SizeOf(Box<Expression>),
+    SizeOf(ExprId),
     SizeOfType(Type),  // sizeof(type)
     AlignOf(Type),     // _Alignof(type) - C11
     ArrayAccess {
-        array: Box<Expression>,
-        index: Box<Expression>,
+        array: ExprId,
+        index: ExprId,
     },
-    ArrayLiteral(Vec<Expression>),
+    ArrayLiteral(Vec<ExprId>),
     StructFieldAccess {
-        object: Box<Expression>,
+        object: ExprId,
         field: String,
     },
     PointerFieldAccess {
-        pointer: Box<Expression>,
+        pointer: ExprId,
         field: String,
     },
     CompoundLiteral {  // (Type){initializers} - C99
         type_name: Type,
-        initializers: Vec<Expression>,
+        initializers: Vec<ExprId>,
     },
     GenericSelection {  // _Generic(expr, type1: expr1, type2: expr2, ...) - C11
-        controlling_expr: Box<Expression>,
-        associations: Vec<(Type, Expression)>,
-        default_expr: Option<Box<Expression>>,
+        controlling_expr: ExprId,
+        associations: Vec<(Type, ExprId)>,
+        default_expr: Option<ExprId>,
     },
     StaticAssert {  // _Static_assert(expr, message) - C11
-        condition: Box<Expression>,
+        condition: ExprId,
         message: String,
     },
-    AtomicExpr {  // Atomic expressions - C11
+    AtomicExpr {  // Atomic expressions - C11; see AtomicOp for the operands
         operation: AtomicOp,
-        operands: Vec<Expression>,
+        operands: Vec<ExprId>,
     },
 }
 
+impl Expression {
+    /// Calls `f` with each direct subexpression, left to right
+    pub fn for_each_child(&self, mut f: impl FnMut(ExprId)) {
+        match self {
+            Expression::BinaryOperation { left, right, .. } => {
+                f(*left);
+                f(*right);
+            }
+            Expression::UnaryOperation { operand: expr, .. }
+            | Expression::Cast { expr, .. }
+            | Expression::SizeOf(expr)
+            | Expression::StructFieldAccess { object: expr, .. }
+            | Expression::PointerFieldAccess { pointer: expr, .. }
+            | Expression::StaticAssert { condition: expr, .. } => f(*expr),
+            Expression::FunctionCall { arguments: exprs, .. }
+            | Expression::ArrayLiteral(exprs)
+            | Expression::CompoundLiteral { initializers: exprs, .. }
+            | Expression::AtomicExpr { operands: exprs, .. } => exprs.iter().copied().for_each(f),
+            Expression::Assignment { target, value } => {
+                f(*target);
+                f(*value);
+            }
+            Expression::TernaryIf {
+                condition,
+                then_expr,
+                else_expr,
+            } => {
+                f(*condition);
+                f(*then_expr);
+                f(*else_expr);
+            }
+            Expression::ArrayAccess { array, index } => {
+                f(*array);
+                f(*index);
+            }
+            Expression::GenericSelection {
+                controlling_expr,
+                associations,
+                default_expr,
+            } => {
+                f(*controlling_expr);
+                for (_, expr) in associations {
+                    f(*expr);
+                }
+                if let Some(expr) = default_expr {
+                    f(*expr);
+                }
+            }
+            Expression::IntegerLiteral(_)
+            | Expression::StringLiteral(_)
+            | Expression::CharLiteral(_)
+            | Expression::FloatLiteral(_)
+            | Expression::Variable(_)
+            | Expression::SizeOfType(_)
+            | Expression::AlignOf(_) => {}
+        }
+    }
+}
+
 #[derive(Debug, Clone)]
 #[allow(dead_code)]
 pub enum Statement {
-    Return(Expression),
+    Return(ExprId),
     VariableDeclaration {
-        name: String,
+        name: Symbol,
         data_type: Option<Type>,
-        initializer: Expression,
+        initializer: ExprId,
         is_global: bool,
         alignment: Option<usize>,  // _Alignas specifier - C11
     },
     ArrayDeclaration {
-        name: String,
+        name: Symbol,
         data_type: Option<Type>,
-        size: Option<Expression>,  // None for VLAs determined at runtime
-        initializer: Expression,
+        size: Option<ExprId>,  // None for VLAs determined at runtime
+        initializer: ExprId,
         is_global: bool,
         alignment: Option<usize>,  // _Alignas specifier - C11
     },
     #[allow(clippy::enum_variant_names)]
-    ExpressionStatement(Expression),
-    Block(Vec<Statement>),
+    ExpressionStatement(ExprId),
+    Block(Vec<StmtId>),
     If {
-        condition: Expression,
-        then_block: Box<Statement>,
-        else_block: Option<Box<Statement>>,
+        condition: ExprId,
+        then_block: StmtId,
+        else_block: Option<StmtId>,
     },
     While {
-        condition: Expression,
-        body: Box<Statement>,
+        condition: ExprId,
+        body: StmtId,
     },
     For {
-        initializer: Option<Box<Statement>>,
-        condition: Option<Expression>,
-        increment: Option<Expression>,
-        body: Box<Statement>,
+        initializer: Option<StmtId>,
+        condition: Option<ExprId>,
+        increment: Option<ExprId>,
+        body: StmtId,
     },
     DoWhile {
-        body: Box<Statement>,
-        condition: Expression,
+        body: StmtId,
+        condition: ExprId,
     },
     Break,
     Continue,
     Switch {
-        expression: Expression,
+        expression: ExprId,
         cases: Vec<SwitchCase>,
     },
     Goto(String),  // Goto statement
-    Label(String, Box<Statement>),  // Label statement
+    Label(String, StmtId),  // Label statement
     StaticAssert {  // _Static_assert declaration - C11
-        condition: Expression,
+        condition: ExprId,
         message: String,
     },
-    AtomicBlock(Vec<Statement>),  // Atomic compound statement - C11
+    AtomicBlock(Vec<StmtId>),  // Atomic compound statement - C11
     ThreadLocal {  // _Thread_local declaration - C11
-        declaration: Box<Statement>,
+        declaration: StmtId,
     },
     NoReturn {  // _Noreturn function - C11
-        declaration: Box<Statement>,
+        declaration: StmtId,
     },
 }
 
 #[derive(Debug, Clone)]
 pub struct SwitchCase {
-    pub value: Option<Expression>, // None for default case
-    pub statements: Vec<Statement>,
+    pub value: Option<ExprId>, // None for default case
+    pub statements: Vec<StmtId>,
 }
 
 #[derive(Debug, Clone, PartialEq)]
@@ -378,7 +570,7 @@ impl Type {
 #[derive(Debug, Clone)]
 #[allow(dead_code)]
 pub struct FunctionParameter {
-    pub name: String,
+    pub name: Symbol,
     pub data_type: Type,
 }
 
@@ -399,12 +591,13 @@ pub struct StructField {
 #[derive(Debug, Clone)]
 #[allow(dead_code)]
 pub struct Function {
-    pub name: String,
+    pub name: Symbol,
     pub return_type: Type,
     pub parameters: Vec<FunctionParameter>,
-    pub body: Vec<Statement>,
+    pub body: Vec<StmtId>,
     pub is_variadic: bool,
     pub is_external: bool,
+    pub arena: AstArena, // Owns every node reachable from `body`
 }
 
 #[derive(Debug, Clone)]
@@ -413,18 +606,32 @@ pub struct Program {
     pub functions: Vec<Function>,
     pub structs: Vec<Struct>,
     pub includes: Vec<String>,   // List of include directives for C code
-    pub globals: Vec<Statement>, // Global variable declarations
+    pub globals: Vec<StmtId>,    // Global variable declarations
+    pub arena: AstArena,         // Owns the nodes of `globals`
+    /// Functions marked `#pragma rustcc hot`, which obfuscation keeps lean
+    pub hot_functions: Vec<Symbol>,
+    pub typedefs: Vec<(Symbol, Type)>,       // Typedef names, in declaration order
+    pub enum_constants: Vec<(Symbol, i32)>,  // Enum constants and their values
 }
 
-// C11 Atomic operations
-#[derive(Debug, Clone)]
+impl Program {
+    /// Number of expression and statement nodes in the program
+    pub fn node_count(&self) -> usize {
+        let count = |arena: &AstArena| arena.expr_count() + arena.stmt_count();
+        count(&self.arena) + self.functions.iter().map(|function| count(&function.arena)).sum::<usize>()
+    }
+}
+
+// C11 Atomic operations, sequentially consistent, on a 64-bit object. The
+// first operand is the object itself, written like an assignment's target.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
 #[allow(dead_code)]
 pub enum AtomicOp {
-    Load,
-    Store,
-    Exchange,
-    CompareExchange,
-    FetchAdd,
+    Load,             // (object), giving its value
+    Store,            // (object, value), giving the value stored
+    Exchange,         // (object, value), giving the old value
+    CompareExchange,  // (object, expected, desired), giving the old value
+    FetchAdd,         // (object, value), giving the old value; so do the rest
     FetchSub,
     FetchAnd,
     FetchOr,
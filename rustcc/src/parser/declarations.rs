@@ -1,15 +1,28 @@
-use crate::parser::ast::{Expression, Function, FunctionParameter, Statement, StructField, Type};
+use crate::analyzer::constant::{self, Context};
+use crate::analyzer::types::TypeTable;
+use crate::parser::ast::{
+    AstArena, ExprId, Expression, Function, FunctionParameter, Statement, StmtId, StructField, Type,
+};
 use crate::parser::error::{self, Result};
 use crate::parser::token::TokenType;
-use crate::parser::Parser;
+use crate::parser::symbol::Symbol;
+use crate::parser::{Body, Parser};
 
 impl Parser {
-    /// Parse a function declaration or definition
+    /// Parse a function declaration, or the header of a definition up to
+    /// the `{` of its body
     pub fn parse_function_with_name(
         &mut self,
         return_type: Type,
-        name: String,
+        name: Symbol,
     ) -> Result<Function> {
+        // Each function body gets its own arena, sized from its token count
+        let capacity = self.function_token_count();
+        let outer = std::mem::replace(
+            &mut self.arena,
+            AstArena::with_capacity(capacity, capacity / 2),
+        );
+
         self.consume(TokenType::LeftParen, "Expected '(' after function name")?;
 
         // Parse parameters list
@@ -26,7 +39,7 @@ impl Parser {
                     } else {
                         return Err(self.error(
                             error::ErrorKind::UnexpectedToken(
-                                self.previous().lexeme.clone(),
+                                self.previous().lexeme().to_string(),
                                 "...".to_string(),
                             ),
                             self.current - 1
@@ -40,11 +53,10 @@ impl Parser {
                 // Parse parameter name (optional in C)
                 let param_name = if self.check(TokenType::Identifier) {
                     self.consume(TokenType::Identifier, "Expected parameter name")?
-                        .lexeme
-                        .clone()
+                        .symbol
                 } else {
                     // Anonymous parameter
-                    String::new()
+                    Symbol::intern("")
                 };
 
                 parameters.push(FunctionParameter {
@@ -73,63 +85,47 @@ impl Parser {
                 body: Vec::new(),
                 is_variadic,
                 is_external: true,
+                arena: std::mem::replace(&mut self.arena, outer),
             });
         }
 
         self.consume(TokenType::LeftBrace, "Expected '{' before function body")?;
 
-        let mut body = Vec::new();
-        while !self.check(TokenType::RightBrace) && !self.is_at_end() {
-            body.push(self.parse_statement()?);
-        }
-
-        self.consume(TokenType::RightBrace, "Expected '}' after function body")?;
-
+        // The body is parsed by `parse_body`, once file scope has been read
         Ok(Function {
             name,
             return_type,
             parameters,
-            body,
+            body: Vec::new(),
             is_variadic,
             is_external: false,
+            arena: std::mem::replace(&mut self.arena, outer),
         })
     }
 
+    /// Parse a function body skipped at file scope, into its own arena
+    pub(super) fn parse_body(&mut self, body: &mut Body) {
+        self.current = body.start;
+        self.end = body.end;
+        self.visible = body.visible;
+        self.arena = std::mem::take(&mut body.arena);
+
+        body.statements = self.parse_statements();
+        if let Err(err) = self.consume(TokenType::RightBrace, "Expected '}' after function body") {
+            self.errors.push(err);
+        }
+        body.arena = std::mem::take(&mut self.arena);
+    }
+
     /// Parse a global variable declaration
     pub fn parse_global_variable_with_name(
         &mut self,
         data_type: Type,
-        name: String,
-    ) -> Result<Statement> {
-        // Check for _Alignas specifier (C11)
-        let alignment = if self.match_token(TokenType::Alignas) {
-            self.consume(TokenType::LeftParen, "Expected '(' after _Alignas")?;
-            
-            let alignment = if self.is_type_specifier() {
-                // _Alignas(type)
-                let _type_name = self.parse_type()?;
-                // In a real implementation, we would compute the alignment of the type
-                // For now, we'll just use a placeholder value
-                Some(8)
-            } else {
-                // _Alignas(constant-expression)
-                let expr = self.parse_expression()?;
-                // In a real implementation, we would evaluate the constant expression
-                // For now, we'll just use a placeholder value if it's a literal
-                match expr {
-                    Expression::IntegerLiteral(value) => Some(value as usize),
-                    _ => Some(8), // Default alignment
-                }
-            };
-            
-            self.consume(TokenType::RightParen, "Expected ')' after _Alignas")?;
-            
-            alignment
-        } else {
-            None
-        };
+        name: Symbol,
+    ) -> Result<StmtId> {
+        let alignment = self.parse_alignas()?;
 
-        let mut initializer = Expression::IntegerLiteral(0); // Default initializer
+        let mut initializer = self.push_expr(Expression::IntegerLiteral(0)); // Default initializer
 
         if self.match_token(TokenType::Equal) {
             initializer = self.parse_expression()?;
@@ -140,17 +136,17 @@ impl Parser {
             "Expected ';' after variable declaration",
         )?;
 
-        Ok(Statement::VariableDeclaration {
+        Ok(self.push_stmt(Statement::VariableDeclaration {
             name,
             data_type: Some(data_type),
             initializer,
             is_global: true,
             alignment,
-        })
+        }))
     }
 
     /// Parse a variable declaration
-    pub fn parse_variable_declaration(&mut self) -> Result<Statement> {
+    pub fn parse_variable_declaration(&mut self) -> Result<StmtId> {
         // Parse type qualifiers and storage class specifiers
         let mut is_thread_local = false;
         
@@ -160,44 +156,18 @@ impl Parser {
         
         let data_type = self.parse_type()?;
 
-        // Check for _Alignas specifier (C11)
-        let alignment = if self.match_token(TokenType::Alignas) {
-            self.consume(TokenType::LeftParen, "Expected '(' after _Alignas")?;
-            
-            let alignment = if self.is_type_specifier() {
-                // _Alignas(type)
-                let _type_name = self.parse_type()?;
-                // In a real implementation, we would compute the alignment of the type
-                // For now, we'll just use a placeholder value
-                Some(8)
-            } else {
-                // _Alignas(constant-expression)
-                let expr = self.parse_expression()?;
-                // In a real implementation, we would evaluate the constant expression
-                // For now, we'll just use a placeholder value if it's a literal
-                match expr {
-                    Expression::IntegerLiteral(value) => Some(value as usize),
-                    _ => Some(8), // Default alignment
-                }
-            };
-            
-            self.consume(TokenType::RightParen, "Expected ')' after _Alignas")?;
-            
-            alignment
-        } else {
-            None
-        };
+        let alignment = self.parse_alignas()?;
 
         // Handle array declarations
         let name_token = self.consume(TokenType::Identifier, "Expected variable name")?;
-        let name = name_token.lexeme.clone();
+        let name = name_token.symbol;
 
         // Check if it's an array declaration
         if self.match_token(TokenType::LeftBracket) {
             // Array declaration
             let size_expr = if self.match_token(TokenType::Star) {
                 // VLA with unspecified size [*]
-                Some(Expression::IntegerLiteral(-1)) // Special marker for [*]
+                Some(self.push_expr(Expression::IntegerLiteral(-1))) // Special marker for [*]
             } else if !self.check(TokenType::RightBracket) {
                 Some(self.parse_expression()?)
             } else {
@@ -232,13 +202,13 @@ impl Parser {
                         "Expected '}' after array initializer",
                     )?;
 
-                    Expression::ArrayLiteral(elements)
+                    self.push_expr(Expression::ArrayLiteral(elements))
                 } else {
                     self.parse_expression()?
                 }
             } else {
                 // Default initialization
-                Expression::ArrayLiteral(Vec::new())
+                self.push_expr(Expression::ArrayLiteral(Vec::new()))
             };
 
             self.consume(
@@ -246,20 +216,20 @@ impl Parser {
                 "Expected ';' after variable declaration",
             )?;
 
-            let declaration = Statement::ArrayDeclaration {
+            let declaration = self.push_stmt(Statement::ArrayDeclaration {
                 name,
                 data_type: Some(data_type),
                 size: size_expr,
                 initializer,
                 is_global: false,
                 alignment,
-            };
+            });
             
             // Wrap in ThreadLocal if needed
             if is_thread_local {
-                return Ok(Statement::ThreadLocal {
-                    declaration: Box::new(declaration),
-                });
+                return Ok(self.push_stmt(Statement::ThreadLocal {
+                    declaration,
+                }));
             } else {
                 return Ok(declaration);
             }
@@ -271,10 +241,10 @@ impl Parser {
         } else {
             // Default initialization
             match data_type {
-                Type::Int => Expression::IntegerLiteral(0),
-                Type::Char => Expression::CharLiteral('\0'),
-                Type::Float | Type::Double => Expression::FloatLiteral(0.0),
-                _ => Expression::IntegerLiteral(0),
+                Type::Int => self.push_expr(Expression::IntegerLiteral(0)),
+                Type::Char => self.push_expr(Expression::CharLiteral('\0')),
+                Type::Float | Type::Double => self.push_expr(Expression::FloatLiteral(0.0)),
+                _ => self.push_expr(Expression::IntegerLiteral(0)),
             }
         };
 
@@ -283,19 +253,19 @@ impl Parser {
             "Expected ';' after variable declaration",
         )?;
 
-        let declaration = Statement::VariableDeclaration {
+        let declaration = self.push_stmt(Statement::VariableDeclaration {
             name,
             data_type: Some(data_type),
             initializer,
             is_global: false,
             alignment,
-        };
+        });
         
         // Wrap in ThreadLocal if needed
         if is_thread_local {
-            Ok(Statement::ThreadLocal {
-                declaration: Box::new(declaration),
-            })
+            Ok(self.push_stmt(Statement::ThreadLocal {
+                declaration,
+            }))
         } else {
             Ok(declaration)
         }
@@ -305,8 +275,8 @@ impl Parser {
     pub fn parse_struct(&mut self) -> Result<crate::parser::ast::Struct> {
         let name = self
             .consume(TokenType::Identifier, "Expected struct name")?
-            .lexeme
-            .clone();
+            .lexeme()
+            .to_string();
 
         // Check if this is just a forward declaration
         if self.match_token(TokenType::Semicolon) {
@@ -359,8 +329,8 @@ impl Parser {
             loop {
                 let field_name = self
                     .consume(TokenType::Identifier, "Expected field name")?
-                    .lexeme
-                    .clone();
+                    .lexeme()
+                    .to_string();
 
                 // Check for array field
                 let field_type = if self.match_token(TokenType::LeftBracket) {
@@ -412,61 +382,51 @@ impl Parser {
         Ok(crate::parser::ast::Struct { name, fields })
     }
 
-    /// Parse a typedef declaration
+    /// Parse a typedef declaration, remembering the name so that it's
+    /// recognised as a type from here on
     pub fn parse_typedef(&mut self) -> Result<()> {
         // Skip the 'typedef' keyword (already consumed)
 
         // Parse the base type
-        let _base_type = self.parse_type()?;
+        let base_type = self.parse_type()?;
 
         // Parse the new type name
-        let _new_type_name = self
-            .consume(TokenType::Identifier, "Expected new type name")?
-            .lexeme
-            .clone();
+        let name = self.consume(TokenType::Identifier, "Expected new type name")?.symbol;
 
         self.consume(TokenType::Semicolon, "Expected ';' after typedef")?;
 
-        // In a full implementation, we would register this typedef in a symbol table
-        // For now, we'll just acknowledge it
-
+        let declarations = self.declarations_mut();
+        declarations.typedefs.push((name, base_type));
+        let declared = declarations.typedefs.len();
+        declarations.type_names.entry(name).or_insert(declared);
         Ok(())
     }
 
-    /// Parse an enum declaration
+    /// Parse an enum declaration, recording the value of each constant
     pub fn parse_enum(&mut self) -> Result<()> {
         // Skip the 'enum' keyword (already consumed)
 
         // Parse the enum name (optional)
-        let _enum_name = if self.check(TokenType::Identifier) {
-            Some(self.consume(TokenType::Identifier, "")?.lexeme.clone())
-        } else {
-            None
-        };
+        if self.check(TokenType::Identifier) {
+            self.advance();
+        }
 
         self.consume(TokenType::LeftBrace, "Expected '{' after enum name")?;
 
-        let mut _value = 0; // Track the implicit enum value
+        let mut value = 0; // Track the implicit enum value
 
         // Parse enum constants
         while !self.check(TokenType::RightBrace) {
-            let _const_name = self
-                .consume(TokenType::Identifier, "Expected enum constant name")?
-                .lexeme
-                .clone();
+            let name = self.consume(TokenType::Identifier, "Expected enum constant name")?.symbol;
 
             // Check for explicit value
             if self.match_token(TokenType::Equal) {
                 let expr = self.parse_expression()?;
-
-                // In a full implementation, we would evaluate the constant expression
-                // For now, we'll just acknowledge it
-                if let Expression::IntegerLiteral(val) = expr {
-                    _value = val;
-                }
+                value = self.evaluate_constant(expr)? as i32;
             }
 
-            _value += 1; // Increment for next constant
+            self.declarations_mut().enum_constants.push((name, value));
+            value = value.wrapping_add(1); // Increment for next constant
 
             // Check for comma
             if !self.match_token(TokenType::Comma) {
@@ -484,4 +444,71 @@ impl Parser {
 
         Ok(())
     }
+
+    /// Parse an optional _Alignas specifier (C11), returning the alignment
+    /// it asks for
+    fn parse_alignas(&mut self) -> Result<Option<usize>> {
+        if !self.match_token(TokenType::Alignas) {
+            return Ok(None);
+        }
+        self.consume(TokenType::LeftParen, "Expected '(' after _Alignas")?;
+
+        let alignment = if self.is_type_specifier() {
+            // _Alignas(type)
+            let typ = self.parse_type()?;
+            match self.align_of_type(&typ) {
+                Some(alignment) => alignment as i64,
+                None => {
+                    return Err(self.error(
+                        error::ErrorKind::InvalidType(format!("_Alignas of incomplete type {:?}", typ)),
+                        self.current - 1,
+                    ))
+                }
+            }
+        } else {
+            // _Alignas(constant-expression)
+            let expr = self.parse_expression()?;
+            self.evaluate_constant(expr)?
+        };
+
+        self.consume(TokenType::RightParen, "Expected ')' after _Alignas")?;
+
+        // _Alignas(0) has no effect; any other alignment is a power of two
+        match alignment {
+            0 => Ok(None),
+            alignment if alignment > 0 && (alignment as u64).is_power_of_two() => Ok(Some(alignment as usize)),
+            alignment => Err(self.error(
+                error::ErrorKind::InvalidType(format!("invalid alignment {}", alignment)),
+                self.current - 1,
+            )),
+        }
+    }
+
+    // The value of the constant expression `expr`, which ends at the
+    // previous token
+    fn evaluate_constant(&self, expr: ExprId) -> Result<i64> {
+        constant::evaluate(&self.arena, expr, self).ok_or_else(|| {
+            self.error(
+                error::ErrorKind::UnexpectedToken(self.previous().lexeme().to_string(), "integer constant".to_string()),
+                self.current - 1,
+            )
+        })
+    }
+}
+
+/// Constant expressions in declarations see the enum constants, typedefs
+/// and structs declared before them
+impl Context for Parser {
+    fn enum_constant(&self, _expr: ExprId, name: Symbol) -> Option<i64> {
+        let (_, value) = self.enum_constants().iter().rev().find(|&&(constant, _)| constant == name)?;
+        Some(i64::from(*value))
+    }
+
+    fn size_of_type(&self, typ: &Type) -> Option<usize> {
+        TypeTable::declared(self.typedefs(), self.structs(), &[]).size_of_type(typ)
+    }
+
+    fn align_of_type(&self, typ: &Type) -> Option<usize> {
+        TypeTable::declared(self.typedefs(), self.structs(), &[]).align_of_type(typ)
+    }
 }
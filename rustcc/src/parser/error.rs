@@ -1,5 +1,6 @@
 use crate::parser::token::Token;
 use std::fmt;
+use std::sync::OnceLock;
 
 /// Represents the location of an error in the source code
 #[derive(Debug, Clone, PartialEq, Eq)]
@@ -21,8 +22,8 @@ impl fmt::Display for SourceLocation {
 impl From<&Token> for SourceLocation {
     fn from(token: &Token) -> Self {
         SourceLocation {
-            line: token.line,
-            column: token.column,
+            line: token.line as usize,
+            column: token.column as usize,
             file: None,
         }
     }
@@ -238,5 +239,29 @@ impl Error {
     }
 }
 
+/// Source text, with where each of its lines starts worked out the first
+/// time one is quoted
+#[derive(Debug)]
+pub struct SourceLines {
+    text: String,
+    starts: OnceLock<Vec<usize>>,
+}
+
+impl SourceLines {
+    pub fn new(text: String) -> Self {
+        SourceLines { text, starts: OnceLock::new() }
+    }
+
+    /// Line `line`, counting from 1, without its line break
+    pub fn line(&self, line: usize) -> Option<&str> {
+        let starts = self.starts.get_or_init(|| {
+            std::iter::once(0).chain(self.text.match_indices('\n').map(|(offset, _)| offset + 1)).collect()
+        });
+        let start = *starts.get(line.checked_sub(1)?)?;
+        let end = starts.get(line).map_or(self.text.len(), |&next| next - 1);
+        Some(self.text[start..end].trim_end_matches('\r'))
+    }
+}
+
 /// Result type for the parser
 pub type Result<T> = std::result::Result<T, Error>;
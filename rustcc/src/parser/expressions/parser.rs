@@ -1,31 +1,31 @@
 use crate::parser::error::{self, Result};
-use crate::parser::ast::{BinaryOp, Expression, OperatorType, UnaryOp};
+use crate::parser::ast::{BinaryOp, ExprId, Expression, OperatorType, UnaryOp};
 use crate::parser::token::{Token, TokenType};
 use crate::parser::Parser;
 
 impl Parser {
     /// Parse an expression
-    pub fn parse_expression(&mut self) -> Result<Expression> {
+    pub fn parse_expression(&mut self) -> Result<ExprId> {
         self.parse_assignment()
     }
 
     /// Parse an assignment expression
-    fn parse_assignment(&mut self) -> Result<Expression> {
+    fn parse_assignment(&mut self) -> Result<ExprId> {
         let expr = self.parse_ternary()?;
 
         if self.match_token(TokenType::Equal) {
             let value = self.parse_assignment()?;
 
             // Validate that the left side is a valid assignment target
-            match expr {
+            match self.arena[expr] {
                 Expression::Variable(_)
                 | Expression::ArrayAccess { .. }
                 | Expression::StructFieldAccess { .. }
                 | Expression::PointerFieldAccess { .. } => {
-                    return Ok(Expression::Assignment {
-                        target: Box::new(expr),
-                        value: Box::new(value),
-                    });
+                    return Ok(self.push_expr(Expression::Assignment {
+                        target: expr,
+                        value,
+                    }));
                 }
                 _ => {
                     return Err(self.error(
@@ -40,7 +40,7 @@ impl Parser {
     }
 
     /// Parse a ternary conditional expression
-    fn parse_ternary(&mut self) -> Result<Expression> {
+    fn parse_ternary(&mut self) -> Result<ExprId> {
         let expr = self.parse_logical_or()?;
 
         if self.match_token(TokenType::Question) {
@@ -48,98 +48,98 @@ impl Parser {
             self.consume(TokenType::Colon, "Expected ':' in ternary expression")?;
             let else_expr = self.parse_ternary()?;
 
-            return Ok(Expression::TernaryIf {
-                condition: Box::new(expr),
-                then_expr: Box::new(then_expr),
-                else_expr: Box::new(else_expr),
-            });
+            return Ok(self.push_expr(Expression::TernaryIf {
+                condition: expr,
+                then_expr,
+                else_expr,
+            }));
         }
 
         Ok(expr)
     }
 
     /// Parse a logical OR expression
-    fn parse_logical_or(&mut self) -> Result<Expression> {
+    fn parse_logical_or(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_logical_and()?;
 
         while self.match_token(TokenType::Or) || self.match_token(TokenType::LogicalOr) {
             let right = self.parse_logical_and()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator: BinaryOp::LogicalOr,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse a logical AND expression
-    fn parse_logical_and(&mut self) -> Result<Expression> {
+    fn parse_logical_and(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_bitwise_or()?;
 
         while self.match_token(TokenType::And) || self.match_token(TokenType::LogicalAnd) {
             let right = self.parse_bitwise_or()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator: BinaryOp::LogicalAnd,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse a bitwise OR expression
-    fn parse_bitwise_or(&mut self) -> Result<Expression> {
+    fn parse_bitwise_or(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_bitwise_xor()?;
 
         while self.match_token(TokenType::Pipe) || self.match_token(TokenType::BitwiseOr) {
             let right = self.parse_bitwise_xor()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator: BinaryOp::BitwiseOr,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse a bitwise XOR expression
-    fn parse_bitwise_xor(&mut self) -> Result<Expression> {
+    fn parse_bitwise_xor(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_bitwise_and()?;
 
         while self.match_token(TokenType::Caret) || self.match_token(TokenType::BitwiseXor) {
             let right = self.parse_bitwise_and()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator: BinaryOp::BitwiseXor,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse a bitwise AND expression
-    fn parse_bitwise_and(&mut self) -> Result<Expression> {
+    fn parse_bitwise_and(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_equality()?;
 
         while self.match_token(TokenType::Ampersand) || self.match_token(TokenType::BitwiseAnd) {
             let right = self.parse_equality()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator: BinaryOp::BitwiseAnd,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse an equality expression
-    fn parse_equality(&mut self) -> Result<Expression> {
+    fn parse_equality(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_comparison()?;
 
         while self.match_token(TokenType::EqualEqual) || self.match_token(TokenType::BangEqual) {
@@ -149,18 +149,18 @@ impl Parser {
                 _ => unreachable!(),
             };
             let right = self.parse_comparison()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse a comparison expression
-    fn parse_comparison(&mut self) -> Result<Expression> {
+    fn parse_comparison(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_shift()?;
 
         while self.match_token(TokenType::Less)
@@ -176,18 +176,18 @@ impl Parser {
                 _ => unreachable!(),
             };
             let right = self.parse_shift()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
     
     /// Parse a shift expression
-    fn parse_shift(&mut self) -> Result<Expression> {
+    fn parse_shift(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_term()?;
 
         while self.match_token(TokenType::ShiftLeft)
@@ -201,18 +201,18 @@ impl Parser {
                 _ => unreachable!(),
             };
             let right = self.parse_term()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse a term expression
-    fn parse_term(&mut self) -> Result<Expression> {
+    fn parse_term(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_factor()?;
 
         while self.match_token(TokenType::Plus) || self.match_token(TokenType::Minus) {
@@ -222,18 +222,18 @@ impl Parser {
                 _ => unreachable!(),
             };
             let right = self.parse_factor()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse a factor expression
-    fn parse_factor(&mut self) -> Result<Expression> {
+    fn parse_factor(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_unary()?;
 
         while self.match_token(TokenType::Star)
@@ -247,18 +247,18 @@ impl Parser {
                 _ => unreachable!(),
             };
             let right = self.parse_unary()?;
-            expr = Expression::BinaryOperation {
-                left: Box::new(expr),
+            expr = self.push_expr(Expression::BinaryOperation {
+                left: expr,
                 operator,
-                right: Box::new(right),
-            };
+                right,
+            });
         }
 
         Ok(expr)
     }
 
     /// Parse a unary expression
-    fn parse_unary(&mut self) -> Result<Expression> {
+    fn parse_unary(&mut self) -> Result<ExprId> {
         if self.match_token(TokenType::Bang)
             || self.match_token(TokenType::Minus)
             || self.match_token(TokenType::Tilde)
@@ -284,10 +284,10 @@ impl Parser {
                 _ => unreachable!(),
             };
             let operand = self.parse_unary()?;
-            return Ok(Expression::UnaryOperation {
+            return Ok(self.push_expr(Expression::UnaryOperation {
                 operator,
-                operand: Box::new(operand),
-            });
+                operand,
+            }));
         }
 
         if self.match_token(TokenType::Sizeof) {
@@ -299,19 +299,20 @@ impl Parser {
                 self.consume(TokenType::RightParen, "Expected ')' after sizeof type")?;
 
                 // Create a dummy expression for the type
-                let dummy_expr = Expression::Cast {
+                let zero = self.push_expr(Expression::IntegerLiteral(0));
+                let dummy_expr = self.push_expr(Expression::Cast {
                     target_type: type_name,
-                    expr: Box::new(Expression::IntegerLiteral(0)),
-                };
+                    expr: zero,
+                });
 
-                return Ok(Expression::SizeOf(Box::new(dummy_expr)));
+                return Ok(self.push_expr(Expression::SizeOf(dummy_expr)));
             } else {
                 let expr = self.parse_expression()?;
                 self.consume(
                     TokenType::RightParen,
                     "Expected ')' after sizeof expression",
                 )?;
-                return Ok(Expression::SizeOf(Box::new(expr)));
+                return Ok(self.push_expr(Expression::SizeOf(expr)));
             }
         }
 
@@ -319,7 +320,7 @@ impl Parser {
     }
 
     /// Parse a postfix expression
-    fn parse_postfix(&mut self) -> Result<Expression> {
+    fn parse_postfix(&mut self) -> Result<ExprId> {
         let mut expr = self.parse_primary()?;
 
         loop {
@@ -327,30 +328,30 @@ impl Parser {
                 // Array access
                 let index = self.parse_expression()?;
                 self.consume(TokenType::RightBracket, "Expected ']' after array index")?;
-                expr = Expression::ArrayAccess {
-                    array: Box::new(expr),
-                    index: Box::new(index),
-                };
+                expr = self.push_expr(Expression::ArrayAccess {
+                    array: expr,
+                    index,
+                });
             } else if self.match_token(TokenType::Dot) {
                 // Struct field access
                 let field = self
                     .consume(TokenType::Identifier, "Expected field name after '.'")?
-                    .lexeme
-                    .clone();
-                expr = Expression::StructFieldAccess {
-                    object: Box::new(expr),
+                    .lexeme()
+                    .to_string();
+                expr = self.push_expr(Expression::StructFieldAccess {
+                    object: expr,
                     field,
-                };
+                });
             } else if self.match_token(TokenType::Arrow) {
                 // Pointer field access
                 let field = self
                     .consume(TokenType::Identifier, "Expected field name after '->'")?
-                    .lexeme
-                    .clone();
-                expr = Expression::PointerFieldAccess {
-                    pointer: Box::new(expr),
+                    .lexeme()
+                    .to_string();
+                expr = self.push_expr(Expression::PointerFieldAccess {
+                    pointer: expr,
                     field,
-                };
+                });
             } else if self.match_token(TokenType::LeftParen) {
                 // Function call
                 let mut arguments = Vec::new();
@@ -370,7 +371,7 @@ impl Parser {
                 )?;
 
                 // Extract function name from expression
-                let name = match expr {
+                let name = match self.arena[expr] {
                     Expression::Variable(name) => name,
                     _ => {
                         return Err(self.error(
@@ -380,23 +381,23 @@ impl Parser {
                     }
                 };
 
-                expr = Expression::FunctionCall { name, arguments };
+                expr = self.push_expr(Expression::FunctionCall { name, arguments });
             } else if self.match_token(TokenType::Increment)
                 || self.match_token(TokenType::PlusPlus)
             {
                 // Post-increment
-                expr = Expression::UnaryOperation {
+                expr = self.push_expr(Expression::UnaryOperation {
                     operator: OperatorType::Unary(UnaryOp::PostIncrement),
-                    operand: Box::new(expr),
-                };
+                    operand: expr,
+                });
             } else if self.match_token(TokenType::Decrement)
                 || self.match_token(TokenType::MinusMinus)
             {
                 // Post-decrement
-                expr = Expression::UnaryOperation {
+                expr = self.push_expr(Expression::UnaryOperation {
                     operator: OperatorType::Unary(UnaryOp::PostDecrement),
-                    operand: Box::new(expr),
-                };
+                    operand: expr,
+                });
             } else {
                 break;
             }
@@ -406,29 +407,29 @@ impl Parser {
     }
 
     /// Parse a primary expression
-    fn parse_primary(&mut self) -> Result<Expression> {
+    fn parse_primary(&mut self) -> Result<ExprId> {
         if self.match_token(TokenType::IntegerLiteral) {
-            let value = self.previous().lexeme.parse::<i32>().unwrap_or(0);
-            return Ok(Expression::IntegerLiteral(value));
+            let value = self.previous().lexeme().parse::<i32>().unwrap_or(0);
+            return Ok(self.push_expr(Expression::IntegerLiteral(value)));
         }
 
         if self.match_token(TokenType::FloatLiteral) {
-            let value = self.previous().lexeme.parse::<f64>().unwrap_or(0.0);
-            return Ok(Expression::FloatLiteral(value));
+            let value = self.previous().lexeme().parse::<f64>().unwrap_or(0.0);
+            return Ok(self.push_expr(Expression::FloatLiteral(value)));
         }
 
         if self.match_token(TokenType::StringLiteral) {
-            let value = self.previous().lexeme.clone();
-            return Ok(Expression::StringLiteral(value));
+            let value = self.previous().lexeme().to_string();
+            return Ok(self.push_expr(Expression::StringLiteral(value)));
         }
 
         if self.match_token(TokenType::CharLiteral) {
-            let value = self.previous().lexeme.chars().next().unwrap_or('\0');
-            return Ok(Expression::CharLiteral(value));
+            let value = self.previous().lexeme().chars().next().unwrap_or('\0');
+            return Ok(self.push_expr(Expression::CharLiteral(value)));
         }
 
         if self.match_token(TokenType::Identifier) {
-            return Ok(Expression::Variable(self.previous().lexeme.clone()));
+            return Ok(self.push_expr(Expression::Variable(self.previous().symbol)));
         }
 
         if self.match_token(TokenType::LeftParen) {
@@ -441,10 +442,10 @@ impl Parser {
                 // Parse the expression being cast
                 let expr = self.parse_unary()?;
                 
-                return Ok(Expression::Cast {
+                return Ok(self.push_expr(Expression::Cast {
                     target_type: cast_type,
-                    expr: Box::new(expr),
-                });
+                    expr,
+                }));
             }
             
             // Check for compound literal: (type){initializers}
@@ -476,10 +477,10 @@ impl Parser {
                 
                 self.consume(TokenType::RightBrace, "Expected '}' after compound literal initializers")?;
                 
-                return Ok(Expression::CompoundLiteral {
+                return Ok(self.push_expr(Expression::CompoundLiteral {
                     type_name,
                     initializers,
-                });
+                }));
             }
 
             // Regular parenthesized expression
@@ -499,17 +500,17 @@ impl Parser {
                     // sizeof(type)
                     let type_name = self.parse_type()?;
                     self.consume(TokenType::RightParen, "Expected ')' after type in sizeof")?;
-                    return Ok(Expression::SizeOfType(type_name));
+                    return Ok(self.push_expr(Expression::SizeOfType(type_name)));
                 } else {
                     // sizeof(expr)
                     let expr = self.parse_expression()?;
                     self.consume(TokenType::RightParen, "Expected ')' after expression in sizeof")?;
-                    return Ok(Expression::SizeOf(Box::new(expr)));
+                    return Ok(self.push_expr(Expression::SizeOf(expr)));
                 }
             } else {
                 // sizeof expr (without parentheses)
                 let expr = self.parse_unary()?;
-                return Ok(Expression::SizeOf(Box::new(expr)));
+                return Ok(self.push_expr(Expression::SizeOf(expr)));
             }
         }
 
@@ -518,7 +519,7 @@ impl Parser {
             self.consume(TokenType::LeftParen, "Expected '(' after _Alignof")?;
             let type_name = self.parse_type()?;
             self.consume(TokenType::RightParen, "Expected ')' after type in _Alignof")?;
-            return Ok(Expression::AlignOf(type_name));
+            return Ok(self.push_expr(Expression::AlignOf(type_name)));
         }
 
         if self.match_token(TokenType::Generic) {
@@ -538,7 +539,7 @@ impl Parser {
                 if self.match_token(TokenType::Default) {
                     // default: expr
                     self.consume(TokenType::Colon, "Expected ':' after 'default' in _Generic")?;
-                    default_expr = Some(Box::new(self.parse_expression()?));
+                    default_expr = Some(self.parse_expression()?);
                 } else {
                     // type: expr
                     let type_name = self.parse_type()?;
@@ -559,11 +560,11 @@ impl Parser {
             
             self.consume(TokenType::RightParen, "Expected ')' after _Generic associations")?;
             
-            return Ok(Expression::GenericSelection {
-                controlling_expr: Box::new(controlling_expr),
+            return Ok(self.push_expr(Expression::GenericSelection {
+                controlling_expr,
                 associations,
                 default_expr,
-            });
+            }));
         }
 
         if self.match_token(TokenType::StaticAssert) {
@@ -577,14 +578,14 @@ impl Parser {
             
             // Parse the message string
             let message_token = self.consume(TokenType::StringLiteral, "Expected string literal message in _Static_assert")?;
-            let message = message_token.lexeme.clone();
+            let message = message_token.lexeme().to_string();
             
             self.consume(TokenType::RightParen, "Expected ')' after _Static_assert")?;
             
-            return Ok(Expression::StaticAssert {
-                condition: Box::new(condition),
+            return Ok(self.push_expr(Expression::StaticAssert {
+                condition,
                 message,
-            });
+            }));
         }
 
         if self.match_token(TokenType::LeftBrace) {
@@ -610,7 +611,7 @@ impl Parser {
                 TokenType::RightBrace,
                 "Expected '}' after array initializer",
             )?;
-            return Ok(Expression::ArrayLiteral(elements));
+            return Ok(self.push_expr(Expression::ArrayLiteral(elements)));
         }
 
         Err(self.unexpected_token_error("expression"))
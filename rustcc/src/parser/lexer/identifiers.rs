@@ -1,24 +1,28 @@
 // identifiers.rs
 // Handling of identifiers and keywords
 
+use crate::parser::lexer::token_definitions::lookup_keyword;
 use crate::parser::lexer::utils::is_alphanumeric;
 use crate::parser::lexer::Lexer;
 use crate::parser::token::TokenType;
 
-impl Lexer {
+impl<'a> Lexer<'a> {
     /// Handles an identifier (or keyword)
     pub(crate) fn handle_identifier(&mut self) {
         while is_alphanumeric(self.peek()) {
             self.advance();
         }
 
-        let text = self.source[self.start..self.current].to_string();
+        let text = self.lexeme();
 
         // Check if it's a keyword
-        if let Some(token_type) = self.keywords.get(&text) {
-            self.add_token(token_type.clone());
+        if let Some(token_type) = lookup_keyword(text) {
+            self.add_token(token_type);
         } else {
-            self.add_token_with_literal(TokenType::Identifier, text);
+            // The literal of an identifier is its own name, so intern once
+            let mut token = self.make_token(TokenType::Identifier, None);
+            token.literal = Some(token.symbol);
+            self.tokens.push(token);
         }
     }
 }
@@ -1,23 +1,25 @@
 // literals.rs
 // Handling of string, character, and numeric literals
 
+use std::borrow::Cow;
+
 use crate::parser::lexer::utils::{is_digit, is_hex_digit, is_octal_digit};
 use crate::parser::lexer::Lexer;
 use crate::parser::token::TokenType;
 
-impl Lexer {
+impl<'a> Lexer<'a> {
     /// Handles string literals
     pub(crate) fn handle_string_literal(&mut self) {
         // Check for prefixed string literals: L"string", u"string", U"string", u8"string"
         if self.current > 1 {
-            let prev_char = self.source.chars().nth(self.current - 2).unwrap_or('\0');
-            if prev_char == 'L' {
+            let prev_char = self.byte_at(self.current - 2);
+            if prev_char == b'L' {
                 self.string_with_type(TokenType::U32StringLiteral);
                 return;
-            } else if prev_char == 'u' {
+            } else if prev_char == b'u' {
                 if self.current > 2
-                    && self.source.chars().nth(self.current - 3).unwrap_or('\0') == 'u'
-                    && self.source.chars().nth(self.current - 2).unwrap_or('\0') == '8'
+                    && self.byte_at(self.current - 3) == b'u'
+                    && self.byte_at(self.current - 2) == b'8'
                 {
                     // Handle u8"string"
                     self.string_with_type(TokenType::U8StringLiteral);
@@ -26,7 +28,7 @@ impl Lexer {
                 // Handle u"string"
                 self.string_with_type(TokenType::UStringLiteral);
                 return;
-            } else if prev_char == 'U' {
+            } else if prev_char == b'U' {
                 // Handle U"string"
                 self.string_with_type(TokenType::U16StringLiteral);
                 return;
@@ -40,14 +42,14 @@ impl Lexer {
     pub(crate) fn handle_char_literal(&mut self) {
         // Check for prefixed char literals: L'x', u'x', U'x'
         if self.current > 1 {
-            let prev_char = self.source.chars().nth(self.current - 2).unwrap_or('\0');
-            if prev_char == 'L' {
+            let prev_char = self.byte_at(self.current - 2);
+            if prev_char == b'L' {
                 self.char_literal_with_type(TokenType::WideLiteral);
                 return;
-            } else if prev_char == 'u' {
+            } else if prev_char == b'u' {
                 self.char_literal_with_type(TokenType::UCharLiteral);
                 return;
-            } else if prev_char == 'U' {
+            } else if prev_char == b'U' {
                 // Handle U'x' - C11 Unicode character literal
                 self.char_literal_with_type(TokenType::U16StringLiteral);
                 return;
@@ -79,13 +81,13 @@ impl Lexer {
         self.advance();
 
         // Extract the string value (without the quotes)
-        let value = self.source[self.start + 1..self.current - 1].to_string();
+        let value = &self.source[self.start + 1..self.current - 1];
         
         // Process escape sequences
         let processed_value = self.process_escape_sequences(value);
         
         // Add the token with the processed value
-        self.add_token_with_literal(TokenType::StringLiteral, processed_value);
+        self.add_token_with_literal(TokenType::StringLiteral, &processed_value);
     }
 
     /// Process a character literal
@@ -110,7 +112,7 @@ impl Lexer {
         self.advance();
 
         // Extract the character value (without the quotes)
-        let value = self.source[self.start + 1..self.current - 1].to_string();
+        let value = &self.source[self.start + 1..self.current - 1];
         
         // Process escape sequences
         let processed_value = self.process_escape_sequences(value);
@@ -121,7 +123,7 @@ impl Lexer {
             // We'll accept them but might want to warn
         }
         
-        self.add_token_with_literal(TokenType::CharLiteral, processed_value);
+        self.add_token_with_literal(TokenType::CharLiteral, &processed_value);
     }
 
     /// Process a string literal with a specific type (L, u, U, u8)
@@ -156,13 +158,13 @@ impl Lexer {
         self.advance();
 
         // Extract the string value (without the quotes and prefix)
-        let value = self.source[self.start + prefix_len..self.current - 1].to_string();
+        let value = &self.source[self.start + prefix_len..self.current - 1];
         
         // Process escape sequences
         let processed_value = self.process_escape_sequences(value);
         
         // Add the token with the processed value
-        self.add_token_with_literal(token_type, processed_value);
+        self.add_token_with_literal(token_type, &processed_value);
         
         // Restore original start position
         self.start = original_start;
@@ -195,13 +197,13 @@ impl Lexer {
         self.advance();
 
         // Extract the character value (without the quotes and prefix)
-        let value = self.source[self.start + 2..self.current - 1].to_string();
+        let value = &self.source[self.start + 2..self.current - 1];
         
         // Process escape sequences
         let processed_value = self.process_escape_sequences(value);
         
         // Add the token with the processed value
-        self.add_token_with_literal(token_type, processed_value);
+        self.add_token_with_literal(token_type, &processed_value);
         
         // Restore original start position
         self.start = original_start;
@@ -209,7 +211,12 @@ impl Lexer {
 
     /// Process escape sequences in string and character literals
     /// Handles all standard C escape sequences including hex, octal, and Unicode
-    fn process_escape_sequences(&self, value: String) -> String {
+    fn process_escape_sequences(&self, value: &'a str) -> Cow<'a, str> {
+        // The common case has nothing to unescape, so hand back the source slice
+        if !value.contains('\\') {
+            return Cow::Borrowed(value);
+        }
+
         let mut result = String::new();
         let mut chars = value.chars().peekable();
         
@@ -368,7 +375,7 @@ impl Lexer {
             }
         }
         
-        result
+        Cow::Owned(result)
     }
 
     /// Handles numeric literals (integer or floating-point)
@@ -384,7 +391,7 @@ impl Lexer {
             }
 
             // Extract the value
-            let value = self.source[self.start..self.current].to_string();
+            let value = &self.source[self.start..self.current];
             self.add_token_with_literal(TokenType::IntegerLiteral, value);
             return;
         } else if self.peek() == 'b' || self.peek() == 'B' {
@@ -397,10 +404,10 @@ impl Lexer {
             }
 
             // Extract the value
-            let value = self.source[self.start..self.current].to_string();
+            let value = &self.source[self.start..self.current];
             self.add_token_with_literal(TokenType::IntegerLiteral, value);
             return;
-        } else if self.source.chars().nth(self.start).unwrap() == '0' && is_octal_digit(self.peek())
+        } else if self.byte_at(self.start) == b'0' && is_octal_digit(self.peek())
         {
             // Octal literal (0...)
             // Read octal digits
@@ -409,7 +416,7 @@ impl Lexer {
             }
 
             // Extract the value
-            let value = self.source[self.start..self.current].to_string();
+            let value = &self.source[self.start..self.current];
             self.add_token_with_literal(TokenType::IntegerLiteral, value);
             return;
         }
@@ -479,7 +486,7 @@ impl Lexer {
         }
 
         // Extract the value
-        let value = self.source[self.start..self.current].to_string();
+        let value = &self.source[self.start..self.current];
 
         // Add the token with the appropriate type
         if is_float {
@@ -10,34 +10,33 @@ mod scanner;
 mod token_definitions;
 mod utils;
 
-use crate::parser::token::{Token, TokenType};
-use std::collections::HashMap;
+use crate::parser::token::Token;
 
 /// The Lexer struct is responsible for tokenizing C source code.
 /// It scans a source string and produces a sequence of tokens that
 /// represent the lexical structure of the code.
-pub struct Lexer {
-    source: String,
+///
+/// The lexer borrows the source text and walks it as a byte cursor:
+/// `start` and `current` are byte offsets. Token text is interned, so the
+/// produced tokens do not borrow from the source.
+pub struct Lexer<'a> {
+    source: &'a str,
     tokens: Vec<Token>,
     start: usize,
     current: usize,
     line: usize,
     column: usize,
-    keywords: HashMap<String, TokenType>,
     // Flag to indicate if we're at the start of a line (for preprocessor directives)
     at_line_start: bool,
     // Track included files
     includes: Vec<String>,
 }
 
-impl Lexer {
+impl<'a> Lexer<'a> {
     /// Creates a new lexer for the given source code
-    pub fn new(mut source: String) -> Self {
+    pub fn new(source: &'a str) -> Self {
         // Remove UTF-8 BOM if present
-        if source.starts_with("\u{FEFF}") {
-            source = source.trim_start_matches("\u{FEFF}").to_string();
-        }
-        let keywords = token_definitions::init_keywords();
+        let source = source.trim_start_matches('\u{FEFF}');
 
         Lexer {
             source,
@@ -46,9 +45,37 @@ impl Lexer {
             current: 0,
             line: 1,
             column: 1,
-            keywords,
             at_line_start: true,
             includes: Vec::new(),
         }
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parser::token::TokenType;
+
+    #[test]
+    fn test_token_text_and_spans() {
+        let source = "int main() { char *s = \"h\u{e9}llo\"; return 42; }";
+        let mut lexer = Lexer::new(source);
+        let tokens = lexer.scan_tokens();
+
+        let kinds: Vec<TokenType> = tokens.iter().map(|t| t.token_type).collect();
+        assert_eq!(kinds[0], TokenType::Int);
+        assert_eq!(tokens[1].lexeme(), "main");
+        assert_eq!(tokens.last().unwrap().token_type, TokenType::Eof);
+
+        let string = tokens
+            .iter()
+            .find(|t| t.token_type == TokenType::StringLiteral)
+            .unwrap();
+        assert_eq!(string.lexeme(), "\"h\u{e9}llo\"");
+        assert_eq!(string.literal.map(|s| s.as_str()), Some("h\u{e9}llo"));
+        assert_eq!(string.span.len as usize, "\"h\u{e9}llo\"".len());
+        // Columns count characters, not bytes
+        let ret = tokens.iter().find(|t| t.token_type == TokenType::Return).unwrap();
+        assert_eq!(ret.column as usize, source.find("return").unwrap());
+    }
+}
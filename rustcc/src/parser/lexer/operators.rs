@@ -4,7 +4,7 @@
 use crate::parser::lexer::Lexer;
 use crate::parser::token::TokenType;
 
-impl Lexer {
+impl<'a> Lexer<'a> {
     /// Handles the dot character (. or ...)
     pub(crate) fn handle_dot(&mut self) {
         // Check for ellipsis (...) for variadic functions
@@ -5,7 +5,7 @@ use crate::parser::lexer::utils::{is_alpha, is_alphanumeric, is_digit, is_whites
 use crate::parser::lexer::Lexer;
 use crate::parser::token::TokenType;
 
-impl Lexer {
+impl<'a> Lexer<'a> {
     /// Handles a preprocessor directive
     pub(crate) fn preprocessor_directive(&mut self) {
         // Add the # token
@@ -25,10 +25,10 @@ impl Lexer {
         }
 
         // Get the directive name
-        let directive = self.source[self.start..self.current].to_string();
+        let directive = self.lexeme();
 
         // Check if it's a known preprocessor directive
-        match directive.as_str() {
+        match directive {
             "include" => {
                 self.add_token(TokenType::PPInclude);
                 self.handle_include_directive();
@@ -167,7 +167,7 @@ impl Lexer {
                 self.process_macro_invocation();
             } else {
                 // Simple macro name
-                let _macro_name = self.source[self.start..self.current].to_string();
+                let _macro_name = self.lexeme();
                 // In a real implementation, we would expand the macro here
             }
         }
@@ -201,7 +201,7 @@ impl Lexer {
         }
 
         // Get the macro name
-        let _macro_name = self.source[self.start..self.current].to_string();
+        let _macro_name = self.lexeme();
 
         // Check if it's a function-like macro
         let is_function_like = self.peek() == '(';
@@ -225,7 +225,7 @@ impl Lexer {
                     }
 
                     // Get the parameter name
-                    let param = self.source[self.start..self.current].to_string();
+                    let param = self.lexeme();
                     if !param.is_empty() {
                         parameters.push(param);
                     }
@@ -241,7 +241,7 @@ impl Lexer {
                         self.advance();
                         self.advance();
                         self.advance();
-                        parameters.push("...".to_string());
+                        parameters.push("...");
                         break;
                     }
 
@@ -448,7 +448,7 @@ impl Lexer {
         }
 
         // Get the macro name
-        let _macro_name = self.source[self.start..self.current].to_string();
+        let _macro_name = self.lexeme();
 
         // Remove the macro from the defines table
         // In a real implementation, we would do this
@@ -483,7 +483,7 @@ impl Lexer {
         }
 
         // Get the macro name
-        let _macro_name = self.source[self.start..self.current].to_string();
+        let _macro_name = self.lexeme();
 
         // In a real implementation, we would check if the macro is defined
         // and conditionally include/exclude code based on that
@@ -517,7 +517,7 @@ impl Lexer {
         }
 
         // Get the macro name
-        let _macro_name = self.source[self.start..self.current].to_string();
+        let _macro_name = self.lexeme();
 
         // In a real implementation, we would check if the macro is not defined
         // and conditionally include/exclude code based on that
@@ -577,11 +577,12 @@ impl Lexer {
             self.advance();
         }
 
-        // Get the pragma name
-        let _pragma_name = self.source[self.start..self.current].to_string();
-
-        // In a real implementation, we would handle specific pragmas
-        // For now, we'll just skip to the end of the line
+        // The words of rustcc's own pragmas are lexed as identifiers for
+        // the parser; other pragmas are skipped
+        if self.lexeme() == "rustcc" {
+            self.add_token(TokenType::Identifier);
+            return;
+        }
 
         // Skip to the end of the line
         while !self.is_at_end() && self.peek() != '\n' {
@@ -640,7 +641,7 @@ impl Lexer {
 
         // Get the line number
         if self.start < self.current {
-            let line_str = self.source[self.start..self.current].to_string();
+            let line_str = self.lexeme();
             if let Ok(_line_num) = line_str.parse::<usize>() {
                 // In a real implementation, we would update the line number
                 // self.line = line_num;
@@ -663,7 +664,7 @@ impl Lexer {
             }
 
             // Get the filename
-            let _filename = self.source[self.start..self.current].to_string();
+            let _filename = self.lexeme();
             
             // In a real implementation, we would update the current filename
             
@@ -720,7 +721,7 @@ impl Lexer {
         }
 
         // Get the macro name
-        let _macro_name = self.source[self.start..self.current].to_string();
+        let _macro_name = self.lexeme();
 
         // In a real implementation, we would check if the macro is defined
         // and conditionally include/exclude code based on that
@@ -754,7 +755,7 @@ impl Lexer {
         }
 
         // Get the macro name
-        let _macro_name = self.source[self.start..self.current].to_string();
+        let _macro_name = self.lexeme();
 
         // In a real implementation, we would check if the macro is not defined
         // and conditionally include/exclude code based on that
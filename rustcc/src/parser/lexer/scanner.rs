@@ -3,92 +3,130 @@
 
 use crate::parser::lexer::utils::{is_alpha, is_digit};
 use crate::parser::lexer::Lexer;
-use crate::parser::token::{Token, TokenType};
+use crate::parser::symbol::Symbol;
+use crate::parser::token::{Span, Token, TokenType};
 
-impl Lexer {
+impl<'a> Lexer<'a> {
     /// Returns whether the scanner has reached the end of the source
     pub(crate) fn is_at_end(&self) -> bool {
         self.current >= self.source.len()
     }
 
+    /// Decodes the character starting at byte offset `pos`, returning it
+    /// together with its encoded length. ASCII is handled without touching
+    /// the UTF-8 decoder; anything else falls back to decoding a single char.
+    #[inline]
+    fn char_at(&self, pos: usize) -> Option<(char, usize)> {
+        let b = *self.source.as_bytes().get(pos)?;
+        if b.is_ascii() {
+            return Some((b as char, 1));
+        }
+        let c = self.source[pos..].chars().next()?;
+        Some((c, c.len_utf8()))
+    }
+
     /// Advances the current position and returns the current character
     pub(crate) fn advance(&mut self) -> char {
-        let c = self.source.chars().nth(self.current).unwrap();
-        self.current += 1;
+        let (c, len) = self.char_at(self.current).unwrap();
+        self.current += len;
         self.column += 1;
         c
     }
 
     /// Consumes the next character if it matches the expected character
     pub(crate) fn match_char(&mut self, expected: char) -> bool {
-        if self.is_at_end() {
-            return false;
-        }
-        if self.source.chars().nth(self.current).unwrap() != expected {
-            return false;
+        match self.char_at(self.current) {
+            Some((c, len)) if c == expected => {
+                self.current += len;
+                self.column += 1;
+                true
+            }
+            _ => false,
         }
-        self.current += 1;
-        self.column += 1;
-        true
     }
 
     /// Peeks at the current character without advancing the position
     pub(crate) fn peek(&self) -> char {
-        if self.is_at_end() {
-            return '\0';
-        }
-        self.source.chars().nth(self.current).unwrap()
+        self.char_at(self.current).map_or('\0', |(c, _)| c)
     }
 
     /// Peeks at the next character without advancing the position
     pub(crate) fn peek_next(&self) -> char {
-        if self.current + 1 >= self.source.len() {
-            '\0'
+        match self.char_at(self.current) {
+            Some((_, len)) => self.char_at(self.current + len).map_or('\0', |(c, _)| c),
+            None => '\0',
+        }
+    }
+
+    /// Returns the raw byte at `pos`, or 0 when out of range. Used for
+    /// look-behind checks on ASCII prefixes such as `L"` and `u8"`.
+    #[inline]
+    pub(crate) fn byte_at(&self, pos: usize) -> u8 {
+        self.source.as_bytes().get(pos).copied().unwrap_or(0)
+    }
+
+    /// Returns the source text of the token currently being scanned
+    #[inline]
+    pub(crate) fn lexeme(&self) -> &'a str {
+        let source = self.source;
+        &source[self.start..self.current]
+    }
+
+    /// Column where the current token starts
+    fn token_column(&self) -> u32 {
+        let lexeme = self.lexeme();
+        let width = if lexeme.is_ascii() {
+            lexeme.len()
         } else {
-            self.source.chars().nth(self.current + 1).unwrap()
+            lexeme.chars().count()
+        };
+        self.column.saturating_sub(width) as u32
+    }
+
+    /// Builds a token spanning `start..current`
+    pub(crate) fn make_token(&self, token_type: TokenType, literal: Option<Symbol>) -> Token {
+        Token {
+            token_type,
+            symbol: Symbol::intern(self.lexeme()),
+            literal,
+            span: Span {
+                start: self.start as u32,
+                len: (self.current - self.start) as u32,
+            },
+            line: self.line as u32,
+            column: self.token_column(),
         }
     }
 
     /// Adds a token with the given type
     pub(crate) fn add_token(&mut self, token_type: TokenType) {
-        let lexeme = self.source[self.start..self.current].to_string();
-        self.tokens.push(Token {
-            token_type,
-            lexeme,
-            line: self.line,
-            column: self.column - (self.current - self.start),
-            literal: None,
-        });
+        let token = self.make_token(token_type, None);
+        self.tokens.push(token);
     }
 
     /// Adds a token with the given type and literal value
-    pub(crate) fn add_token_with_literal(&mut self, token_type: TokenType, literal: String) {
-        let lexeme = self.source[self.start..self.current].to_string();
-        self.tokens.push(Token {
-            token_type,
-            lexeme,
-            line: self.line,
-            column: self.column - (self.current - self.start),
-            literal: Some(literal),
-        });
+    pub(crate) fn add_token_with_literal(&mut self, token_type: TokenType, literal: &str) {
+        let token = self.make_token(token_type, Some(Symbol::intern(literal)));
+        self.tokens.push(token);
     }
 
-    /// Scans all tokens from the source and returns them as a vector
-    pub fn scan_tokens(&mut self) -> &Vec<Token> {
+    /// Scans all tokens from the source and returns them as a vector.
+    /// The stream is moved out of the lexer so it can be handed to the
+    /// parser without copying.
+    pub fn scan_tokens(&mut self) -> Vec<Token> {
         while !self.is_at_end() {
             self.start = self.current;
             self.scan_token();
         }
 
-        self.tokens.push(Token {
-            token_type: TokenType::Eof,
-            lexeme: String::new(),
-            line: self.line,
-            column: self.column,
-            literal: None,
-        });
+        self.start = self.current;
+        let eof = Token {
+            column: self.column as u32,
+            ..self.make_token(TokenType::Eof, None)
+        };
+        self.tokens.push(eof);
 
-        &self.tokens
+        std::mem::take(&mut self.tokens)
     }
 
     /// Scans a single token from the source
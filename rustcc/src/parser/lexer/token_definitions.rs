@@ -1,107 +1,121 @@
 // token_definitions.rs
 // Contains token type definitions and helpers for the lexer
 
-use crate::parser::token::{Token, TokenType};
-use std::collections::HashMap;
+use crate::parser::symbol::Symbol;
+use crate::parser::token::{Span, Token, TokenType};
 
-/// Initializes the keywords HashMap for the lexer
-pub fn init_keywords() -> HashMap<String, TokenType> {
-    let mut keywords = HashMap::new();
+/// Shortest and longest keyword, used to reject most identifiers before
+/// looking at any table
+const MIN_KEYWORD_LEN: usize = 2;
+const MAX_KEYWORD_LEN: usize = 14;
 
-    // Basic types
-    keywords.insert("int".to_string(), TokenType::Int);
-    keywords.insert("char".to_string(), TokenType::Char);
-    keywords.insert("short".to_string(), TokenType::Short);
-    keywords.insert("long".to_string(), TokenType::Long);
-    keywords.insert("float".to_string(), TokenType::Float);
-    keywords.insert("double".to_string(), TokenType::Double);
-    keywords.insert("void".to_string(), TokenType::Void);
-    keywords.insert("_Bool".to_string(), TokenType::Bool);
-    keywords.insert("_Complex".to_string(), TokenType::Complex);
-    keywords.insert("_Imaginary".to_string(), TokenType::Imaginary);
+// Keyword tables, bucketed by first byte. These are plain constants so
+// keyword recognition needs no setup when a lexer is created.
+//
+// Directive names such as `define` and `line` aren't keywords: they only
+// mean something right after a `#` at the start of a line, where
+// `preprocessor_directive` recognizes them, and are ordinary identifiers
+// anywhere else.
+const KEYWORDS_UNDERSCORE: &[(&str, TokenType)] = &[
+    ("_Bool", TokenType::Bool),
+    ("_Complex", TokenType::Complex),
+    ("_Imaginary", TokenType::Imaginary),
+    ("_Atomic", TokenType::Atomic),
+    ("_Thread_local", TokenType::ThreadLocal),
+    ("_Alignas", TokenType::Alignas),
+    ("_Alignof", TokenType::Alignof),
+    ("_Generic", TokenType::Generic),
+    ("_Noreturn", TokenType::Noreturn),
+    ("_Static_assert", TokenType::StaticAssert),
+];
+const KEYWORDS_A: &[(&str, TokenType)] = &[("auto", TokenType::Auto)];
+const KEYWORDS_B: &[(&str, TokenType)] = &[("break", TokenType::Break)];
+const KEYWORDS_C: &[(&str, TokenType)] = &[
+    ("char", TokenType::Char),
+    ("const", TokenType::Const),
+    ("case", TokenType::Case),
+    ("continue", TokenType::Continue),
+];
+const KEYWORDS_D: &[(&str, TokenType)] = &[
+    ("do", TokenType::Do),
+    ("double", TokenType::Double),
+    ("default", TokenType::Default),
+];
+const KEYWORDS_E: &[(&str, TokenType)] = &[
+    ("else", TokenType::Else),
+    ("enum", TokenType::Enum),
+    ("extern", TokenType::Extern),
+];
+const KEYWORDS_F: &[(&str, TokenType)] = &[("for", TokenType::For), ("float", TokenType::Float)];
+const KEYWORDS_G: &[(&str, TokenType)] = &[("goto", TokenType::Goto)];
+const KEYWORDS_I: &[(&str, TokenType)] = &[("if", TokenType::If), ("int", TokenType::Int), ("inline", TokenType::Inline)];
+const KEYWORDS_L: &[(&str, TokenType)] = &[("long", TokenType::Long)];
+const KEYWORDS_R: &[(&str, TokenType)] = &[
+    ("return", TokenType::Return),
+    ("register", TokenType::Register),
+    ("restrict", TokenType::Restrict),
+];
+const KEYWORDS_S: &[(&str, TokenType)] = &[
+    ("short", TokenType::Short),
+    ("static", TokenType::Static),
+    ("struct", TokenType::Struct),
+    ("sizeof", TokenType::Sizeof),
+    ("switch", TokenType::Switch),
+    ("signed", TokenType::Signed),
+];
+const KEYWORDS_T: &[(&str, TokenType)] = &[("typedef", TokenType::Typedef)];
+const KEYWORDS_U: &[(&str, TokenType)] = &[
+    ("union", TokenType::Union),
+    ("unsigned", TokenType::Unsigned),
+];
+const KEYWORDS_V: &[(&str, TokenType)] = &[("void", TokenType::Void), ("volatile", TokenType::Volatile)];
+const KEYWORDS_W: &[(&str, TokenType)] = &[("while", TokenType::While)];
 
-    // Type qualifiers
-    keywords.insert("const".to_string(), TokenType::Const);
-    keywords.insert("volatile".to_string(), TokenType::Volatile);
-    keywords.insert("restrict".to_string(), TokenType::Restrict);
-    keywords.insert("_Atomic".to_string(), TokenType::Atomic);
-
-    // Storage class specifiers
-    keywords.insert("auto".to_string(), TokenType::Auto);
-    keywords.insert("register".to_string(), TokenType::Register);
-    keywords.insert("static".to_string(), TokenType::Static);
-    keywords.insert("extern".to_string(), TokenType::Extern);
-    keywords.insert("typedef".to_string(), TokenType::Typedef);
-    keywords.insert("_Thread_local".to_string(), TokenType::ThreadLocal);
-
-    // Control flow
-    keywords.insert("if".to_string(), TokenType::If);
-    keywords.insert("else".to_string(), TokenType::Else);
-    keywords.insert("while".to_string(), TokenType::While);
-    keywords.insert("for".to_string(), TokenType::For);
-    keywords.insert("return".to_string(), TokenType::Return);
-    keywords.insert("break".to_string(), TokenType::Break);
-    keywords.insert("continue".to_string(), TokenType::Continue);
-    keywords.insert("switch".to_string(), TokenType::Switch);
-    keywords.insert("case".to_string(), TokenType::Case);
-    keywords.insert("default".to_string(), TokenType::Default);
-    keywords.insert("do".to_string(), TokenType::Do);
-    keywords.insert("goto".to_string(), TokenType::Goto);
-
-    // Other keywords
-    keywords.insert("sizeof".to_string(), TokenType::Sizeof);
-    keywords.insert("_Alignas".to_string(), TokenType::Alignas);
-    keywords.insert("_Alignof".to_string(), TokenType::Alignof);
-    keywords.insert("_Generic".to_string(), TokenType::Generic);
-    keywords.insert("_Noreturn".to_string(), TokenType::Noreturn);
-    keywords.insert("_Static_assert".to_string(), TokenType::StaticAssert);
-
-    // Struct/Union/Enum
-    keywords.insert("struct".to_string(), TokenType::Struct);
-    keywords.insert("union".to_string(), TokenType::Union);
-    keywords.insert("enum".to_string(), TokenType::Enum);
-
-    // Function specifiers
-    keywords.insert("inline".to_string(), TokenType::Inline);
-
-    // Unsigned/signed
-    keywords.insert("unsigned".to_string(), TokenType::Unsigned);
-    keywords.insert("signed".to_string(), TokenType::Signed);
+/// Returns the keyword token type for `text`, or `None` for an ordinary
+/// identifier. Dispatches on length and first byte, then compares against
+/// a handful of candidates; nothing is hashed or allocated.
+pub fn lookup_keyword(text: &str) -> Option<TokenType> {
+    let bytes = text.as_bytes();
+    if bytes.len() < MIN_KEYWORD_LEN || bytes.len() > MAX_KEYWORD_LEN {
+        return None;
+    }
 
-    // Preprocessor keywords - these are handled differently
-    // as they only have special meaning after a # symbol
-    // But we'll add them anyway for completeness
-    keywords.insert("include".to_string(), TokenType::PPInclude);
-    keywords.insert("define".to_string(), TokenType::PPDefine);
-    keywords.insert("undef".to_string(), TokenType::PPUndef);
-    keywords.insert("ifdef".to_string(), TokenType::PPIfDef);
-    keywords.insert("ifndef".to_string(), TokenType::PPIfNDef);
-    keywords.insert("if".to_string(), TokenType::PPIf); // Note: duplicate with control flow "if"
-    keywords.insert("else".to_string(), TokenType::PPElse); // Note: duplicate with control flow "else"
-    keywords.insert("elif".to_string(), TokenType::PPElif);
-    keywords.insert("endif".to_string(), TokenType::PPEndif);
-    keywords.insert("pragma".to_string(), TokenType::PPPragma);
-    keywords.insert("error".to_string(), TokenType::PPErrorDir);
-    keywords.insert("warning".to_string(), TokenType::PPWarning);
-    keywords.insert("line".to_string(), TokenType::PPLine);
-    
-    // C23 preprocessor directives
-    keywords.insert("embed".to_string(), TokenType::PPEmbed);
-    keywords.insert("elifdef".to_string(), TokenType::PPElifDef);
-    keywords.insert("elifndef".to_string(), TokenType::PPElifNDef);
+    let candidates = match bytes[0] {
+        b'_' => KEYWORDS_UNDERSCORE,
+        b'a' => KEYWORDS_A,
+        b'b' => KEYWORDS_B,
+        b'c' => KEYWORDS_C,
+        b'd' => KEYWORDS_D,
+        b'e' => KEYWORDS_E,
+        b'f' => KEYWORDS_F,
+        b'g' => KEYWORDS_G,
+        b'i' => KEYWORDS_I,
+        b'l' => KEYWORDS_L,
+        b'r' => KEYWORDS_R,
+        b's' => KEYWORDS_S,
+        b't' => KEYWORDS_T,
+        b'u' => KEYWORDS_U,
+        b'v' => KEYWORDS_V,
+        b'w' => KEYWORDS_W,
+        _ => return None,
+    };
 
-    keywords
+    candidates
+        .iter()
+        .find(|(keyword, _)| keyword.len() == bytes.len() && keyword.as_bytes() == bytes)
+        .map(|&(_, token_type)| token_type)
 }
 
 /// Creates a token with the given type
 #[allow(dead_code)]
-pub fn create_token(token_type: TokenType, lexeme: String, line: usize, column: usize) -> Token {
+pub fn create_token(token_type: TokenType, lexeme: &str, line: u32, column: u32) -> Token {
     Token {
         token_type,
-        lexeme,
+        symbol: Symbol::intern(lexeme),
+        literal: None,
+        span: Span::default(),
         line,
         column,
-        literal: None,
     }
 }
 
@@ -109,16 +123,47 @@ pub fn create_token(token_type: TokenType, lexeme: String, line: usize, column:
 #[allow(dead_code)]
 pub fn create_token_with_literal(
     token_type: TokenType,
-    lexeme: String,
-    line: usize,
-    column: usize,
-    literal: String,
+    lexeme: &str,
+    line: u32,
+    column: u32,
+    literal: &str,
 ) -> Token {
     Token {
-        token_type,
-        lexeme,
-        line,
-        column,
-        literal: Some(literal),
+        literal: Some(Symbol::intern(literal)),
+        ..create_token(token_type, lexeme, line, column)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+
+    #[test]
+    fn test_lookup_keyword() {
+        assert_eq!(lookup_keyword("int"), Some(TokenType::Int));
+        assert_eq!(lookup_keyword("if"), Some(TokenType::If));
+        assert_eq!(lookup_keyword("else"), Some(TokenType::Else));
+        assert_eq!(lookup_keyword("_Static_assert"), Some(TokenType::StaticAssert));
+        assert_eq!(lookup_keyword("integer"), None);
+        assert_eq!(lookup_keyword("x"), None);
+        assert_eq!(lookup_keyword("Int"), None);
+    }
+
+    #[test]
+    fn test_directive_names_are_identifiers_outside_directives() {
+        let source = "#define LIMIT 3\n\
+                      int line;\n\
+                      void error(int code) { line = code; }\n\
+                      int main() { int define = LIMIT; error(define); return line; }";
+        let tokens = Lexer::new(source).scan_tokens();
+        assert_eq!(tokens[1].token_type, TokenType::PPDefine);
+        for name in ["line", "error", "define"] {
+            let token = tokens[2..].iter().find(|token| token.lexeme() == name).unwrap();
+            assert_eq!(token.token_type, TokenType::Identifier, "{}", name);
+        }
+        let program = Parser::new(tokens).parse().unwrap();
+        assert_eq!(program.functions.len(), 2);
     }
 }
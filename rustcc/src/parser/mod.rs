@@ -1,6 +1,7 @@
 pub mod ast;
 pub mod error;
 pub mod lexer;
+pub mod symbol;
 pub mod token;
 
 // Submodules
@@ -9,116 +10,398 @@ mod expressions;
 mod statements;
 mod utils;
 
-use ast::{Program, Type};
-use error::Result;
+use ast::{AstArena, ExprId, Expression, Function, Program, Statement, StmtId, Struct, Type};
+use error::{Result, SourceLines};
 use std::collections::HashMap;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use symbol::Symbol;
 use token::{Token, TokenType};
 
+// Function bodies with fewer tokens than this between them are parsed on
+// one thread, since starting more would take longer than parsing them
+const PARALLEL_TOKENS: usize = 16 * 1024;
+
 pub struct Parser {
-    tokens: Vec<Token>,
+    // The tokens, shared with the parsers of function bodies. Parsing stops
+    // at `end`, the end of the body being parsed or of the file.
+    tokens: Arc<[Token]>,
     current: usize,
+    end: usize,
+    // The source the tokens were scanned from, for quoting it in errors
+    source: Option<Arc<SourceLines>>,
     // Track preprocessor definitions for macro expansion
     _defines: HashMap<String, String>,
     // Track included files
     includes: Vec<String>,
+    // Arena receiving the nodes currently being parsed: the program's arena
+    // at file scope, or the enclosing function's arena inside a body
+    arena: AstArena,
+    // Functions named by `#pragma rustcc hot`, and whether a bare one
+    // applies to the next function defined
+    hot_functions: Vec<Symbol>,
+    next_function_hot: bool,
+    // Typedefs, structs and enum constants declared at file scope, and how
+    // many of each are visible where parsing is
+    declarations: Arc<Declarations>,
+    visible: Visible,
+    // Errors recovered from so far
+    errors: Vec<error::Error>,
+    threads: usize,
+}
+
+/// What file scope declares, shared by the parsers of function bodies
+#[derive(Debug, Clone, Default)]
+struct Declarations {
+    typedefs: Vec<(Symbol, Type)>,
+    // Typedef names, which decide whether a statement is a declaration,
+    // with how many typedefs have to be visible for each to be: 0 for
+    // names declared before the source, or its position in `typedefs` plus 1
+    type_names: HashMap<Symbol, usize>,
+    structs: Vec<Struct>,
+    enum_constants: Vec<(Symbol, i32)>,
+}
+
+/// How many of the file-scope declarations were made before a function body
+#[derive(Debug, Clone, Copy)]
+struct Visible {
+    typedefs: usize,
+    structs: usize,
+    enum_constants: usize,
+}
+
+impl Visible {
+    const ALL: Visible = Visible { typedefs: usize::MAX, structs: usize::MAX, enum_constants: usize::MAX };
+}
+
+/// A function body skipped at file scope, parsed once the whole file has
+/// been read
+struct Body {
+    function: usize,
+    // Its tokens, from just after the `{` to just after the `}`
+    start: usize,
+    end: usize,
+    visible: Visible,
+    arena: AstArena,
+    statements: Vec<StmtId>,
 }
 
 impl Parser {
     pub fn new(tokens: Vec<Token>) -> Self {
+        Self::over(tokens.into())
+    }
+
+    fn over(tokens: Arc<[Token]>) -> Self {
         Parser {
+            end: tokens.len(),
             tokens,
             current: 0,
+            source: None,
             _defines: HashMap::new(),
             includes: Vec::new(),
+            arena: AstArena::new(),
+            hot_functions: Vec::new(),
+            next_function_hot: false,
+            declarations: Default::default(),
+            visible: Visible::ALL,
+            errors: Vec::new(),
+            threads: thread::available_parallelism().map_or(1, |cores| cores.get()),
         }
     }
 
+    /// Treat `names` as typedef names declared before the source, such as
+    /// those of a precompiled header
+    pub fn with_type_names(mut self, names: impl IntoIterator<Item = Symbol>) -> Self {
+        let type_names = &mut self.declarations_mut().type_names;
+        for name in names {
+            type_names.entry(name).or_insert(0);
+        }
+        self
+    }
+
+    /// Quote lines of `source`, which the tokens were scanned from, in errors
+    pub fn with_source(mut self, source: String) -> Self {
+        self.source = Some(Arc::new(SourceLines::new(source)));
+        self
+    }
+
+    /// Set the number of threads function bodies are parsed on
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        self.threads = threads.max(1);
+        self
+    }
+
+    /// Allocates an expression in the current arena
+    pub(crate) fn push_expr(&mut self, expr: Expression) -> ExprId {
+        self.arena.alloc_expr(expr)
+    }
+
+    /// Allocates a statement in the current arena
+    pub(crate) fn push_stmt(&mut self, stmt: Statement) -> StmtId {
+        self.arena.alloc_stmt(stmt)
+    }
+
+    // The typedefs, structs and enum constants visible where parsing is
+    fn typedefs(&self) -> &[(Symbol, Type)] {
+        let typedefs = &self.declarations.typedefs;
+        &typedefs[..self.visible.typedefs.min(typedefs.len())]
+    }
+
+    fn structs(&self) -> &[Struct] {
+        let structs = &self.declarations.structs;
+        &structs[..self.visible.structs.min(structs.len())]
+    }
+
+    fn enum_constants(&self) -> &[(Symbol, i32)] {
+        let enum_constants = &self.declarations.enum_constants;
+        &enum_constants[..self.visible.enum_constants.min(enum_constants.len())]
+    }
+
+    // Only file scope declares anything, and it's done before the bodies
+    // share the declarations, so this never copies them
+    fn declarations_mut(&mut self) -> &mut Declarations {
+        Arc::make_mut(&mut self.declarations)
+    }
+
+    /// Counts the tokens from the current position to the end of the next
+    /// brace-delimited body (or the next `;` for a prototype). Used to size a
+    /// function's arena up front.
+    fn function_token_count(&self) -> usize {
+        let mut depth = 0usize;
+        for (offset, token) in self.tokens[self.current..self.end].iter().enumerate() {
+            match token.token_type {
+                TokenType::LeftBrace => depth += 1,
+                TokenType::RightBrace => {
+                    depth = depth.saturating_sub(1);
+                    if depth == 0 {
+                        return offset + 1;
+                    }
+                }
+                TokenType::Semicolon if depth == 0 => return offset + 1,
+                _ => {}
+            }
+        }
+        self.end - self.current
+    }
+
+    /// Parses the whole program, returning the first syntax error if there
+    /// are any
+    #[allow(dead_code)]
     pub fn parse(&mut self) -> Result<Program> {
+        self.parse_recovering().map_err(|mut errors| errors.swap_remove(0))
+    }
+
+    /// Parses the whole program, carrying on past syntax errors to report
+    /// all of them, in source order
+    ///
+    /// File scope is read first, skipping over function bodies by matching
+    /// braces. The bodies are parsed afterwards, on several threads for a
+    /// large file, each seeing only what was declared before it.
+    pub fn parse_recovering(&mut self) -> std::result::Result<Program, Vec<error::Error>> {
         // Initialize program components
         let mut functions = Vec::new();
-        let mut structs = Vec::new();
         let mut global_variables = Vec::new();
+        let mut bodies = Vec::new();
 
         while !self.is_at_end() {
-            // Skip over preprocessor directives that were already processed
-            if self.check(TokenType::Hash) {
-                self.advance(); // Skip the # token
-                if !self.is_at_end()
-                    && self.check_any(&[
-                        TokenType::PPInclude,
-                        TokenType::PPDefine,
-                        TokenType::PPIfDef,
-                        TokenType::PPIfNDef,
-                        TokenType::PPIf,
-                        TokenType::PPElse,
-                        TokenType::PPElif,
-                        TokenType::PPEndif,
-                        TokenType::PPUndef,
-                        TokenType::PPPragma,
-                        TokenType::PPErrorDir,
-                        TokenType::PPWarning,
-                    ])
-                {
-                    // Skip to the end of the line
-                    while !self.is_at_end() && !self.is_at_new_line() {
-                        self.advance();
-                    }
-                    if !self.is_at_end() {
-                        self.advance(); // Skip the newline
-                    }
-                    continue;
-                }
+            if let Err(err) = self.parse_external_declaration(&mut functions, &mut global_variables, &mut bodies) {
+                self.errors.push(err);
+                self.synchronize_declaration();
             }
+        }
 
-            // Handle typedef declarations
-            if self.match_token(TokenType::Typedef) {
-                self.parse_typedef()?;
-                continue;
-            }
+        let (bodies, errors) = self.parse_bodies(bodies);
+        self.errors.extend(errors);
+        for body in bodies {
+            let function: &mut Function = &mut functions[body.function];
+            function.body = body.statements;
+            function.arena = body.arena;
+        }
 
-            // Handle enum declarations
-            if self.match_token(TokenType::Enum) {
-                self.parse_enum()?;
-                continue;
-            }
+        if !self.errors.is_empty() {
+            let mut errors = std::mem::take(&mut self.errors);
+            errors.sort_by_key(|err| (err.line, err.column));
+            return Err(errors);
+        }
+
+        let declarations = std::mem::take(&mut self.declarations);
+        let declarations = Arc::try_unwrap(declarations).unwrap_or_else(|shared| (*shared).clone());
+        Ok(Program {
+            functions,
+            structs: declarations.structs,
+            includes: self.includes.clone(),
+            globals: global_variables,
+            arena: std::mem::take(&mut self.arena),
+            hot_functions: std::mem::take(&mut self.hot_functions),
+            typedefs: declarations.typedefs,
+            enum_constants: declarations.enum_constants,
+        })
+    }
 
-            // Handle struct declarations
-            if self.match_token(TokenType::Struct) {
-                // Parse struct declaration
-                structs.push(self.parse_struct()?);
-                continue;
+    // Parses a declaration or definition at file scope, or skips a
+    // preprocessor line. A function's body is only skipped, and added to
+    // `bodies` to be parsed later.
+    fn parse_external_declaration(
+        &mut self,
+        functions: &mut Vec<Function>,
+        global_variables: &mut Vec<StmtId>,
+        bodies: &mut Vec<Body>,
+    ) -> Result<()> {
+        // Skip over preprocessor directives that were already processed
+        if self.check(TokenType::Hash) {
+            self.advance(); // Skip the # token
+            if !self.is_at_end()
+                && self.check_any(&[
+                    TokenType::PPInclude,
+                    TokenType::PPDefine,
+                    TokenType::PPIfDef,
+                    TokenType::PPIfNDef,
+                    TokenType::PPIf,
+                    TokenType::PPElse,
+                    TokenType::PPElif,
+                    TokenType::PPEndif,
+                    TokenType::PPUndef,
+                    TokenType::PPPragma,
+                    TokenType::PPErrorDir,
+                    TokenType::PPWarning,
+                ])
+            {
+                if self.match_token(TokenType::PPPragma) {
+                    self.parse_rustcc_pragma();
+                }
+                // Skip to the end of the line. There are no newline
+                // tokens, so this stops at the next line's first token.
+                while !self.is_at_end() && !self.is_at_new_line() {
+                    self.advance();
+                }
+                return Ok(());
             }
+        }
 
-            // Handle function declarations and global variables with different types
-            if self.is_type_specifier() {
-                let return_type = self.parse_type()?;
+        // Handle typedef declarations
+        if self.match_token(TokenType::Typedef) {
+            return self.parse_typedef();
+        }
 
-                // Check if it's a function or global variable
-                let name_token =
-                    self.consume(TokenType::Identifier, "Expected identifier after type")?;
-                let name = name_token.lexeme.clone();
+        // Handle enum declarations
+        if self.match_token(TokenType::Enum) {
+            return self.parse_enum();
+        }
 
-                if self.check(TokenType::LeftParen) {
-                    // This is a function declaration
-                    functions.push(self.parse_function_with_name(return_type, name)?);
-                } else {
-                    // This is a global variable declaration
-                    global_variables.push(self.parse_global_variable_with_name(return_type, name)?);
+        // Handle struct declarations
+        if self.match_token(TokenType::Struct) {
+            // Parse struct declaration
+            let definition = self.parse_struct()?;
+            self.declarations_mut().structs.push(definition);
+            return Ok(());
+        }
+
+        // Handle function declarations and global variables with different types
+        if self.is_type_specifier() {
+            let return_type = self.parse_type()?;
+
+            // Check if it's a function or global variable
+            let name_token = self.consume(TokenType::Identifier, "Expected identifier after type")?;
+            let name = name_token.symbol;
+
+            if self.check(TokenType::LeftParen) {
+                // This is a function declaration
+                let mut function = self.parse_function_with_name(return_type, name)?;
+                if !function.is_external {
+                    if self.next_function_hot {
+                        self.hot_functions.push(name);
+                        self.next_function_hot = false;
+                    }
+                    let start = self.current;
+                    self.skip_body();
+                    bodies.push(Body {
+                        function: functions.len(),
+                        start,
+                        end: self.current,
+                        visible: Visible {
+                            typedefs: self.declarations.typedefs.len(),
+                            structs: self.declarations.structs.len(),
+                            enum_constants: self.declarations.enum_constants.len(),
+                        },
+                        arena: std::mem::take(&mut function.arena),
+                        statements: Vec::new(),
+                    });
                 }
+                functions.push(function);
             } else {
-                // Skip unrecognized tokens
-                if !self.is_at_end() {
-                    return Err(self.unexpected_token_error("declaration or definition"));
+                // This is a global variable declaration
+                global_variables.push(self.parse_global_variable_with_name(return_type, name)?);
+            }
+            return Ok(());
+        }
+
+        // Skip unrecognized tokens
+        Err(self.unexpected_token_error("declaration or definition"))
+    }
+
+    // Skips from just inside a body's `{` to just after its `}`
+    fn skip_body(&mut self) {
+        let mut depth = 1usize;
+        while !self.is_at_end() {
+            match self.advance().token_type {
+                TokenType::LeftBrace => depth += 1,
+                TokenType::RightBrace => {
+                    depth -= 1;
+                    if depth == 0 {
+                        return;
+                    }
                 }
+                _ => {}
             }
         }
+    }
 
-        Ok(Program {
-            functions,
-            structs,
-            includes: self.includes.clone(),
-            globals: global_variables,
-        })
+    // Parses the bodies skipped at file scope, returning them and their
+    // errors. Each thread has a parser of its own over the shared tokens
+    // and declarations, and takes the next body until none are left.
+    fn parse_bodies(&self, bodies: Vec<Body>) -> (Vec<Body>, Vec<error::Error>) {
+        let tokens: usize = bodies.iter().map(|body| body.end - body.start).sum();
+        let threads = if tokens < PARALLEL_TOKENS { 1 } else { self.threads.min(bodies.len()) };
+
+        let bodies: Vec<Mutex<Body>> = bodies.into_iter().map(Mutex::new).collect();
+        let next = AtomicUsize::new(0);
+        let parse = || {
+            let mut parser = Parser {
+                declarations: Arc::clone(&self.declarations),
+                source: self.source.clone(),
+                ..Parser::over(Arc::clone(&self.tokens))
+            };
+            while let Some(body) = bodies.get(next.fetch_add(1, Ordering::Relaxed)) {
+                parser.parse_body(&mut body.lock().unwrap());
+            }
+            parser.errors
+        };
+        let errors = if threads <= 1 {
+            parse()
+        } else {
+            thread::scope(|scope| {
+                let workers: Vec<_> = (0..threads).map(|_| scope.spawn(&parse)).collect();
+                workers.into_iter().flat_map(|worker| worker.join().expect("parser thread panicked")).collect()
+            })
+        };
+        (bodies.into_iter().map(|body| body.into_inner().unwrap()).collect(), errors)
+    }
+
+    // `#pragma rustcc hot` marks the function defined next as hot, and
+    // `#pragma rustcc hot f g` the functions named. The lexer keeps the
+    // words of rustcc pragmas as identifiers; other pragmas are skipped.
+    fn parse_rustcc_pragma(&mut self) {
+        let mut words = Vec::new();
+        while !self.is_at_end() && !self.is_at_new_line() && self.check(TokenType::Identifier) {
+            words.push(self.advance().symbol);
+        }
+        if let [rustcc, hot, names @ ..] = words.as_slice() {
+            if *rustcc == "rustcc" && *hot == "hot" {
+                self.hot_functions.extend_from_slice(names);
+                self.next_function_hot |= names.is_empty();
+            }
+        }
     }
 
     // Helper method to check if the current token is a type specifier
@@ -134,6 +417,18 @@ impl Parser {
             || self.check(TokenType::Signed)
             || self.check(TokenType::Float)
             || self.check(TokenType::Double)
+            || self.check(TokenType::Enum)
+            || self.is_type_name()
+    }
+
+    // Whether the current token is a name declared by a typedef
+    fn is_type_name(&self) -> bool {
+        self.check(TokenType::Identifier)
+            && self
+                .declarations
+                .type_names
+                .get(&self.peek().symbol)
+                .is_some_and(|&declared| declared <= self.visible.typedefs)
     }
 
     // Parse a type specifier
@@ -149,13 +444,20 @@ impl Parser {
             // Parse struct type
             let struct_name = self
                 .consume(TokenType::Identifier, "Expected struct name")?
-                .lexeme
-                .clone();
+                .lexeme()
+                .to_string();
             return Ok(Type::Struct(struct_name));
         } else if self.match_token(TokenType::Const) {
             // Parse const type
             let base_type = self.parse_type()?;
             return Ok(Type::Const(Box::new(base_type)));
+        } else if self.match_token(TokenType::Enum) {
+            // Enums are ints; their constants are declared by `parse_enum`
+            self.consume(TokenType::Identifier, "Expected enum name")?;
+            return Ok(Type::Int);
+        } else if self.is_type_name() {
+            let name = self.advance().lexeme().to_string();
+            return Ok(Type::TypeDef(name));
         }
 
         // If we get here, it's an error
@@ -167,7 +469,7 @@ impl Parser {
         // Parse the array size if present
         let size = if !self.check(TokenType::RightBracket) {
             if let Ok(size_token) = self.consume(TokenType::IntegerLiteral, "Expected array size") {
-                let token_lexeme = size_token.lexeme.clone();
+                let token_lexeme = size_token.lexeme().to_string();
                 if let Ok(size) = token_lexeme.parse::<usize>() {
                     Some(size)
                 } else {
@@ -191,8 +493,8 @@ impl Parser {
     // Add a method to create errors with source context
     fn error(&self, kind: error::ErrorKind, token_index: usize) -> error::Error {
         let token = &self.tokens[token_index];
-        let line = token.line;
-        let column = token.column;
+        let line = token.line as usize;
+        let column = token.column as usize;
         
         // Create the basic error
         let mut err = error::Error::new(kind, line, column);
@@ -207,47 +509,44 @@ impl Parser {
 
     // Get the source line for a given line number
     fn get_source_line(&self, line: usize) -> Option<String> {
-        // This is a simplified implementation
-        // In a real compiler, we would store the source code and retrieve the actual line
-        
-        // For now, we'll reconstruct the line from tokens on the same line
-        let line_tokens: Vec<&Token> = self.tokens.iter()
-            .filter(|t| t.line == line)
-            .collect();
-        
-        if line_tokens.is_empty() {
-            return None;
+        if let Some(source) = &self.source {
+            return source.line(line).map(str::to_string);
         }
-        
-        // Sort tokens by column
-        let mut sorted_tokens = line_tokens.clone();
-        sorted_tokens.sort_by_key(|t| t.column);
-        
+
+        // Without the source, rebuild the line from its tokens, which are
+        // in order, so they're found by binary search
+        let first = self.tokens.partition_point(|t| (t.line as usize) < line);
+        let line_tokens = self.tokens[first..].iter().take_while(|t| t.line as usize == line);
+
         // Reconstruct the line
         let mut result = String::new();
         let mut last_column = 0;
-        
-        for token in sorted_tokens {
+
+        for token in line_tokens {
+            if token.token_type == TokenType::Eof {
+                break;
+            }
+            let column = token.column as usize;
             // Add spaces between tokens
-            if token.column > last_column {
-                result.push_str(&" ".repeat(token.column - last_column));
+            if column > last_column {
+                result.push_str(&" ".repeat(column - last_column));
             }
-            
+
             // Add the token lexeme
-            result.push_str(&token.lexeme);
-            
+            result.push_str(token.lexeme());
+
             // Update last column
-            last_column = token.column + token.lexeme.len();
+            last_column = column + token.lexeme().len();
         }
-        
-        Some(result)
+
+        Some(result).filter(|result| !result.is_empty())
     }
 
     // Helper method to create an unexpected token error
     fn unexpected_token_error(&self, expected: &str) -> error::Error {
         let token = &self.tokens[self.current];
         let kind = error::ErrorKind::UnexpectedToken(
-            token.lexeme.clone(),
+            token.lexeme().to_string(),
             expected.to_string(),
         );
         
@@ -260,13 +559,63 @@ impl Parser {
         let last_token = self.tokens.last().unwrap();
         let kind = error::ErrorKind::UnexpectedEOF(expected.to_string());
         
-        error::Error::new(kind, last_token.line, last_token.column)
+        error::Error::new(kind, last_token.line as usize, last_token.column as usize)
     }
 }
 
 #[cfg(test)]
 mod tests {
     // Integration tests for parser components
-}
+    use super::*;
+    use crate::parser::lexer::Lexer;
+
+    #[test]
+    fn test_function_nodes_live_in_function_arena() {
+        let source = "int g = 1; int main() { int x = 2; return x + g; }";
+        let tokens = Lexer::new(source).scan_tokens();
+        let program = Parser::new(tokens).parse().unwrap();
+
+        let main = &program.functions[0];
+        assert_eq!(main.body.len(), 2);
+        let Statement::Return(value) = main.arena[main.body[1]] else {
+            panic!("expected return statement");
+        };
+        let Expression::BinaryOperation { left, right, .. } = main.arena[value] else {
+            panic!("expected binary operation");
+        };
+        assert!(matches!(main.arena[left], Expression::Variable(name) if name == "x"));
+        assert!(matches!(main.arena[right], Expression::Variable(name) if name == "g"));
+
+        // Globals are allocated in the program's own arena
+        assert!(matches!(
+            program.arena[program.globals[0]],
+            Statement::VariableDeclaration { name, .. } if name == "g"
+        ));
+    }
+
+    #[test]
+    fn test_errors_are_recovered_from_and_bodies_parse_in_parallel() {
+        let source = "int f() { int x = 1 +; return x; }\n\
+                      int g( { return 0; }\n\
+                      int h() { if (1) { return 1 } return 2; }";
+        let mut parser = Parser::new(Lexer::new(source).scan_tokens()).with_source(source.to_string());
+        let errors = parser.parse_recovering().unwrap_err();
+        assert_eq!(errors.iter().map(|err| err.line).collect::<Vec<_>>(), [1, 2, 3]);
+        assert_eq!(errors[2].source_line.as_deref(), Some("int h() { if (1) { return 1 } return 2; }"));
 
-// Any other modules in the parser directory
+        // Bodies only see the typedefs declared before them
+        let mut source = String::from("typedef int word;\n");
+        for i in 0..2000 {
+            source.push_str(&format!("word f{i}(word a) {{ word b = a * {i}; return b; }}\n"));
+        }
+        source.push_str("typedef int late;\nint main() { late x = 1; return x; }\n");
+        let parse = |threads| {
+            let program = Parser::new(Lexer::new(&source).scan_tokens()).with_threads(threads).parse().unwrap();
+            format!("{:?}", program)
+        };
+        assert_eq!(parse(1), parse(4));
+
+        let early = source.replace("word f0(word a) { word b", "word f0(word a) { late b");
+        assert!(Parser::new(Lexer::new(&early).scan_tokens()).parse().is_err());
+    }
+}
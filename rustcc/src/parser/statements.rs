@@ -1,11 +1,11 @@
-use crate::parser::ast::{Expression, Statement, SwitchCase};
+use crate::parser::ast::{Expression, Statement, StmtId, SwitchCase};
 use crate::parser::error::Result;
 use crate::parser::token::TokenType;
 use crate::parser::Parser;
 
 impl Parser {
     /// Parse a statement
-    pub fn parse_statement(&mut self) -> Result<Statement> {
+    pub fn parse_statement(&mut self) -> Result<StmtId> {
         if self.match_token(TokenType::If) {
             self.parse_if_statement()
         } else if self.match_token(TokenType::While) {
@@ -43,53 +43,67 @@ impl Parser {
         }
     }
 
-    /// Parse a block of statements
-    pub fn parse_block(&mut self) -> Result<Statement> {
+    /// Parse statements up to the `}` ending a block or body. A statement
+    /// that doesn't parse has its error recorded and is skipped.
+    pub fn parse_statements(&mut self) -> Vec<StmtId> {
         let mut statements = Vec::new();
 
         while !self.check(TokenType::RightBrace) && !self.is_at_end() {
-            statements.push(self.parse_statement()?);
+            match self.parse_statement() {
+                Ok(statement) => statements.push(statement),
+                Err(err) => {
+                    self.errors.push(err);
+                    self.synchronize();
+                }
+            }
         }
 
+        statements
+    }
+
+    /// Parse a block of statements
+    pub fn parse_block(&mut self) -> Result<StmtId> {
+        let statements = self.parse_statements();
+
         self.consume(TokenType::RightBrace, "Expected '}' after block")?;
 
-        Ok(Statement::Block(statements))
+        Ok(self.push_stmt(Statement::Block(statements)))
     }
 
     /// Parse an if statement
-    fn parse_if_statement(&mut self) -> Result<Statement> {
+    fn parse_if_statement(&mut self) -> Result<StmtId> {
         self.consume(TokenType::LeftParen, "Expected '(' after 'if'")?;
         let condition = self.parse_expression()?;
         self.consume(TokenType::RightParen, "Expected ')' after if condition")?;
 
-        let then_statement = Box::new(self.parse_statement()?);
+        let then_statement = self.parse_statement()?;
         let else_statement = if self.match_token(TokenType::Else) {
-            Some(Box::new(self.parse_statement()?))
+            Some(self.parse_statement()?)
         } else {
             None
         };
 
-        Ok(Statement::If {
+        Ok(self.push_stmt(Statement::If {
             condition,
             then_block: then_statement,
             else_block: else_statement,
-        })
+        }))
     }
 
     /// Parse a while statement
-    fn parse_while_statement(&mut self) -> Result<Statement> {
+    fn parse_while_statement(&mut self) -> Result<StmtId> {
         self.consume(TokenType::LeftParen, "Expected '(' after 'while'")?;
         let condition = self.parse_expression()?;
         self.consume(TokenType::RightParen, "Expected ')' after while condition")?;
 
-        let body = Box::new(self.parse_statement()?);
+        let body = self.parse_statement()?;
 
-        Ok(Statement::While { condition, body })
+        Ok(self.push_stmt(Statement::While { condition, body }))
     }
 
     /// Parse a do-while statement
-    fn parse_do_while_statement(&mut self) -> Result<Statement> {
-        let body = Box::new(self.parse_statement()?);
+    fn parse_do_while_statement(&mut self) -> Result<StmtId> {
+        let body = self.parse_statement()?;
 
         self.consume(TokenType::While, "Expected 'while' after do block")?;
         self.consume(TokenType::LeftParen, "Expected '(' after 'while'")?;
@@ -97,11 +111,11 @@ impl Parser {
         self.consume(TokenType::RightParen, "Expected ')' after while condition")?;
         self.consume(TokenType::Semicolon, "Expected ';' after do-while statement")?;
 
-        Ok(Statement::DoWhile { body, condition })
+        Ok(self.push_stmt(Statement::DoWhile { body, condition }))
     }
 
     /// Parse a for statement
-    fn parse_for_statement(&mut self) -> Result<Statement> {
+    fn parse_for_statement(&mut self) -> Result<StmtId> {
         self.consume(TokenType::LeftParen, "Expected '(' after 'for'")?;
 
         // Parse initializer
@@ -110,11 +124,11 @@ impl Parser {
         } else if self.is_type_specifier() {
             // C99 style for loop with declaration in initializer
             let declaration = self.parse_variable_declaration()?;
-            Some(Box::new(declaration))
+            Some(declaration)
         } else {
             let expr = self.parse_expression()?;
             self.consume(TokenType::Semicolon, "Expected ';' after for initializer")?;
-            Some(Box::new(Statement::ExpressionStatement(expr)))
+            Some(self.push_stmt(Statement::ExpressionStatement(expr)))
         };
 
         // Parse condition
@@ -134,44 +148,44 @@ impl Parser {
         self.consume(TokenType::RightParen, "Expected ')' after for clauses")?;
 
         // Parse body
-        let body = Box::new(self.parse_statement()?);
+        let body = self.parse_statement()?;
 
-        Ok(Statement::For {
+        Ok(self.push_stmt(Statement::For {
             initializer,
             condition,
             increment,
             body,
-        })
+        }))
     }
 
     /// Parse a return statement
-    fn parse_return_statement(&mut self) -> Result<Statement> {
+    fn parse_return_statement(&mut self) -> Result<StmtId> {
         let value = if self.check(TokenType::Semicolon) {
             // Return with no value (void)
-            Expression::IntegerLiteral(0) // Placeholder
+            self.push_expr(Expression::IntegerLiteral(0)) // Placeholder
         } else {
             self.parse_expression()?
         };
 
         self.consume(TokenType::Semicolon, "Expected ';' after return value")?;
 
-        Ok(Statement::Return(value))
+        Ok(self.push_stmt(Statement::Return(value)))
     }
 
     /// Parse a break statement
-    fn parse_break_statement(&mut self) -> Result<Statement> {
+    fn parse_break_statement(&mut self) -> Result<StmtId> {
         self.consume(TokenType::Semicolon, "Expected ';' after 'break'")?;
-        Ok(Statement::Break)
+        Ok(self.push_stmt(Statement::Break))
     }
 
     /// Parse a continue statement
-    fn parse_continue_statement(&mut self) -> Result<Statement> {
+    fn parse_continue_statement(&mut self) -> Result<StmtId> {
         self.consume(TokenType::Semicolon, "Expected ';' after 'continue'")?;
-        Ok(Statement::Continue)
+        Ok(self.push_stmt(Statement::Continue))
     }
 
     /// Parse a switch statement
-    fn parse_switch_statement(&mut self) -> Result<Statement> {
+    fn parse_switch_statement(&mut self) -> Result<StmtId> {
         self.consume(TokenType::LeftParen, "Expected '(' after 'switch'")?;
         let expression = self.parse_expression()?;
         self.consume(TokenType::RightParen, "Expected ')' after switch expression")?;
@@ -225,37 +239,37 @@ impl Parser {
 
         self.consume(TokenType::RightBrace, "Expected '}' after switch cases")?;
 
-        Ok(Statement::Switch { expression, cases })
+        Ok(self.push_stmt(Statement::Switch { expression, cases }))
     }
 
     /// Parse an expression statement
-    fn parse_expression_statement(&mut self) -> Result<Statement> {
+    fn parse_expression_statement(&mut self) -> Result<StmtId> {
         let expr = self.parse_expression()?;
         self.consume(TokenType::Semicolon, "Expected ';' after expression")?;
-        Ok(Statement::ExpressionStatement(expr))
+        Ok(self.push_stmt(Statement::ExpressionStatement(expr)))
     }
 
     /// Parse a goto statement
-    fn parse_goto_statement(&mut self) -> Result<Statement> {
+    fn parse_goto_statement(&mut self) -> Result<StmtId> {
         let label = self.consume(TokenType::Identifier, "Expected label name after 'goto'")?
-            .lexeme
-            .clone();
+            .lexeme()
+            .to_string();
         self.consume(TokenType::Semicolon, "Expected ';' after goto label")?;
-        Ok(Statement::Goto(label))
+        Ok(self.push_stmt(Statement::Goto(label)))
     }
 
     /// Parse a labeled statement
-    fn parse_labeled_statement(&mut self) -> Result<Statement> {
+    fn parse_labeled_statement(&mut self) -> Result<StmtId> {
         let label = self.consume(TokenType::Identifier, "Expected label name")?
-            .lexeme
-            .clone();
+            .lexeme()
+            .to_string();
         self.consume(TokenType::Colon, "Expected ':' after label name")?;
         let statement = self.parse_statement()?;
-        Ok(Statement::Label(label, Box::new(statement)))
+        Ok(self.push_stmt(Statement::Label(label, statement)))
     }
 
     /// Parse a _Static_assert statement (C11)
-    fn parse_static_assert_statement(&mut self) -> Result<Statement> {
+    fn parse_static_assert_statement(&mut self) -> Result<StmtId> {
         self.consume(TokenType::LeftParen, "Expected '(' after '_Static_assert'")?;
         
         // Parse the condition
@@ -265,19 +279,19 @@ impl Parser {
         
         // Parse the message string
         let message_token = self.consume(TokenType::StringLiteral, "Expected string literal message in _Static_assert")?;
-        let message = message_token.lexeme.clone();
+        let message = message_token.lexeme().to_string();
         
         self.consume(TokenType::RightParen, "Expected ')' after _Static_assert")?;
         self.consume(TokenType::Semicolon, "Expected ';' after _Static_assert")?;
         
-        Ok(Statement::StaticAssert {
+        Ok(self.push_stmt(Statement::StaticAssert {
             condition,
             message,
-        })
+        }))
     }
 
     /// Parse an atomic statement (C11)
-    fn parse_atomic_statement(&mut self) -> Result<Statement> {
+    fn parse_atomic_statement(&mut self) -> Result<StmtId> {
         // _Atomic compound statement
         self.consume(TokenType::LeftBrace, "Expected '{' after '_Atomic'")?;
         
@@ -289,26 +303,26 @@ impl Parser {
         
         self.consume(TokenType::RightBrace, "Expected '}' after atomic block")?;
         
-        Ok(Statement::AtomicBlock(statements))
+        Ok(self.push_stmt(Statement::AtomicBlock(statements)))
     }
 
     /// Parse a _Thread_local statement (C11)
-    fn parse_thread_local_statement(&mut self) -> Result<Statement> {
+    fn parse_thread_local_statement(&mut self) -> Result<StmtId> {
         // _Thread_local declaration
         let declaration = self.parse_statement()?;
         
-        Ok(Statement::ThreadLocal {
-            declaration: Box::new(declaration),
-        })
+        Ok(self.push_stmt(Statement::ThreadLocal {
+            declaration,
+        }))
     }
 
     /// Parse a _Noreturn statement (C11)
-    fn parse_noreturn_statement(&mut self) -> Result<Statement> {
+    fn parse_noreturn_statement(&mut self) -> Result<StmtId> {
         // _Noreturn function
         let declaration = self.parse_statement()?;
         
-        Ok(Statement::NoReturn {
-            declaration: Box::new(declaration),
-        })
+        Ok(self.push_stmt(Statement::NoReturn {
+            declaration,
+        }))
     }
 }
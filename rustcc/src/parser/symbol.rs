@@ -0,0 +1,161 @@
+// symbol.rs
+// Global string interner shared by the lexer, parser, analyzer and code generator
+//
+// Looking a symbol's text up takes no lock: the texts live in an append-only
+// table of chunks, each twice the size of the one before, so a slot never
+// moves once written. A slot is written before its symbol is handed out and
+// read with an acquire load, so the parallel parser, code generator and
+// obfuscation passes share no writable cache line when they only read.
+// Interning new text still takes the lock on the map from text to symbol.
+
+use std::collections::HashMap;
+use std::fmt;
+use std::num::NonZeroU32;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{OnceLock, RwLock};
+
+// Slots in the first chunk of the table
+const FIRST_CHUNK: usize = 1024;
+
+// Enough chunks of doubling size for every u32 id
+const CHUNKS: usize = 23;
+
+/// An interned string.
+///
+/// Symbols are small `Copy` ids that compare and hash as integers. The text
+/// behind a symbol lives for the rest of the process, so `as_str` can hand out
+/// a `&'static str` and symbols can be freely shared between threads.
+#[derive(Clone, Copy, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct Symbol(NonZeroU32);
+
+type Chunk = Box<[OnceLock<&'static str>]>;
+
+// The text of every symbol, by id
+static STRINGS: [OnceLock<Chunk>; CHUNKS] = [const { OnceLock::new() }; CHUNKS];
+
+// Bytes of text interned so far
+static BYTES: AtomicUsize = AtomicUsize::new(0);
+
+fn ids() -> &'static RwLock<HashMap<&'static str, Symbol>> {
+    static IDS: OnceLock<RwLock<HashMap<&'static str, Symbol>>> = OnceLock::new();
+    IDS.get_or_init(|| RwLock::new(HashMap::new()))
+}
+
+// The chunk holding the `index`th symbol and its place there
+fn slot(index: usize) -> (usize, usize) {
+    let chunk = (index / FIRST_CHUNK + 1).ilog2() as usize;
+    (chunk, index - FIRST_CHUNK * ((1 << chunk) - 1))
+}
+
+impl Symbol {
+    /// Returns the symbol for `text`, interning it on first use
+    pub fn intern(text: &str) -> Symbol {
+        // Fast path: most lookups hit an existing entry
+        {
+            let ids = ids().read().unwrap_or_else(|e| e.into_inner());
+            if let Some(&symbol) = ids.get(text) {
+                return symbol;
+            }
+        }
+
+        let mut ids = ids().write().unwrap_or_else(|e| e.into_inner());
+        // Another thread may have won the race between the two locks
+        if let Some(&symbol) = ids.get(text) {
+            return symbol;
+        }
+
+        let text: &'static str = Box::leak(text.to_owned().into_boxed_str());
+        let index = ids.len();
+        let (chunk, offset) = slot(index);
+        let chunk = STRINGS[chunk].get_or_init(|| (0..FIRST_CHUNK << chunk).map(|_| OnceLock::new()).collect());
+        chunk[offset].set(text).expect("symbol slot is written once");
+        let symbol = Symbol(NonZeroU32::new(u32::try_from(index + 1).expect("symbol table overflow")).unwrap());
+        ids.insert(text, symbol);
+        BYTES.fetch_add(text.len(), Ordering::Relaxed);
+        symbol
+    }
+
+    /// Returns the interned text
+    pub fn as_str(self) -> &'static str {
+        let (chunk, offset) = slot(self.0.get() as usize - 1);
+        STRINGS[chunk].get().and_then(|chunk| chunk[offset].get()).expect("symbol was interned")
+    }
+
+    /// Bytes of text interned by the process so far, which are never freed
+    pub fn interned_bytes() -> usize {
+        BYTES.load(Ordering::Relaxed)
+    }
+
+}
+
+impl From<&str> for Symbol {
+    fn from(text: &str) -> Self {
+        Symbol::intern(text)
+    }
+}
+
+impl From<String> for Symbol {
+    fn from(text: String) -> Self {
+        Symbol::intern(&text)
+    }
+}
+
+impl PartialEq<str> for Symbol {
+    fn eq(&self, other: &str) -> bool {
+        self.as_str() == other
+    }
+}
+
+impl PartialEq<&str> for Symbol {
+    fn eq(&self, other: &&str) -> bool {
+        self.as_str() == *other
+    }
+}
+
+impl fmt::Display for Symbol {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.write_str(self.as_str())
+    }
+}
+
+impl fmt::Debug for Symbol {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{:?}", self.as_str())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_intern_is_stable() {
+        let a = Symbol::intern("counter");
+        let b = Symbol::intern(&String::from("counter"));
+        let c = Symbol::intern("other");
+
+        assert_eq!(a, b);
+        assert_ne!(a, c);
+        assert_eq!(a.as_str(), "counter");
+        assert!(a == "counter");
+    }
+
+    #[test]
+    fn test_symbols_are_read_across_chunks_and_threads() {
+        assert_eq!(slot(0), (0, 0));
+        assert_eq!(slot(FIRST_CHUNK - 1), (0, FIRST_CHUNK - 1));
+        assert_eq!(slot(FIRST_CHUNK), (1, 0));
+        assert_eq!(slot(3 * FIRST_CHUNK), (2, 0));
+
+        let symbols: Vec<Symbol> = (0..3 * FIRST_CHUNK).map(|n| Symbol::intern(&format!("chunked_{}", n))).collect();
+        std::thread::scope(|scope| {
+            for _ in 0..4 {
+                scope.spawn(|| {
+                    for (n, symbol) in symbols.iter().enumerate() {
+                        assert_eq!(symbol.as_str(), format!("chunked_{}", n));
+                    }
+                });
+            }
+        });
+    }
+}
@@ -1,10 +1,32 @@
-#[derive(Debug, PartialEq, Clone)]
+use crate::parser::symbol::Symbol;
+
+/// Byte range of a token within the lexed source
+#[derive(Debug, PartialEq, Eq, Clone, Copy, Default)]
+pub struct Span {
+    pub start: u32,
+    pub len: u32,
+}
+
+/// A lexed token.
+///
+/// Tokens are small `Copy` values: the text is interned rather than owned,
+/// so a token stream can be handed from the lexer to the parser by move and
+/// indexed without any per-token allocation.
+#[derive(Debug, PartialEq, Clone, Copy)]
 pub struct Token {
     pub token_type: TokenType,   // The kind of token (from your enum)
-    pub lexeme: String,          // The actual text from the source code
-    pub line: usize,             // Line where the token appears
-    pub column: usize,           // Column where the token appears
-    pub literal: Option<String>, // Optional literal value for constants/strings
+    pub symbol: Symbol,          // Interned text of the token
+    pub literal: Option<Symbol>, // Optional literal value for constants/strings
+    pub span: Span,              // Byte range in the source
+    pub line: u32,               // Line where the token appears
+    pub column: u32,             // Column where the token appears
+}
+
+impl Token {
+    /// Returns the source text of this token
+    pub fn lexeme(&self) -> &'static str {
+        self.symbol.as_str()
+    }
 }
 
 #[derive(Debug, PartialEq, Clone, Copy)]
@@ -3,17 +3,32 @@ use crate::parser::token::{Token, TokenType};
 use crate::parser::Parser;
 
 impl Parser {
-    // Helper method to synchronize after error
-    #[allow(dead_code)]
+    // Skips past a statement that failed to parse: to just after its `;`
+    // or its block, to the start of the next statement when the `;` is
+    // missing, or to the `}` closing the enclosing block. Moves on at least
+    // one token unless already at that `}`, so statement loops always end.
     pub fn synchronize(&mut self) {
-        self.advance();
+        let start = self.current;
+        let mut braces = 0usize;
+        let mut parens = 0usize;
 
         while !self.is_at_end() {
-            if self.previous().token_type == TokenType::Semicolon {
-                return;
-            }
-
             match self.peek().token_type {
+                TokenType::RightBrace if braces == 0 => return,
+                TokenType::RightBrace => {
+                    braces -= 1;
+                    if braces == 0 {
+                        self.advance();
+                        return;
+                    }
+                }
+                TokenType::LeftBrace => braces += 1,
+                TokenType::LeftParen => parens += 1,
+                TokenType::RightParen => parens = parens.saturating_sub(1),
+                TokenType::Semicolon if braces == 0 && parens == 0 => {
+                    self.advance();
+                    return;
+                }
                 TokenType::Int
                 | TokenType::Void
                 | TokenType::Char
@@ -21,7 +36,11 @@ impl Parser {
                 | TokenType::While
                 | TokenType::For
                 | TokenType::Return
-                | TokenType::Struct => return,
+                | TokenType::Struct
+                    if braces == 0 && parens == 0 && self.current > start =>
+                {
+                    return
+                }
                 _ => {}
             }
 
@@ -29,6 +48,26 @@ impl Parser {
         }
     }
 
+    // Skips past a file-scope declaration that failed to parse: to just
+    // after its `;`, or after the `}` ending its body
+    pub fn synchronize_declaration(&mut self) {
+        let mut depth = 0usize;
+
+        while !self.is_at_end() {
+            match self.advance().token_type {
+                TokenType::LeftBrace => depth += 1,
+                TokenType::RightBrace if depth <= 1 => {
+                    // A struct or enum declaration ends with `};`
+                    self.match_token(TokenType::Semicolon);
+                    return;
+                }
+                TokenType::RightBrace => depth -= 1,
+                TokenType::Semicolon if depth == 0 => return,
+                _ => {}
+            }
+        }
+    }
+
     // Helper methods
     pub fn match_token(&mut self, token_type: TokenType) -> bool {
         if self.check(token_type) {
@@ -65,7 +104,7 @@ impl Parser {
     }
 
     pub fn is_at_end(&self) -> bool {
-        self.peek().token_type == TokenType::Eof
+        self.current >= self.end || self.peek().token_type == TokenType::Eof
     }
 
     pub fn peek(&self) -> &Token {
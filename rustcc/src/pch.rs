@@ -0,0 +1,643 @@
+// pch.rs
+// Precompiled headers
+//
+// A precompiled header is a snapshot of a header after preprocessing and
+// parsing it: the macro table and the structs, typedefs, enum constants,
+// function prototypes and global variables it declares. Compiling a file against it starts from that
+// state and skips the header's #include, so the header chain is not read,
+// lexed or parsed again.
+//
+// The file is a compact little-endian encoding: a magic number and format
+// version, the canonical path and modification time of the header (a PCH is
+// rejected once its header changes), then the macros and declarations.
+
+use crate::parser::ast::{Expression, Function, FunctionParameter, Program, Statement, Struct, StructField, Type};
+use crate::parser::symbol::Symbol;
+use crate::preprocessor::native::macros::{Macro, Token, TokenKind};
+use crate::preprocessor::NativePreprocessor;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+const MAGIC: &[u8; 8] = b"RUSTCCPH";
+const VERSION: u32 = 2;
+// How deeply a type may nest, so a malformed file can't exhaust the stack
+const MAX_TYPE_DEPTH: usize = 256;
+
+/// A global variable declared by the header
+struct Global {
+    name: Symbol,
+    data_type: Option<Type>,
+    // A literal; other initializers aren't precompiled
+    initializer: Expression,
+    alignment: Option<usize>,
+}
+
+pub struct PrecompiledHeader {
+    header: PathBuf,
+    modified: SystemTime,
+    macros: Vec<(String, Macro)>,
+    structs: Vec<Struct>,
+    typedefs: Vec<(Symbol, Type)>,
+    enum_constants: Vec<(Symbol, i32)>,
+    prototypes: Vec<Function>,
+    globals: Vec<Global>,
+}
+
+impl PrecompiledHeader {
+    /// Captures the state left by preprocessing `header` with `preprocessor`
+    /// and parsing it into `program`
+    pub fn new(header: &Path, preprocessor: &NativePreprocessor, program: &Program) -> Result<Self, String> {
+        let header = fs::canonicalize(header).map_err(|e| format!("Failed to resolve {}: {}", header.display(), e))?;
+        let modified = modification_time(&header)?;
+
+        let mut macros: Vec<(String, Macro)> = preprocessor
+            .defines
+            .iter()
+            .map(|(name, definition)| (name.clone(), definition.clone()))
+            .collect();
+        // Sorted so the same header always gives the same file
+        macros.sort_by(|a, b| a.0.cmp(&b.0));
+
+        let prototypes = program
+            .functions
+            .iter()
+            .map(|function| match function.body.is_empty() {
+                true => Ok(function.clone()),
+                false => Err(format!("Function definitions can't be precompiled: {}", function.name)),
+            })
+            .collect::<Result<_, _>>()?;
+
+        let globals = program
+            .globals
+            .iter()
+            .map(|&global| match &program.arena[global] {
+                Statement::VariableDeclaration { name, data_type, initializer, alignment, .. } => {
+                    match &program.arena[*initializer] {
+                        literal @ (Expression::IntegerLiteral(_)
+                        | Expression::CharLiteral(_)
+                        | Expression::FloatLiteral(_)
+                        | Expression::StringLiteral(_)) => Ok(Global {
+                            name: *name,
+                            data_type: data_type.clone(),
+                            initializer: literal.clone(),
+                            alignment: *alignment,
+                        }),
+                        _ => Err(format!("Only literal initializers can be precompiled: {}", name)),
+                    }
+                }
+                _ => Err("Unsupported global declaration in precompiled header".to_string()),
+            })
+            .collect::<Result<_, _>>()?;
+
+        Ok(PrecompiledHeader {
+            header,
+            modified,
+            macros,
+            structs: program.structs.clone(),
+            typedefs: program.typedefs.clone(),
+            enum_constants: program.enum_constants.clone(),
+            prototypes,
+            globals,
+        })
+    }
+
+    /// Reads a precompiled header, checking that its header hasn't changed
+    pub fn read(path: &Path) -> Result<Self, String> {
+        let bytes = fs::read(path).map_err(|e| format!("Failed to read precompiled header {}: {}", path.display(), e))?;
+        let pch = Reader { bytes: &bytes, position: 0, depth: 0 }
+            .precompiled_header()
+            .ok_or_else(|| format!("Invalid precompiled header: {}", path.display()))?;
+        if modification_time(&pch.header).ok() != Some(pch.modified) {
+            return Err(format!(
+                "Precompiled header {} is out of date: {} has changed",
+                path.display(),
+                pch.header.display()
+            ));
+        }
+        Ok(pch)
+    }
+
+    pub fn write(&self, path: &Path) -> Result<(), String> {
+        let mut writer = Writer { bytes: Vec::new() };
+        writer.precompiled_header(self);
+        fs::write(path, writer.bytes).map_err(|e| format!("Failed to write precompiled header: {}", e))
+    }
+
+    /// Identifies the header the PCH was made from, as it was then
+    pub fn fingerprint(&self) -> String {
+        format!("{} {:?}", self.header.display(), self.modified)
+    }
+
+    /// Gives `preprocessor` the header's macros and makes it skip the header
+    pub fn apply_to_preprocessor(&self, preprocessor: &mut NativePreprocessor) {
+        preprocessor.defines.extend(self.macros.iter().cloned());
+        preprocessor.macro_generation += 1;
+        preprocessor.precompiled.insert(self.header.clone());
+    }
+
+    /// The names the header declared with typedef, which the parser must
+    /// know are types
+    pub fn type_names(&self) -> Vec<Symbol> {
+        self.typedefs.iter().map(|&(name, _)| name).collect()
+    }
+
+    /// Adds the header's declarations in front of those of `program`
+    pub fn add_declarations(&self, program: &mut Program) {
+        program.structs.splice(0..0, self.structs.iter().cloned());
+        program.typedefs.splice(0..0, self.typedefs.iter().cloned());
+        program.enum_constants.splice(0..0, self.enum_constants.iter().copied());
+        program.functions.splice(0..0, self.prototypes.iter().cloned());
+        let globals: Vec<_> = self
+            .globals
+            .iter()
+            .map(|global| {
+                let initializer = program.arena.alloc_expr(global.initializer.clone());
+                program.arena.alloc_stmt(Statement::VariableDeclaration {
+                    name: global.name,
+                    data_type: global.data_type.clone(),
+                    initializer,
+                    is_global: true,
+                    alignment: global.alignment,
+                })
+            })
+            .collect();
+        program.globals.splice(0..0, globals);
+    }
+}
+
+fn modification_time(path: &Path) -> Result<SystemTime, String> {
+    fs::metadata(path)
+        .and_then(|metadata| metadata.modified())
+        .map_err(|e| format!("Failed to read {}: {}", path.display(), e))
+}
+
+struct Writer {
+    bytes: Vec<u8>,
+}
+
+impl Writer {
+    fn u8(&mut self, value: u8) {
+        self.bytes.push(value);
+    }
+
+    fn u32(&mut self, value: u32) {
+        self.bytes.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn u64(&mut self, value: u64) {
+        self.bytes.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn bool(&mut self, value: bool) {
+        self.u8(value as u8);
+    }
+
+    fn len(&mut self, len: usize) {
+        self.u32(u32::try_from(len).expect("precompiled header too large"));
+    }
+
+    fn str(&mut self, value: &str) {
+        self.len(value.len());
+        self.bytes.extend_from_slice(value.as_bytes());
+    }
+
+    fn option<T>(&mut self, value: Option<T>, write: impl FnOnce(&mut Self, T)) {
+        self.bool(value.is_some());
+        if let Some(value) = value {
+            write(self, value);
+        }
+    }
+
+    fn precompiled_header(&mut self, pch: &PrecompiledHeader) {
+        self.bytes.extend_from_slice(MAGIC);
+        self.u32(VERSION);
+        self.str(&pch.header.to_string_lossy());
+        let modified = pch.modified.duration_since(UNIX_EPOCH).unwrap_or_default();
+        self.u64(modified.as_secs());
+        self.u32(modified.subsec_nanos());
+
+        self.len(pch.macros.len());
+        for (name, definition) in &pch.macros {
+            self.str(name);
+            self.option(definition.params.as_ref(), |w, params| {
+                w.len(params.len());
+                params.iter().for_each(|param| w.str(param));
+            });
+            self.bool(definition.variadic);
+            self.len(definition.body.len());
+            for token in &definition.body {
+                self.u8(token.kind as u8);
+                self.str(&token.text);
+                self.bool(!token.space.is_empty());
+            }
+        }
+
+        self.len(pch.structs.len());
+        for struct_def in &pch.structs {
+            self.str(&struct_def.name);
+            self.len(struct_def.fields.len());
+            for field in &struct_def.fields {
+                self.str(&field.name);
+                self.ty(&field.data_type);
+            }
+        }
+
+        self.len(pch.typedefs.len());
+        for (name, ty) in &pch.typedefs {
+            self.str(name.as_str());
+            self.ty(ty);
+        }
+
+        self.len(pch.enum_constants.len());
+        for (name, value) in &pch.enum_constants {
+            self.str(name.as_str());
+            self.u32(*value as u32);
+        }
+
+        self.len(pch.prototypes.len());
+        for function in &pch.prototypes {
+            self.str(function.name.as_str());
+            self.ty(&function.return_type);
+            self.len(function.parameters.len());
+            for param in &function.parameters {
+                self.str(param.name.as_str());
+                self.ty(&param.data_type);
+            }
+            self.bool(function.is_variadic);
+            self.bool(function.is_external);
+        }
+
+        self.len(pch.globals.len());
+        for global in &pch.globals {
+            self.str(global.name.as_str());
+            self.option(global.data_type.as_ref(), Self::ty);
+            match &global.initializer {
+                Expression::IntegerLiteral(value) => {
+                    self.u8(0);
+                    self.u32(*value as u32);
+                }
+                Expression::CharLiteral(value) => {
+                    self.u8(1);
+                    self.u32(*value as u32);
+                }
+                Expression::FloatLiteral(value) => {
+                    self.u8(2);
+                    self.u64(value.to_bits());
+                }
+                Expression::StringLiteral(value) => {
+                    self.u8(3);
+                    self.str(value);
+                }
+                _ => unreachable!("only literal initializers are precompiled"),
+            }
+            self.option(global.alignment, |w, alignment| w.u64(alignment as u64));
+        }
+    }
+
+    fn ty(&mut self, ty: &Type) {
+        match ty {
+            Type::Int => self.u8(0),
+            Type::Char => self.u8(1),
+            Type::Void => self.u8(2),
+            Type::Float => self.u8(3),
+            Type::Double => self.u8(4),
+            Type::Short => self.u8(5),
+            Type::Long => self.u8(6),
+            Type::LongLong => self.u8(7),
+            Type::UnsignedInt => self.u8(8),
+            Type::UnsignedChar => self.u8(9),
+            Type::UnsignedShort => self.u8(10),
+            Type::UnsignedLong => self.u8(11),
+            Type::UnsignedLongLong => self.u8(12),
+            Type::Bool => self.u8(13),
+            Type::Pointer(inner) => {
+                self.u8(14);
+                self.ty(inner);
+            }
+            Type::Array(inner, size) => {
+                self.u8(15);
+                self.ty(inner);
+                self.option(*size, |w, size| w.u64(size as u64));
+            }
+            Type::Struct(name) => {
+                self.u8(16);
+                self.str(name);
+            }
+            Type::Const(inner) => {
+                self.u8(17);
+                self.ty(inner);
+            }
+            Type::Volatile(inner) => {
+                self.u8(18);
+                self.ty(inner);
+            }
+            Type::Restrict(inner) => {
+                self.u8(19);
+                self.ty(inner);
+            }
+            Type::Union(name) => {
+                self.u8(20);
+                self.str(name);
+            }
+            Type::Function { return_type, parameters, is_variadic } => {
+                self.u8(21);
+                self.ty(return_type);
+                self.len(parameters.len());
+                for (name, ty) in parameters {
+                    self.str(name);
+                    self.ty(ty);
+                }
+                self.bool(*is_variadic);
+            }
+            Type::TypeDef(name) => {
+                self.u8(22);
+                self.str(name);
+            }
+            Type::Complex => self.u8(23),
+            Type::Imaginary => self.u8(24),
+            Type::Atomic(inner) => {
+                self.u8(25);
+                self.ty(inner);
+            }
+            Type::Generic { controlling_type, associations, default_type } => {
+                self.u8(26);
+                self.ty(controlling_type);
+                self.len(associations.len());
+                for (ty, result) in associations {
+                    self.ty(ty);
+                    self.ty(result);
+                }
+                self.option(default_type.as_deref(), Self::ty);
+            }
+        }
+    }
+}
+
+/// Decodes what `Writer` encodes, returning `None` for malformed input
+struct Reader<'a> {
+    bytes: &'a [u8],
+    position: usize,
+    depth: usize,
+}
+
+impl Reader<'_> {
+    fn take(&mut self, len: usize) -> Option<&[u8]> {
+        let bytes = self.bytes.get(self.position..self.position.checked_add(len)?)?;
+        self.position += len;
+        Some(bytes)
+    }
+
+    fn u8(&mut self) -> Option<u8> {
+        Some(self.take(1)?[0])
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_le_bytes(self.take(8)?.try_into().ok()?))
+    }
+
+    fn bool(&mut self) -> Option<bool> {
+        match self.u8()? {
+            0 => Some(false),
+            1 => Some(true),
+            _ => None,
+        }
+    }
+
+    fn len(&mut self) -> Option<usize> {
+        Some(self.u32()? as usize)
+    }
+
+    fn string(&mut self) -> Option<String> {
+        let len = self.len()?;
+        String::from_utf8(self.take(len)?.to_vec()).ok()
+    }
+
+    fn option<T>(&mut self, read: impl FnOnce(&mut Self) -> Option<T>) -> Option<Option<T>> {
+        match self.bool()? {
+            true => read(self).map(Some),
+            false => Some(None),
+        }
+    }
+
+    fn vec<T>(&mut self, mut read: impl FnMut(&mut Self) -> Option<T>) -> Option<Vec<T>> {
+        let len = self.len()?;
+        // Lengths aren't trusted for allocation sizes
+        let mut items = Vec::with_capacity(len.min(1024));
+        for _ in 0..len {
+            items.push(read(self)?);
+        }
+        Some(items)
+    }
+
+    fn precompiled_header(&mut self) -> Option<PrecompiledHeader> {
+        if self.take(MAGIC.len())? != MAGIC || self.u32()? != VERSION {
+            return None;
+        }
+        let header = PathBuf::from(self.string()?);
+        let (secs, nanos) = (self.u64()?, self.u32()?);
+        if nanos >= 1_000_000_000 {
+            return None;
+        }
+        let modified = UNIX_EPOCH.checked_add(Duration::new(secs, nanos))?;
+
+        let macros = self.vec(|r| {
+            let name = r.string()?;
+            let params = r.option(|r| r.vec(Self::string))?;
+            let variadic = r.bool()?;
+            let body = r.vec(|r| {
+                let kind = match r.u8()? {
+                    0 => TokenKind::Identifier,
+                    1 => TokenKind::Number,
+                    2 => TokenKind::Literal,
+                    3 => TokenKind::Punct,
+                    _ => return None,
+                };
+                Some(Token::body(kind, r.string()?, r.bool()?))
+            })?;
+            Some((name, Macro { params, variadic, body }))
+        })?;
+
+        let structs = self.vec(|r| {
+            Some(Struct {
+                name: r.string()?,
+                fields: r.vec(|r| Some(StructField { name: r.string()?, data_type: r.ty()? }))?,
+            })
+        })?;
+
+        let typedefs = self.vec(|r| Some((Symbol::intern(&r.string()?), r.ty()?)))?;
+        let enum_constants = self.vec(|r| Some((Symbol::intern(&r.string()?), r.u32()? as i32)))?;
+
+        let prototypes = self.vec(|r| {
+            Some(Function {
+                name: Symbol::intern(&r.string()?),
+                return_type: r.ty()?,
+                parameters: r.vec(|r| {
+                    Some(FunctionParameter { name: Symbol::intern(&r.string()?), data_type: r.ty()? })
+                })?,
+                body: Vec::new(),
+                is_variadic: r.bool()?,
+                is_external: r.bool()?,
+                arena: Default::default(),
+            })
+        })?;
+
+        let globals = self.vec(|r| {
+            Some(Global {
+                name: Symbol::intern(&r.string()?),
+                data_type: r.option(Self::ty)?,
+                initializer: match r.u8()? {
+                    0 => Expression::IntegerLiteral(r.u32()? as i32),
+                    1 => Expression::CharLiteral(char::from_u32(r.u32()?)?),
+                    2 => Expression::FloatLiteral(f64::from_bits(r.u64()?)),
+                    3 => Expression::StringLiteral(r.string()?),
+                    _ => return None,
+                },
+                alignment: r.option(|r| Some(r.u64()? as usize))?,
+            })
+        })?;
+
+        // Anything left over means the file isn't what it claims to be
+        (self.position == self.bytes.len()).then_some(PrecompiledHeader {
+            header,
+            modified,
+            macros,
+            structs,
+            typedefs,
+            enum_constants,
+            prototypes,
+            globals,
+        })
+    }
+
+    fn ty(&mut self) -> Option<Type> {
+        if self.depth == MAX_TYPE_DEPTH {
+            return None;
+        }
+        self.depth += 1;
+        let ty = self.nested_ty();
+        self.depth -= 1;
+        ty
+    }
+
+    fn nested_ty(&mut self) -> Option<Type> {
+        let boxed = |r: &mut Self| r.ty().map(Box::new);
+        Some(match self.u8()? {
+            0 => Type::Int,
+            1 => Type::Char,
+            2 => Type::Void,
+            3 => Type::Float,
+            4 => Type::Double,
+            5 => Type::Short,
+            6 => Type::Long,
+            7 => Type::LongLong,
+            8 => Type::UnsignedInt,
+            9 => Type::UnsignedChar,
+            10 => Type::UnsignedShort,
+            11 => Type::UnsignedLong,
+            12 => Type::UnsignedLongLong,
+            13 => Type::Bool,
+            14 => Type::Pointer(boxed(self)?),
+            15 => Type::Array(boxed(self)?, self.option(|r| Some(r.u64()? as usize))?),
+            16 => Type::Struct(self.string()?),
+            17 => Type::Const(boxed(self)?),
+            18 => Type::Volatile(boxed(self)?),
+            19 => Type::Restrict(boxed(self)?),
+            20 => Type::Union(self.string()?),
+            21 => Type::Function {
+                return_type: boxed(self)?,
+                parameters: self.vec(|r| Some((r.string()?, r.ty()?)))?,
+                is_variadic: self.bool()?,
+            },
+            22 => Type::TypeDef(self.string()?),
+            23 => Type::Complex,
+            24 => Type::Imaginary,
+            25 => Type::Atomic(boxed(self)?),
+            26 => Type::Generic {
+                controlling_type: boxed(self)?,
+                associations: self.vec(|r| Some((r.ty()?, r.ty()?)))?,
+                default_type: self.option(boxed)?,
+            },
+            _ => return None,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::compiler::Compiler;
+    use std::fs;
+    use std::time::{Duration, SystemTime};
+    use tempfile::TempDir;
+
+    #[test]
+    fn test_precompiled_header_replaces_include() {
+        let dir = TempDir::new().unwrap();
+        let path = |name: &str| dir.path().join(name).to_string_lossy().to_string();
+        fs::write(
+            path("common.h"),
+            "#define SCALE(x) ((x) * 3)\nstruct point { int x; int y; };\ntypedef int count;\nenum { LIMIT = 2 };\n\
+             int twice(int x);\nint base = 4;\n",
+        )
+        .unwrap();
+        fs::write(
+            path("main.c"),
+            "#include \"common.h\"\nint twice(count x) { return x + x; }\nint main() { return SCALE(twice(LIMIT)); }\n",
+        )
+        .unwrap();
+
+        Compiler::new(path("common.h"), path("common.pch")).emit_pch(true).compile().unwrap();
+        let compiler = Compiler::new(path("main.c"), path("main.i")).with_pch(path("common.pch")).unwrap();
+
+        // The header is skipped and its macros come from the PCH
+        compiler.clone().preprocess_only(true).compile().unwrap();
+        let preprocessed = fs::read_to_string(path("main.i")).unwrap();
+        assert!(!preprocessed.contains("struct point"));
+        assert!(preprocessed.contains("return ((twice(LIMIT)) * 3);"));
+
+        // Its declarations are part of the program
+        compiler.for_file(&path("main.c"), &path("main.s")).compile().unwrap();
+        assert!(fs::read_to_string(path("main.s")).unwrap().contains("_base:"));
+
+        // A PCH can't be used once its header changes
+        let header = fs::File::options().append(true).open(path("common.h")).unwrap();
+        header.set_modified(SystemTime::now() + Duration::from_secs(1)).unwrap();
+        let error = Compiler::new(path("main.c"), path("main.s")).with_pch(path("common.pch")).err().unwrap();
+        assert!(error.contains("is out of date"));
+    }
+
+    #[test]
+    fn test_malformed_headers_are_rejected() {
+        let dir = TempDir::new().unwrap();
+        let path = dir.path().join("bad.pch");
+        let prefix = |secs: u64, nanos: u32| {
+            let mut writer = Writer { bytes: Vec::new() };
+            writer.bytes.extend_from_slice(MAGIC);
+            writer.u32(VERSION);
+            writer.str("common.h");
+            writer.u64(secs);
+            writer.u32(nanos);
+            writer.bytes
+        };
+        let rejected = |bytes: Vec<u8>| {
+            fs::write(&path, bytes).unwrap();
+            PrecompiledHeader::read(&path).err().unwrap().contains("Invalid precompiled header")
+        };
+
+        // Times past what SystemTime holds
+        assert!(rejected(prefix(u64::MAX, 0)));
+        assert!(rejected(prefix(0, 1_000_000_000)));
+
+        // A typedef nesting deeper than any real type
+        let mut bytes = prefix(0, 0);
+        bytes.extend_from_slice(&[0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, b't']);
+        bytes.extend(std::iter::repeat(14).take(1_000_000));
+        bytes.push(0);
+        assert!(rejected(bytes));
+    }
+}
@@ -6,16 +6,44 @@
 pub mod native;
 pub mod tests;
 
+use std::io::Write;
+
 /// Trait for preprocessors
 pub trait Preprocessor {
     /// Check if the preprocessor is available
     fn is_available(&self) -> bool;
     
+    /// Preprocess a file, writing the output to `out` as it is produced
+    fn preprocess_file_into(&mut self, file_path: &str, out: &mut dyn Write) -> Result<(), String>;
+    
+    /// Preprocess a string, writing the output to `out` as it is produced
+    fn preprocess_string_into(&mut self, content: &str, file_name: &str, out: &mut dyn Write) -> Result<(), String>;
+    
     /// Preprocess a file
-    fn preprocess_file(&mut self, file_path: &str) -> Result<String, String>;
+    fn preprocess_file(&mut self, file_path: &str) -> Result<String, String> {
+        let mut out = Vec::new();
+        self.preprocess_file_into(file_path, &mut out)?;
+        output_string(out)
+    }
     
-    /// Preprocess a string
-    fn preprocess_string(&mut self, content: &str, file_name: &str) -> Result<String, String>;
+    /// Preprocess a string; only the tests need it in one piece
+    #[cfg(test)]
+    fn preprocess_string(&mut self, content: &str, file_name: &str) -> Result<String, String> {
+        let mut out = Vec::new();
+        self.preprocess_string_into(content, file_name, &mut out)?;
+        output_string(out)
+    }
+}
+
+/// Preprocessed output collected in memory, as a string
+pub fn output_string(out: Vec<u8>) -> Result<String, String> {
+    String::from_utf8(out).map_err(|_| "Preprocessed output is not valid UTF-8".to_string())
+}
+
+/// Writes preprocessed output to `out`
+pub(crate) fn write_output(out: &mut dyn Write, text: &str) -> Result<(), String> {
+    out.write_all(text.as_bytes())
+        .map_err(|e| format!("Failed to write preprocessed output: {}", e))
 }
 
 // Re-export NativePreprocessor for convenience
@@ -1,73 +1,411 @@
+use std::io::Write;
+
+use super::macros::{tokenize, Token, TokenKind};
 use super::NativePreprocessor;
 
+/// The name of the directive on `line` and the text after it, if `line` is
+/// a directive
+pub(crate) fn directive_name(line: &str) -> Option<(&str, &str)> {
+    let rest = line.trim_start().strip_prefix('#')?.trim_start();
+    let end = rest.find(|c: char| !c.is_ascii_alphanumeric() && c != '_').unwrap_or(rest.len());
+    Some((&rest[..end], &rest[end..]))
+}
+
+/// Whether `name` starts a conditional block
+fn is_if(name: &str) -> bool {
+    matches!(name, "if" | "ifdef" | "ifndef")
+}
+
+/// Skips the conditional block starting at `start`, looking only at the
+/// directive names of its lines, and returns the index after its #endif
+fn skip_conditional_block(lines: &[&str], start: usize) -> Option<usize> {
+    let mut depth = 0;
+    for (i, line) in lines.iter().enumerate().skip(start) {
+        match directive_name(line) {
+            Some((name, _)) if is_if(name) => depth += 1,
+            Some(("endif", _)) => {
+                depth -= 1;
+                if depth == 0 {
+                    return Some(i + 1);
+                }
+            }
+            _ => {}
+        }
+    }
+    None
+}
+
 impl NativePreprocessor {
-    /// Preprocess content with conditional compilation
-    #[allow(dead_code)]
-    pub(crate) fn preprocess_content(&mut self, content: &str, _current_file: &str) -> Result<String, String> {
-        // Split the content into lines
-        let lines: Vec<&str> = content.lines().collect();
-        let mut processed_lines = Vec::new();
-        
-        // Process the lines with conditional compilation
-        let mut i = 0;
+    /// Process the conditional block (#if, #ifdef, #ifndef) starting at
+    /// `start`, writing the lines of its active group to `out`. Returns the
+    /// index of the line after its #endif. Groups that aren't taken are
+    /// skipped without expanding macros or evaluating nested conditions.
+    pub(crate) fn process_conditional_block(
+        &mut self,
+        lines: &[&str],
+        start: usize,
+        file_name: &str,
+        out: &mut dyn Write,
+    ) -> Result<usize, String> {
+        self.current_line = start + 1;
+        let mut active = self.evaluate_conditional(lines[start])?;
+        // Whether a group has been taken; later ones aren't
+        let mut taken = active;
+        let mut seen_else = false;
+
+        let mut i = start + 1;
         while i < lines.len() {
             let line = lines[i];
-            let trimmed = line.trim();
-            
-            if trimmed.starts_with("#if") || trimmed.starts_with("#ifdef") || trimmed.starts_with("#ifndef") {
-                // Process a conditional block
-                let mut result = String::new();
-                let mut j = i;
-                let mut condition_depth = 1;
-                
-                // Evaluate the initial condition
-                let condition_met = self.evaluate_conditional(trimmed)?;
-                
-                // Skip the initial condition line
-                j += 1;
-                
-                // Process the block
-                while j < lines.len() && condition_depth > 0 {
-                    let block_line = lines[j];
-                    let block_trimmed = block_line.trim();
-                    
-                    if block_trimmed.starts_with("#if") || block_trimmed.starts_with("#ifdef") || block_trimmed.starts_with("#ifndef") {
-                        // Nested condition
-                        condition_depth += 1;
-                    } else if block_trimmed.starts_with("#endif") {
-                        // End of a condition
-                        condition_depth -= 1;
-                        if condition_depth == 0 {
-                            // End of our conditional block
-                            break;
-                        }
-                    } else if condition_depth == 1 && (block_trimmed.starts_with("#else") || block_trimmed.starts_with("#elif")) {
-                        // Else or elif branch
-                        // For now, we'll just add basic handling (simplified)
-                        j += 1;
-                        continue;
-                    } else if condition_met {
-                        // Include the line in the output if the condition is met
-                        result.push_str(block_line);
-                        result.push('\n');
+            match directive_name(line) {
+                Some((name, _)) if is_if(name) => {
+                    i = if active {
+                        self.process_conditional_block(lines, i, file_name, out)?
+                    } else {
+                        skip_conditional_block(lines, i).ok_or_else(|| unterminated(file_name, i))?
+                    };
+                    continue;
+                }
+                Some(("elif", expr)) => {
+                    if seen_else {
+                        return Err(format!("#elif after #else at {}:{}", file_name, i + 1));
+                    }
+                    self.current_line = i + 1;
+                    active = !taken && self.evaluate_if_expression(expr)?;
+                    taken |= active;
+                }
+                Some(("else", _)) => {
+                    if seen_else {
+                        return Err(format!("#else after #else at {}:{}", file_name, i + 1));
+                    }
+                    seen_else = true;
+                    active = !taken;
+                    taken = true;
+                }
+                Some(("endif", _)) => return Ok(i + 1),
+                Some(_) if active => {
+                    self.current_line = i + 1;
+                    self.process_directive(line, file_name, out)?;
+                }
+                None if active => {
+                    self.current_line = i + 1;
+                    self.write_line(line, out)?;
+                }
+                _ => {}
+            }
+            i += 1;
+        }
+
+        Err(unterminated(file_name, start))
+    }
+
+    /// Evaluate an #if, #ifdef or #ifndef line
+    pub(crate) fn evaluate_conditional(&mut self, line: &str) -> Result<bool, String> {
+        let (name, rest) = directive_name(line).unwrap_or(("", ""));
+        match name {
+            "ifdef" | "ifndef" => {
+                let (tokens, _) = tokenize(rest);
+                match tokens.as_slice() {
+                    [token] if token.kind == TokenKind::Identifier => {
+                        Ok(self.is_defined(&token.text) == (name == "ifdef"))
                     }
-                    
-                    j += 1;
+                    _ => Err(format!("Invalid #{} directive: {}", name, line.trim())),
+                }
+            }
+            "if" => self.evaluate_if_expression(rest),
+            _ => Err(format!("Invalid conditional directive: {}", line)),
+        }
+    }
+
+    /// Evaluate the controlling expression of an #if or #elif (C11 6.10.1):
+    /// `defined` operators are replaced first, then macros are expanded and
+    /// identifiers left over are 0. Results are cached until a macro is
+    /// defined or undefined.
+    pub(crate) fn evaluate_if_expression(&mut self, expr: &str) -> Result<bool, String> {
+        let expr = expr.trim();
+        // __LINE__ changes between lines without any #define
+        let cacheable = !expr.contains("__LINE__");
+        if cacheable {
+            if let Some(&(generation, result)) = self.if_cache.get(expr) {
+                if generation == self.macro_generation {
+                    return Ok(result);
                 }
-                
-                // Add the processed conditional block
-                processed_lines.push(result);
-                
-                // Move past the entire conditional block
-                i = j + 1;
-            } else {
-                // Regular line, add it as is
-                processed_lines.push(line.to_string());
-                i += 1;
             }
         }
-        
-        // Join the processed lines
-        Ok(processed_lines.join("\n"))
+
+        let invalid = || format!("Invalid #if expression: {}", expr);
+        let (tokens, _) = tokenize(expr);
+        let mut replaced = Vec::with_capacity(tokens.len());
+        let mut tokens = tokens.into_iter();
+        while let Some(token) = tokens.next() {
+            if token.kind != TokenKind::Identifier || token.text != "defined" {
+                replaced.push(token);
+                continue;
+            }
+            // defined X or defined ( X )
+            let mut operand = tokens.next().ok_or_else(invalid)?;
+            let parenthesized = operand.text == "(";
+            if parenthesized {
+                operand = tokens.next().ok_or_else(invalid)?;
+            }
+            if operand.kind != TokenKind::Identifier
+                || (parenthesized && tokens.next().is_none_or(|close| close.text != ")"))
+            {
+                return Err(invalid());
+            }
+            let value = if self.is_defined(&operand.text) { "1" } else { "0" };
+            replaced.push(Token::body(TokenKind::Number, value.to_string(), !token.space.is_empty()));
+        }
+
+        let expanded = self.expand(replaced);
+        let mut evaluator = Evaluator { tokens: &expanded, position: 0 };
+        let value = evaluator.conditional(true)?;
+        if evaluator.position != expanded.len() {
+            return Err(invalid());
+        }
+        let result = value.bits != 0;
+
+        if cacheable {
+            self.if_cache.insert(expr.to_string(), (self.macro_generation, result));
+        }
+        Ok(result)
+    }
+}
+
+fn unterminated(file_name: &str, line: usize) -> String {
+    format!("Unterminated conditional directive at {}:{}", file_name, line + 1)
+}
+
+/// A value of an #if expression, which has type `intmax_t` or `uintmax_t`
+#[derive(Debug, Clone, Copy)]
+struct Value {
+    bits: u64,
+    unsigned: bool,
+}
+
+impl Value {
+    fn signed(value: i64) -> Self {
+        Value { bits: value as u64, unsigned: false }
+    }
+
+    fn bool(value: bool) -> Self {
+        Value::signed(value as i64)
+    }
+}
+
+/// Binary operators and their precedence, from loosest to tightest binding
+fn binary_operator(text: &str) -> Option<u8> {
+    Some(match text {
+        "||" => 1,
+        "&&" => 2,
+        "|" => 3,
+        "^" => 4,
+        "&" => 5,
+        "==" | "!=" => 6,
+        "<" | ">" | "<=" | ">=" => 7,
+        "<<" | ">>" => 8,
+        "+" | "-" => 9,
+        "*" | "/" | "%" => 10,
+        _ => return None,
+    })
+}
+
+/// Parses and evaluates a macro-expanded #if expression. Operands that are
+/// not evaluated, like the right side of a false `&&`, are still parsed but
+/// can't fail, so `0 && 1 / 0` is fine.
+struct Evaluator<'t, 'a> {
+    tokens: &'t [Token<'a>],
+    position: usize,
+}
+
+impl Evaluator<'_, '_> {
+    fn peek(&self) -> Option<&str> {
+        self.tokens.get(self.position).map(|token| &*token.text)
+    }
+
+    fn expect(&mut self, text: &str) -> Result<(), String> {
+        if self.peek() != Some(text) {
+            return Err(format!("Expected '{}' in #if expression", text));
+        }
+        self.position += 1;
+        Ok(())
+    }
+
+    fn conditional(&mut self, live: bool) -> Result<Value, String> {
+        let condition = self.binary(1, live)?;
+        if self.peek() != Some("?") {
+            return Ok(condition);
+        }
+        self.position += 1;
+        let taken = condition.bits != 0;
+        let then = self.conditional(live && taken)?;
+        self.expect(":")?;
+        let otherwise = self.conditional(live && !taken)?;
+        Ok(Value {
+            bits: if taken { then.bits } else { otherwise.bits },
+            unsigned: then.unsigned || otherwise.unsigned,
+        })
+    }
+
+    fn binary(&mut self, min_precedence: u8, live: bool) -> Result<Value, String> {
+        let mut left = self.unary(live)?;
+        while let Some(op) = self.peek() {
+            let Some(precedence) = binary_operator(op).filter(|&precedence| precedence >= min_precedence) else {
+                break;
+            };
+            let op = op.to_string();
+            self.position += 1;
+            let right_live = match op.as_str() {
+                "&&" => live && left.bits != 0,
+                "||" => live && left.bits == 0,
+                _ => live,
+            };
+            let right = self.binary(precedence + 1, right_live)?;
+            left = apply(&op, left, right, live)?;
+        }
+        Ok(left)
+    }
+
+    fn unary(&mut self, live: bool) -> Result<Value, String> {
+        let token = self.tokens.get(self.position).ok_or("Unexpected end of #if expression")?;
+        self.position += 1;
+        match token.kind {
+            TokenKind::Number => number(&token.text),
+            TokenKind::Literal => character(&token.text),
+            // Identifiers that aren't macros
+            TokenKind::Identifier => Ok(Value::signed(0)),
+            TokenKind::Punct => match &*token.text {
+                "(" => {
+                    let value = self.conditional(live)?;
+                    self.expect(")")?;
+                    Ok(value)
+                }
+                "+" => self.unary(live),
+                "-" => {
+                    let value = self.unary(live)?;
+                    Ok(Value { bits: value.bits.wrapping_neg(), ..value })
+                }
+                "~" => {
+                    let value = self.unary(live)?;
+                    Ok(Value { bits: !value.bits, ..value })
+                }
+                "!" => Ok(Value::bool(self.unary(live)?.bits == 0)),
+                text => Err(format!("Unexpected '{}' in #if expression", text)),
+            },
+        }
+    }
+}
+
+fn apply(op: &str, left: Value, right: Value, live: bool) -> Result<Value, String> {
+    let unsigned = left.unsigned || right.unsigned;
+    let (l, r) = (left.bits, right.bits);
+    let compare = |ordering: std::cmp::Ordering| {
+        if unsigned {
+            l.cmp(&r) == ordering
+        } else {
+            (l as i64).cmp(&(r as i64)) == ordering
+        }
+    };
+    let arithmetic = |bits: u64| Value { bits, unsigned };
+    Ok(match op {
+        "||" => Value::bool(l != 0 || r != 0),
+        "&&" => Value::bool(l != 0 && r != 0),
+        "|" => arithmetic(l | r),
+        "^" => arithmetic(l ^ r),
+        "&" => arithmetic(l & r),
+        "==" => Value::bool(l == r),
+        "!=" => Value::bool(l != r),
+        "<" => Value::bool(compare(std::cmp::Ordering::Less)),
+        ">" => Value::bool(compare(std::cmp::Ordering::Greater)),
+        "<=" => Value::bool(!compare(std::cmp::Ordering::Greater)),
+        ">=" => Value::bool(!compare(std::cmp::Ordering::Less)),
+        // Shifts keep the type of their left operand
+        "<<" => Value { bits: l.wrapping_shl(r as u32), ..left },
+        ">>" if left.unsigned => Value { bits: l.wrapping_shr(r as u32), ..left },
+        ">>" => Value { bits: (l as i64).wrapping_shr(r as u32) as u64, ..left },
+        "+" => arithmetic(l.wrapping_add(r)),
+        "-" => arithmetic(l.wrapping_sub(r)),
+        "*" => arithmetic(l.wrapping_mul(r)),
+        "/" | "%" if r == 0 => {
+            if live {
+                return Err("Division by zero in #if expression".to_string());
+            }
+            arithmetic(0)
+        }
+        "/" if unsigned => arithmetic(l / r),
+        "/" => arithmetic((l as i64).wrapping_div(r as i64) as u64),
+        "%" if unsigned => arithmetic(l % r),
+        "%" => arithmetic((l as i64).wrapping_rem(r as i64) as u64),
+        _ => unreachable!("not a binary operator: {}", op),
+    })
+}
+
+/// The value of an integer constant, with its u/l suffixes
+fn number(text: &str) -> Result<Value, String> {
+    let invalid = || format!("Invalid integer constant in #if expression: {}", text);
+    let digits = text.trim_end_matches(['u', 'U', 'l', 'L']);
+    let unsigned = digits.len() < text.len() && text[digits.len()..].contains(['u', 'U']);
+    let (digits, radix) = if let Some(hex) = digits.strip_prefix("0x").or_else(|| digits.strip_prefix("0X")) {
+        (hex, 16)
+    } else if let Some(binary) = digits.strip_prefix("0b").or_else(|| digits.strip_prefix("0B")) {
+        (binary, 2)
+    } else if digits.len() > 1 && digits.starts_with('0') {
+        (&digits[1..], 8)
+    } else {
+        (digits, 10)
+    };
+    let bits = u64::from_str_radix(digits, radix).map_err(|_| invalid())?;
+    // Constants too large for intmax_t are uintmax_t
+    Ok(Value { bits, unsigned: unsigned || bits > i64::MAX as u64 })
+}
+
+/// The value of a character constant
+fn character(text: &str) -> Result<Value, String> {
+    let invalid = || format!("Invalid character constant in #if expression: {}", text);
+    let body = text.strip_prefix('\'').and_then(|text| text.strip_suffix('\'')).ok_or_else(invalid)?;
+    let mut chars = body.chars().peekable();
+    let mut value: i64 = 0;
+    let mut count = 0;
+    while let Some(c) = chars.next() {
+        let c = if c != '\\' {
+            c as i64
+        } else {
+            match chars.next().ok_or_else(invalid)? {
+                'n' => 10,
+                't' => 9,
+                'r' => 13,
+                'a' => 7,
+                'b' => 8,
+                'f' => 12,
+                'v' => 11,
+                'x' => {
+                    let mut value = 0;
+                    while let Some(digit) = chars.peek().and_then(|c| c.to_digit(16)) {
+                        value = value * 16 + digit as i64;
+                        chars.next();
+                    }
+                    value
+                }
+                digit @ '0'..='7' => {
+                    let mut value = digit.to_digit(8).unwrap() as i64;
+                    for _ in 0..2 {
+                        match chars.peek().and_then(|c| c.to_digit(8)) {
+                            Some(digit) => value = value * 8 + digit as i64,
+                            None => break,
+                        }
+                        chars.next();
+                    }
+                    value
+                }
+                other => other as i64,
+            }
+        };
+        // Multi-character constants pack their characters, as in GCC
+        value = (value << 8) | (c & 0xff);
+        count += 1;
+    }
+    if count == 0 {
+        return Err(invalid());
     }
-} 
\ No newline at end of file
+    // A single char is a (signed) char promoted to int
+    Ok(Value::signed(if count == 1 { value as u8 as i8 as i64 } else { value }))
+}
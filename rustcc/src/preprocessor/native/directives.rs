@@ -1,46 +1,49 @@
+use super::conditionals::directive_name;
+use super::includes::is_pragma_once;
 use super::NativePreprocessor;
+use crate::preprocessor::write_output;
+use std::io::Write;
 
 impl NativePreprocessor {
-    /// Process a preprocessor directive
+    /// Process a preprocessor directive, writing its output to `out`
     #[allow(dead_code)]
-    pub(crate) fn process_directive(&mut self, line: &str, current_file: &str) -> Result<String, String> {
-        let trimmed = line.trim();
+    pub(crate) fn process_directive(&mut self, line: &str, current_file: &str, out: &mut dyn Write) -> Result<(), String> {
+        // Spaces between the # and the name, as in `#  define`, are allowed
+        let normalized = match directive_name(line) {
+            Some((name, rest)) => format!("#{}{}", name, rest),
+            None => line.to_string(),
+        };
+        let trimmed = normalized.trim();
         
         if trimmed.starts_with("#include") {
             // Handle include directive
-            self.process_include(trimmed, current_file)
+            self.process_include(trimmed, current_file, out)
         } else if trimmed.starts_with("#define") {
             // Handle define directive
-            self.process_define(trimmed)?;
-            Ok("".to_string())
+            self.process_define(trimmed)
         } else if trimmed.starts_with("#undef") {
             // Handle undef directive
-            self.process_undef(trimmed)?;
-            Ok("".to_string())
-        } else if trimmed.starts_with("#ifdef") || trimmed.starts_with("#ifndef") || trimmed.starts_with("#if") {
-            // Handle conditional compilation start
-            // In the real implementation, this would be part of conditional compilation
-            // For now, just pass it through since we skip lines during conditional processing
-            Ok(format!("{}\n", line))
-        } else if trimmed.starts_with("#else") || trimmed.starts_with("#elif") {
-            // Handle conditional compilation else/elif
-            Ok(format!("{}\n", line))
-        } else if trimmed.starts_with("#endif") {
-            // Handle conditional compilation end
-            Ok(format!("{}\n", line))
+            self.process_undef(trimmed)
+        } else if trimmed.starts_with("#else") || trimmed.starts_with("#elif") || trimmed.starts_with("#endif") {
+            // Conditional blocks are processed whole, so this has no #if
+            let directive = trimmed.split_whitespace().next().unwrap_or(trimmed);
+            Err(format!("{} without #if at {}:{}", directive, current_file, self.current_line))
+        } else if is_pragma_once(trimmed) {
+            // Handled when the file is included
+            Ok(())
         } else if trimmed.starts_with("#pragma") {
             // Handle pragma directive (simply pass through)
-            Ok(format!("{}\n", line))
+            write_output(out, &format!("{}\n", line))
         } else if trimmed.starts_with("#error") {
             // Handle error directive
             self.process_error(trimmed)
         } else if trimmed.starts_with("#warning") {
             // Handle warning directive
             self.process_warning(trimmed);
-            Ok("".to_string())
+            Ok(())
         } else if trimmed == "#" {
             // Empty directive, ignore
-            Ok("".to_string())
+            Ok(())
         } else {
             // Unknown directive
             Err(format!("Unknown preprocessor directive: {}", trimmed))
@@ -60,13 +63,14 @@ impl NativePreprocessor {
         
         // Remove the macro from the defines
         self.defines.remove(undef_part);
+        self.macro_generation += 1;
         
         Ok(())
     }
 
     /// Process a #error directive
     #[allow(dead_code)]
-    pub(crate) fn process_error(&self, line: &str) -> Result<String, String> {
+    pub(crate) fn process_error(&self, line: &str) -> Result<(), String> {
         // Remove the #error part
         let error_part = line.trim_start_matches("#error").trim();
         
@@ -76,50 +80,11 @@ impl NativePreprocessor {
 
     /// Process a #warning directive
     #[allow(dead_code)]
-    pub(crate) fn process_warning(&self, line: &str) {
+    pub(crate) fn process_warning(&mut self, line: &str) {
         // Remove the #warning part
         let warning_part = line.trim_start_matches("#warning").trim();
         
-        // Print a warning message
-        eprintln!("Warning: {}", warning_part);
+        // Kept for the compiler to report with the rest of its messages
+        self.warnings.push(format!("Warning: {}", warning_part));
     }
-
-    /// Evaluate a conditional directive
-    #[allow(dead_code)]
-    pub(crate) fn evaluate_conditional(&self, line: &str) -> Result<bool, String> {
-        if line.starts_with("#ifdef") {
-            // Check if a macro is defined
-            let macro_name = line.trim_start_matches("#ifdef").trim();
-            Ok(self.defines.contains_key(macro_name))
-        } else if line.starts_with("#ifndef") {
-            // Check if a macro is not defined
-            let macro_name = line.trim_start_matches("#ifndef").trim();
-            Ok(!self.defines.contains_key(macro_name))
-        } else if line.starts_with("#if") {
-            // Evaluate a condition
-            let expr = line.trim_start_matches("#if").trim();
-            self.evaluate_if_expression(expr)
-        } else {
-            Err(format!("Invalid conditional directive: {}", line))
-        }
-    }
-
-    /// Evaluate an #if expression
-    #[allow(dead_code)]
-    pub(crate) fn evaluate_if_expression(&self, expr: &str) -> Result<bool, String> {
-        // For simplicity, we'll implement a basic version that just checks for defined()
-        // and handles simple numeric comparisons
-        if expr.contains("defined(") && expr.contains(")") {
-            let start_idx = expr.find("defined(").unwrap() + "defined(".len();
-            let end_idx = expr.find(")").unwrap();
-            if start_idx < end_idx {
-                let macro_name = expr[start_idx..end_idx].trim();
-                return Ok(self.defines.contains_key(macro_name));
-            }
-        }
-        
-        // For numeric values, just check if the expression is non-zero
-        // For simplicity, we'll just check if it's "0" or not
-        Ok(expr.trim() != "0")
-    }
-} 
\ No newline at end of file
+}
@@ -1,13 +1,113 @@
-use std::path::{Path, PathBuf};
+use std::collections::HashMap;
 use std::fs;
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use std::time::SystemTime;
 
+use super::source::SourceText;
 use super::NativePreprocessor;
 use crate::preprocessor::Preprocessor;
 
+/// A header as read from disk, with what it takes to include it only once
+#[derive(Debug)]
+pub(crate) struct Header {
+    pub(crate) contents: SourceText,
+    /// The macro of an `#ifndef X / #define X ... #endif` guard around the
+    /// whole file
+    pub(crate) guard: Option<String>,
+    pub(crate) pragma_once: bool,
+}
+
+/// Headers read so far, keyed by path and checked against their modification
+/// time. Clones of a preprocessor share the cache, so the files of a batch
+/// read each header once.
+#[derive(Debug, Clone, Default)]
+pub(crate) struct HeaderCache {
+    headers: Arc<Mutex<HashMap<PathBuf, (SystemTime, Arc<Header>)>>>,
+}
+
+impl HeaderCache {
+    /// Reads `path`, or returns the cached copy if the file hasn't changed
+    pub(crate) fn read(&self, path: &Path) -> std::io::Result<Arc<Header>> {
+        let modified = fs::metadata(path)?.modified()?;
+        if let Some((time, header)) = self.headers.lock().unwrap().get(path) {
+            if *time == modified {
+                return Ok(Arc::clone(header));
+            }
+        }
+        
+        let contents = SourceText::read(path)?;
+        let header = Arc::new(Header {
+            guard: find_include_guard(&contents),
+            pragma_once: contents.lines().any(|line| is_pragma_once(line.trim())),
+            contents,
+        });
+        self.headers.lock().unwrap().insert(path.to_path_buf(), (modified, Arc::clone(&header)));
+        Ok(header)
+    }
+}
+
+/// Whether a trimmed line is `#pragma once`
+pub(crate) fn is_pragma_once(line: &str) -> bool {
+    line.strip_prefix('#')
+        .and_then(|rest| rest.trim_start().strip_prefix("pragma"))
+        .is_some_and(|rest| rest.trim() == "once")
+}
+
+/// The guard macro if everything in `contents` outside comments is inside
+/// `#ifndef X`, `#define X` ... `#endif`
+fn find_include_guard(contents: &str) -> Option<String> {
+    let mut lines = contents.lines().map(str::trim).filter(|line| !line.is_empty());
+    let mut in_comment = false;
+    let mut code = std::iter::from_fn(move || loop {
+        let line = lines.next()?;
+        // Comment-only lines don't count as code
+        if in_comment {
+            in_comment = !line.contains("*/");
+            continue;
+        }
+        if line.starts_with("//") {
+            continue;
+        }
+        if let Some(comment) = line.strip_prefix("/*") {
+            match comment.find("*/") {
+                None => in_comment = true,
+                Some(end) if end + 2 == comment.len() => {}
+                Some(_) => return Some(line),
+            }
+            continue;
+        }
+        return Some(line);
+    });
+    
+    let guard = code.next()?.strip_prefix("#ifndef")?.trim().to_string();
+    let define = code.next()?.strip_prefix("#define")?;
+    if define.trim() != guard || guard.is_empty() {
+        return None;
+    }
+    // The #endif closing the #ifndef must be the last line, with no #else
+    // or #elif at its level
+    let mut depth = 1;
+    for line in code {
+        if depth == 0 {
+            return None;
+        }
+        if line.starts_with("#if") {
+            depth += 1;
+        } else if line.starts_with("#endif") {
+            depth -= 1;
+        } else if depth == 1 && (line.starts_with("#else") || line.starts_with("#elif")) {
+            return None;
+        }
+    }
+    (depth == 0).then_some(guard)
+}
+
 impl NativePreprocessor {
-    /// Process an #include directive
+    /// Process an #include directive, writing the preprocessed header to `out`
     #[allow(dead_code)]
-    pub(crate) fn process_include(&mut self, line: &str, current_file: &str) -> Result<String, String> {
+    pub(crate) fn process_include(&mut self, line: &str, current_file: &str, out: &mut dyn Write) -> Result<(), String> {
         // Remove the #include part
         let include_part = line.trim_start_matches("#include").trim();
         
@@ -28,6 +128,17 @@ impl NativePreprocessor {
         // Find the include file
         let include_file = self.find_include_file(&expanded_path, is_system, current_file)?;
         
+        // Headers with #pragma once or a defined include guard are skipped
+        // without being opened again, as is a precompiled header whose state
+        // the preprocessor started from
+        if self.included_once.contains(&include_file)
+            || self.include_guards.get(&include_file).is_some_and(|guard| self.is_defined(guard))
+            || (!self.precompiled.is_empty()
+                && fs::canonicalize(&include_file).is_ok_and(|path| self.precompiled.contains(&path)))
+        {
+            return Ok(());
+        }
+        
         // Increment include depth to prevent infinite recursion
         self.include_depth += 1;
         if self.include_depth > self.max_include_depth {
@@ -36,49 +147,54 @@ impl NativePreprocessor {
         }
         
         // Read the file content
-        let content = match fs::read_to_string(&include_file) {
-            Ok(content) => content,
+        let header = match self.headers.read(&include_file) {
+            Ok(header) => header,
             Err(e) => {
                 self.include_depth -= 1;
                 return Err(format!("Failed to read include file {}: {}", include_file.display(), e));
             }
         };
+        if header.pragma_once {
+            self.included_once.insert(include_file.clone());
+        }
+        if let Some(guard) = &header.guard {
+            self.include_guards.insert(include_file.clone(), guard.clone());
+        }
         
         // Process the included content
         let file_name = include_file.to_string_lossy();
-        let result = match self.preprocess_string(&content, &file_name) {
-            Ok(result) => result,
-            Err(e) => {
-                self.include_depth -= 1;
-                return Err(e);
-            }
-        };
+        let result = self.preprocess_string_into(&header.contents, &file_name, out);
         
         // Decrement include depth
         self.include_depth -= 1;
         
-        Ok(result)
+        result
     }
 
     /// Find an include file
     #[allow(dead_code)]
-    pub(crate) fn find_include_file(&self, path: &str, is_system: bool, current_file: &str) -> Result<PathBuf, String> {
-        // For local includes, first check relative to the current file
-        if !is_system {
-            let current_dir = Path::new(current_file).parent().unwrap_or_else(|| Path::new(""));
-            let local_path = current_dir.join(path);
-            
-            if local_path.exists() {
-                return Ok(local_path);
-            }
+    pub(crate) fn find_include_file(&mut self, path: &str, is_system: bool, current_file: &str) -> Result<PathBuf, String> {
+        // Local includes are looked up relative to the current file first,
+        // so their resolution depends on its directory
+        let current_dir = if is_system {
+            Path::new("")
+        } else {
+            Path::new(current_file).parent().unwrap_or_else(|| Path::new(""))
+        };
+        let key = (path.to_string(), is_system, current_dir.to_path_buf());
+        if let Some(resolved) = self.resolved_includes.get(&key) {
+            return Ok(resolved.clone());
         }
         
-        // Check all include directories
-        for dir in &self.include_dirs {
-            let include_path = dir.join(path);
-            if include_path.exists() {
-                return Ok(include_path);
-            }
+        let found = if !is_system && current_dir.join(path).exists() {
+            Some(current_dir.join(path))
+        } else {
+            // Check all include directories
+            self.include_dirs.iter().map(|dir| dir.join(path)).find(|include_path| include_path.exists())
+        };
+        if let Some(include_path) = found {
+            self.resolved_includes.insert(key, include_path.clone());
+            return Ok(include_path);
         }
         
         // If it's a system header, allow it even if not found
@@ -1,9 +1,226 @@
+use std::borrow::Cow;
 use std::collections::HashMap;
-use regex;
 use chrono;
 
 use super::NativePreprocessor;
 
+/// Macros the preprocessor provides itself, expanding to where and when
+/// they are used
+const BUILTIN_MACROS: &[&str] = &["__FILE__", "__LINE__", "__DATE__", "__TIME__"];
+
+/// Kinds of preprocessing tokens
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum TokenKind {
+    Identifier,
+    Number,
+    /// String or character literal
+    Literal,
+    Punct,
+}
+
+/// A preprocessing token
+#[derive(Debug, Clone, PartialEq)]
+pub(crate) struct Token<'a> {
+    pub(crate) kind: TokenKind,
+    pub(crate) text: Cow<'a, str>,
+    /// Whitespace and comments before the token: as written on source
+    /// lines, a single space or nothing in macro bodies
+    pub(crate) space: Cow<'a, str>,
+    /// Macros whose expansion produced the token, which must not expand it
+    /// again
+    hide: Vec<&'a str>,
+}
+
+/// A macro definition
+#[derive(Debug, Clone, PartialEq)]
+pub(crate) struct Macro {
+    /// Parameter names of a function-like macro, `None` for an object-like
+    /// one. The last parameter of a variadic macro is `__VA_ARGS__`.
+    pub(crate) params: Option<Vec<String>>,
+    pub(crate) variadic: bool,
+    pub(crate) body: Vec<Token<'static>>,
+}
+
+impl Macro {
+    /// An object-like macro expanding to `value`
+    pub(crate) fn object(value: &str) -> Self {
+        Macro {
+            params: None,
+            variadic: false,
+            body: body_tokens(&tokenize(value).0),
+        }
+    }
+}
+
+impl Token<'static> {
+    /// A macro body token, preceded by a space if `space` is set
+    pub(crate) fn body(kind: TokenKind, text: String, space: bool) -> Self {
+        Token {
+            kind,
+            text: Cow::Owned(text),
+            space: Cow::Borrowed(if space { " " } else { "" }),
+            hide: Vec::new(),
+        }
+    }
+}
+
+/// Splits `line` into tokens, also returning the whitespace and comments
+/// after the last one. An unterminated block comment runs to the end of
+/// the line.
+pub(crate) fn tokenize(line: &str) -> (Vec<Token<'_>>, &str) {
+    let bytes = line.as_bytes();
+    let is_identifier = |c: u8| c.is_ascii_alphanumeric() || c == b'_' || c >= 0x80;
+    let mut tokens = Vec::new();
+    let mut space_start = 0;
+    let mut i = 0;
+
+    while i < bytes.len() {
+        let c = bytes[i];
+        let start = i;
+        let kind = if c.is_ascii_whitespace() {
+            i += 1;
+            continue;
+        } else if line[i..].starts_with("//") {
+            i = bytes.len();
+            continue;
+        } else if line[i..].starts_with("/*") {
+            i = line[i + 2..].find("*/").map_or(bytes.len(), |end| i + end + 4);
+            continue;
+        } else if is_identifier(c) && !c.is_ascii_digit() {
+            while i < bytes.len() && is_identifier(bytes[i]) {
+                i += 1;
+            }
+            TokenKind::Identifier
+        } else if c.is_ascii_digit() || (c == b'.' && bytes.get(i + 1).is_some_and(u8::is_ascii_digit)) {
+            // A pp-number: digits, letters, dots and signed exponents
+            i += 1;
+            while i < bytes.len() {
+                match bytes[i] {
+                    b'+' | b'-' if matches!(bytes[i - 1], b'e' | b'E' | b'p' | b'P') => i += 1,
+                    d if is_identifier(d) || d == b'.' => i += 1,
+                    _ => break,
+                }
+            }
+            TokenKind::Number
+        } else if c == b'"' || c == b'\'' {
+            i += 1;
+            while i < bytes.len() && bytes[i] != c {
+                i += if bytes[i] == b'\\' { 2 } else { 1 };
+            }
+            i = (i + 1).min(bytes.len());
+            TokenKind::Literal
+        } else {
+            i += punctuator_len(&line[i..]);
+            TokenKind::Punct
+        };
+        tokens.push(Token {
+            kind,
+            text: Cow::Borrowed(&line[start..i]),
+            space: Cow::Borrowed(&line[space_start..start]),
+            hide: Vec::new(),
+        });
+        space_start = i;
+    }
+    (tokens, &line[space_start..])
+}
+
+/// Length of the punctuator `text` starts with
+fn punctuator_len(text: &str) -> usize {
+    const PUNCTUATORS: &[&str] = &[
+        "...", "<<=", ">>=", "##", "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "*=", "/=",
+        "%=", "+=", "-=", "&=", "^=", "|=",
+    ];
+    PUNCTUATORS
+        .iter()
+        .find(|punctuator| text.starts_with(*punctuator))
+        .map_or(1, |punctuator| punctuator.len())
+}
+
+/// The tokens of a macro body, owned and with normalized spacing
+fn body_tokens(tokens: &[Token]) -> Vec<Token<'static>> {
+    tokens
+        .iter()
+        .enumerate()
+        .map(|(i, token)| Token {
+            kind: token.kind,
+            text: Cow::Owned(token.text.to_string()),
+            space: Cow::Borrowed(if i > 0 && !token.space.is_empty() { " " } else { "" }),
+            hide: Vec::new(),
+        })
+        .collect()
+}
+
+/// A token of a macro body, to be copied into an expansion
+fn borrow<'a>(token: &'a Token<'static>) -> Token<'a> {
+    Token {
+        kind: token.kind,
+        text: Cow::Borrowed(&token.text),
+        space: Cow::Borrowed(&token.space),
+        hide: Vec::new(),
+    }
+}
+
+/// The string literal spelling `arg`, for the `#` operator
+fn stringify<'a>(arg: &[Token<'a>], space: Cow<'a, str>) -> Token<'a> {
+    let mut text = String::from("\"");
+    for (i, token) in arg.iter().enumerate() {
+        if i > 0 && !token.space.is_empty() {
+            text.push(' ');
+        }
+        if token.kind == TokenKind::Literal {
+            for c in token.text.chars() {
+                if c == '"' || c == '\\' {
+                    text.push('\\');
+                }
+                text.push(c);
+            }
+        } else {
+            text.push_str(&token.text);
+        }
+    }
+    text.push('"');
+    Token { kind: TokenKind::Literal, text: Cow::Owned(text), space, hide: Vec::new() }
+}
+
+/// Takes the parenthesized arguments of a function-like macro invocation
+/// from the front of `input` (stored last token first), along with the
+/// closing parenthesis. Returns `None`, consuming nothing, if the next
+/// token isn't an opening parenthesis or the invocation isn't closed.
+fn take_arguments<'a>(input: &mut Vec<Token<'a>>) -> Option<(Vec<Vec<Token<'a>>>, Token<'a>)> {
+    if input.last().is_none_or(|token| token.text != "(") {
+        return None;
+    }
+    let mut depth = 0;
+    let close = input.iter().rev().skip(1).position(|token| {
+        match &*token.text {
+            "(" => depth += 1,
+            ")" if depth == 0 => return true,
+            ")" => depth -= 1,
+            _ => {}
+        }
+        false
+    })?;
+    
+    input.pop();
+    let mut args = vec![Vec::new()];
+    let mut depth = 0;
+    for _ in 0..close {
+        let token = input.pop().expect("argument tokens");
+        match &*token.text {
+            "(" => depth += 1,
+            ")" => depth -= 1,
+            "," if depth == 0 => {
+                args.push(Vec::new());
+                continue;
+            }
+            _ => {}
+        }
+        args.last_mut().expect("an argument").push(token);
+    }
+    let close = input.pop().expect("closing parenthesis");
+    Some((args, close))
+}
+
 impl NativePreprocessor {
     /// Process a #define directive
     #[allow(dead_code)]
@@ -16,355 +233,315 @@ impl NativePreprocessor {
             return Err("Empty #define directive".to_string());
         }
         
-        // Check if it's a function-like macro or an object-like macro
-        if let Some(paren_pos) = define_part.find('(') {
-            // Function-like macro
-            let name_end = paren_pos;
-            let name = define_part[..name_end].trim().to_string();
-            
-            // Find the closing parenthesis
-            if let Some(close_paren_pos) = define_part[paren_pos..].find(')') {
-                let params_str = &define_part[paren_pos + 1..paren_pos + close_paren_pos];
-                let body_start = paren_pos + close_paren_pos + 1;
-                
-                // Get the body (everything after the closing parenthesis)
-                let body = if body_start < define_part.len() {
-                    define_part[body_start..].trim().to_string()
-                } else {
-                    // Empty body
-                    String::new()
-                };
-                
-                // Parse the parameters
-                let params = params_str.split(',')
-                    .map(|s| s.trim().to_string())
-                    .collect::<Vec<String>>();
-                
-                // Store the function-like macro
-                // For simplicity, we'll prefix with FUNCTION_MACRO: to distinguish
-                let macro_value = format!("FUNCTION_MACRO:{}:{}", 
-                    params.join(","), 
-                    body);
-                
-                self.defines.insert(name, macro_value);
-            } else {
-                return Err("Missing closing parenthesis in function-like macro".to_string());
+        let (tokens, _) = tokenize(define_part);
+        let name = match tokens.first() {
+            Some(token) if token.kind == TokenKind::Identifier => token.text.to_string(),
+            _ => return Err(format!("Invalid macro name in #define: {}", define_part)),
+        };
+        
+        // A parenthesis right after the name starts the parameter list of a
+        // function-like macro; with a space before it, it's part of the body
+        let (params, variadic, body) = if tokens.get(1).is_some_and(|token| token.text == "(" && token.space.is_empty()) {
+            let close = tokens
+                .iter()
+                .position(|token| token.text == ")")
+                .ok_or_else(|| "Missing closing parenthesis in function-like macro".to_string())?;
+            let mut params = Vec::new();
+            let mut variadic = false;
+            for token in &tokens[2..close] {
+                match token.kind {
+                    TokenKind::Identifier if !variadic => params.push(token.text.to_string()),
+                    TokenKind::Punct if token.text == "..." && !variadic => {
+                        variadic = true;
+                        params.push("__VA_ARGS__".to_string());
+                    }
+                    TokenKind::Punct if token.text == "," => {}
+                    _ => return Err(format!("Invalid parameter list in #define: {}", define_part)),
+                }
             }
+            (Some(params), variadic, &tokens[close + 1..])
         } else {
-            // Object-like macro
-            // Find the first space to separate name and value
-            if let Some(space_pos) = define_part.find(char::is_whitespace) {
-                let name = define_part[..space_pos].trim().to_string();
-                let value = define_part[space_pos..].trim().to_string();
-                
-                self.defines.insert(name, value);
-            } else {
-                // No value, just a name (like #define DEBUG)
-                let name = define_part.trim().to_string();
-                self.defines.insert(name, "1".to_string());
-            }
-        }
+            (None, false, &tokens[1..])
+        };
         
+        self.defines.insert(name, Macro { params, variadic, body: body_tokens(body) });
+        self.macro_generation += 1;
         Ok(())
     }
 
+    /// Whether `name` is a macro, including the built-in ones
+    pub(crate) fn is_defined(&self, name: &str) -> bool {
+        self.defines.contains_key(name) || BUILTIN_MACROS.contains(&name)
+    }
+
     /// Expand macros in a line of text
     #[allow(dead_code)]
     pub(crate) fn expand_macros(&self, line: &str) -> String {
-        let mut result = line.to_string();
-        
-        // Expand predefined macros first
-        result = self.expand_predefined_macros(&result);
-        
-        // Expand user-defined macros
-        // We need to loop to handle nested macro expansions
-        let mut changed = true;
-        let mut iteration = 0;
-        let max_iterations = 10; // Prevent infinite recursion
-        
-        while changed && iteration < max_iterations {
-            changed = false;
-            iteration += 1;
-            
-            for (name, value) in &self.defines {
-                // Skip function-like macros for now
-                if value.starts_with("FUNCTION_MACRO:") {
-                    // Handle function-like macros separately
-                    let mut temp_result = result.clone();
-                    if self.expand_function_macro(&mut temp_result, name, value) {
-                        changed = true;
-                        result = temp_result;
-                    }
-                    continue;
-                }
-                
-                // For object-like macros, use regex to ensure we only replace whole words
-                let pattern = format!(r"\b{}\b", regex::escape(name));
-                if let Ok(re) = regex::Regex::new(&pattern) {
-                    let new_result = re.replace_all(&result, value.as_str()).to_string();
-                    if new_result != result {
-                        changed = true;
-                        result = new_result;
-                    }
-                }
-            }
+        let (tokens, trailing) = tokenize(line);
+        // Most lines use no macros at all and are kept as they are
+        if !tokens.iter().any(|token| token.kind == TokenKind::Identifier && self.is_defined(&token.text)) {
+            return line.to_string();
         }
         
-        if iteration >= max_iterations {
-            // Add a warning comment for potential circular macro expansion
-            result.push_str("\n/* WARNING: Possible circular macro expansion */\n");
+        let mut result = String::with_capacity(line.len());
+        for token in self.expand(tokens) {
+            result.push_str(&token.space);
+            result.push_str(&token.text);
         }
-        
+        result.push_str(trailing);
         result
     }
     
-    /// Expand predefined macros like __FILE__, __LINE__, etc.
-    fn expand_predefined_macros(&self, line: &str) -> String {
-        let mut result = line.to_string();
-        
-        // Replace __FILE__ with the current file
-        let file_pattern = r"\b__FILE__\b";
-        if let Ok(re) = regex::Regex::new(file_pattern) {
-            result = re.replace_all(&result, "\"unknown\"").to_string();
-        }
-        
-        // Replace __LINE__ with the current line number (placeholder)
-        let line_pattern = r"\b__LINE__\b";
-        if let Ok(re) = regex::Regex::new(line_pattern) {
-            result = re.replace_all(&result, "0").to_string();
-        }
-        
-        // Replace __DATE__ with the current date
-        let date_pattern = r"\b__DATE__\b";
-        if let Ok(re) = regex::Regex::new(date_pattern) {
-            let date = chrono::Local::now().format("\"%b %d %Y\"").to_string();
-            result = re.replace_all(&result, date.as_str()).to_string();
-        }
-        
-        // Replace __TIME__ with the current time
-        let time_pattern = r"\b__TIME__\b";
-        if let Ok(re) = regex::Regex::new(time_pattern) {
-            let time = chrono::Local::now().format("\"%H:%M:%S\"").to_string();
-            result = re.replace_all(&result, time.as_str()).to_string();
-        }
-        
-        result
-    }
-    
-    /// Expand a function-like macro
-    #[allow(dead_code)]
-    pub(crate) fn expand_function_macro(&self, input: &mut String, name: &str, value: &str) -> bool {
-        // Check if the value has the function macro format
-        let parts: Vec<&str> = value.splitn(3, ':').collect();
-        if parts.len() != 3 || parts[0] != "FUNCTION_MACRO" {
-            return false;
-        }
-        
-        let params_str = parts[1];
-        let replacement = parts[2];
-        
-        // Parse parameters
-        let params: Vec<&str> = if params_str.is_empty() {
-            Vec::new()
-        } else {
-            params_str.split(',').collect()
-        };
-        
-        // Create a regex to find macro invocations
-        // This pattern looks for macro_name(args)
-        let pattern = format!(r"\b{}\s*\((.*?)\)", regex::escape(name));
-        let regex = match regex::Regex::new(&pattern) {
-            Ok(r) => r,
-            Err(_) => return false,
-        };
-        
-        let mut modified = false;
-        
-        // Find and replace all macro invocations
-        while let Some(captures) = regex.captures(input) {
-            modified = true;
-            
-            // Extract arguments
-            let full_match = captures.get(0).unwrap().as_str();
-            let args_str = captures.get(1).unwrap().as_str();
-            let args = self.parse_macro_args(args_str);
-            
-            // Check if argument count matches parameter count
-            if args.len() != params.len() {
-                // Replace with an error message if argument count doesn't match
-                let error = format!("/* ERROR: Macro {} expected {} arguments, got {} */", 
-                               name, params.len(), args.len());
-                *input = input.replacen(full_match, &error, 1);
+    /// Macro-expands `tokens` (C11 6.10.3). Each expansion is pushed back on
+    /// the input to be rescanned, with its macro added to the hide set of
+    /// every token it produced, so self-referencing macros stop expanding
+    /// instead of recursing.
+    pub(crate) fn expand<'a>(&'a self, tokens: Vec<Token<'a>>) -> Vec<Token<'a>> {
+        // Unread tokens, last first so expansions can be pushed back
+        let mut input = tokens;
+        input.reverse();
+        let mut output = Vec::with_capacity(input.len());
+        
+        while let Some(token) = input.pop() {
+            if token.kind != TokenKind::Identifier || token.hide.iter().any(|&name| name == token.text) {
+                output.push(token);
                 continue;
             }
+            let Some((name, definition)) = self.defines.get_key_value(&*token.text) else {
+                match self.builtin_macro(&token.text) {
+                    Some(text) => output.push(Token { text: Cow::Owned(text), ..token }),
+                    None => output.push(token),
+                }
+                continue;
+            };
             
-            // Perform the replacement
-            let mut result = replacement.to_string();
-            
-            // Replace each parameter with its argument
-            for (i, param) in params.iter().enumerate() {
-                let arg = &args[i];
-                let param_pattern = format!(r"\b{}\b", regex::escape(param));
-                if let Ok(re) = regex::Regex::new(&param_pattern) {
-                    result = re.replace_all(&result, arg).to_string();
+            let (args, mut hide) = match &definition.params {
+                None => (Vec::new(), token.hide.clone()),
+                Some(params) => {
+                    // Without arguments the name is just an identifier
+                    let Some(args) = take_arguments(&mut input) else {
+                        output.push(token);
+                        continue;
+                    };
+                    let (mut args, close) = args;
+                    if params.is_empty() && matches!(args.as_slice(), [arg] if arg.is_empty()) {
+                        args.clear();
+                    }
+                    if definition.variadic && args.len() + 1 == params.len() {
+                        args.push(Vec::new());
+                    }
+                    if definition.variadic && args.len() > params.len() {
+                        // The extra arguments, with their commas, are __VA_ARGS__
+                        let rest = args.split_off(params.len() - 1);
+                        let mut va_args = Vec::new();
+                        for (i, arg) in rest.into_iter().enumerate() {
+                            if i > 0 {
+                                va_args.push(Token {
+                                    kind: TokenKind::Punct,
+                                    text: Cow::Borrowed(","),
+                                    space: Cow::Borrowed(""),
+                                    hide: Vec::new(),
+                                });
+                            }
+                            va_args.extend(arg);
+                        }
+                        args.push(va_args);
+                    }
+                    if args.len() != params.len() {
+                        let error = format!("/* ERROR: Macro {} expected {} arguments, got {} */",
+                                       name, params.len(), args.len());
+                        output.push(Token { kind: TokenKind::Punct, text: Cow::Owned(error), ..token });
+                        continue;
+                    }
+                    let hide = token.hide.iter().copied().filter(|name| close.hide.contains(name)).collect();
+                    (args, hide)
                 }
-            }
+            };
+            hide.push(name.as_str());
             
-            // Replace the macro invocation with the expanded text
-            *input = input.replacen(full_match, &result, 1);
+            let mut expansion = self.substitute(definition, &args, &hide);
+            // The expansion takes the place of the invocation
+            if let Some(first) = expansion.first_mut() {
+                first.space = token.space;
+            }
+            input.extend(expansion.into_iter().rev());
         }
-        
-        modified
+        output
     }
     
-    /// Parse macro arguments, handling nested parentheses and commas in strings
-    #[allow(dead_code)]
-    pub(crate) fn parse_macro_args(&self, args_str: &str) -> Vec<String> {
-        let mut args = Vec::new();
-        let mut current_arg = String::new();
-        let mut paren_depth = 0;
-        let mut in_string = false;
-        let mut in_char = false;
-        let mut escaped = false;
-        
-        for c in args_str.chars() {
-            match c {
-                '(' if !in_string && !in_char => {
-                    paren_depth += 1;
-                    current_arg.push(c);
-                },
-                ')' if !in_string && !in_char => {
-                    paren_depth -= 1;
-                    current_arg.push(c);
-                },
-                ',' if paren_depth == 0 && !in_string && !in_char => {
-                    // Argument separator at top level
-                    args.push(current_arg.trim().to_string());
-                    current_arg = String::new();
-                },
-                '"' if !escaped => {
-                    in_string = !in_string;
-                    current_arg.push(c);
-                },
-                '\'' if !escaped => {
-                    in_char = !in_char;
-                    current_arg.push(c);
-                },
-                '\\' => {
-                    escaped = !escaped;
-                    current_arg.push(c);
-                },
-                _ => {
-                    escaped = false;
-                    current_arg.push(c);
+    /// The body of `definition` with its parameters replaced by `args`
+    fn substitute<'a>(&'a self, definition: &'a Macro, args: &[Vec<Token<'a>>], hide: &[&'a str]) -> Vec<Token<'a>> {
+        let params = definition.params.as_deref().unwrap_or(&[]);
+        let param = |token: &Token| match token.kind {
+            TokenKind::Identifier => params.iter().position(|param| *param == token.text),
+            _ => None,
+        };
+        let body = &definition.body;
+        // Arguments are expanded once, when first used outside # and ##
+        let mut expanded: Vec<Option<Vec<Token<'a>>>> = vec![None; args.len()];
+        let mut output: Vec<Token<'a>> = Vec::with_capacity(body.len());
+        // Whether the last thing substituted was an empty argument, which
+        // leaves nothing for a following ## to paste onto
+        let mut placemarker = false;
+        
+        let mut i = 0;
+        while i < body.len() {
+            let token = &body[i];
+            let next = body.get(i + 1);
+            if definition.params.is_some() && token.text == "#" {
+                if let Some(index) = next.and_then(param) {
+                    output.push(stringify(&args[index], Cow::Borrowed(&token.space)));
+                    placemarker = false;
+                    i += 2;
+                    continue;
+                }
+            }
+            if token.text == "##" {
+                if let Some(next) = next {
+                    let mut right = match param(next) {
+                        Some(index) => args[index].clone(),
+                        None => vec![borrow(next)],
+                    };
+                    if !right.is_empty() {
+                        match output.last_mut().filter(|_| !placemarker) {
+                            Some(left) => {
+                                let first = right.remove(0);
+                                let text = format!("{}{}", left.text, first.text);
+                                left.kind = tokenize(&text).0.first().map_or(TokenKind::Punct, |token| token.kind);
+                                left.text = Cow::Owned(text);
+                            }
+                            None => right[0].space = Cow::Borrowed(&token.space),
+                        }
+                        placemarker = false;
+                    }
+                    output.extend(right);
+                    i += 2;
+                    continue;
                 }
             }
+            if let Some(index) = param(token) {
+                let mut arg = if next.is_some_and(|next| next.text == "##") {
+                    args[index].clone()
+                } else {
+                    expanded[index].get_or_insert_with(|| self.expand(args[index].clone())).clone()
+                };
+                // The argument takes the parameter's spacing
+                if let Some(first) = arg.first_mut() {
+                    first.space = Cow::Borrowed(&token.space);
+                }
+                placemarker = arg.is_empty();
+                output.extend(arg);
+                i += 1;
+                continue;
+            }
+            output.push(borrow(token));
+            placemarker = false;
+            i += 1;
         }
         
-        // Add the last argument if not empty
-        if !current_arg.trim().is_empty() {
-            args.push(current_arg.trim().to_string());
+        for token in &mut output {
+            for &name in hide {
+                if !token.hide.contains(&name) {
+                    token.hide.push(name);
+                }
+            }
+        }
+        output
+    }
+    
+    /// The expansion of a built-in macro like __FILE__ or __LINE__
+    fn builtin_macro(&self, name: &str) -> Option<String> {
+        match name {
+            "__FILE__" => Some(format!("\"{}\"", self.current_file.replace('\\', "\\\\").replace('"', "\\\""))),
+            "__LINE__" => Some(self.current_line.to_string()),
+            "__DATE__" => Some(chrono::Local::now().format("\"%b %d %Y\"").to_string()),
+            "__TIME__" => Some(chrono::Local::now().format("\"%H:%M:%S\"").to_string()),
+            _ => None,
         }
-        
-        args
     }
 
     /// Add standard predefined macros
     pub(crate) fn add_standard_defines(&mut self) {
         // C standard version
-        self.defines.insert("__STDC__".to_string(), "1".to_string());
-        self.defines.insert("__STDC_VERSION__".to_string(), "201710L".to_string()); // C17
-        self.defines.insert("__STDC_HOSTED__".to_string(), "1".to_string());
+        self.add_define("__STDC__", "1");
+        self.add_define("__STDC_VERSION__", "201710L"); // C17
+        self.add_define("__STDC_HOSTED__", "1");
         
         // Platform-specific macros
         #[cfg(target_os = "linux")]
         {
-            self.defines.insert("__linux__".to_string(), "1".to_string());
-            self.defines.insert("__unix__".to_string(), "1".to_string());
-            self.defines.insert("__GNUC__".to_string(), "4".to_string());
-            self.defines.insert("__GNUC_MINOR__".to_string(), "2".to_string());
+            self.add_define("__linux__", "1");
+            self.add_define("__unix__", "1");
+            self.add_define("__GNUC__", "4");
+            self.add_define("__GNUC_MINOR__", "2");
         }
         
         #[cfg(target_os = "macos")]
         {
-            self.defines.insert("__APPLE__".to_string(), "1".to_string());
-            self.defines.insert("__MACH__".to_string(), "1".to_string());
-            self.defines.insert("__unix__".to_string(), "1".to_string());
+            self.add_define("__APPLE__", "1");
+            self.add_define("__MACH__", "1");
+            self.add_define("__unix__", "1");
             
             // Check if we're on Apple Silicon
             #[cfg(target_arch = "aarch64")]
             {
-                self.defines.insert("__aarch64__".to_string(), "1".to_string());
-                self.defines.insert("__arm64__".to_string(), "1".to_string());
-                self.defines.insert("__ARM_ARCH".to_string(), "8".to_string());
+                self.add_define("__aarch64__", "1");
+                self.add_define("__arm64__", "1");
+                self.add_define("__ARM_ARCH", "8");
             }
             
             // Check if we're on Intel
             #[cfg(target_arch = "x86_64")]
             {
-                self.defines.insert("__x86_64__".to_string(), "1".to_string());
-                self.defines.insert("__amd64__".to_string(), "1".to_string());
+                self.add_define("__x86_64__", "1");
+                self.add_define("__amd64__", "1");
             }
             
             // Add clang-specific macros
-            self.defines.insert("__clang__".to_string(), "1".to_string());
-            self.defines.insert("__clang_major__".to_string(), "13".to_string());
-            self.defines.insert("__clang_minor__".to_string(), "0".to_string());
+            self.add_define("__clang__", "1");
+            self.add_define("__clang_major__", "13");
+            self.add_define("__clang_minor__", "0");
         }
         
         #[cfg(target_os = "windows")]
         {
-            self.defines.insert("_WIN32".to_string(), "1".to_string());
+            self.add_define("_WIN32", "1");
             
             #[cfg(target_arch = "x86_64")]
             {
-                self.defines.insert("_WIN64".to_string(), "1".to_string());
-                self.defines.insert("__x86_64__".to_string(), "1".to_string());
+                self.add_define("_WIN64", "1");
+                self.add_define("__x86_64__", "1");
             }
             
             // Add MSVC-specific macros
-            self.defines.insert("_MSC_VER".to_string(), "1929".to_string());
+            self.add_define("_MSC_VER", "1929");
         }
         
         // Architecture-specific macros
         #[cfg(target_arch = "x86_64")]
         {
-            self.defines.insert("__x86_64__".to_string(), "1".to_string());
-            self.defines.insert("__LP64__".to_string(), "1".to_string());
-            self.defines.insert("__SIZEOF_POINTER__".to_string(), "8".to_string());
+            self.add_define("__x86_64__", "1");
+            self.add_define("__LP64__", "1");
+            self.add_define("__SIZEOF_POINTER__", "8");
         }
         
         #[cfg(target_arch = "x86")]
         {
-            self.defines.insert("__i386__".to_string(), "1".to_string());
-            self.defines.insert("__SIZEOF_POINTER__".to_string(), "4".to_string());
+            self.add_define("__i386__", "1");
+            self.add_define("__SIZEOF_POINTER__", "4");
         }
         
         #[cfg(target_arch = "aarch64")]
         {
-            self.defines.insert("__aarch64__".to_string(), "1".to_string());
-            self.defines.insert("__LP64__".to_string(), "1".to_string());
-            self.defines.insert("__SIZEOF_POINTER__".to_string(), "8".to_string());
+            self.add_define("__aarch64__", "1");
+            self.add_define("__LP64__", "1");
+            self.add_define("__SIZEOF_POINTER__", "8");
         }
         
-        // Add date and time macros
-        let now = std::time::SystemTime::now();
-        
-        // Convert to a date/time
-        let datetime = chrono::DateTime::<chrono::Utc>::from(now);
-        
-        // Format as required by C standard
-        let date = datetime.format("%b %d %Y").to_string();
-        let time = datetime.format("%H:%M:%S").to_string();
-        
-        self.defines.insert("__DATE__".to_string(), format!("\"{}\"", date));
-        self.defines.insert("__TIME__".to_string(), format!("\"{}\"", time));
-        
-        // Add other standard macros
-        self.defines.insert("__FUNCTION__".to_string(), "\"\"".to_string());
-        self.defines.insert("__func__".to_string(), "\"\"".to_string());
-        self.defines.insert("__FILE__".to_string(), "\"\"".to_string());
-        self.defines.insert("__LINE__".to_string(), "0".to_string());
+        // Add other standard macros; __FILE__, __LINE__, __DATE__ and
+        // __TIME__ are built in
+        self.add_define("__FUNCTION__", "\"\"");
+        self.add_define("__func__", "\"\"");
     }
     
     /// Extract defines from content without processing includes
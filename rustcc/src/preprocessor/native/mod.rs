@@ -3,8 +3,8 @@
 //! This module provides a native implementation of the preprocessor for the RustCC compiler.
 //! It handles preprocessor directives, macro expansion, and conditional compilation.
 
-use std::collections::HashMap;
-use std::fs;
+use std::collections::{HashMap, HashSet};
+use std::io::Write;
 use std::path::{Path, PathBuf};
 
 // Local modules
@@ -12,14 +12,20 @@ pub mod macros;
 pub mod directives;
 pub mod includes;
 pub mod conditionals;
+pub mod source;
 
 // Import functionality from submodules
-use crate::preprocessor::Preprocessor;
+use crate::preprocessor::{write_output, Preprocessor};
+use conditionals::directive_name;
+use includes::HeaderCache;
+use macros::Macro;
+use source::SourceText;
 
 /// Native preprocessor implementation
+#[derive(Clone)]
 pub struct NativePreprocessor {
     /// Macro definitions
-    pub(crate) defines: HashMap<String, String>,
+    pub(crate) defines: HashMap<String, Macro>,
     /// Include directories
     pub(crate) include_dirs: Vec<PathBuf>,
     /// Whether to keep comments in the preprocessed output
@@ -30,6 +36,25 @@ pub struct NativePreprocessor {
     /// Maximum include depth
     #[allow(dead_code)]
     pub(crate) max_include_depth: usize,
+    /// File and line being preprocessed, for __FILE__ and __LINE__
+    pub(crate) current_file: String,
+    pub(crate) current_line: usize,
+    /// Headers read so far, shared with clones of this preprocessor
+    pub(crate) headers: HeaderCache,
+    /// Included headers marked with #pragma once
+    pub(crate) included_once: HashSet<PathBuf>,
+    /// Canonical paths of precompiled headers already applied
+    pub(crate) precompiled: HashSet<PathBuf>,
+    /// Guard macros of included headers
+    pub(crate) include_guards: HashMap<PathBuf, String>,
+    /// Include lookups by (name, system include, including directory)
+    pub(crate) resolved_includes: HashMap<(String, bool, PathBuf), PathBuf>,
+    /// Changes whenever a macro is defined or undefined
+    pub(crate) macro_generation: u64,
+    /// #if results by expression, with the macro generation they hold for
+    pub(crate) if_cache: HashMap<String, (u64, bool)>,
+    /// Messages of #warning directives, until the compiler takes them
+    pub(crate) warnings: Vec<String>,
 }
 
 impl NativePreprocessor {
@@ -41,11 +66,21 @@ impl NativePreprocessor {
             keep_comments: false,
             include_depth: 0,
             max_include_depth: 64,
+            current_file: String::new(),
+            current_line: 0,
+            headers: HeaderCache::default(),
+            included_once: HashSet::new(),
+            precompiled: HashSet::new(),
+            include_guards: HashMap::new(),
+            resolved_includes: HashMap::new(),
+            macro_generation: 0,
+            if_cache: HashMap::new(),
+            warnings: Vec::new(),
         };
         
         // Add standard predefined macros
-        preprocessor.defines.insert("__STDC__".to_string(), "1".to_string());
-        preprocessor.defines.insert("__STDC_VERSION__".to_string(), "201710L".to_string());
+        preprocessor.add_define("__STDC__", "1");
+        preprocessor.add_define("__STDC_VERSION__", "201710L");
         
         // Set up platform-specific includes
         preprocessor.setup_platform_includes();
@@ -55,14 +90,17 @@ impl NativePreprocessor {
 
     /// Add a define to the preprocessor
     pub fn add_define(&mut self, name: &str, value: &str) {
-        self.defines.insert(name.to_string(), value.to_string());
+        self.defines.insert(name.to_string(), Macro::object(value));
+        self.macro_generation += 1;
     }
 
     /// Add an include directory
     pub fn add_include_dir(&mut self, dir: &str) {
         let path = Path::new(dir).to_path_buf();
-        if path.exists() && path.is_dir() {
+        if path.is_dir() && !self.include_dirs.contains(&path) {
             self.include_dirs.push(path);
+            // Earlier lookups may now resolve differently
+            self.resolved_includes.clear();
         }
     }
 
@@ -71,6 +109,11 @@ impl NativePreprocessor {
         self.keep_comments = keep;
     }
 
+    /// The warnings issued since they were last taken
+    pub fn take_warnings(&mut self) -> Vec<String> {
+        std::mem::take(&mut self.warnings)
+    }
+
     /// Set the maximum include depth
     pub fn set_max_include_depth(&mut self, depth: usize) {
         self.max_include_depth = depth;
@@ -99,86 +142,6 @@ impl NativePreprocessor {
         // Add current directory
         self.add_include_dir(".");
     }
-
-    /// Process a conditional block (#if, #ifdef, #ifndef)
-    fn process_conditional_block(&mut self, lines: &[&str], start_idx: usize, file_name: &str) 
-        -> Result<(String, usize), String> {
-        let start_line = lines[start_idx].trim();
-        let mut result = String::new();
-        let mut i = start_idx;
-        let mut depth = 1;
-        let mut include_output = self.evaluate_conditional(start_line)?;
-        let mut processed_elif = false;
-        
-        // Skip the initial directive line
-        i += 1;
-        
-        // Process lines until we find the matching #endif
-        while i < lines.len() && depth > 0 {
-            let line = lines[i];
-            let trimmed = line.trim();
-            
-            if trimmed.starts_with("#if") {
-                // Nested conditional
-                depth += 1;
-                if include_output {
-                    // If we're including the parent block, process this nested block
-                    let (nested_result, new_i) = self.process_conditional_block(lines, i, file_name)?;
-                    result.push_str(&nested_result);
-                    i = new_i;
-                    continue;
-                }
-            } else if trimmed.starts_with("#endif") {
-                depth -= 1;
-                if depth == 0 {
-                    // This is the end of our conditional block
-                    break;
-                }
-            } else if depth == 1 && (trimmed.starts_with("#else") || trimmed.starts_with("#elif")) {
-                if trimmed.starts_with("#else") {
-                    // Toggle inclusion for #else if we haven't processed an #elif that was true
-                    if !processed_elif {
-                        include_output = !include_output;
-                    } else {
-                        include_output = false;
-                    }
-                } else if trimmed.starts_with("#elif") {
-                    // For #elif, check the condition if nothing before was true
-                    if !processed_elif && !include_output {
-                        include_output = self.evaluate_conditional(trimmed.replace("#elif", "#if").as_str())?;
-                        if include_output {
-                            processed_elif = true;
-                        }
-                    } else {
-                        // If something before was true, don't include this block
-                        include_output = false;
-                    }
-                }
-                i += 1;
-                continue;
-            }
-            
-            // Include the line if the condition is met
-            if include_output {
-                if trimmed.starts_with('#') {
-                    // Process directives inside the conditional
-                    match self.process_directive(line, file_name) {
-                        Ok(processed) => result.push_str(&processed),
-                        Err(e) => return Err(e),
-                    }
-                } else {
-                    // Expand macros in regular lines
-                    let expanded = self.expand_macros(line);
-                    result.push_str(&expanded);
-                    result.push('\n');
-                }
-            }
-            
-            i += 1;
-        }
-        
-        Ok((result, i))
-    }
 }
 
 impl Preprocessor for NativePreprocessor {
@@ -188,10 +151,10 @@ impl Preprocessor for NativePreprocessor {
     }
     
     /// Preprocess a file
-    fn preprocess_file(&mut self, file_path: &str) -> Result<String, String> {
+    fn preprocess_file_into(&mut self, file_path: &str, out: &mut dyn Write) -> Result<(), String> {
         // Read the file content
         let path = Path::new(file_path);
-        let content = fs::read_to_string(path)
+        let content = SourceText::read(path)
             .map_err(|e| format!("Failed to read file {}: {}", file_path, e))?;
         
         // Add the directory of the file to include paths temporarily for this file
@@ -205,48 +168,64 @@ impl Preprocessor for NativePreprocessor {
         
         // Process the content using the file name
         let file_name = path.to_str().unwrap_or(file_path);
-        self.preprocess_string(&content, file_name)
+        self.preprocess_string_into(&content, file_name, out)
     }
     
     /// Preprocess a string
-    fn preprocess_string(&mut self, content: &str, file_name: &str) -> Result<String, String> {
+    fn preprocess_string_into(&mut self, content: &str, file_name: &str, out: &mut dyn Write) -> Result<(), String> {
+        // Track the position in this file, going back to the including
+        // file's afterwards
+        let file = std::mem::replace(&mut self.current_file, file_name.to_string());
+        let line = self.current_line;
+        let result = self.preprocess_lines(content, file_name, out);
+        self.current_file = file;
+        self.current_line = line;
+        result
+    }
+}
+
+impl NativePreprocessor {
+    /// Preprocess the lines of `content`, from the file `file_name`. Output
+    /// goes to `out` line by line, and included files write to it directly
+    /// rather than being collected first, so memory use doesn't grow with
+    /// the size of the output.
+    fn preprocess_lines(&mut self, content: &str, file_name: &str, out: &mut dyn Write) -> Result<(), String> {
         // Split content into lines for line-by-line processing
         let lines: Vec<&str> = content.lines().collect();
-        let mut result = String::new();
         let mut i = 0;
         
         // Process each line
         while i < lines.len() {
             let line = lines[i];
-            let trimmed = line.trim();
+            self.current_line = i + 1;
             
             // Check if it's a preprocessor directive
-            if trimmed.starts_with('#') {
-                if trimmed.starts_with("#if") || trimmed.starts_with("#ifdef") || trimmed.starts_with("#ifndef") {
+            if let Some((name, _)) = directive_name(line) {
+                if matches!(name, "if" | "ifdef" | "ifndef") {
                     // This is the start of a conditional block
                     // Find the end of the block and process it
-                    let (processed, new_i) = self.process_conditional_block(&lines, i, file_name)?;
-                    result.push_str(&processed);
-                    i = new_i;
+                    i = self.process_conditional_block(&lines, i, file_name, out)?;
                     continue;
                 } else {
                     // Other directives (#include, #define, etc.)
-                    match self.process_directive(line, file_name) {
-                        Ok(processed) => result.push_str(&processed),
-                        Err(e) => return Err(e),
-                    }
+                    self.process_directive(line, file_name, out)?;
                 }
             } else {
                 // Regular code line - expand macros
-                let expanded = self.expand_macros(line);
-                result.push_str(&expanded);
-                result.push('\n');
+                self.write_line(line, out)?;
             }
             
             i += 1;
         }
         
-        Ok(result)
+        Ok(())
+    }
+
+    /// Writes `line` to `out` with its macros expanded
+    fn write_line(&self, line: &str, out: &mut dyn Write) -> Result<(), String> {
+        let mut expanded = self.expand_macros(line);
+        expanded.push('\n');
+        write_output(out, &expanded)
     }
 }
 
@@ -263,7 +242,7 @@ mod tests {
     #[test]
     fn test_simple_define() {
         let mut preprocessor = NativePreprocessor::new();
-        preprocessor.defines.insert("VERSION".to_string(), "1.0".to_string());
+        preprocessor.add_define("VERSION", "1.0");
         
         let source = "#ifdef VERSION\nconst char* version = VERSION;\n#endif";
         let result = preprocessor.preprocess_string(source, "test.c").unwrap();
@@ -274,7 +253,7 @@ mod tests {
     #[test]
     fn test_conditional_compilation() {
         let mut preprocessor = NativePreprocessor::new();
-        preprocessor.defines.insert("DEBUG".to_string(), "1".to_string());
+        preprocessor.add_define("DEBUG", "1");
         
         let source = "#ifdef DEBUG\nconst char* mode = \"debug\";\n#else\nconst char* mode = \"release\";\n#endif";
         let result = preprocessor.preprocess_string(source, "test.c").unwrap();
@@ -282,4 +261,16 @@ mod tests {
         assert!(result.contains("const char* mode = \"debug\""));
         assert!(!result.contains("const char* mode = \"release\""));
     }
+
+    #[test]
+    fn test_rescanning_stops_at_hidden_macros() {
+        let mut preprocessor = NativePreprocessor::new();
+        
+        // From the example in C11 6.10.3.5
+        let source = "#define x 3\n#define f(a) f(x * (a))\n#undef x\n#define x 2\n#define g f\n#define z z[0]\n#define t(a) a\n\
+                      f(y+1) + f(f(z)) % t(t(g)(0) + t)(1);";
+        let result = preprocessor.preprocess_string(source, "test.c").unwrap();
+        
+        assert!(result.contains("f(2 * (y+1)) + f(2 * (f(2 * (z[0])))) % f(2 * (0)) + t(1);"));
+    }
 } 
\ No newline at end of file
@@ -0,0 +1,129 @@
+//! Source file input
+//!
+//! Large regular files are mapped into memory and preprocessed straight from
+//! the mapped pages, avoiding a copy of the whole file into the heap. Small
+//! files, and anything that can't be mapped (pipes, terminals, other
+//! platforms), are read into a string instead.
+
+use std::fs::File;
+use std::io::{self, Read};
+use std::ops::Deref;
+use std::path::Path;
+
+/// Files smaller than this are read, which is faster than setting up a mapping
+const MMAP_THRESHOLD: u64 = 64 * 1024;
+
+/// The text of a source file
+#[derive(Debug)]
+pub(crate) struct SourceText {
+    contents: Contents,
+}
+
+#[derive(Debug)]
+enum Contents {
+    Read(String),
+    /// Mapped pages, checked to be UTF-8 when mapped
+    #[cfg(unix)]
+    Mapped { ptr: *const u8, len: usize },
+}
+
+// The mapping is read-only and owned by the `SourceText`
+unsafe impl Send for SourceText {}
+unsafe impl Sync for SourceText {}
+
+impl SourceText {
+    /// Reads the source file at `path`, mapping it if it's large enough. As
+    /// with any mapped file, truncating it while it's being preprocessed is
+    /// not supported.
+    pub(crate) fn read(path: &Path) -> io::Result<Self> {
+        let mut file = File::open(path)?;
+        #[cfg(unix)]
+        {
+            let metadata = file.metadata()?;
+            if metadata.is_file() && metadata.len() >= MMAP_THRESHOLD {
+                if let Some(source) = Self::map(&file, metadata.len())? {
+                    return Ok(source);
+                }
+            }
+        }
+        let mut contents = String::new();
+        file.read_to_string(&mut contents)?;
+        Ok(SourceText { contents: Contents::Read(contents) })
+    }
+
+    /// Maps `len` bytes of `file`, or returns `None` if it can't be mapped
+    #[cfg(unix)]
+    fn map(file: &File, len: u64) -> io::Result<Option<Self>> {
+        use std::os::unix::io::AsRawFd;
+
+        let Ok(len) = usize::try_from(len) else {
+            return Ok(None);
+        };
+        // SAFETY: a private read-only mapping of an open file, unmapped on drop
+        let ptr = unsafe {
+            libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ, libc::MAP_PRIVATE, file.as_raw_fd(), 0)
+        };
+        if ptr == libc::MAP_FAILED {
+            return Ok(None);
+        }
+        let source = SourceText { contents: Contents::Mapped { ptr: ptr as *const u8, len } };
+        // SAFETY: the mapping is `len` readable bytes
+        let bytes = unsafe { std::slice::from_raw_parts(ptr as *const u8, len) };
+        if std::str::from_utf8(bytes).is_err() {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "stream did not contain valid UTF-8"));
+        }
+        Ok(Some(source))
+    }
+}
+
+impl Deref for SourceText {
+    type Target = str;
+
+    fn deref(&self) -> &str {
+        match &self.contents {
+            Contents::Read(contents) => contents,
+            // SAFETY: checked to be UTF-8 in `map`, and mapped until drop
+            #[cfg(unix)]
+            Contents::Mapped { ptr, len } => unsafe {
+                std::str::from_utf8_unchecked(std::slice::from_raw_parts(*ptr, *len))
+            },
+        }
+    }
+}
+
+#[cfg(unix)]
+impl Drop for SourceText {
+    fn drop(&mut self) {
+        if let Contents::Mapped { ptr, len } = self.contents {
+            // SAFETY: mapped by `map` and not used after this
+            unsafe {
+                libc::munmap(ptr as *mut libc::c_void, len);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use tempfile::tempdir;
+
+    #[test]
+    fn test_large_files_read_like_small_ones() {
+        let dir = tempdir().unwrap();
+        for (name, size) in [("small.c", 10), ("large.c", 20_000)] {
+            let path = dir.path().join(name);
+            let contents = "int x;\n".repeat(size);
+            std::fs::write(&path, &contents).unwrap();
+            let source = SourceText::read(&path).unwrap();
+            assert_eq!(&*source, contents);
+            #[cfg(unix)]
+            assert_eq!(matches!(source.contents, Contents::Mapped { .. }), name == "large.c");
+        }
+
+        // Invalid UTF-8 is an error either way
+        let path = dir.path().join("binary.c");
+        std::fs::write(&path, vec![0xff; MMAP_THRESHOLD as usize]).unwrap();
+        assert_eq!(SourceText::read(&path).unwrap_err().kind(), io::ErrorKind::InvalidData);
+    }
+}
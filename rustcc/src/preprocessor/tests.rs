@@ -229,6 +229,54 @@ const char* status = "unsupported";
         assert!(!result.contains("const char* status = \"unsupported\";"));
     }
 
+    #[test]
+    fn test_if_expressions() {
+        let mut preprocessor = NativePreprocessor::new();
+        preprocessor.add_define("VERSION", "0x0203");
+        
+        // Each line is taken only if its condition is true
+        let source = r#"
+#define MAJOR(v) ((v) >> 8)
+#if MAJOR(VERSION) == 2 && (VERSION & 0xff) >= 3 && -1 < 0 && -1 > 0u
+int arithmetic;
+#endif
+#if 0 && 1 / 0 || !defined UNDEFINED && defined(VERSION) ? 'a' == 97 : 0
+int short_circuit;
+#endif
+#if UNDEFINED
+int wrong_if;
+#elif VERSION < 0x200
+int wrong_elif;
+#elif VERSION % 2
+int elif;
+#elif 1
+int second_elif;
+#else
+int wrong_else;
+#endif
+#ifdef VERSION
+#else
+int wrong_ifdef;
+#endif
+"#;
+        let result = preprocessor.preprocess_string(source, "test.c").unwrap();
+        assert!(result.contains("int arithmetic;"));
+        assert!(result.contains("int short_circuit;"));
+        assert!(result.contains("int elif;"));
+        assert!(!result.contains("wrong"));
+        assert!(!result.contains("second_elif"));
+        
+        // Groups that aren't taken are skipped without being processed
+        let spaced = "#  define SPACED 1\n# if SPACED\nint spaced;\n# endif\n";
+        assert_eq!(preprocessor.preprocess_string(spaced, "test.c"), Ok("int spaced;\n".to_string()));
+        let skipped = "#if 0\n#bogus\n#if 1 / 0\n#error nested\n#endif\n#else\nint taken;\n#endif\n";
+        assert_eq!(preprocessor.preprocess_string(skipped, "test.c"), Ok("int taken;\n".to_string()));
+        
+        for invalid in ["#if 1 / 0\n#endif\n", "#if (1\n#endif\n", "#else\n", "#if 1\n#else\n#else\n#endif\n"] {
+            assert!(preprocessor.preprocess_string(invalid, "test.c").is_err(), "{}", invalid);
+        }
+    }
+
     #[test]
     fn test_standard_predefined_macros() {
         let mut preprocessor = NativePreprocessor::new();
@@ -288,4 +336,61 @@ const char* status = "unsupported";
         // Check that both headers were included and defines were expanded
         assert!(result.contains("int main() { return 100 + 200; }"));
     }
+
+    #[test]
+    fn test_headers_included_once() {
+        let mut preprocessor = NativePreprocessor::new();
+        
+        // Create a temporary directory
+        let temp_dir = tempdir().unwrap();
+        let guarded_path = temp_dir.path().join("guarded.h");
+        let once_path = temp_dir.path().join("once.h");
+        let input_path = temp_dir.path().join("test.c");
+        
+        // One header with an include guard, one with #pragma once
+        fs::write(&guarded_path, "// Guarded\n#ifndef GUARDED_H\n#define GUARDED_H\nint guarded;\n#endif\n").unwrap();
+        fs::write(&once_path, "#pragma once\nint once;\n").unwrap();
+        fs::write(&input_path, "#include \"guarded.h\"\n#include \"once.h\"\n#include \"guarded.h\"\n#include \"once.h\"\n").unwrap();
+        
+        // Each header's contents appear once
+        let result = preprocessor.preprocess_file(input_path.to_str().unwrap()).unwrap();
+        assert_eq!(result.matches("int guarded;").count(), 1);
+        assert_eq!(result.matches("int once;").count(), 1);
+        assert!(!result.contains("#pragma"));
+        
+        // With its guard defined the header isn't opened again
+        fs::remove_file(&guarded_path).unwrap();
+        let result = preprocessor.preprocess_string("#include \"guarded.h\"\n", input_path.to_str().unwrap());
+        assert_eq!(result, Ok(String::new()));
+    }
+
+    #[test]
+    fn test_output_streamed_in_lines() {
+        // Records the size of every write
+        struct Sink(Vec<u8>, usize);
+        impl Write for Sink {
+            fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+                self.1 = self.1.max(buf.len());
+                self.0.write(buf)
+            }
+            fn flush(&mut self) -> std::io::Result<()> {
+                Ok(())
+            }
+        }
+
+        let temp_dir = tempdir().unwrap();
+        let header_path = temp_dir.path().join("big.h");
+        let input_path = temp_dir.path().join("test.c");
+        fs::write(&header_path, "int x;\n".repeat(1000)).unwrap();
+        fs::write(&input_path, "#include \"big.h\"\n#include \"big.h\"\nint main;\n").unwrap();
+
+        // Included files are written line by line rather than as a whole
+        let mut preprocessor = NativePreprocessor::new();
+        let mut sink = Sink(Vec::new(), 0);
+        preprocessor.preprocess_file_into(input_path.to_str().unwrap(), &mut sink).unwrap();
+        assert_eq!(sink.1, "int main;\n".len());
+        let expected = NativePreprocessor::new().preprocess_file(input_path.to_str().unwrap()).unwrap();
+        assert_eq!(String::from_utf8(sink.0).unwrap(), expected);
+        assert_eq!(expected.matches("int x;").count(), 2000);
+    }
 } 
\ No newline at end of file
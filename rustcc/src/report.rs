@@ -0,0 +1,146 @@
+// report.rs
+// Per-phase statistics of a compilation, for --time-report
+//
+// Each phase of the pipeline is timed along with the allocations made while
+// it runs, and the report ends with the size of what the phases produced:
+// preprocessed bytes, tokens, AST nodes and output bytes. It is printed as a
+// table or as one JSON object per line for build telemetry.
+//
+// Allocations are counted by `CountingAllocator`, which the rustcc binary
+// installs as its global allocator. The counters are process-wide, so when
+// files are compiled in parallel each file's figures include allocations
+// made for the others at the same time. Without the allocator (as when
+// rustcc is used as a library) they are zero.
+
+use serde::Serialize;
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+use std::time::Instant;
+
+static COUNTING: AtomicBool = AtomicBool::new(false);
+static ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+static ALLOCATED_BYTES: AtomicU64 = AtomicU64::new(0);
+
+/// The system allocator, counting allocations once a report is requested
+pub struct CountingAllocator;
+
+impl CountingAllocator {
+    fn count(size: usize) {
+        if COUNTING.load(Ordering::Relaxed) {
+            ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+            ALLOCATED_BYTES.fetch_add(size as u64, Ordering::Relaxed);
+        }
+    }
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        Self::count(layout.size());
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        Self::count(layout.size());
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        // Growing counts as allocating the new size
+        Self::count(new_size);
+        System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+}
+
+/// How a report is printed
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ReportFormat {
+    Table,
+    Json,
+}
+
+#[derive(Debug, Clone, Serialize)]
+pub struct Phase {
+    pub name: String,
+    pub wall_ms: f64,
+    pub allocations: u64,
+    pub allocated_bytes: u64,
+}
+
+#[derive(Debug, Clone, Default, Serialize)]
+pub struct TimeReport {
+    pub source_file: String,
+    pub phases: Vec<Phase>,
+    pub preprocessed_bytes: usize,
+    pub tokens: usize,
+    pub ast_nodes: usize,
+    pub output_bytes: usize,
+    /// Whether the output came from the build cache
+    pub cached: bool,
+}
+
+impl TimeReport {
+    pub fn new(source_file: &str) -> Self {
+        COUNTING.store(true, Ordering::Relaxed);
+        TimeReport {
+            source_file: source_file.to_string(),
+            ..Self::default()
+        }
+    }
+
+    /// Runs `phase`, recording it as `name`
+    pub fn measure<T>(&mut self, name: &str, phase: impl FnOnce() -> T) -> T {
+        let allocations = ALLOCATIONS.load(Ordering::Relaxed);
+        let allocated_bytes = ALLOCATED_BYTES.load(Ordering::Relaxed);
+        let start = Instant::now();
+        let result = phase();
+        self.phases.push(Phase {
+            name: name.to_string(),
+            wall_ms: start.elapsed().as_secs_f64() * 1000.0,
+            allocations: ALLOCATIONS.load(Ordering::Relaxed) - allocations,
+            allocated_bytes: ALLOCATED_BYTES.load(Ordering::Relaxed) - allocated_bytes,
+        });
+        result
+    }
+
+    pub fn format(&self, format: ReportFormat) -> String {
+        match format {
+            ReportFormat::Table => self.to_table(),
+            ReportFormat::Json => serde_json::to_string(self).expect("report serializes") + "\n",
+        }
+    }
+
+    fn to_table(&self) -> String {
+        let mut table = format!("Time report for {}{}\n", self.source_file, if self.cached { " (cached)" } else { "" });
+        table.push_str(&format!("  {:<24} {:>10} {:>12} {:>14}\n", "Phase", "Wall (ms)", "Allocations", "Bytes"));
+        for phase in &self.phases {
+            table.push_str(&format!(
+                "  {:<24} {:>10.3} {:>12} {:>14}\n",
+                phase.name, phase.wall_ms, phase.allocations, phase.allocated_bytes
+            ));
+        }
+        let total: f64 = self.phases.iter().map(|phase| phase.wall_ms).sum();
+        table.push_str(&format!("  {:<24} {:>10.3}\n", "Total", total));
+        table.push_str(&format!(
+            "  Preprocessed: {} bytes, tokens: {}, AST nodes: {}, output: {} bytes\n",
+            self.preprocessed_bytes, self.tokens, self.ast_nodes, self.output_bytes
+        ));
+        table
+    }
+}
+
+/// Runs `phase`, recording it in `report` if there is one
+pub fn measure<T>(report: &mut Option<TimeReport>, name: &str, phase: impl FnOnce() -> T) -> T {
+    match report {
+        Some(report) => report.measure(name, phase),
+        None => phase(),
+    }
+}
+
+/// Allocations and bytes allocated so far, for phases timed piecewise
+pub fn allocation_counts() -> (u64, u64) {
+    (ALLOCATIONS.load(Ordering::Relaxed), ALLOCATED_BYTES.load(Ordering::Relaxed))
+}
@@ -0,0 +1,470 @@
+// server.rs
+// Compilation server
+//
+// `rustcc --server <socket>` listens on a Unix socket and compiles for
+// clients run as `rustcc --connect <socket> <options>...`. Staying up keeps
+// what every invocation would otherwise set up again: prepared
+// preprocessors and the headers they've read, loaded precompiled headers,
+// open build caches and the interned symbols. Each connection is served by
+// one of a fixed set of worker threads (`-j`, by default one per core), so
+// jobs from different clients run concurrently. Connections arriving while
+// every worker is busy and enough others wait are turned away.
+//
+// A connection carries one request and its response, each a line of JSON.
+// The request has the client's working directory and arguments; the
+// response has what the compilation printed and its error, which the
+// client prints and exits with as if it had compiled the files itself.
+//
+// Interned symbols are never freed, so the symbol table grows with every
+// new identifier and literal compiled. Once it passes SYMBOL_LIMIT the
+// server finishes the requests it has taken and executes itself again,
+// handing the listening socket to the new process so no client is turned
+// away while it restarts.
+//
+// A request can read and write any file the server's user can, so only
+// that user is served: the socket is created for its owner alone and every
+// peer's credentials are checked before its request is read.
+
+use crate::cache::BuildCache;
+use crate::driver;
+use crate::options::Options;
+use crate::pch::PrecompiledHeader;
+use crate::preprocessor::NativePreprocessor;
+use serde::{Deserialize, Serialize};
+use std::collections::HashMap;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex, MutexGuard, PoisonError};
+use std::time::SystemTime;
+
+#[derive(Debug, Serialize, Deserialize)]
+struct Request {
+    dir: PathBuf,
+    args: Vec<String>,
+}
+
+#[derive(Debug, Default, Serialize, Deserialize)]
+struct Response {
+    stdout: String,
+    stderr: String,
+    error: Option<String>,
+}
+
+// Identifies a precompiled header by its path and when it was written
+type PchKey = (String, SystemTime);
+
+/// What the server keeps between requests
+#[derive(Default)]
+struct Server {
+    // Prepared preprocessors by include paths and precompiled header. Their
+    // clones share one header cache, so a header is read once for all
+    // requests until it changes.
+    preprocessors: Mutex<HashMap<(Vec<PathBuf>, Option<PchKey>), NativePreprocessor>>,
+    // Precompiled headers by path, with the time they were written
+    pchs: Mutex<HashMap<String, (SystemTime, Arc<PrecompiledHeader>)>>,
+    caches: Mutex<HashMap<String, Arc<BuildCache>>>,
+}
+
+// A request that panicked leaves its locks poisoned, but nothing it could
+// have left half-updated, so later requests carry on
+fn lock<T>(mutex: &Mutex<T>) -> MutexGuard<'_, T> {
+    mutex.lock().unwrap_or_else(PoisonError::into_inner)
+}
+
+impl Server {
+    fn compile(&self, request: &Request) -> Response {
+        let mut response = Response::default();
+        if let Err(e) = self.run(request, &mut response) {
+            response.error = Some(e);
+        }
+        response
+    }
+
+    fn run(&self, request: &Request, response: &mut Response) -> Result<(), String> {
+        // File lists are read from the client's directory too
+        let args: Vec<String> = request
+            .args
+            .iter()
+            .map(|arg| match arg.strip_prefix('@') {
+                Some(list) => format!("@{}", request.dir.join(list).display()),
+                None => arg.clone(),
+            })
+            .collect();
+        let mut options = Options::parse(&args)?;
+        options.resolve(&request.dir);
+
+        let mut compiler = options.compiler();
+        let pch = match &options.include_pch {
+            Some(path) => Some((path.clone(), self.pch(path)?)),
+            None => None,
+        };
+        if let Some((_, (_, pch))) = &pch {
+            compiler = compiler.with_loaded_pch(Arc::clone(pch));
+        }
+        if let Some(dir) = &options.cache_dir {
+            compiler = compiler.with_cache(self.cache(dir)?);
+        }
+
+        let key = (options.include_paths.clone(), pch.map(|(path, (modified, _))| (path, modified)));
+        let preprocessor = lock(&self.preprocessors).entry(key).or_insert_with(|| compiler.preprocessor()).clone();
+
+        let jobs = options.jobs();
+        let (results, messages): (Vec<_>, Vec<_>) =
+            driver::compile_all_reporting(&compiler, &preprocessor, &jobs, options.threads).into_iter().unzip();
+        for messages in messages {
+            response.stdout.push_str(&messages.stdout);
+            response.stderr.push_str(&messages.stderr);
+        }
+        let result = match results.as_slice() {
+            [result] => result.clone(),
+            _ => {
+                let (errors, result) = driver::batch_errors(&jobs, &results);
+                for error in errors {
+                    response.stderr.push_str(&error);
+                    response.stderr.push('\n');
+                }
+                result
+            }
+        };
+        result.map(|_| response.stdout.push_str(&options.summary()))
+    }
+
+    // The precompiled header at `path`, read again only once it changes
+    fn pch(&self, path: &str) -> Result<(SystemTime, Arc<PrecompiledHeader>), String> {
+        let modified = fs::metadata(path)
+            .and_then(|metadata| metadata.modified())
+            .map_err(|e| format!("Failed to read precompiled header {}: {}", path, e))?;
+        let mut pchs = lock(&self.pchs);
+        if let Some((time, pch)) = pchs.get(path) {
+            if *time == modified {
+                return Ok((modified, Arc::clone(pch)));
+            }
+        }
+        let pch = Arc::new(PrecompiledHeader::read(Path::new(path))?);
+        pchs.insert(path.to_string(), (modified, Arc::clone(&pch)));
+        Ok((modified, pch))
+    }
+
+    fn cache(&self, dir: &str) -> Result<Arc<BuildCache>, String> {
+        let mut caches = lock(&self.caches);
+        if let Some(cache) = caches.get(dir) {
+            return Ok(Arc::clone(cache));
+        }
+        let cache = Arc::new(BuildCache::open(dir)?);
+        caches.insert(dir.to_string(), Arc::clone(&cache));
+        Ok(cache)
+    }
+}
+
+#[cfg(unix)]
+mod unix {
+    use super::{Request, Response, Server};
+    use crate::parser::symbol::Symbol;
+    use std::env;
+    use std::fs::{self, Permissions};
+    use std::io::{BufRead, BufReader, Write};
+    use std::os::unix::fs::{FileTypeExt, MetadataExt, PermissionsExt};
+    use std::os::unix::io::{AsRawFd, FromRawFd, IntoRawFd};
+    use std::os::unix::process::CommandExt;
+    use std::path::Path;
+    use std::os::unix::net::{UnixListener, UnixStream};
+    use std::panic::{self, AssertUnwindSafe};
+    use std::sync::mpsc::{self, TrySendError};
+    use std::sync::{Arc, Mutex};
+    use std::process::Command;
+    use std::thread;
+    use std::time::Duration;
+
+    /// Bytes of interned text after which the server restarts
+    const SYMBOL_LIMIT: usize = 256 << 20;
+
+    // Names the socket a restarted server inherits
+    const LISTENER_FD: &str = "RUSTCC_SERVER_FD";
+
+    // Connections waiting for each worker, beyond which new ones are refused
+    pub(super) const QUEUED_PER_WORKER: usize = 4;
+
+    // How long a client may take to send its request
+    const REQUEST_TIMEOUT: Duration = Duration::from_secs(30);
+
+    /// Serves compilations on the Unix socket `socket` with `workers`
+    /// threads until killed
+    pub fn serve(socket: &str, workers: usize) -> Result<(), String> {
+        let listener = match inherited_listener() {
+            Some(listener) => listener,
+            None => {
+                let listener = bind(socket)?;
+                println!("Serving compilations on {}", socket);
+                listener
+            }
+        };
+        listen(&listener, Arc::new(Server::default()), workers, SYMBOL_LIMIT);
+
+        // Start over with an empty symbol table, still listening
+        let fd = listener.into_raw_fd();
+        // SAFETY: clears close-on-exec on a descriptor we own
+        unsafe { libc::fcntl(fd, libc::F_SETFD, 0) };
+        let program = env::current_exe().map_err(|e| format!("Failed to restart the server: {}", e))?;
+        let error = Command::new(program).args(env::args_os().skip(1)).env(LISTENER_FD, fd.to_string()).exec();
+        Err(format!("Failed to restart the server: {}", error))
+    }
+
+    // The socket left open by the server this one replaced, if any
+    fn inherited_listener() -> Option<UnixListener> {
+        let fd = env::var(LISTENER_FD).ok()?.parse().ok()?;
+        env::remove_var(LISTENER_FD);
+        // SAFETY: the descriptor is the listening socket the previous server
+        // kept open across exec, owned by nothing else here
+        unsafe {
+            libc::fcntl(fd, libc::F_SETFD, libc::FD_CLOEXEC);
+            Some(UnixListener::from_raw_fd(fd))
+        }
+    }
+
+    // Creates the socket, readable and writable by its owner only
+    pub(super) fn bind(socket: &str) -> Result<UnixListener, String> {
+        if let Ok(metadata) = fs::symlink_metadata(socket) {
+            // Only a socket of ours that nothing listens on any more is
+            // replaced; anything else at the path is left alone
+            if !metadata.file_type().is_socket() || metadata.uid() != user() {
+                return Err(format!("Refusing to replace {}: it isn't a socket of this user", socket));
+            }
+            if UnixStream::connect(socket).is_ok() {
+                return Err(format!("A server is already listening on {}", socket));
+            }
+            fs::remove_file(socket).map_err(|e| format!("Failed to remove the old socket {}: {}", socket, e))?;
+        }
+        // SAFETY: umask only swaps the process's file mode mask, restored
+        // right after; nothing else creates files while the server starts
+        let mask = unsafe { libc::umask(0o177) };
+        let listener = UnixListener::bind(socket);
+        unsafe { libc::umask(mask) };
+        let listener = listener.map_err(|e| format!("Failed to listen on {}: {}", socket, e))?;
+        fs::set_permissions(socket, Permissions::from_mode(0o600))
+            .map_err(|e| format!("Failed to restrict access to {}: {}", socket, e))?;
+        Ok(listener)
+    }
+
+    // Serves connections until the symbol table passes `symbol_limit`
+    // bytes, then returns once the requests taken so far are answered
+    pub(super) fn listen(listener: &UnixListener, server: Arc<Server>, workers: usize, symbol_limit: usize) {
+        let (queue, connections) = mpsc::sync_channel::<UnixStream>(workers * QUEUED_PER_WORKER);
+        let connections = Arc::new(Mutex::new(connections));
+        let address = listener.local_addr().ok().and_then(|address| address.as_pathname().map(Path::to_path_buf));
+        let workers: Vec<_> = (0..workers)
+            .map(|_| {
+                let (server, connections, address) = (Arc::clone(&server), Arc::clone(&connections), address.clone());
+                thread::spawn(move || {
+                    while let Ok(stream) = super::lock(&connections).recv() {
+                        handle(&server, stream);
+                        // Wake the listener to notice; its empty
+                        // connection is dropped like any other
+                        if Symbol::interned_bytes() > symbol_limit {
+                            if let Some(address) = &address {
+                                let _ = UnixStream::connect(address);
+                            }
+                        }
+                    }
+                })
+            })
+            .collect();
+
+        for stream in listener.incoming().flatten() {
+            if peer_user(&stream) != Some(user()) {
+                respond(&stream, &refused("Only the user running the server may use it"));
+                continue;
+            }
+            if let Err(TrySendError::Full(stream)) = queue.try_send(stream) {
+                respond(&stream, &refused("The server is busy; try again later"));
+            }
+            if Symbol::interned_bytes() > symbol_limit {
+                break;
+            }
+        }
+        drop(queue);
+        for worker in workers {
+            let _ = worker.join();
+        }
+    }
+
+    fn user() -> u32 {
+        // SAFETY: geteuid can't fail and touches no memory
+        unsafe { libc::geteuid() }
+    }
+
+    // The user on the other end of `stream`
+    #[cfg(any(target_os = "linux", target_os = "android"))]
+    fn peer_user(stream: &UnixStream) -> Option<u32> {
+        let mut credentials = libc::ucred { pid: 0, uid: 0, gid: 0 };
+        let mut len = std::mem::size_of::<libc::ucred>() as libc::socklen_t;
+        // SAFETY: SO_PEERCRED fills in a ucred of at most `len` bytes
+        let result = unsafe {
+            libc::getsockopt(
+                stream.as_raw_fd(),
+                libc::SOL_SOCKET,
+                libc::SO_PEERCRED,
+                &mut credentials as *mut libc::ucred as *mut libc::c_void,
+                &mut len,
+            )
+        };
+        (result == 0).then_some(credentials.uid)
+    }
+
+    #[cfg(not(any(target_os = "linux", target_os = "android")))]
+    fn peer_user(stream: &UnixStream) -> Option<u32> {
+        let (mut uid, mut gid) = (0, 0);
+        // SAFETY: getpeereid only writes the two ids
+        let result = unsafe { libc::getpeereid(stream.as_raw_fd(), &mut uid, &mut gid) };
+        (result == 0).then_some(uid)
+    }
+
+    fn refused(error: &str) -> Response {
+        Response { error: Some(error.to_string()), ..Default::default() }
+    }
+
+    fn respond(stream: &UnixStream, response: &Response) {
+        let response = serde_json::to_string(response).expect("response serializes");
+        let _ = writeln!(&*stream, "{}", response);
+    }
+
+    fn handle(server: &Server, stream: UnixStream) {
+        // A client that never sends its request mustn't hold a worker
+        let _ = stream.set_read_timeout(Some(REQUEST_TIMEOUT));
+        let mut line = String::new();
+        if BufReader::new(&stream).read_line(&mut line).map_or(true, |read| read == 0) {
+            return;
+        }
+        let response = match serde_json::from_str::<Request>(&line) {
+            // A crash fails the request, not the server
+            Ok(request) => panic::catch_unwind(AssertUnwindSafe(|| server.compile(&request)))
+                .unwrap_or_else(|_| refused("Internal compiler error")),
+            Err(e) => refused(&format!("Malformed request: {}", e)),
+        };
+        respond(&stream, &response);
+    }
+
+    /// Has the server on `socket` compile with `args`, printing what it
+    /// printed and returning its error
+    pub fn request(socket: &str, args: &[String]) -> Result<(), String> {
+        let dir = env::current_dir().map_err(|e| format!("Failed to get the working directory: {}", e))?;
+        let response = send(socket, &Request { dir, args: args.to_vec() })?;
+        print!("{}", response.stdout);
+        eprint!("{}", response.stderr);
+        response.error.map_or(Ok(()), Err)
+    }
+
+    pub(super) fn send(socket: &str, request: &Request) -> Result<Response, String> {
+        let failed = |e: std::io::Error| format!("Failed to talk to the server on {}: {}", socket, e);
+        let stream = UnixStream::connect(socket).map_err(failed)?;
+        let request = serde_json::to_string(request).expect("request serializes");
+        let sent = writeln!(&stream, "{}", request);
+
+        // A busy server answers and closes without reading the request, so
+        // sending can fail with the answer already on its way
+        let mut line = String::new();
+        let received = BufReader::new(&stream).read_line(&mut line);
+        if line.is_empty() {
+            sent.map_err(failed)?;
+            received.map_err(failed)?;
+        }
+        serde_json::from_str(&line).map_err(|e| format!("Malformed response from the server: {}", e))
+    }
+}
+
+#[cfg(unix)]
+pub use unix::{request, serve};
+
+#[cfg(not(unix))]
+pub fn serve(_socket: &str, _workers: usize) -> Result<(), String> {
+    Err("The compilation server needs Unix domain sockets".to_string())
+}
+
+#[cfg(not(unix))]
+pub fn request(_socket: &str, _args: &[String]) -> Result<(), String> {
+    Err("The compilation server needs Unix domain sockets".to_string())
+}
+
+#[cfg(all(test, unix))]
+mod tests {
+    use super::*;
+    use std::os::unix::fs::PermissionsExt;
+    use std::os::unix::net::{UnixListener, UnixStream};
+    use std::thread;
+    use crate::parser::symbol::Symbol;
+    use tempfile::TempDir;
+    use unix::QUEUED_PER_WORKER;
+
+    #[test]
+    fn test_server_compiles_in_the_client_directory() {
+        let dir = TempDir::new().unwrap();
+        fs::write(dir.path().join("ok.c"), "int main() { return 2; }").unwrap();
+        fs::write(dir.path().join("bad.c"), "int main() { return }").unwrap();
+        let socket = dir.path().join("rustcc.sock").to_string_lossy().to_string();
+        let listener = unix::bind(&socket).unwrap();
+        assert_eq!(fs::metadata(&socket).unwrap().permissions().mode() & 0o777, 0o600);
+        thread::spawn(move || unix::listen(&listener, Arc::new(Server::default()), 2, usize::MAX));
+
+        let request = |args: &[&str]| {
+            let request = Request { dir: dir.path().to_path_buf(), args: args.iter().map(|arg| arg.to_string()).collect() };
+            unix::send(&socket, &request).unwrap()
+        };
+        let response = request(&["ok.c", "-O1"]);
+        assert_eq!(response.error, None);
+        assert!(response.stdout.starts_with("Compilation successful!"));
+        assert!(fs::read_to_string(dir.path().join("ok.s")).unwrap().contains("_main:"));
+
+        // What the compilation would have printed comes back with it
+        fs::write(dir.path().join("warn.c"), "#warning check me\nint main() { return 0; }").unwrap();
+        let response = request(&["warn.c"]);
+        assert_eq!(response.error, None);
+        assert_eq!(response.stderr, "Warning: check me\n");
+
+        let response = request(&["ok.c", "bad.c", "-j2"]);
+        assert_eq!(response.error.as_deref(), Some("1 of 2 files failed to compile"));
+        assert!(response.stderr.contains("bad.c: Parsing error"));
+    }
+
+    #[test]
+    fn test_server_turns_connections_away_when_busy() {
+        let dir = TempDir::new().unwrap();
+        let socket = dir.path().join("rustcc.sock").to_string_lossy().to_string();
+        let listener = unix::bind(&socket).unwrap();
+        thread::spawn(move || unix::listen(&listener, Arc::new(Server::default()), 1, usize::MAX));
+
+        // One connection keeps the worker waiting for its request and the
+        // next ones fill the queue behind it
+        let idle: Vec<_> = (0..=QUEUED_PER_WORKER).map(|_| UnixStream::connect(&socket).unwrap()).collect();
+        let request = Request { dir: dir.path().to_path_buf(), args: vec!["missing.c".to_string()] };
+        let response = unix::send(&socket, &request).unwrap();
+        assert_eq!(response.error.as_deref(), Some("The server is busy; try again later"));
+        drop(idle);
+    }
+
+    #[test]
+    fn test_server_stops_once_symbols_pass_the_limit() {
+        let dir = TempDir::new().unwrap();
+        fs::write(dir.path().join("fresh.c"), "int restart_limit_probe() { return 1; } int main() { return restart_limit_probe(); }").unwrap();
+        let socket = dir.path().join("rustcc.sock").to_string_lossy().to_string();
+        let listener = unix::bind(&socket).unwrap();
+        let limit = Symbol::interned_bytes();
+        let server = thread::spawn(move || unix::listen(&listener, Arc::new(Server::default()), 1, limit));
+
+        // The request past the limit is still answered before the server stops
+        let request = Request { dir: dir.path().to_path_buf(), args: vec!["fresh.c".to_string()] };
+        assert_eq!(unix::send(&socket, &request).unwrap().error, None);
+        server.join().unwrap();
+    }
+
+    #[test]
+    fn test_server_only_replaces_its_own_stale_sockets() {
+        let dir = TempDir::new().unwrap();
+        let file = dir.path().join("notes.txt");
+        fs::write(&file, "keep me").unwrap();
+        assert!(unix::bind(&file.to_string_lossy()).unwrap_err().starts_with("Refusing to replace"));
+        assert_eq!(fs::read_to_string(&file).unwrap(), "keep me");
+
+        let socket = dir.path().join("stale.sock").to_string_lossy().to_string();
+        drop(UnixListener::bind(&socket).unwrap());
+        assert!(unix::bind(&socket).is_ok());
+    }
+}
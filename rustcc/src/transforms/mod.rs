@@ -1,13 +1,307 @@
 pub mod obfuscation;
 
-use crate::parser::ast::Program;
+use crate::parser::ast::{Function, Program};
+use crate::parser::symbol::Symbol;
+use crate::report::{self, Phase};
+use rand::rngs::StdRng;
+use rand::{thread_rng, Rng, SeedableRng};
+use std::collections::HashSet;
+use std::thread;
+use std::time::{Duration, Instant};
 
 /// A transform that can be applied to a program AST
-pub trait Transform {
-    /// Apply the transform to the given program
-    fn apply(&self, program: &mut Program) -> std::result::Result<(), String>;
+///
+/// Transforms rewrite one function at a time without looking at the
+/// others, which lets `PassManager` run them all over a function in one
+/// visit and over different functions in parallel.
+pub trait Transform: Sync {
+    /// Rewrite `function`, making random choices with `rng`
+    fn apply_to_function(&self, function: &mut Function, rng: &mut StdRng) -> std::result::Result<(), String>;
+
+    /// Whole-program work once every function has been rewritten, such as
+    /// adding functions the rewritten code calls
+    fn finish(&self, _program: &mut Program) -> std::result::Result<(), String> {
+        Ok(())
+    }
+
+    /// Whether the rewritten code runs slower, which keeps the transform
+    /// out of hot functions
+    fn costs_runtime(&self) -> bool {
+        true
+    }
 
     /// Get the name of the transform
-    #[allow(dead_code)]
     fn name(&self) -> &'static str;
 }
+
+// Fewer functions than this per thread aren't worth a thread of their own
+const MIN_FUNCTIONS_PER_THREAD: usize = 16;
+
+/// Runs a sequence of transforms over a program
+///
+/// Each function goes through every transform before the next function is
+/// started, so it's visited once while it's in cache rather than once per
+/// transform, and the list of functions is split into chunks across
+/// threads. Every function draws from its own generator, seeded from the
+/// manager's seed and the function's position, so a seed gives the same
+/// output on any number of threads.
+///
+/// Hot functions, named by the configuration or by `#pragma rustcc hot`,
+/// only get the transforms that cost nothing at run time, and a size budget
+/// stops any function from growing past a fraction of its original size.
+pub struct PassManager<'a> {
+    transforms: Vec<&'a dyn Transform>,
+    threads: usize,
+    seed: u64,
+    hot_functions: HashSet<Symbol>,
+    size_budget: Option<f32>,
+}
+
+impl<'a> PassManager<'a> {
+    pub fn new(transforms: Vec<&'a dyn Transform>) -> Self {
+        PassManager {
+            transforms,
+            threads: thread::available_parallelism().map_or(1, |threads| threads.get()),
+            seed: thread_rng().gen(),
+            hot_functions: HashSet::new(),
+            size_budget: None,
+        }
+    }
+
+    /// Rewrite functions on up to `threads` threads
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        self.threads = threads.max(1);
+        self
+    }
+
+    /// Make the same random choices on every run
+    #[allow(dead_code)]
+    pub fn with_seed(mut self, seed: u64) -> Self {
+        self.seed = seed;
+        self
+    }
+
+    /// Keep transforms that slow code down out of these functions
+    pub fn with_hot_functions<'n>(mut self, names: impl IntoIterator<Item = &'n str>) -> Self {
+        self.hot_functions.extend(names.into_iter().map(Symbol::intern));
+        self
+    }
+
+    /// Stop transforming a function once it has grown by `budget` times
+    /// its original number of AST nodes
+    pub fn with_size_budget(mut self, budget: f32) -> Self {
+        self.size_budget = Some(budget.max(0.0));
+        self
+    }
+
+    /// Applies the transforms to `program`, returning what each one cost.
+    /// A transform's time is summed over the threads that ran it.
+    pub fn run(&self, program: &mut Program) -> Result<Vec<Phase>, String> {
+        let mut hot = self.hot_functions.clone();
+        hot.extend(program.hot_functions.iter().copied());
+        let hot = &hot;
+
+        let mut costs = vec![Cost::default(); self.transforms.len()];
+        let functions = &mut program.functions;
+        let chunk_size = functions.len().div_ceil(self.threads).max(MIN_FUNCTIONS_PER_THREAD);
+        let chunks = if chunk_size >= functions.len() {
+            vec![self.run_functions(functions, 0, 0, hot)]
+        } else {
+            thread::scope(|scope| {
+                let handles: Vec<_> = functions
+                    .chunks_mut(chunk_size)
+                    .enumerate()
+                    .map(|(index, chunk)| scope.spawn(move || self.run_functions(chunk, index * chunk_size, 0, hot)))
+                    .collect();
+                handles
+                    .into_iter()
+                    .map(|handle| handle.join().expect("obfuscation thread panicked"))
+                    .collect()
+            })
+        };
+        for chunk in chunks {
+            Cost::add_all(&mut costs, &chunk?);
+        }
+
+        // Functions added by a transform's whole-program step still go
+        // through the transforms after it
+        for (index, transform) in self.transforms.iter().enumerate() {
+            let count = program.functions.len();
+            costs[index].measure(|| transform.finish(program))?;
+            if program.functions.len() > count {
+                let added = self.run_functions(&mut program.functions[count..], count, index + 1, hot)?;
+                Cost::add_all(&mut costs, &added);
+            }
+        }
+
+        Ok(self
+            .transforms
+            .iter()
+            .zip(costs)
+            .map(|(transform, cost)| Phase {
+                name: transform.name().to_string(),
+                wall_ms: cost.time.as_secs_f64() * 1000.0,
+                allocations: cost.allocations,
+                allocated_bytes: cost.allocated_bytes,
+            })
+            .collect())
+    }
+
+    // Runs the transforms from `first` on over `functions`, which start at
+    // `offset` in the program, leaving the `hot` ones lean
+    fn run_functions(
+        &self,
+        functions: &mut [Function],
+        offset: usize,
+        first: usize,
+        hot: &HashSet<Symbol>,
+    ) -> Result<Vec<Cost>, String> {
+        let mut costs = vec![Cost::default(); self.transforms.len()];
+        for (index, function) in functions.iter_mut().enumerate() {
+            let position = (offset + index) as u64;
+            let mut rng = StdRng::seed_from_u64(self.seed ^ position.wrapping_mul(0x9e37_79b9_7f4a_7c15));
+            let is_hot = hot.contains(&function.name);
+            let size_limit = self.size_budget.map(|budget| (size(function) as f64 * (1.0 + f64::from(budget))) as usize);
+            for (transform, cost) in self.transforms.iter().zip(&mut costs).skip(first) {
+                if is_hot && transform.costs_runtime() {
+                    continue;
+                }
+                if size_limit.is_some_and(|limit| size(function) > limit) {
+                    break;
+                }
+                cost.measure(|| transform.apply_to_function(function, &mut rng))?;
+            }
+        }
+        Ok(costs)
+    }
+}
+
+// A function's size, in AST nodes. Nodes a transform has replaced are
+// still counted, which errs on the side of transforming less.
+fn size(function: &Function) -> usize {
+    function.arena.expr_count() + function.arena.stmt_count()
+}
+
+// Time and allocations spent in one transform
+#[derive(Debug, Clone, Default)]
+struct Cost {
+    time: Duration,
+    allocations: u64,
+    allocated_bytes: u64,
+}
+
+impl Cost {
+    fn measure<T>(&mut self, work: impl FnOnce() -> T) -> T {
+        let (allocations, allocated_bytes) = report::allocation_counts();
+        let start = Instant::now();
+        let result = work();
+        self.time += start.elapsed();
+        let (allocations_after, allocated_bytes_after) = report::allocation_counts();
+        self.allocations += allocations_after - allocations;
+        self.allocated_bytes += allocated_bytes_after - allocated_bytes;
+        result
+    }
+
+    fn add_all(costs: &mut [Cost], more: &[Cost]) {
+        for (cost, more) in costs.iter_mut().zip(more) {
+            cost.time += more.time;
+            cost.allocations += more.allocations;
+            cost.allocated_bytes += more.allocated_bytes;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::obfuscation::{ControlFlowObfuscator, DeadCodeInserter, StringEncryptor, VariableObfuscator};
+    use super::*;
+    use crate::parser::ast::{Expression, Statement};
+    use crate::parser::lexer::Lexer;
+    use crate::parser::Parser;
+
+    #[test]
+    fn test_seeded_output_is_the_same_on_any_number_of_threads() {
+        let source: String = (0..40)
+            .map(|i| format!("int f{}(int a) {{ int b = a * {}; if (b > 3) {{ return b; }} return a; }}\n", i, i))
+            .chain(["int main() { printf(\"%d\\n\", f1(2)); return 0; }\n".to_string()])
+            .collect();
+        let program = Parser::new(Lexer::new(&source).scan_tokens()).parse().unwrap();
+        let (control_flow, dead_code) = (ControlFlowObfuscator::default(), DeadCodeInserter::default());
+        let transforms: Vec<&dyn Transform> = vec![&VariableObfuscator, &StringEncryptor, &control_flow, &dead_code];
+
+        let obfuscate = |threads| {
+            let mut program = program.clone();
+            let passes = PassManager::new(transforms.clone()).with_threads(threads).with_seed(7);
+            let costs = passes.run(&mut program).unwrap();
+            assert_eq!(costs.len(), 4);
+            program
+        };
+        let (serial, parallel) = (obfuscate(1), obfuscate(4));
+        assert_eq!(format!("{:?}", serial), format!("{:?}", parallel));
+
+        // The decrypt function added at the end still gets dead code
+        let decrypt = serial.functions.last().unwrap();
+        assert_eq!(decrypt.name, "__rustcc_decrypt_string");
+        let Statement::VariableDeclaration { name, .. } = &decrypt.arena[decrypt.body[0]] else {
+            panic!("expected a dummy declaration");
+        };
+        assert!(name.as_str().starts_with("_unused_"));
+    }
+
+    #[test]
+    fn test_each_string_gets_its_own_storage() {
+        let source = "int main() { printf(\"hi\"); printf(\"%d items\\n\", 3); return 0; }";
+        let mut program = Parser::new(Lexer::new(source).scan_tokens()).parse().unwrap();
+        PassManager::new(vec![&StringEncryptor]).with_seed(5).run(&mut program).unwrap();
+
+        // Whole words of text and terminator, then the state word
+        let sizes: Vec<_> = program
+            .globals
+            .iter()
+            .map(|&global| match &program.arena[global] {
+                Statement::ArrayDeclaration { name, size: Some(size), alignment: Some(8), .. } => {
+                    assert!(name.as_str().starts_with("L.enc."));
+                    match program.arena[*size] {
+                        Expression::IntegerLiteral(size) => size,
+                        _ => panic!("expected a constant size"),
+                    }
+                }
+                other => panic!("expected aligned storage, got {:?}", other),
+            })
+            .collect();
+        assert_eq!(sizes, [16, 24]);
+
+        let main = &program.functions[0];
+        let calls = main
+            .arena
+            .expr_ids()
+            .filter(|&id| {
+                matches!(&main.arena[id], Expression::FunctionCall { name, arguments }
+                    if *name == "__rustcc_decrypt_string" && arguments.len() == 3)
+            })
+            .count();
+        assert_eq!(calls, 2);
+        assert_eq!(program.functions.last().unwrap().name, "__rustcc_decrypt_string");
+    }
+
+    #[test]
+    fn test_hot_functions_are_only_renamed() {
+        let source = "int cold(int a) { int b = a + 1; return b; }\n\
+                      #pragma rustcc hot\n\
+                      int hot(int a) { int b = a + 1; return b; }\n\
+                      int warm(int a) { int b = a + 1; return b; }\n";
+        let mut program = Parser::new(Lexer::new(source).scan_tokens()).parse().unwrap();
+        assert_eq!(program.hot_functions, vec![Symbol::intern("hot")]);
+
+        let (control_flow, dead_code) = (ControlFlowObfuscator::default(), DeadCodeInserter::new(1.0));
+        let transforms: Vec<&dyn Transform> = vec![&VariableObfuscator, &control_flow, &dead_code];
+        PassManager::new(transforms).with_hot_functions(["warm"]).with_seed(3).run(&mut program).unwrap();
+        let lengths: Vec<_> = program.functions.iter().map(|function| function.body.len()).collect();
+        assert!(lengths[0] > 2);
+        assert_eq!(lengths[1..], [2, 2]);
+        let Statement::VariableDeclaration { name, .. } = &program.functions[1].arena[program.functions[1].body[0]] else {
+            panic!("expected the declaration of b");
+        };
+        assert_ne!(name.as_str(), "b");
+    }
+}
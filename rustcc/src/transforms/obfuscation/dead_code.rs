@@ -1,53 +1,69 @@
-use crate::parser::ast::{BinaryOp, Expression, Program, Statement, Type, UnaryOp};
+use super::{binary, int, var};
+use crate::parser::ast::{AstArena, BinaryOp, ExprId, Expression, Function, Statement, StmtId, Type, UnaryOp};
+use crate::parser::symbol::Symbol;
 use crate::transforms::Transform;
-use rand::{thread_rng, Rng};
+use rand::rngs::StdRng;
+use rand::Rng;
 
 /// Advanced Dead Code Insertion
 /// Adds various types of meaningless but complex code to confuse reverse engineers
-pub struct DeadCodeInserter;
+pub struct DeadCodeInserter {
+    /// Chance of dead code before each statement, from 0 to 1
+    ratio: f64,
+}
 
-impl Transform for DeadCodeInserter {
-    fn apply(&self, program: &mut Program) -> std::result::Result<(), String> {
-        let mut rng = thread_rng();
-
-        for function in &mut program.functions {
-            // Generate a list of dummy variable names with convincing patterns
-            let dummy_var_count = rng.gen_range(3..8); // Increase the number of dummy variables
-            let mut dummy_vars = Vec::new();
-
-            // Generate variables that look like they have meaningful purposes
-            let prefixes = [
-                "counter", "index", "temp", "buffer", "size", "len", "offset", "ptr", "flag",
-            ];
-
-            for _ in 0..dummy_var_count {
-                let prefix = prefixes[rng.gen_range(0..prefixes.len())];
-                let suffix = rng.gen_range(1..100);
-                dummy_vars.push(format!("{}_{}", prefix, suffix));
-            }
+impl DeadCodeInserter {
+    pub fn new(ratio: f32) -> Self {
+        DeadCodeInserter {
+            ratio: f64::from(ratio).clamp(0.0, 1.0),
+        }
+    }
+}
 
-            // Insert dummy declarations and more complex dead code
-            let original_len = function.body.len();
-            let mut new_statements = Vec::new();
+impl Default for DeadCodeInserter {
+    fn default() -> Self {
+        DeadCodeInserter::new(0.2)
+    }
+}
+
+impl Transform for DeadCodeInserter {
+    fn apply_to_function(&self, function: &mut Function, rng: &mut StdRng) -> std::result::Result<(), String> {
+        // Generate a list of dummy variable names with convincing patterns
+        let dummy_var_count = rng.gen_range(3..8); // Increase the number of dummy variables
+        let mut dummy_vars = Vec::new();
+
+        // Generate variables that look like they have meaningful purposes
+        let prefixes = [
+            "counter", "index", "temp", "buffer", "size", "len", "offset", "ptr", "flag",
+        ];
+
+        for _ in 0..dummy_var_count {
+            let prefix = prefixes[rng.gen_range(0..prefixes.len())];
+            let suffix = rng.gen_range(1..100);
+            dummy_vars.push(Symbol::intern(&format!("{}_{}", prefix, suffix)));
+        }
 
-            // Add complex initialization at the start
-            self.add_complex_initialization(&mut new_statements, &dummy_vars, &mut rng);
+        // Insert dummy declarations and more complex dead code
+        let original_len = function.body.len();
+        let mut new_statements = Vec::new();
 
-            for (i, stmt) in function.body.drain(..).enumerate() {
-                // Decide whether to insert dead code before this statement
-                // Higher probability for more code insertion
-                if rng.gen_bool(0.4) && i < original_len - 1 {
-                    // Insert more complex dead code
-                    self.insert_complex_dead_code(&mut new_statements, &dummy_vars, &mut rng);
-                }
+        // Add complex initialization at the start
+        let arena = &mut function.arena;
+        self.add_complex_initialization(arena, &mut new_statements, &dummy_vars, rng);
 
-                // Add the original statement
-                new_statements.push(stmt);
+        for (i, stmt) in function.body.drain(..).enumerate() {
+            // Decide whether to insert dead code before this statement
+            if rng.gen_bool(self.ratio) && i < original_len - 1 {
+                // Insert more complex dead code
+                self.insert_complex_dead_code(arena, &mut new_statements, &dummy_vars, rng);
             }
 
-            function.body = new_statements;
+            // Add the original statement
+            new_statements.push(stmt);
         }
 
+        function.body = new_statements;
+
         Ok(())
     }
 
@@ -60,52 +76,44 @@ impl DeadCodeInserter {
     // Helper method to add complex initialization code
     fn add_complex_initialization(
         &self,
-        statements: &mut Vec<Statement>,
-        dummy_vars: &[String],
+        arena: &mut AstArena,
+        statements: &mut Vec<StmtId>,
+        dummy_vars: &[Symbol],
         rng: &mut impl Rng,
     ) {
         // Add a few variable declarations with complex initializers
         for _var_name in dummy_vars.iter().take(3) {
-            // Create a complex initializer
-            let _initializer = self.create_complex_expression(rng);
-
             // Create the variable declaration
-            let decl = Statement::VariableDeclaration {
-                name: format!("_unused_{}", rng.gen_range(1000..9999)),
+            let name = Symbol::intern(&format!("_unused_{}", rng.gen_range(1000..9999)));
+            let initializer = int(arena, rng.gen_range(-100..100));
+            let decl = arena.alloc_stmt(Statement::VariableDeclaration {
+                name,
                 data_type: Some(Type::Int),
-                initializer: Expression::IntegerLiteral(rng.gen_range(-100..100)),
+                initializer,
                 is_global: false,
                 alignment: None,
-            };
+            });
 
             statements.push(decl);
         }
     }
 
     // Helper method to create complex but meaningless expressions
-    fn create_complex_expression(&self, rng: &mut impl Rng) -> Expression {
+    fn create_complex_expression(&self, arena: &mut AstArena, rng: &mut impl Rng) -> ExprId {
         // Choose a random pattern for the expression
         match rng.gen_range(0..5) {
             0 => {
                 // Nested binary operations: (a + b) * (c - d)
                 let a = rng.gen_range(1..100);
                 let b = rng.gen_range(1..100);
-                let c = rng.gen_range(1..100);
+                let c = rng.gen_range(2..100);
                 let d = rng.gen_range(1..c); // Ensure c > d to avoid negative results
 
-                Expression::BinaryOperation {
-                    left: Box::new(Expression::BinaryOperation {
-                        left: Box::new(Expression::IntegerLiteral(a)),
-                        operator: BinaryOp::Add,
-                        right: Box::new(Expression::IntegerLiteral(b)),
-                    }),
-                    operator: BinaryOp::Multiply,
-                    right: Box::new(Expression::BinaryOperation {
-                        left: Box::new(Expression::IntegerLiteral(c)),
-                        operator: BinaryOp::Subtract,
-                        right: Box::new(Expression::IntegerLiteral(d)),
-                    }),
-                }
+                let (a, b) = (int(arena, a), int(arena, b));
+                let sum = binary(arena, a, BinaryOp::Add, b);
+                let (c, d) = (int(arena, c), int(arena, d));
+                let diff = binary(arena, c, BinaryOp::Subtract, d);
+                binary(arena, sum, BinaryOp::Multiply, diff)
             }
             1 => {
                 // Bitwise operations: a & (b | c)
@@ -113,15 +121,10 @@ impl DeadCodeInserter {
                 let b = rng.gen_range(1..100);
                 let c = rng.gen_range(1..100);
 
-                Expression::BinaryOperation {
-                    left: Box::new(Expression::IntegerLiteral(a)),
-                    operator: BinaryOp::BitwiseAnd,
-                    right: Box::new(Expression::BinaryOperation {
-                        left: Box::new(Expression::IntegerLiteral(b)),
-                        operator: BinaryOp::BitwiseOr,
-                        right: Box::new(Expression::IntegerLiteral(c)),
-                    }),
-                }
+                let a = int(arena, a);
+                let (b, c) = (int(arena, b), int(arena, c));
+                let or = binary(arena, b, BinaryOp::BitwiseOr, c);
+                binary(arena, a, BinaryOp::BitwiseAnd, or)
             }
             2 => {
                 // Ternary operation: a > b ? c : d
@@ -130,29 +133,26 @@ impl DeadCodeInserter {
                 let c = rng.gen_range(1..100);
                 let d = rng.gen_range(1..100);
 
-                Expression::TernaryIf {
-                    condition: Box::new(Expression::BinaryOperation {
-                        left: Box::new(Expression::IntegerLiteral(a)),
-                        operator: BinaryOp::GreaterThan,
-                        right: Box::new(Expression::IntegerLiteral(b)),
-                    }),
-                    then_expr: Box::new(Expression::IntegerLiteral(c)),
-                    else_expr: Box::new(Expression::IntegerLiteral(d)),
-                }
+                let (a, b) = (int(arena, a), int(arena, b));
+                let condition = binary(arena, a, BinaryOp::GreaterThan, b);
+                let (then_expr, else_expr) = (int(arena, c), int(arena, d));
+                arena.alloc_expr(Expression::TernaryIf {
+                    condition,
+                    then_expr,
+                    else_expr,
+                })
             }
             3 => {
                 // Unary operations: -(a * b)
                 let a = rng.gen_range(1..100);
                 let b = rng.gen_range(1..100);
 
-                Expression::UnaryOperation {
+                let (a, b) = (int(arena, a), int(arena, b));
+                let operand = binary(arena, a, BinaryOp::Multiply, b);
+                arena.alloc_expr(Expression::UnaryOperation {
                     operator: crate::parser::ast::OperatorType::Unary(UnaryOp::Negate),
-                    operand: Box::new(Expression::BinaryOperation {
-                        left: Box::new(Expression::IntegerLiteral(a)),
-                        operator: BinaryOp::Multiply,
-                        right: Box::new(Expression::IntegerLiteral(b)),
-                    }),
-                }
+                    operand,
+                })
             }
             _ => {
                 // Modulo operation: (a * b) % c
@@ -160,15 +160,10 @@ impl DeadCodeInserter {
                 let b = rng.gen_range(1..20);
                 let c = rng.gen_range(1..100);
 
-                Expression::BinaryOperation {
-                    left: Box::new(Expression::BinaryOperation {
-                        left: Box::new(Expression::IntegerLiteral(a)),
-                        operator: BinaryOp::Multiply,
-                        right: Box::new(Expression::IntegerLiteral(b)),
-                    }),
-                    operator: BinaryOp::Modulo,
-                    right: Box::new(Expression::IntegerLiteral(c)),
-                }
+                let (a, b) = (int(arena, a), int(arena, b));
+                let product = binary(arena, a, BinaryOp::Multiply, b);
+                let c = int(arena, c);
+                binary(arena, product, BinaryOp::Modulo, c)
             }
         }
     }
@@ -176,8 +171,9 @@ impl DeadCodeInserter {
     // Insert more complex dead code
     fn insert_complex_dead_code(
         &self,
-        statements: &mut Vec<Statement>,
-        dummy_vars: &[String],
+        arena: &mut AstArena,
+        statements: &mut Vec<StmtId>,
+        dummy_vars: &[Symbol],
         rng: &mut impl Rng,
     ) {
         // Choose a random pattern of dead code to insert
@@ -186,13 +182,12 @@ impl DeadCodeInserter {
                 // Simple variable assignment with complex expression
                 if !dummy_vars.is_empty() {
                     let var_idx = rng.gen_range(0..dummy_vars.len());
-                    let var_name = dummy_vars[var_idx].clone();
+                    let var_name = dummy_vars[var_idx];
 
-                    let expr = self.create_complex_expression(rng);
-                    let stmt = Statement::ExpressionStatement(Expression::Assignment {
-                        target: Box::new(Expression::Variable(var_name)),
-                        value: Box::new(expr),
-                    });
+                    let value = self.create_complex_expression(arena, rng);
+                    let target = var(arena, var_name);
+                    let assignment = arena.alloc_expr(Expression::Assignment { target, value });
+                    let stmt = arena.alloc_stmt(Statement::ExpressionStatement(assignment));
 
                     statements.push(stmt);
                 }
@@ -203,35 +198,27 @@ impl DeadCodeInserter {
                     let var1_idx = rng.gen_range(0..dummy_vars.len());
                     let var2_idx = (var1_idx + 1) % dummy_vars.len(); // Ensure different from var1
 
-                    let var1 = dummy_vars[var1_idx].clone();
-                    let var2 = dummy_vars[var2_idx].clone();
+                    let var1 = dummy_vars[var1_idx];
+                    let var2 = dummy_vars[var2_idx];
 
                     // Create condition like: var1 > var2 || var1 < var2 (always true)
-                    let condition = Expression::BinaryOperation {
-                        left: Box::new(Expression::BinaryOperation {
-                            left: Box::new(Expression::Variable(var1.clone())),
-                            operator: BinaryOp::GreaterThan,
-                            right: Box::new(Expression::Variable(var2.clone())),
-                        }),
-                        operator: BinaryOp::LogicalOr,
-                        right: Box::new(Expression::BinaryOperation {
-                            left: Box::new(Expression::Variable(var1)),
-                            operator: BinaryOp::LessThan,
-                            right: Box::new(Expression::Variable(var2)),
-                        }),
-                    };
+                    let (l1, r1) = (var(arena, var1), var(arena, var2));
+                    let greater = binary(arena, l1, BinaryOp::GreaterThan, r1);
+                    let (l2, r2) = (var(arena, var1), var(arena, var2));
+                    let less = binary(arena, l2, BinaryOp::LessThan, r2);
+                    let condition = binary(arena, greater, BinaryOp::LogicalOr, less);
 
                     // Create meaningless block
-                    let block = Statement::Block(vec![Statement::ExpressionStatement(
-                        Expression::IntegerLiteral(rng.gen_range(1..1000)),
-                    )]);
+                    let junk_value = int(arena, rng.gen_range(1..1000));
+                    let junk_statement = arena.alloc_stmt(Statement::ExpressionStatement(junk_value));
+                    let block = arena.alloc_stmt(Statement::Block(vec![junk_statement]));
 
                     // Create the if statement
-                    let if_stmt = Statement::If {
+                    let if_stmt = arena.alloc_stmt(Statement::If {
                         condition,
-                        then_block: Box::new(block),
+                        then_block: block,
                         else_block: None,
-                    };
+                    });
 
                     statements.push(if_stmt);
                 }
@@ -240,86 +227,80 @@ impl DeadCodeInserter {
                 // Loop with a fixed number of iterations
                 if !dummy_vars.is_empty() {
                     let var_idx = rng.gen_range(0..dummy_vars.len());
-                    let var_name = dummy_vars[var_idx].clone();
+                    let var_name = dummy_vars[var_idx];
 
                     // Initialize counter
-                    let init_stmt = Statement::VariableDeclaration {
-                        name: var_name.clone(),
+                    let zero = int(arena, 0);
+                    let init_stmt = arena.alloc_stmt(Statement::VariableDeclaration {
+                        name: var_name,
                         data_type: Some(Type::Int),
-                        initializer: Expression::IntegerLiteral(0),
+                        initializer: zero,
                         is_global: false,
                         alignment: None,
-                    };
+                    });
 
                     statements.push(init_stmt);
 
                     // Create a loop with a small number of iterations
                     let iterations = rng.gen_range(1..5);
-                    let loop_var = format!("_iter_{}", rng.gen_range(1000..9999));
+                    let loop_var = Symbol::intern(&format!("_iter_{}", rng.gen_range(1000..9999)));
 
                     // Loop initialization
-                    let init = Statement::VariableDeclaration {
-                        name: format!("_iter_{}", rng.gen_range(1000..9999)),
+                    let name = Symbol::intern(&format!("_iter_{}", rng.gen_range(1000..9999)));
+                    let zero = int(arena, 0);
+                    let init = arena.alloc_stmt(Statement::VariableDeclaration {
+                        name,
                         data_type: Some(Type::Int),
-                        initializer: Expression::IntegerLiteral(0),
+                        initializer: zero,
                         is_global: false,
                         alignment: None,
-                    };
+                    });
 
                     // Loop condition
-                    let condition = Expression::BinaryOperation {
-                        left: Box::new(Expression::Variable(loop_var.clone())),
-                        operator: BinaryOp::LessThan,
-                        right: Box::new(Expression::IntegerLiteral(iterations)),
-                    };
+                    let (counter, limit) = (var(arena, loop_var), int(arena, iterations));
+                    let condition = binary(arena, counter, BinaryOp::LessThan, limit);
 
                     // Loop increment
-                    let increment = Expression::Assignment {
-                        target: Box::new(Expression::Variable(loop_var.clone())),
-                        value: Box::new(Expression::BinaryOperation {
-                            left: Box::new(Expression::Variable(loop_var)),
-                            operator: BinaryOp::Add,
-                            right: Box::new(Expression::IntegerLiteral(1)),
-                        }),
-                    };
+                    let (counter, one) = (var(arena, loop_var), int(arena, 1));
+                    let value = binary(arena, counter, BinaryOp::Add, one);
+                    let target = var(arena, loop_var);
+                    let increment = arena.alloc_expr(Expression::Assignment { target, value });
 
                     // Loop body
-                    let body = Statement::Block(vec![Statement::ExpressionStatement(
-                        Expression::Assignment {
-                            target: Box::new(Expression::Variable(var_name)),
-                            value: Box::new(self.create_complex_expression(rng)),
-                        },
-                    )]);
+                    let value = self.create_complex_expression(arena, rng);
+                    let target = var(arena, var_name);
+                    let assignment = arena.alloc_expr(Expression::Assignment { target, value });
+                    let assignment = arena.alloc_stmt(Statement::ExpressionStatement(assignment));
+                    let body = arena.alloc_stmt(Statement::Block(vec![assignment]));
 
                     // Create the for loop
-                    let for_stmt = Statement::For {
-                        initializer: Some(Box::new(init)),
+                    let for_stmt = arena.alloc_stmt(Statement::For {
+                        initializer: Some(init),
                         condition: Some(condition),
                         increment: Some(increment),
-                        body: Box::new(body),
-                    };
+                        body,
+                    });
 
                     statements.push(for_stmt);
                 }
             }
             3 => {
                 // Nested expression statement
-                statements.push(Statement::ExpressionStatement(
-                    self.create_complex_expression(rng),
-                ));
+                let expr = self.create_complex_expression(arena, rng);
+                statements.push(arena.alloc_stmt(Statement::ExpressionStatement(expr)));
             }
             _ => {
                 // Create a new dummy variable with complex initialization
-                let var_name = format!("_junk_{}", rng.gen_range(1000..9999));
-                let expr = self.create_complex_expression(rng);
+                let var_name = Symbol::intern(&format!("_junk_{}", rng.gen_range(1000..9999)));
+                let expr = self.create_complex_expression(arena, rng);
 
-                let stmt = Statement::VariableDeclaration {
+                let stmt = arena.alloc_stmt(Statement::VariableDeclaration {
                     name: var_name,
                     data_type: Some(Type::Int),
                     initializer: expr,
                     is_global: false,
                     alignment: None,
-                };
+                });
 
                 statements.push(stmt);
             }
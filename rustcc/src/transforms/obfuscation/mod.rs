@@ -8,4 +8,23 @@ pub use dead_code::DeadCodeInserter;
 pub use string::StringEncryptor;
 pub use variable::VariableObfuscator;
 
-// Add any common utility functions or shared code here
+use crate::parser::ast::{AstArena, BinaryOp, ExprId, Expression};
+use crate::parser::symbol::Symbol;
+
+// Shorthands for building expression trees bottom-up in an arena. Each call
+// allocates a fresh node, so generated trees never share subexpressions.
+fn int(arena: &mut AstArena, value: i32) -> ExprId {
+    arena.alloc_expr(Expression::IntegerLiteral(value))
+}
+
+fn var(arena: &mut AstArena, name: Symbol) -> ExprId {
+    arena.alloc_expr(Expression::Variable(name))
+}
+
+fn binary(arena: &mut AstArena, left: ExprId, operator: BinaryOp, right: ExprId) -> ExprId {
+    arena.alloc_expr(Expression::BinaryOperation {
+        left,
+        operator,
+        right,
+    })
+}
@@ -1,35 +1,85 @@
-use crate::parser::ast::{Expression, Function, Program, Statement, Type};
+use super::{binary, int, var};
+use crate::parser::ast::{
+    AstArena, AtomicOp, BinaryOp, ExprId, Expression, Function, FunctionParameter, OperatorType, Program, Statement,
+    StmtId, Type, UnaryOp,
+};
+use crate::parser::symbol::Symbol;
 use crate::transforms::Transform;
-use rand::{thread_rng, Rng};
+use rand::rngs::StdRng;
+use rand::Rng;
+
+const DECRYPT: &str = "__rustcc_decrypt_string";
+
+// Names of the encrypted texts, numbered across the program. The backends
+// keep globals starting with "L." local to the file.
+const STORAGE_PREFIX: &str = "L.enc.";
+
+// States of an encrypted string, kept in the word after its text
+const ENCRYPTED: i32 = 0;
+const DECRYPTING: i32 = 1;
+const DECRYPTED: i32 = 2;
 
 /// String Encryption Obfuscation
 /// Encrypts string literals to make them harder to identify
+///
+/// Every literal gets its own writable copy, XORed word by word with a
+/// random 64-bit key and followed by a state word. The first use decrypts
+/// it in place, and later uses only check the state, so a format string
+/// in a loop is decrypted once rather than on every call. Threads racing
+/// to the first use agree through a compare-exchange on the state: one
+/// decrypts while the others wait for it.
 pub struct StringEncryptor;
 
 impl Transform for StringEncryptor {
-    fn apply(&self, program: &mut Program) -> std::result::Result<(), String> {
-        let mut rng = thread_rng();
-        let mut encrypted_strings = Vec::new();
-        let mut has_decrypt_function = false;
+    fn apply_to_function(&self, function: &mut Function, rng: &mut StdRng) -> std::result::Result<(), String> {
+        self.encrypt_strings_in_arena(&mut function.arena, rng);
+        Ok(())
+    }
 
-        // Check if the decrypt function already exists
-        for function in &program.functions {
-            if function.name == "__rustcc_decrypt_string" {
-                has_decrypt_function = true;
-                break;
+    // Move each string's encrypted text into a global of its own, and add
+    // the decryption function if any were encrypted
+    fn finish(&self, program: &mut Program) -> std::result::Result<(), String> {
+        let decrypt = Symbol::intern(DECRYPT);
+        let mut calls_decrypt = false;
+        let mut count = 0;
+        for function in &mut program.functions {
+            let mut encrypted = Vec::new();
+            for id in function.arena.expr_ids() {
+                if let Expression::FunctionCall { name, arguments } = &function.arena[id] {
+                    if *name != decrypt {
+                        continue;
+                    }
+                    calls_decrypt = true;
+                    if let [.., text] = arguments[..] {
+                        if let Expression::ArrayLiteral(text) = &function.arena[text] {
+                            encrypted.push((id, text.clone()));
+                        }
+                    }
+                }
             }
-        }
 
-        // Process all functions to encrypt strings
-        for function in &mut program.functions {
-            self.encrypt_strings_in_statements(&mut function.body, &mut rng, &mut encrypted_strings);
+            for (call, text) in encrypted {
+                let storage = Symbol::intern(&format!("{}{}", STORAGE_PREFIX, count));
+                count += 1;
+                let bytes: Vec<_> = text
+                    .iter()
+                    .map(|&byte| match function.arena[byte] {
+                        Expression::IntegerLiteral(value) => value,
+                        _ => 0,
+                    })
+                    .collect();
+                program.globals.push(Self::storage(&mut program.arena, storage, &bytes));
+                let storage = var(&mut function.arena, storage);
+                if let Expression::FunctionCall { arguments, .. } = &mut function.arena[call] {
+                    arguments.pop();
+                    arguments.insert(0, storage);
+                }
+            }
         }
 
-        // If we encrypted any strings, add the decryption function
-        if !encrypted_strings.is_empty() && !has_decrypt_function {
+        if calls_decrypt && !program.functions.iter().any(|function| function.name == decrypt) {
             program.functions.push(self.create_decrypt_function());
         }
-
         Ok(())
     }
 
@@ -39,325 +89,205 @@ impl Transform for StringEncryptor {
 }
 
 impl StringEncryptor {
+    // unsigned char storage[] = { encrypted text..., state word }, 8-byte
+    // aligned for the word-at-a-time decryption
+    fn storage(arena: &mut AstArena, name: Symbol, bytes: &[i32]) -> StmtId {
+        let elements = bytes.iter().map(|&byte| int(arena, byte)).collect();
+        let initializer = arena.alloc_expr(Expression::ArrayLiteral(elements));
+        let size = int(arena, bytes.len() as i32 + 8);
+        arena.alloc_stmt(Statement::ArrayDeclaration {
+            name,
+            data_type: Some(Type::UnsignedChar),
+            size: Some(size),
+            initializer,
+            is_global: true,
+            alignment: Some(8),
+        })
+    }
+
     // Create a decryption function that will be added to the program
     fn create_decrypt_function(&self) -> Function {
-        // Create a simple XOR decryption function
-        let decrypt_body = vec![
-            // char* __rustcc_decrypt_string(const char* encrypted, unsigned char key)
-            // {
-            //     static char buffer[1024];  // Static buffer for simplicity
-            //     int i = 0;
-            //     while (encrypted[i] != '\0') {
-            //         buffer[i] = encrypted[i] ^ key;
-            //         i++;
-            //     }
-            //     buffer[i] = '\0';
-            //     return buffer;
-            // }
-            Statement::VariableDeclaration {
-                name: "buffer".to_string(),
-                data_type: Some(Type::Array(Box::new(Type::Char), Some(1024))),
-                initializer: Expression::ArrayLiteral(vec![Expression::CharLiteral('\0')]),
-                is_global: false,
-                alignment: None,
-            },
-            Statement::VariableDeclaration {
-                name: "i".to_string(),
-                data_type: Some(Type::Int),
-                initializer: Expression::IntegerLiteral(0),
-                is_global: false,
-                alignment: None,
-            },
-            Statement::While {
-                condition: Expression::BinaryOperation {
-                    left: Box::new(Expression::UnaryOperation {
-                        operator: crate::parser::ast::OperatorType::Unary(crate::parser::ast::UnaryOp::Dereference),
-                        operand: Box::new(Expression::BinaryOperation {
-                            left: Box::new(Expression::Variable("encrypted".to_string())),
-                            operator: crate::parser::ast::BinaryOp::Add,
-                            right: Box::new(Expression::Variable("i".to_string())),
-                        }),
-                    }),
-                    operator: crate::parser::ast::BinaryOp::NotEqual,
-                    right: Box::new(Expression::CharLiteral('\0')),
-                },
-                body: Box::new(Statement::Block(vec![
-                    // buffer[i] = encrypted[i] ^ key;
-                    Statement::ExpressionStatement(Expression::Assignment {
-                        target: Box::new(Expression::ArrayAccess {
-                            array: Box::new(Expression::Variable("buffer".to_string())),
-                            index: Box::new(Expression::Variable("i".to_string())),
-                        }),
-                        value: Box::new(Expression::BinaryOperation {
-                            left: Box::new(Expression::UnaryOperation {
-                                operator: crate::parser::ast::OperatorType::Unary(crate::parser::ast::UnaryOp::Dereference),
-                                operand: Box::new(Expression::BinaryOperation {
-                                    left: Box::new(Expression::Variable("encrypted".to_string())),
-                                    operator: crate::parser::ast::BinaryOp::Add,
-                                    right: Box::new(Expression::Variable("i".to_string())),
-                                }),
-                            }),
-                            operator: crate::parser::ast::BinaryOp::BitwiseXor,
-                            right: Box::new(Expression::Variable("key".to_string())),
-                        }),
-                    }),
-                    // i++;
-                    Statement::ExpressionStatement(Expression::UnaryOperation {
-                        operator: crate::parser::ast::OperatorType::Unary(crate::parser::ast::UnaryOp::PostIncrement),
-                        operand: Box::new(Expression::Variable("i".to_string())),
-                    }),
-                ])),
-            },
-            // buffer[i] = '\0';
-            Statement::ExpressionStatement(Expression::Assignment {
-                target: Box::new(Expression::ArrayAccess {
-                    array: Box::new(Expression::Variable("buffer".to_string())),
-                    index: Box::new(Expression::Variable("i".to_string())),
-                }),
-                value: Box::new(Expression::CharLiteral('\0')),
-            }),
-            // return buffer;
-            Statement::Return(Expression::Variable("buffer".to_string())),
-        ];
+        // char* __rustcc_decrypt_string(unsigned long* text, unsigned long key, int words)
+        // {
+        //     if (atomic_load(text[words]) != DECRYPTED) {
+        //         if (atomic_compare_exchange(text[words], ENCRYPTED, DECRYPTING) == ENCRYPTED) {
+        //             int i = 0;
+        //             while (i < words) {
+        //                 text[i] = text[i] ^ key;
+        //                 i++;
+        //             }
+        //             atomic_store(text[words], DECRYPTED);
+        //         } else {
+        //             while (atomic_load(text[words]) != DECRYPTED) {}
+        //         }
+        //     }
+        //     return text;
+        // }
+        let mut arena = AstArena::with_capacity(48, 16);
+        let arena = &mut arena;
+        let (text, key, words, i) = (
+            Symbol::intern("text"),
+            Symbol::intern("key"),
+            Symbol::intern("words"),
+            Symbol::intern("i"),
+        );
+
+        // text[index], built fresh for each use
+        let element = |arena: &mut AstArena, index: Symbol| {
+            let (array, index) = (var(arena, text), var(arena, index));
+            arena.alloc_expr(Expression::ArrayAccess { array, index })
+        };
+        let atomic = |arena: &mut AstArena, operation: AtomicOp, values: &[i32]| {
+            let mut operands = vec![element(arena, words)];
+            operands.extend(values.iter().map(|&value| int(arena, value)));
+            arena.alloc_expr(Expression::AtomicExpr { operation, operands })
+        };
+        // atomic_load(text[words]) != DECRYPTED
+        let not_decrypted = |arena: &mut AstArena| {
+            let state = atomic(arena, AtomicOp::Load, &[]);
+            let decrypted = int(arena, DECRYPTED);
+            binary(arena, state, BinaryOp::NotEqual, decrypted)
+        };
+
+        let zero = int(arena, 0);
+        let i_decl = arena.alloc_stmt(Statement::VariableDeclaration {
+            name: i,
+            data_type: Some(Type::Int),
+            initializer: zero,
+            is_global: false,
+            alignment: None,
+        });
+
+        // text[i] = text[i] ^ key;
+        let target = element(arena, i);
+        let current = element(arena, i);
+        let key_value = var(arena, key);
+        let value = binary(arena, current, BinaryOp::BitwiseXor, key_value);
+        let store = arena.alloc_expr(Expression::Assignment { target, value });
+        let store = arena.alloc_stmt(Statement::ExpressionStatement(store));
+
+        // i++;
+        let operand = var(arena, i);
+        let increment = arena.alloc_expr(Expression::UnaryOperation {
+            operator: OperatorType::Unary(UnaryOp::PostIncrement),
+            operand,
+        });
+        let increment = arena.alloc_stmt(Statement::ExpressionStatement(increment));
+
+        let (index, count) = (var(arena, i), var(arena, words));
+        let condition = binary(arena, index, BinaryOp::LessThan, count);
+        let body = arena.alloc_stmt(Statement::Block(vec![store, increment]));
+        let decrypt_loop = arena.alloc_stmt(Statement::While { condition, body });
+
+        let publish = atomic(arena, AtomicOp::Store, &[DECRYPTED]);
+        let publish = arena.alloc_stmt(Statement::ExpressionStatement(publish));
+        let decrypt = arena.alloc_stmt(Statement::Block(vec![i_decl, decrypt_loop, publish]));
+
+        // Another thread is decrypting: wait until it's done
+        let condition = not_decrypted(arena);
+        let body = arena.alloc_stmt(Statement::Block(Vec::new()));
+        let wait = arena.alloc_stmt(Statement::While { condition, body });
+        let wait = arena.alloc_stmt(Statement::Block(vec![wait]));
+
+        let claim = atomic(arena, AtomicOp::CompareExchange, &[ENCRYPTED, DECRYPTING]);
+        let encrypted = int(arena, ENCRYPTED);
+        let claimed = binary(arena, claim, BinaryOp::Equal, encrypted);
+        let first_use = arena.alloc_stmt(Statement::If {
+            condition: claimed,
+            then_block: decrypt,
+            else_block: Some(wait),
+        });
+        let first_use = arena.alloc_stmt(Statement::Block(vec![first_use]));
+
+        let condition = not_decrypted(arena);
+        let check = arena.alloc_stmt(Statement::If {
+            condition,
+            then_block: first_use,
+            else_block: None,
+        });
+
+        // return text;
+        let result = var(arena, text);
+        let return_stmt = arena.alloc_stmt(Statement::Return(result));
 
         Function {
-            name: "__rustcc_decrypt_string".to_string(),
+            name: Symbol::intern(DECRYPT),
             return_type: Type::Pointer(Box::new(Type::Char)),
             parameters: vec![
-                crate::parser::ast::FunctionParameter {
-                    name: "encrypted".to_string(),
-                    data_type: Type::Pointer(Box::new(Type::Char)),
+                FunctionParameter {
+                    name: text,
+                    data_type: Type::Pointer(Box::new(Type::UnsignedLong)),
+                },
+                FunctionParameter {
+                    name: key,
+                    data_type: Type::UnsignedLong,
                 },
-                crate::parser::ast::FunctionParameter {
-                    name: "key".to_string(),
-                    data_type: Type::UnsignedChar,
+                FunctionParameter {
+                    name: words,
+                    data_type: Type::Int,
                 },
             ],
-            body: decrypt_body,
+            body: vec![check, return_stmt],
             is_variadic: false,
             is_external: false,
+            arena: std::mem::take(arena),
         }
     }
 
-    // Recursively encrypt all string literals in statements
-    fn encrypt_strings_in_statements(
-        &self, 
-        statements: &mut Vec<Statement>, 
-        rng: &mut impl Rng,
-        encrypted_strings: &mut Vec<(String, u8)>
-    ) {
-        for statement in statements {
-            match statement {
-                Statement::Return(expr) => {
-                    *expr = self.encrypt_strings_in_expression(expr.clone(), rng, encrypted_strings);
-                }
-                Statement::VariableDeclaration { initializer, .. } => {
-                    *initializer = self.encrypt_strings_in_expression(initializer.clone(), rng, encrypted_strings);
-                }
-                Statement::ExpressionStatement(expr) => {
-                    *expr = self.encrypt_strings_in_expression(expr.clone(), rng, encrypted_strings);
-                }
-                Statement::Block(stmts) => {
-                    self.encrypt_strings_in_statements(stmts, rng, encrypted_strings);
-                }
-                Statement::If {
-                    condition,
-                    then_block,
-                    else_block,
-                } => {
-                    *condition = self.encrypt_strings_in_expression(condition.clone(), rng, encrypted_strings);
+    // Find and encrypt every string literal in a function. All of the body's
+    // expressions live in its arena, so each literal is rewritten in place
+    // into a call to the decrypt function without walking the tree.
+    //
+    // The call is __rustcc_decrypt_string(key, words, {text...}) until
+    // `finish` moves the encrypted text into a storage global and passes
+    // that instead.
+    fn encrypt_strings_in_arena(&self, arena: &mut AstArena, rng: &mut impl Rng) {
+        for id in arena.expr_ids() {
+            let Expression::StringLiteral(s) = &arena[id] else {
+                continue;
+            };
 
-                    if let Statement::Block(stmts) = then_block.as_mut() {
-                        self.encrypt_strings_in_statements(stmts, rng, encrypted_strings);
-                    } else {
-                        // Handle non-block then statements
-                        let new_then =
-                            self.encrypt_strings_in_statement(then_block.as_ref().clone(), rng, encrypted_strings);
-                        *then_block = Box::new(new_then);
-                    }
-
-                    if let Some(else_stmt) = else_block {
-                        if let Statement::Block(stmts) = else_stmt.as_mut() {
-                            self.encrypt_strings_in_statements(stmts, rng, encrypted_strings);
-                        } else {
-                            // Handle non-block else statements
-                            let new_else =
-                                self.encrypt_strings_in_statement(else_stmt.as_ref().clone(), rng, encrypted_strings);
-                            *else_block = Some(Box::new(new_else));
-                        }
-                    }
-                }
-                Statement::While { condition, body } => {
-                    *condition = self.encrypt_strings_in_expression(condition.clone(), rng, encrypted_strings);
-
-                    let new_body = self.encrypt_strings_in_statement(body.as_ref().clone(), rng, encrypted_strings);
-                    *body = Box::new(new_body);
-                }
-                Statement::For {
-                    condition,
-                    increment,
-                    body,
-                    ..
-                } => {
-                    if let Some(cond) = condition {
-                        *cond = self.encrypt_strings_in_expression(cond.clone(), rng, encrypted_strings);
-                    }
-
-                    if let Some(inc) = increment {
-                        *inc = self.encrypt_strings_in_expression(inc.clone(), rng, encrypted_strings);
-                    }
-
-                    let new_body = self.encrypt_strings_in_statement(body.as_ref().clone(), rng, encrypted_strings);
-                    *body = Box::new(new_body);
-                }
-                Statement::DoWhile { body, condition } => {
-                    *condition = self.encrypt_strings_in_expression(condition.clone(), rng, encrypted_strings);
-
-                    let new_body = self.encrypt_strings_in_statement(body.as_ref().clone(), rng, encrypted_strings);
-                    *body = Box::new(new_body);
-                }
-                Statement::Switch { expression, cases } => {
-                    *expression = self.encrypt_strings_in_expression(expression.clone(), rng, encrypted_strings);
-
-                    for case in cases {
-                        if let Some(value) = &mut case.value {
-                            *value = self.encrypt_strings_in_expression(value.clone(), rng, encrypted_strings);
-                        }
-
-                        self.encrypt_strings_in_statements(&mut case.statements, rng, encrypted_strings);
-                    }
-                }
-                _ => {} // Other statement types may not contain expressions
+            // Skip empty strings
+            if s.is_empty() {
+                continue;
             }
-        }
-    }
 
-    // Process a single statement
-    fn encrypt_strings_in_statement(
-        &self, 
-        statement: Statement, 
-        rng: &mut impl Rng,
-        encrypted_strings: &mut Vec<(String, u8)>
-    ) -> Statement {
-        match statement {
-            Statement::Block(mut stmts) => {
-                self.encrypt_strings_in_statements(&mut stmts, rng, encrypted_strings);
-                Statement::Block(stmts)
-            }
-            Statement::Return(expr) => {
-                Statement::Return(self.encrypt_strings_in_expression(expr, rng, encrypted_strings))
-            }
-            Statement::VariableDeclaration {
-                name,
-                data_type,
-                initializer,
-                is_global,
-                alignment,
-            } => Statement::VariableDeclaration {
-                name: name.clone(),
-                data_type: data_type.clone(),
-                initializer: self.encrypt_strings_in_expression(initializer, rng, encrypted_strings),
-                is_global,
-                alignment: alignment.clone(),
-            },
-            Statement::ExpressionStatement(expr) => {
-                Statement::ExpressionStatement(self.encrypt_strings_in_expression(expr, rng, encrypted_strings))
-            }
-            // Other statement types would need similar handling
-            _ => statement,
+            // The text and its terminator, zero-padded to whole words and
+            // XORed with the key
+            let mut plain = s.as_bytes().to_vec();
+            plain.resize((plain.len() + 1).next_multiple_of(8), 0);
+            let key = rng.gen::<u64>();
+            let encrypted: Vec<u8> = plain
+                .chunks_exact(8)
+                .flat_map(|word| (u64::from_le_bytes(word.try_into().expect("8-byte word")) ^ key).to_le_bytes())
+                .collect();
+
+            // Replace with a call to the decrypt function
+            let text = encrypted.iter().map(|&byte| int(arena, i32::from(byte))).collect();
+            let arguments = vec![
+                Self::key_expression(arena, key),
+                int(arena, (encrypted.len() / 8) as i32),
+                arena.alloc_expr(Expression::ArrayLiteral(text)),
+            ];
+            arena[id] = Expression::FunctionCall {
+                name: Symbol::intern(DECRYPT),
+                arguments,
+            };
         }
     }
 
-    // Find and encrypt string literals in expressions
-    #[allow(clippy::only_used_in_recursion)]
-    fn encrypt_strings_in_expression(
-        &self, 
-        expr: Expression, 
-        rng: &mut impl Rng,
-        encrypted_strings: &mut Vec<(String, u8)>
-    ) -> Expression {
-        match expr {
-            Expression::StringLiteral(s) => {
-                // Skip empty strings
-                if s.is_empty() {
-                    return Expression::StringLiteral(s);
-                }
-                
-                // Apply XOR encryption on the string
-                let key = rng.gen::<u8>();
-                let encrypted: String = s.chars().map(|c| (c as u8 ^ key) as char).collect();
-                
-                // Store the encrypted string and key for later use
-                encrypted_strings.push((encrypted.clone(), key));
-                
-                // Replace with a call to the decrypt function
-                Expression::FunctionCall {
-                    name: "__rustcc_decrypt_string".to_string(),
-                    arguments: vec![
-                        // Pass the encrypted string literal
-                        Expression::StringLiteral(encrypted),
-                        // Pass the encryption key
-                        Expression::IntegerLiteral(key as i32),
-                    ],
-                }
-            }
-            Expression::BinaryOperation {
-                left,
-                operator,
-                right,
-            } => Expression::BinaryOperation {
-                left: Box::new(self.encrypt_strings_in_expression(*left, rng, encrypted_strings)),
-                operator,
-                right: Box::new(self.encrypt_strings_in_expression(*right, rng, encrypted_strings)),
-            },
-            Expression::UnaryOperation { operator, operand } => Expression::UnaryOperation {
-                operator,
-                operand: Box::new(self.encrypt_strings_in_expression(*operand, rng, encrypted_strings)),
-            },
-            Expression::FunctionCall {
-                name,
-                mut arguments,
-            } => {
-                // Don't encrypt strings in calls to our decrypt function
-                if name != "__rustcc_decrypt_string" {
-                    for arg in &mut arguments {
-                        *arg = self.encrypt_strings_in_expression(arg.clone(), rng, encrypted_strings);
-                    }
-                }
-
-                Expression::FunctionCall { name, arguments }
-            }
-            Expression::Assignment { target, value } => Expression::Assignment {
-                target: Box::new(self.encrypt_strings_in_expression(*target, rng, encrypted_strings)),
-                value: Box::new(self.encrypt_strings_in_expression(*value, rng, encrypted_strings)),
-            },
-            Expression::TernaryIf {
-                condition,
-                then_expr,
-                else_expr,
-            } => Expression::TernaryIf {
-                condition: Box::new(self.encrypt_strings_in_expression(*condition, rng, encrypted_strings)),
-                then_expr: Box::new(self.encrypt_strings_in_expression(*then_expr, rng, encrypted_strings)),
-                else_expr: Box::new(self.encrypt_strings_in_expression(*else_expr, rng, encrypted_strings)),
-            },
-            Expression::Cast { target_type, expr } => Expression::Cast {
-                target_type,
-                expr: Box::new(self.encrypt_strings_in_expression(*expr, rng, encrypted_strings)),
-            },
-            Expression::ArrayAccess { array, index } => Expression::ArrayAccess {
-                array: Box::new(self.encrypt_strings_in_expression(*array, rng, encrypted_strings)),
-                index: Box::new(self.encrypt_strings_in_expression(*index, rng, encrypted_strings)),
-            },
-            Expression::StructFieldAccess { object, field } => Expression::StructFieldAccess {
-                object: Box::new(self.encrypt_strings_in_expression(*object, rng, encrypted_strings)),
-                field,
-            },
-            Expression::PointerFieldAccess { pointer, field } => Expression::PointerFieldAccess {
-                pointer: Box::new(self.encrypt_strings_in_expression(*pointer, rng, encrypted_strings)),
-                field,
-            },
-            // Other expression types may not contain nested expressions
-            _ => expr,
+    // Integer literals are 32 bits, so the key is put together from three
+    // 21- or 22-bit pieces. Multiplying keeps to 64 bits where shifting
+    // might not: ((a * 2^21) | b) * 2^21 | c
+    fn key_expression(arena: &mut AstArena, key: u64) -> ExprId {
+        let piece = |arena: &mut AstArena, shift: u32, bits: u32| int(arena, (key >> shift & ((1 << bits) - 1)) as i32);
+        let mut result = piece(arena, 42, 22);
+        for shift in [21, 0] {
+            let scale = int(arena, 1 << 21);
+            let scaled = binary(arena, result, BinaryOp::Multiply, scale);
+            let next = piece(arena, shift, 21);
+            result = binary(arena, scaled, BinaryOp::BitwiseOr, next);
         }
+        result
     }
 }
@@ -0,0 +1,42 @@
+// workload.rs
+// Tests of the benchmarks' synthetic workloads
+
+#[allow(dead_code)]
+#[path = "../benches/workload.rs"]
+mod workload;
+
+use rustcc::parser::lexer::Lexer;
+use rustcc::parser::Parser;
+use rustcc::preprocessor::{output_string, NativePreprocessor, Preprocessor};
+use workload::Workload;
+
+fn function_count(source: &str, include_dir: Option<&str>) -> usize {
+    let mut preprocessor = NativePreprocessor::new();
+    if let Some(dir) = include_dir {
+        preprocessor.add_include_dir(dir);
+    }
+    let mut out = Vec::new();
+    preprocessor.preprocess_string_into(source, "workload.c", &mut out).unwrap();
+    let source = output_string(out).unwrap();
+    Parser::new(Lexer::new(&source).scan_tokens()).parse().unwrap().functions.len()
+}
+
+#[test]
+fn test_workload_is_deterministic() {
+    let source = Workload::new(20, 4, 5).source();
+    assert_eq!(source, Workload::new(20, 4, 5).source());
+    assert_ne!(source, Workload::new(20, 5, 5).source());
+    assert_ne!(source, Workload::new(20, 4, 6).source());
+}
+
+#[test]
+fn test_workload_parses() {
+    for (functions, depth, macros) in [(1, 0, 0), (10, 3, 4), (25, 6, 10)] {
+        let workload = Workload::new(functions, depth, macros);
+        assert_eq!(function_count(&workload.source(), None), functions + 1);
+
+        let dir = tempfile::tempdir().unwrap();
+        let source = workload.with_headers(dir.path());
+        assert_eq!(function_count(&source, dir.path().to_str()), functions + 1);
+    }
+}